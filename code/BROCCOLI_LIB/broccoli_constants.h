@@ -118,6 +118,40 @@
 
 #define NUMBER_OF_FILTERS_FOR_NONLINEAR_REGISTRATION 6
 
+#define REDUCE_SUM 0
+#define REDUCE_MAX 1
+#define REDUCE_MIN 2
+
+#define REDUCTION_LOCAL_SIZE 256
+#define MAX_REDUCTION_GROUPS 64
+
+#define DEVICE_POOL_SIZE_CLASSES 128
+#define DEVICE_POOL_SMALLEST_BUFFER 256
+#define DEVICE_POOL_DEFAULT_CACHE_LIMIT (512*1024*1024)
+
+#define TEMPLATE_ASSETS_MAGIC "BROCTA01"
+#define TEMPLATE_ASSETS_MAX_BYTES ((size_t)2048*1024*1024)
+
+#define REGISTRATION_RESULTS_MAGIC "BROCRR01"
+
+#define PCA_FULL 0
+#define PCA_RANDOMIZED 1
+
+#define RANDOMIZED_PCA_INITIAL_COMPONENTS 32
+#define RANDOMIZED_PCA_OVERSAMPLING 10
+#define RANDOMIZED_PCA_POWER_ITERATIONS 2
+
+#define ICA_STREAMING_CHUNK_VOXELS 16384
+
+#define ICA_INFOMAX 0
+#define ICA_FASTICA 1
+
+#define FASTICA_LOGCOSH 0
+#define FASTICA_EXP 1
+
+#define FASTICA_MAX_ITERATIONS 200
+#define FASTICA_TOLERANCE 1e-4
+
 #define CL_SUCCESS 0
 #define CL_DEVICE_NOT_FOUND -1
 #define CL_DEVICE_NOT_AVAILABLE -2
@@ -167,3 +201,48 @@
 #define CL_INVALID_MIP_LEVEL -62
 #define CL_INVALID_GLOBAL_WORK_SIZE -63
 
+
+#define SEARCHLIGHT_GRADIENT_DESCENT 0
+#define SEARCHLIGHT_RIDGE 1
+#define SEARCHLIGHT_SHRINKAGE_LDA 2
+#define SEARCHLIGHT_DIAGONAL_LDA 3
+
+#define SEARCHLIGHT_SPHERE_LOCAL_SIZE 64
+#define SEARCHLIGHT_MAX_SPHERE_VOXELS 1024
+#define SEARCHLIGHT_SPHERE_FEATURES_MB 256
+
+#define BAYESIAN_MAX_CHAINS 8
+
+#define PROFILING_KERNEL 0
+#define PROFILING_WRITE 1
+#define PROFILING_READ 2
+#define PROFILING_COPY 3
+#define PROFILING_MAP 4
+
+#define PROFILING_EVENT_BATCH 4096
+
+#define KERNEL_BENCHMARK_SEPARABLE_CONVOLUTION 0
+#define KERNEL_BENCHMARK_NONSEPARABLE_CONVOLUTION 1
+#define KERNEL_BENCHMARK_INTERPOLATION 2
+#define KERNEL_BENCHMARK_GLM_TTEST 3
+#define KERNEL_BENCHMARK_GLM_FTEST 4
+#define KERNEL_BENCHMARK_AR4_ESTIMATION 5
+#define KERNEL_BENCHMARK_AR4_WHITENING 6
+#define KERNEL_BENCHMARK_PERMUTATION 7
+#define KERNEL_BENCHMARK_CLUSTERIZE 8
+#define KERNEL_BENCHMARK_TFCE 9
+#define KERNEL_BENCHMARK_MAX_REDUCTION 10
+#define KERNEL_BENCHMARK_SUM_REDUCTION 11
+#define KERNEL_BENCHMARK_SEARCHLIGHT_RADIUS_2 12
+#define KERNEL_BENCHMARK_SEARCHLIGHT_RADIUS_3 13
+#define KERNEL_BENCHMARK_SEARCHLIGHT_RADIUS_4 14
+#define KERNEL_BENCHMARK_SEARCHLIGHT_RADIUS_5 15
+#define KERNEL_BENCHMARK_SEARCHLIGHT_RADIUS_6 16
+#define NUMBER_OF_KERNEL_BENCHMARKS 17
+
+#define KERNEL_BENCHMARK_REGRESSORS 8
+#define KERNEL_BENCHMARK_CONTRASTS 4
+#define KERNEL_BENCHMARK_TFCE_THRESHOLDS 10
+#define KERNEL_BENCHMARK_SEARCHLIGHT_VOLUMES 40
+#define KERNEL_BENCHMARK_SEARCHLIGHT_FOLDS 10
+#define KERNEL_BENCHMARK_SEARCHLIGHT_SPHERES 4096
@@ -41,6 +41,7 @@
 
 #include <time.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 
 #include <limits.h>
 //#include <unistd.h>
@@ -80,6 +81,14 @@ float mymax(float a, float b)
 		return b;
 }
 
+float mymin(float a, float b)
+{
+	if (a < b)
+		return a;
+	else
+		return b;
+}
+
 double GetTime()
 {
     struct timeval time;
@@ -96,6 +105,15 @@ float myround(float a)
 	return floor(a + 0.5f);
 }
 
+// Xorshift random number generator with its own state, does not change the state of rand()
+cl_uint XorshiftRandom(cl_uint& state)
+{
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
 void debugVolumeInfo(const char* name, int W, int H, int D, int T, float* volume)
 {
 	#ifndef NDEBUG
@@ -125,182 +143,834 @@ void debugVolumeInfo(const char* name, int W, int H, int D, float* volume)
     debugVolumeInfo(name, W, H, D, 1, volume);
 }
 
-// Constructors
+// Profiling
 
-BROCCOLI_LIB::BROCCOLI_LIB()
-{	
-	OPENCL_INITIATED = false;
-	SetStartValues();
-}
+// All kernel launches and transfers in this file go through the functions below, which forward to OpenCL
+// and, if profiling is enabled, keep an event for each command. The sizes of all buffers are kept such that
+// the bytes of a kernel launch can be estimated as the total size of its buffer arguments.
 
-BROCCOLI_LIB::BROCCOLI_LIB(cl_uint platform, cl_uint device)
+cl_int BROCCOLI_LIB::ProfiledEnqueueNDRangeKernel(cl_command_queue queue, cl_kernel kernel, cl_uint dimensions, const size_t* globalOffset, const size_t* globalSize, const size_t* localSize, cl_uint numberOfEvents, const cl_event* waitList, cl_event* event)
 {
-	SetStartValues();
-	OPENCL_INITIATED = false;
-	SUCCESSFUL_INITIALIZATION = OpenCLInitiate(platform,device);
+	if (!PROFILING)
+	{
+		return clEnqueueNDRangeKernel(queue, kernel, dimensions, globalOffset, globalSize, localSize, numberOfEvents, waitList, event);
+	}
+
+	cl_event profilingEvent;
+	cl_int error = clEnqueueNDRangeKernel(queue, kernel, dimensions, globalOffset, globalSize, localSize, numberOfEvents, waitList, &profilingEvent);
+	AddProfilingEvent(error, profilingEvent, event, GetProfilingKernelNameIndex(kernel), PROFILING_KERNEL, GetProfilingKernelBytes(kernel));
+	return error;
 }
 
-BROCCOLI_LIB::BROCCOLI_LIB(cl_uint platform, cl_uint device, const char* location)
+cl_int BROCCOLI_LIB::ProfiledEnqueueReadBuffer(cl_command_queue queue, cl_mem buffer, cl_bool blocking, size_t offset, size_t size, void* hostPointer, cl_uint numberOfEvents, const cl_event* waitList, cl_event* event)
 {
-	SetStartValues();
-	OPENCL_INITIATED = false;
-	BROCCOLI_LOCATION = location;
-	SUCCESSFUL_INITIALIZATION = OpenCLInitiate(platform,device);
+	if (!PROFILING)
+	{
+		return clEnqueueReadBuffer(queue, buffer, blocking, offset, size, hostPointer, numberOfEvents, waitList, event);
+	}
+
+	cl_event profilingEvent;
+	cl_int error = clEnqueueReadBuffer(queue, buffer, blocking, offset, size, hostPointer, numberOfEvents, waitList, &profilingEvent);
+	AddProfilingEvent(error, profilingEvent, event, GetProfilingNameIndex("Read buffer (device to host)"), PROFILING_READ, size);
+	return error;
 }
 
-BROCCOLI_LIB::BROCCOLI_LIB(cl_uint platform, cl_uint device, int wrapper, bool verbos)
+cl_int BROCCOLI_LIB::ProfiledEnqueueWriteBuffer(cl_command_queue queue, cl_mem buffer, cl_bool blocking, size_t offset, size_t size, const void* hostPointer, cl_uint numberOfEvents, const cl_event* waitList, cl_event* event)
 {
-	SetStartValues();
-	WRAPPER = wrapper;
-	VERBOS = verbos;
-	OPENCL_INITIATED = false;
-	SUCCESSFUL_INITIALIZATION = OpenCLInitiate(platform,device);
+	if (!PROFILING)
+	{
+		return clEnqueueWriteBuffer(queue, buffer, blocking, offset, size, hostPointer, numberOfEvents, waitList, event);
+	}
+
+	cl_event profilingEvent;
+	cl_int error = clEnqueueWriteBuffer(queue, buffer, blocking, offset, size, hostPointer, numberOfEvents, waitList, &profilingEvent);
+	AddProfilingEvent(error, profilingEvent, event, GetProfilingNameIndex("Write buffer (host to device)"), PROFILING_WRITE, size);
+	return error;
 }
 
-// Destructor
-BROCCOLI_LIB::~BROCCOLI_LIB()
+cl_int BROCCOLI_LIB::ProfiledEnqueueCopyBuffer(cl_command_queue queue, cl_mem source, cl_mem destination, size_t sourceOffset, size_t destinationOffset, size_t size, cl_uint numberOfEvents, const cl_event* waitList, cl_event* event)
 {
-	OpenCLCleanup();
+	if (!PROFILING)
+	{
+		return clEnqueueCopyBuffer(queue, source, destination, sourceOffset, destinationOffset, size, numberOfEvents, waitList, event);
+	}
+
+	// A copy reads and writes all bytes
+	cl_event profilingEvent;
+	cl_int error = clEnqueueCopyBuffer(queue, source, destination, sourceOffset, destinationOffset, size, numberOfEvents, waitList, &profilingEvent);
+	AddProfilingEvent(error, profilingEvent, event, GetProfilingNameIndex("Copy buffer (device to device)"), PROFILING_COPY, 2 * size);
+	return error;
 }
 
-void BROCCOLI_LIB::SetDebug(bool debug)
+cl_int BROCCOLI_LIB::ProfiledEnqueueCopyBufferToImage(cl_command_queue queue, cl_mem source, cl_mem destination, size_t sourceOffset, const size_t* origin, const size_t* region, cl_uint numberOfEvents, const cl_event* waitList, cl_event* event)
 {
-	DEBUG = debug;
+	if (!PROFILING)
+	{
+		return clEnqueueCopyBufferToImage(queue, source, destination, sourceOffset, origin, region, numberOfEvents, waitList, event);
+	}
+
+	// Only used for float images
+	cl_event profilingEvent;
+	cl_int error = clEnqueueCopyBufferToImage(queue, source, destination, sourceOffset, origin, region, numberOfEvents, waitList, &profilingEvent);
+	AddProfilingEvent(error, profilingEvent, event, GetProfilingNameIndex("Copy buffer to image"), PROFILING_COPY, 2 * region[0] * region[1] * region[2] * sizeof(float));
+	return error;
 }
 
-void BROCCOLI_LIB::SetPrint(bool print)
+void* BROCCOLI_LIB::ProfiledEnqueueMapBuffer(cl_command_queue queue, cl_mem buffer, cl_bool blocking, cl_map_flags flags, size_t offset, size_t size, cl_uint numberOfEvents, const cl_event* waitList, cl_event* event, cl_int* error)
 {
-	PRINT = print;
+	if (!PROFILING)
+	{
+		return clEnqueueMapBuffer(queue, buffer, blocking, flags, offset, size, numberOfEvents, waitList, event, error);
+	}
+
+	cl_event profilingEvent;
+	cl_int mapError;
+	void* pointer = clEnqueueMapBuffer(queue, buffer, blocking, flags, offset, size, numberOfEvents, waitList, &profilingEvent, &mapError);
+	AddProfilingEvent(mapError, profilingEvent, event, GetProfilingNameIndex("Map buffer"), PROFILING_MAP, size);
+	if (error != NULL)
+	{
+		*error = mapError;
+	}
+	return pointer;
 }
 
-void BROCCOLI_LIB::SetVerbose(bool verbos)
+// Remembers which arguments of each kernel are buffers, and their sizes
+cl_int BROCCOLI_LIB::ProfiledSetKernelArg(cl_kernel kernel, cl_uint index, size_t size, const void* value)
 {
-	VERBOS = verbos;
+	if (PROFILING)
+	{
+		std::map<cl_mem, size_t>::iterator buffer = profilingBufferSizes.end();
+		if ( (size == sizeof(cl_mem)) && (value != NULL) )
+		{
+			buffer = profilingBufferSizes.find(*(const cl_mem*)value);
+		}
+
+		if (buffer != profilingBufferSizes.end())
+		{
+			profilingKernelArgumentBytes[kernel][index] = buffer->second;
+		}
+		else
+		{
+			profilingKernelArgumentBytes[kernel].erase(index);
+		}
+	}
+
+	return clSetKernelArg(kernel, index, size, value);
 }
 
-void BROCCOLI_LIB::SetAllocatedHostMemory(unsigned long int allocated)
+cl_mem BROCCOLI_LIB::ProfiledCreateBuffer(cl_context context, cl_mem_flags flags, size_t size, void* hostPointer, cl_int* error)
 {
-	allocatedHostMemory = allocated;
+	cl_mem buffer = clCreateBuffer(context, flags, size, hostPointer, error);
+	if ( (buffer != NULL) && (profilingBufferSizes.count(buffer) == 0) )
+	{
+		profilingBufferSizes[buffer] = size;
+		deviceBufferBytes += size;
+		deviceBufferBytesHighWater = std::max(deviceBufferBytesHighWater, deviceBufferBytes);
+		stageDeviceBufferBytesHighWater = std::max(stageDeviceBufferBytesHighWater, deviceBufferBytes);
+	}
+	return buffer;
 }
 
-void BROCCOLI_LIB::SetDoAllPermutations(bool doall)
+cl_int BROCCOLI_LIB::ProfiledReleaseMemObject(cl_mem memory)
 {
-	DO_ALL_PERMUTATIONS = doall;
+	std::map<cl_mem, size_t>::iterator it = profilingBufferSizes.find(memory);
+	if (it != profilingBufferSizes.end())
+	{
+		deviceBufferBytes -= it->second;
+		profilingBufferSizes.erase(it);
+	}
+	return clReleaseMemObject(memory);
 }
 
-void BROCCOLI_LIB::SetRawRegressors(bool raw)
+void BROCCOLI_LIB::AddProfilingEvent(cl_int error, cl_event profilingEvent, cl_event* event, int name, int type, size_t bytes)
 {
-	RAW_REGRESSORS = raw;
+	if (error != SUCCESS)
+	{
+		return;
+	}
+
+	// The caller gets its own reference to the event
+	if (event != NULL)
+	{
+		clRetainEvent(profilingEvent);
+		*event = profilingEvent;
+	}
+
+	ProfilingRecord record;
+	record.name = name;
+	record.type = type;
+	record.bytes = bytes;
+	record.start = 0;
+	record.end = 0;
+
+	profilingPendingEvents.push_back(profilingEvent);
+	profilingPendingRecords.push_back(record);
+
+	// Waits for the batch, the queue is in order so the device is only idle until the next launch
+	if (profilingPendingEvents.size() >= PROFILING_EVENT_BATCH)
+	{
+		CollectProfilingEvents();
+	}
 }
 
-void BROCCOLI_LIB::SetRawDesignMatrix(bool raw)
+int BROCCOLI_LIB::GetProfilingNameIndex(const std::string& name)
 {
-	RAW_DESIGNMATRIX = raw;
+	std::map<std::string, int>::iterator it = profilingNameIndices.find(name);
+	if (it != profilingNameIndices.end())
+	{
+		return it->second;
+	}
+
+	int index = (int)profilingNames.size();
+	profilingNames.push_back(name);
+	profilingNameIndices[name] = index;
+	return index;
 }
 
-void BROCCOLI_LIB::SetCustomReferenceSlice(int slice)
+// Uses the same names as GetOpenCLKernelName, kernels outside OpenCLKernels (e.g. from clBLAS) use their function name
+int BROCCOLI_LIB::GetProfilingKernelNameIndex(cl_kernel kernel)
 {
-	SLICE_CUSTOM_REF = slice;
+	std::map<cl_kernel, int>::iterator it = profilingKernelNames.find(kernel);
+	if (it != profilingKernelNames.end())
+	{
+		return it->second;
+	}
+
+	std::string name = "Unknown kernel";
+	bool found = false;
+	for (int k = 0; k < NUMBER_OF_OPENCL_KERNELS; k++)
+	{
+		if (OpenCLKernels[k] == kernel)
+		{
+			name = GetOpenCLKernelName(k);
+			found = true;
+			break;
+		}
+	}
+
+	size_t nameSize = 0;
+	if (!found && (clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, 0, NULL, &nameSize) == SUCCESS) && (nameSize > 1))
+	{
+		std::vector<char> functionName(nameSize);
+		if (clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, nameSize, &functionName[0], NULL) == SUCCESS)
+		{
+			name = std::string(&functionName[0]);
+		}
+	}
+
+	int index = GetProfilingNameIndex(name);
+	profilingKernelNames[kernel] = index;
+	return index;
 }
 
-void BROCCOLI_LIB::SetDoSkullstrip(bool doskullstrip)
+// Total size of the buffer arguments, an upper bound of the memory traffic of kernels that only use part of a buffer
+size_t BROCCOLI_LIB::GetProfilingKernelBytes(cl_kernel kernel)
 {
-	DO_SKULLSTRIP = doskullstrip;
+	size_t bytes = 0;
+	std::map<cl_kernel, std::map<cl_uint, size_t> >::iterator arguments = profilingKernelArgumentBytes.find(kernel);
+	if (arguments != profilingKernelArgumentBytes.end())
+	{
+		for (std::map<cl_uint, size_t>::iterator it = arguments->second.begin(); it != arguments->second.end(); it++)
+		{
+			bytes += it->second;
+		}
+	}
+	return bytes;
 }
 
-void BROCCOLI_LIB::SetDoSkullstripOriginal(bool doskullstriporiginal)
+// Waits for all pending commands and reads their start and end times
+void BROCCOLI_LIB::CollectProfilingEvents()
 {
-	DO_SKULLSTRIP_ORIGINAL = doskullstriporiginal;
+	if (profilingPendingEvents.size() == 0)
+	{
+		return;
+	}
+
+	clWaitForEvents((cl_uint)profilingPendingEvents.size(), &profilingPendingEvents[0]);
+
+	for (size_t i = 0; i < profilingPendingEvents.size(); i++)
+	{
+		ProfilingRecord record = profilingPendingRecords[i];
+		cl_int startError = clGetEventProfilingInfo(profilingPendingEvents[i], CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &record.start, NULL);
+		cl_int endError = clGetEventProfilingInfo(profilingPendingEvents[i], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &record.end, NULL);
+		if ( (startError == SUCCESS) && (endError == SUCCESS) && (record.end >= record.start) )
+		{
+			profilingRecords.push_back(record);
+		}
+		clReleaseEvent(profilingPendingEvents[i]);
+	}
+
+	profilingPendingEvents.clear();
+	profilingPendingRecords.clear();
 }
 
-void BROCCOLI_LIB::SetCustomSliceTimes(float* times)
+// Removes all commands and pending events, e.g. for each subject of a batch, so that the summary and the trace only contain new commands
+void BROCCOLI_LIB::ResetProfiling()
 {
-	h_Custom_Slice_Times = times;
+	if (profilingPendingEvents.size() > 0)
+	{
+		clWaitForEvents((cl_uint)profilingPendingEvents.size(), &profilingPendingEvents[0]);
+		for (size_t i = 0; i < profilingPendingEvents.size(); i++)
+		{
+			clReleaseEvent(profilingPendingEvents[i]);
+		}
+	}
+
+	profilingPendingEvents.clear();
+	profilingPendingRecords.clear();
+	profilingRecords.clear();
+	pipelineStageFirstRecord = 0;
 }
 
-void BROCCOLI_LIB::SetWrapper(int wrapper)
+// The command queue is created again if profiling is turned on or off after the initialization, since timings
+// are only available with CL_QUEUE_PROFILING_ENABLE
+void BROCCOLI_LIB::SetProfiling(bool profiling)
 {
-	WRAPPER = wrapper;
+	if (profiling == PROFILING)
+	{
+		return;
+	}
+
+	CollectProfilingEvents();
+	PROFILING = profiling;
+
+	if (commandQueue != NULL)
+	{
+		cl_int error;
+		cl_command_queue queue = clCreateCommandQueue(context, device, PROFILING ? CL_QUEUE_PROFILING_ENABLE : 0, &error);
+		if (error == SUCCESS)
+		{
+			clFinish(commandQueue);
+			clReleaseCommandQueue(commandQueue);
+			commandQueue = queue;
+		}
+		else if ( (WRAPPER == BASH) && VERBOS )
+		{
+			printf("Could not create a new command queue for profiling, error is %s \n",GetOpenCLErrorMessage(error));
+		}
+	}
 }
 
-void BROCCOLI_LIB::SetApplySliceTimingCorrection(bool value)
+// Prints count, total time, mean time and bytes for each kernel and transfer type, sorted by total time
+void BROCCOLI_LIB::PrintProfilingSummary()
 {
-	APPLY_SLICE_TIMING_CORRECTION = value;
+	CollectProfilingEvents();
+
+	size_t N = profilingNames.size();
+	std::vector<size_t> counts(N,0);
+	std::vector<double> times(N,0.0);
+	std::vector<double> bytes(N,0.0);
+	double totalTime = 0.0;
+
+	for (size_t i = 0; i < profilingRecords.size(); i++)
+	{
+		const ProfilingRecord& record = profilingRecords[i];
+		double time = (double)(record.end - record.start) * 1.0e-9;
+		counts[record.name]++;
+		times[record.name] += time;
+		bytes[record.name] += (double)record.bytes;
+		totalTime += time;
+	}
+
+	std::vector<std::pair<double, int> > order;
+	for (size_t n = 0; n < N; n++)
+	{
+		if (counts[n] > 0)
+		{
+			order.push_back(std::make_pair(-times[n],(int)n));
+		}
+	}
+	std::sort(order.begin(), order.end());
+
+	printf("\nProfiling summary, %zu commands, %f seconds of device time\n\n",profilingRecords.size(),totalTime);
+	printf("%-56s %10s %12s %12s %7s %12s %10s\n","Name","Count","Total (ms)","Mean (ms)","Time %","MB","GB/s");
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		int n = order[i].second;
+		double bandwidth = (times[n] > 0.0) ? bytes[n] / times[n] * 1.0e-9 : 0.0;
+		printf("%-56s %10zu %12.3f %12.4f %7.2f %12.1f %10.2f\n",profilingNames[n].c_str(),counts[n],times[n] * 1000.0,times[n] * 1000.0 / (double)counts[n],(totalTime > 0.0) ? 100.0 * times[n] / totalTime : 0.0,bytes[n] / (1024.0 * 1024.0),bandwidth);
+	}
+	printf("\nMB for kernels is the total size of their buffer arguments over all launches, an upper bound of the memory traffic\n\n");
 }
 
-void BROCCOLI_LIB::SetApplyMotionCorrection(bool value)
+// Writes all commands in the Chrome trace event format (chrome://tracing, Perfetto), kernels and transfers as two threads
+bool BROCCOLI_LIB::WriteProfilingTrace(const char* filename)
 {
-	APPLY_MOTION_CORRECTION = value;
+	CollectProfilingEvents();
+
+	FILE* file = fopen(filename, "w");
+	if (file == NULL)
+	{
+		return false;
+	}
+
+	cl_ulong firstStart = 0;
+	for (size_t i = 0; i < profilingRecords.size(); i++)
+	{
+		if ( (i == 0) || (profilingRecords[i].start < firstStart) )
+		{
+			firstStart = profilingRecords[i].start;
+		}
+	}
+
+	fprintf(file, "{\"traceEvents\":[\n");
+	fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":1,\"args\":{\"name\":\"Kernels\"}},\n");
+	fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":2,\"args\":{\"name\":\"Transfers\"}}");
+	for (size_t i = 0; i < profilingRecords.size(); i++)
+	{
+		const ProfilingRecord& record = profilingRecords[i];
+		bool kernel = (record.type == PROFILING_KERNEL);
+		fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%i,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"bytes\":%zu}}",profilingNames[record.name].c_str(),kernel ? "kernel" : "transfer",kernel ? 1 : 2,(double)(record.start - firstStart) * 1.0e-3,(double)(record.end - record.start) * 1.0e-3,record.bytes);
+	}
+	fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+	return (fclose(file) == 0);
 }
 
-void BROCCOLI_LIB::SetApplySmoothing(bool value)
+// Pipeline stages
+
+// The processing of a wrapper is divided into stages, a stage lasts until the next one begins or EndPipelineStage is
+// called. The device is synchronized at each stage boundary, such that the wall time includes all commands of the stage.
+
+// Starts a new timeline, e.g. for each subject of a batch, the peak resident memory can not be reset and is for the whole process
+void BROCCOLI_LIB::SetPipelineTimeline(bool timeline)
 {
-	APPLY_SMOOTHING = value;
+	PIPELINE_TIMELINE = timeline;
+	pipelineStages.clear();
+	ResetProfiling();
+	pipelineStageActive = false;
+	deviceBufferBytesHighWater = deviceBufferBytes;
+	allocatedHostMemoryHighWater = allocatedHostMemory;
 }
 
-//void BROCCOLI_LIB::SetSaveDisplacementField(bool save)
-//{
-//	DEBUG = debug;
-//}
+// Largest resident set of the process so far (ru_maxrss is in kilobytes on Linux and in bytes on OS X)
+size_t BROCCOLI_LIB::GetPeakResidentMemory()
+{
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+	{
+		return 0;
+	}
+	#ifdef __APPLE__
+	return (size_t)usage.ru_maxrss;
+	#else
+	return (size_t)usage.ru_maxrss * 1024;
+	#endif
+}
 
-// Set some default values
-void BROCCOLI_LIB::SetStartValues()
+// The device buffers are counted when they are created, the host memory only when it is checked
+void BROCCOLI_LIB::UpdateMemoryHighWater()
 {
-	INITIALIZATION_ERROR = "";
-	OPENCL_ERROR = "";
+	allocatedHostMemoryHighWater = std::max(allocatedHostMemoryHighWater, allocatedHostMemory);
+	stageAllocatedHostMemoryHighWater = std::max(stageAllocatedHostMemoryHighWater, allocatedHostMemory);
+}
 
-	BROCCOLI_LOCATION = NULL;
+void BROCCOLI_LIB::BeginPipelineStage(const char* name, size_t dataBytes)
+{
+	if (!PIPELINE_TIMELINE)
+	{
+		return;
+	}
 
-	localMemorySize = 0;
-	maxThreadsPerBlock = 0;
-	maxThreadsPerDimension[0] = 0;
-	maxThreadsPerDimension[1] = 0;
-	maxThreadsPerDimension[2] = 0;
+	EndPipelineStage();
+	clFinish(commandQueue);
+	CollectProfilingEvents();
 
-	PRECENTER_REGISTRATION = false;
+	PipelineStage stage;
+	stage.name = name;
+	stage.wallTime = 0.0;
+	stage.deviceTime = -1.0;
+	stage.dataBytes = dataBytes;
+	stage.deviceMemoryHighWater = 0;
+	stage.hostMemoryHighWater = 0;
+	stage.peakResidentMemory = 0;
+	pipelineStages.push_back(stage);
 
-	DEBUG = false;
-	WRAPPER = -1;
-	PRINT = true;
-	VERBOS = false;
-	DO_ALL_PERMUTATIONS = false;
+	pipelineStageActive = true;
+	pipelineStageFirstRecord = profilingRecords.size();
+	stageDeviceBufferBytesHighWater = deviceBufferBytes;
+	stageAllocatedHostMemoryHighWater = allocatedHostMemory;
+	UpdateMemoryHighWater();
 
-	APPLY_SLICE_TIMING_CORRECTION = true;
-	APPLY_MOTION_CORRECTION = true;
-	APPLY_SMOOTHING = true;
+	pipelineStageStart = GetTime();
+}
 
-	WRITE_INTERPOLATED_T1 = false;
-	WRITE_ALIGNED_T1_MNI_LINEAR = false;
-	WRITE_ALIGNED_T1_MNI_NONLINEAR = false;
-	DO_SKULLSTRIP = false;
+void BROCCOLI_LIB::EndPipelineStage()
+{
+	if (!pipelineStageActive)
+	{
+		return;
+	}
 
-	WRITE_ALIGNED_EPI_T1 = false;
-	WRITE_ALIGNED_EPI_MNI = false;
+	clFinish(commandQueue);
+	PipelineStage& stage = pipelineStages.back();
+	stage.wallTime = GetTime() - pipelineStageStart;
 
-	WRITE_EPI_MASK = false;
-	WRITE_MNI_MASK = false;
-	WRITE_SLICETIMING_CORRECTED = false;
-	WRITE_MOTION_CORRECTED = false;
-	WRITE_SMOOTHED = false;
+	// Device time of all kernels and transfers of the stage
+	if (PROFILING)
+	{
+		CollectProfilingEvents();
+		stage.deviceTime = 0.0;
+		for (size_t i = pipelineStageFirstRecord; i < profilingRecords.size(); i++)
+		{
+			double time = (double)(profilingRecords[i].end - profilingRecords[i].start) * 1.0e-9;
+			stage.deviceTime += time;
+			stage.deviceTimes[profilingRecords[i].name] += time;
+		}
+	}
 
-	WRITE_ACTIVITY_EPI = false;
-	WRITE_DESIGNMATRIX = false;
-	WRITE_AR_ESTIMATES_EPI = false;
-	WRITE_AR_ESTIMATES_MNI = false;
+	UpdateMemoryHighWater();
+	stage.deviceMemoryHighWater = stageDeviceBufferBytesHighWater;
+	stage.hostMemoryHighWater = stageAllocatedHostMemoryHighWater;
+	stage.peakResidentMemory = GetPeakResidentMemory();
 
-	WRITE_UNWHITENED_RESULTS = false;
+	pipelineStageActive = false;
+}
 
-	EPI_Smoothing_FWHM = 8.0f;
-	AR_Smoothing_FWHM = 8.0f;
-	AUTO_MASK = false;
+// Adds a stage that was timed outside the library, e.g. reading or writing files in a wrapper
+void BROCCOLI_LIB::AddPipelineStage(const char* name, double wallTime, size_t dataBytes)
+{
+	if (!PIPELINE_TIMELINE)
+	{
+		return;
+	}
 
-	programBinarySize = 0;
-	writtenElements = 0;
+	EndPipelineStage();
+	UpdateMemoryHighWater();
 
-	BETA_SPACE = EPI;
+	PipelineStage stage;
+	stage.name = name;
+	stage.wallTime = wallTime;
+	stage.deviceTime = -1.0;
+	stage.dataBytes = dataBytes;
+	stage.deviceMemoryHighWater = deviceBufferBytes;
+	stage.hostMemoryHighWater = allocatedHostMemory;
+	stage.peakResidentMemory = GetPeakResidentMemory();
+	pipelineStages.push_back(stage);
+}
 
-	SLICE_ORDER = UNDEFINED;
-	SLICE_CUSTOM_REF = 0;
+// Writes the stages as JSON, device times are null if profiling is off
+bool BROCCOLI_LIB::WritePipelineTimeline(const char* filename)
+{
+	EndPipelineStage();
+	UpdateMemoryHighWater();
+
+	FILE* file = fopen(filename, "w");
+	if (file == NULL)
+	{
+		return false;
+	}
+
+	double totalWallTime = 0.0;
+	double totalDeviceTime = 0.0;
+	for (size_t i = 0; i < pipelineStages.size(); i++)
+	{
+		totalWallTime += pipelineStages[i].wallTime;
+		totalDeviceTime += std::max(pipelineStages[i].deviceTime, 0.0);
+	}
+
+	std::string device;
+	for (size_t i = 0; i < deviceName.size(); i++)
+	{
+		if ( (deviceName[i] == '"') || (deviceName[i] == '\\') )
+		{
+			device += '\\';
+		}
+		if ((unsigned char)deviceName[i] >= 32)
+		{
+			device += deviceName[i];
+		}
+	}
+
+	fprintf(file, "{\n");
+	fprintf(file, "\"device\": \"%s\",\n", device.c_str());
+	fprintf(file, "\"profiling\": %s,\n", PROFILING ? "true" : "false");
+	fprintf(file, "\"wall_seconds\": %.6f,\n", totalWallTime);
+	if (PROFILING)
+	{
+		fprintf(file, "\"device_seconds\": %.6f,\n", totalDeviceTime);
+	}
+	else
+	{
+		fprintf(file, "\"device_seconds\": null,\n");
+	}
+	fprintf(file, "\"device_buffer_high_water_bytes\": %zu,\n", deviceBufferBytesHighWater);
+	fprintf(file, "\"host_memory_high_water_bytes\": %zu,\n", allocatedHostMemoryHighWater);
+	fprintf(file, "\"peak_resident_bytes\": %zu,\n", GetPeakResidentMemory());
+	fprintf(file, "\"stages\": [");
+	for (size_t i = 0; i < pipelineStages.size(); i++)
+	{
+		const PipelineStage& stage = pipelineStages[i];
+		fprintf(file, "%s\n{\"name\": \"%s\", \"wall_seconds\": %.6f, ", (i == 0) ? "" : ",", stage.name.c_str(), stage.wallTime);
+		if (stage.deviceTime >= 0.0)
+		{
+			fprintf(file, "\"device_seconds\": %.6f, ", stage.deviceTime);
+		}
+		else
+		{
+			fprintf(file, "\"device_seconds\": null, ");
+		}
+		fprintf(file, "\"data_bytes\": %zu, \"device_buffer_high_water_bytes\": %zu, \"host_memory_high_water_bytes\": %zu, \"peak_resident_bytes\": %zu, \"device_times\": {", stage.dataBytes, stage.deviceMemoryHighWater, stage.hostMemoryHighWater, stage.peakResidentMemory);
+		for (std::map<int, double>::const_iterator it = stage.deviceTimes.begin(); it != stage.deviceTimes.end(); it++)
+		{
+			fprintf(file, "%s\"%s\": %.6f", (it == stage.deviceTimes.begin()) ? "" : ", ", profilingNames[it->first].c_str(), it->second);
+		}
+		fprintf(file, "}}");
+	}
+	fprintf(file, "\n]\n}\n");
+
+	return (fclose(file) == 0);
+}
+
+// Redirect all OpenCL calls below to the profiling functions
+#define clEnqueueNDRangeKernel ProfiledEnqueueNDRangeKernel
+#define clEnqueueReadBuffer ProfiledEnqueueReadBuffer
+#define clEnqueueWriteBuffer ProfiledEnqueueWriteBuffer
+#define clEnqueueCopyBuffer ProfiledEnqueueCopyBuffer
+#define clEnqueueCopyBufferToImage ProfiledEnqueueCopyBufferToImage
+#define clEnqueueMapBuffer ProfiledEnqueueMapBuffer
+#define clSetKernelArg ProfiledSetKernelArg
+#define clCreateBuffer ProfiledCreateBuffer
+#define clReleaseMemObject ProfiledReleaseMemObject
+
+// Constructors
+
+BROCCOLI_LIB::BROCCOLI_LIB()
+{	
+	OPENCL_INITIATED = false;
+	SetStartValues();
+}
+
+BROCCOLI_LIB::BROCCOLI_LIB(cl_uint platform, cl_uint device)
+{
+	SetStartValues();
+	OPENCL_INITIATED = false;
+	SUCCESSFUL_INITIALIZATION = OpenCLInitiate(platform,device);
+}
+
+BROCCOLI_LIB::BROCCOLI_LIB(cl_uint platform, cl_uint device, const char* location)
+{
+	SetStartValues();
+	OPENCL_INITIATED = false;
+	BROCCOLI_LOCATION = location;
+	SUCCESSFUL_INITIALIZATION = OpenCLInitiate(platform,device);
+}
+
+BROCCOLI_LIB::BROCCOLI_LIB(cl_uint platform, cl_uint device, int wrapper, bool verbos)
+{
+	SetStartValues();
+	WRAPPER = wrapper;
+	VERBOS = verbos;
+	OPENCL_INITIATED = false;
+	SUCCESSFUL_INITIALIZATION = OpenCLInitiate(platform,device);
+}
+
+// Destructor
+BROCCOLI_LIB::~BROCCOLI_LIB()
+{
+	OpenCLCleanup();
+}
+
+void BROCCOLI_LIB::SetDebug(bool debug)
+{
+	DEBUG = debug;
+}
+
+void BROCCOLI_LIB::SetPrint(bool print)
+{
+	PRINT = print;
+}
+
+void BROCCOLI_LIB::SetVerbose(bool verbos)
+{
+	VERBOS = verbos;
+}
+
+void BROCCOLI_LIB::SetAllocatedHostMemory(unsigned long int allocated)
+{
+	allocatedHostMemory = allocated;
+}
+
+void BROCCOLI_LIB::SetDoAllPermutations(bool doall)
+{
+	DO_ALL_PERMUTATIONS = doall;
+}
+
+void BROCCOLI_LIB::SetRawRegressors(bool raw)
+{
+	RAW_REGRESSORS = raw;
+}
+
+void BROCCOLI_LIB::SetRawDesignMatrix(bool raw)
+{
+	RAW_DESIGNMATRIX = raw;
+}
+
+void BROCCOLI_LIB::SetCustomReferenceSlice(int slice)
+{
+	SLICE_CUSTOM_REF = slice;
+}
+
+void BROCCOLI_LIB::SetDoSkullstrip(bool doskullstrip)
+{
+	DO_SKULLSTRIP = doskullstrip;
+}
+
+void BROCCOLI_LIB::SetDoSkullstripOriginal(bool doskullstriporiginal)
+{
+	DO_SKULLSTRIP_ORIGINAL = doskullstriporiginal;
+}
+
+void BROCCOLI_LIB::SetCustomSliceTimes(float* times)
+{
+	h_Custom_Slice_Times = times;
+}
+
+void BROCCOLI_LIB::SetWrapper(int wrapper)
+{
+	WRAPPER = wrapper;
+}
+
+void BROCCOLI_LIB::SetApplySliceTimingCorrection(bool value)
+{
+	APPLY_SLICE_TIMING_CORRECTION = value;
+}
+
+// Applies slice timing correction and motion correction in one interpolation, the motion is then estimated without slice timing correction
+void BROCCOLI_LIB::SetFuseSliceTimingAndMotionCorrection(bool value)
+{
+	FUSE_SLICE_TIMING_AND_MOTION_CORRECTION = value;
+}
+
+void BROCCOLI_LIB::SetApplyMotionCorrection(bool value)
+{
+	APPLY_MOTION_CORRECTION = value;
+}
+
+void BROCCOLI_LIB::SetApplySmoothing(bool value)
+{
+	APPLY_SMOOTHING = value;
+}
+
+//void BROCCOLI_LIB::SetSaveDisplacementField(bool save)
+//{
+//	DEBUG = debug;
+//}
+
+// Set some default values
+void BROCCOLI_LIB::SetStartValues()
+{
+	INITIALIZATION_ERROR = "";
+	OPENCL_ERROR = "";
+
+	BROCCOLI_LOCATION = NULL;
+
+	localMemorySize = 0;
+	maxThreadsPerBlock = 0;
+	maxMemoryAllocationSize = 0;
+	maxThreadsPerDimension[0] = 0;
+	maxThreadsPerDimension[1] = 0;
+	maxThreadsPerDimension[2] = 0;
+	USE_BUFFER_INTERPOLATION = false;
+
+	devicePoolBytesInUse = 0;
+	devicePoolBytesCached = 0;
+	devicePoolCacheLimit = DEVICE_POOL_DEFAULT_CACHE_LIMIT;
+	devicePoolBytesInUseHighWater = 0;
+	devicePoolBytesReservedHighWater = 0;
+	devicePoolRequests = 0;
+	devicePoolHits = 0;
+
+	PROFILING = false;
+
+	PIPELINE_TIMELINE = false;
+	pipelineStageActive = false;
+	pipelineStageStart = 0.0;
+	pipelineStageFirstRecord = 0;
+	allocatedHostMemory = 0;
+	deviceBufferBytes = 0;
+	deviceBufferBytesHighWater = 0;
+	allocatedHostMemoryHighWater = 0;
+	stageDeviceBufferBytesHighWater = 0;
+	stageAllocatedHostMemoryHighWater = 0;
+
+	// The registration filters are hashed for the template assets, and are only set by some wrappers
+	h_Quadrature_Filter_1_Linear_Registration_Real = NULL;
+	h_Quadrature_Filter_1_Linear_Registration_Imag = NULL;
+	h_Quadrature_Filter_2_Linear_Registration_Real = NULL;
+	h_Quadrature_Filter_2_Linear_Registration_Imag = NULL;
+	h_Quadrature_Filter_3_Linear_Registration_Real = NULL;
+	h_Quadrature_Filter_3_Linear_Registration_Imag = NULL;
+	h_Quadrature_Filter_1_NonLinear_Registration_Real = NULL;
+	h_Quadrature_Filter_1_NonLinear_Registration_Imag = NULL;
+	h_Quadrature_Filter_2_NonLinear_Registration_Real = NULL;
+	h_Quadrature_Filter_2_NonLinear_Registration_Imag = NULL;
+	h_Quadrature_Filter_3_NonLinear_Registration_Real = NULL;
+	h_Quadrature_Filter_3_NonLinear_Registration_Imag = NULL;
+	h_Quadrature_Filter_4_NonLinear_Registration_Real = NULL;
+	h_Quadrature_Filter_4_NonLinear_Registration_Imag = NULL;
+	h_Quadrature_Filter_5_NonLinear_Registration_Real = NULL;
+	h_Quadrature_Filter_5_NonLinear_Registration_Imag = NULL;
+	h_Quadrature_Filter_6_NonLinear_Registration_Real = NULL;
+	h_Quadrature_Filter_6_NonLinear_Registration_Imag = NULL;
+
+	templateAssetsKey = 0;
+	templateAssetsBytes = 0;
+	templateDeviceAssetsBytes = 0;
+	KEEP_TEMPLATE_ON_DEVICE = false;
+	USE_TEMPLATE_ASSETS = false;
+	templateAssetsChanged = false;
+	TEMPLATE_CACHE_DIRECTORY = "";
+
+	registrationResultsKeyT1MNI = 0;
+	registrationResultsKeyEPIT1 = 0;
+	REGISTRATION_CACHE_DIRECTORY = "";
+
+	PRECENTER_REGISTRATION = false;
+
+	DEBUG = false;
+	WRAPPER = -1;
+	PRINT = true;
+	VERBOS = false;
+	DO_ALL_PERMUTATIONS = false;
+
+	APPLY_SLICE_TIMING_CORRECTION = true;
+	FUSE_SLICE_TIMING_AND_MOTION_CORRECTION = false;
+	APPLY_MOTION_CORRECTION = true;
+	APPLY_SMOOTHING = true;
+
+	WRITE_INTERPOLATED_T1 = false;
+	WRITE_ALIGNED_T1_MNI_LINEAR = false;
+	WRITE_ALIGNED_T1_MNI_NONLINEAR = false;
+	DO_SKULLSTRIP = false;
+
+	WRITE_ALIGNED_EPI_T1 = false;
+	WRITE_ALIGNED_EPI_MNI = false;
+
+	WRITE_EPI_MASK = false;
+	WRITE_MNI_MASK = false;
+	WRITE_SLICETIMING_CORRECTED = false;
+	WRITE_MOTION_CORRECTED = false;
+	WRITE_SMOOTHED = false;
+
+	WRITE_ACTIVITY_EPI = false;
+	WRITE_DESIGNMATRIX = false;
+	WRITE_AR_ESTIMATES_EPI = false;
+	WRITE_AR_ESTIMATES_MNI = false;
+
+	WRITE_UNWHITENED_RESULTS = false;
+
+	EPI_Smoothing_FWHM = 8.0f;
+	AR_Smoothing_FWHM = 8.0f;
+	AUTO_MASK = false;
+
+	programBinarySize = 0;
+	writtenElements = 0;
+
+	BETA_SPACE = EPI;
+
+	SLICE_ORDER = UNDEFINED;
+	SLICE_CUSTOM_REF = 0;
 
 	FILE_TYPE = RAW;
 	DATA_TYPE = FLOAT;
@@ -319,6 +989,17 @@ void BROCCOLI_LIB::SetStartValues()
 	
 	NUMBER_OF_PERMUTATIONS = 1000;
 	SIGNIFICANCE_LEVEL = 0.05f;
+
+	SEARCHLIGHT_CLASSIFIER = SEARCHLIGHT_GRADIENT_DESCENT;
+	NUMBER_OF_SEARCHLIGHT_FOLDS = 0;
+	SEARCHLIGHT_REGULARIZATION = 0.1f;
+	SEARCHLIGHT_RADIUS = 2.0f;
+	NUMBER_OF_SEARCHLIGHT_PERMUTATIONS = 0;
+	NUMBER_OF_MCMC_ITERATIONS = 1000;
+	MCMC_SINGLE_PRECISION = false;
+	NUMBER_OF_MCMC_CHAINS = 4;
+	MCMC_TOLERANCE = 0.005f;
+	h_MCMC_Diagnostics_EPI = NULL;
 	SIGNIFICANCE_THRESHOLD = 0;
 	STATISTICAL_TEST = 0;
 
@@ -347,6 +1028,12 @@ void BROCCOLI_LIB::SetStartValues()
 
 	Z_SCORE = false;
 	PROPORTION_OF_VARIANCE_TO_SAVE_BEFORE_ICA = 80.0f;
+	PCA_METHOD = PCA_FULL;
+	ICA_STREAMING = false;
+	ICA_VOXEL_READER = NULL;
+	ICA_VOXEL_READER_DATA = NULL;
+	ICA_ALGORITHM = ICA_INFOMAX;
+	FASTICA_NONLINEARITY = FASTICA_LOGCOSH;
 
 	NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS = 12;
 
@@ -358,7 +1045,7 @@ void BROCCOLI_LIB::SetStartValues()
 
 	error = 0;
 
-	NUMBER_OF_OPENCL_KERNELS = 102;
+	NUMBER_OF_OPENCL_KERNELS = 114;
 
 	commandQueue = NULL;
 	program = NULL;
@@ -414,7 +1101,6 @@ void BROCCOLI_LIB::SetStartValues()
     createKernelErrorSeparableConvolutionColumns = 0;
     createKernelErrorSeparableConvolutionRods = 0;
     
-    createKernelErrorSliceTimingCorrection = 0;
     
     createKernelErrorCalculatePhaseDifferencesAndCertainties = 0;
     createKernelErrorCalculatePhaseGradientsX = 0;
@@ -439,6 +1125,10 @@ void BROCCOLI_LIB::SetStartValues()
     createKernelErrorCalculateColumnMaxs = 0;
     createKernelErrorCalculateRowMaxs = 0;
     createKernelErrorCalculateMaxAtomic = 0;
+    createKernelErrorReduceVolumes = 0;
+    createKernelErrorReduceVolumesFinal = 0;
+    createKernelErrorCalculateMassMoments = 0;
+    createKernelErrorFastICANonlinearity = 0;
     createKernelErrorThresholdVolume = 0;
     createKernelErrorMemset = 0;
     createKernelErrorMemsetDouble = 0;
@@ -470,6 +1160,11 @@ void BROCCOLI_LIB::SetStartValues()
     createKernelErrorInterpolateVolumeNearestNonLinear = 0;
     createKernelErrorInterpolateVolumeLinearNonLinear = 0;
     createKernelErrorInterpolateVolumeCubicNonLinear = 0;
+    createKernelErrorInterpolateVolumeNearestComposed = 0;
+    createKernelErrorInterpolateVolumeLinearComposed = 0;
+    createKernelErrorInterpolateVolumeCubicComposed = 0;
+    createKernelErrorSliceTimingCorrectionSlices = 0;
+    createKernelErrorSliceTimingAndMotionCorrection = 0;
     createKernelErrorRescaleVolumeLinear = 0;
     createKernelErrorRescaleVolumeCubic = 0;
     createKernelErrorRescaleVolumeNearest = 0;
@@ -508,11 +1203,15 @@ void BROCCOLI_LIB::SetStartValues()
     createKernelErrorCalculateStatisticalMapsGLMFTestSecondLevelPermutation = 0;
     createKernelErrorCalculateStatisticalMapsMeanSecondLevelPermutation = 0;
     createKernelErrorCalculateStatisticalMapSearchlight = 0;
+    createKernelErrorCalculateStatisticalMapSearchlightClosedForm = 0;
+    createKernelErrorCalculateStatisticalMapSearchlightSphere = 0;
+    createKernelErrorCalculateStatisticalMapsSearchlightRidgePermutation = 0;
     createKernelErrorTransformData = 0;
     createKernelErrorRemoveLinearFit = 0;
     createKernelErrorRemoveLinearFitSlice = 0;
     
     createKernelErrorCalculateStatisticalMapsGLMBayesian = 0;
+    createKernelErrorCalculateStatisticalMapsGLMBayesianMultiChain = 0;
     
     createKernelErrorEstimateAR4Models = 0;
     createKernelErrorEstimateAR4ModelsSlice = 0;
@@ -528,7 +1227,6 @@ void BROCCOLI_LIB::SetStartValues()
     runKernelErrorSeparableConvolutionColumns = 0;
     runKernelErrorSeparableConvolutionRods = 0;
     
-    runKernelErrorSliceTimingCorrection = 0;
     
     runKernelErrorCalculatePhaseDifferencesAndCertainties = 0;
     runKernelErrorCalculatePhaseGradientsX = 0;
@@ -553,6 +1251,10 @@ void BROCCOLI_LIB::SetStartValues()
     runKernelErrorCalculateColumnMaxs = 0;
     runKernelErrorCalculateRowMaxs = 0;
     runKernelErrorCalculateMaxAtomic = 0;
+    runKernelErrorReduceVolumes = 0;
+    runKernelErrorReduceVolumesFinal = 0;
+    runKernelErrorCalculateMassMoments = 0;
+    runKernelErrorFastICANonlinearity = 0;
     runKernelErrorThresholdVolume = 0;
     runKernelErrorMemset = 0;
     runKernelErrorMemsetDouble = 0;
@@ -584,6 +1286,11 @@ void BROCCOLI_LIB::SetStartValues()
     runKernelErrorInterpolateVolumeNearestNonLinear = 0;
     runKernelErrorInterpolateVolumeLinearNonLinear = 0;
     runKernelErrorInterpolateVolumeCubicNonLinear = 0;
+    runKernelErrorInterpolateVolumeNearestComposed = 0;
+    runKernelErrorInterpolateVolumeLinearComposed = 0;
+    runKernelErrorInterpolateVolumeCubicComposed = 0;
+    runKernelErrorSliceTimingCorrectionSlices = 0;
+    runKernelErrorSliceTimingAndMotionCorrection = 0;
     runKernelErrorRescaleVolumeLinear = 0;
     runKernelErrorRescaleVolumeCubic = 0;
     runKernelErrorRescaleVolumeNearest = 0;
@@ -622,11 +1329,15 @@ void BROCCOLI_LIB::SetStartValues()
     runKernelErrorCalculateStatisticalMapsGLMFTestSecondLevelPermutation = 0;
     runKernelErrorCalculateStatisticalMapsMeanSecondLevelPermutation = 0;
     runKernelErrorCalculateStatisticalMapSearchlight = 0;
+    runKernelErrorCalculateStatisticalMapSearchlightClosedForm = 0;
+    runKernelErrorCalculateStatisticalMapSearchlightSphere = 0;
+    runKernelErrorCalculateStatisticalMapsSearchlightRidgePermutation = 0;
     runKernelErrorTransformData = 0;
     runKernelErrorRemoveLinearFit = 0;
     runKernelErrorRemoveLinearFitSlice = 0;
     
     runKernelErrorCalculateStatisticalMapsGLMBayesian = 0;
+    runKernelErrorCalculateStatisticalMapsGLMBayesianMultiChain = 0;
     
     runKernelErrorEstimateAR4Models = 0;
     runKernelErrorEstimateAR4ModelsSlice = 0;
@@ -964,34 +1675,617 @@ void BROCCOLI_LIB::GetBandwidth()
 	clReleaseMemObject(d_Data2);
 }
 
-const char* BROCCOLI_LIB::GetOpenCLDeviceName()
-{
-	return deviceName.c_str();
-}
+// Runs each major kernel family on synthetic data and returns the mean time over the repetitions, after a number of warmup runs
+std::vector<KernelBenchmark> BROCCOLI_LIB::RunKernelBenchmarks(int DATA_W, int DATA_H, int DATA_D, int DATA_T, int warmup, int repetitions)
+{
+	size_t N = (size_t)DATA_W * (size_t)DATA_H * (size_t)DATA_D;
+	size_t NT = N * (size_t)DATA_T;
+	int NUMBER_OF_REGRESSORS = KERNEL_BENCHMARK_REGRESSORS;
+	int NUMBER_OF_CONTRASTS_ = KERNEL_BENCHMARK_CONTRASTS;
+	int NUMBER_OF_INVALID_TIMEPOINTS = 0;
+
+	// Use a fixed seed, so that the clustering does the same number of iterations every time
+	cl_uint randomState = 1234;
+
+	int searchlightVolumes = mymin(DATA_T, KERNEL_BENCHMARK_SEARCHLIGHT_VOLUMES);
+	int searchlightFolds = mymax(mymin(KERNEL_BENCHMARK_SEARCHLIGHT_FOLDS, searchlightVolumes), 2);
+
+	// Allocate memory on device, nothing is timed if any buffer can not be allocated
+	cl_int createBufferErrors[37];
+	int numberOfBuffers = 0;
+	cl_mem d_Volumes = clCreateBuffer(context, CL_MEM_READ_WRITE, NT * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem d_Output = clCreateBuffer(context, CL_MEM_READ_WRITE, NT * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem d_Transformed = clCreateBuffer(context, CL_MEM_READ_WRITE, NT * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem d_Residuals_ = clCreateBuffer(context, CL_MEM_READ_WRITE, NT * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem d_Permuted = clCreateBuffer(context, CL_MEM_READ_WRITE, NT * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+
+	cl_mem d_Mask = clCreateBuffer(context, CL_MEM_READ_WRITE, N * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem d_Volume = clCreateBuffer(context, CL_MEM_READ_WRITE, N * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem d_Statistical_Map = clCreateBuffer(context, CL_MEM_READ_WRITE, N * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem d_q1 = clCreateBuffer(context, CL_MEM_READ_WRITE, N * sizeof(float2), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem d_q2 = clCreateBuffer(context, CL_MEM_READ_WRITE, N * sizeof(float2), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem d_q3 = clCreateBuffer(context, CL_MEM_READ_WRITE, N * sizeof(float2), NULL, &createBufferErrors[numberOfBuffers++]);
+
+	cl_mem d_Beta = clCreateBuffer(context, CL_MEM_READ_WRITE, N * NUMBER_OF_REGRESSORS * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem d_Statistical_Maps_ = clCreateBuffer(context, CL_MEM_READ_WRITE, N * NUMBER_OF_CONTRASTS_ * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem d_Residual_Variances_ = clCreateBuffer(context, CL_MEM_READ_WRITE, N * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem d_AR1 = clCreateBuffer(context, CL_MEM_READ_WRITE, N * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem d_AR2 = clCreateBuffer(context, CL_MEM_READ_WRITE, N * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem d_AR3 = clCreateBuffer(context, CL_MEM_READ_WRITE, N * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem d_AR4 = clCreateBuffer(context, CL_MEM_READ_WRITE, N * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem d_Cluster_Indices_ = clCreateBuffer(context, CL_MEM_READ_WRITE, N * sizeof(unsigned int), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem d_Cluster_Sizes_ = clCreateBuffer(context, CL_MEM_READ_WRITE, N * sizeof(unsigned int), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem d_TFCE = clCreateBuffer(context, CL_MEM_READ_WRITE, N * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+
+	cl_mem c_X = clCreateBuffer(context, CL_MEM_READ_ONLY, DATA_T * NUMBER_OF_REGRESSORS * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem c_xtxxt = clCreateBuffer(context, CL_MEM_READ_ONLY, DATA_T * NUMBER_OF_REGRESSORS * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem c_Contrasts_ = clCreateBuffer(context, CL_MEM_READ_ONLY, NUMBER_OF_REGRESSORS * NUMBER_OF_CONTRASTS_ * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem c_ctxtxc_TTest = clCreateBuffer(context, CL_MEM_READ_ONLY, NUMBER_OF_CONTRASTS_ * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem c_ctxtxc_FTest = clCreateBuffer(context, CL_MEM_READ_ONLY, NUMBER_OF_CONTRASTS_ * NUMBER_OF_CONTRASTS_ * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem c_Censored = clCreateBuffer(context, CL_MEM_READ_ONLY, DATA_T * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem c_Permutation = clCreateBuffer(context, CL_MEM_READ_ONLY, DATA_T * sizeof(unsigned short int), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem c_Classes = clCreateBuffer(context, CL_MEM_READ_ONLY, DATA_T * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem c_Volume_Indices = clCreateBuffer(context, CL_MEM_READ_ONLY, mymax(searchlightVolumes, 1) * sizeof(cl_int), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem c_Fold_Starts = clCreateBuffer(context, CL_MEM_READ_ONLY, (searchlightFolds + 1) * sizeof(cl_int), NULL, &createBufferErrors[numberOfBuffers++]);
+
+	cl_mem c_Filter_1_Real = clCreateBuffer(context, CL_MEM_READ_ONLY, IMAGE_REGISTRATION_FILTER_SIZE * IMAGE_REGISTRATION_FILTER_SIZE * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem c_Filter_1_Imag = clCreateBuffer(context, CL_MEM_READ_ONLY, IMAGE_REGISTRATION_FILTER_SIZE * IMAGE_REGISTRATION_FILTER_SIZE * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem c_Filter_2_Real = clCreateBuffer(context, CL_MEM_READ_ONLY, IMAGE_REGISTRATION_FILTER_SIZE * IMAGE_REGISTRATION_FILTER_SIZE * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem c_Filter_2_Imag = clCreateBuffer(context, CL_MEM_READ_ONLY, IMAGE_REGISTRATION_FILTER_SIZE * IMAGE_REGISTRATION_FILTER_SIZE * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem c_Filter_3_Real = clCreateBuffer(context, CL_MEM_READ_ONLY, IMAGE_REGISTRATION_FILTER_SIZE * IMAGE_REGISTRATION_FILTER_SIZE * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+	cl_mem c_Filter_3_Imag = clCreateBuffer(context, CL_MEM_READ_ONLY, IMAGE_REGISTRATION_FILTER_SIZE * IMAGE_REGISTRATION_FILTER_SIZE * sizeof(float), NULL, &createBufferErrors[numberOfBuffers++]);
+
+	cl_mem allBuffers[] = {d_Volumes, d_Output, d_Transformed, d_Residuals_, d_Permuted, d_Mask, d_Volume, d_Statistical_Map, d_q1, d_q2, d_q3, d_Beta,
+		d_Statistical_Maps_, d_Residual_Variances_, d_AR1, d_AR2, d_AR3, d_AR4, d_Cluster_Indices_, d_Cluster_Sizes_, d_TFCE, c_X, c_xtxxt, c_Contrasts_,
+		c_ctxtxc_TTest, c_ctxtxc_FTest, c_Censored, c_Permutation, c_Classes, c_Volume_Indices, c_Fold_Starts, c_Filter_1_Real, c_Filter_1_Imag,
+		c_Filter_2_Real, c_Filter_2_Imag, c_Filter_3_Real, c_Filter_3_Imag};
+
+	std::vector<KernelBenchmark> results;
+	for (int i = 0; i < numberOfBuffers; i++)
+	{
+		if (createBufferErrors[i] != SUCCESS)
+		{
+			if ((WRAPPER == BASH) && VERBOS)
+			{
+				printf("Could not allocate memory for the kernel benchmarks, error is %s\n", GetOpenCLErrorMessage(createBufferErrors[i]));
+			}
 
-const char* BROCCOLI_LIB::GetOpenCLPlatformName()
-{
-	return platformName.c_str();
-}
+			for (int j = 0; j < numberOfBuffers; j++)
+			{
+				if (createBufferErrors[j] == SUCCESS)
+				{
+					clReleaseMemObject(allBuffers[j]);
+				}
+			}
+			return results;
+		}
+	}
 
-// Creates OpenCL programs from binary files
-void BROCCOLI_LIB::CreateProgramFromBinary(cl_context context, cl_device_id device, std::string filename)
-{
-	for (int k = 0; k < NUMBER_OF_KERNEL_FILES; k++)
+	// Synthetic fMRI volumes, zero mean residuals and a brain shaped mask
+	float* h_Volumes = (float*)malloc(NT * sizeof(float));
+	float* h_Noise = (float*)malloc(NT * sizeof(float));
+	float* h_Mask = (float*)malloc(N * sizeof(float));
+
+	for (size_t i = 0; i < NT; i++)
 	{
-		std::string thisFilename = filename;
+		h_Noise[i] = 2.0f * (float)XorshiftRandom(randomState) / 4294967295.0f - 1.0f;
+		h_Volumes[i] = 1000.0f + 10.0f * h_Noise[i];
+	}
 
-		// Get device name and remove spaces, add to filename
-		char* value;
-		size_t valueSize;
-		std::string device_name;
-		clGetDeviceInfo(device, CL_DEVICE_NAME, 0, NULL, &valueSize);
-		value = (char*) malloc(valueSize);
-		clGetDeviceInfo(device, CL_DEVICE_NAME, valueSize, value, NULL);            
-		thisFilename.append("_");
-		device_name = value;
-		device_name.erase(std::remove (device_name.begin(), device_name.end(), ' '), device_name.end());
-		thisFilename.append(device_name);			
+	for (int z = 0; z < DATA_D; z++)
+	{
+		for (int y = 0; y < DATA_H; y++)
+		{
+			for (int x = 0; x < DATA_W; x++)
+			{
+				float dx = ((float)x - (float)DATA_W/2.0f) / ((float)DATA_W/2.0f);
+				float dy = ((float)y - (float)DATA_H/2.0f) / ((float)DATA_H/2.0f);
+				float dz = ((float)z - (float)DATA_D/2.0f) / ((float)DATA_D/2.0f);
+				h_Mask[x + y * DATA_W + z * DATA_W * DATA_H] = (dx*dx + dy*dy + dz*dz <= 1.0f) ? 1.0f : 0.0f;
+			}
+		}
+	}
+
+	// Design matrix with an intercept, a linear trend and sines and cosines of increasing frequency
+	Eigen::MatrixXd X(DATA_T,NUMBER_OF_REGRESSORS);
+	for (int t = 0; t < DATA_T; t++)
+	{
+		X(t,0) = 1.0;
+		X(t,1) = (double)t / (double)DATA_T - 0.5;
+		for (int r = 2; r < NUMBER_OF_REGRESSORS; r++)
+		{
+			double phase = 2.0 * PI * (double)(r/2) * (double)t / (double)DATA_T;
+			X(t,r) = (r % 2 == 0) ? sin(phase) : cos(phase);
+		}
+	}
+
+	Eigen::MatrixXd inv_xtx = (X.transpose() * X).inverse();
+	Eigen::MatrixXd xtxxt = inv_xtx * X.transpose();
+
+	// One contrast per sine and cosine pair
+	Eigen::MatrixXd Contrasts = Eigen::MatrixXd::Zero(NUMBER_OF_CONTRASTS_,NUMBER_OF_REGRESSORS);
+	for (int c = 0; c < NUMBER_OF_CONTRASTS_; c++)
+	{
+		Contrasts(c,2 + (c % (NUMBER_OF_REGRESSORS - 2))) = 1.0;
+	}
+	Eigen::MatrixXd ctxtxc = (Contrasts * inv_xtx * Contrasts.transpose()).inverse();
+
+	float* h_X = (float*)malloc(DATA_T * NUMBER_OF_REGRESSORS * sizeof(float));
+	float* h_xtxxt = (float*)malloc(DATA_T * NUMBER_OF_REGRESSORS * sizeof(float));
+	float* h_Contrasts_ = (float*)malloc(NUMBER_OF_REGRESSORS * NUMBER_OF_CONTRASTS_ * sizeof(float));
+	float* h_ctxtxc_TTest = (float*)malloc(NUMBER_OF_CONTRASTS_ * sizeof(float));
+	float* h_ctxtxc_FTest = (float*)malloc(NUMBER_OF_CONTRASTS_ * NUMBER_OF_CONTRASTS_ * sizeof(float));
+
+	for (int t = 0; t < DATA_T; t++)
+	{
+		for (int r = 0; r < NUMBER_OF_REGRESSORS; r++)
+		{
+			h_X[t + r * DATA_T] = (float)X(t,r);
+			h_xtxxt[t + r * DATA_T] = (float)xtxxt(r,t);
+		}
+	}
+
+	for (int c = 0; c < NUMBER_OF_CONTRASTS_; c++)
+	{
+		for (int r = 0; r < NUMBER_OF_REGRESSORS; r++)
+		{
+			h_Contrasts_[NUMBER_OF_REGRESSORS * c + r] = (float)Contrasts(c,r);
+		}
+		Eigen::VectorXd Contrast = Contrasts.row(c).transpose();
+		Eigen::VectorXd scalar = Contrast.transpose() * inv_xtx * Contrast;
+		h_ctxtxc_TTest[c] = (float)scalar(0);
+		for (int cc = 0; cc < NUMBER_OF_CONTRASTS_; cc++)
+		{
+			h_ctxtxc_FTest[c + cc * NUMBER_OF_CONTRASTS_] = (float)ctxtxc(c,cc);
+		}
+	}
+
+	// Random permutation of the timepoints
+	unsigned short int* h_Permutation = (unsigned short int*)malloc(DATA_T * sizeof(unsigned short int));
+	for (int t = 0; t < DATA_T; t++)
+	{
+		h_Permutation[t] = (unsigned short int)t;
+	}
+	for (int t = DATA_T - 1; t > 0; t--)
+	{
+		int tt = (int)(XorshiftRandom(randomState) % (cl_uint)(t + 1));
+		unsigned short int temp = h_Permutation[t];
+		h_Permutation[t] = h_Permutation[tt];
+		h_Permutation[tt] = temp;
+	}
+
+	// Smoothing filters, a small affine transformation and random quadrature filters
+	float* h_Filter_X = (float*)malloc(SMOOTHING_FILTER_SIZE * sizeof(float));
+	float* h_Filter_Y = (float*)malloc(SMOOTHING_FILTER_SIZE * sizeof(float));
+	float* h_Filter_Z = (float*)malloc(SMOOTHING_FILTER_SIZE * sizeof(float));
+	CreateSmoothingFilters(h_Filter_X, h_Filter_Y, h_Filter_Z, SMOOTHING_FILTER_SIZE, 2.0);
+
+	float* h_Parameters = (float*)malloc(NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS * sizeof(float));
+	for (int p = 0; p < NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS; p++)
+	{
+		h_Parameters[p] = 0.0f;
+	}
+	h_Parameters[0] = 0.5f;
+	h_Parameters[1] = -0.3f;
+	h_Parameters[2] = 0.2f;
+	h_Parameters[3] = 0.01f;
+	h_Parameters[4] = 0.02f;
+	h_Parameters[6] = -0.02f;
+	h_Parameters[7] = 0.01f;
+
+	int FILTER_ELEMENTS = IMAGE_REGISTRATION_FILTER_SIZE * IMAGE_REGISTRATION_FILTER_SIZE * IMAGE_REGISTRATION_FILTER_SIZE;
+	float* h_Quadrature_Filters = (float*)malloc(6 * FILTER_ELEMENTS * sizeof(float));
+	for (int i = 0; i < 6 * FILTER_ELEMENTS; i++)
+	{
+		h_Quadrature_Filters[i] = 2.0f * (float)XorshiftRandom(randomState) / 4294967295.0f - 1.0f;
+	}
+
+	// Searchlight with two alternating classes for the first volumes, for evenly spaced spheres in the mask
+	float* h_Classes = (float*)malloc(DATA_T * sizeof(float));
+	std::vector<cl_int> searchlightVolumeIndices, searchlightFoldStarts, searchlightVoxelIndices;
+	for (int t = 0; t < DATA_T; t++)
+	{
+		h_Classes[t] = (float)(t % 2);
+		if (t < searchlightVolumes)
+		{
+			searchlightVolumeIndices.push_back(t);
+		}
+	}
+	CreateSearchlightFolds(searchlightVolumeIndices, searchlightFoldStarts, searchlightFolds, h_Classes);
+
+	std::vector<cl_int> maskIndices;
+	for (size_t i = 0; i < N; i++)
+	{
+		if (h_Mask[i] == 1.0f)
+		{
+			maskIndices.push_back((cl_int)i);
+		}
+	}
+	size_t sphereStep = std::max(maskIndices.size() / KERNEL_BENCHMARK_SEARCHLIGHT_SPHERES, (size_t)1);
+	for (size_t i = 0; i < maskIndices.size(); i += sphereStep)
+	{
+		searchlightVoxelIndices.push_back(maskIndices[i]);
+	}
+
+	// Copy data to device
+	clEnqueueWriteBuffer(commandQueue, d_Volumes, CL_TRUE, 0, NT * sizeof(float), h_Volumes, 0, NULL, NULL);
+	clEnqueueWriteBuffer(commandQueue, d_Residuals_, CL_TRUE, 0, NT * sizeof(float), h_Noise, 0, NULL, NULL);
+	clEnqueueWriteBuffer(commandQueue, d_Output, CL_TRUE, 0, NT * sizeof(float), h_Noise, 0, NULL, NULL);
+	clEnqueueWriteBuffer(commandQueue, d_Mask, CL_TRUE, 0, N * sizeof(float), h_Mask, 0, NULL, NULL);
+	clEnqueueWriteBuffer(commandQueue, d_Volume, CL_TRUE, 0, N * sizeof(float), h_Volumes, 0, NULL, NULL);
+
+	clEnqueueWriteBuffer(commandQueue, c_X, CL_TRUE, 0, DATA_T * NUMBER_OF_REGRESSORS * sizeof(float), h_X, 0, NULL, NULL);
+	clEnqueueWriteBuffer(commandQueue, c_xtxxt, CL_TRUE, 0, DATA_T * NUMBER_OF_REGRESSORS * sizeof(float), h_xtxxt, 0, NULL, NULL);
+	clEnqueueWriteBuffer(commandQueue, c_Contrasts_, CL_TRUE, 0, NUMBER_OF_REGRESSORS * NUMBER_OF_CONTRASTS_ * sizeof(float), h_Contrasts_, 0, NULL, NULL);
+	clEnqueueWriteBuffer(commandQueue, c_ctxtxc_TTest, CL_TRUE, 0, NUMBER_OF_CONTRASTS_ * sizeof(float), h_ctxtxc_TTest, 0, NULL, NULL);
+	clEnqueueWriteBuffer(commandQueue, c_ctxtxc_FTest, CL_TRUE, 0, NUMBER_OF_CONTRASTS_ * NUMBER_OF_CONTRASTS_ * sizeof(float), h_ctxtxc_FTest, 0, NULL, NULL);
+	clEnqueueWriteBuffer(commandQueue, c_Permutation, CL_TRUE, 0, DATA_T * sizeof(unsigned short int), h_Permutation, 0, NULL, NULL);
+	clEnqueueWriteBuffer(commandQueue, c_Classes, CL_TRUE, 0, DATA_T * sizeof(float), h_Classes, 0, NULL, NULL);
+	if (searchlightVolumes > 0)
+	{
+		clEnqueueWriteBuffer(commandQueue, c_Volume_Indices, CL_TRUE, 0, searchlightVolumes * sizeof(cl_int), &searchlightVolumeIndices[0], 0, NULL, NULL);
+	}
+	clEnqueueWriteBuffer(commandQueue, c_Fold_Starts, CL_TRUE, 0, (searchlightFolds + 1) * sizeof(cl_int), &searchlightFoldStarts[0], 0, NULL, NULL);
+	SetMemory(c_Censored, 1.0f, DATA_T);
+
+	// Moderate auto correlation, as for real fMRI data
+	SetMemory(d_AR1, 0.3f, N);
+	SetMemory(d_AR2, 0.1f, N);
+	SetMemory(d_AR3, 0.05f, N);
+	SetMemory(d_AR4, 0.02f, N);
+
+	// Smoothed noise gives clusters of realistic shape, threshold at half the max
+	PerformSmoothing(d_Statistical_Map, d_Residuals_, h_Filter_X, h_Filter_Y, h_Filter_Z, DATA_W, DATA_H, DATA_D, 1);
+	float maxValue = CalculateMax(d_Statistical_Map, DATA_W, DATA_H, DATA_D);
+	float clusterThreshold = 0.5f * maxValue;
+	float tfceDelta = maxValue / (float)KERNEL_BENCHMARK_TFCE_THRESHOLDS;
+
+	// The clustering calculates cluster sizes only for extent inference
+	int OLD_INFERENCE_MODE = INFERENCE_MODE;
+	INFERENCE_MODE = CLUSTER_EXTENT;
+
+	// The searchlight radius is given in voxels of the smallest voxel size, isotropic voxels give the same spheres for any voxel size
+	float OLD_SEARCHLIGHT_RADIUS = SEARCHLIGHT_RADIUS;
+	float OLD_MNI_VOXEL_SIZE_X = MNI_VOXEL_SIZE_X;
+	float OLD_MNI_VOXEL_SIZE_Y = MNI_VOXEL_SIZE_Y;
+	float OLD_MNI_VOXEL_SIZE_Z = MNI_VOXEL_SIZE_Z;
+	MNI_VOXEL_SIZE_X = 1.0f;
+	MNI_VOXEL_SIZE_Y = 1.0f;
+	MNI_VOXEL_SIZE_Z = 1.0f;
+
+	SetGlobalAndLocalWorkSizesStatisticalCalculations(DATA_W, DATA_H, DATA_D);
+
+	// Bytes and floating point operations per voxel are estimated from the kernel code
+	double n = (double)N, t = (double)DATA_T, r = (double)NUMBER_OF_REGRESSORS, c = (double)NUMBER_OF_CONTRASTS_;
+	double f = (double)IMAGE_REGISTRATION_FILTER_SIZE;
+
+	for (int benchmark = 0; benchmark < NUMBER_OF_KERNEL_BENCHMARKS; benchmark++)
+	{
+		KernelBenchmark result;
+		switch (benchmark)
+		{
+			case KERNEL_BENCHMARK_SEPARABLE_CONVOLUTION:
+				result.name = "Separable convolution";
+				result.bytes = 4.0 * 8.0 * n * t;
+				result.flops = 3.0 * 2.0 * (double)SMOOTHING_FILTER_SIZE * n * t;
+				break;
+			case KERNEL_BENCHMARK_NONSEPARABLE_CONVOLUTION:
+				result.name = "Nonseparable convolution";
+				result.bytes = f * (4.0 + 3.0 * 2.0 * 8.0) * n;
+				result.flops = 3.0 * 4.0 * f * f * f * n;
+				break;
+			case KERNEL_BENCHMARK_INTERPOLATION:
+				result.name = "Linear interpolation";
+				result.bytes = 4.0 * 4.0 * n * t;
+				result.flops = 40.0 * n * t;
+				break;
+			case KERNEL_BENCHMARK_GLM_TTEST:
+				result.name = "GLM t-test";
+				result.bytes = 4.0 * (4.0 * t + 2.0 * r + c + 1.0) * n;
+				result.flops = (6.0 * t * r + 4.0 * t + c * (2.0 * r + 4.0)) * n;
+				break;
+			case KERNEL_BENCHMARK_GLM_FTEST:
+				result.name = "GLM F-test";
+				result.bytes = 4.0 * (4.0 * t + 2.0 * r + 2.0) * n;
+				result.flops = (6.0 * t * r + 4.0 * t + 2.0 * c * r + 2.0 * c * c + 2.0 * c) * n;
+				break;
+			case KERNEL_BENCHMARK_AR4_ESTIMATION:
+				result.name = "AR(4) estimation";
+				result.bytes = 4.0 * (t + 4.0) * n;
+				result.flops = (10.0 * t + 100.0) * n;
+				break;
+			case KERNEL_BENCHMARK_AR4_WHITENING:
+				result.name = "AR(4) whitening";
+				result.bytes = 4.0 * (2.0 * t + 4.0) * n;
+				result.flops = 8.0 * t * n;
+				break;
+			case KERNEL_BENCHMARK_PERMUTATION:
+				result.name = "Permutation";
+				result.bytes = 4.0 * (2.0 * t + 4.0) * n;
+				result.flops = 8.0 * t * n;
+				break;
+			case KERNEL_BENCHMARK_CLUSTERIZE:
+				// The number of iterations depends on the data, so there is no meaningful bandwidth
+				result.name = "Clusterize";
+				result.bytes = 0.0;
+				result.flops = 0.0;
+				break;
+			case KERNEL_BENCHMARK_TFCE:
+				result.name = "TFCE";
+				result.bytes = 0.0;
+				result.flops = 0.0;
+				break;
+			case KERNEL_BENCHMARK_MAX_REDUCTION:
+				result.name = "Max reduction";
+				result.bytes = 4.0 * n;
+				result.flops = n;
+				break;
+			case KERNEL_BENCHMARK_SUM_REDUCTION:
+				result.name = "Sum reduction";
+				result.bytes = 4.0 * (t + 1.0) * n;
+				result.flops = t * n;
+				break;
+			case KERNEL_BENCHMARK_SEARCHLIGHT_RADIUS_2:
+				result.name = "Searchlight radius 2";
+				break;
+			case KERNEL_BENCHMARK_SEARCHLIGHT_RADIUS_3:
+				result.name = "Searchlight radius 3";
+				break;
+			case KERNEL_BENCHMARK_SEARCHLIGHT_RADIUS_4:
+				result.name = "Searchlight radius 4";
+				break;
+			case KERNEL_BENCHMARK_SEARCHLIGHT_RADIUS_5:
+				result.name = "Searchlight radius 5";
+				break;
+			case KERNEL_BENCHMARK_SEARCHLIGHT_RADIUS_6:
+				result.name = "Searchlight radius 6";
+				break;
+		}
+
+		// Each value of the sphere is read from the volumes, written to and read twice from the feature matrix
+		if ( (benchmark >= KERNEL_BENCHMARK_SEARCHLIGHT_RADIUS_2) && (benchmark <= KERNEL_BENCHMARK_SEARCHLIGHT_RADIUS_6) )
+		{
+			SEARCHLIGHT_RADIUS = (float)(benchmark - KERNEL_BENCHMARK_SEARCHLIGHT_RADIUS_2 + 2);
+
+			std::vector<cl_int> sphereOffsets;
+			double sphereValues = (double)CreateSearchlightSphereOffsets(sphereOffsets) * (double)searchlightVolumes * (double)searchlightVoxelIndices.size();
+			result.bytes = 4.0 * 4.0 * sphereValues;
+			result.flops = 12.0 * sphereValues;
+		}
+
+		double start = 0.0;
+		for (int repetition = 0; repetition < warmup + repetitions; repetition++)
+		{
+			// Start the timer after the warmup
+			if (repetition == warmup)
+			{
+				clFinish(commandQueue);
+				start = GetTime();
+			}
+
+			switch (benchmark)
+			{
+				case KERNEL_BENCHMARK_SEPARABLE_CONVOLUTION:
+					PerformSmoothing(d_Output, d_Volumes, h_Filter_X, h_Filter_Y, h_Filter_Z, DATA_W, DATA_H, DATA_D, DATA_T);
+					break;
+
+				case KERNEL_BENCHMARK_NONSEPARABLE_CONVOLUTION:
+					NonseparableConvolution3D(d_q1, d_q2, d_q3, d_Volume, c_Filter_1_Real, c_Filter_1_Imag, c_Filter_2_Real, c_Filter_2_Imag, c_Filter_3_Real, c_Filter_3_Imag, &h_Quadrature_Filters[0 * FILTER_ELEMENTS], &h_Quadrature_Filters[1 * FILTER_ELEMENTS], &h_Quadrature_Filters[2 * FILTER_ELEMENTS], &h_Quadrature_Filters[3 * FILTER_ELEMENTS], &h_Quadrature_Filters[4 * FILTER_ELEMENTS], &h_Quadrature_Filters[5 * FILTER_ELEMENTS], DATA_W, DATA_H, DATA_D);
+					break;
+
+				case KERNEL_BENCHMARK_INTERPOLATION:
+					// The volumes are transformed in place, start from the same volumes every time
+					clEnqueueCopyBuffer(commandQueue, d_Volumes, d_Transformed, 0, 0, NT * sizeof(float), 0, NULL, NULL);
+					TransformVolumesLinear(d_Transformed, h_Parameters, DATA_W, DATA_H, DATA_D, DATA_T, LINEAR);
+					break;
+
+				case KERNEL_BENCHMARK_GLM_TTEST:
+				case KERNEL_BENCHMARK_GLM_FTEST:
+				{
+					cl_kernel StatisticalMapsKernel = (benchmark == KERNEL_BENCHMARK_GLM_TTEST) ? CalculateStatisticalMapsGLMTTestKernel : CalculateStatisticalMapsGLMFTestKernel;
+					cl_mem c_ctxtxc = (benchmark == KERNEL_BENCHMARK_GLM_TTEST) ? c_ctxtxc_TTest : c_ctxtxc_FTest;
+
+					clSetKernelArg(CalculateBetaWeightsGLMKernel, 0, sizeof(cl_mem), &d_Beta);
+					clSetKernelArg(CalculateBetaWeightsGLMKernel, 1, sizeof(cl_mem), &d_Volumes);
+					clSetKernelArg(CalculateBetaWeightsGLMKernel, 2, sizeof(cl_mem), &d_Mask);
+					clSetKernelArg(CalculateBetaWeightsGLMKernel, 3, sizeof(cl_mem), &c_xtxxt);
+					clSetKernelArg(CalculateBetaWeightsGLMKernel, 4, sizeof(cl_mem), &c_Censored);
+					clSetKernelArg(CalculateBetaWeightsGLMKernel, 5, sizeof(int),    &DATA_W);
+					clSetKernelArg(CalculateBetaWeightsGLMKernel, 6, sizeof(int),    &DATA_H);
+					clSetKernelArg(CalculateBetaWeightsGLMKernel, 7, sizeof(int),    &DATA_D);
+					clSetKernelArg(CalculateBetaWeightsGLMKernel, 8, sizeof(int),    &DATA_T);
+					clSetKernelArg(CalculateBetaWeightsGLMKernel, 9, sizeof(int),    &NUMBER_OF_REGRESSORS);
+					runKernelErrorCalculateBetaWeightsGLM = clEnqueueNDRangeKernel(commandQueue, CalculateBetaWeightsGLMKernel, 3, NULL, globalWorkSizeCalculateBetaWeightsGLM, localWorkSizeCalculateBetaWeightsGLM, 0, NULL, NULL);
+
+					clSetKernelArg(StatisticalMapsKernel, 0, sizeof(cl_mem),  &d_Statistical_Maps_);
+					clSetKernelArg(StatisticalMapsKernel, 1, sizeof(cl_mem),  &d_Residuals_);
+					clSetKernelArg(StatisticalMapsKernel, 2, sizeof(cl_mem),  &d_Residual_Variances_);
+					clSetKernelArg(StatisticalMapsKernel, 3, sizeof(cl_mem),  &d_Volumes);
+					clSetKernelArg(StatisticalMapsKernel, 4, sizeof(cl_mem),  &d_Beta);
+					clSetKernelArg(StatisticalMapsKernel, 5, sizeof(cl_mem),  &d_Mask);
+					clSetKernelArg(StatisticalMapsKernel, 6, sizeof(cl_mem),  &c_X);
+					clSetKernelArg(StatisticalMapsKernel, 7, sizeof(cl_mem),  &c_Contrasts_);
+					clSetKernelArg(StatisticalMapsKernel, 8, sizeof(cl_mem),  &c_ctxtxc);
+					clSetKernelArg(StatisticalMapsKernel, 9, sizeof(cl_mem),  &c_Censored);
+					clSetKernelArg(StatisticalMapsKernel, 10, sizeof(int),    &DATA_W);
+					clSetKernelArg(StatisticalMapsKernel, 11, sizeof(int),    &DATA_H);
+					clSetKernelArg(StatisticalMapsKernel, 12, sizeof(int),    &DATA_D);
+					clSetKernelArg(StatisticalMapsKernel, 13, sizeof(int),    &DATA_T);
+					clSetKernelArg(StatisticalMapsKernel, 14, sizeof(int),    &NUMBER_OF_REGRESSORS);
+					clSetKernelArg(StatisticalMapsKernel, 15, sizeof(int),    &NUMBER_OF_CONTRASTS_);
+					clSetKernelArg(StatisticalMapsKernel, 16, sizeof(int),    &NUMBER_OF_INVALID_TIMEPOINTS);
+					if (benchmark == KERNEL_BENCHMARK_GLM_TTEST)
+					{
+						runKernelErrorCalculateStatisticalMapsGLMTTest = clEnqueueNDRangeKernel(commandQueue, StatisticalMapsKernel, 3, NULL, globalWorkSizeCalculateStatisticalMapsGLM, localWorkSizeCalculateStatisticalMapsGLM, 0, NULL, NULL);
+					}
+					else
+					{
+						runKernelErrorCalculateStatisticalMapsGLMFTest = clEnqueueNDRangeKernel(commandQueue, StatisticalMapsKernel, 3, NULL, globalWorkSizeCalculateStatisticalMapsGLM, localWorkSizeCalculateStatisticalMapsGLM, 0, NULL, NULL);
+					}
+					break;
+				}
+
+				case KERNEL_BENCHMARK_AR4_ESTIMATION:
+					clSetKernelArg(EstimateAR4ModelsKernel, 0, sizeof(cl_mem), &d_AR1);
+					clSetKernelArg(EstimateAR4ModelsKernel, 1, sizeof(cl_mem), &d_AR2);
+					clSetKernelArg(EstimateAR4ModelsKernel, 2, sizeof(cl_mem), &d_AR3);
+					clSetKernelArg(EstimateAR4ModelsKernel, 3, sizeof(cl_mem), &d_AR4);
+					clSetKernelArg(EstimateAR4ModelsKernel, 4, sizeof(cl_mem), &d_Residuals_);
+					clSetKernelArg(EstimateAR4ModelsKernel, 5, sizeof(cl_mem), &d_Mask);
+					clSetKernelArg(EstimateAR4ModelsKernel, 6, sizeof(int),    &DATA_W);
+					clSetKernelArg(EstimateAR4ModelsKernel, 7, sizeof(int),    &DATA_H);
+					clSetKernelArg(EstimateAR4ModelsKernel, 8, sizeof(int),    &DATA_D);
+					clSetKernelArg(EstimateAR4ModelsKernel, 9, sizeof(int),    &DATA_T);
+					clSetKernelArg(EstimateAR4ModelsKernel, 10, sizeof(int),   &NUMBER_OF_INVALID_TIMEPOINTS);
+					runKernelErrorEstimateAR4Models = clEnqueueNDRangeKernel(commandQueue, EstimateAR4ModelsKernel, 3, NULL, globalWorkSizeEstimateAR4Models, localWorkSizeEstimateAR4Models, 0, NULL, NULL);
+					break;
+
+				case KERNEL_BENCHMARK_AR4_WHITENING:
+					clSetKernelArg(ApplyWhiteningAR4Kernel, 0,  sizeof(cl_mem), &d_Output);
+					clSetKernelArg(ApplyWhiteningAR4Kernel, 1,  sizeof(cl_mem), &d_Volumes);
+					clSetKernelArg(ApplyWhiteningAR4Kernel, 2,  sizeof(cl_mem), &d_AR1);
+					clSetKernelArg(ApplyWhiteningAR4Kernel, 3,  sizeof(cl_mem), &d_AR2);
+					clSetKernelArg(ApplyWhiteningAR4Kernel, 4,  sizeof(cl_mem), &d_AR3);
+					clSetKernelArg(ApplyWhiteningAR4Kernel, 5,  sizeof(cl_mem), &d_AR4);
+					clSetKernelArg(ApplyWhiteningAR4Kernel, 6,  sizeof(cl_mem), &d_Mask);
+					clSetKernelArg(ApplyWhiteningAR4Kernel, 7,  sizeof(int),    &DATA_W);
+					clSetKernelArg(ApplyWhiteningAR4Kernel, 8,  sizeof(int),    &DATA_H);
+					clSetKernelArg(ApplyWhiteningAR4Kernel, 9,  sizeof(int),    &DATA_D);
+					clSetKernelArg(ApplyWhiteningAR4Kernel, 10, sizeof(int),    &DATA_T);
+					runKernelErrorApplyWhiteningAR4 = clEnqueueNDRangeKernel(commandQueue, ApplyWhiteningAR4Kernel, 3, NULL, globalWorkSizeApplyWhiteningAR4, localWorkSizeApplyWhiteningAR4, 0, NULL, NULL);
+					break;
+
+				case KERNEL_BENCHMARK_PERMUTATION:
+					clSetKernelArg(GeneratePermutedVolumesFirstLevelKernel, 0, sizeof(cl_mem), &d_Permuted);
+					clSetKernelArg(GeneratePermutedVolumesFirstLevelKernel, 1, sizeof(cl_mem), &d_Output);
+					clSetKernelArg(GeneratePermutedVolumesFirstLevelKernel, 2, sizeof(cl_mem), &d_AR1);
+					clSetKernelArg(GeneratePermutedVolumesFirstLevelKernel, 3, sizeof(cl_mem), &d_AR2);
+					clSetKernelArg(GeneratePermutedVolumesFirstLevelKernel, 4, sizeof(cl_mem), &d_AR3);
+					clSetKernelArg(GeneratePermutedVolumesFirstLevelKernel, 5, sizeof(cl_mem), &d_AR4);
+					clSetKernelArg(GeneratePermutedVolumesFirstLevelKernel, 6, sizeof(cl_mem), &d_Mask);
+					clSetKernelArg(GeneratePermutedVolumesFirstLevelKernel, 7, sizeof(cl_mem), &c_Permutation);
+					clSetKernelArg(GeneratePermutedVolumesFirstLevelKernel, 8, sizeof(int),    &DATA_W);
+					clSetKernelArg(GeneratePermutedVolumesFirstLevelKernel, 9, sizeof(int),    &DATA_H);
+					clSetKernelArg(GeneratePermutedVolumesFirstLevelKernel, 10, sizeof(int),   &DATA_D);
+					clSetKernelArg(GeneratePermutedVolumesFirstLevelKernel, 11, sizeof(int),   &DATA_T);
+					runKernelErrorGeneratePermutedVolumesFirstLevel = clEnqueueNDRangeKernel(commandQueue, GeneratePermutedVolumesFirstLevelKernel, 3, NULL, globalWorkSizeGeneratePermutedVolumesFirstLevel, localWorkSizeGeneratePermutedVolumesFirstLevel, 0, NULL, NULL);
+					break;
+
+				case KERNEL_BENCHMARK_CLUSTERIZE:
+					ClusterizeOpenCL(d_Cluster_Indices_, d_Cluster_Sizes_, d_Statistical_Map, clusterThreshold, d_Mask, DATA_W, DATA_H, DATA_D, 0);
+					break;
+
+				case KERNEL_BENCHMARK_TFCE:
+					// Same as the TFCE in the permutation test, clustering and TFCE contributions for each threshold
+					SetMemory(d_TFCE, 0.0f, N);
+					for (int threshold = 1; threshold <= KERNEL_BENCHMARK_TFCE_THRESHOLDS; threshold++)
+					{
+						float tfceThreshold = (float)threshold * tfceDelta;
+						ClusterizeOpenCL(d_Cluster_Indices_, d_Cluster_Sizes_, d_Statistical_Map, tfceThreshold, d_Mask, DATA_W, DATA_H, DATA_D, 0);
+
+						clSetKernelArg(CalculateTFCEValuesKernel, 0, sizeof(cl_mem), &d_TFCE);
+						clSetKernelArg(CalculateTFCEValuesKernel, 1, sizeof(cl_mem), &d_Mask);
+						clSetKernelArg(CalculateTFCEValuesKernel, 2, sizeof(float),  &tfceThreshold);
+						clSetKernelArg(CalculateTFCEValuesKernel, 3, sizeof(cl_mem), &d_Cluster_Indices_);
+						clSetKernelArg(CalculateTFCEValuesKernel, 4, sizeof(cl_mem), &d_Cluster_Sizes_);
+						clSetKernelArg(CalculateTFCEValuesKernel, 5, sizeof(int),    &DATA_W);
+						clSetKernelArg(CalculateTFCEValuesKernel, 6, sizeof(int),    &DATA_H);
+						clSetKernelArg(CalculateTFCEValuesKernel, 7, sizeof(int),    &DATA_D);
+						runKernelErrorCalculateTFCEValues = clEnqueueNDRangeKernel(commandQueue, CalculateTFCEValuesKernel, 3, NULL, globalWorkSizeClusterize, localWorkSizeClusterize, 0, NULL, NULL);
+						clFinish(commandQueue);
+					}
+					break;
+
+				case KERNEL_BENCHMARK_MAX_REDUCTION:
+					CalculateMax(d_Volume, DATA_W, DATA_H, DATA_D);
+					break;
+
+				case KERNEL_BENCHMARK_SUM_REDUCTION:
+				{
+					float* h_Sums = (float*)malloc(DATA_T * sizeof(float));
+					CalculateSums(h_Sums, d_Volumes, d_Mask, DATA_W, DATA_H, DATA_D, DATA_T);
+					free(h_Sums);
+					break;
+				}
+
+				case KERNEL_BENCHMARK_SEARCHLIGHT_RADIUS_2:
+				case KERNEL_BENCHMARK_SEARCHLIGHT_RADIUS_3:
+				case KERNEL_BENCHMARK_SEARCHLIGHT_RADIUS_4:
+				case KERNEL_BENCHMARK_SEARCHLIGHT_RADIUS_5:
+				case KERNEL_BENCHMARK_SEARCHLIGHT_RADIUS_6:
+					CalculateStatisticalMapSearchlightSphere(d_Statistical_Map, d_Volumes, d_Mask, c_Classes, c_Volume_Indices, c_Fold_Starts, searchlightVoxelIndices, DATA_W, DATA_H, DATA_D, searchlightVolumes, searchlightFolds, 0.5f);
+					break;
+			}
+			clFinish(commandQueue);
+		}
+
+		result.time = (GetTime() - start) / (double)repetitions;
+		results.push_back(result);
+
+		if ((WRAPPER == BASH) && VERBOS)
+		{
+			printf("%s took %f ms\n", result.name.c_str(), (float)(result.time * 1000.0));
+		}
+	}
+
+	INFERENCE_MODE = OLD_INFERENCE_MODE;
+	SEARCHLIGHT_RADIUS = OLD_SEARCHLIGHT_RADIUS;
+	MNI_VOXEL_SIZE_X = OLD_MNI_VOXEL_SIZE_X;
+	MNI_VOXEL_SIZE_Y = OLD_MNI_VOXEL_SIZE_Y;
+	MNI_VOXEL_SIZE_Z = OLD_MNI_VOXEL_SIZE_Z;
+
+	free(h_Volumes);
+	free(h_Noise);
+	free(h_Mask);
+	free(h_X);
+	free(h_xtxxt);
+	free(h_Contrasts_);
+	free(h_ctxtxc_TTest);
+	free(h_ctxtxc_FTest);
+	free(h_Permutation);
+	free(h_Filter_X);
+	free(h_Filter_Y);
+	free(h_Filter_Z);
+	free(h_Parameters);
+	free(h_Quadrature_Filters);
+	free(h_Classes);
+
+	for (int i = 0; i < numberOfBuffers; i++)
+	{
+		clReleaseMemObject(allBuffers[i]);
+	}
+
+	return results;
+}
+
+const char* BROCCOLI_LIB::GetOpenCLDeviceName()
+{
+	return deviceName.c_str();
+}
+
+const char* BROCCOLI_LIB::GetOpenCLPlatformName()
+{
+	return platformName.c_str();
+}
+
+// Creates OpenCL programs from binary files
+void BROCCOLI_LIB::CreateProgramFromBinary(cl_context context, cl_device_id device, std::string filename)
+{
+	for (int k = 0; k < NUMBER_OF_KERNEL_FILES; k++)
+	{
+		std::string thisFilename = filename;
+
+		// Get device name and remove spaces, add to filename
+		char* value;
+		size_t valueSize;
+		std::string device_name;
+		clGetDeviceInfo(device, CL_DEVICE_NAME, 0, NULL, &valueSize);
+		value = (char*) malloc(valueSize);
+		clGetDeviceInfo(device, CL_DEVICE_NAME, valueSize, value, NULL);            
+		thisFilename.append("_");
+		device_name = value;
+		device_name.erase(std::remove (device_name.begin(), device_name.end(), ' '), device_name.end());
+		thisFilename.append(device_name);			
 
 		// Remove ".cpp" and "kernel" from kernel name and add kernel name
 		std::string name = kernelFileNames[k];
@@ -1324,7 +2618,8 @@ bool BROCCOLI_LIB::OpenCLInitiate(cl_uint OPENCL_PLATFORM, cl_uint OPENCL_DEVICE
 	}
 
 	// Create a command queue for the selected device
-	commandQueue = clCreateCommandQueue(context, deviceIds[OPENCL_DEVICE], CL_QUEUE_PROFILING_ENABLE, &error);
+	device = deviceIds[OPENCL_DEVICE];
+	commandQueue = clCreateCommandQueue(context, device, PROFILING ? CL_QUEUE_PROFILING_ENABLE : 0, &error);
 
 	if (error != SUCCESS)
 	{
@@ -1543,6 +2838,9 @@ bool BROCCOLI_LIB::OpenCLInitiate(cl_uint OPENCL_PLATFORM, cl_uint OPENCL_DEVICE
 	clGetDeviceInfo(deviceIds[OPENCL_DEVICE], CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(globalMemorySize), &globalMemorySize, NULL); 
 	globalMemorySize /= (1024*1024);
 
+	// Find out the largest buffer that can be allocated
+	clGetDeviceInfo(deviceIds[OPENCL_DEVICE], CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(maxMemoryAllocationSize), &maxMemoryAllocationSize, NULL);
+
 	// Find out the size of the local (shared) memory in KB
 	clGetDeviceInfo(deviceIds[OPENCL_DEVICE], CL_DEVICE_LOCAL_MEM_SIZE, sizeof(localMemorySize), &localMemorySize, NULL);            
 	localMemorySize /= 1024;            
@@ -1558,6 +2856,18 @@ bool BROCCOLI_LIB::OpenCLInitiate(cl_uint OPENCL_PLATFORM, cl_uint OPENCL_DEVICE
 		printf("The selected OpenCL device has %i KB of local memory, %i MB of global memory, and can run %i threads per thread block, max threads per dimension are %i %i %i\n",(int)localMemorySize,(int)globalMemorySize,(int)maxThreadsPerBlock,(int)maxThreadsPerDimension[0],(int)maxThreadsPerDimension[1],(int)maxThreadsPerDimension[2]);
 	}
 
+	// Images are emulated in software on CPUs, interpolating directly from buffers is faster and avoids copying each volume to an image
+	cl_device_type deviceType = 0;
+	cl_bool imageSupport = CL_FALSE;
+	clGetDeviceInfo(deviceIds[OPENCL_DEVICE], CL_DEVICE_TYPE, sizeof(deviceType), &deviceType, NULL);
+	clGetDeviceInfo(deviceIds[OPENCL_DEVICE], CL_DEVICE_IMAGE_SUPPORT, sizeof(imageSupport), &imageSupport, NULL);
+	USE_BUFFER_INTERPOLATION = ((deviceType & CL_DEVICE_TYPE_CPU) != 0) || (imageSupport == CL_FALSE);
+
+	if ( (WRAPPER == BASH) && VERBOS )
+	{
+		printf("Using %s for interpolation\n", USE_BUFFER_INTERPOLATION ? "buffers" : "images");
+	}
+
 	// Create kernels
 	
 	// Non-separable convolution kernel using 32 KB of shared memory and 512 threads per thread block (32 * 16)
@@ -1608,9 +2918,9 @@ bool BROCCOLI_LIB::OpenCLInitiate(cl_uint OPENCL_PLATFORM, cl_uint OPENCL_DEVICE
 	OpenCLKernels[2] = SeparableConvolutionColumnsKernel;
 	OpenCLKernels[3] = SeparableConvolutionRodsKernel;
 
-	SliceTimingCorrectionKernel = clCreateKernel(OpenCLPrograms[3],"SliceTimingCorrection",&createKernelErrorSliceTimingCorrection);
+	SliceTimingCorrectionSlicesKernel = clCreateKernel(OpenCLPrograms[3],"SliceTimingCorrectionSlices",&createKernelErrorSliceTimingCorrectionSlices);
 
-	OpenCLKernels[4] = SliceTimingCorrectionKernel;
+	OpenCLKernels[4] = SliceTimingCorrectionSlicesKernel;
 
 	// Kernels for linear registration
 	CalculatePhaseDifferencesAndCertaintiesKernel = clCreateKernel(OpenCLPrograms[1],"CalculatePhaseDifferencesAndCertainties",&createKernelErrorCalculatePhaseDifferencesAndCertainties);
@@ -1714,12 +3024,12 @@ bool BROCCOLI_LIB::OpenCLInitiate(cl_uint OPENCL_PLATFORM, cl_uint OPENCL_DEVICE
 	OpenCLKernels[50] = RemoveMeanKernel;
 
 	// Interpolation kernels
-	InterpolateVolumeNearestLinearKernel = clCreateKernel(OpenCLPrograms[1],"InterpolateVolumeNearestLinear",&createKernelErrorInterpolateVolumeNearestLinear);
-	InterpolateVolumeLinearLinearKernel = clCreateKernel(OpenCLPrograms[1],"InterpolateVolumeLinearLinear",&createKernelErrorInterpolateVolumeLinearLinear);
-	InterpolateVolumeCubicLinearKernel = clCreateKernel(OpenCLPrograms[1],"InterpolateVolumeCubicLinear",&createKernelErrorInterpolateVolumeCubicLinear);
-	InterpolateVolumeNearestNonLinearKernel = clCreateKernel(OpenCLPrograms[1],"InterpolateVolumeNearestNonLinear",&createKernelErrorInterpolateVolumeNearestNonLinear);
-	InterpolateVolumeLinearNonLinearKernel = clCreateKernel(OpenCLPrograms[1],"InterpolateVolumeLinearNonLinear",&createKernelErrorInterpolateVolumeLinearNonLinear);
-	InterpolateVolumeCubicNonLinearKernel = clCreateKernel(OpenCLPrograms[1],"InterpolateVolumeCubicNonLinear",&createKernelErrorInterpolateVolumeCubicNonLinear);
+	InterpolateVolumeNearestLinearKernel = clCreateKernel(OpenCLPrograms[1],USE_BUFFER_INTERPOLATION ? "InterpolateVolumeNearestLinearBuffer" : "InterpolateVolumeNearestLinear",&createKernelErrorInterpolateVolumeNearestLinear);
+	InterpolateVolumeLinearLinearKernel = clCreateKernel(OpenCLPrograms[1],USE_BUFFER_INTERPOLATION ? "InterpolateVolumeLinearLinearBuffer" : "InterpolateVolumeLinearLinear",&createKernelErrorInterpolateVolumeLinearLinear);
+	InterpolateVolumeCubicLinearKernel = clCreateKernel(OpenCLPrograms[1],USE_BUFFER_INTERPOLATION ? "InterpolateVolumeCubicLinearBuffer" : "InterpolateVolumeCubicLinear",&createKernelErrorInterpolateVolumeCubicLinear);
+	InterpolateVolumeNearestNonLinearKernel = clCreateKernel(OpenCLPrograms[1],USE_BUFFER_INTERPOLATION ? "InterpolateVolumeNearestNonLinearBuffer" : "InterpolateVolumeNearestNonLinear",&createKernelErrorInterpolateVolumeNearestNonLinear);
+	InterpolateVolumeLinearNonLinearKernel = clCreateKernel(OpenCLPrograms[1],USE_BUFFER_INTERPOLATION ? "InterpolateVolumeLinearNonLinearBuffer" : "InterpolateVolumeLinearNonLinear",&createKernelErrorInterpolateVolumeLinearNonLinear);
+	InterpolateVolumeCubicNonLinearKernel = clCreateKernel(OpenCLPrograms[1],USE_BUFFER_INTERPOLATION ? "InterpolateVolumeCubicNonLinearBuffer" : "InterpolateVolumeCubicNonLinear",&createKernelErrorInterpolateVolumeCubicNonLinear);
 
 	OpenCLKernels[51] = InterpolateVolumeNearestLinearKernel;
 	OpenCLKernels[52] = InterpolateVolumeLinearLinearKernel;
@@ -1728,9 +3038,21 @@ bool BROCCOLI_LIB::OpenCLInitiate(cl_uint OPENCL_PLATFORM, cl_uint OPENCL_DEVICE
 	OpenCLKernels[55] = InterpolateVolumeLinearNonLinearKernel;
 	OpenCLKernels[56] = InterpolateVolumeCubicNonLinearKernel;
 
-	RescaleVolumeLinearKernel = clCreateKernel(OpenCLPrograms[1],"RescaleVolumeLinear",&createKernelErrorRescaleVolumeLinear);
-	RescaleVolumeCubicKernel = clCreateKernel(OpenCLPrograms[1],"RescaleVolumeCubic",&createKernelErrorRescaleVolumeCubic);
-	RescaleVolumeNearestKernel = clCreateKernel(OpenCLPrograms[1],"RescaleVolumeNearest",&createKernelErrorRescaleVolumeNearest);
+	InterpolateVolumeNearestComposedKernel = clCreateKernel(OpenCLPrograms[1],USE_BUFFER_INTERPOLATION ? "InterpolateVolumeNearestComposedBuffer" : "InterpolateVolumeNearestComposed",&createKernelErrorInterpolateVolumeNearestComposed);
+	InterpolateVolumeLinearComposedKernel = clCreateKernel(OpenCLPrograms[1],USE_BUFFER_INTERPOLATION ? "InterpolateVolumeLinearComposedBuffer" : "InterpolateVolumeLinearComposed",&createKernelErrorInterpolateVolumeLinearComposed);
+	InterpolateVolumeCubicComposedKernel = clCreateKernel(OpenCLPrograms[1],USE_BUFFER_INTERPOLATION ? "InterpolateVolumeCubicComposedBuffer" : "InterpolateVolumeCubicComposed",&createKernelErrorInterpolateVolumeCubicComposed);
+
+	OpenCLKernels[106] = InterpolateVolumeNearestComposedKernel;
+	OpenCLKernels[107] = InterpolateVolumeLinearComposedKernel;
+	OpenCLKernels[108] = InterpolateVolumeCubicComposedKernel;
+
+	SliceTimingAndMotionCorrectionKernel = clCreateKernel(OpenCLPrograms[1],"SliceTimingAndMotionCorrection",&createKernelErrorSliceTimingAndMotionCorrection);
+
+	OpenCLKernels[109] = SliceTimingAndMotionCorrectionKernel;
+
+	RescaleVolumeLinearKernel = clCreateKernel(OpenCLPrograms[1],USE_BUFFER_INTERPOLATION ? "RescaleVolumeLinearBuffer" : "RescaleVolumeLinear",&createKernelErrorRescaleVolumeLinear);
+	RescaleVolumeCubicKernel = clCreateKernel(OpenCLPrograms[1],USE_BUFFER_INTERPOLATION ? "RescaleVolumeCubicBuffer" : "RescaleVolumeCubic",&createKernelErrorRescaleVolumeCubic);
+	RescaleVolumeNearestKernel = clCreateKernel(OpenCLPrograms[1],USE_BUFFER_INTERPOLATION ? "RescaleVolumeNearestBuffer" : "RescaleVolumeNearest",&createKernelErrorRescaleVolumeNearest);
 
 	OpenCLKernels[57] = RescaleVolumeLinearKernel;
 	OpenCLKernels[58] = RescaleVolumeCubicKernel;
@@ -1822,8 +3144,10 @@ bool BROCCOLI_LIB::OpenCLInitiate(cl_uint OPENCL_PLATFORM, cl_uint OPENCL_DEVICE
 
 	// Bayesian kernels
 	CalculateStatisticalMapsGLMBayesianKernel = clCreateKernel(OpenCLPrograms[10],"CalculateStatisticalMapsGLMBayesian",&createKernelErrorCalculateStatisticalMapsGLMBayesian);
+	CalculateStatisticalMapsGLMBayesianMultiChainKernel = clCreateKernel(OpenCLPrograms[10],"CalculateStatisticalMapsGLMBayesianMultiChain",&createKernelErrorCalculateStatisticalMapsGLMBayesianMultiChain);
 
 	OpenCLKernels[95] = CalculateStatisticalMapsGLMBayesianKernel;
+	OpenCLKernels[113] = CalculateStatisticalMapsGLMBayesianMultiChainKernel;
 
 	// Whitening kernels	
 	EstimateAR4ModelsKernel = clCreateKernel(OpenCLPrograms[9],"EstimateAR4Models",&createKernelErrorEstimateAR4Models);
@@ -1840,8 +3164,28 @@ bool BROCCOLI_LIB::OpenCLInitiate(cl_uint OPENCL_PLATFORM, cl_uint OPENCL_DEVICE
 
     // Searchlight kernels
     CalculateStatisticalMapSearchlightKernel = clCreateKernel(OpenCLPrograms[11],"CalculateStatisticalMapSearchlight",&createKernelErrorCalculateStatisticalMapSearchlight);
+    CalculateStatisticalMapSearchlightClosedFormKernel = clCreateKernel(OpenCLPrograms[11],"CalculateStatisticalMapSearchlightClosedForm",&createKernelErrorCalculateStatisticalMapSearchlightClosedForm);
+    CalculateStatisticalMapSearchlightSphereKernel = clCreateKernel(OpenCLPrograms[11],"CalculateStatisticalMapSearchlightSphere",&createKernelErrorCalculateStatisticalMapSearchlightSphere);
+    CalculateStatisticalMapsSearchlightRidgePermutationKernel = clCreateKernel(OpenCLPrograms[11],"CalculateStatisticalMapsSearchlightRidgePermutation",&createKernelErrorCalculateStatisticalMapsSearchlightRidgePermutation);
     
     OpenCLKernels[101] = CalculateStatisticalMapSearchlightKernel;
+    OpenCLKernels[110] = CalculateStatisticalMapSearchlightClosedFormKernel;
+    OpenCLKernels[111] = CalculateStatisticalMapSearchlightSphereKernel;
+    OpenCLKernels[112] = CalculateStatisticalMapsSearchlightRidgePermutationKernel;
+
+	// Reduction kernels
+	ReduceVolumesKernel = clCreateKernel(OpenCLPrograms[3],"ReduceVolumes",&createKernelErrorReduceVolumes);
+	ReduceVolumesFinalKernel = clCreateKernel(OpenCLPrograms[3],"ReduceVolumesFinal",&createKernelErrorReduceVolumesFinal);
+	CalculateMassMomentsKernel = clCreateKernel(OpenCLPrograms[3],"CalculateMassMoments",&createKernelErrorCalculateMassMoments);
+
+	OpenCLKernels[102] = ReduceVolumesKernel;
+	OpenCLKernels[103] = ReduceVolumesFinalKernel;
+	OpenCLKernels[104] = CalculateMassMomentsKernel;
+
+	// ICA kernels
+	FastICANonlinearityKernel = clCreateKernel(OpenCLPrograms[3],"FastICANonlinearity",&createKernelErrorFastICANonlinearity);
+
+	OpenCLKernels[105] = FastICANonlinearityKernel;
     
 	OPENCL_INITIATED = true;
 
@@ -1893,7 +3237,7 @@ const char* BROCCOLI_LIB::GetOpenCLKernelName(int kernel)
 			return "SeparableConvolutionRods";
 			break;
 		case 4:
-			return "SliceTimingCorrection";
+			return "SliceTimingCorrectionSlices";
 			break;
 		case 5:
 			return "CalculatePhaseDifferencesAndCertainties";
@@ -2190,6 +3534,42 @@ const char* BROCCOLI_LIB::GetOpenCLKernelName(int kernel)
         case 101:
             return "CalculateStatisticalMapSearchlight";
             break;
+		case 102:
+			return "ReduceVolumes";
+			break;
+		case 103:
+			return "ReduceVolumesFinal";
+			break;
+		case 104:
+			return "CalculateMassMoments";
+			break;
+		case 105:
+			return "FastICANonlinearity";
+			break;
+		case 106:
+			return "InterpolateVolumeNearestComposed";
+			break;
+		case 107:
+			return "InterpolateVolumeLinearComposed";
+			break;
+		case 108:
+			return "InterpolateVolumeCubicComposed";
+			break;
+		case 109:
+			return "SliceTimingAndMotionCorrection";
+			break;
+		case 110:
+			return "CalculateStatisticalMapSearchlightClosedForm";
+			break;
+		case 111:
+			return "CalculateStatisticalMapSearchlightSphere";
+			break;
+		case 112:
+			return "CalculateStatisticalMapsSearchlightRidgePermutation";
+			break;
+		case 113:
+			return "CalculateStatisticalMapsGLMBayesianMultiChain";
+			break;
             
             
 		default:
@@ -2204,7 +3584,7 @@ int* BROCCOLI_LIB::GetOpenCLCreateKernelErrors()
 	OpenCLCreateKernelErrors[2] = createKernelErrorSeparableConvolutionColumns;
 	OpenCLCreateKernelErrors[3] = createKernelErrorSeparableConvolutionRods;
 
-	OpenCLCreateKernelErrors[4] = createKernelErrorSliceTimingCorrection;
+	OpenCLCreateKernelErrors[4] = createKernelErrorSliceTimingCorrectionSlices;
 
 	OpenCLCreateKernelErrors[5] = createKernelErrorCalculatePhaseDifferencesAndCertainties;
 	OpenCLCreateKernelErrors[6] = createKernelErrorCalculatePhaseGradientsX;
@@ -2310,6 +3690,21 @@ int* BROCCOLI_LIB::GetOpenCLCreateKernelErrors()
 	OpenCLCreateKernelErrors[100] = createKernelErrorGeneratePermutedVolumesFirstLevel;
     
     OpenCLCreateKernelErrors[101] = createKernelErrorCalculateStatisticalMapSearchlight;
+
+	OpenCLCreateKernelErrors[102] = createKernelErrorReduceVolumes;
+	OpenCLCreateKernelErrors[103] = createKernelErrorReduceVolumesFinal;
+	OpenCLCreateKernelErrors[104] = createKernelErrorCalculateMassMoments;
+
+	OpenCLCreateKernelErrors[105] = createKernelErrorFastICANonlinearity;
+
+	OpenCLCreateKernelErrors[106] = createKernelErrorInterpolateVolumeNearestComposed;
+	OpenCLCreateKernelErrors[107] = createKernelErrorInterpolateVolumeLinearComposed;
+	OpenCLCreateKernelErrors[108] = createKernelErrorInterpolateVolumeCubicComposed;
+	OpenCLCreateKernelErrors[109] = createKernelErrorSliceTimingAndMotionCorrection;
+	OpenCLCreateKernelErrors[110] = createKernelErrorCalculateStatisticalMapSearchlightClosedForm;
+	OpenCLCreateKernelErrors[111] = createKernelErrorCalculateStatisticalMapSearchlightSphere;
+	OpenCLCreateKernelErrors[112] = createKernelErrorCalculateStatisticalMapsSearchlightRidgePermutation;
+	OpenCLCreateKernelErrors[113] = createKernelErrorCalculateStatisticalMapsGLMBayesianMultiChain;
     
 	return OpenCLCreateKernelErrors;
 }
@@ -2321,7 +3716,7 @@ int* BROCCOLI_LIB::GetOpenCLRunKernelErrors()
 	OpenCLRunKernelErrors[2] = runKernelErrorSeparableConvolutionColumns;
 	OpenCLRunKernelErrors[3] = runKernelErrorSeparableConvolutionRods;
 
-	OpenCLRunKernelErrors[4] = runKernelErrorSliceTimingCorrection;
+	OpenCLRunKernelErrors[4] = runKernelErrorSliceTimingCorrectionSlices;
 
 	OpenCLRunKernelErrors[5] = runKernelErrorCalculatePhaseDifferencesAndCertainties;
 	OpenCLRunKernelErrors[6] = runKernelErrorCalculatePhaseGradientsX;
@@ -2427,6 +3822,21 @@ int* BROCCOLI_LIB::GetOpenCLRunKernelErrors()
 	OpenCLRunKernelErrors[100] = runKernelErrorGeneratePermutedVolumesFirstLevel;
     
     OpenCLRunKernelErrors[101] = runKernelErrorCalculateStatisticalMapSearchlight;
+
+	OpenCLRunKernelErrors[102] = runKernelErrorReduceVolumes;
+	OpenCLRunKernelErrors[103] = runKernelErrorReduceVolumesFinal;
+	OpenCLRunKernelErrors[104] = runKernelErrorCalculateMassMoments;
+
+	OpenCLRunKernelErrors[105] = runKernelErrorFastICANonlinearity;
+
+	OpenCLRunKernelErrors[106] = runKernelErrorInterpolateVolumeNearestComposed;
+	OpenCLRunKernelErrors[107] = runKernelErrorInterpolateVolumeLinearComposed;
+	OpenCLRunKernelErrors[108] = runKernelErrorInterpolateVolumeCubicComposed;
+	OpenCLRunKernelErrors[109] = runKernelErrorSliceTimingAndMotionCorrection;
+	OpenCLRunKernelErrors[110] = runKernelErrorCalculateStatisticalMapSearchlightClosedForm;
+	OpenCLRunKernelErrors[111] = runKernelErrorCalculateStatisticalMapSearchlightSphere;
+	OpenCLRunKernelErrors[112] = runKernelErrorCalculateStatisticalMapsSearchlightRidgePermutation;
+	OpenCLRunKernelErrors[113] = runKernelErrorCalculateStatisticalMapsGLMBayesianMultiChain;
     
 	return OpenCLRunKernelErrors;
 }
@@ -2435,6 +3845,8 @@ int* BROCCOLI_LIB::GetOpenCLRunKernelErrors()
 // Cleans up all the OpenCL variables when the BROCCOLI instance is destroyed
 void BROCCOLI_LIB::OpenCLCleanup()
 {
+	CollectProfilingEvents();
+
 	if (OPENCL_INITIATED)
 	{
 		// Release all kernels
@@ -2448,6 +3860,10 @@ void BROCCOLI_LIB::OpenCLCleanup()
 			}
 		}
 
+		// Release all buffers held by the buffer pool, and the template assets on the device
+		ReleaseDeviceBufferPool();
+		ReleaseTemplateDeviceAssets();
+
 		// Release programs, command queue and context
 		for (int k = 0; k < NUMBER_OF_KERNEL_FILES; k++)
 		{	
@@ -3178,6 +4594,34 @@ void BROCCOLI_LIB::SetGlobalAndLocalWorkSizesCalculateMax(int DATA_W, int DATA_H
 	globalWorkSizeCalculateRowMaxs[2] = 1;
 }
 
+// The reduction uses one dimensional work-groups (power of two) that loop over the data, the second dimension selects the volume
+void BROCCOLI_LIB::SetGlobalAndLocalWorkSizesReduceVolumes(size_t N, size_t NUMBER_OF_VOLUMES)
+{
+	size_t localSize = 1;
+	while ( ((localSize * 2) <= REDUCTION_LOCAL_SIZE) && ((localSize * 2) <= maxThreadsPerBlock) && ((localSize * 2) <= maxThreadsPerDimension[0]) )
+	{
+		localSize *= 2;
+	}
+
+	localWorkSizeReduceVolumes[0] = localSize;
+	localWorkSizeReduceVolumes[1] = 1;
+	localWorkSizeReduceVolumes[2] = 1;
+
+	// Calculate how many blocks are required, each work item handles several elements if there are more than MAX_REDUCTION_GROUPS blocks
+	xBlocks = (size_t)ceil((float)N / (float)localWorkSizeReduceVolumes[0]);
+	xBlocks = mymin((int)xBlocks, MAX_REDUCTION_GROUPS);
+	xBlocks = mymax((int)xBlocks, 1);
+
+	globalWorkSizeReduceVolumes[0] = xBlocks * localWorkSizeReduceVolumes[0];
+	globalWorkSizeReduceVolumes[1] = NUMBER_OF_VOLUMES;
+	globalWorkSizeReduceVolumes[2] = 1;
+
+	// One block per volume for the final pass
+	globalWorkSizeReduceVolumesFinal[0] = localWorkSizeReduceVolumes[0];
+	globalWorkSizeReduceVolumesFinal[1] = NUMBER_OF_VOLUMES;
+	globalWorkSizeReduceVolumesFinal[2] = 1;
+}
+
 
 void BROCCOLI_LIB::SetGlobalAndLocalWorkSizesCalculateMagnitudes(int DATA_W, int DATA_H, int DATA_D)
 {
@@ -3413,40 +4857,208 @@ void BROCCOLI_LIB::SetGlobalAndLocalWorkSizesSearchlight(int DATA_W, int DATA_H,
     globalWorkSizeCalculateStatisticalMapSearchlight[0] = xBlocks * localWorkSizeCalculateStatisticalMapSearchlight[0];
     globalWorkSizeCalculateStatisticalMapSearchlight[1] = yBlocks * localWorkSizeCalculateStatisticalMapSearchlight[1];
     globalWorkSizeCalculateStatisticalMapSearchlight[2] = zBlocks * localWorkSizeCalculateStatisticalMapSearchlight[2];
-}
 
+    // The closed form classifiers use much more private memory per thread
+    localWorkSizeCalculateStatisticalMapSearchlightClosedForm[0] = 16;
+    localWorkSizeCalculateStatisticalMapSearchlightClosedForm[1] = 4;
+    localWorkSizeCalculateStatisticalMapSearchlightClosedForm[2] = 1;
 
+    xBlocks = (size_t)ceil((float)DATA_W / (float)localWorkSizeCalculateStatisticalMapSearchlightClosedForm[0]);
+    yBlocks = (size_t)ceil((float)DATA_H / (float)localWorkSizeCalculateStatisticalMapSearchlightClosedForm[1]);
+    zBlocks = (size_t)ceil((float)DATA_D / (float)localWorkSizeCalculateStatisticalMapSearchlightClosedForm[2]);
 
+    globalWorkSizeCalculateStatisticalMapSearchlightClosedForm[0] = xBlocks * localWorkSizeCalculateStatisticalMapSearchlightClosedForm[0];
+    globalWorkSizeCalculateStatisticalMapSearchlightClosedForm[1] = yBlocks * localWorkSizeCalculateStatisticalMapSearchlightClosedForm[1];
+    globalWorkSizeCalculateStatisticalMapSearchlightClosedForm[2] = zBlocks * localWorkSizeCalculateStatisticalMapSearchlightClosedForm[2];
+}
 
-// Set functions for GUI / Wrappers
+// Offsets (x, y, z) of all voxels within SEARCHLIGHT_RADIUS, the radius is given in voxels of the smallest voxel size
+int BROCCOLI_LIB::CreateSearchlightSphereOffsets(std::vector<cl_int>& offsets)
+{
+	float voxelSize = mymin(mymin(MNI_VOXEL_SIZE_X, MNI_VOXEL_SIZE_Y), MNI_VOXEL_SIZE_Z);
+	float radius = SEARCHLIGHT_RADIUS * voxelSize;
 
+	int RX = (int)floor(radius / MNI_VOXEL_SIZE_X);
+	int RY = (int)floor(radius / MNI_VOXEL_SIZE_Y);
+	int RZ = (int)floor(radius / MNI_VOXEL_SIZE_Z);
 
-void BROCCOLI_LIB::SetInputfMRIVolumes(float* data)
-{
-	h_fMRI_Volumes = data;
-    //    debugVolumeInfo("fMRI", EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, EPI_DATA_T, data);
-}
+	offsets.clear();
+	for (int z = -RZ; z <= RZ; z++)
+	{
+		for (int y = -RY; y <= RY; y++)
+		{
+			for (int x = -RX; x <= RX; x++)
+			{
+				float dx = (float)x * MNI_VOXEL_SIZE_X;
+				float dy = (float)y * MNI_VOXEL_SIZE_Y;
+				float dz = (float)z * MNI_VOXEL_SIZE_Z;
 
-void BROCCOLI_LIB::SetInputEPIVolume(float* data)
-{
-	h_EPI_Volume = data;
-    //    debugVolumeInfo("EPI", EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, data);
-}
+				if ( (dx*dx + dy*dy + dz*dz) <= (radius * radius * 1.0001f) )
+				{
+					offsets.push_back(x);
+					offsets.push_back(y);
+					offsets.push_back(z);
+				}
+			}
+		}
+	}
 
-void BROCCOLI_LIB::SetInputCertainty(float* data)
-{
-	h_Certainty = data;
+	return (int)offsets.size() / 3;
 }
 
-void BROCCOLI_LIB::SetInputT1Volume(float* data)
+// Orders the uncensored volumes for stratified k-fold cross validation, fold f is volumeIndices[foldStarts[f]] ... volumeIndices[foldStarts[f + 1] - 1].
+// The volumes of class 0 and then class 1 are dealt to the folds in turn, such that each fold has the same proportion of the classes
+// (within one volume) and the fold sizes differ by at most one, with as many folds as volumes this is leave one out cross validation
+void BROCCOLI_LIB::CreateSearchlightFolds(std::vector<cl_int>& volumeIndices, std::vector<cl_int>& foldStarts, int folds, float* classes)
 {
-	h_T1_Volume = data;
-    //    debugVolumeInfo("T1", T1_DATA_W, T1_DATA_H, T1_DATA_D, data);
+	std::vector< std::vector<cl_int> > foldVolumes(folds);
+
+	int v = 0;
+	for (int c = 0; c < 2; c++)
+	{
+		for (size_t i = 0; i < volumeIndices.size(); i++)
+		{
+			bool class0 = (classes[volumeIndices[i]] == 0.0f);
+			if (class0 == (c == 0))
+			{
+				foldVolumes[v % folds].push_back(volumeIndices[i]);
+				v++;
+			}
+		}
+	}
+
+	volumeIndices.clear();
+	foldStarts.clear();
+	for (int f = 0; f < folds; f++)
+	{
+		foldStarts.push_back((cl_int)volumeIndices.size());
+		volumeIndices.insert(volumeIndices.end(), foldVolumes[f].begin(), foldVolumes[f].end());
+	}
+	foldStarts.push_back((cl_int)volumeIndices.size());
 }
 
-void BROCCOLI_LIB::SetInputMNIVolume(float* data)
+// Diagonal LDA searchlight for spheres of SEARCHLIGHT_RADIUS, one work group for each voxel in voxelIndices. Each work group needs a
+// feature matrix of sphereVoxels x uncensoredVolumes values in global memory, so the voxels are divided into several runs if necessary
+cl_int BROCCOLI_LIB::CalculateStatisticalMapSearchlightSphere(cl_mem d_Maps, cl_mem d_Volumes, cl_mem d_Mask, cl_mem c_Classes, cl_mem c_Volume_Indices, cl_mem c_Fold_Starts, std::vector<cl_int>& voxelIndices, int DATA_W, int DATA_H, int DATA_D, int uncensoredVolumes, int folds, float regularization)
 {
-	h_MNI_Volume = data;
+	std::vector<cl_int> sphereOffsets;
+	int sphereVoxels = CreateSearchlightSphereOffsets(sphereOffsets);
+
+	if (sphereVoxels > SEARCHLIGHT_MAX_SPHERE_VOXELS)
+	{
+		if ((WRAPPER == BASH) && PRINT)
+		{
+			printf("The searchlight sphere contains %i voxels, but at most %i voxels are supported, not running the searchlight!\n",sphereVoxels,SEARCHLIGHT_MAX_SPHERE_VOXELS);
+		}
+		return CL_INVALID_VALUE;
+	}
+
+	if ( (voxelIndices.size() == 0) || (uncensoredVolumes < 2) )
+	{
+		return CL_SUCCESS;
+	}
+
+	int numberOfVoxels = (int)voxelIndices.size();
+
+	size_t featureBytes = (size_t)sphereVoxels * (size_t)uncensoredVolumes * sizeof(float);
+	size_t maxFeatureBytes = (size_t)SEARCHLIGHT_SPHERE_FEATURES_MB * 1024 * 1024;
+	if (maxMemoryAllocationSize > 0)
+	{
+		maxFeatureBytes = std::min(maxFeatureBytes, (size_t)maxMemoryAllocationSize);
+	}
+	int voxelsPerRun = (int)std::min((size_t)numberOfVoxels, std::max(maxFeatureBytes / featureBytes, (size_t)1));
+
+	c_Searchlight_Sphere_Offsets = clCreateBuffer(context, CL_MEM_READ_ONLY, sphereOffsets.size() * sizeof(cl_int), NULL, NULL);
+	d_Searchlight_Voxel_Indices = clCreateBuffer(context, CL_MEM_READ_ONLY, numberOfVoxels * sizeof(cl_int), NULL, NULL);
+	cl_mem d_Sphere_Features = clCreateBuffer(context, CL_MEM_READ_WRITE, (size_t)voxelsPerRun * featureBytes, NULL, NULL);
+
+	clEnqueueWriteBuffer(commandQueue, c_Searchlight_Sphere_Offsets, CL_TRUE, 0, sphereOffsets.size() * sizeof(cl_int), &sphereOffsets[0], 0, NULL, NULL);
+	clEnqueueWriteBuffer(commandQueue, d_Searchlight_Voxel_Indices, CL_TRUE, 0, numberOfVoxels * sizeof(cl_int), &voxelIndices[0], 0, NULL, NULL);
+
+	localWorkSizeCalculateStatisticalMapSearchlightSphere[0] = SEARCHLIGHT_SPHERE_LOCAL_SIZE;
+	localWorkSizeCalculateStatisticalMapSearchlightSphere[1] = 1;
+	localWorkSizeCalculateStatisticalMapSearchlightSphere[2] = 1;
+
+	globalWorkSizeCalculateStatisticalMapSearchlightSphere[1] = 1;
+	globalWorkSizeCalculateStatisticalMapSearchlightSphere[2] = 1;
+
+	clSetKernelArg(CalculateStatisticalMapSearchlightSphereKernel, 0, sizeof(cl_mem),  &d_Maps);
+	clSetKernelArg(CalculateStatisticalMapSearchlightSphereKernel, 1, sizeof(cl_mem),  &d_Sphere_Features);
+	clSetKernelArg(CalculateStatisticalMapSearchlightSphereKernel, 2, sizeof(cl_mem),  &d_Volumes);
+	clSetKernelArg(CalculateStatisticalMapSearchlightSphereKernel, 3, sizeof(cl_mem),  &d_Mask);
+	clSetKernelArg(CalculateStatisticalMapSearchlightSphereKernel, 4, sizeof(cl_mem),  &d_Searchlight_Voxel_Indices);
+	clSetKernelArg(CalculateStatisticalMapSearchlightSphereKernel, 5, sizeof(cl_mem),  &c_Searchlight_Sphere_Offsets);
+	clSetKernelArg(CalculateStatisticalMapSearchlightSphereKernel, 6, sizeof(cl_mem),  &c_Classes);
+	clSetKernelArg(CalculateStatisticalMapSearchlightSphereKernel, 7, sizeof(cl_mem),  &c_Volume_Indices);
+	clSetKernelArg(CalculateStatisticalMapSearchlightSphereKernel, 8, sizeof(cl_mem),  &c_Fold_Starts);
+	clSetKernelArg(CalculateStatisticalMapSearchlightSphereKernel, 9, sizeof(int),     &DATA_W);
+	clSetKernelArg(CalculateStatisticalMapSearchlightSphereKernel, 10, sizeof(int),    &DATA_H);
+	clSetKernelArg(CalculateStatisticalMapSearchlightSphereKernel, 11, sizeof(int),    &DATA_D);
+	clSetKernelArg(CalculateStatisticalMapSearchlightSphereKernel, 12, sizeof(int),    &sphereVoxels);
+	clSetKernelArg(CalculateStatisticalMapSearchlightSphereKernel, 13, sizeof(int),    &uncensoredVolumes);
+	clSetKernelArg(CalculateStatisticalMapSearchlightSphereKernel, 14, sizeof(int),    &folds);
+	clSetKernelArg(CalculateStatisticalMapSearchlightSphereKernel, 15, sizeof(float),  &regularization);
+
+	double startTime = GetTime();
+
+	runKernelErrorCalculateStatisticalMapSearchlightSphere = CL_SUCCESS;
+	for (int firstVoxel = 0; (firstVoxel < numberOfVoxels) && (runKernelErrorCalculateStatisticalMapSearchlightSphere == CL_SUCCESS); firstVoxel += voxelsPerRun)
+	{
+		int voxels = mymin(voxelsPerRun, numberOfVoxels - firstVoxel);
+		globalWorkSizeCalculateStatisticalMapSearchlightSphere[0] = (size_t)voxels * SEARCHLIGHT_SPHERE_LOCAL_SIZE;
+
+		clSetKernelArg(CalculateStatisticalMapSearchlightSphereKernel, 16, sizeof(int),    &firstVoxel);
+		runKernelErrorCalculateStatisticalMapSearchlightSphere = clEnqueueNDRangeKernel(commandQueue, CalculateStatisticalMapSearchlightSphereKernel, 1, NULL, globalWorkSizeCalculateStatisticalMapSearchlightSphere, localWorkSizeCalculateStatisticalMapSearchlightSphere, 0, NULL, NULL);
+	}
+	clFinish(commandQueue);
+
+	double endTime = GetTime();
+
+	// Throughput, to compare different radii
+	if ((WRAPPER == BASH) && VERBOS && (endTime > startTime))
+	{
+		printf("Searchlight with %i voxels per sphere, %i spheres, %f spheres per second\n",sphereVoxels,numberOfVoxels,(float)((double)numberOfVoxels / (endTime - startTime)));
+	}
+
+	clReleaseMemObject(c_Searchlight_Sphere_Offsets);
+	clReleaseMemObject(d_Searchlight_Voxel_Indices);
+	clReleaseMemObject(d_Sphere_Features);
+
+	return runKernelErrorCalculateStatisticalMapSearchlightSphere;
+}
+
+
+
+
+// Set functions for GUI / Wrappers
+
+
+void BROCCOLI_LIB::SetInputfMRIVolumes(float* data)
+{
+	h_fMRI_Volumes = data;
+    //    debugVolumeInfo("fMRI", EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, EPI_DATA_T, data);
+}
+
+void BROCCOLI_LIB::SetInputEPIVolume(float* data)
+{
+	h_EPI_Volume = data;
+    //    debugVolumeInfo("EPI", EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, data);
+}
+
+void BROCCOLI_LIB::SetInputCertainty(float* data)
+{
+	h_Certainty = data;
+}
+
+void BROCCOLI_LIB::SetInputT1Volume(float* data)
+{
+	h_T1_Volume = data;
+    //    debugVolumeInfo("T1", T1_DATA_W, T1_DATA_H, T1_DATA_D, data);
+}
+
+void BROCCOLI_LIB::SetInputMNIVolume(float* data)
+{
+	h_MNI_Volume = data;
     //    debugVolumeInfo("MNI", MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, data);
 }
 
@@ -3599,6 +5211,32 @@ void BROCCOLI_LIB::SetVarianceToSaveBeforeICA(double p)
 	PROPORTION_OF_VARIANCE_TO_SAVE_BEFORE_ICA = p;
 }
 
+void BROCCOLI_LIB::SetPCAMethod(int method)
+{
+	PCA_METHOD = method;
+}
+
+void BROCCOLI_LIB::SetICAStreaming(bool streaming)
+{
+	ICA_STREAMING = streaming;
+}
+
+void BROCCOLI_LIB::SetICAVoxelReader(VoxelReader reader, void* userData)
+{
+	ICA_VOXEL_READER = reader;
+	ICA_VOXEL_READER_DATA = userData;
+}
+
+void BROCCOLI_LIB::SetICAAlgorithm(int algorithm)
+{
+	ICA_ALGORITHM = algorithm;
+}
+
+void BROCCOLI_LIB::SetFastICANonlinearity(int nonlinearity)
+{
+	FASTICA_NONLINEARITY = nonlinearity;
+}
+
 void BROCCOLI_LIB::SetDesignMatrix(float* data1, float* data2)
 {
 	h_X_GLM_In = data1;
@@ -3611,6 +5249,36 @@ void BROCCOLI_LIB::SetCorrectClasses(float* data1, float* data2)
     h_d_In = data2;
 }
 
+// SEARCHLIGHT_GRADIENT_DESCENT, SEARCHLIGHT_RIDGE or SEARCHLIGHT_SHRINKAGE_LDA
+void BROCCOLI_LIB::SetSearchlightClassifier(int classifier)
+{
+	SEARCHLIGHT_CLASSIFIER = classifier;
+}
+
+// Number of folds for the closed form classifiers, 0 gives leave one out cross validation
+void BROCCOLI_LIB::SetNumberOfSearchlightFolds(int N)
+{
+	NUMBER_OF_SEARCHLIGHT_FOLDS = N;
+}
+
+// Regularization (0 - 1) for the closed form classifiers, relative to the mean variance of the voxels
+void BROCCOLI_LIB::SetSearchlightRegularization(float value)
+{
+	SEARCHLIGHT_REGULARIZATION = value;
+}
+
+// Radius of the sphere for SEARCHLIGHT_DIAGONAL_LDA, in voxels
+void BROCCOLI_LIB::SetSearchlightRadius(float value)
+{
+	SEARCHLIGHT_RADIUS = value;
+}
+
+// Number of label permutations for SEARCHLIGHT_RIDGE (including the original labels), 0 gives no permutation test
+void BROCCOLI_LIB::SetNumberOfSearchlightPermutations(int value)
+{
+	NUMBER_OF_SEARCHLIGHT_PERMUTATIONS = value;
+}
+
 
 void BROCCOLI_LIB::SetPermutationMatrix(unsigned short int* matrix)
 {
@@ -3688,6 +5356,24 @@ void BROCCOLI_LIB::SetNumberOfMCMCIterations(int N)
 	NUMBER_OF_MCMC_ITERATIONS = N;
 }
 
+// Use the float32 sampler with several chains and early stopping, instead of the double precision sampler
+void BROCCOLI_LIB::SetMCMCSinglePrecision(bool value)
+{
+	MCMC_SINGLE_PRECISION = value;
+}
+
+// Number of independent chains per voxel for the float32 sampler (1 - BAYESIAN_MAX_CHAINS)
+void BROCCOLI_LIB::SetNumberOfMCMCChains(int N)
+{
+	NUMBER_OF_MCMC_CHAINS = N;
+}
+
+// Largest change of the PPMs between two convergence checks for the float32 sampler to stop early, 0 runs all iterations
+void BROCCOLI_LIB::SetMCMCTolerance(float value)
+{
+	MCMC_TOLERANCE = value;
+}
+
 void BROCCOLI_LIB::SetSmoothingFilters(float* Smoothing_Filter_X, float* Smoothing_Filter_Y, float* Smoothing_Filter_Z)
 {
 	h_Smoothing_Filter_X_In = Smoothing_Filter_X;
@@ -4435,6 +6121,12 @@ void BROCCOLI_LIB::SetOutputAREstimatesEPI(float* ar1, float* ar2, float* ar3, f
 	h_AR4_Estimates_EPI = ar4;
 }
 
+// R-hat and number of iterations of the float32 Bayesian sampler, 2 volumes
+void BROCCOLI_LIB::SetOutputMCMCDiagnosticsEPI(float* diagnostics)
+{
+	h_MCMC_Diagnostics_EPI = diagnostics;
+}
+
 void BROCCOLI_LIB::SetOutputAREstimatesT1(float* ar1, float* ar2, float* ar3, float* ar4)
 {
 	h_AR1_Estimates_T1 = ar1;
@@ -4674,6 +6366,59 @@ int BROCCOLI_LIB::GetWrittenElements()
 	return writtenElements;
 }
 
+// Sets how many bytes of released buffers the device buffer pool may keep for reuse
+void BROCCOLI_LIB::SetDeviceBufferPoolCacheLimit(size_t bytes)
+{
+	devicePoolCacheLimit = bytes;
+	if (devicePoolBytesCached > devicePoolCacheLimit)
+	{
+		ReleaseCachedDeviceBuffers();
+	}
+}
+
+// Largest number of bytes handed out by the device buffer pool at the same time
+size_t BROCCOLI_LIB::GetDeviceBufferPoolHighWaterMark()
+{
+	return devicePoolBytesInUseHighWater;
+}
+
+// Largest number of bytes held by the device buffer pool, in use or cached
+size_t BROCCOLI_LIB::GetDeviceBufferPoolReservedHighWaterMark()
+{
+	return devicePoolBytesReservedHighWater;
+}
+
+int BROCCOLI_LIB::GetDeviceBufferPoolRequests()
+{
+	return devicePoolRequests;
+}
+
+int BROCCOLI_LIB::GetDeviceBufferPoolHits()
+{
+	return devicePoolHits;
+}
+
+// Sets a directory where the template registration assets are saved, and read by later registrations to the same template
+void BROCCOLI_LIB::SetTemplateCacheDirectory(const char* directory)
+{
+	TEMPLATE_CACHE_DIRECTORY = directory;
+	if ( (TEMPLATE_CACHE_DIRECTORY.size() > 0) && (TEMPLATE_CACHE_DIRECTORY[TEMPLATE_CACHE_DIRECTORY.size()-1] != '/') )
+	{
+		TEMPLATE_CACHE_DIRECTORY.append("/");
+	}
+}
+
+// Sets a directory where the registration results of first level analyses are saved, and read when the same
+// volumes are registered again with the same settings
+void BROCCOLI_LIB::SetRegistrationCacheDirectory(const char* directory)
+{
+	REGISTRATION_CACHE_DIRECTORY = directory;
+	if ( (REGISTRATION_CACHE_DIRECTORY.size() > 0) && (REGISTRATION_CACHE_DIRECTORY[REGISTRATION_CACHE_DIRECTORY.size()-1] != '/') )
+	{
+		REGISTRATION_CACHE_DIRECTORY.append("/");
+	}
+}
+
 int BROCCOLI_LIB::GetOpenCLPlatformIDsError()
 {
 	return getPlatformIDsError;
@@ -4941,6 +6686,24 @@ int BROCCOLI_LIB::GetNumberOfICAComponents()
 	return NUMBER_OF_ICA_COMPONENTS;
 }
 
+// Puts the independent components into volumes, only needed when the ICA data were read with a voxel reader
+void BROCCOLI_LIB::GetICAComponents(float* h_Components)
+{
+	size_t v = 0;
+	for (size_t i = 0; i < EPI_DATA_W * EPI_DATA_H * EPI_DATA_D; i++)
+	{
+		bool inMask = (h_EPI_Mask[i] == 1.0f);
+		for (size_t t = 0; t < NUMBER_OF_ICA_COMPONENTS; t++)
+		{
+			h_Components[i + t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D] = inMask ? icaSourceMatrix(t,v) : 0.0f;
+		}
+		if (inMask)
+		{
+			v++;
+		}
+	}
+}
+
 
 
 // Preprocessing
@@ -5075,9 +6838,6 @@ void BROCCOLI_LIB::AlignTwoVolumesLinearSetup(int DATA_W, int DATA_H, int DATA_D
 	SetGlobalAndLocalWorkSizesImageRegistration(DATA_W, DATA_H, DATA_D);
 
 	// Create a 3D image (texture) for fast interpolation
-	cl_image_format format;
-	format.image_channel_data_type = CL_FLOAT;
-	format.image_channel_order = CL_INTENSITY;
 
 	/*
 	cl_image_desc imageDesc;
@@ -5094,33 +6854,33 @@ void BROCCOLI_LIB::AlignTwoVolumesLinearSetup(int DATA_W, int DATA_H, int DATA_D
 
 	//d_Original_Volume = clCreateImage(context, CL_MEM_READ_ONLY, &format, &imageDesc, NULL, NULL);
 
-	// Deprecated
-	d_Original_Volume = clCreateImage3D(context, CL_MEM_READ_ONLY, &format, DATA_W, DATA_H, DATA_D, 0, 0, NULL, NULL);
+	// Deprecated, the image and buffers are taken from the buffer pool since the setup is repeated for every scale and registration
+	d_Original_Volume = AllocatePooledImage3D(DATA_W, DATA_H, DATA_D);
 
 	// Allocate global memory on the device
-	d_Aligned_Volume = clCreateBuffer(context, CL_MEM_READ_WRITE,  DATA_W * DATA_H * DATA_D * sizeof(float), NULL, &createBufferErrorAlignedVolume);
-	d_Reference_Volume = clCreateBuffer(context, CL_MEM_READ_WRITE,  DATA_W * DATA_H * DATA_D * sizeof(float), NULL, &createBufferErrorReferenceVolume);
+	d_Aligned_Volume = AllocatePooledBuffer(DATA_W * DATA_H * DATA_D * sizeof(float), &createBufferErrorAlignedVolume);
+	d_Reference_Volume = AllocatePooledBuffer(DATA_W * DATA_H * DATA_D * sizeof(float), &createBufferErrorReferenceVolume);
 
-	d_q11 = clCreateBuffer(context, CL_MEM_READ_WRITE,  DATA_W * DATA_H * DATA_D * sizeof(cl_float2), NULL, &createBufferErrorq11Real);
-	d_q12 = clCreateBuffer(context, CL_MEM_READ_WRITE,  DATA_W * DATA_H * DATA_D * sizeof(cl_float2), NULL, &createBufferErrorq12Real);
-	d_q13 = clCreateBuffer(context, CL_MEM_READ_WRITE,  DATA_W * DATA_H * DATA_D * sizeof(cl_float2), NULL, &createBufferErrorq13Real);
+	d_q11 = AllocatePooledBuffer(DATA_W * DATA_H * DATA_D * sizeof(cl_float2), &createBufferErrorq11Real);
+	d_q12 = AllocatePooledBuffer(DATA_W * DATA_H * DATA_D * sizeof(cl_float2), &createBufferErrorq12Real);
+	d_q13 = AllocatePooledBuffer(DATA_W * DATA_H * DATA_D * sizeof(cl_float2), &createBufferErrorq13Real);
 
-	d_q21 = clCreateBuffer(context, CL_MEM_READ_WRITE,  DATA_W * DATA_H * DATA_D * sizeof(cl_float2), NULL, &createBufferErrorq21Real);
-	d_q22 = clCreateBuffer(context, CL_MEM_READ_WRITE,  DATA_W * DATA_H * DATA_D * sizeof(cl_float2), NULL, &createBufferErrorq22Real);
-	d_q23 = clCreateBuffer(context, CL_MEM_READ_WRITE,  DATA_W * DATA_H * DATA_D * sizeof(cl_float2), NULL, &createBufferErrorq23Real);
+	d_q21 = AllocatePooledBuffer(DATA_W * DATA_H * DATA_D * sizeof(cl_float2), &createBufferErrorq21Real);
+	d_q22 = AllocatePooledBuffer(DATA_W * DATA_H * DATA_D * sizeof(cl_float2), &createBufferErrorq22Real);
+	d_q23 = AllocatePooledBuffer(DATA_W * DATA_H * DATA_D * sizeof(cl_float2), &createBufferErrorq23Real);
 
-	d_Phase_Differences = clCreateBuffer(context, CL_MEM_READ_WRITE,  DATA_W * DATA_H * DATA_D * sizeof(float), NULL, &createBufferErrorPhaseDifferences);
-	d_Phase_Certainties = clCreateBuffer(context, CL_MEM_READ_WRITE,  DATA_W * DATA_H * DATA_D * sizeof(float), NULL, &createBufferErrorPhaseCertainties);
-	d_Phase_Gradients = clCreateBuffer(context, CL_MEM_READ_WRITE,  DATA_W * DATA_H * DATA_D * sizeof(float), NULL, &createBufferErrorPhaseGradients);
+	d_Phase_Differences = AllocatePooledBuffer(DATA_W * DATA_H * DATA_D * sizeof(float), &createBufferErrorPhaseDifferences);
+	d_Phase_Certainties = AllocatePooledBuffer(DATA_W * DATA_H * DATA_D * sizeof(float), &createBufferErrorPhaseCertainties);
+	d_Phase_Gradients = AllocatePooledBuffer(DATA_W * DATA_H * DATA_D * sizeof(float), &createBufferErrorPhaseGradients);
 
-	d_A_Matrix = clCreateBuffer(context, CL_MEM_READ_WRITE, NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS * NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS * sizeof(float), NULL, &createBufferErrorAMatrix);
-	d_h_Vector = clCreateBuffer(context, CL_MEM_READ_WRITE, NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS * sizeof(float), NULL, &createBufferErrorHVector);
+	d_A_Matrix = AllocatePooledBuffer(NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS * NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS * sizeof(float), &createBufferErrorAMatrix);
+	d_h_Vector = AllocatePooledBuffer(NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS * sizeof(float), &createBufferErrorHVector);
 
-	d_A_Matrix_2D_Values = clCreateBuffer(context, CL_MEM_READ_WRITE, DATA_H * DATA_D * NUMBER_OF_NON_ZERO_A_MATRIX_ELEMENTS * sizeof(float), NULL, &createBufferErrorAMatrix2DValues);
-	d_A_Matrix_1D_Values = clCreateBuffer(context, CL_MEM_READ_WRITE, DATA_D * NUMBER_OF_NON_ZERO_A_MATRIX_ELEMENTS * sizeof(float), NULL, &createBufferErrorAMatrix1DValues);
+	d_A_Matrix_2D_Values = AllocatePooledBuffer(DATA_H * DATA_D * NUMBER_OF_NON_ZERO_A_MATRIX_ELEMENTS * sizeof(float), &createBufferErrorAMatrix2DValues);
+	d_A_Matrix_1D_Values = AllocatePooledBuffer(DATA_D * NUMBER_OF_NON_ZERO_A_MATRIX_ELEMENTS * sizeof(float), &createBufferErrorAMatrix1DValues);
 
-	d_h_Vector_2D_Values = clCreateBuffer(context, CL_MEM_READ_WRITE, DATA_H * DATA_D * NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS * sizeof(float), NULL, &createBufferErrorHVector2DValues);
-	d_h_Vector_1D_Values = clCreateBuffer(context, CL_MEM_READ_WRITE, DATA_D * NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS * sizeof(float), NULL, &createBufferErrorHVector1DValues);
+	d_h_Vector_2D_Values = AllocatePooledBuffer(DATA_H * DATA_D * NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS * sizeof(float), &createBufferErrorHVector2DValues);
+	d_h_Vector_1D_Values = AllocatePooledBuffer(DATA_D * NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS * sizeof(float), &createBufferErrorHVector1DValues);
 
 	deviceMemoryAllocations += 18;
 
@@ -5143,14 +6903,14 @@ void BROCCOLI_LIB::AlignTwoVolumesLinearSetup(int DATA_W, int DATA_H, int DATA_D
 
 	// Allocate constant memory
 
-	c_Quadrature_Filter_1_Real = clCreateBuffer(context, CL_MEM_READ_ONLY, IMAGE_REGISTRATION_FILTER_SIZE * IMAGE_REGISTRATION_FILTER_SIZE * sizeof(float), NULL, &createBufferErrorQuadratureFilter1Real);
-	c_Quadrature_Filter_1_Imag = clCreateBuffer(context, CL_MEM_READ_ONLY, IMAGE_REGISTRATION_FILTER_SIZE * IMAGE_REGISTRATION_FILTER_SIZE * sizeof(float), NULL, &createBufferErrorQuadratureFilter1Imag);
-	c_Quadrature_Filter_2_Real = clCreateBuffer(context, CL_MEM_READ_ONLY, IMAGE_REGISTRATION_FILTER_SIZE * IMAGE_REGISTRATION_FILTER_SIZE * sizeof(float), NULL, &createBufferErrorQuadratureFilter2Real);
-	c_Quadrature_Filter_2_Imag = clCreateBuffer(context, CL_MEM_READ_ONLY, IMAGE_REGISTRATION_FILTER_SIZE * IMAGE_REGISTRATION_FILTER_SIZE * sizeof(float), NULL, &createBufferErrorQuadratureFilter2Imag);
-	c_Quadrature_Filter_3_Real = clCreateBuffer(context, CL_MEM_READ_ONLY, IMAGE_REGISTRATION_FILTER_SIZE * IMAGE_REGISTRATION_FILTER_SIZE * sizeof(float), NULL, &createBufferErrorQuadratureFilter3Real);
-	c_Quadrature_Filter_3_Imag = clCreateBuffer(context, CL_MEM_READ_ONLY, IMAGE_REGISTRATION_FILTER_SIZE * IMAGE_REGISTRATION_FILTER_SIZE * sizeof(float), NULL, &createBufferErrorQuadratureFilter3Imag);
+	c_Quadrature_Filter_1_Real = AllocatePooledBuffer(IMAGE_REGISTRATION_FILTER_SIZE * IMAGE_REGISTRATION_FILTER_SIZE * sizeof(float), &createBufferErrorQuadratureFilter1Real);
+	c_Quadrature_Filter_1_Imag = AllocatePooledBuffer(IMAGE_REGISTRATION_FILTER_SIZE * IMAGE_REGISTRATION_FILTER_SIZE * sizeof(float), &createBufferErrorQuadratureFilter1Imag);
+	c_Quadrature_Filter_2_Real = AllocatePooledBuffer(IMAGE_REGISTRATION_FILTER_SIZE * IMAGE_REGISTRATION_FILTER_SIZE * sizeof(float), &createBufferErrorQuadratureFilter2Real);
+	c_Quadrature_Filter_2_Imag = AllocatePooledBuffer(IMAGE_REGISTRATION_FILTER_SIZE * IMAGE_REGISTRATION_FILTER_SIZE * sizeof(float), &createBufferErrorQuadratureFilter2Imag);
+	c_Quadrature_Filter_3_Real = AllocatePooledBuffer(IMAGE_REGISTRATION_FILTER_SIZE * IMAGE_REGISTRATION_FILTER_SIZE * sizeof(float), &createBufferErrorQuadratureFilter3Real);
+	c_Quadrature_Filter_3_Imag = AllocatePooledBuffer(IMAGE_REGISTRATION_FILTER_SIZE * IMAGE_REGISTRATION_FILTER_SIZE * sizeof(float), &createBufferErrorQuadratureFilter3Imag);
 
-	c_Registration_Parameters = clCreateBuffer(context, CL_MEM_READ_ONLY, NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS * sizeof(float), NULL, &createBufferErrorRegistrationParameters);
+	c_Registration_Parameters = AllocatePooledBuffer(NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS * sizeof(float), &createBufferErrorRegistrationParameters);
 
 	// Set all kernel arguments
 	clSetKernelArg(CalculatePhaseDifferencesAndCertaintiesKernel, 0, sizeof(cl_mem), &d_Phase_Differences);
@@ -5263,6 +7023,13 @@ void BROCCOLI_LIB::AlignTwoVolumesLinearSetup(int DATA_W, int DATA_H, int DATA_D
 	clSetKernelArg(InterpolateVolumeCubicLinearKernel, 4, sizeof(int), &DATA_H);
 	clSetKernelArg(InterpolateVolumeCubicLinearKernel, 5, sizeof(int), &DATA_D);
 	clSetKernelArg(InterpolateVolumeCubicLinearKernel, 6, sizeof(int), &volume);
+
+	if (USE_BUFFER_INTERPOLATION)
+	{
+		clSetKernelArg(InterpolateVolumeNearestLinearKernel, 7, sizeof(int), &volume);
+		clSetKernelArg(InterpolateVolumeLinearLinearKernel, 7, sizeof(int), &volume);
+		clSetKernelArg(InterpolateVolumeCubicLinearKernel, 7, sizeof(int), &volume);
+	}
 }
 
 
@@ -5279,8 +7046,13 @@ void BROCCOLI_LIB::AlignTwoVolumesLinear(float *h_Registration_Parameters_Align_
 		                                     int ALIGNMENT_TYPE,
 		                                     int INTERPOLATION_MODE)
 {
-	// Calculate the filter responses for the reference volume (only needed once)
-	NonseparableConvolution3D(d_q11, d_q12, d_q13, d_Reference_Volume, c_Quadrature_Filter_1_Real, c_Quadrature_Filter_1_Imag, c_Quadrature_Filter_2_Real, c_Quadrature_Filter_2_Imag, c_Quadrature_Filter_3_Real, c_Quadrature_Filter_3_Imag, h_Quadrature_Filter_1_Linear_Registration_Real, h_Quadrature_Filter_1_Linear_Registration_Imag, h_Quadrature_Filter_2_Linear_Registration_Real, h_Quadrature_Filter_2_Linear_Registration_Imag, h_Quadrature_Filter_3_Linear_Registration_Real, h_Quadrature_Filter_3_Linear_Registration_Imag, DATA_W, DATA_H, DATA_D);
+	// Calculate the filter responses for the reference volume (only needed once, and never again for a template)
+	cl_mem referenceResponses[3] = {d_q11, d_q12, d_q13};
+	if (!GetTemplateAssets("linear filter response", referenceResponses, 3, DATA_W, DATA_H, DATA_D, 2))
+	{
+		NonseparableConvolution3D(d_q11, d_q12, d_q13, d_Reference_Volume, c_Quadrature_Filter_1_Real, c_Quadrature_Filter_1_Imag, c_Quadrature_Filter_2_Real, c_Quadrature_Filter_2_Imag, c_Quadrature_Filter_3_Real, c_Quadrature_Filter_3_Imag, h_Quadrature_Filter_1_Linear_Registration_Real, h_Quadrature_Filter_1_Linear_Registration_Imag, h_Quadrature_Filter_2_Linear_Registration_Real, h_Quadrature_Filter_2_Linear_Registration_Imag, h_Quadrature_Filter_3_Linear_Registration_Real, h_Quadrature_Filter_3_Linear_Registration_Imag, DATA_W, DATA_H, DATA_D);
+		StoreTemplateAssets("linear filter response", referenceResponses, 3, DATA_W, DATA_H, DATA_D, 2);
+	}
 
 	if (DEBUG)
 	{
@@ -5443,9 +7215,6 @@ void BROCCOLI_LIB::AlignTwoVolumesNonLinearSetup(int DATA_W, int DATA_H, int DAT
 	// Set global and local work sizes
 	SetGlobalAndLocalWorkSizesImageRegistration(DATA_W, DATA_H, DATA_D);
 	// a 3D image (texture) for fast interpolation
-	cl_image_format format;
-	format.image_channel_data_type = CL_FLOAT;
-	format.image_channel_order = CL_INTENSITY;
 
 	/*
 	cl_image_desc imageDesc;
@@ -5463,7 +7232,7 @@ void BROCCOLI_LIB::AlignTwoVolumesNonLinearSetup(int DATA_W, int DATA_H, int DAT
 	//d_Original_Volume = clCreateImage(context, CL_MEM_READ_ONLY, &format, &imageDesc, NULL, NULL);
 
 	// Deprecated
-	d_Original_Volume = clCreateImage3D(context, CL_MEM_READ_ONLY, &format, DATA_W, DATA_H, DATA_D, 0, 0, NULL, NULL);
+	d_Original_Volume = AllocatePooledImage3D(DATA_W, DATA_H, DATA_D);
 
 	// Allocate global memory on the device
 	d_Aligned_Volume = clCreateBuffer(context, CL_MEM_READ_WRITE,  DATA_W * DATA_H * DATA_D * sizeof(float), NULL, &createBufferErrorAlignedVolume);
@@ -5747,9 +7516,14 @@ void BROCCOLI_LIB::CalculateTensorMagnitude(cl_mem d_Tensor_Magnitudes, cl_mem d
 // This function is the foundation for all the non-linear image registration functions
 void BROCCOLI_LIB::AlignTwoVolumesNonLinear(int DATA_W, int DATA_H, int DATA_D, int NUMBER_OF_ITERATIONS, int INTERPOLATION_MODE)
 {
-	// Calculate the filter responses for the reference volume (only needed once), calculate three complex valued filter responses at a time
-	NonseparableConvolution3D(d_q11, d_q12, d_q13, d_Reference_Volume, c_Quadrature_Filter_1_Real, c_Quadrature_Filter_1_Imag, c_Quadrature_Filter_2_Real, c_Quadrature_Filter_2_Imag, c_Quadrature_Filter_3_Real, c_Quadrature_Filter_3_Imag, h_Quadrature_Filter_1_NonLinear_Registration_Real, h_Quadrature_Filter_1_NonLinear_Registration_Imag, h_Quadrature_Filter_2_NonLinear_Registration_Real, h_Quadrature_Filter_2_NonLinear_Registration_Imag, h_Quadrature_Filter_3_NonLinear_Registration_Real, h_Quadrature_Filter_3_NonLinear_Registration_Imag, DATA_W, DATA_H, DATA_D);
-	NonseparableConvolution3D(d_q14, d_q15, d_q16, d_Reference_Volume, c_Quadrature_Filter_1_Real, c_Quadrature_Filter_1_Imag, c_Quadrature_Filter_2_Real, c_Quadrature_Filter_2_Imag, c_Quadrature_Filter_3_Real, c_Quadrature_Filter_3_Imag, h_Quadrature_Filter_4_NonLinear_Registration_Real, h_Quadrature_Filter_4_NonLinear_Registration_Imag, h_Quadrature_Filter_5_NonLinear_Registration_Real, h_Quadrature_Filter_5_NonLinear_Registration_Imag, h_Quadrature_Filter_6_NonLinear_Registration_Real, h_Quadrature_Filter_6_NonLinear_Registration_Imag, DATA_W, DATA_H, DATA_D);
+	// Calculate the filter responses for the reference volume (only needed once, and never again for a template), calculate three complex valued filter responses at a time
+	cl_mem referenceResponses[6] = {d_q11, d_q12, d_q13, d_q14, d_q15, d_q16};
+	if (!GetTemplateAssets("non-linear filter response", referenceResponses, 6, DATA_W, DATA_H, DATA_D, 2))
+	{
+		NonseparableConvolution3D(d_q11, d_q12, d_q13, d_Reference_Volume, c_Quadrature_Filter_1_Real, c_Quadrature_Filter_1_Imag, c_Quadrature_Filter_2_Real, c_Quadrature_Filter_2_Imag, c_Quadrature_Filter_3_Real, c_Quadrature_Filter_3_Imag, h_Quadrature_Filter_1_NonLinear_Registration_Real, h_Quadrature_Filter_1_NonLinear_Registration_Imag, h_Quadrature_Filter_2_NonLinear_Registration_Real, h_Quadrature_Filter_2_NonLinear_Registration_Imag, h_Quadrature_Filter_3_NonLinear_Registration_Real, h_Quadrature_Filter_3_NonLinear_Registration_Imag, DATA_W, DATA_H, DATA_D);
+		NonseparableConvolution3D(d_q14, d_q15, d_q16, d_Reference_Volume, c_Quadrature_Filter_1_Real, c_Quadrature_Filter_1_Imag, c_Quadrature_Filter_2_Real, c_Quadrature_Filter_2_Imag, c_Quadrature_Filter_3_Real, c_Quadrature_Filter_3_Imag, h_Quadrature_Filter_4_NonLinear_Registration_Real, h_Quadrature_Filter_4_NonLinear_Registration_Imag, h_Quadrature_Filter_5_NonLinear_Registration_Real, h_Quadrature_Filter_5_NonLinear_Registration_Imag, h_Quadrature_Filter_6_NonLinear_Registration_Real, h_Quadrature_Filter_6_NonLinear_Registration_Imag, DATA_W, DATA_H, DATA_D);
+		StoreTemplateAssets("non-linear filter response", referenceResponses, 6, DATA_W, DATA_H, DATA_D, 2);
+	}
 
 	//clEnqueueReadBuffer(commandQueue, d_q11, CL_TRUE, 0, DATA_W * DATA_H * DATA_D * sizeof(cl_float2), h_Quadrature_Filter_Response_1, 0, NULL, NULL);
 	//clEnqueueReadBuffer(commandQueue, d_q12, CL_TRUE, 0, DATA_W * DATA_H * DATA_D * sizeof(cl_float2), h_Quadrature_Filter_Response_2, 0, NULL, NULL);
@@ -6061,7 +7835,7 @@ void BROCCOLI_LIB::AlignTwoVolumesNonLinearCleanup(int DATA_W, int DATA_H, int D
 {
 	// Free all the allocated memory on the device
 
-	clReleaseMemObject(d_Original_Volume);
+	ReleasePooledImage3D(d_Original_Volume);
 	clReleaseMemObject(d_Reference_Volume);
 	clReleaseMemObject(d_Aligned_Volume);
 
@@ -6247,9 +8021,6 @@ void BROCCOLI_LIB::CalculateRotationAnglesFromRotationMatrix(float* h_Rotations,
 void BROCCOLI_LIB::ChangeVolumeSize(cl_mem d_Changed_Volume, cl_mem d_Original_Volume_, int ORIGINAL_DATA_W, int ORIGINAL_DATA_H, int ORIGINAL_DATA_D, int NEW_DATA_W, int NEW_DATA_H, int NEW_DATA_D, int INTERPOLATION_MODE)
 {
 	// Create a 3D image (texture) for fast interpolation
-	cl_image_format format;
-	format.image_channel_data_type = CL_FLOAT;
-	format.image_channel_order = CL_INTENSITY;
 
 	/*
 	cl_image_desc imageDesc;
@@ -6266,13 +8037,16 @@ void BROCCOLI_LIB::ChangeVolumeSize(cl_mem d_Changed_Volume, cl_mem d_Original_V
 
 	//cl_mem d_Volume_Texture = clCreateImage(context, CL_MEM_READ_ONLY, &format, &imageDesc, NULL, NULL);
 
-	// Deprecated
-	cl_mem d_Volume_Texture = clCreateImage3D(context, CL_MEM_READ_ONLY, &format, ORIGINAL_DATA_W, ORIGINAL_DATA_H, ORIGINAL_DATA_D, 0, 0, NULL, NULL);
-
-	// Copy the volume to an image to interpolate from
-	size_t origin[3] = {0, 0, 0};
-	size_t region[3] = {ORIGINAL_DATA_W, ORIGINAL_DATA_H, ORIGINAL_DATA_D};
-	clEnqueueCopyBufferToImage(commandQueue, d_Original_Volume_, d_Volume_Texture, 0, origin, region, 0, NULL, NULL);
+	// Deprecated, the texture is taken from the buffer pool since the same sizes are used for every scale
+	// When interpolating from buffers the original volume is read directly
+	cl_mem d_Volume_Texture = d_Original_Volume_;
+	int ORIGINAL_VOLUME = 0;
+	if (!USE_BUFFER_INTERPOLATION)
+	{
+		// Copy the volume to an image to interpolate from
+		d_Volume_Texture = AllocatePooledImage3D(ORIGINAL_DATA_W, ORIGINAL_DATA_H, ORIGINAL_DATA_D);
+		CopyVolumeToInterpolationVolume(d_Volume_Texture, d_Original_Volume_, 0, ORIGINAL_DATA_W, ORIGINAL_DATA_H, ORIGINAL_DATA_D);
+	}
 
 	// Calculate how to interpolate (up or down)
 	float VOXEL_DIFFERENCE_X = (float)(ORIGINAL_DATA_W-1)/(float)(NEW_DATA_W-1);
@@ -6291,6 +8065,13 @@ void BROCCOLI_LIB::ChangeVolumeSize(cl_mem d_Changed_Volume, cl_mem d_Original_V
 		clSetKernelArg(RescaleVolumeLinearKernel, 5, sizeof(int), &NEW_DATA_W);
 		clSetKernelArg(RescaleVolumeLinearKernel, 6, sizeof(int), &NEW_DATA_H);
 		clSetKernelArg(RescaleVolumeLinearKernel, 7, sizeof(int), &NEW_DATA_D);
+		if (USE_BUFFER_INTERPOLATION)
+		{
+			clSetKernelArg(RescaleVolumeLinearKernel, 8, sizeof(int), &ORIGINAL_DATA_W);
+			clSetKernelArg(RescaleVolumeLinearKernel, 9, sizeof(int), &ORIGINAL_DATA_H);
+			clSetKernelArg(RescaleVolumeLinearKernel, 10, sizeof(int), &ORIGINAL_DATA_D);
+			clSetKernelArg(RescaleVolumeLinearKernel, 11, sizeof(int), &ORIGINAL_VOLUME);
+		}
 
 		runKernelErrorRescaleVolumeLinear = clEnqueueNDRangeKernel(commandQueue, RescaleVolumeLinearKernel, 3, NULL, globalWorkSizeInterpolateVolume, localWorkSizeInterpolateVolume, 0, NULL, NULL);
 		clFinish(commandQueue);
@@ -6305,21 +8086,28 @@ void BROCCOLI_LIB::ChangeVolumeSize(cl_mem d_Changed_Volume, cl_mem d_Original_V
 		clSetKernelArg(RescaleVolumeCubicKernel, 5, sizeof(int), &NEW_DATA_W);
 		clSetKernelArg(RescaleVolumeCubicKernel, 6, sizeof(int), &NEW_DATA_H);
 		clSetKernelArg(RescaleVolumeCubicKernel, 7, sizeof(int), &NEW_DATA_D);
+		if (USE_BUFFER_INTERPOLATION)
+		{
+			clSetKernelArg(RescaleVolumeCubicKernel, 8, sizeof(int), &ORIGINAL_DATA_W);
+			clSetKernelArg(RescaleVolumeCubicKernel, 9, sizeof(int), &ORIGINAL_DATA_H);
+			clSetKernelArg(RescaleVolumeCubicKernel, 10, sizeof(int), &ORIGINAL_DATA_D);
+			clSetKernelArg(RescaleVolumeCubicKernel, 11, sizeof(int), &ORIGINAL_VOLUME);
+		}
 
 		runKernelErrorRescaleVolumeCubic = clEnqueueNDRangeKernel(commandQueue, RescaleVolumeCubicKernel, 3, NULL, globalWorkSizeInterpolateVolume, localWorkSizeInterpolateVolume, 0, NULL, NULL);
 		clFinish(commandQueue);
 	}
 
-	clReleaseMemObject(d_Volume_Texture);
+	if (!USE_BUFFER_INTERPOLATION)
+	{
+		ReleasePooledImage3D(d_Volume_Texture);
+	}
 }
 
 // Changes volume size in place
 void BROCCOLI_LIB::ChangeVolumeSize(cl_mem& d_Original_Volume, int ORIGINAL_DATA_W, int ORIGINAL_DATA_H, int ORIGINAL_DATA_D, int NEW_DATA_W, int NEW_DATA_H, int NEW_DATA_D, int INTERPOLATION_MODE)
 {
 	// Create a 3D image (texture) for fast interpolation
-	cl_image_format format;
-	format.image_channel_data_type = CL_FLOAT;
-	format.image_channel_order = CL_INTENSITY;
 
 	/*
 	cl_image_desc imageDesc;
@@ -6336,16 +8124,21 @@ void BROCCOLI_LIB::ChangeVolumeSize(cl_mem& d_Original_Volume, int ORIGINAL_DATA
 
 	//cl_mem d_Volume_Texture = clCreateImage(context, CL_MEM_READ_ONLY, &format, &imageDesc, NULL, NULL);
 
-	// Deprecated
-	cl_mem d_Volume_Texture = clCreateImage3D(context, CL_MEM_READ_ONLY, &format, ORIGINAL_DATA_W, ORIGINAL_DATA_H, ORIGINAL_DATA_D, 0, 0, NULL, NULL);
+	// Deprecated, the texture is taken from the buffer pool since the same sizes are used for every scale
+	// When interpolating from buffers the old volume is read directly, and released after the interpolation
+	cl_mem d_Volume_Texture = d_Original_Volume;
+	int ORIGINAL_VOLUME = 0;
+	if (!USE_BUFFER_INTERPOLATION)
+	{
+		// Copy the volume to an image to interpolate from
+		d_Volume_Texture = AllocatePooledImage3D(ORIGINAL_DATA_W, ORIGINAL_DATA_H, ORIGINAL_DATA_D);
+		CopyVolumeToInterpolationVolume(d_Volume_Texture, d_Original_Volume, 0, ORIGINAL_DATA_W, ORIGINAL_DATA_H, ORIGINAL_DATA_D);
 
-	// Copy the volume to an image to interpolate from
-	size_t origin[3] = {0, 0, 0};
-	size_t region[3] = {ORIGINAL_DATA_W, ORIGINAL_DATA_H, ORIGINAL_DATA_D};
-	clEnqueueCopyBufferToImage(commandQueue, d_Original_Volume, d_Volume_Texture, 0, origin, region, 0, NULL, NULL);
+		// Throw away old volume
+		clReleaseMemObject(d_Original_Volume);
+	}
 
-	// Throw away old volume and make a new one of the new size
-	clReleaseMemObject(d_Original_Volume);
+	// Make a new volume of the new size
 	d_Original_Volume = clCreateBuffer(context, CL_MEM_READ_WRITE,  NEW_DATA_W * NEW_DATA_H * NEW_DATA_D * sizeof(float), NULL, &createBufferErrorPhaseCertainties);
 
 	// Calculate how to interpolate (up or down)
@@ -6365,6 +8158,13 @@ void BROCCOLI_LIB::ChangeVolumeSize(cl_mem& d_Original_Volume, int ORIGINAL_DATA
 		clSetKernelArg(RescaleVolumeLinearKernel, 5, sizeof(int), &NEW_DATA_W);
 		clSetKernelArg(RescaleVolumeLinearKernel, 6, sizeof(int), &NEW_DATA_H);
 		clSetKernelArg(RescaleVolumeLinearKernel, 7, sizeof(int), &NEW_DATA_D);
+		if (USE_BUFFER_INTERPOLATION)
+		{
+			clSetKernelArg(RescaleVolumeLinearKernel, 8, sizeof(int), &ORIGINAL_DATA_W);
+			clSetKernelArg(RescaleVolumeLinearKernel, 9, sizeof(int), &ORIGINAL_DATA_H);
+			clSetKernelArg(RescaleVolumeLinearKernel, 10, sizeof(int), &ORIGINAL_DATA_D);
+			clSetKernelArg(RescaleVolumeLinearKernel, 11, sizeof(int), &ORIGINAL_VOLUME);
+		}
 
 		runKernelErrorRescaleVolumeLinear = clEnqueueNDRangeKernel(commandQueue, RescaleVolumeLinearKernel, 3, NULL, globalWorkSizeInterpolateVolume, localWorkSizeInterpolateVolume, 0, NULL, NULL);
 		clFinish(commandQueue);
@@ -6379,12 +8179,19 @@ void BROCCOLI_LIB::ChangeVolumeSize(cl_mem& d_Original_Volume, int ORIGINAL_DATA
 		clSetKernelArg(RescaleVolumeCubicKernel, 5, sizeof(int), &NEW_DATA_W);
 		clSetKernelArg(RescaleVolumeCubicKernel, 6, sizeof(int), &NEW_DATA_H);
 		clSetKernelArg(RescaleVolumeCubicKernel, 7, sizeof(int), &NEW_DATA_D);
+		if (USE_BUFFER_INTERPOLATION)
+		{
+			clSetKernelArg(RescaleVolumeCubicKernel, 8, sizeof(int), &ORIGINAL_DATA_W);
+			clSetKernelArg(RescaleVolumeCubicKernel, 9, sizeof(int), &ORIGINAL_DATA_H);
+			clSetKernelArg(RescaleVolumeCubicKernel, 10, sizeof(int), &ORIGINAL_DATA_D);
+			clSetKernelArg(RescaleVolumeCubicKernel, 11, sizeof(int), &ORIGINAL_VOLUME);
+		}
 
 		runKernelErrorRescaleVolumeCubic = clEnqueueNDRangeKernel(commandQueue, RescaleVolumeCubicKernel, 3, NULL, globalWorkSizeInterpolateVolume, localWorkSizeInterpolateVolume, 0, NULL, NULL);
 		clFinish(commandQueue);
 	}
 
-	clReleaseMemObject(d_Volume_Texture);
+	ReleasePooledImage3D(d_Volume_Texture);
 }
 
 // Runs linear registration over several scales, COARSEST_SCALE should be 16, 8, 4, 2 or 1
@@ -6421,12 +8228,14 @@ void BROCCOLI_LIB::AlignTwoVolumesLinearSeveralScales(float *h_Registration_Para
 
 	// Change size of original volumes to current scale
 	ChangeVolumeSize(d_Aligned_Volume, d_Original_Aligned_Volume, DATA_W, DATA_H, DATA_D, CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D, INTERPOLATION_MODE);
-	ChangeVolumeSize(d_Reference_Volume, d_Original_Reference_Volume, DATA_W, DATA_H, DATA_D, CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D, INTERPOLATION_MODE);
+	if (!GetTemplateAssets("reference volume", &d_Reference_Volume, 1, CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D, 1))
+	{
+		ChangeVolumeSize(d_Reference_Volume, d_Original_Reference_Volume, DATA_W, DATA_H, DATA_D, CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D, INTERPOLATION_MODE);
+		StoreTemplateAssets("reference volume", &d_Reference_Volume, 1, CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D, 1);
+	}
 
 	// Copy volume to be aligned to an image (texture)
-	size_t origin[3] = {0, 0, 0};
-	size_t region[3] = {CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D};
-	clEnqueueCopyBufferToImage(commandQueue, d_Aligned_Volume, d_Original_Volume, 0, origin, region, 0, NULL, NULL);
+	CopyVolumeToInterpolationVolume(d_Original_Volume, d_Aligned_Volume, 0, CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D);
 
 	// Loop registration over scales
 	for (int current_scale = COARSEST_SCALE; current_scale >= 1; current_scale = current_scale/2)
@@ -6466,12 +8275,14 @@ void BROCCOLI_LIB::AlignTwoVolumesLinearSeveralScales(float *h_Registration_Para
 
 			// Change size of original volumes to current scale
 			ChangeVolumeSize(d_Aligned_Volume, d_Original_Aligned_Volume, DATA_W, DATA_H, DATA_D, CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D, INTERPOLATION_MODE);
-			ChangeVolumeSize(d_Reference_Volume, d_Original_Reference_Volume, DATA_W, DATA_H, DATA_D, CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D, INTERPOLATION_MODE);
+			if (!GetTemplateAssets("reference volume", &d_Reference_Volume, 1, CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D, 1))
+			{
+				ChangeVolumeSize(d_Reference_Volume, d_Original_Reference_Volume, DATA_W, DATA_H, DATA_D, CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D, INTERPOLATION_MODE);
+				StoreTemplateAssets("reference volume", &d_Reference_Volume, 1, CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D, 1);
+			}
 
 			// Copy volume to be aligned to an image (texture)
-			size_t origin[3] = {0, 0, 0};
-			size_t region[3] = {CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D};
-			clEnqueueCopyBufferToImage(commandQueue, d_Aligned_Volume, d_Original_Volume, 0, origin, region, 0, NULL, NULL);
+			CopyVolumeToInterpolationVolume(d_Original_Volume, d_Aligned_Volume, 0, CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D);
 
 			// Copy incremented parameter vector to constant memory
 			clEnqueueWriteBuffer(commandQueue, c_Registration_Parameters, CL_TRUE, 0, NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS * sizeof(float), h_Registration_Parameters_Align_Two_Volumes_Several_Scales, 0, NULL, NULL);
@@ -6489,7 +8300,7 @@ void BROCCOLI_LIB::AlignTwoVolumesLinearSeveralScales(float *h_Registration_Para
 			}
 
 			// Copy transformed volume back to image (texture)
-			clEnqueueCopyBufferToImage(commandQueue, d_Aligned_Volume, d_Original_Volume, 0, origin, region, 0, NULL, NULL);
+			CopyVolumeToInterpolationVolume(d_Original_Volume, d_Aligned_Volume, 0, CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D);
 		}
 		else // Last scale, nothing more to do
 		{
@@ -6538,12 +8349,14 @@ void BROCCOLI_LIB::AlignTwoVolumesNonLinearSeveralScales(cl_mem d_Original_Align
 
 	// Change size of original volumes to current scale
 	ChangeVolumeSize(d_Aligned_Volume, d_Original_Aligned_Volume, DATA_W, DATA_H, DATA_D, CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D, INTERPOLATION_MODE);
-	ChangeVolumeSize(d_Reference_Volume, d_Original_Reference_Volume, DATA_W, DATA_H, DATA_D, CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D, INTERPOLATION_MODE);
+	if (!GetTemplateAssets("reference volume", &d_Reference_Volume, 1, CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D, 1))
+	{
+		ChangeVolumeSize(d_Reference_Volume, d_Original_Reference_Volume, DATA_W, DATA_H, DATA_D, CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D, INTERPOLATION_MODE);
+		StoreTemplateAssets("reference volume", &d_Reference_Volume, 1, CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D, 1);
+	}
 
 	// Copy volume to be aligned to an image (texture)
-	size_t origin[3] = {0, 0, 0};
-	size_t region[3] = {CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D};
-	clEnqueueCopyBufferToImage(commandQueue, d_Aligned_Volume, d_Original_Volume, 0, origin, region, 0, NULL, NULL);
+	CopyVolumeToInterpolationVolume(d_Original_Volume, d_Aligned_Volume, 0, CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D);
 
 	// Allocate memory for total displacement field, done separately as we release memory for each new scale
 	d_Total_Displacement_Field_X = clCreateBuffer(context, CL_MEM_READ_WRITE,  CURRENT_DATA_W * CURRENT_DATA_H * CURRENT_DATA_D * sizeof(float), NULL, &createBufferErrorPhaseCertainties);
@@ -6593,12 +8406,14 @@ void BROCCOLI_LIB::AlignTwoVolumesNonLinearSeveralScales(cl_mem d_Original_Align
 
 			// Change size of original volumes to current scale
 			ChangeVolumeSize(d_Aligned_Volume, d_Original_Aligned_Volume, DATA_W, DATA_H, DATA_D, CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D, INTERPOLATION_MODE);
-			ChangeVolumeSize(d_Reference_Volume, d_Original_Reference_Volume, DATA_W, DATA_H, DATA_D, CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D, INTERPOLATION_MODE);
+			if (!GetTemplateAssets("reference volume", &d_Reference_Volume, 1, CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D, 1))
+			{
+				ChangeVolumeSize(d_Reference_Volume, d_Original_Reference_Volume, DATA_W, DATA_H, DATA_D, CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D, INTERPOLATION_MODE);
+				StoreTemplateAssets("reference volume", &d_Reference_Volume, 1, CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D, 1);
+			}
 
 			// Copy volume to be aligned to an image (texture)
-			size_t origin[3] = {0, 0, 0};
-			size_t region[3] = {CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D};
-			clEnqueueCopyBufferToImage(commandQueue, d_Aligned_Volume, d_Original_Volume, 0, origin, region, 0, NULL, NULL);
+			CopyVolumeToInterpolationVolume(d_Original_Volume, d_Aligned_Volume, 0, CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D);
 
 			// Rescale the displacement field to the current volume size
 			ChangeVolumeSize(d_Total_Displacement_Field_X, PREVIOUS_DATA_W, PREVIOUS_DATA_H, PREVIOUS_DATA_D, CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D, INTERPOLATION_MODE);
@@ -6631,7 +8446,7 @@ void BROCCOLI_LIB::AlignTwoVolumesNonLinearSeveralScales(cl_mem d_Original_Align
 			}
 
 			// Copy transformed volume back to image (texture)
-			clEnqueueCopyBufferToImage(commandQueue, d_Aligned_Volume, d_Original_Volume, 0, origin, region, 0, NULL, NULL);
+			CopyVolumeToInterpolationVolume(d_Original_Volume, d_Aligned_Volume, 0, CURRENT_DATA_W, CURRENT_DATA_H, CURRENT_DATA_D);
 		}
 		else // Last scale, nothing more to do
 		{
@@ -6671,39 +8486,39 @@ void BROCCOLI_LIB::AlignTwoVolumesLinearCleanup(int DATA_W, int DATA_H, int DATA
 {
 	// Free all the allocated memory on the device
 
-	clReleaseMemObject(d_Original_Volume);
-	clReleaseMemObject(d_Reference_Volume);
-	clReleaseMemObject(d_Aligned_Volume);
+	ReleasePooledImage3D(d_Original_Volume);
+	ReleasePooledBuffer(d_Reference_Volume);
+	ReleasePooledBuffer(d_Aligned_Volume);
 
-	clReleaseMemObject(d_q11);
-	clReleaseMemObject(d_q12);
-	clReleaseMemObject(d_q13);
+	ReleasePooledBuffer(d_q11);
+	ReleasePooledBuffer(d_q12);
+	ReleasePooledBuffer(d_q13);
 
-	clReleaseMemObject(d_q21);
-	clReleaseMemObject(d_q22);
-	clReleaseMemObject(d_q23);
+	ReleasePooledBuffer(d_q21);
+	ReleasePooledBuffer(d_q22);
+	ReleasePooledBuffer(d_q23);
 
-	clReleaseMemObject(d_Phase_Differences);
-	clReleaseMemObject(d_Phase_Gradients);
-	clReleaseMemObject(d_Phase_Certainties);
+	ReleasePooledBuffer(d_Phase_Differences);
+	ReleasePooledBuffer(d_Phase_Gradients);
+	ReleasePooledBuffer(d_Phase_Certainties);
 
-	clReleaseMemObject(d_A_Matrix);
-	clReleaseMemObject(d_h_Vector);
+	ReleasePooledBuffer(d_A_Matrix);
+	ReleasePooledBuffer(d_h_Vector);
 
-	clReleaseMemObject(d_A_Matrix_2D_Values);
-	clReleaseMemObject(d_A_Matrix_1D_Values);
+	ReleasePooledBuffer(d_A_Matrix_2D_Values);
+	ReleasePooledBuffer(d_A_Matrix_1D_Values);
 
-	clReleaseMemObject(d_h_Vector_2D_Values);
-	clReleaseMemObject(d_h_Vector_1D_Values);
+	ReleasePooledBuffer(d_h_Vector_2D_Values);
+	ReleasePooledBuffer(d_h_Vector_1D_Values);
 
-	clReleaseMemObject(c_Quadrature_Filter_1_Real);
-	clReleaseMemObject(c_Quadrature_Filter_1_Imag);
-	clReleaseMemObject(c_Quadrature_Filter_2_Real);
-	clReleaseMemObject(c_Quadrature_Filter_2_Imag);
-	clReleaseMemObject(c_Quadrature_Filter_3_Real);
-	clReleaseMemObject(c_Quadrature_Filter_3_Imag);
+	ReleasePooledBuffer(c_Quadrature_Filter_1_Real);
+	ReleasePooledBuffer(c_Quadrature_Filter_1_Imag);
+	ReleasePooledBuffer(c_Quadrature_Filter_2_Real);
+	ReleasePooledBuffer(c_Quadrature_Filter_2_Imag);
+	ReleasePooledBuffer(c_Quadrature_Filter_3_Real);
+	ReleasePooledBuffer(c_Quadrature_Filter_3_Imag);
 
-	clReleaseMemObject(c_Registration_Parameters);
+	ReleasePooledBuffer(c_Registration_Parameters);
 
 	deviceMemoryDeallocations += 18;
 
@@ -6762,38 +8577,50 @@ void BROCCOLI_LIB::CalculateGlobalMeans(float* h_Volumes)
 
 void BROCCOLI_LIB::CalculateCenterOfMass(float &rx, float &ry, float &rz, cl_mem d_Volume, size_t DATA_W, size_t DATA_H, size_t DATA_D)
 {
-    float *h_Temp_Volume = (float*)malloc(DATA_W * DATA_H * DATA_D * sizeof(float));
+	// Sum mass and mass weighted coordinates on the device, instead of copying the volume to the host
+	SetGlobalAndLocalWorkSizesReduceVolumes(DATA_W * DATA_H * DATA_D, 4);
 
-    // Copy the volume to host
-	clEnqueueReadBuffer(commandQueue, d_Volume, CL_TRUE, 0, DATA_W * DATA_H * DATA_D * sizeof(float), h_Temp_Volume, 0, NULL, NULL);
+	int NUMBER_OF_PARTIALS = (int)(globalWorkSizeReduceVolumes[0] / localWorkSizeReduceVolumes[0]);
+	int OPERATION = REDUCE_SUM;
+	size_t globalWorkSizeCalculateMassMoments[3] = {globalWorkSizeReduceVolumes[0], 1, 1};
 
-    float totalMass = 0.0f;
-    float mass = 0.0f;
+	cl_mem d_Partial_Values = AllocatePooledBuffer(NUMBER_OF_PARTIALS * 4 * sizeof(float), NULL);
+	cl_mem d_Partial_Indices = AllocatePooledBuffer(NUMBER_OF_PARTIALS * 4 * sizeof(int), NULL);
+	cl_mem d_Moments = AllocatePooledBuffer(4 * sizeof(float), NULL);
+	cl_mem d_Moment_Indices = AllocatePooledBuffer(4 * sizeof(int), NULL);
 
-    rx = 0.0f;
-    ry = 0.0f;
-    rz = 0.0f;
+	clSetKernelArg(CalculateMassMomentsKernel, 0, sizeof(cl_mem), &d_Partial_Values);
+	clSetKernelArg(CalculateMassMomentsKernel, 1, sizeof(cl_mem), &d_Partial_Indices);
+	clSetKernelArg(CalculateMassMomentsKernel, 2, sizeof(cl_mem), &d_Volume);
+	clSetKernelArg(CalculateMassMomentsKernel, 3, sizeof(int), &DATA_W);
+	clSetKernelArg(CalculateMassMomentsKernel, 4, sizeof(int), &DATA_H);
+	clSetKernelArg(CalculateMassMomentsKernel, 5, sizeof(int), &DATA_D);
 
-    for (size_t z = 0; z < DATA_D; z++)
-    {
-        for (size_t y = 0; y < DATA_H; y++)
-        {
-            for (size_t x = 0; x < DATA_W; x++)
-            {
-                mass = h_Temp_Volume[x + y * DATA_W + z * DATA_W * DATA_H];
-                rx += mass * (float)x;
-                ry += mass * (float)y;
-                rz += mass * (float)z;
-                totalMass += mass;
-            }
-        }
-    }
+	runKernelErrorCalculateMassMoments = clEnqueueNDRangeKernel(commandQueue, CalculateMassMomentsKernel, 1, NULL, globalWorkSizeCalculateMassMoments, localWorkSizeReduceVolumes, 0, NULL, NULL);
 
-    rx /= totalMass;
-    ry /= totalMass;
-    rz /= totalMass;
+	// The partial sums are stored as four volumes, reduce them in one launch
+	clSetKernelArg(ReduceVolumesFinalKernel, 0, sizeof(cl_mem), &d_Moments);
+	clSetKernelArg(ReduceVolumesFinalKernel, 1, sizeof(cl_mem), &d_Moment_Indices);
+	clSetKernelArg(ReduceVolumesFinalKernel, 2, sizeof(cl_mem), &d_Partial_Values);
+	clSetKernelArg(ReduceVolumesFinalKernel, 3, sizeof(cl_mem), &d_Partial_Indices);
+	clSetKernelArg(ReduceVolumesFinalKernel, 4, sizeof(int), &NUMBER_OF_PARTIALS);
+	clSetKernelArg(ReduceVolumesFinalKernel, 5, sizeof(int), &OPERATION);
 
-    free(h_Temp_Volume);
+	runKernelErrorReduceVolumesFinal = clEnqueueNDRangeKernel(commandQueue, ReduceVolumesFinalKernel, 2, NULL, globalWorkSizeReduceVolumesFinal, localWorkSizeReduceVolumes, 0, NULL, NULL);
+
+	float h_Moments[4];
+	clEnqueueReadBuffer(commandQueue, d_Moments, CL_TRUE, 0, 4 * sizeof(float), h_Moments, 0, NULL, NULL);
+
+	ReleasePooledBuffer(d_Partial_Values);
+	ReleasePooledBuffer(d_Partial_Indices);
+	ReleasePooledBuffer(d_Moments);
+	ReleasePooledBuffer(d_Moment_Indices);
+
+	float totalMass = h_Moments[0];
+
+	rx = h_Moments[1] / totalMass;
+	ry = h_Moments[2] / totalMass;
+	rz = h_Moments[3] / totalMass;
 }
 
 
@@ -6975,9 +8802,6 @@ void BROCCOLI_LIB::ChangeVolumesResolutionAndSize(cl_mem d_New_Volumes,
 	cl_mem d_Interpolated_Volume = clCreateBuffer(context, CL_MEM_READ_WRITE,  DATA_W_INTERPOLATED * DATA_H_INTERPOLATED * DATA_D_INTERPOLATED * sizeof(float), NULL, NULL);
 
 	// Create a 3D image (texture) for fast interpolation
-	cl_image_format format;
-	format.image_channel_data_type = CL_FLOAT;
-	format.image_channel_order = CL_INTENSITY;
 
 	/*
 	cl_image_desc imageDesc;
@@ -6994,8 +8818,12 @@ void BROCCOLI_LIB::ChangeVolumesResolutionAndSize(cl_mem d_New_Volumes,
 
 	//cl_mem d_Volume_Texture = clCreateImage(context, CL_MEM_READ_ONLY, &format, &imageDesc, NULL, NULL);
 
-	// Deprecated
-	cl_mem d_Volume_Texture = clCreateImage3D(context, CL_MEM_READ_ONLY, &format, DATA_W, DATA_H, DATA_D, 0, 0, NULL, NULL);
+	// Deprecated, when interpolating from buffers each volume is instead read directly from the 4D volumes
+	cl_mem d_Volume_Texture = d_Volumes;
+	if (!USE_BUFFER_INTERPOLATION)
+	{
+		d_Volume_Texture = AllocatePooledImage3D(DATA_W, DATA_H, DATA_D);
+	}
 
 	float VOXEL_DIFFERENCE_X = (float)(DATA_W-1)/(float)(DATA_W_INTERPOLATED-1);
 	float VOXEL_DIFFERENCE_Y = (float)(DATA_H-1)/(float)(DATA_H_INTERPOLATED-1);
@@ -7015,6 +8843,12 @@ void BROCCOLI_LIB::ChangeVolumesResolutionAndSize(cl_mem d_New_Volumes,
 		clSetKernelArg(RescaleVolumeLinearKernel, 5, sizeof(int), &DATA_W_INTERPOLATED);
 		clSetKernelArg(RescaleVolumeLinearKernel, 6, sizeof(int), &DATA_H_INTERPOLATED);
 		clSetKernelArg(RescaleVolumeLinearKernel, 7, sizeof(int), &DATA_D_INTERPOLATED);
+		if (USE_BUFFER_INTERPOLATION)
+		{
+			clSetKernelArg(RescaleVolumeLinearKernel, 8, sizeof(int), &DATA_W);
+			clSetKernelArg(RescaleVolumeLinearKernel, 9, sizeof(int), &DATA_H);
+			clSetKernelArg(RescaleVolumeLinearKernel, 10, sizeof(int), &DATA_D);
+		}
 	}
 	else if (INTERPOLATION_MODE == CUBIC)
 	{
@@ -7026,6 +8860,12 @@ void BROCCOLI_LIB::ChangeVolumesResolutionAndSize(cl_mem d_New_Volumes,
 		clSetKernelArg(RescaleVolumeCubicKernel, 5, sizeof(int), &DATA_W_INTERPOLATED);
 		clSetKernelArg(RescaleVolumeCubicKernel, 6, sizeof(int), &DATA_H_INTERPOLATED);
 		clSetKernelArg(RescaleVolumeCubicKernel, 7, sizeof(int), &DATA_D_INTERPOLATED);
+		if (USE_BUFFER_INTERPOLATION)
+		{
+			clSetKernelArg(RescaleVolumeCubicKernel, 8, sizeof(int), &DATA_W);
+			clSetKernelArg(RescaleVolumeCubicKernel, 9, sizeof(int), &DATA_H);
+			clSetKernelArg(RescaleVolumeCubicKernel, 10, sizeof(int), &DATA_D);
+		}
 	}
 	else if (INTERPOLATION_MODE == NEAREST)
 	{
@@ -7037,6 +8877,12 @@ void BROCCOLI_LIB::ChangeVolumesResolutionAndSize(cl_mem d_New_Volumes,
 		clSetKernelArg(RescaleVolumeNearestKernel, 5, sizeof(int), &DATA_W_INTERPOLATED);
 		clSetKernelArg(RescaleVolumeNearestKernel, 6, sizeof(int), &DATA_H_INTERPOLATED);
 		clSetKernelArg(RescaleVolumeNearestKernel, 7, sizeof(int), &DATA_D_INTERPOLATED);
+		if (USE_BUFFER_INTERPOLATION)
+		{
+			clSetKernelArg(RescaleVolumeNearestKernel, 8, sizeof(int), &DATA_W);
+			clSetKernelArg(RescaleVolumeNearestKernel, 9, sizeof(int), &DATA_H);
+			clSetKernelArg(RescaleVolumeNearestKernel, 10, sizeof(int), &DATA_D);
+		}
 	}
 
 	// Make sure that the interpolated volume has the same number of voxels as the new volume in each direction
@@ -7067,10 +8913,24 @@ void BROCCOLI_LIB::ChangeVolumesResolutionAndSize(cl_mem d_New_Volumes,
 	{
 		SetMemory(d_Interpolated_Volume, 0.0f, DATA_W_INTERPOLATED * DATA_H_INTERPOLATED * DATA_D_INTERPOLATED);
 
-		// Copy the current volume to an image to interpolate from
-		size_t origin[3] = {0, 0, 0};
-		size_t region[3] = {DATA_W, DATA_H, DATA_D};
-		clEnqueueCopyBufferToImage(commandQueue, d_Volumes, d_Volume_Texture, (volume + offset) * DATA_W * DATA_H * DATA_D * sizeof(float), origin, region, 0, NULL, NULL);
+		// Copy the current volume to an image to interpolate from, or select it in the 4D volumes
+		int ORIGINAL_VOLUME = volume + offset;
+		if (!USE_BUFFER_INTERPOLATION)
+		{
+			CopyVolumeToInterpolationVolume(d_Volume_Texture, d_Volumes, ORIGINAL_VOLUME, DATA_W, DATA_H, DATA_D);
+		}
+		else if (INTERPOLATION_MODE == LINEAR)
+		{
+			clSetKernelArg(RescaleVolumeLinearKernel, 11, sizeof(int), &ORIGINAL_VOLUME);
+		}
+		else if (INTERPOLATION_MODE == CUBIC)
+		{
+			clSetKernelArg(RescaleVolumeCubicKernel, 11, sizeof(int), &ORIGINAL_VOLUME);
+		}
+		else if (INTERPOLATION_MODE == NEAREST)
+		{
+			clSetKernelArg(RescaleVolumeNearestKernel, 11, sizeof(int), &ORIGINAL_VOLUME);
+		}
 
 		// Rescale current volume to the same voxel size as the new volume
 		if (INTERPOLATION_MODE == LINEAR)
@@ -7096,7 +8956,10 @@ void BROCCOLI_LIB::ChangeVolumesResolutionAndSize(cl_mem d_New_Volumes,
 	}
 
 	clReleaseMemObject(d_Interpolated_Volume);
-	clReleaseMemObject(d_Volume_Texture);
+	if (!USE_BUFFER_INTERPOLATION)
+	{
+		ReleasePooledImage3D(d_Volume_Texture);
+	}
 }
 
 void BROCCOLI_LIB::ScaleAffineRegistrationParameters(float* h_Parameters, float OLD_VOXEL_SIZE_X, float OLD_VOXEL_SIZE_Y, float OLD_VOXEL_SIZE_Z, float NEW_VOXEL_SIZE_X, float NEW_VOXEL_SIZE_Y, float NEW_VOXEL_SIZE_Z)
@@ -7731,6 +9594,20 @@ void BROCCOLI_LIB::LogitMatrixDouble(cl_mem d_Array, size_t N)
 	clFinish(commandQueue);
 }
 
+void BROCCOLI_LIB::FastICANonlinearity(cl_mem d_Array, cl_mem d_Derivative, size_t N)
+{
+	SetGlobalAndLocalWorkSizesAddVolumes(N, 1, 1);
+
+	int n = (int)N;
+	clSetKernelArg(FastICANonlinearityKernel, 0, sizeof(cl_mem), &d_Array);
+	clSetKernelArg(FastICANonlinearityKernel, 1, sizeof(cl_mem), &d_Derivative);
+	clSetKernelArg(FastICANonlinearityKernel, 2, sizeof(int), &n);
+	clSetKernelArg(FastICANonlinearityKernel, 3, sizeof(int), &FASTICA_NONLINEARITY);
+
+	runKernelErrorFastICANonlinearity = clEnqueueNDRangeKernel(commandQueue, FastICANonlinearityKernel, 3, NULL, globalWorkSizeAddVolumes, localWorkSizeAddVolumes, 0, NULL, NULL);
+	clFinish(commandQueue);
+}
+
 // Subtracts two volumes and saves as a third volume
 void BROCCOLI_LIB::SubtractVolumes(cl_mem d_Result, cl_mem d_Volume_1, cl_mem d_Volume_2, size_t DATA_W, size_t DATA_H, size_t DATA_D)
 {
@@ -7872,6 +9749,14 @@ void BROCCOLI_LIB::PerformRegistrationEPIT1()
 	// Make sure that the volumes overlap from start, save the translation parameters
 	MatchVolumeMasses(d_T1_EPI_Volume, d_Skullstripped_T1_Volume, h_StartParameters_EPI_T1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D);
 
+	// Use the results of an earlier registration of the same volumes, if there is one
+	float* h_Results[2] = {h_Registration_Parameters_EPI_T1_Affine, h_Registration_Parameters_EPI_T1};
+	size_t numberOfValues[2] = {(size_t)NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS, 6};
+	if (ReadRegistrationResults("epi_t1", registrationResultsKeyEPIT1, h_Results, numberOfValues, 2))
+	{
+		TransformVolumesLinear(d_T1_EPI_Volume, h_Registration_Parameters_EPI_T1_Affine, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
+		return;
+	}
 	
 	cl_mem d_T1_EPI_Tensor_Magnitude = clCreateBuffer(context, CL_MEM_READ_WRITE, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), NULL, NULL);
 	cl_mem d_Skullstripped_T1_Tensor_Magnitude = clCreateBuffer(context, CL_MEM_READ_WRITE, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), NULL, NULL);
@@ -7909,6 +9794,8 @@ void BROCCOLI_LIB::PerformRegistrationEPIT1()
 	h_Registration_Parameters_EPI_T1[4] = h_Rotations[1];
 	h_Registration_Parameters_EPI_T1[5] = h_Rotations[2];
 
+	WriteRegistrationResults("epi_t1", registrationResultsKeyEPIT1, h_Results, numberOfValues, 2);
+
 	clReleaseMemObject(d_T1_EPI_Tensor_Magnitude);
 	clReleaseMemObject(d_Skullstripped_T1_Tensor_Magnitude);
 }
@@ -7935,6 +9822,15 @@ void BROCCOLI_LIB::PerformRegistrationEPIT1Original()
 	// Make sure that the volumes overlap from start, save the translation parameters
 	MatchVolumeMasses(d_T1_EPI_Volume, d_T1_Volume, h_StartParameters_EPI_T1_Original, T1_DATA_W, T1_DATA_H, T1_DATA_D);
 
+	// Use the results of an earlier registration of the same volumes, if there is one
+	float* h_Results[1] = {h_Registration_Parameters_EPI_T1_Affine_Original};
+	size_t numberOfValues[1] = {(size_t)NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS};
+	if (ReadRegistrationResults("epi_t1_original", registrationResultsKeyEPIT1, h_Results, numberOfValues, 1))
+	{
+		TransformVolumesLinear(d_T1_EPI_Volume, h_Registration_Parameters_EPI_T1_Affine_Original, T1_DATA_W, T1_DATA_H, T1_DATA_D, 1, INTERPOLATION_MODE);
+		return;
+	}
+
 	cl_mem d_T1_EPI_Tensor_Magnitude = clCreateBuffer(context, CL_MEM_READ_WRITE, T1_DATA_W * T1_DATA_H * T1_DATA_D * sizeof(float), NULL, NULL);
 	cl_mem d_Skullstripped_T1_Tensor_Magnitude = clCreateBuffer(context, CL_MEM_READ_WRITE, T1_DATA_W * T1_DATA_H * T1_DATA_D * sizeof(float), NULL, NULL);
 
@@ -7961,6 +9857,7 @@ void BROCCOLI_LIB::PerformRegistrationEPIT1Original()
 	TransformVolumesLinear(d_T1_EPI_Volume, h_Registration_Parameters_EPI_T1_Rigid_Original, T1_DATA_W, T1_DATA_H, T1_DATA_D, 1, INTERPOLATION_MODE);
 	AddAffineRegistrationParameters(h_Registration_Parameters_EPI_T1_Affine_Original,h_Registration_Parameters_EPI_T1_Rigid_Original);
 		
+	WriteRegistrationResults("epi_t1_original", registrationResultsKeyEPIT1, h_Results, numberOfValues, 1);
 
 	clReleaseMemObject(d_T1_EPI_Tensor_Magnitude);
 	clReleaseMemObject(d_Skullstripped_T1_Tensor_Magnitude);
@@ -7985,7 +9882,8 @@ void BROCCOLI_LIB::PerformRegistrationTwoVolumesWrapper()
 	allocatedDeviceMemory += 2 * MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float);
 	deviceMemoryAllocations += 3;
 
-    clEnqueueWriteBuffer(commandQueue, d_Reference_Volume, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), h_MNI_Brain_Volume , 0, NULL, NULL);
+	// The reference volume is the same for all volumes, reuse its resized versions and filter responses
+	WriteTemplateVolume(d_Reference_Volume, h_MNI_Brain_Volume, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, MNI_VOXEL_SIZE_X, MNI_VOXEL_SIZE_Y, MNI_VOXEL_SIZE_Z);
 
 	for (int t = 0; t < T1_DATA_T; t++)
 	{	
@@ -8060,6 +9958,7 @@ void BROCCOLI_LIB::PerformRegistrationTwoVolumesWrapper()
 		}
 	}
 
+	EndTemplateAssets();
 
 	if (T1_DATA_T == 1)
 	{
@@ -8236,231 +10135,1276 @@ void BROCCOLI_LIB::PerformRegistrationT1MNINoSkullstrip()
 	// Copy result to skullstripped T1 volume, which will be used for the EPI-T1 registration
 	clEnqueueCopyBuffer(commandQueue, d_MNI_T1_Volume, d_Skullstripped_T1_Volume, 0, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), 0, NULL, NULL);
 
-	if (WRITE_INTERPOLATED_T1)
+	if (WRITE_INTERPOLATED_T1)
+	{
+		clEnqueueReadBuffer(commandQueue, d_MNI_T1_Volume, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), h_Interpolated_T1_Volume, 0, NULL, NULL);
+	}
+
+	// The results are the affine parameters, and the displacement field if there is a non-linear registration
+	size_t MNI_VOLUME_SIZE = (size_t)MNI_DATA_W * MNI_DATA_H * MNI_DATA_D;
+	int numberOfResults = (NUMBER_OF_ITERATIONS_FOR_NONLINEAR_IMAGE_REGISTRATION > 0) ? 4 : 1;
+	float* h_Results[4] = {h_Registration_Parameters_T1_MNI, NULL, NULL, NULL};
+	size_t numberOfValues[4] = {(size_t)NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS, MNI_VOLUME_SIZE, MNI_VOLUME_SIZE, MNI_VOLUME_SIZE};
+	std::vector<float> h_Displacement_Fields;
+	if ( (registrationResultsKeyT1MNI != 0) && (numberOfResults == 4) )
+	{
+		h_Displacement_Fields.resize(3 * MNI_VOLUME_SIZE);
+		h_Results[1] = &h_Displacement_Fields[0];
+		h_Results[2] = &h_Displacement_Fields[MNI_VOLUME_SIZE];
+		h_Results[3] = &h_Displacement_Fields[2 * MNI_VOLUME_SIZE];
+	}
+
+	// Use the results of an earlier registration of the same volumes, if there is one
+	bool savedResults = ReadRegistrationResults("t1_mni", registrationResultsKeyT1MNI, h_Results, numberOfValues, numberOfResults);
+
+	// The MNI brain volume is the reference for both registrations, reuse its resized versions and filter responses
+	BeginTemplateAssets(h_MNI_Brain_Volume, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, MNI_VOXEL_SIZE_X, MNI_VOXEL_SIZE_Y, MNI_VOXEL_SIZE_Z);
+
+	if (savedResults)
+	{
+		// Transform the volume in the same way as the registration does
+		TransformVolumesLinear(d_MNI_T1_Volume, h_Registration_Parameters_T1_MNI, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
+	}
+	else
+	{
+		// Do Linear registration between T1 and MNI with several scales (without skull)
+		AlignTwoVolumesLinearSeveralScales(h_Registration_Parameters_T1_MNI, h_Rotations, d_MNI_T1_Volume, d_MNI_Brain_Volume, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, COARSEST_SCALE_T1_MNI, NUMBER_OF_ITERATIONS_FOR_LINEAR_IMAGE_REGISTRATION, AFFINE, DO_OVERWRITE, INTERPOLATION_MODE);
+	}
+
+	if (WRITE_ALIGNED_T1_MNI_LINEAR)
+	{
+		clEnqueueReadBuffer(commandQueue, d_MNI_T1_Volume, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), h_Aligned_T1_Volume_Linear, 0, NULL, NULL);
+	}
+
+    if (NUMBER_OF_ITERATIONS_FOR_NONLINEAR_IMAGE_REGISTRATION > 0)
+	{
+		if (savedResults)
+		{
+			d_Total_Displacement_Field_X = clCreateBuffer(context, CL_MEM_READ_WRITE, MNI_VOLUME_SIZE * sizeof(float), NULL, NULL);
+			d_Total_Displacement_Field_Y = clCreateBuffer(context, CL_MEM_READ_WRITE, MNI_VOLUME_SIZE * sizeof(float), NULL, NULL);
+			d_Total_Displacement_Field_Z = clCreateBuffer(context, CL_MEM_READ_WRITE, MNI_VOLUME_SIZE * sizeof(float), NULL, NULL);
+
+			clEnqueueWriteBuffer(commandQueue, d_Total_Displacement_Field_X, CL_TRUE, 0, MNI_VOLUME_SIZE * sizeof(float), h_Results[1], 0, NULL, NULL);
+			clEnqueueWriteBuffer(commandQueue, d_Total_Displacement_Field_Y, CL_TRUE, 0, MNI_VOLUME_SIZE * sizeof(float), h_Results[2], 0, NULL, NULL);
+			clEnqueueWriteBuffer(commandQueue, d_Total_Displacement_Field_Z, CL_TRUE, 0, MNI_VOLUME_SIZE * sizeof(float), h_Results[3], 0, NULL, NULL);
+
+			TransformVolumesNonLinear(d_MNI_T1_Volume, d_Total_Displacement_Field_X, d_Total_Displacement_Field_Y, d_Total_Displacement_Field_Z, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
+		}
+		else
+		{
+			// Perform non-Linear registration between registered skullstripped volume and MNI brain volume
+			AlignTwoVolumesNonLinearSeveralScales(d_MNI_T1_Volume, d_MNI_Brain_Volume, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, COARSEST_SCALE_T1_MNI, NUMBER_OF_ITERATIONS_FOR_NONLINEAR_IMAGE_REGISTRATION, DO_OVERWRITE, INTERPOLATION_MODE, KEEP_DISPLACEMENT_FIELD);
+
+			if (registrationResultsKeyT1MNI != 0)
+			{
+				clEnqueueReadBuffer(commandQueue, d_Total_Displacement_Field_X, CL_TRUE, 0, MNI_VOLUME_SIZE * sizeof(float), h_Results[1], 0, NULL, NULL);
+				clEnqueueReadBuffer(commandQueue, d_Total_Displacement_Field_Y, CL_TRUE, 0, MNI_VOLUME_SIZE * sizeof(float), h_Results[2], 0, NULL, NULL);
+				clEnqueueReadBuffer(commandQueue, d_Total_Displacement_Field_Z, CL_TRUE, 0, MNI_VOLUME_SIZE * sizeof(float), h_Results[3], 0, NULL, NULL);
+			}
+		}
+
+		if (WRITE_ALIGNED_T1_MNI_NONLINEAR)
+		{
+			clEnqueueReadBuffer(commandQueue, d_MNI_T1_Volume, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), h_Aligned_T1_Volume_NonLinear, 0, NULL, NULL);
+		}
+	}
+
+	EndTemplateAssets();
+
+	if (!savedResults)
+	{
+		WriteRegistrationResults("t1_mni", registrationResultsKeyT1MNI, h_Results, numberOfValues, numberOfResults);
+	}
+}
+
+
+
+// Transforms volumes Linearally by applying a parameter vector
+void BROCCOLI_LIB::TransformVolumesLinear(cl_mem d_Volumes,
+		                                      float* h_Registration_Parameters_,
+		                                      int DATA_W,
+		                                      int DATA_H,
+		                                      int DATA_D,
+		                                      int NUMBER_OF_VOLUMES,
+		                                      int INTERPOLATION_MODE)
+{
+	// Allocate constant memory
+	cl_mem c_Parameters = clCreateBuffer(context, CL_MEM_READ_ONLY, NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS * sizeof(float), NULL, &createBufferErrorRegistrationParameters);
+
+	// Copy parameter vector to constant memory
+	clEnqueueWriteBuffer(commandQueue, c_Parameters, CL_TRUE, 0, NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS * sizeof(float), h_Registration_Parameters_, 0, NULL, NULL);
+
+	// Allocate memory for texture
+	
+	/*
+	cl_image_desc imageDesc;
+	imageDesc.image_type = CL_MEM_OBJECT_IMAGE3D;
+	imageDesc.image_width = DATA_W;
+	imageDesc.image_height = DATA_H;
+	imageDesc.image_depth = DATA_D;
+	imageDesc.image_row_pitch = 0;
+	imageDesc.image_slice_pitch = 0;
+	imageDesc.num_mip_levels = 0;
+	imageDesc.num_samples = 0;
+	imageDesc.buffer = NULL;
+	*/
+
+	//cl_mem d_Volume_Texture = clCreateImage(context, CL_MEM_READ_ONLY, &format, &imageDesc, NULL, NULL);
+
+	// Deprecated, the volumes are transformed in place so each volume is first copied to an image (or a buffer)
+	cl_mem d_Volume_Texture = AllocatePooledImage3D(DATA_W, DATA_H, DATA_D);
+	int ORIGINAL_VOLUME = 0;
+
+	SetGlobalAndLocalWorkSizesInterpolateVolume(DATA_W, DATA_H, DATA_D);
+
+	// Loop over volumes
+	for (int volume = 0; volume < NUMBER_OF_VOLUMES; volume++)
+	{
+		// Copy current volume to texture
+		CopyVolumeToInterpolationVolume(d_Volume_Texture, d_Volumes, volume, DATA_W, DATA_H, DATA_D);
+
+		// Interpolate to get the transformed volume
+		if (INTERPOLATION_MODE == LINEAR)
+		{
+			clSetKernelArg(InterpolateVolumeLinearLinearKernel, 0, sizeof(cl_mem), &d_Volumes);
+			clSetKernelArg(InterpolateVolumeLinearLinearKernel, 1, sizeof(cl_mem), &d_Volume_Texture);
+			clSetKernelArg(InterpolateVolumeLinearLinearKernel, 2, sizeof(cl_mem), &c_Parameters);
+			clSetKernelArg(InterpolateVolumeLinearLinearKernel, 3, sizeof(int), &DATA_W);
+			clSetKernelArg(InterpolateVolumeLinearLinearKernel, 4, sizeof(int), &DATA_H);
+			clSetKernelArg(InterpolateVolumeLinearLinearKernel, 5, sizeof(int), &DATA_D);
+			clSetKernelArg(InterpolateVolumeLinearLinearKernel, 6, sizeof(int), &volume);
+			if (USE_BUFFER_INTERPOLATION)
+			{
+				clSetKernelArg(InterpolateVolumeLinearLinearKernel, 7, sizeof(int), &ORIGINAL_VOLUME);
+			}
+			runKernelErrorInterpolateVolumeLinearLinear = clEnqueueNDRangeKernel(commandQueue, InterpolateVolumeLinearLinearKernel, 3, NULL, globalWorkSizeInterpolateVolume, localWorkSizeInterpolateVolume, 0, NULL, NULL);
+			clFinish(commandQueue);
+		}
+		else if (INTERPOLATION_MODE == CUBIC)
+		{
+			clSetKernelArg(InterpolateVolumeCubicLinearKernel, 0, sizeof(cl_mem), &d_Volumes);
+			clSetKernelArg(InterpolateVolumeCubicLinearKernel, 1, sizeof(cl_mem), &d_Volume_Texture);
+			clSetKernelArg(InterpolateVolumeCubicLinearKernel, 2, sizeof(cl_mem), &c_Parameters);
+			clSetKernelArg(InterpolateVolumeCubicLinearKernel, 3, sizeof(int), &DATA_W);
+			clSetKernelArg(InterpolateVolumeCubicLinearKernel, 4, sizeof(int), &DATA_H);
+			clSetKernelArg(InterpolateVolumeCubicLinearKernel, 5, sizeof(int), &DATA_D);
+			clSetKernelArg(InterpolateVolumeCubicLinearKernel, 6, sizeof(int), &volume);
+			if (USE_BUFFER_INTERPOLATION)
+			{
+				clSetKernelArg(InterpolateVolumeCubicLinearKernel, 7, sizeof(int), &ORIGINAL_VOLUME);
+			}
+			runKernelErrorInterpolateVolumeCubicLinear = clEnqueueNDRangeKernel(commandQueue, InterpolateVolumeCubicLinearKernel, 3, NULL, globalWorkSizeInterpolateVolume, localWorkSizeInterpolateVolume, 0, NULL, NULL);
+			clFinish(commandQueue);
+		}
+		else if (INTERPOLATION_MODE == NEAREST)
+		{
+			clSetKernelArg(InterpolateVolumeNearestLinearKernel, 0, sizeof(cl_mem), &d_Volumes);
+			clSetKernelArg(InterpolateVolumeNearestLinearKernel, 1, sizeof(cl_mem), &d_Volume_Texture);
+			clSetKernelArg(InterpolateVolumeNearestLinearKernel, 2, sizeof(cl_mem), &c_Parameters);
+			clSetKernelArg(InterpolateVolumeNearestLinearKernel, 3, sizeof(int), &DATA_W);
+			clSetKernelArg(InterpolateVolumeNearestLinearKernel, 4, sizeof(int), &DATA_H);
+			clSetKernelArg(InterpolateVolumeNearestLinearKernel, 5, sizeof(int), &DATA_D);
+			clSetKernelArg(InterpolateVolumeNearestLinearKernel, 6, sizeof(int), &volume);
+			if (USE_BUFFER_INTERPOLATION)
+			{
+				clSetKernelArg(InterpolateVolumeNearestLinearKernel, 7, sizeof(int), &ORIGINAL_VOLUME);
+			}
+			runKernelErrorInterpolateVolumeNearestLinear = clEnqueueNDRangeKernel(commandQueue, InterpolateVolumeNearestLinearKernel, 3, NULL, globalWorkSizeInterpolateVolume, localWorkSizeInterpolateVolume, 0, NULL, NULL);
+			clFinish(commandQueue);
+		}
+	}
+
+	ReleasePooledImage3D(d_Volume_Texture);
+	clReleaseMemObject(c_Parameters);
+}
+
+
+
+
+// Transforms volumes non-Linearally by applying a displacement field
+void BROCCOLI_LIB::TransformVolumesNonLinear(cl_mem d_Volumes,
+		                                         cl_mem d_Displacement_Field_X,
+		                                         cl_mem d_Displacement_Field_Y,
+		                                         cl_mem d_Displacement_Field_Z,
+		                                         int DATA_W,
+		                                         int DATA_H,
+		                                         int DATA_D,
+		                                         int NUMBER_OF_VOLUMES,
+		                                         int INTERPOLATION_MODE)
+{
+	// Allocate memory for texture
+	
+	/*
+	cl_image_desc imageDesc;
+	imageDesc.image_type = CL_MEM_OBJECT_IMAGE3D;
+	imageDesc.image_width = DATA_W;
+	imageDesc.image_height = DATA_H;
+	imageDesc.image_depth = DATA_D;
+	imageDesc.image_row_pitch = 0;
+	imageDesc.image_slice_pitch = 0;
+	imageDesc.num_mip_levels = 0;
+	imageDesc.num_samples = 0;
+	imageDesc.buffer = NULL;
+	*/
+
+	//cl_mem d_Volume_Texture = clCreateImage(context, CL_MEM_READ_ONLY, &format, &imageDesc, NULL, NULL);
+
+	// Deprecated, the volumes are transformed in place so each volume is first copied to an image (or a buffer)
+	cl_mem d_Volume_Texture = AllocatePooledImage3D(DATA_W, DATA_H, DATA_D);
+
+	SetGlobalAndLocalWorkSizesInterpolateVolume(DATA_W, DATA_H, DATA_D);
+
+	// Transform all volumes
+	for (int volume = 0; volume < NUMBER_OF_VOLUMES; volume++)
+	{
+		// Copy current volume to texture
+		CopyVolumeToInterpolationVolume(d_Volume_Texture, d_Volumes, volume, DATA_W, DATA_H, DATA_D);
+
+		// Interpolate to get the transformed volume
+		if (INTERPOLATION_MODE == LINEAR)
+		{
+			clSetKernelArg(InterpolateVolumeLinearNonLinearKernel, 0, sizeof(cl_mem), &d_Volumes);
+			clSetKernelArg(InterpolateVolumeLinearNonLinearKernel, 1, sizeof(cl_mem), &d_Volume_Texture);
+			clSetKernelArg(InterpolateVolumeLinearNonLinearKernel, 2, sizeof(cl_mem), &d_Displacement_Field_X);
+			clSetKernelArg(InterpolateVolumeLinearNonLinearKernel, 3, sizeof(cl_mem), &d_Displacement_Field_Y);
+			clSetKernelArg(InterpolateVolumeLinearNonLinearKernel, 4, sizeof(cl_mem), &d_Displacement_Field_Z);
+			clSetKernelArg(InterpolateVolumeLinearNonLinearKernel, 5, sizeof(int), &DATA_W);
+			clSetKernelArg(InterpolateVolumeLinearNonLinearKernel, 6, sizeof(int), &DATA_H);
+			clSetKernelArg(InterpolateVolumeLinearNonLinearKernel, 7, sizeof(int), &DATA_D);
+			clSetKernelArg(InterpolateVolumeLinearNonLinearKernel, 8, sizeof(int), &volume);
+			runKernelErrorInterpolateVolumeLinearNonLinear = clEnqueueNDRangeKernel(commandQueue, InterpolateVolumeLinearNonLinearKernel, 3, NULL, globalWorkSizeInterpolateVolume, localWorkSizeInterpolateVolume, 0, NULL, NULL);
+			clFinish(commandQueue);
+		}
+		else if (INTERPOLATION_MODE == CUBIC)
+		{
+			clSetKernelArg(InterpolateVolumeCubicNonLinearKernel, 0, sizeof(cl_mem), &d_Volumes);
+			clSetKernelArg(InterpolateVolumeCubicNonLinearKernel, 1, sizeof(cl_mem), &d_Volume_Texture);
+			clSetKernelArg(InterpolateVolumeCubicNonLinearKernel, 2, sizeof(cl_mem), &d_Displacement_Field_X);
+			clSetKernelArg(InterpolateVolumeCubicNonLinearKernel, 3, sizeof(cl_mem), &d_Displacement_Field_Y);
+			clSetKernelArg(InterpolateVolumeCubicNonLinearKernel, 4, sizeof(cl_mem), &d_Displacement_Field_Z);
+			clSetKernelArg(InterpolateVolumeCubicNonLinearKernel, 5, sizeof(int), &DATA_W);
+			clSetKernelArg(InterpolateVolumeCubicNonLinearKernel, 6, sizeof(int), &DATA_H);
+			clSetKernelArg(InterpolateVolumeCubicNonLinearKernel, 7, sizeof(int), &DATA_D);
+			clSetKernelArg(InterpolateVolumeCubicNonLinearKernel, 8, sizeof(int), &volume);
+			runKernelErrorInterpolateVolumeCubicNonLinear = clEnqueueNDRangeKernel(commandQueue, InterpolateVolumeCubicNonLinearKernel, 3, NULL, globalWorkSizeInterpolateVolume, localWorkSizeInterpolateVolume, 0, NULL, NULL);
+			clFinish(commandQueue);
+		}
+		else if (INTERPOLATION_MODE == NEAREST)
+		{
+			clSetKernelArg(InterpolateVolumeNearestNonLinearKernel, 0, sizeof(cl_mem), &d_Volumes);
+			clSetKernelArg(InterpolateVolumeNearestNonLinearKernel, 1, sizeof(cl_mem), &d_Volume_Texture);
+			clSetKernelArg(InterpolateVolumeNearestNonLinearKernel, 2, sizeof(cl_mem), &d_Displacement_Field_X);
+			clSetKernelArg(InterpolateVolumeNearestNonLinearKernel, 3, sizeof(cl_mem), &d_Displacement_Field_Y);
+			clSetKernelArg(InterpolateVolumeNearestNonLinearKernel, 4, sizeof(cl_mem), &d_Displacement_Field_Z);
+			clSetKernelArg(InterpolateVolumeNearestNonLinearKernel, 5, sizeof(int), &DATA_W);
+			clSetKernelArg(InterpolateVolumeNearestNonLinearKernel, 6, sizeof(int), &DATA_H);
+			clSetKernelArg(InterpolateVolumeNearestNonLinearKernel, 7, sizeof(int), &DATA_D);
+			clSetKernelArg(InterpolateVolumeNearestNonLinearKernel, 8, sizeof(int), &volume);
+			runKernelErrorInterpolateVolumeNearestNonLinear = clEnqueueNDRangeKernel(commandQueue, InterpolateVolumeNearestNonLinearKernel, 3, NULL, globalWorkSizeInterpolateVolume, localWorkSizeInterpolateVolume, 0, NULL, NULL);
+			clFinish(commandQueue);
+		}
+	}
+
+	ReleasePooledImage3D(d_Volume_Texture);
+}
+
+// Transforms volumes from EPI space to MNI space in a single interpolation, instead of first changing resolution and size
+// and then applying the EPI-T1 start parameters, the EPI-MNI registration parameters and the displacement field one
+// after each other. All linear steps are composed into two transformations, from MNI voxels to the voxels of the
+// interpolated EPI volume and from there to the original EPI voxels, such that each volume is only resampled once
+void BROCCOLI_LIB::TransformVolumesEPIToMNI(cl_mem d_MNI_Volumes,
+		                                    cl_mem d_EPI_Volumes,
+		                                    int NUMBER_OF_VOLUMES,
+		                                    int offset,
+		                                    int INTERPOLATION_MODE)
+{
+	float h_Composed_Transformation[30];
+
+	int EPI_SIZE[3] = {(int)EPI_DATA_W, (int)EPI_DATA_H, (int)EPI_DATA_D};
+	int MNI_SIZE[3] = {(int)MNI_DATA_W, (int)MNI_DATA_H, (int)MNI_DATA_D};
+	float EPI_VOXEL_SIZE[3] = {EPI_VOXEL_SIZE_X, EPI_VOXEL_SIZE_Y, EPI_VOXEL_SIZE_Z};
+	float MNI_VOXEL_SIZE[3] = {MNI_VOXEL_SIZE_X, MNI_VOXEL_SIZE_Y, MNI_VOXEL_SIZE_Z};
+
+	// Each parameter vector p transforms a voxel x as x + (p0 p1 p2) + P (x - center), i.e. as (I + P) x + (p0 p1 p2) - P center
+	float EPI_MNI_Matrix[9], EPI_MNI_Translation[3], EPI_T1_Matrix[9], EPI_T1_Translation[3], EPI_Matrix[9], EPI_Translation[3];
+	for (int i = 0; i < 3; i++)
+	{
+		EPI_MNI_Translation[i] = h_Registration_Parameters_EPI_MNI[i];
+		EPI_T1_Translation[i] = h_StartParameters_EPI_T1[i];
+		EPI_Translation[i] = h_StartParameters_EPI[i];
+
+		for (int j = 0; j < 3; j++)
+		{
+			EPI_MNI_Matrix[i * 3 + j] = h_Registration_Parameters_EPI_MNI[3 + i * 3 + j] + (i == j ? 1.0f : 0.0f);
+			EPI_T1_Matrix[i * 3 + j] = h_StartParameters_EPI_T1[3 + i * 3 + j] + (i == j ? 1.0f : 0.0f);
+			EPI_Matrix[i * 3 + j] = h_StartParameters_EPI[3 + i * 3 + j] + (i == j ? 1.0f : 0.0f);
+		}
+	}
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 3; j++)
+		{
+			EPI_MNI_Translation[i] -= h_Registration_Parameters_EPI_MNI[3 + i * 3 + j] * ((float)MNI_SIZE[j] - 1.0f) * 0.5f;
+			EPI_T1_Translation[i] -= h_StartParameters_EPI_T1[3 + i * 3 + j] * ((float)MNI_SIZE[j] - 1.0f) * 0.5f;
+			EPI_Translation[i] -= h_StartParameters_EPI[3 + i * 3 + j] * ((float)EPI_SIZE[j] - 1.0f) * 0.5f;
+		}
+	}
+
+	// MNI voxel to interpolated EPI voxel, first the EPI-MNI registration and then the EPI-T1 start parameters
+	for (int i = 0; i < 3; i++)
+	{
+		h_Composed_Transformation[i] = EPI_T1_Translation[i];
+		for (int j = 0; j < 3; j++)
+		{
+			h_Composed_Transformation[i] += EPI_T1_Matrix[i * 3 + j] * EPI_MNI_Translation[j];
+
+			h_Composed_Transformation[3 + i * 3 + j] = 0.0f;
+			for (int k = 0; k < 3; k++)
+			{
+				h_Composed_Transformation[3 + i * 3 + j] += EPI_T1_Matrix[i * 3 + k] * EPI_MNI_Matrix[k * 3 + j];
+			}
+		}
+	}
+
+	// Same voxel size and offset as in ChangeVolumesResolutionAndSize, voxels outside the interpolated volume are zero
+	float VOXEL_DIFFERENCE[3];
+	float OFFSET[3];
+	for (int i = 0; i < 3; i++)
+	{
+		int INTERPOLATED_SIZE = (int)myround((float)EPI_SIZE[i] * EPI_VOXEL_SIZE[i] / MNI_VOXEL_SIZE[i]);
+		int diff = INTERPOLATED_SIZE - MNI_SIZE[i];
+
+		VOXEL_DIFFERENCE[i] = (float)(EPI_SIZE[i] - 1) / (float)(INTERPOLATED_SIZE - 1);
+		OFFSET[i] = (diff > 0) ? myround((float)diff / 2.0f) : -myround((float)(-diff) / 2.0f);
+		if (i == 2)
+		{
+			OFFSET[i] += myround((float)MM_EPI_Z_CUT / MNI_VOXEL_SIZE_Z);
+		}
+
+		h_Composed_Transformation[12 + i * 2] = mymax(-0.5f, -0.5f - OFFSET[i]);
+		h_Composed_Transformation[13 + i * 2] = mymin((float)MNI_SIZE[i] - 0.5f, (float)INTERPOLATED_SIZE - 0.5f - OFFSET[i]);
+	}
+
+	// Interpolated EPI voxel to original EPI voxel, change of resolution followed by the EPI start parameters
+	for (int i = 0; i < 3; i++)
+	{
+		h_Composed_Transformation[18 + i] = EPI_Translation[i];
+		for (int j = 0; j < 3; j++)
+		{
+			h_Composed_Transformation[18 + i] += EPI_Matrix[i * 3 + j] * VOXEL_DIFFERENCE[j] * OFFSET[j];
+			h_Composed_Transformation[21 + i * 3 + j] = EPI_Matrix[i * 3 + j] * VOXEL_DIFFERENCE[j];
+		}
+	}
+
+	cl_mem c_Composed_Transformation = clCreateBuffer(context, CL_MEM_READ_ONLY, 30 * sizeof(float), NULL, NULL);
+	clEnqueueWriteBuffer(commandQueue, c_Composed_Transformation, CL_TRUE, 0, 30 * sizeof(float), h_Composed_Transformation, 0, NULL, NULL);
+
+	// When interpolating from buffers each volume is read directly from the EPI volumes, otherwise it is copied to an image
+	cl_mem d_Volume_Texture = d_EPI_Volumes;
+	if (!USE_BUFFER_INTERPOLATION)
+	{
+		d_Volume_Texture = AllocatePooledImage3D(EPI_DATA_W, EPI_DATA_H, EPI_DATA_D);
+	}
+
+	int USE_DISPLACEMENT_FIELD = (NUMBER_OF_ITERATIONS_FOR_NONLINEAR_IMAGE_REGISTRATION > 0) ? 1 : 0;
+
+	cl_kernel InterpolateVolumeComposedKernel = InterpolateVolumeLinearComposedKernel;
+	if (INTERPOLATION_MODE == CUBIC)
+	{
+		InterpolateVolumeComposedKernel = InterpolateVolumeCubicComposedKernel;
+	}
+	else if (INTERPOLATION_MODE == NEAREST)
+	{
+		InterpolateVolumeComposedKernel = InterpolateVolumeNearestComposedKernel;
+	}
+
+	clSetKernelArg(InterpolateVolumeComposedKernel, 0, sizeof(cl_mem), &d_MNI_Volumes);
+	clSetKernelArg(InterpolateVolumeComposedKernel, 1, sizeof(cl_mem), &d_Volume_Texture);
+	if (USE_DISPLACEMENT_FIELD == 1)
+	{
+		clSetKernelArg(InterpolateVolumeComposedKernel, 2, sizeof(cl_mem), &d_Total_Displacement_Field_X);
+		clSetKernelArg(InterpolateVolumeComposedKernel, 3, sizeof(cl_mem), &d_Total_Displacement_Field_Y);
+		clSetKernelArg(InterpolateVolumeComposedKernel, 4, sizeof(cl_mem), &d_Total_Displacement_Field_Z);
+	}
+	else
+	{
+		clSetKernelArg(InterpolateVolumeComposedKernel, 2, sizeof(cl_mem), NULL);
+		clSetKernelArg(InterpolateVolumeComposedKernel, 3, sizeof(cl_mem), NULL);
+		clSetKernelArg(InterpolateVolumeComposedKernel, 4, sizeof(cl_mem), NULL);
+	}
+	clSetKernelArg(InterpolateVolumeComposedKernel, 5, sizeof(cl_mem), &c_Composed_Transformation);
+	clSetKernelArg(InterpolateVolumeComposedKernel, 6, sizeof(int), &USE_DISPLACEMENT_FIELD);
+	clSetKernelArg(InterpolateVolumeComposedKernel, 7, sizeof(int), &MNI_DATA_W);
+	clSetKernelArg(InterpolateVolumeComposedKernel, 8, sizeof(int), &MNI_DATA_H);
+	clSetKernelArg(InterpolateVolumeComposedKernel, 9, sizeof(int), &MNI_DATA_D);
+	if (USE_BUFFER_INTERPOLATION)
+	{
+		clSetKernelArg(InterpolateVolumeComposedKernel, 11, sizeof(int), &EPI_DATA_W);
+		clSetKernelArg(InterpolateVolumeComposedKernel, 12, sizeof(int), &EPI_DATA_H);
+		clSetKernelArg(InterpolateVolumeComposedKernel, 13, sizeof(int), &EPI_DATA_D);
+	}
+
+	SetGlobalAndLocalWorkSizesInterpolateVolume(MNI_DATA_W, MNI_DATA_H, MNI_DATA_D);
+
+	for (int volume = 0; volume < NUMBER_OF_VOLUMES; volume++)
+	{
+		// Copy current volume to texture, or select it in the EPI volumes
+		int EPI_VOLUME = volume + offset;
+		if (USE_BUFFER_INTERPOLATION)
+		{
+			clSetKernelArg(InterpolateVolumeComposedKernel, 14, sizeof(int), &EPI_VOLUME);
+		}
+		else
+		{
+			CopyVolumeToInterpolationVolume(d_Volume_Texture, d_EPI_Volumes, EPI_VOLUME, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D);
+		}
+
+		clSetKernelArg(InterpolateVolumeComposedKernel, 10, sizeof(int), &volume);
+		cl_int error = clEnqueueNDRangeKernel(commandQueue, InterpolateVolumeComposedKernel, 3, NULL, globalWorkSizeInterpolateVolume, localWorkSizeInterpolateVolume, 0, NULL, NULL);
+
+		if (INTERPOLATION_MODE == CUBIC)
+		{
+			runKernelErrorInterpolateVolumeCubicComposed = error;
+		}
+		else if (INTERPOLATION_MODE == NEAREST)
+		{
+			runKernelErrorInterpolateVolumeNearestComposed = error;
+		}
+		else
+		{
+			runKernelErrorInterpolateVolumeLinearComposed = error;
+		}
+	}
+	clFinish(commandQueue);
+
+	if (!USE_BUFFER_INTERPOLATION)
+	{
+		ReleasePooledImage3D(d_Volume_Texture);
+	}
+	clReleaseMemObject(c_Composed_Transformation);
+}
+
+void BROCCOLI_LIB::PrintMemoryStatus(const char* text)
+{
+	UpdateMemoryHighWater();
+
+	if ((WRAPPER == BASH) && VERBOS)
+	{
+		printf("\n");
+		printf("Code location is %s \n",text);
+		//printf("Number of memory allocations is %i  \n",deviceMemoryAllocations);
+		//printf("Number of memory deallocations is %i  \n",deviceMemoryDeallocations);
+		printf("Total allocated device memory is %lu MB  \n",(unsigned long)(allocatedDeviceMemory/1024/1024));
+		printf("Total allocated host memory is %lu MB  \n",(unsigned long)(allocatedHostMemory/1024/1024));
+		printf("Device buffer pool in use is %lu MB, cached is %lu MB, high water mark is %lu MB (%lu MB reserved)  \n",(unsigned long)(devicePoolBytesInUse/1024/1024),(unsigned long)(devicePoolBytesCached/1024/1024),(unsigned long)(devicePoolBytesInUseHighWater/1024/1024),(unsigned long)(devicePoolBytesReservedHighWater/1024/1024));
+		printf("Device buffer pool reused %i of %i requested buffers  \n",devicePoolHits,devicePoolRequests);
+		printf("Device buffers are %lu MB, high water mark is %lu MB  \n",(unsigned long)(deviceBufferBytes/1024/1024),(unsigned long)(deviceBufferBytesHighWater/1024/1024));
+		printf("Host memory high water mark is %lu MB, peak resident memory is %lu MB  \n",(unsigned long)(allocatedHostMemoryHighWater/1024/1024),(unsigned long)(GetPeakResidentMemory()/1024/1024));
+		printf("\n");
+	}
+}
+
+// Returns the smallest size class that can hold the requested number of bytes,
+// each power of two is split into four classes so that at most 25% is wasted
+int BROCCOLI_LIB::GetDeviceBufferPoolSizeClass(size_t size)
+{
+	int sizeClass = 0;
+	while ( (sizeClass < (DEVICE_POOL_SIZE_CLASSES - 1)) && (GetDeviceBufferPoolClassSize(sizeClass) < size) )
+	{
+		sizeClass++;
+	}
+	return sizeClass;
+}
+
+size_t BROCCOLI_LIB::GetDeviceBufferPoolClassSize(int sizeClass)
+{
+	return ((size_t)(4 + (sizeClass & 3)) << (sizeClass >> 2)) * (DEVICE_POOL_SMALLEST_BUFFER / 4);
+}
+
+void BROCCOLI_LIB::UpdateDeviceBufferPoolHighWaterMarks()
+{
+	if (devicePoolBytesInUse > devicePoolBytesInUseHighWater)
+	{
+		devicePoolBytesInUseHighWater = devicePoolBytesInUse;
+	}
+	if ((devicePoolBytesInUse + devicePoolBytesCached) > devicePoolBytesReservedHighWater)
+	{
+		devicePoolBytesReservedHighWater = devicePoolBytesInUse + devicePoolBytesCached;
+	}
+}
+
+// Returns a read/write buffer of at least the requested size, reusing a released buffer of the same size class if possible
+cl_mem BROCCOLI_LIB::AllocatePooledBuffer(size_t size, cl_int* error)
+{
+	int sizeClass = GetDeviceBufferPoolSizeClass(size);
+	size_t classSize = GetDeviceBufferPoolClassSize(sizeClass);
+	cl_mem buffer = NULL;
+	cl_int createError = CL_SUCCESS;
+
+	devicePoolRequests++;
+
+	if (!devicePoolFreeBuffers[sizeClass].empty())
+	{
+		buffer = devicePoolFreeBuffers[sizeClass].back();
+		devicePoolFreeBuffers[sizeClass].pop_back();
+		devicePoolBytesCached -= classSize;
+		devicePoolHits++;
+	}
+	else
+	{
+		buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, classSize, NULL, &createError);
+
+		// The cached buffers may be what fills up the device, free them and try again
+		if ((createError != CL_SUCCESS) && (devicePoolBytesCached > 0))
+		{
+			ReleaseCachedDeviceBuffers();
+			buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, classSize, NULL, &createError);
+		}
+	}
+
+	if (error != NULL)
+	{
+		*error = createError;
+	}
+
+	if (createError != CL_SUCCESS)
+	{
+		return NULL;
+	}
+
+	devicePoolUsedBuffers.push_back(buffer);
+	devicePoolUsedSizeClasses.push_back(sizeClass);
+	devicePoolBytesInUse += classSize;
+	UpdateDeviceBufferPoolHighWaterMarks();
+
+	return buffer;
+}
+
+// Gives a buffer back to the pool, buffers that were not allocated from the pool are released
+void BROCCOLI_LIB::ReleasePooledBuffer(cl_mem buffer)
+{
+	if (buffer == NULL)
+	{
+		return;
+	}
+
+	for (size_t i = 0; i < devicePoolUsedBuffers.size(); i++)
+	{
+		if (devicePoolUsedBuffers[i] == buffer)
+		{
+			int sizeClass = devicePoolUsedSizeClasses[i];
+			size_t classSize = GetDeviceBufferPoolClassSize(sizeClass);
+
+			devicePoolUsedBuffers[i] = devicePoolUsedBuffers.back();
+			devicePoolUsedBuffers.pop_back();
+			devicePoolUsedSizeClasses[i] = devicePoolUsedSizeClasses.back();
+			devicePoolUsedSizeClasses.pop_back();
+			devicePoolBytesInUse -= classSize;
+
+			// Keep the buffer for the next call, unless the cache is full
+			if ((devicePoolBytesCached + classSize) <= devicePoolCacheLimit)
+			{
+				devicePoolFreeBuffers[sizeClass].push_back(buffer);
+				devicePoolBytesCached += classSize;
+			}
+			else
+			{
+				clReleaseMemObject(buffer);
+			}
+			return;
+		}
+	}
+
+	clReleaseMemObject(buffer);
+}
+
+// Returns a 3D image (texture) for interpolation, reusing a released image with the same dimensions if possible,
+// or a buffer of the same size when interpolating from buffers
+cl_mem BROCCOLI_LIB::AllocatePooledImage3D(size_t DATA_W, size_t DATA_H, size_t DATA_D)
+{
+	size_t imageSize = DATA_W * DATA_H * DATA_D * sizeof(float);
+
+	if (USE_BUFFER_INTERPOLATION)
+	{
+		return AllocatePooledBuffer(imageSize, NULL);
+	}
+
+	devicePoolRequests++;
+
+	for (size_t i = 0; i < devicePoolImages.size(); i++)
+	{
+		if (!devicePoolImageInUse[i] && (devicePoolImageSizes[3*i+0] == DATA_W) && (devicePoolImageSizes[3*i+1] == DATA_H) && (devicePoolImageSizes[3*i+2] == DATA_D))
+		{
+			devicePoolImageInUse[i] = true;
+			devicePoolBytesCached -= imageSize;
+			devicePoolBytesInUse += imageSize;
+			devicePoolHits++;
+			UpdateDeviceBufferPoolHighWaterMarks();
+			return devicePoolImages[i];
+		}
+	}
+
+	cl_image_format format;
+	format.image_channel_data_type = CL_FLOAT;
+	format.image_channel_order = CL_INTENSITY;
+
+	// Deprecated
+	cl_mem image = clCreateImage3D(context, CL_MEM_READ_ONLY, &format, DATA_W, DATA_H, DATA_D, 0, 0, NULL, NULL);
+
+	if ((image == NULL) && (devicePoolBytesCached > 0))
+	{
+		ReleaseCachedDeviceBuffers();
+		image = clCreateImage3D(context, CL_MEM_READ_ONLY, &format, DATA_W, DATA_H, DATA_D, 0, 0, NULL, NULL);
+	}
+
+	if (image == NULL)
+	{
+		return NULL;
+	}
+
+	devicePoolImages.push_back(image);
+	devicePoolImageSizes.push_back(DATA_W);
+	devicePoolImageSizes.push_back(DATA_H);
+	devicePoolImageSizes.push_back(DATA_D);
+	devicePoolImageInUse.push_back(true);
+	devicePoolBytesInUse += imageSize;
+	UpdateDeviceBufferPoolHighWaterMarks();
+
+	return image;
+}
+
+// Gives an image back to the pool, images that were not allocated from the pool are released
+void BROCCOLI_LIB::ReleasePooledImage3D(cl_mem image)
+{
+	if (image == NULL)
+	{
+		return;
+	}
+
+	if (USE_BUFFER_INTERPOLATION)
+	{
+		ReleasePooledBuffer(image);
+		return;
+	}
+
+	for (size_t i = 0; i < devicePoolImages.size(); i++)
+	{
+		if (devicePoolImages[i] == image)
+		{
+			size_t imageSize = devicePoolImageSizes[3*i+0] * devicePoolImageSizes[3*i+1] * devicePoolImageSizes[3*i+2] * sizeof(float);
+
+			devicePoolImageInUse[i] = false;
+			devicePoolBytesInUse -= imageSize;
+			devicePoolBytesCached += imageSize;
+
+			if (devicePoolBytesCached > devicePoolCacheLimit)
+			{
+				ReleaseCachedDeviceBuffers();
+			}
+			return;
+		}
+	}
+
+	clReleaseMemObject(image);
+}
+
+// Copies one volume (starting at volume offset) of a 4D buffer to an image or buffer from AllocatePooledImage3D
+void BROCCOLI_LIB::CopyVolumeToInterpolationVolume(cl_mem d_Interpolation_Volume, cl_mem d_Volumes, size_t offset, size_t DATA_W, size_t DATA_H, size_t DATA_D)
+{
+	size_t volumeSize = DATA_W * DATA_H * DATA_D * sizeof(float);
+
+	if (USE_BUFFER_INTERPOLATION)
+	{
+		clEnqueueCopyBuffer(commandQueue, d_Volumes, d_Interpolation_Volume, offset * volumeSize, 0, volumeSize, 0, NULL, NULL);
+	}
+	else
+	{
+		size_t origin[3] = {0, 0, 0};
+		size_t region[3] = {DATA_W, DATA_H, DATA_D};
+		clEnqueueCopyBufferToImage(commandQueue, d_Volumes, d_Interpolation_Volume, offset * volumeSize, origin, region, 0, NULL, NULL);
+	}
+}
+
+// Sets the volume that the linear registration interpolates from to volume t of d_Volumes, with buffer interpolation
+// the kernels read d_Volumes directly, otherwise the volume is copied to the image d_Original_Volume
+void BROCCOLI_LIB::SetLinearRegistrationInterpolationVolume(cl_mem d_Volumes, size_t t, int DATA_W, int DATA_H, int DATA_D)
+{
+	if (!USE_BUFFER_INTERPOLATION)
+	{
+		CopyVolumeToInterpolationVolume(d_Original_Volume, d_Volumes, t, DATA_W, DATA_H, DATA_D);
+		return;
+	}
+
+	int ORIGINAL_VOLUME = (int)t;
+
+	clSetKernelArg(InterpolateVolumeNearestLinearKernel, 1, sizeof(cl_mem), &d_Volumes);
+	clSetKernelArg(InterpolateVolumeNearestLinearKernel, 7, sizeof(int), &ORIGINAL_VOLUME);
+	clSetKernelArg(InterpolateVolumeLinearLinearKernel, 1, sizeof(cl_mem), &d_Volumes);
+	clSetKernelArg(InterpolateVolumeLinearLinearKernel, 7, sizeof(int), &ORIGINAL_VOLUME);
+	clSetKernelArg(InterpolateVolumeCubicLinearKernel, 1, sizeof(cl_mem), &d_Volumes);
+	clSetKernelArg(InterpolateVolumeCubicLinearKernel, 7, sizeof(int), &ORIGINAL_VOLUME);
+}
+
+// Releases all buffers and images in the pool that are not in use
+void BROCCOLI_LIB::ReleaseCachedDeviceBuffers()
+{
+	for (int c = 0; c < DEVICE_POOL_SIZE_CLASSES; c++)
+	{
+		for (size_t i = 0; i < devicePoolFreeBuffers[c].size(); i++)
+		{
+			clReleaseMemObject(devicePoolFreeBuffers[c][i]);
+		}
+		devicePoolFreeBuffers[c].clear();
+	}
+
+	size_t keep = 0;
+	for (size_t i = 0; i < devicePoolImages.size(); i++)
+	{
+		if (devicePoolImageInUse[i])
+		{
+			devicePoolImages[keep] = devicePoolImages[i];
+			devicePoolImageSizes[3*keep+0] = devicePoolImageSizes[3*i+0];
+			devicePoolImageSizes[3*keep+1] = devicePoolImageSizes[3*i+1];
+			devicePoolImageSizes[3*keep+2] = devicePoolImageSizes[3*i+2];
+			devicePoolImageInUse[keep] = true;
+			keep++;
+		}
+		else
+		{
+			clReleaseMemObject(devicePoolImages[i]);
+		}
+	}
+	devicePoolImages.resize(keep);
+	devicePoolImageSizes.resize(3*keep);
+	devicePoolImageInUse.resize(keep);
+
+	devicePoolBytesCached = 0;
+}
+
+// Releases everything held by the pool, including buffers that were never given back
+void BROCCOLI_LIB::ReleaseDeviceBufferPool()
+{
+	ReleaseCachedDeviceBuffers();
+
+	for (size_t i = 0; i < devicePoolUsedBuffers.size(); i++)
+	{
+		clReleaseMemObject(devicePoolUsedBuffers[i]);
+	}
+	devicePoolUsedBuffers.clear();
+	devicePoolUsedSizeClasses.clear();
+
+	for (size_t i = 0; i < devicePoolImages.size(); i++)
+	{
+		clReleaseMemObject(devicePoolImages[i]);
+	}
+	devicePoolImages.clear();
+	devicePoolImageSizes.clear();
+	devicePoolImageInUse.clear();
+
+	devicePoolBytesInUse = 0;
+}
+
+// 64 bit FNV-1a hash, used to recognize volumes and settings that have been processed before
+unsigned long long BROCCOLI_LIB::HashData(const void* data, size_t bytes, unsigned long long hash)
+{
+	const unsigned char* p = (const unsigned char*)data;
+	for (size_t i = 0; i < bytes; i++)
+	{
+		hash ^= (unsigned long long)p[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// Adds the filter size and all linear and non-linear registration filters to a hash
+unsigned long long BROCCOLI_LIB::HashRegistrationFilters(unsigned long long hash)
+{
+	float* filters[18] = {h_Quadrature_Filter_1_Linear_Registration_Real, h_Quadrature_Filter_1_Linear_Registration_Imag, h_Quadrature_Filter_2_Linear_Registration_Real, h_Quadrature_Filter_2_Linear_Registration_Imag, h_Quadrature_Filter_3_Linear_Registration_Real, h_Quadrature_Filter_3_Linear_Registration_Imag,
+	                      h_Quadrature_Filter_1_NonLinear_Registration_Real, h_Quadrature_Filter_1_NonLinear_Registration_Imag, h_Quadrature_Filter_2_NonLinear_Registration_Real, h_Quadrature_Filter_2_NonLinear_Registration_Imag, h_Quadrature_Filter_3_NonLinear_Registration_Real, h_Quadrature_Filter_3_NonLinear_Registration_Imag,
+	                      h_Quadrature_Filter_4_NonLinear_Registration_Real, h_Quadrature_Filter_4_NonLinear_Registration_Imag, h_Quadrature_Filter_5_NonLinear_Registration_Real, h_Quadrature_Filter_5_NonLinear_Registration_Imag, h_Quadrature_Filter_6_NonLinear_Registration_Real, h_Quadrature_Filter_6_NonLinear_Registration_Imag};
+
+	size_t filterSize = IMAGE_REGISTRATION_FILTER_SIZE * IMAGE_REGISTRATION_FILTER_SIZE * IMAGE_REGISTRATION_FILTER_SIZE;
+	hash = HashData(&IMAGE_REGISTRATION_FILTER_SIZE, sizeof(IMAGE_REGISTRATION_FILTER_SIZE), hash);
+	for (int f = 0; f < 18; f++)
+	{
+		if (filters[f] != NULL)
+		{
+			hash = HashData(filters[f], filterSize * sizeof(float), hash);
+		}
+	}
+	return hash;
+}
+
+std::string BROCCOLI_LIB::GetTemplateAssetsFilename()
+{
+	char name[64];
+	sprintf(name, "template_assets_%016llx.bin", templateAssetsKey);
+	return TEMPLATE_CACHE_DIRECTORY + name;
+}
+
+// Starts a registration where the reference volume is a template, the resized template and its filter responses
+// are then only calculated the first time, and are taken from memory (or the cache directory) for later registrations
+void BROCCOLI_LIB::BeginTemplateAssets(float* h_Template_Volume, int DATA_W, int DATA_H, int DATA_D, float VOXEL_SIZE_X, float VOXEL_SIZE_Y, float VOXEL_SIZE_Z)
+{
+	unsigned long long key = 14695981039346656037ULL;
+	key = HashData(TEMPLATE_ASSETS_MAGIC, 8, key);
+	key = HashData(h_Template_Volume, (size_t)DATA_W * DATA_H * DATA_D * sizeof(float), key);
+	int sizes[3] = {DATA_W, DATA_H, DATA_D};
+	float voxelSizes[3] = {VOXEL_SIZE_X, VOXEL_SIZE_Y, VOXEL_SIZE_Z};
+	key = HashData(sizes, sizeof(sizes), key);
+	key = HashData(voxelSizes, sizeof(voxelSizes), key);
+	key = HashData(&INTERPOLATION_MODE, sizeof(INTERPOLATION_MODE), key);
+	key = HashRegistrationFilters(key);
+
+	if ( (key != templateAssetsKey) || ((templateAssets.size() == 0) && (templateDeviceAssets.size() == 0)) )
+	{
+		templateAssets.clear();
+		templateAssetsBytes = 0;
+		ReleaseTemplateDeviceAssets();
+		templateAssetsKey = key;
+		templateAssetsChanged = false;
+
+		if (TEMPLATE_CACHE_DIRECTORY.size() > 0)
+		{
+			ReadTemplateAssets();
+		}
+	}
+
+	USE_TEMPLATE_ASSETS = true;
+}
+
+// Stops using the template assets, new assets are saved if there is a cache directory
+void BROCCOLI_LIB::EndTemplateAssets()
+{
+	USE_TEMPLATE_ASSETS = false;
+
+	if (templateAssetsChanged && (TEMPLATE_CACHE_DIRECTORY.size() > 0))
+	{
+		WriteTemplateAssets();
+	}
+	templateAssetsChanged = false;
+}
+
+// The file contains the magic string, the key, the number of assets and then, for each asset, the length of the name,
+// the name, the number of values and the values
+bool BROCCOLI_LIB::ReadTemplateAssets()
+{
+	std::string filename = GetTemplateAssetsFilename();
+	FILE* fp = fopen(filename.c_str(), "rb");
+	if (fp == NULL)
+	{
+		return false;
+	}
+
+	char magic[8];
+	unsigned long long key, numberOfAssets;
+	bool success = (fread(magic, 1, 8, fp) == 8) && (memcmp(magic, TEMPLATE_ASSETS_MAGIC, 8) == 0);
+	success = success && (fread(&key, sizeof(key), 1, fp) == 1) && (key == templateAssetsKey);
+	success = success && (fread(&numberOfAssets, sizeof(numberOfAssets), 1, fp) == 1);
+
+	for (unsigned long long a = 0; success && (a < numberOfAssets); a++)
+	{
+		unsigned int nameLength;
+		unsigned long long numberOfValues;
+		success = (fread(&nameLength, sizeof(nameLength), 1, fp) == 1) && (nameLength < 256);
+		std::string name(success ? nameLength : 0, ' ');
+		success = success && ( (nameLength == 0) || (fread(&name[0], 1, nameLength, fp) == nameLength) );
+		success = success && (fread(&numberOfValues, sizeof(numberOfValues), 1, fp) == 1) && ((templateAssetsBytes + numberOfValues * sizeof(float)) <= TEMPLATE_ASSETS_MAX_BYTES);
+		if (success)
+		{
+			std::vector<float>& values = templateAssets[name];
+			values.resize(numberOfValues);
+			success = (numberOfValues == 0) || (fread(&values[0], sizeof(float), numberOfValues, fp) == numberOfValues);
+			templateAssetsBytes += numberOfValues * sizeof(float);
+		}
+	}
+	fclose(fp);
+
+	if (!success)
+	{
+		if ((WRAPPER == BASH) && VERBOS)
+		{
+			printf("Ignoring template assets in %s, the file is damaged or was written on another type of computer \n",filename.c_str());
+		}
+		templateAssets.clear();
+		templateAssetsBytes = 0;
+		return false;
+	}
+
+	if ((WRAPPER == BASH) && VERBOS)
+	{
+		printf("Read %i template assets from %s \n",(int)templateAssets.size(),filename.c_str());
+	}
+
+	return true;
+}
+
+// Writes all assets to a temporary file that is then renamed, such that other processes never read a partial file
+bool BROCCOLI_LIB::WriteTemplateAssets()
+{
+	std::string filename = GetTemplateAssetsFilename();
+	std::string temporaryFilename = GetTemporaryFilename(filename);
+
+	FILE* fp = fopen(temporaryFilename.c_str(), "wb");
+	if (fp == NULL)
+	{
+		if (WRAPPER == BASH)
+		{
+			printf("Unable to write template assets to %s !\n",temporaryFilename.c_str());
+		}
+		return false;
+	}
+
+	unsigned long long numberOfAssets = templateAssets.size();
+	bool success = (fwrite(TEMPLATE_ASSETS_MAGIC, 1, 8, fp) == 8);
+	success = success && (fwrite(&templateAssetsKey, sizeof(templateAssetsKey), 1, fp) == 1);
+	success = success && (fwrite(&numberOfAssets, sizeof(numberOfAssets), 1, fp) == 1);
+
+	for (std::map<std::string, std::vector<float> >::iterator asset = templateAssets.begin(); success && (asset != templateAssets.end()); asset++)
+	{
+		unsigned int nameLength = (unsigned int)asset->first.size();
+		unsigned long long numberOfValues = asset->second.size();
+		success = (fwrite(&nameLength, sizeof(nameLength), 1, fp) == 1);
+		success = success && (fwrite(asset->first.c_str(), 1, nameLength, fp) == nameLength);
+		success = success && (fwrite(&numberOfValues, sizeof(numberOfValues), 1, fp) == 1);
+		success = success && ( (numberOfValues == 0) || (fwrite(&asset->second[0], sizeof(float), numberOfValues, fp) == numberOfValues) );
+	}
+
+	if (fclose(fp) != 0)
+	{
+		success = false;
+	}
+
+	if (!success || (rename(temporaryFilename.c_str(), filename.c_str()) != 0))
+	{
+		if (WRAPPER == BASH)
+		{
+			printf("Unable to write template assets to %s !\n",filename.c_str());
+		}
+		remove(temporaryFilename.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+// Name of an asset, e.g. "linear filter response 2 at 46 x 55 x 46"
+std::string BROCCOLI_LIB::GetTemplateAssetName(const char* name, int index, int DATA_W, int DATA_H, int DATA_D)
+{
+	std::stringstream ss;
+	ss << name << " " << index << " at " << DATA_W << " x " << DATA_H << " x " << DATA_D;
+	return ss.str();
+}
+
+// Copies stored template assets to the device buffers, returns false if any of them is missing (or no template is used).
+// Assets that are kept on the device are copied from there, and are otherwise uploaded from host memory
+bool BROCCOLI_LIB::GetTemplateAssets(const char* name, cl_mem* buffers, int numberOfBuffers, int DATA_W, int DATA_H, int DATA_D, int valuesPerVoxel)
+{
+	if (!USE_TEMPLATE_ASSETS)
+	{
+		return false;
+	}
+
+	size_t numberOfValues = (size_t)DATA_W * DATA_H * DATA_D * valuesPerVoxel;
+
+	std::vector<cl_mem> deviceAssets;
+	for (int b = 0; b < numberOfBuffers; b++)
+	{
+		std::map<std::string, cl_mem>::iterator asset = templateDeviceAssets.find(GetTemplateAssetName(name, b, DATA_W, DATA_H, DATA_D));
+		if (asset == templateDeviceAssets.end())
+		{
+			break;
+		}
+		deviceAssets.push_back(asset->second);
+	}
+
+	if ((int)deviceAssets.size() == numberOfBuffers)
+	{
+		for (int b = 0; b < numberOfBuffers; b++)
+		{
+			clEnqueueCopyBuffer(commandQueue, deviceAssets[b], buffers[b], 0, 0, numberOfValues * sizeof(float), 0, NULL, NULL);
+		}
+		return true;
+	}
+	std::vector<std::vector<float>*> assets;
+	for (int b = 0; b < numberOfBuffers; b++)
+	{
+		std::map<std::string, std::vector<float> >::iterator asset = templateAssets.find(GetTemplateAssetName(name, b, DATA_W, DATA_H, DATA_D));
+		if ( (asset == templateAssets.end()) || (asset->second.size() != numberOfValues) )
+		{
+			return false;
+		}
+		assets.push_back(&asset->second);
+	}
+
+	for (int b = 0; b < numberOfBuffers; b++)
+	{
+		clEnqueueWriteBuffer(commandQueue, buffers[b], CL_FALSE, 0, numberOfValues * sizeof(float), &(*assets[b])[0], 0, NULL, NULL);
+	}
+	clFinish(commandQueue);
+
+	StoreTemplateDeviceAssets(name, buffers, numberOfBuffers, DATA_W, DATA_H, DATA_D, valuesPerVoxel);
+
+	return true;
+}
+
+// Copies the device buffers to host, as assets of the current template
+void BROCCOLI_LIB::StoreTemplateAssets(const char* name, cl_mem* buffers, int numberOfBuffers, int DATA_W, int DATA_H, int DATA_D, int valuesPerVoxel)
+{
+	StoreTemplateDeviceAssets(name, buffers, numberOfBuffers, DATA_W, DATA_H, DATA_D, valuesPerVoxel);
+
+	size_t numberOfValues = (size_t)DATA_W * DATA_H * DATA_D * valuesPerVoxel;
+	if ( !USE_TEMPLATE_ASSETS || ((templateAssetsBytes + numberOfBuffers * numberOfValues * sizeof(float)) > TEMPLATE_ASSETS_MAX_BYTES) )
+	{
+		return;
+	}
+
+	for (int b = 0; b < numberOfBuffers; b++)
+	{
+		std::vector<float>& values = templateAssets[GetTemplateAssetName(name, b, DATA_W, DATA_H, DATA_D)];
+		values.resize(numberOfValues);
+		clEnqueueReadBuffer(commandQueue, buffers[b], CL_TRUE, 0, numberOfValues * sizeof(float), &values[0], 0, NULL, NULL);
+		templateAssetsBytes += numberOfValues * sizeof(float);
+	}
+
+	templateAssetsChanged = true;
+}
+
+// Keeps a device copy of template assets, such that later registrations to the same template (e.g. all subjects of a batch)
+// do not upload them again. At most a quarter of the device memory is used for the copies
+void BROCCOLI_LIB::StoreTemplateDeviceAssets(const char* name, cl_mem* buffers, int numberOfBuffers, int DATA_W, int DATA_H, int DATA_D, int valuesPerVoxel)
+{
+	size_t bytes = (size_t)DATA_W * DATA_H * DATA_D * valuesPerVoxel * sizeof(float);
+	if ( !USE_TEMPLATE_ASSETS || !KEEP_TEMPLATE_ON_DEVICE || ((templateDeviceAssetsBytes + numberOfBuffers * bytes) / (1024*1024) > globalMemorySize / 4) )
+	{
+		return;
+	}
+
+	for (int b = 0; b < numberOfBuffers; b++)
+	{
+		std::string assetName = GetTemplateAssetName(name, b, DATA_W, DATA_H, DATA_D);
+		if (templateDeviceAssets.find(assetName) != templateDeviceAssets.end())
+		{
+			continue;
+		}
+
+		cl_int error;
+		cl_mem asset = clCreateBuffer(context, CL_MEM_READ_ONLY, bytes, NULL, &error);
+		if (error != SUCCESS)
+		{
+			return;
+		}
+
+		clEnqueueCopyBuffer(commandQueue, buffers[b], asset, 0, 0, bytes, 0, NULL, NULL);
+		templateDeviceAssets[assetName] = asset;
+		templateDeviceAssetsBytes += bytes;
+
+		deviceMemoryAllocations += 1;
+		allocatedDeviceMemory += bytes;
+	}
+}
+
+void BROCCOLI_LIB::ReleaseTemplateDeviceAssets()
+{
+	for (std::map<std::string, cl_mem>::iterator asset = templateDeviceAssets.begin(); asset != templateDeviceAssets.end(); asset++)
+	{
+		clReleaseMemObject(asset->second);
+		deviceMemoryDeallocations += 1;
+	}
+	allocatedDeviceMemory -= templateDeviceAssetsBytes;
+
+	templateDeviceAssets.clear();
+	templateDeviceAssetsBytes = 0;
+}
+
+// Starts the template assets, and copies the template to a device buffer. The template is only uploaded the first time
+// if it is kept on the device
+void BROCCOLI_LIB::WriteTemplateVolume(cl_mem d_Volume, float* h_Template_Volume, int DATA_W, int DATA_H, int DATA_D, float VOXEL_SIZE_X, float VOXEL_SIZE_Y, float VOXEL_SIZE_Z)
+{
+	BeginTemplateAssets(h_Template_Volume, DATA_W, DATA_H, DATA_D, VOXEL_SIZE_X, VOXEL_SIZE_Y, VOXEL_SIZE_Z);
+
+	std::map<std::string, cl_mem>::iterator asset = templateDeviceAssets.find(GetTemplateAssetName("template volume", 0, DATA_W, DATA_H, DATA_D));
+	if (asset != templateDeviceAssets.end())
+	{
+		clEnqueueCopyBuffer(commandQueue, asset->second, d_Volume, 0, 0, (size_t)DATA_W * DATA_H * DATA_D * sizeof(float), 0, NULL, NULL);
+	}
+	else
+	{
+		clEnqueueWriteBuffer(commandQueue, d_Volume, CL_TRUE, 0, (size_t)DATA_W * DATA_H * DATA_D * sizeof(float), h_Template_Volume, 0, NULL, NULL);
+		StoreTemplateDeviceAssets("template volume", &d_Volume, 1, DATA_W, DATA_H, DATA_D, 1);
+	}
+}
+
+// Keeps the template, its resized versions and its filter responses on the device between registrations, e.g. for a batch
+void BROCCOLI_LIB::SetKeepTemplateOnDevice(bool keep)
+{
+	KEEP_TEMPLATE_ON_DEVICE = keep;
+	if (!KEEP_TEMPLATE_ON_DEVICE)
 	{
-		clEnqueueReadBuffer(commandQueue, d_MNI_T1_Volume, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), h_Interpolated_T1_Volume, 0, NULL, NULL);
+		ReleaseTemplateDeviceAssets();
 	}
+}
 
-	// Do Linear registration between T1 and MNI with several scales (without skull)
-	AlignTwoVolumesLinearSeveralScales(h_Registration_Parameters_T1_MNI, h_Rotations, d_MNI_T1_Volume, d_MNI_Brain_Volume, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, COARSEST_SCALE_T1_MNI, NUMBER_OF_ITERATIONS_FOR_LINEAR_IMAGE_REGISTRATION, AFFINE, DO_OVERWRITE, INTERPOLATION_MODE);
+// Name of a file that is written and then renamed to filename
+std::string BROCCOLI_LIB::GetTemporaryFilename(const std::string& filename)
+{
+	struct timeval time;
+	gettimeofday(&time, NULL);
+	char suffix[64];
+	sprintf(suffix, ".%lx%lx.tmp", (unsigned long)time.tv_sec, (unsigned long)time.tv_usec);
+	return filename + suffix;
+}
 
-	if (WRITE_ALIGNED_T1_MNI_LINEAR)
-	{
-		clEnqueueReadBuffer(commandQueue, d_MNI_T1_Volume, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), h_Aligned_T1_Volume_Linear, 0, NULL, NULL);
-	}
+// The T1-MNI registration depends on the T1 volume, the MNI volume and the registration settings, the fMRI-T1
+// registrations also depend on the first fMRI volume
+void BROCCOLI_LIB::CalculateRegistrationResultsKeys()
+{
+	registrationResultsKeyT1MNI = 0;
+	registrationResultsKeyEPIT1 = 0;
 
-    if (NUMBER_OF_ITERATIONS_FOR_NONLINEAR_IMAGE_REGISTRATION > 0)
+	if (REGISTRATION_CACHE_DIRECTORY.size() == 0)
 	{
-		// Perform non-Linear registration between registered skullstripped volume and MNI brain volume
-		AlignTwoVolumesNonLinearSeveralScales(d_MNI_T1_Volume, d_MNI_Brain_Volume, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, COARSEST_SCALE_T1_MNI, NUMBER_OF_ITERATIONS_FOR_NONLINEAR_IMAGE_REGISTRATION, DO_OVERWRITE, INTERPOLATION_MODE, KEEP_DISPLACEMENT_FIELD);
-
-		if (WRITE_ALIGNED_T1_MNI_NONLINEAR)
-		{
-			clEnqueueReadBuffer(commandQueue, d_MNI_T1_Volume, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), h_Aligned_T1_Volume_NonLinear, 0, NULL, NULL);
-		}
+		return;
 	}
-}
 
+	int T1MNISettings[11] = {(int)T1_DATA_W, (int)T1_DATA_H, (int)T1_DATA_D, (int)MNI_DATA_W, (int)MNI_DATA_H, (int)MNI_DATA_D, MM_T1_Z_CUT, INTERPOLATION_MODE, NUMBER_OF_ITERATIONS_FOR_LINEAR_IMAGE_REGISTRATION, NUMBER_OF_ITERATIONS_FOR_NONLINEAR_IMAGE_REGISTRATION, COARSEST_SCALE_T1_MNI};
+	float T1MNIVoxelSizes[6] = {T1_VOXEL_SIZE_X, T1_VOXEL_SIZE_Y, T1_VOXEL_SIZE_Z, MNI_VOXEL_SIZE_X, MNI_VOXEL_SIZE_Y, MNI_VOXEL_SIZE_Z};
 
+	unsigned long long key = 14695981039346656037ULL;
+	key = HashData(REGISTRATION_RESULTS_MAGIC, 8, key);
+	key = HashData(h_T1_Volume, (size_t)T1_DATA_W * T1_DATA_H * T1_DATA_D * sizeof(float), key);
+	key = HashData(h_MNI_Brain_Volume, (size_t)MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), key);
+	key = HashData(T1MNISettings, sizeof(T1MNISettings), key);
+	key = HashData(T1MNIVoxelSizes, sizeof(T1MNIVoxelSizes), key);
+	key = HashRegistrationFilters(key);
+	registrationResultsKeyT1MNI = key;
 
-// Transforms volumes Linearally by applying a parameter vector
-void BROCCOLI_LIB::TransformVolumesLinear(cl_mem d_Volumes,
-		                                      float* h_Registration_Parameters_,
-		                                      int DATA_W,
-		                                      int DATA_H,
-		                                      int DATA_D,
-		                                      int NUMBER_OF_VOLUMES,
-		                                      int INTERPOLATION_MODE)
-{
-	// Allocate constant memory
-	cl_mem c_Parameters = clCreateBuffer(context, CL_MEM_READ_ONLY, NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS * sizeof(float), NULL, &createBufferErrorRegistrationParameters);
+	int EPIT1Settings[4] = {(int)EPI_DATA_W, (int)EPI_DATA_H, (int)EPI_DATA_D, COARSEST_SCALE_EPI_T1};
+	float EPIVoxelSizes[3] = {EPI_VOXEL_SIZE_X, EPI_VOXEL_SIZE_Y, EPI_VOXEL_SIZE_Z};
 
-	// Copy parameter vector to constant memory
-	clEnqueueWriteBuffer(commandQueue, c_Parameters, CL_TRUE, 0, NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS * sizeof(float), h_Registration_Parameters_, 0, NULL, NULL);
+	key = HashData(h_fMRI_Volumes, (size_t)EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(float), key);
+	key = HashData(EPIT1Settings, sizeof(EPIT1Settings), key);
+	key = HashData(EPIVoxelSizes, sizeof(EPIVoxelSizes), key);
+	registrationResultsKeyEPIT1 = key;
+}
 
-	// Allocate memory for texture
-	cl_image_format format;
-	format.image_channel_data_type = CL_FLOAT;
-	format.image_channel_order = CL_INTENSITY;
-	
-	/*
-	cl_image_desc imageDesc;
-	imageDesc.image_type = CL_MEM_OBJECT_IMAGE3D;
-	imageDesc.image_width = DATA_W;
-	imageDesc.image_height = DATA_H;
-	imageDesc.image_depth = DATA_D;
-	imageDesc.image_row_pitch = 0;
-	imageDesc.image_slice_pitch = 0;
-	imageDesc.num_mip_levels = 0;
-	imageDesc.num_samples = 0;
-	imageDesc.buffer = NULL;
-	*/
+std::string BROCCOLI_LIB::GetRegistrationResultsFilename(const char* name, unsigned long long key)
+{
+	char filename[128];
+	sprintf(filename, "registration_%s_%016llx.bin", name, key);
+	return REGISTRATION_CACHE_DIRECTORY + filename;
+}
 
-	//cl_mem d_Volume_Texture = clCreateImage(context, CL_MEM_READ_ONLY, &format, &imageDesc, NULL, NULL);
+// Reads results saved by WriteRegistrationResults, returns false if there are no valid results for the key
+// (the results are then not changed)
+bool BROCCOLI_LIB::ReadRegistrationResults(const char* name, unsigned long long key, float** h_Results, size_t* numberOfValues, int numberOfResults)
+{
+	if (key == 0)
+	{
+		return false;
+	}
 
-	// Deprecated
-	cl_mem d_Volume_Texture = clCreateImage3D(context, CL_MEM_READ_ONLY, &format, DATA_W, DATA_H, DATA_D, 0, 0, NULL, NULL);
+	std::string filename = GetRegistrationResultsFilename(name, key);
+	FILE* fp = fopen(filename.c_str(), "rb");
+	if (fp == NULL)
+	{
+		return false;
+	}
 
-	SetGlobalAndLocalWorkSizesInterpolateVolume(DATA_W, DATA_H, DATA_D);
+	char magic[8];
+	unsigned long long fileKey, fileNumberOfResults;
+	bool success = (fread(magic, 1, 8, fp) == 8) && (memcmp(magic, REGISTRATION_RESULTS_MAGIC, 8) == 0);
+	success = success && (fread(&fileKey, sizeof(fileKey), 1, fp) == 1) && (fileKey == key);
+	success = success && (fread(&fileNumberOfResults, sizeof(fileNumberOfResults), 1, fp) == 1) && (fileNumberOfResults == (unsigned long long)numberOfResults);
 
-	// Loop over volumes
-	for (int volume = 0; volume < NUMBER_OF_VOLUMES; volume++)
+	std::vector<std::vector<float> > values(numberOfResults);
+	for (int r = 0; success && (r < numberOfResults); r++)
 	{
-		// Copy current volume to texture
-		size_t origin[3] = {0, 0, 0};
-		size_t region[3] = {DATA_W, DATA_H, DATA_D};
-		clEnqueueCopyBufferToImage(commandQueue, d_Volumes, d_Volume_Texture, volume * DATA_W * DATA_H * DATA_D * sizeof(float), origin, region, 0, NULL, NULL);
-
-		// Interpolate to get the transformed volume
-		if (INTERPOLATION_MODE == LINEAR)
+		unsigned long long fileNumberOfValues;
+		success = (fread(&fileNumberOfValues, sizeof(fileNumberOfValues), 1, fp) == 1) && (fileNumberOfValues == (unsigned long long)numberOfValues[r]);
+		if (success && (numberOfValues[r] > 0))
 		{
-			clSetKernelArg(InterpolateVolumeLinearLinearKernel, 0, sizeof(cl_mem), &d_Volumes);
-			clSetKernelArg(InterpolateVolumeLinearLinearKernel, 1, sizeof(cl_mem), &d_Volume_Texture);
-			clSetKernelArg(InterpolateVolumeLinearLinearKernel, 2, sizeof(cl_mem), &c_Parameters);
-			clSetKernelArg(InterpolateVolumeLinearLinearKernel, 3, sizeof(int), &DATA_W);
-			clSetKernelArg(InterpolateVolumeLinearLinearKernel, 4, sizeof(int), &DATA_H);
-			clSetKernelArg(InterpolateVolumeLinearLinearKernel, 5, sizeof(int), &DATA_D);
-			clSetKernelArg(InterpolateVolumeLinearLinearKernel, 6, sizeof(int), &volume);
-			runKernelErrorInterpolateVolumeLinearLinear = clEnqueueNDRangeKernel(commandQueue, InterpolateVolumeLinearLinearKernel, 3, NULL, globalWorkSizeInterpolateVolume, localWorkSizeInterpolateVolume, 0, NULL, NULL);
-			clFinish(commandQueue);
+			values[r].resize(numberOfValues[r]);
+			success = (fread(&values[r][0], sizeof(float), numberOfValues[r], fp) == numberOfValues[r]);
 		}
-		else if (INTERPOLATION_MODE == CUBIC)
+	}
+	fclose(fp);
+
+	if (!success)
+	{
+		if ((WRAPPER == BASH) && VERBOS)
 		{
-			clSetKernelArg(InterpolateVolumeCubicLinearKernel, 0, sizeof(cl_mem), &d_Volumes);
-			clSetKernelArg(InterpolateVolumeCubicLinearKernel, 1, sizeof(cl_mem), &d_Volume_Texture);
-			clSetKernelArg(InterpolateVolumeCubicLinearKernel, 2, sizeof(cl_mem), &c_Parameters);
-			clSetKernelArg(InterpolateVolumeCubicLinearKernel, 3, sizeof(int), &DATA_W);
-			clSetKernelArg(InterpolateVolumeCubicLinearKernel, 4, sizeof(int), &DATA_H);
-			clSetKernelArg(InterpolateVolumeCubicLinearKernel, 5, sizeof(int), &DATA_D);
-			clSetKernelArg(InterpolateVolumeCubicLinearKernel, 6, sizeof(int), &volume);
-			runKernelErrorInterpolateVolumeCubicLinear = clEnqueueNDRangeKernel(commandQueue, InterpolateVolumeCubicLinearKernel, 3, NULL, globalWorkSizeInterpolateVolume, localWorkSizeInterpolateVolume, 0, NULL, NULL);
-			clFinish(commandQueue);
+			printf("Ignoring registration results in %s, the file is damaged or was written on another type of computer \n",filename.c_str());
 		}
-		else if (INTERPOLATION_MODE == NEAREST)
+		return false;
+	}
+
+	for (int r = 0; r < numberOfResults; r++)
+	{
+		if (numberOfValues[r] > 0)
 		{
-			clSetKernelArg(InterpolateVolumeNearestLinearKernel, 0, sizeof(cl_mem), &d_Volumes);
-			clSetKernelArg(InterpolateVolumeNearestLinearKernel, 1, sizeof(cl_mem), &d_Volume_Texture);
-			clSetKernelArg(InterpolateVolumeNearestLinearKernel, 2, sizeof(cl_mem), &c_Parameters);
-			clSetKernelArg(InterpolateVolumeNearestLinearKernel, 3, sizeof(int), &DATA_W);
-			clSetKernelArg(InterpolateVolumeNearestLinearKernel, 4, sizeof(int), &DATA_H);
-			clSetKernelArg(InterpolateVolumeNearestLinearKernel, 5, sizeof(int), &DATA_D);
-			clSetKernelArg(InterpolateVolumeNearestLinearKernel, 6, sizeof(int), &volume);
-			runKernelErrorInterpolateVolumeNearestLinear = clEnqueueNDRangeKernel(commandQueue, InterpolateVolumeNearestLinearKernel, 3, NULL, globalWorkSizeInterpolateVolume, localWorkSizeInterpolateVolume, 0, NULL, NULL);
-			clFinish(commandQueue);
+			memcpy(h_Results[r], &values[r][0], numberOfValues[r] * sizeof(float));
 		}
 	}
 
-	clReleaseMemObject(d_Volume_Texture);
-	clReleaseMemObject(c_Parameters);
-}
-
-
+	if ((WRAPPER == BASH) && VERBOS)
+	{
+		printf("Read registration results from %s \n",filename.c_str());
+	}
 
+	return true;
+}
 
-// Transforms volumes non-Linearally by applying a displacement field
-void BROCCOLI_LIB::TransformVolumesNonLinear(cl_mem d_Volumes,
-		                                         cl_mem d_Displacement_Field_X,
-		                                         cl_mem d_Displacement_Field_Y,
-		                                         cl_mem d_Displacement_Field_Z,
-		                                         int DATA_W,
-		                                         int DATA_H,
-		                                         int DATA_D,
-		                                         int NUMBER_OF_VOLUMES,
-		                                         int INTERPOLATION_MODE)
+// The file contains the magic string, the key, the number of results and then, for each result, the number of
+// values and the values
+bool BROCCOLI_LIB::WriteRegistrationResults(const char* name, unsigned long long key, float** h_Results, size_t* numberOfValues, int numberOfResults)
 {
-	// Allocate memory for texture
-	cl_image_format format;
-	format.image_channel_data_type = CL_FLOAT;
-	format.image_channel_order = CL_INTENSITY;
-	
-	/*
-	cl_image_desc imageDesc;
-	imageDesc.image_type = CL_MEM_OBJECT_IMAGE3D;
-	imageDesc.image_width = DATA_W;
-	imageDesc.image_height = DATA_H;
-	imageDesc.image_depth = DATA_D;
-	imageDesc.image_row_pitch = 0;
-	imageDesc.image_slice_pitch = 0;
-	imageDesc.num_mip_levels = 0;
-	imageDesc.num_samples = 0;
-	imageDesc.buffer = NULL;
-	*/
-
-	//cl_mem d_Volume_Texture = clCreateImage(context, CL_MEM_READ_ONLY, &format, &imageDesc, NULL, NULL);
-
-	// Deprecated
-	cl_mem d_Volume_Texture = clCreateImage3D(context, CL_MEM_READ_ONLY, &format, DATA_W, DATA_H, DATA_D, 0, 0, NULL, NULL);
+	if (key == 0)
+	{
+		return false;
+	}
 
-	SetGlobalAndLocalWorkSizesInterpolateVolume(DATA_W, DATA_H, DATA_D);
+	std::string filename = GetRegistrationResultsFilename(name, key);
+	std::string temporaryFilename = GetTemporaryFilename(filename);
 
-	// Transform all volumes
-	for (int volume = 0; volume < NUMBER_OF_VOLUMES; volume++)
+	FILE* fp = fopen(temporaryFilename.c_str(), "wb");
+	if (fp == NULL)
 	{
-		// Copy current volume to texture
-		size_t origin[3] = {0, 0, 0};
-		size_t region[3] = {DATA_W, DATA_H, DATA_D};
-		clEnqueueCopyBufferToImage(commandQueue, d_Volumes, d_Volume_Texture, volume * DATA_W * DATA_H * DATA_D * sizeof(float), origin, region, 0, NULL, NULL);
-
-		// Interpolate to get the transformed volume
-		if (INTERPOLATION_MODE == LINEAR)
-		{
-			clSetKernelArg(InterpolateVolumeLinearNonLinearKernel, 0, sizeof(cl_mem), &d_Volumes);
-			clSetKernelArg(InterpolateVolumeLinearNonLinearKernel, 1, sizeof(cl_mem), &d_Volume_Texture);
-			clSetKernelArg(InterpolateVolumeLinearNonLinearKernel, 2, sizeof(cl_mem), &d_Displacement_Field_X);
-			clSetKernelArg(InterpolateVolumeLinearNonLinearKernel, 3, sizeof(cl_mem), &d_Displacement_Field_Y);
-			clSetKernelArg(InterpolateVolumeLinearNonLinearKernel, 4, sizeof(cl_mem), &d_Displacement_Field_Z);
-			clSetKernelArg(InterpolateVolumeLinearNonLinearKernel, 5, sizeof(int), &DATA_W);
-			clSetKernelArg(InterpolateVolumeLinearNonLinearKernel, 6, sizeof(int), &DATA_H);
-			clSetKernelArg(InterpolateVolumeLinearNonLinearKernel, 7, sizeof(int), &DATA_D);
-			clSetKernelArg(InterpolateVolumeLinearNonLinearKernel, 8, sizeof(int), &volume);
-			runKernelErrorInterpolateVolumeLinearNonLinear = clEnqueueNDRangeKernel(commandQueue, InterpolateVolumeLinearNonLinearKernel, 3, NULL, globalWorkSizeInterpolateVolume, localWorkSizeInterpolateVolume, 0, NULL, NULL);
-			clFinish(commandQueue);
-		}
-		else if (INTERPOLATION_MODE == CUBIC)
-		{
-			clSetKernelArg(InterpolateVolumeCubicNonLinearKernel, 0, sizeof(cl_mem), &d_Volumes);
-			clSetKernelArg(InterpolateVolumeCubicNonLinearKernel, 1, sizeof(cl_mem), &d_Volume_Texture);
-			clSetKernelArg(InterpolateVolumeCubicNonLinearKernel, 2, sizeof(cl_mem), &d_Displacement_Field_X);
-			clSetKernelArg(InterpolateVolumeCubicNonLinearKernel, 3, sizeof(cl_mem), &d_Displacement_Field_Y);
-			clSetKernelArg(InterpolateVolumeCubicNonLinearKernel, 4, sizeof(cl_mem), &d_Displacement_Field_Z);
-			clSetKernelArg(InterpolateVolumeCubicNonLinearKernel, 5, sizeof(int), &DATA_W);
-			clSetKernelArg(InterpolateVolumeCubicNonLinearKernel, 6, sizeof(int), &DATA_H);
-			clSetKernelArg(InterpolateVolumeCubicNonLinearKernel, 7, sizeof(int), &DATA_D);
-			clSetKernelArg(InterpolateVolumeCubicNonLinearKernel, 8, sizeof(int), &volume);
-			runKernelErrorInterpolateVolumeCubicNonLinear = clEnqueueNDRangeKernel(commandQueue, InterpolateVolumeCubicNonLinearKernel, 3, NULL, globalWorkSizeInterpolateVolume, localWorkSizeInterpolateVolume, 0, NULL, NULL);
-			clFinish(commandQueue);
-		}
-		else if (INTERPOLATION_MODE == NEAREST)
+		if (WRAPPER == BASH)
 		{
-			clSetKernelArg(InterpolateVolumeNearestNonLinearKernel, 0, sizeof(cl_mem), &d_Volumes);
-			clSetKernelArg(InterpolateVolumeNearestNonLinearKernel, 1, sizeof(cl_mem), &d_Volume_Texture);
-			clSetKernelArg(InterpolateVolumeNearestNonLinearKernel, 2, sizeof(cl_mem), &d_Displacement_Field_X);
-			clSetKernelArg(InterpolateVolumeNearestNonLinearKernel, 3, sizeof(cl_mem), &d_Displacement_Field_Y);
-			clSetKernelArg(InterpolateVolumeNearestNonLinearKernel, 4, sizeof(cl_mem), &d_Displacement_Field_Z);
-			clSetKernelArg(InterpolateVolumeNearestNonLinearKernel, 5, sizeof(int), &DATA_W);
-			clSetKernelArg(InterpolateVolumeNearestNonLinearKernel, 6, sizeof(int), &DATA_H);
-			clSetKernelArg(InterpolateVolumeNearestNonLinearKernel, 7, sizeof(int), &DATA_D);
-			clSetKernelArg(InterpolateVolumeNearestNonLinearKernel, 8, sizeof(int), &volume);
-			runKernelErrorInterpolateVolumeNearestNonLinear = clEnqueueNDRangeKernel(commandQueue, InterpolateVolumeNearestNonLinearKernel, 3, NULL, globalWorkSizeInterpolateVolume, localWorkSizeInterpolateVolume, 0, NULL, NULL);
-			clFinish(commandQueue);
+			printf("Unable to write registration results to %s !\n",temporaryFilename.c_str());
 		}
+		return false;
 	}
 
-	clReleaseMemObject(d_Volume_Texture);
-}
+	unsigned long long fileNumberOfResults = numberOfResults;
+	bool success = (fwrite(REGISTRATION_RESULTS_MAGIC, 1, 8, fp) == 8);
+	success = success && (fwrite(&key, sizeof(key), 1, fp) == 1);
+	success = success && (fwrite(&fileNumberOfResults, sizeof(fileNumberOfResults), 1, fp) == 1);
 
-void BROCCOLI_LIB::PrintMemoryStatus(const char* text)
-{
-	if ((WRAPPER == BASH) && VERBOS)
+	for (int r = 0; success && (r < numberOfResults); r++)
 	{
-		printf("\n");
-		printf("Code location is %s \n",text);
-		//printf("Number of memory allocations is %i  \n",deviceMemoryAllocations);
-		//printf("Number of memory deallocations is %i  \n",deviceMemoryDeallocations);
-		printf("Total allocated device memory is %lu MB  \n",(unsigned long)(allocatedDeviceMemory/1024/1024));
-		printf("Total allocated host memory is %lu MB  \n",(unsigned long)(allocatedHostMemory/1024/1024));
-		printf("\n");
+		unsigned long long fileNumberOfValues = numberOfValues[r];
+		success = (fwrite(&fileNumberOfValues, sizeof(fileNumberOfValues), 1, fp) == 1);
+		success = success && ( (numberOfValues[r] == 0) || (fwrite(h_Results[r], sizeof(float), numberOfValues[r], fp) == numberOfValues[r]) );
+	}
+
+	if (fclose(fp) != 0)
+	{
+		success = false;
+	}
+
+	if (!success || (rename(temporaryFilename.c_str(), filename.c_str()) != 0))
+	{
+		if (WRAPPER == BASH)
+		{
+			printf("Unable to write registration results to %s !\n",filename.c_str());
+		}
+		remove(temporaryFilename.c_str());
+		return false;
 	}
+
+	return true;
 }
 
 void BROCCOLI_LIB::PerformFirstLevelAnalysisWrapper()
@@ -8471,6 +11415,9 @@ void BROCCOLI_LIB::PerformFirstLevelAnalysisWrapper()
 	deviceMemoryDeallocations = 0;
 	allocatedDeviceMemory = 0;
 
+	size_t volumeBytes = (size_t)EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(float);
+	size_t volumesBytes = volumeBytes * EPI_DATA_T;
+
 	// Save the first untouched fMRI volume, to be used for fMRI-T1 registration later (if needed)
 	float* h_Temp_fMRI_Volume = (float*)malloc(EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(float));
 	memcpy(h_Temp_fMRI_Volume, h_fMRI_Volumes, EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(float));
@@ -8478,6 +11425,9 @@ void BROCCOLI_LIB::PerformFirstLevelAnalysisWrapper()
 	hostMemoryAllocations += 1;
 	allocatedHostMemory += EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(float);
 
+	// Registration results are saved and reused if there is a registration cache directory
+	CalculateRegistrationResultsKeys();
+
 	//---------------------------------------------------------------------------------------------------------------------------------------
 	// T1-MNI registration
 	//---------------------------------------------------------------------------------------------------------------------------------------
@@ -8487,6 +11437,8 @@ void BROCCOLI_LIB::PerformFirstLevelAnalysisWrapper()
 		printf("\nPerforming registration between T1 and MNI\n");
 	}
 
+	BeginPipelineStage("T1-MNI registration", ((size_t)T1_DATA_W * T1_DATA_H * T1_DATA_D + (size_t)MNI_DATA_W * MNI_DATA_H * MNI_DATA_D) * sizeof(float));
+
 	// Allocate memory on device for registration
 	d_T1_Volume = clCreateBuffer(context, CL_MEM_READ_WRITE,  T1_DATA_W * T1_DATA_H * T1_DATA_D * sizeof(float), NULL, NULL);
 	d_MNI_Brain_Volume = clCreateBuffer(context, CL_MEM_READ_WRITE,  MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), NULL, NULL);
@@ -8501,7 +11453,7 @@ void BROCCOLI_LIB::PerformFirstLevelAnalysisWrapper()
 
 	// Copy data to device
 	clEnqueueWriteBuffer(commandQueue, d_T1_Volume, CL_TRUE, 0, T1_DATA_W * T1_DATA_H * T1_DATA_D * sizeof(float), h_T1_Volume , 0, NULL, NULL);
-	clEnqueueWriteBuffer(commandQueue, d_MNI_Brain_Volume, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), h_MNI_Brain_Volume , 0, NULL, NULL);
+	WriteTemplateVolume(d_MNI_Brain_Volume, h_MNI_Brain_Volume, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, MNI_VOXEL_SIZE_X, MNI_VOXEL_SIZE_Y, MNI_VOXEL_SIZE_Z);
 
 	PerformRegistrationT1MNINoSkullstrip();
 
@@ -8526,6 +11478,8 @@ void BROCCOLI_LIB::PerformFirstLevelAnalysisWrapper()
 		printf("Performing registration between fMRI and T1\n");
 	}
 
+	BeginPipelineStage("fMRI-T1 registration", volumeBytes + (size_t)MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float));
+
 	// Allocate memory on device
 	d_EPI_Volume = clCreateBuffer(context, CL_MEM_READ_WRITE,  EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(float), NULL, NULL);
 	d_T1_EPI_Volume = clCreateBuffer(context, CL_MEM_READ_WRITE,  MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), NULL, NULL);
@@ -8580,6 +11534,8 @@ void BROCCOLI_LIB::PerformFirstLevelAnalysisWrapper()
 	// EPI - T1 original
 	//---------------------------------------------------------------------------------------------------------------------------------------
 
+	BeginPipelineStage("fMRI-T1 registration original T1", volumeBytes + (size_t)T1_DATA_W * T1_DATA_H * T1_DATA_D * sizeof(float));
+
 	// Allocate memory on device
 	d_T1_Volume = clCreateBuffer(context, CL_MEM_READ_WRITE,  T1_DATA_W * T1_DATA_H * T1_DATA_D * sizeof(float), NULL, NULL);
 	d_EPI_Volume = clCreateBuffer(context, CL_MEM_READ_WRITE,  EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(float), NULL, NULL);
@@ -8605,7 +11561,21 @@ void BROCCOLI_LIB::PerformFirstLevelAnalysisWrapper()
 	// Slice timing correction
 	//---------------------------------------------------------------------------------------------------------------------------------------
 
-	if (APPLY_SLICE_TIMING_CORRECTION)
+	// Slice timing correction and motion correction can be applied in one interpolation, if all the volumes fit in device memory
+	bool fuseSliceTimingAndMotionCorrection = false;
+	bool sliceTimingCorrectedOnDevice = false;
+	if (FUSE_SLICE_TIMING_AND_MOTION_CORRECTION && APPLY_SLICE_TIMING_CORRECTION && APPLY_MOTION_CORRECTION && (SLICE_ORDER != UNDEFINED) && !WRITE_SLICETIMING_CORRECTED)
+	{
+		size_t volumesSize = (size_t)EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * EPI_DATA_T * sizeof(float);
+		fuseSliceTimingAndMotionCorrection = ((allocatedDeviceMemory + 2 * volumesSize) / (1024*1024) <= globalMemorySize) && ((maxMemoryAllocationSize == 0) || (volumesSize <= maxMemoryAllocationSize));
+
+		if (!fuseSliceTimingAndMotionCorrection && (WRAPPER == BASH) && VERBOS)
+		{
+			printf("Not enough device memory for combined slice timing and motion correction, doing them separately\n");
+		}
+	}
+
+	if (APPLY_SLICE_TIMING_CORRECTION && !fuseSliceTimingAndMotionCorrection)
 	{
 		if (SLICE_ORDER != UNDEFINED)
 		{
@@ -8614,16 +11584,43 @@ void BROCCOLI_LIB::PerformFirstLevelAnalysisWrapper()
 				printf("Performing slice timing correction \n");
 			}
 
+			BeginPipelineStage("Slice timing correction", volumesBytes);
+
 			PrintMemoryStatus("Before slice timing correction");
 
-			PerformSliceTimingCorrectionHost(h_fMRI_Volumes);
+			// Correct all slices in one launch and keep the corrected volumes on the device for the motion correction,
+			// if they fit together with the original volumes and the 18 volumes used by the motion correction
+			sliceTimingCorrectedOnDevice = AllocateSliceTimingCorrectionVolumes(APPLY_MOTION_CORRECTION ? 18 * volumeBytes : 0);
 
-			PrintMemoryStatus("After slice timing correction");
+			if (sliceTimingCorrectedOnDevice)
+			{
+				clEnqueueWriteBuffer(commandQueue, d_fMRI_Volumes, CL_TRUE, 0, volumesBytes, h_fMRI_Volumes, 0, NULL, NULL);
+
+				PerformSliceTimingCorrection();
+
+				if (WRITE_SLICETIMING_CORRECTED)
+				{
+					clEnqueueReadBuffer(commandQueue, d_Slice_Timing_Corrected_fMRI_Volumes, CL_TRUE, 0, volumesBytes, h_Slice_Timing_Corrected_fMRI_Volumes, 0, NULL, NULL);
+				}
 
-			if (WRITE_SLICETIMING_CORRECTED)
+				if (!APPLY_MOTION_CORRECTION)
+				{
+					clEnqueueReadBuffer(commandQueue, d_Slice_Timing_Corrected_fMRI_Volumes, CL_TRUE, 0, volumesBytes, h_fMRI_Volumes, 0, NULL, NULL);
+					ReleaseSliceTimingCorrectionVolumes();
+					sliceTimingCorrectedOnDevice = false;
+				}
+			}
+			else
 			{
-				memcpy(h_Slice_Timing_Corrected_fMRI_Volumes, h_fMRI_Volumes, EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * EPI_DATA_T * sizeof(float));
+				PerformSliceTimingCorrectionHost(h_fMRI_Volumes);
+
+				if (WRITE_SLICETIMING_CORRECTED)
+				{
+					memcpy(h_Slice_Timing_Corrected_fMRI_Volumes, h_fMRI_Volumes, EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * EPI_DATA_T * sizeof(float));
+				}
 			}
+
+			PrintMemoryStatus("After slice timing correction");
 		}
 		else
 		{
@@ -8643,20 +11640,38 @@ void BROCCOLI_LIB::PerformFirstLevelAnalysisWrapper()
 	{
 		if ((WRAPPER == BASH) && PRINT)
 		{
-			printf("Performing motion correction");
+			printf(fuseSliceTimingAndMotionCorrection ? "Performing slice timing and motion correction" : "Performing motion correction");
 			if (!VERBOS)
 			{
 				printf("\n");	
 			}
 		}
 
+		BeginPipelineStage(fuseSliceTimingAndMotionCorrection ? "Slice timing and motion correction" : "Motion correction", volumesBytes);
+
 		PrintMemoryStatus("Before motion correction");
 
 		h_Motion_Parameters = (float*)malloc(EPI_DATA_T * NUMBER_OF_MOTION_REGRESSORS * sizeof(float));
 		allocatedHostMemory += EPI_DATA_T * NUMBER_OF_MOTION_REGRESSORS * sizeof(float);
 		hostMemoryAllocations += 1;
 
-		PerformMotionCorrectionHost(h_fMRI_Volumes);
+		if (fuseSliceTimingAndMotionCorrection)
+		{
+			PerformSliceTimingAndMotionCorrectionHost(h_fMRI_Volumes);
+		}
+		else if (sliceTimingCorrectedOnDevice)
+		{
+			// The original volumes are not needed anymore, store the motion corrected volumes there
+			d_Motion_Corrected_fMRI_Volumes = d_fMRI_Volumes;
+			PerformMotionCorrection(d_Slice_Timing_Corrected_fMRI_Volumes);
+
+			clEnqueueReadBuffer(commandQueue, d_Motion_Corrected_fMRI_Volumes, CL_TRUE, 0, volumesBytes, h_fMRI_Volumes, 0, NULL, NULL);
+			ReleaseSliceTimingCorrectionVolumes();
+		}
+		else
+		{
+			PerformMotionCorrectionHost(h_fMRI_Volumes, NULL);
+		}
 
 		if ((WRAPPER == BASH) && VERBOS)
 		{
@@ -8689,6 +11704,8 @@ void BROCCOLI_LIB::PerformFirstLevelAnalysisWrapper()
 		printf("Performing EPI segmentation\n");
 	}
 
+	BeginPipelineStage("EPI segmentation", volumeBytes);
+
 	d_EPI_Mask = clCreateBuffer(context, CL_MEM_READ_WRITE, EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(float), NULL, NULL);
 
 	deviceMemoryAllocations += 1;
@@ -8726,6 +11743,8 @@ void BROCCOLI_LIB::PerformFirstLevelAnalysisWrapper()
 			printf("Performing smoothing\n");
 		}
 	
+		BeginPipelineStage("Smoothing", volumesBytes);
+
 		PrintMemoryStatus("Before smoothing");
 
 		PerformSmoothingNormalizedHost(h_fMRI_Volumes, d_EPI_Mask, d_Smoothed_EPI_Mask, h_Smoothing_Filter_X, h_Smoothing_Filter_Y, h_Smoothing_Filter_Z, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, EPI_DATA_T);
@@ -8749,6 +11768,9 @@ void BROCCOLI_LIB::PerformFirstLevelAnalysisWrapper()
 			printf("Performing statistical analysis\n");
 		}
 
+		// AR estimation and whitening are part of the GLM, their kernels are listed in the device times of the stage
+		BeginPipelineStage("GLM", volumesBytes);
+
 		NUMBER_OF_TOTAL_GLM_REGRESSORS = NUMBER_OF_GLM_REGRESSORS*(USE_TEMPORAL_DERIVATIVES+1) + NUMBER_OF_DETRENDING_REGRESSORS*NUMBER_OF_RUNS + NUMBER_OF_MOTION_REGRESSORS*REGRESS_MOTION + REGRESS_GLOBALMEAN + NUMBER_OF_CONFOUND_REGRESSORS*REGRESS_CONFOUNDS;
 
 		CalculateNumberOfBrainVoxels(d_EPI_Mask, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D);
@@ -8903,10 +11925,14 @@ void BROCCOLI_LIB::PerformFirstLevelAnalysisWrapper()
 			clEnqueueReadBuffer(commandQueue, d_AR4_Estimates, CL_TRUE, 0, EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(float), h_AR4_Estimates_EPI, 0, NULL, NULL);
 		}		
 
+		BeginPipelineStage("Transform results to MNI", volumeBytes * (NUMBER_OF_TOTAL_GLM_REGRESSORS + 2 * NUMBER_OF_CONTRASTS));
+
 		TransformFirstLevelResultsToMNI(true);
 
 		if (WRITE_ACTIVITY_T1)
 		{
+			BeginPipelineStage("Results in T1 space", volumesBytes);
+
 			// Run the actual GLM again
 			if (!largeMemory)
 			{
@@ -8951,6 +11977,8 @@ void BROCCOLI_LIB::PerformFirstLevelAnalysisWrapper()
 		// Do statistical analysis without whitening	
 		if (WRITE_UNWHITENED_RESULTS)
 		{
+			BeginPipelineStage("GLM without whitening", volumesBytes);
+
 			// Calculate maps without whitening
 			if (!largeMemory)
 			{
@@ -9040,6 +12068,8 @@ void BROCCOLI_LIB::PerformFirstLevelAnalysisWrapper()
 					c_Permutation_Vector = clCreateBuffer(context, CL_MEM_READ_ONLY, EPI_DATA_T * sizeof(unsigned short int), NULL, NULL);
 					c_Permutation_Distribution = clCreateBuffer(context, CL_MEM_READ_ONLY, NUMBER_OF_PERMUTATIONS * sizeof(float), NULL, NULL);
 
+					BeginPipelineStage("Permutation test", volumesBytes);
+
 					PrintMemoryStatus("Before permutation testing");
 	
 					// Run the actual permutation test
@@ -9140,6 +12170,8 @@ void BROCCOLI_LIB::PerformFirstLevelAnalysisWrapper()
 	// Only transform the preprocessed fMRI data to MNI space
 	else if (PREPROCESSING_ONLY)
 	{
+		BeginPipelineStage("Transform fMRI volumes to MNI", volumesBytes);
+
 		TransformfMRIVolumesToMNI();
 	}
 	// Only estimate beta values, no t- or F-scores
@@ -9150,6 +12182,8 @@ void BROCCOLI_LIB::PerformFirstLevelAnalysisWrapper()
 			printf("Performing statistical analysis, only estimating beta values and contrasts\n");
 		}
 
+		BeginPipelineStage("GLM beta weights", volumesBytes);
+
 		NUMBER_OF_TOTAL_GLM_REGRESSORS = NUMBER_OF_GLM_REGRESSORS*(USE_TEMPORAL_DERIVATIVES+1) + NUMBER_OF_DETRENDING_REGRESSORS*NUMBER_OF_RUNS + NUMBER_OF_MOTION_REGRESSORS*REGRESS_MOTION + REGRESS_GLOBALMEAN + NUMBER_OF_CONFOUND_REGRESSORS*REGRESS_CONFOUNDS;
 
 		// Check amount of global memory, compared to required memory
@@ -9352,6 +12386,8 @@ void BROCCOLI_LIB::PerformFirstLevelAnalysisWrapper()
 		deviceMemoryAllocations += 3;
 		allocatedDeviceMemory += (EPI_DATA_W * EPI_DATA_H * EPI_DATA_D)*(10 + 6 + 1) * sizeof(float);
 
+		BeginPipelineStage("Bayesian GLM", volumesBytes);
+
 		PrintMemoryStatus("Before Bayesian GLM");
 
 		h_X_GLM = (float*)malloc(NUMBER_OF_TOTAL_GLM_REGRESSORS * EPI_DATA_T * sizeof(float));
@@ -9429,6 +12465,8 @@ void BROCCOLI_LIB::PerformFirstLevelAnalysisWrapper()
 			printf("Performing regression\n");
 		}
 
+		BeginPipelineStage("Regression", volumesBytes);
+
 		NUMBER_OF_TOTAL_GLM_REGRESSORS = NUMBER_OF_DETRENDING_REGRESSORS*NUMBER_OF_RUNS + NUMBER_OF_MOTION_REGRESSORS*REGRESS_MOTION + REGRESS_GLOBALMEAN + NUMBER_OF_CONFOUND_REGRESSORS*REGRESS_CONFOUNDS;
 
 		// Check amount of global memory, compared to required memory
@@ -9621,7 +12659,12 @@ void BROCCOLI_LIB::PerformFirstLevelAnalysisWrapper()
 		hostMemoryDeallocations += 1;
 	}
 
+	registrationResultsKeyT1MNI = 0;
+	registrationResultsKeyEPIT1 = 0;
+
 	PrintMemoryStatus("After deallocating masks");
+
+	EndPipelineStage();
 }
 
 
@@ -9643,21 +12686,8 @@ void BROCCOLI_LIB::TransformResidualsToMNI()
 		// Copy current volume to temp
 		clEnqueueWriteBuffer(commandQueue, d_Temp, CL_TRUE, 0, EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(float), &h_fMRI_Volumes[i * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D], 0, NULL, NULL);
 
-		// First apply initial translation before changing resolution and size 
-		TransformVolumesLinear(d_Temp, h_StartParameters_EPI, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, 1, INTERPOLATION_MODE);
-
-		// Change resolution and size of volume
-		ChangeVolumesResolutionAndSize(d_Data, d_Temp, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, 1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, EPI_VOXEL_SIZE_X, EPI_VOXEL_SIZE_Y, EPI_VOXEL_SIZE_Z, MNI_VOXEL_SIZE_X, MNI_VOXEL_SIZE_Y, MNI_VOXEL_SIZE_Z, MM_EPI_Z_CUT, INTERPOLATION_MODE, 0);
-
-		// Now apply the same translation as applied before the EPI-T1 registration
-		TransformVolumesLinear(d_Data, h_StartParameters_EPI_T1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-
-		// Apply transformation
-		TransformVolumesLinear(d_Data, h_Registration_Parameters_EPI_MNI, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-		if (NUMBER_OF_ITERATIONS_FOR_NONLINEAR_IMAGE_REGISTRATION > 0)		
-		{
-			TransformVolumesNonLinear(d_Data, d_Total_Displacement_Field_X, d_Total_Displacement_Field_Y, d_Total_Displacement_Field_Z, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-		}
+		// Change resolution and size and apply all transformations in a single interpolation
+		TransformVolumesEPIToMNI(d_Data, d_Temp, 1, 0, INTERPOLATION_MODE);
 
 		// Write transformed volume to host
 		clEnqueueReadBuffer(commandQueue, d_Data, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), &h_Residuals_MNI[i * MNI_DATA_W * MNI_DATA_H * MNI_DATA_D], 0, NULL, NULL);
@@ -9676,21 +12706,8 @@ void BROCCOLI_LIB::TransformMaskToMNI()
 	// Copy mask volume to temp
 	clEnqueueWriteBuffer(commandQueue, d_Temp, CL_TRUE, 0, EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(float), h_EPI_Mask, 0, NULL, NULL);
 
-	// First apply initial translation before changing resolution and size 
-	TransformVolumesLinear(d_Temp, h_StartParameters_EPI, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, 1, NEAREST);
-
-	// Change resolution and size of volume
-	ChangeVolumesResolutionAndSize(d_Data, d_Temp, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, 1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, EPI_VOXEL_SIZE_X, EPI_VOXEL_SIZE_Y, EPI_VOXEL_SIZE_Z, MNI_VOXEL_SIZE_X, MNI_VOXEL_SIZE_Y, MNI_VOXEL_SIZE_Z, MM_EPI_Z_CUT, NEAREST, 0);
-
-	// Now apply the same translation as applied before the EPI-T1 registration
-	TransformVolumesLinear(d_Data, h_StartParameters_EPI_T1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, NEAREST);
-
-	// Apply transformation
-	TransformVolumesLinear(d_Data, h_Registration_Parameters_EPI_MNI, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, NEAREST);
-	if (NUMBER_OF_ITERATIONS_FOR_NONLINEAR_IMAGE_REGISTRATION > 0)
-	{
-		TransformVolumesNonLinear(d_Data, d_Total_Displacement_Field_X, d_Total_Displacement_Field_Y, d_Total_Displacement_Field_Z, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, NEAREST);
-	}
+	// Change resolution and size and apply all transformations in a single interpolation
+	TransformVolumesEPIToMNI(d_Data, d_Temp, 1, 0, NEAREST);
 
 	// Write transformed mask to host
 	clEnqueueReadBuffer(commandQueue, d_Data, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), h_MNI_Mask, 0, NULL, NULL);
@@ -9711,21 +12728,8 @@ void BROCCOLI_LIB::TransformfMRIVolumesToMNI()
 		// Copy current volume to temp
 		clEnqueueWriteBuffer(commandQueue, d_Temp, CL_TRUE, 0, EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(float), &h_fMRI_Volumes[i * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D], 0, NULL, NULL);
 
-		// First apply initial translation before changing resolution and size 
-		TransformVolumesLinear(d_Temp, h_StartParameters_EPI, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, 1, INTERPOLATION_MODE);
-
-		// Change resolution and size of volume
-		ChangeVolumesResolutionAndSize(d_Data, d_Temp, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, 1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, EPI_VOXEL_SIZE_X, EPI_VOXEL_SIZE_Y, EPI_VOXEL_SIZE_Z, MNI_VOXEL_SIZE_X, MNI_VOXEL_SIZE_Y, MNI_VOXEL_SIZE_Z, MM_EPI_Z_CUT, INTERPOLATION_MODE, 0);
-
-		// Now apply the same translation as applied before the EPI-T1 registration
-		TransformVolumesLinear(d_Data, h_StartParameters_EPI_T1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-
-		// Apply transformation
-		TransformVolumesLinear(d_Data, h_Registration_Parameters_EPI_MNI, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-		if (NUMBER_OF_ITERATIONS_FOR_NONLINEAR_IMAGE_REGISTRATION > 0)
-		{
-			TransformVolumesNonLinear(d_Data, d_Total_Displacement_Field_X, d_Total_Displacement_Field_Y, d_Total_Displacement_Field_Z, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-		}
+		// Change resolution and size and apply all transformations in a single interpolation
+		TransformVolumesEPIToMNI(d_Data, d_Temp, 1, 0, INTERPOLATION_MODE);
 
 		// Write transformed volume to host
 		clEnqueueReadBuffer(commandQueue, d_Data, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), &h_fMRI_Volumes_MNI[i * MNI_DATA_W * MNI_DATA_H * MNI_DATA_D], 0, NULL, NULL);
@@ -9742,31 +12746,13 @@ void BROCCOLI_LIB::TransformFirstLevelResultsToMNI(bool WHITENED)
 	// Allocate temporary memory
 	cl_mem d_Data = clCreateBuffer(context, CL_MEM_READ_WRITE, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), NULL, NULL);
 
-	// Make a copy of results, to not ruin transformation to T1
-
-	// First apply initial translation before changing resolution and size 
-	TransformVolumesLinear(d_Beta_Volumes, h_StartParameters_EPI, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, NUMBER_OF_TOTAL_GLM_REGRESSORS, INTERPOLATION_MODE);
-	TransformVolumesLinear(d_Contrast_Volumes, h_StartParameters_EPI, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, NUMBER_OF_CONTRASTS, INTERPOLATION_MODE);
-	if (!BETAS_ONLY)
-	{
-		TransformVolumesLinear(d_Statistical_Maps, h_StartParameters_EPI, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, NUMBER_OF_CONTRASTS, INTERPOLATION_MODE);
-	}
+	// The results are only read, such that they can still be transformed to T1
 
 	// Loop over regressors
 	for (int i = 0; i < NUMBER_OF_TOTAL_GLM_REGRESSORS; i++)
 	{
-		// Change resolution and size of volume
-		ChangeVolumesResolutionAndSize(d_Data, d_Beta_Volumes, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, 1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, EPI_VOXEL_SIZE_X, EPI_VOXEL_SIZE_Y, EPI_VOXEL_SIZE_Z, MNI_VOXEL_SIZE_X, MNI_VOXEL_SIZE_Y, MNI_VOXEL_SIZE_Z, MM_EPI_Z_CUT, INTERPOLATION_MODE, i);
-
-		// Now apply the same translation as applied before the EPI-T1 registration
-		TransformVolumesLinear(d_Data, h_StartParameters_EPI_T1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-
-		// Apply transformation
-		TransformVolumesLinear(d_Data, h_Registration_Parameters_EPI_MNI, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-		if (NUMBER_OF_ITERATIONS_FOR_NONLINEAR_IMAGE_REGISTRATION > 0)
-		{
-			TransformVolumesNonLinear(d_Data, d_Total_Displacement_Field_X, d_Total_Displacement_Field_Y, d_Total_Displacement_Field_Z, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-		}
+		// Change resolution and size and apply all transformations in a single interpolation
+		TransformVolumesEPIToMNI(d_Data, d_Beta_Volumes, 1, i, INTERPOLATION_MODE);
 
 		// Write transformed volume to host
 		if (WHITENED)
@@ -9782,18 +12768,8 @@ void BROCCOLI_LIB::TransformFirstLevelResultsToMNI(bool WHITENED)
 	// Loop over contrasts
 	for (int i = 0; i < NUMBER_OF_CONTRASTS; i++)
 	{
-		// Change resolution and size of volume
-		ChangeVolumesResolutionAndSize(d_Data, d_Contrast_Volumes, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, 1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, EPI_VOXEL_SIZE_X, EPI_VOXEL_SIZE_Y, EPI_VOXEL_SIZE_Z, MNI_VOXEL_SIZE_X, MNI_VOXEL_SIZE_Y, MNI_VOXEL_SIZE_Z, MM_EPI_Z_CUT, INTERPOLATION_MODE, i);
-
-		// Now apply the same translation as applied before the EPI-T1 registration
-		TransformVolumesLinear(d_Data, h_StartParameters_EPI_T1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-
-		// Apply transformation
-		TransformVolumesLinear(d_Data, h_Registration_Parameters_EPI_MNI, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-		if (NUMBER_OF_ITERATIONS_FOR_NONLINEAR_IMAGE_REGISTRATION > 0)
-		{
-			TransformVolumesNonLinear(d_Data, d_Total_Displacement_Field_X, d_Total_Displacement_Field_Y, d_Total_Displacement_Field_Z, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-		}
+		// Change resolution and size and apply all transformations in a single interpolation
+		TransformVolumesEPIToMNI(d_Data, d_Contrast_Volumes, 1, i, INTERPOLATION_MODE);
 
 		// Write transformed volume to host
 		if (WHITENED)
@@ -9811,18 +12787,8 @@ void BROCCOLI_LIB::TransformFirstLevelResultsToMNI(bool WHITENED)
 		// Loop over contrasts, for statistical maps
 		for (int i = 0; i < NUMBER_OF_CONTRASTS; i++)
 		{
-			// Change resolution and size of volume
-			ChangeVolumesResolutionAndSize(d_Data, d_Statistical_Maps, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, 1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, EPI_VOXEL_SIZE_X, EPI_VOXEL_SIZE_Y, EPI_VOXEL_SIZE_Z, MNI_VOXEL_SIZE_X, MNI_VOXEL_SIZE_Y, MNI_VOXEL_SIZE_Z, MM_EPI_Z_CUT, INTERPOLATION_MODE, i);
-
-			// Now apply the same translation as applied before the EPI-T1 registration
-			TransformVolumesLinear(d_Data, h_StartParameters_EPI_T1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-
-			// Apply transformation
-			TransformVolumesLinear(d_Data, h_Registration_Parameters_EPI_MNI, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-			if (NUMBER_OF_ITERATIONS_FOR_NONLINEAR_IMAGE_REGISTRATION > 0)
-			{
-				TransformVolumesNonLinear(d_Data, d_Total_Displacement_Field_X, d_Total_Displacement_Field_Y, d_Total_Displacement_Field_Z, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-			}
+			// Change resolution and size and apply all transformations in a single interpolation
+			TransformVolumesEPIToMNI(d_Data, d_Statistical_Maps, 1, i, INTERPOLATION_MODE);
 
 			// Write transformed volume to host
 			if (WHITENED)
@@ -9847,50 +12813,26 @@ void BROCCOLI_LIB::TransformFirstLevelResultsToMNI(bool WHITENED)
 
 	if (WRITE_AR_ESTIMATES_MNI && WHITENED && !BETAS_ONLY)
 	{
-		TransformVolumesLinear(d_AR1_Estimates, h_StartParameters_EPI, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, 1, INTERPOLATION_MODE);
-		ChangeVolumesResolutionAndSize(d_Data, d_AR1_Estimates, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, 1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, EPI_VOXEL_SIZE_X, EPI_VOXEL_SIZE_Y, EPI_VOXEL_SIZE_Z, MNI_VOXEL_SIZE_X, MNI_VOXEL_SIZE_Y, MNI_VOXEL_SIZE_Z, MM_EPI_Z_CUT, INTERPOLATION_MODE, 0);
-		TransformVolumesLinear(d_Data, h_StartParameters_EPI_T1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-		TransformVolumesLinear(d_Data, h_Registration_Parameters_EPI_MNI, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-		if (NUMBER_OF_ITERATIONS_FOR_NONLINEAR_IMAGE_REGISTRATION > 0)
-		{
-			TransformVolumesNonLinear(d_Data, d_Total_Displacement_Field_X, d_Total_Displacement_Field_Y, d_Total_Displacement_Field_Z, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-		}
+		// Change resolution and size and apply all transformations in a single interpolation
+		TransformVolumesEPIToMNI(d_Data, d_AR1_Estimates, 1, 0, INTERPOLATION_MODE);
 
 		// Write transformed volume to host
 		clEnqueueReadBuffer(commandQueue, d_Data, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), h_AR1_Estimates_MNI, 0, NULL, NULL);
 
-		TransformVolumesLinear(d_AR2_Estimates, h_StartParameters_EPI, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, 1, INTERPOLATION_MODE);
-		ChangeVolumesResolutionAndSize(d_Data, d_AR2_Estimates, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, 1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, EPI_VOXEL_SIZE_X, EPI_VOXEL_SIZE_Y, EPI_VOXEL_SIZE_Z, MNI_VOXEL_SIZE_X, MNI_VOXEL_SIZE_Y, MNI_VOXEL_SIZE_Z, MM_EPI_Z_CUT, INTERPOLATION_MODE, 0);
-		TransformVolumesLinear(d_Data, h_StartParameters_EPI_T1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-		TransformVolumesLinear(d_Data, h_Registration_Parameters_EPI_MNI, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-		if (NUMBER_OF_ITERATIONS_FOR_NONLINEAR_IMAGE_REGISTRATION > 0)
-		{
-			TransformVolumesNonLinear(d_Data, d_Total_Displacement_Field_X, d_Total_Displacement_Field_Y, d_Total_Displacement_Field_Z, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-		}
+		// Change resolution and size and apply all transformations in a single interpolation
+		TransformVolumesEPIToMNI(d_Data, d_AR2_Estimates, 1, 0, INTERPOLATION_MODE);
 
 		// Write transformed volume to host
 		clEnqueueReadBuffer(commandQueue, d_Data, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), h_AR2_Estimates_MNI, 0, NULL, NULL);
 
-		TransformVolumesLinear(d_AR3_Estimates, h_StartParameters_EPI, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, 1, INTERPOLATION_MODE);
-		ChangeVolumesResolutionAndSize(d_Data, d_AR3_Estimates, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, 1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, EPI_VOXEL_SIZE_X, EPI_VOXEL_SIZE_Y, EPI_VOXEL_SIZE_Z, MNI_VOXEL_SIZE_X, MNI_VOXEL_SIZE_Y, MNI_VOXEL_SIZE_Z, MM_EPI_Z_CUT, INTERPOLATION_MODE, 0);
-		TransformVolumesLinear(d_Data, h_StartParameters_EPI_T1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-		TransformVolumesLinear(d_Data, h_Registration_Parameters_EPI_MNI, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-		if (NUMBER_OF_ITERATIONS_FOR_NONLINEAR_IMAGE_REGISTRATION > 0)
-		{
-			TransformVolumesNonLinear(d_Data, d_Total_Displacement_Field_X, d_Total_Displacement_Field_Y, d_Total_Displacement_Field_Z, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-		}
+		// Change resolution and size and apply all transformations in a single interpolation
+		TransformVolumesEPIToMNI(d_Data, d_AR3_Estimates, 1, 0, INTERPOLATION_MODE);
 
 		// Write transformed volume to host
 		clEnqueueReadBuffer(commandQueue, d_Data, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), h_AR3_Estimates_MNI, 0, NULL, NULL);
 
-		TransformVolumesLinear(d_AR4_Estimates, h_StartParameters_EPI, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, 1, INTERPOLATION_MODE);
-		ChangeVolumesResolutionAndSize(d_Data, d_AR4_Estimates, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, 1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, EPI_VOXEL_SIZE_X, EPI_VOXEL_SIZE_Y, EPI_VOXEL_SIZE_Z, MNI_VOXEL_SIZE_X, MNI_VOXEL_SIZE_Y, MNI_VOXEL_SIZE_Z, MM_EPI_Z_CUT, INTERPOLATION_MODE, 0);
-		TransformVolumesLinear(d_Data, h_StartParameters_EPI_T1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-		TransformVolumesLinear(d_Data, h_Registration_Parameters_EPI_MNI, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-		if (NUMBER_OF_ITERATIONS_FOR_NONLINEAR_IMAGE_REGISTRATION > 0)
-		{
-			TransformVolumesNonLinear(d_Data, d_Total_Displacement_Field_X, d_Total_Displacement_Field_Y, d_Total_Displacement_Field_Z, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-		}
+		// Change resolution and size and apply all transformations in a single interpolation
+		TransformVolumesEPIToMNI(d_Data, d_AR4_Estimates, 1, 0, INTERPOLATION_MODE);
 
 		// Write transformed volume to host
 		clEnqueueReadBuffer(commandQueue, d_Data, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), h_AR4_Estimates_MNI, 0, NULL, NULL);
@@ -10025,24 +12967,11 @@ void BROCCOLI_LIB::TransformBayesianFirstLevelResultsToMNI()
 	// Allocate temporary memory
 	cl_mem d_Data = clCreateBuffer(context, CL_MEM_READ_WRITE, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), NULL, NULL);
 
-	TransformVolumesLinear(d_Beta_Volumes, h_StartParameters_EPI, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, 2, INTERPOLATION_MODE);
-	TransformVolumesLinear(d_Statistical_Maps, h_StartParameters_EPI, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, 6, INTERPOLATION_MODE);
-
 	// Loop over regressors, for beta volumes
 	for (int i = 0; i < 2; i++)
 	{
-		// Change resolution and size of volume
-		ChangeVolumesResolutionAndSize(d_Data, d_Beta_Volumes, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, 1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, EPI_VOXEL_SIZE_X, EPI_VOXEL_SIZE_Y, EPI_VOXEL_SIZE_Z, MNI_VOXEL_SIZE_X, MNI_VOXEL_SIZE_Y, MNI_VOXEL_SIZE_Z, MM_EPI_Z_CUT, INTERPOLATION_MODE, i);
-
-		// Now apply the same translation as applied before the EPI-T1 registration
-		TransformVolumesLinear(d_Data, h_StartParameters_EPI_T1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-
-		// Apply transformation
-		TransformVolumesLinear(d_Data, h_Registration_Parameters_EPI_MNI, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-		if (NUMBER_OF_ITERATIONS_FOR_NONLINEAR_IMAGE_REGISTRATION > 0)
-		{
-			TransformVolumesNonLinear(d_Data, d_Total_Displacement_Field_X, d_Total_Displacement_Field_Y, d_Total_Displacement_Field_Z, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-		}
+		// Change resolution and size and apply all transformations in a single interpolation
+		TransformVolumesEPIToMNI(d_Data, d_Beta_Volumes, 1, i, INTERPOLATION_MODE);
 
 		// Write transformed volume to host
 		clEnqueueReadBuffer(commandQueue, d_Data, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), &h_Beta_Volumes_MNI[i * MNI_DATA_W * MNI_DATA_H * MNI_DATA_D], 0, NULL, NULL);
@@ -10051,18 +12980,8 @@ void BROCCOLI_LIB::TransformBayesianFirstLevelResultsToMNI()
 	// Loop over contrasts, for statistical maps
 	for (int i = 0; i < 6; i++)
 	{
-		// Change resolution and size of volume
-		ChangeVolumesResolutionAndSize(d_Data, d_Statistical_Maps, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, 1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, EPI_VOXEL_SIZE_X, EPI_VOXEL_SIZE_Y, EPI_VOXEL_SIZE_Z, MNI_VOXEL_SIZE_X, MNI_VOXEL_SIZE_Y, MNI_VOXEL_SIZE_Z, MM_EPI_Z_CUT, INTERPOLATION_MODE, i);
-
-		// Now apply the same translation as applied before the EPI-T1 registration
-		TransformVolumesLinear(d_Data, h_StartParameters_EPI_T1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-
-		// Apply transformation
-		TransformVolumesLinear(d_Data, h_Registration_Parameters_EPI_MNI, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-		if (NUMBER_OF_ITERATIONS_FOR_NONLINEAR_IMAGE_REGISTRATION > 0)
-		{
-			TransformVolumesNonLinear(d_Data, d_Total_Displacement_Field_X, d_Total_Displacement_Field_Y, d_Total_Displacement_Field_Z, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-		}
+		// Change resolution and size and apply all transformations in a single interpolation
+		TransformVolumesEPIToMNI(d_Data, d_Statistical_Maps, 1, i, INTERPOLATION_MODE);
 
 		// Write transformed volume to host
 		clEnqueueReadBuffer(commandQueue, d_Data, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), &h_Statistical_Maps_MNI[i * MNI_DATA_W * MNI_DATA_H * MNI_DATA_D], 0, NULL, NULL);
@@ -10070,14 +12989,8 @@ void BROCCOLI_LIB::TransformBayesianFirstLevelResultsToMNI()
 
 	if (WRITE_AR_ESTIMATES_MNI)
 	{
-		TransformVolumesLinear(d_AR1_Estimates, h_StartParameters_EPI, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, 1, INTERPOLATION_MODE);
-		ChangeVolumesResolutionAndSize(d_Data, d_AR1_Estimates, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, 1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, EPI_VOXEL_SIZE_X, EPI_VOXEL_SIZE_Y, EPI_VOXEL_SIZE_Z, MNI_VOXEL_SIZE_X, MNI_VOXEL_SIZE_Y, MNI_VOXEL_SIZE_Z, MM_EPI_Z_CUT, INTERPOLATION_MODE, 0);
-		TransformVolumesLinear(d_Data, h_StartParameters_EPI_T1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-		TransformVolumesLinear(d_Data, h_Registration_Parameters_EPI_MNI, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-		if (NUMBER_OF_ITERATIONS_FOR_NONLINEAR_IMAGE_REGISTRATION > 0)
-		{
-			TransformVolumesNonLinear(d_Data, d_Total_Displacement_Field_X, d_Total_Displacement_Field_Y, d_Total_Displacement_Field_Z, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-		}
+		// Change resolution and size and apply all transformations in a single interpolation
+		TransformVolumesEPIToMNI(d_Data, d_AR1_Estimates, 1, 0, INTERPOLATION_MODE);
 
 		clEnqueueReadBuffer(commandQueue, d_Data, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), h_AR1_Estimates_MNI, 0, NULL, NULL);
 	}
@@ -10092,26 +13005,14 @@ void BROCCOLI_LIB::TransformPValuesToMNI()
 	// Allocate temporary memory
 	cl_mem d_Data = clCreateBuffer(context, CL_MEM_READ_WRITE, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), NULL, NULL);
 
-	// Allocate temporary memory
-	cl_mem d_Temp = clCreateBuffer(context, CL_MEM_READ_WRITE, EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * NUMBER_OF_CONTRASTS * sizeof(float), NULL, NULL);
-
-	clEnqueueCopyBuffer(commandQueue, d_P_Values, d_Temp, 0, 0, EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * NUMBER_OF_CONTRASTS * sizeof(float), 0, NULL, NULL);
-
 	// Nearest neighbour interpolation for cluster inference, since all voxels in the cluster should have the same p-value
 	if ( (INFERENCE_MODE == CLUSTER_EXTENT) || (INFERENCE_MODE == CLUSTER_MASS) )
 	{
-		TransformVolumesLinear(d_Temp, h_StartParameters_EPI, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, NUMBER_OF_CONTRASTS, NEAREST);
-
 		// Loop over contrasts, for statistical maps
 		for (int i = 0; i < NUMBER_OF_CONTRASTS; i++)
 		{
-			ChangeVolumesResolutionAndSize(d_Data, d_Temp, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, 1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, EPI_VOXEL_SIZE_X, EPI_VOXEL_SIZE_Y, EPI_VOXEL_SIZE_Z, MNI_VOXEL_SIZE_X, MNI_VOXEL_SIZE_Y, MNI_VOXEL_SIZE_Z, MM_EPI_Z_CUT, NEAREST, i);
-			TransformVolumesLinear(d_Data, h_StartParameters_EPI_T1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, NEAREST);
-			TransformVolumesLinear(d_Data, h_Registration_Parameters_EPI_MNI, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, NEAREST);
-			if (NUMBER_OF_ITERATIONS_FOR_NONLINEAR_IMAGE_REGISTRATION > 0)
-			{
-				TransformVolumesNonLinear(d_Data, d_Total_Displacement_Field_X, d_Total_Displacement_Field_Y, d_Total_Displacement_Field_Z, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, NEAREST);
-			}
+			// Change resolution and size and apply all transformations in a single interpolation
+			TransformVolumesEPIToMNI(d_Data, d_P_Values, 1, i, NEAREST);
 
 			// Write transformed volume to host
 			clEnqueueReadBuffer(commandQueue, d_Data, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), &h_P_Values_MNI[i * MNI_DATA_W * MNI_DATA_H * MNI_DATA_D], 0, NULL, NULL);
@@ -10120,18 +13021,11 @@ void BROCCOLI_LIB::TransformPValuesToMNI()
 	// Linear interpolation otherwhise
 	else
 	{
-		TransformVolumesLinear(d_Temp, h_StartParameters_EPI, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, NUMBER_OF_CONTRASTS, INTERPOLATION_MODE);
-
 		// Loop over contrasts, for statistical maps
 		for (int i = 0; i < NUMBER_OF_CONTRASTS; i++)
 		{
-			ChangeVolumesResolutionAndSize(d_Data, d_Temp, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, 1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, EPI_VOXEL_SIZE_X, EPI_VOXEL_SIZE_Y, EPI_VOXEL_SIZE_Z, MNI_VOXEL_SIZE_X, MNI_VOXEL_SIZE_Y, MNI_VOXEL_SIZE_Z, MM_EPI_Z_CUT, INTERPOLATION_MODE, i);
-			TransformVolumesLinear(d_Data, h_StartParameters_EPI_T1, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-			TransformVolumesLinear(d_Data, h_Registration_Parameters_EPI_MNI, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-			if (NUMBER_OF_ITERATIONS_FOR_NONLINEAR_IMAGE_REGISTRATION > 0)
-			{
-				TransformVolumesNonLinear(d_Data, d_Total_Displacement_Field_X, d_Total_Displacement_Field_Y, d_Total_Displacement_Field_Z, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, INTERPOLATION_MODE);
-			}
+			// Change resolution and size and apply all transformations in a single interpolation
+			TransformVolumesEPIToMNI(d_Data, d_P_Values, 1, i, INTERPOLATION_MODE);
 
 			// Write transformed volume to host
 			clEnqueueReadBuffer(commandQueue, d_Data, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), &h_P_Values_MNI[i * MNI_DATA_W * MNI_DATA_H * MNI_DATA_D], 0, NULL, NULL);
@@ -10139,7 +13033,6 @@ void BROCCOLI_LIB::TransformPValuesToMNI()
 	}
 
 	clReleaseMemObject(d_Data);
-	clReleaseMemObject(d_Temp);
 }
 
 // Updated to use less memory
@@ -10277,16 +13170,9 @@ void BROCCOLI_LIB::PerformSecondLevelAnalysisWrapper()
 
 
 
-// Performs slice timing correction of an fMRI dataset, old, does not work
-void BROCCOLI_LIB::PerformSliceTimingCorrection()
+// Calculates the time shift of each slice, as a fraction of the TR, for the selected slice order
+void BROCCOLI_LIB::CalculateSliceTimingDifferences(float* h_Differences)
 {
-	SetGlobalAndLocalWorkSizesInterpolateVolume(EPI_DATA_W, EPI_DATA_H, EPI_DATA_D);
-
-	// Allocate memory for slice differences
-	c_Slice_Differences = clCreateBuffer(context, CL_MEM_READ_ONLY, EPI_DATA_D * sizeof(float), NULL, NULL);
-
-	h_Slice_Differences = (float*)malloc(EPI_DATA_D * sizeof(float));
-
 	float middle_slice;
 
 	// Calculate slice differences
@@ -10296,7 +13182,7 @@ void BROCCOLI_LIB::PerformSliceTimingCorrection()
 
 		for (int z = 0; z < EPI_DATA_D; z++)
 		{
-			h_Slice_Differences[z] = (middle_slice - (float)z)/((float)EPI_DATA_D);
+			h_Differences[z] = (middle_slice - (float)z)/((float)EPI_DATA_D);
 		}
 	}
 	else if (SLICE_ORDER == DOWN)
@@ -10305,14 +13191,14 @@ void BROCCOLI_LIB::PerformSliceTimingCorrection()
 
 		for (int z = 0; z < EPI_DATA_D; z++)
 		{
-			h_Slice_Differences[z] = ((float)z - middle_slice)/(float)(EPI_DATA_D);
+			h_Differences[z] = ((float)z - middle_slice)/(float)(EPI_DATA_D);
 		}
 	}
 	else if (SLICE_ORDER == UP_INTERLEAVED)
 	{
 		middle_slice = (float)EPI_DATA_D - 1.0f;
 
-		float* h_Times = (float*)malloc(EPI_DATA_D * sizeof(float));
+		std::vector<float> h_Times(EPI_DATA_D, 0.0f);
 		float timePerSlice = TR/(float)EPI_DATA_D;
 
 		for (int z = 0; z < EPI_DATA_D; z++)
@@ -10331,15 +13217,14 @@ void BROCCOLI_LIB::PerformSliceTimingCorrection()
 		
 		for (int z = 0; z < EPI_DATA_D; z++)
 		{
-			h_Slice_Differences[z] = (h_Times[(int)middle_slice] - h_Times[z])/TR;
+			h_Differences[z] = (h_Times[(int)middle_slice] - h_Times[z])/TR;
 		}		
-		free(h_Times);
 	}
 	else if (SLICE_ORDER == DOWN_INTERLEAVED)
 	{
 		middle_slice = 0.0f;
 
-		float* h_Times = (float*)malloc(EPI_DATA_D * sizeof(float));
+		std::vector<float> h_Times(EPI_DATA_D, 0.0f);
 		float timePerSlice = TR/(float)EPI_DATA_D;
 
 		int zz = 0;
@@ -10360,23 +13245,91 @@ void BROCCOLI_LIB::PerformSliceTimingCorrection()
 		
 		for (int z = 0; z < EPI_DATA_D; z++)
 		{
-			h_Slice_Differences[z] = (h_Times[(int)middle_slice] - h_Times[z])/TR;
+			h_Differences[z] = (h_Times[(int)middle_slice] - h_Times[z])/TR;
 		}		
-		free(h_Times);
 	}
+	// Custom slice times, e.g. for multiband data where several slices are acquired at the same time
+	else if (SLICE_ORDER == CUSTOM)
+	{
+		middle_slice = SLICE_CUSTOM_REF;
+		
+		for (int z = 0; z < EPI_DATA_D; z++)
+		{
+			h_Differences[z] = (h_Custom_Slice_Times[(int)middle_slice] - h_Custom_Slice_Times[z])/TR;			
+		}
+	}
+}
+
+// Allocates d_fMRI_Volumes and d_Slice_Timing_Corrected_fMRI_Volumes for slice timing correction on the device, if they
+// fit in device memory together with otherMemory bytes needed later, returns false if they do not fit or could not be allocated
+bool BROCCOLI_LIB::AllocateSliceTimingCorrectionVolumes(size_t otherMemory)
+{
+	size_t volumesSize = (size_t)EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * EPI_DATA_T * sizeof(float);
+
+	if ( ((allocatedDeviceMemory + 2 * volumesSize + otherMemory) / (1024*1024) > globalMemorySize) || ((maxMemoryAllocationSize > 0) && (volumesSize > maxMemoryAllocationSize)) )
+	{
+		return false;
+	}
+
+	cl_int error1, error2;
+	d_fMRI_Volumes = clCreateBuffer(context, CL_MEM_READ_WRITE, volumesSize, NULL, &error1);
+	d_Slice_Timing_Corrected_fMRI_Volumes = clCreateBuffer(context, CL_MEM_READ_WRITE, volumesSize, NULL, &error2);
+
+	if ((error1 != CL_SUCCESS) || (error2 != CL_SUCCESS))
+	{
+		if (error1 == CL_SUCCESS)
+		{
+			clReleaseMemObject(d_fMRI_Volumes);
+		}
+		if (error2 == CL_SUCCESS)
+		{
+			clReleaseMemObject(d_Slice_Timing_Corrected_fMRI_Volumes);
+		}
+		return false;
+	}
+
+	deviceMemoryAllocations += 2;
+	allocatedDeviceMemory += 2 * volumesSize;
+
+	return true;
+}
+
+void BROCCOLI_LIB::ReleaseSliceTimingCorrectionVolumes()
+{
+	clReleaseMemObject(d_fMRI_Volumes);
+	clReleaseMemObject(d_Slice_Timing_Corrected_fMRI_Volumes);
+
+	deviceMemoryDeallocations += 2;
+	allocatedDeviceMemory -= 2 * (size_t)EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * EPI_DATA_T * sizeof(float);
+}
+
+// Performs slice timing correction of an fMRI dataset stored on the device, all slices in one launch
+void BROCCOLI_LIB::PerformSliceTimingCorrection()
+{
+	SetGlobalAndLocalWorkSizesInterpolateVolume(EPI_DATA_W, EPI_DATA_H, EPI_DATA_D);
+
+	// Allocate memory for slice differences
+	c_Slice_Differences = clCreateBuffer(context, CL_MEM_READ_ONLY, EPI_DATA_D * sizeof(float), NULL, NULL);
+
+	h_Slice_Differences = (float*)malloc(EPI_DATA_D * sizeof(float));
+
+	CalculateSliceTimingDifferences(h_Slice_Differences);
 
 	// Copy slice differences to device
 	clEnqueueWriteBuffer(commandQueue, c_Slice_Differences, CL_TRUE, 0, EPI_DATA_D * sizeof(float), h_Slice_Differences, 0, NULL, NULL);
 
-	clSetKernelArg(SliceTimingCorrectionKernel, 0, sizeof(cl_mem), &d_Slice_Timing_Corrected_fMRI_Volumes);
-	clSetKernelArg(SliceTimingCorrectionKernel, 1, sizeof(cl_mem), &d_fMRI_Volumes);
-	clSetKernelArg(SliceTimingCorrectionKernel, 2, sizeof(cl_mem), &c_Slice_Differences);
-	clSetKernelArg(SliceTimingCorrectionKernel, 3, sizeof(int), &EPI_DATA_W);
-	clSetKernelArg(SliceTimingCorrectionKernel, 4, sizeof(int), &EPI_DATA_H);
-	clSetKernelArg(SliceTimingCorrectionKernel, 5, sizeof(int), &EPI_DATA_D);
-	clSetKernelArg(SliceTimingCorrectionKernel, 6, sizeof(int), &EPI_DATA_T);
+	int SLICE_OFFSET = 0;
+
+	clSetKernelArg(SliceTimingCorrectionSlicesKernel, 0, sizeof(cl_mem), &d_Slice_Timing_Corrected_fMRI_Volumes);
+	clSetKernelArg(SliceTimingCorrectionSlicesKernel, 1, sizeof(cl_mem), &d_fMRI_Volumes);
+	clSetKernelArg(SliceTimingCorrectionSlicesKernel, 2, sizeof(cl_mem), &c_Slice_Differences);
+	clSetKernelArg(SliceTimingCorrectionSlicesKernel, 3, sizeof(int), &EPI_DATA_W);
+	clSetKernelArg(SliceTimingCorrectionSlicesKernel, 4, sizeof(int), &EPI_DATA_H);
+	clSetKernelArg(SliceTimingCorrectionSlicesKernel, 5, sizeof(int), &EPI_DATA_D);
+	clSetKernelArg(SliceTimingCorrectionSlicesKernel, 6, sizeof(int), &EPI_DATA_T);
+	clSetKernelArg(SliceTimingCorrectionSlicesKernel, 7, sizeof(int), &SLICE_OFFSET);
 
-	runKernelErrorSliceTimingCorrection = clEnqueueNDRangeKernel(commandQueue, SliceTimingCorrectionKernel, 3, NULL, globalWorkSizeInterpolateVolume, localWorkSizeInterpolateVolume, 0, NULL, NULL);
+	runKernelErrorSliceTimingCorrectionSlices = clEnqueueNDRangeKernel(commandQueue, SliceTimingCorrectionSlicesKernel, 3, NULL, globalWorkSizeInterpolateVolume, localWorkSizeInterpolateVolume, 0, NULL, NULL);
 	clFinish(commandQueue);
 
 	clReleaseMemObject(c_Slice_Differences);
@@ -10384,274 +13337,156 @@ void BROCCOLI_LIB::PerformSliceTimingCorrection()
 }
 
 // Performs slice timing correction of an fMRI dataset
-// Updated to use less memory, loops over slices 
-void BROCCOLI_LIB::PerformSliceTimingCorrectionHost(float* h_Volumes)
+// Corrects slabs of slices, as many slices as fit in device memory (normally the whole volume) in each launch,
+// returns the allocation error if not even one slice fits
+cl_int BROCCOLI_LIB::PerformSliceTimingCorrectionHost(float* h_Volumes)
 {
-	SetGlobalAndLocalWorkSizesInterpolateVolume(EPI_DATA_W, EPI_DATA_H, 1);
-
-	// Allocate temporary memory, one slice for all time points
-	cl_mem d_Temp_Volumes = clCreateBuffer(context, CL_MEM_READ_WRITE, EPI_DATA_W * EPI_DATA_H * EPI_DATA_T * sizeof(float), NULL, NULL);
-	cl_mem d_Temp_Volumes_Corrected = clCreateBuffer(context, CL_MEM_READ_WRITE, EPI_DATA_W * EPI_DATA_H * EPI_DATA_T * sizeof(float), NULL, NULL);	
-
-	deviceMemoryAllocations += 2;
-	allocatedDeviceMemory += 2 * EPI_DATA_W * EPI_DATA_H * EPI_DATA_T * sizeof(float);
+	size_t sliceSize = (size_t)EPI_DATA_W * EPI_DATA_H * EPI_DATA_T * sizeof(float);
+	size_t sliceVoxels = (size_t)EPI_DATA_W * EPI_DATA_H;
 
-	PrintMemoryStatus("Inside slice timing correction host");
-
-	h_Slice_Differences = (float*)malloc(EPI_DATA_D * sizeof(float));
-
-	float middle_slice;
+	// Two slabs are needed, for the original and the corrected data
+	size_t freeMemory = globalMemorySize * 1024 * 1024;
+	freeMemory = (freeMemory > allocatedDeviceMemory) ? (freeMemory - allocatedDeviceMemory) : 0;
 
-	// Calculate slice differences
-	if (SLICE_ORDER == UP)
+	size_t slabSlices = std::min((size_t)EPI_DATA_D, freeMemory / (2 * sliceSize));
+	if (maxMemoryAllocationSize > 0)
 	{
-		middle_slice = myround((float)EPI_DATA_D / 2.0f) - 1.0f;
-
-		for (int z = 0; z < EPI_DATA_D; z++)
-		{
-			h_Slice_Differences[z] = (middle_slice - (float)z)/((float)EPI_DATA_D);
-		}
+		slabSlices = std::min(slabSlices, (size_t)(maxMemoryAllocationSize / sliceSize));
 	}
-	else if (SLICE_ORDER == DOWN)
+	slabSlices = std::max(slabSlices, (size_t)1);
+
+	// Allocate temporary memory, try smaller slabs if the allocation fails
+	cl_int error1, error2;
+	cl_mem d_Temp_Volumes, d_Temp_Volumes_Corrected;
+	while (true)
 	{
-		middle_slice = myround((float)EPI_DATA_D / 2.0f) - 1.0f;
+		d_Temp_Volumes = clCreateBuffer(context, CL_MEM_READ_WRITE, slabSlices * sliceSize, NULL, &error1);
+		d_Temp_Volumes_Corrected = clCreateBuffer(context, CL_MEM_READ_WRITE, slabSlices * sliceSize, NULL, &error2);
 
-		for (int z = 0; z < EPI_DATA_D; z++)
+		if ((error1 == CL_SUCCESS) && (error2 == CL_SUCCESS))
 		{
-			h_Slice_Differences[z] = ((float)z - middle_slice)/(float)(EPI_DATA_D);
+			break;
 		}
-	}
-	else if (SLICE_ORDER == UP_INTERLEAVED)
-	{
-		middle_slice = (float)EPI_DATA_D - 1.0f;
-
-		float* h_Times = (float*)malloc(EPI_DATA_D * sizeof(float));
-		float timePerSlice = TR/(float)EPI_DATA_D;
 
-		for (int z = 0; z < EPI_DATA_D; z++)
+		if (error1 == CL_SUCCESS)
 		{
-			// Odd slice
-			if (z % 2)
-			{
-				h_Times[z] = ceil((float)z/2.0f) * timePerSlice + TR/2.0f;		
-			}
-			// Even slice
-			else
-			{
-				h_Times[z] = (float)z/2.0f * timePerSlice;		
-			}
+			clReleaseMemObject(d_Temp_Volumes);
 		}
-		
-		for (int z = 0; z < EPI_DATA_D; z++)
+		if (error2 == CL_SUCCESS)
 		{
-			h_Slice_Differences[z] = (h_Times[(int)middle_slice] - h_Times[z])/TR;
-		}		
-		free(h_Times);
-	}
-	else if (SLICE_ORDER == DOWN_INTERLEAVED)
-	{
-		middle_slice = 0.0f;
-
-		float* h_Times = (float*)malloc(EPI_DATA_D * sizeof(float));
-		float timePerSlice = TR/(float)EPI_DATA_D;
+			clReleaseMemObject(d_Temp_Volumes_Corrected);
+		}
 
-		int zz = 0;
-		for (int z = EPI_DATA_D-1; z >= 0; z--)
+		if (slabSlices == 1)
 		{
-			// Odd slice
-			if (zz % 2)
-			{
-				h_Times[z] = ceil((float)zz/2.0f) * timePerSlice + TR/2.0f;		
-			}
-			// Even slice
-			else
+			runKernelErrorSliceTimingCorrectionSlices = (error1 != CL_SUCCESS) ? error1 : error2;
+			if (WRAPPER == BASH)
 			{
-				h_Times[z] = (float)zz/2.0f * timePerSlice;		
+				printf("Could not allocate device memory for slice timing correction of one slice!\n");
 			}
-			zz++;
+			return runKernelErrorSliceTimingCorrectionSlices;
 		}
-		
-		for (int z = 0; z < EPI_DATA_D; z++)
-		{
-			h_Slice_Differences[z] = (h_Times[(int)middle_slice] - h_Times[z])/TR;
-		}		
-		free(h_Times);
-	}
-	else if (SLICE_ORDER == CUSTOM)
-	{
-		middle_slice = SLICE_CUSTOM_REF;
-		
-		for (int z = 0; z < EPI_DATA_D; z++)
-		{
-			h_Slice_Differences[z] = (h_Custom_Slice_Times[(int)middle_slice] - h_Custom_Slice_Times[z])/TR;			
-		}
-	}
-
-	// Flip data from x,y,z,t to x,y,t,z, to be able to copy one slice at a time
-	//FlipVolumesXYZTtoXYTZ(h_Volumes, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, EPI_DATA_T);
-
-	// Loop over slices
-	for (int z = 0; z < EPI_DATA_D; z++)
-	{
-		// Copy a new slice of data to device, for all time points
-		CopyCurrentfMRISliceToDevice(d_Temp_Volumes, h_Volumes, z, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, EPI_DATA_T);
-				
-		clSetKernelArg(SliceTimingCorrectionKernel, 0, sizeof(cl_mem), &d_Temp_Volumes_Corrected);
-		clSetKernelArg(SliceTimingCorrectionKernel, 1, sizeof(cl_mem), &d_Temp_Volumes);
-		clSetKernelArg(SliceTimingCorrectionKernel, 2, sizeof(float), &h_Slice_Differences[z]);
-		clSetKernelArg(SliceTimingCorrectionKernel, 3, sizeof(int), &EPI_DATA_W);
-		clSetKernelArg(SliceTimingCorrectionKernel, 4, sizeof(int), &EPI_DATA_H);
-		clSetKernelArg(SliceTimingCorrectionKernel, 5, sizeof(int), &EPI_DATA_D);
-		clSetKernelArg(SliceTimingCorrectionKernel, 6, sizeof(int), &EPI_DATA_T);
-
-		runKernelErrorSliceTimingCorrection = clEnqueueNDRangeKernel(commandQueue, SliceTimingCorrectionKernel, 3, NULL, globalWorkSizeInterpolateVolume, localWorkSizeInterpolateVolume, 0, NULL, NULL);
-		clFinish(commandQueue);
 
-		// Copy slice timing corrected slice from device, for all time points
-		CopyCurrentfMRISliceToHost(h_Volumes, d_Temp_Volumes_Corrected, z, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, EPI_DATA_T);		
+		slabSlices = (slabSlices + 1) / 2;
 	}
 
-	// Flip data back from x,y,t,z to x,y,z,t
-	//FlipVolumesXYTZtoXYZT(h_Volumes, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, EPI_DATA_T);
-
-	clReleaseMemObject(d_Temp_Volumes);
-	clReleaseMemObject(d_Temp_Volumes_Corrected);
-
-	deviceMemoryDeallocations += 2;
-	allocatedDeviceMemory -= 2 * EPI_DATA_W * EPI_DATA_H * EPI_DATA_T * sizeof(float);
-
-	free(h_Slice_Differences);
-}
+	deviceMemoryAllocations += 2;
+	allocatedDeviceMemory += 2 * slabSlices * sliceSize;
 
+	if ((WRAPPER == BASH) && VERBOS)
+	{
+		printf("Slice timing correction of %i slices in each launch\n", (int)slabSlices);
+	}
 
-void BROCCOLI_LIB::PerformSliceTimingCorrectionWrapper()
-{
-	SetGlobalAndLocalWorkSizesInterpolateVolume(EPI_DATA_W, EPI_DATA_H, 1);
+	PrintMemoryStatus("Inside slice timing correction host");
 
-	// Allocate temporary memory, one slice for all time points
-	cl_mem d_Temp_Volumes = clCreateBuffer(context, CL_MEM_READ_WRITE, EPI_DATA_W * EPI_DATA_H * EPI_DATA_T * sizeof(float), NULL, NULL);
-	cl_mem d_Temp_Volumes_Corrected = clCreateBuffer(context, CL_MEM_READ_WRITE, EPI_DATA_W * EPI_DATA_H * EPI_DATA_T * sizeof(float), NULL, NULL);	
+	// Allocate memory for slice differences
+	c_Slice_Differences = clCreateBuffer(context, CL_MEM_READ_ONLY, EPI_DATA_D * sizeof(float), NULL, NULL);
 
 	h_Slice_Differences = (float*)malloc(EPI_DATA_D * sizeof(float));
 
-	float middle_slice;
+	CalculateSliceTimingDifferences(h_Slice_Differences);
 
-	// Calculate slice differences
-	if (SLICE_ORDER == UP)
-	{
-		middle_slice = myround((float)EPI_DATA_D / 2.0f) - 1.0f;
+	// Copy slice differences to device
+	clEnqueueWriteBuffer(commandQueue, c_Slice_Differences, CL_TRUE, 0, EPI_DATA_D * sizeof(float), h_Slice_Differences, 0, NULL, NULL);
 
-		for (int z = 0; z < EPI_DATA_D; z++)
-		{
-			h_Slice_Differences[z] = (middle_slice - (float)z)/((float)EPI_DATA_D);
-		}
-	}
-	else if (SLICE_ORDER == DOWN)
+	clSetKernelArg(SliceTimingCorrectionSlicesKernel, 0, sizeof(cl_mem), &d_Temp_Volumes_Corrected);
+	clSetKernelArg(SliceTimingCorrectionSlicesKernel, 1, sizeof(cl_mem), &d_Temp_Volumes);
+	clSetKernelArg(SliceTimingCorrectionSlicesKernel, 2, sizeof(cl_mem), &c_Slice_Differences);
+	clSetKernelArg(SliceTimingCorrectionSlicesKernel, 3, sizeof(int), &EPI_DATA_W);
+	clSetKernelArg(SliceTimingCorrectionSlicesKernel, 4, sizeof(int), &EPI_DATA_H);
+	clSetKernelArg(SliceTimingCorrectionSlicesKernel, 6, sizeof(int), &EPI_DATA_T);
+
+	// Loop over slabs
+	for (int z = 0; z < EPI_DATA_D; z += (int)slabSlices)
 	{
-		middle_slice = myround((float)EPI_DATA_D / 2.0f) - 1.0f;
+		int SLAB_DATA_D = mymin((int)slabSlices, EPI_DATA_D - z);
+		size_t slabVolumeSize = sliceVoxels * SLAB_DATA_D;
 
-		for (int z = 0; z < EPI_DATA_D; z++)
+		// Copy the slab for all time points, one copy per time point (a single copy for the whole volume)
+		if (SLAB_DATA_D == EPI_DATA_D)
 		{
-			h_Slice_Differences[z] = ((float)z - middle_slice)/(float)(EPI_DATA_D);
+			clEnqueueWriteBuffer(commandQueue, d_Temp_Volumes, CL_FALSE, 0, slabVolumeSize * EPI_DATA_T * sizeof(float), h_Volumes, 0, NULL, NULL);
 		}
-	}
-	else if (SLICE_ORDER == UP_INTERLEAVED)
-	{
-		middle_slice = (float)EPI_DATA_D - 1.0f;
-		
-		float* h_Times = (float*)malloc(EPI_DATA_D * sizeof(float));
-		float timePerSlice = TR/(float)EPI_DATA_D;
-
-		for (int z = 0; z < EPI_DATA_D; z++)
+		else
 		{
-			// Odd slice
-			if (z % 2)
+			for (int t = 0; t < EPI_DATA_T; t++)
 			{
-				h_Times[z] = ceil((float)z/2.0f) * timePerSlice + TR/2.0f;		
-			}
-			// Even slice
-			else
-			{
-				h_Times[z] = (float)z/2.0f * timePerSlice;		
+				clEnqueueWriteBuffer(commandQueue, d_Temp_Volumes, CL_FALSE, t * slabVolumeSize * sizeof(float), slabVolumeSize * sizeof(float), &h_Volumes[z * sliceVoxels + t * sliceVoxels * EPI_DATA_D], 0, NULL, NULL);
 			}
 		}
-		
-		for (int z = 0; z < EPI_DATA_D; z++)
-		{
-			h_Slice_Differences[z] = (h_Times[(int)middle_slice] - h_Times[z])/TR;
-		}		
-		free(h_Times);
-	}
-	else if (SLICE_ORDER == DOWN_INTERLEAVED)
-	{
-		middle_slice = 0.0f;
 
-		float* h_Times = (float*)malloc(EPI_DATA_D * sizeof(float));
-		float timePerSlice = TR/(float)EPI_DATA_D;
+		SetGlobalAndLocalWorkSizesInterpolateVolume(EPI_DATA_W, EPI_DATA_H, SLAB_DATA_D);
 
-		int zz = 0;
-		for (int z = EPI_DATA_D-1; z >= 0; z--)
+		clSetKernelArg(SliceTimingCorrectionSlicesKernel, 5, sizeof(int), &SLAB_DATA_D);
+		clSetKernelArg(SliceTimingCorrectionSlicesKernel, 7, sizeof(int), &z);
+
+		runKernelErrorSliceTimingCorrectionSlices = clEnqueueNDRangeKernel(commandQueue, SliceTimingCorrectionSlicesKernel, 3, NULL, globalWorkSizeInterpolateVolume, localWorkSizeInterpolateVolume, 0, NULL, NULL);
+
+		// Copy slice timing corrected slab from device, for all time points
+		if (SLAB_DATA_D == EPI_DATA_D)
 		{
-			// Odd slice
-			if (zz % 2)
-			{
-				h_Times[z] = ceil((float)zz/2.0f) * timePerSlice + TR/2.0f;		
-			}
-			// Even slice
-			else
-			{
-				h_Times[z] = (float)zz/2.0f * timePerSlice;		
-			}
-			zz++;
+			clEnqueueReadBuffer(commandQueue, d_Temp_Volumes_Corrected, CL_FALSE, 0, slabVolumeSize * EPI_DATA_T * sizeof(float), h_Volumes, 0, NULL, NULL);
 		}
-		
-		for (int z = 0; z < EPI_DATA_D; z++)
-		{
-			h_Slice_Differences[z] = (h_Times[(int)middle_slice] - h_Times[z])/TR;
-		}		
-		free(h_Times);
-	}
-	else if (SLICE_ORDER == CUSTOM)
-	{
-		middle_slice = SLICE_CUSTOM_REF;
-		
-		for (int z = 0; z < EPI_DATA_D; z++)
+		else
 		{
-			h_Slice_Differences[z] = (h_Custom_Slice_Times[(int)middle_slice] - h_Custom_Slice_Times[z])/TR;			
+			for (int t = 0; t < EPI_DATA_T; t++)
+			{
+				clEnqueueReadBuffer(commandQueue, d_Temp_Volumes_Corrected, CL_FALSE, t * slabVolumeSize * sizeof(float), slabVolumeSize * sizeof(float), &h_Volumes[z * sliceVoxels + t * sliceVoxels * EPI_DATA_D], 0, NULL, NULL);
+			}
 		}
-	}
-
-	// Flip data from x,y,z,t to x,y,t,z, to be able to copy one slice at a time
-	//FlipVolumesXYZTtoXYTZ(h_fMRI_Volumes, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, EPI_DATA_T);
-
-	// Loop over slices
-	for (int z = 0; z < EPI_DATA_D; z++)
-	{
-		// Copy a new slice of data to device, for all time points
-		CopyCurrentfMRISliceToDevice(d_Temp_Volumes, h_fMRI_Volumes, z, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, EPI_DATA_T);
-				
-		clSetKernelArg(SliceTimingCorrectionKernel, 0, sizeof(cl_mem), &d_Temp_Volumes_Corrected);
-		clSetKernelArg(SliceTimingCorrectionKernel, 1, sizeof(cl_mem), &d_Temp_Volumes);
-		clSetKernelArg(SliceTimingCorrectionKernel, 2, sizeof(float), &h_Slice_Differences[z]);
-		clSetKernelArg(SliceTimingCorrectionKernel, 3, sizeof(int), &EPI_DATA_W);
-		clSetKernelArg(SliceTimingCorrectionKernel, 4, sizeof(int), &EPI_DATA_H);
-		clSetKernelArg(SliceTimingCorrectionKernel, 5, sizeof(int), &EPI_DATA_D);
-		clSetKernelArg(SliceTimingCorrectionKernel, 6, sizeof(int), &EPI_DATA_T);
-
-		runKernelErrorSliceTimingCorrection = clEnqueueNDRangeKernel(commandQueue, SliceTimingCorrectionKernel, 3, NULL, globalWorkSizeInterpolateVolume, localWorkSizeInterpolateVolume, 0, NULL, NULL);
 		clFinish(commandQueue);
-
-		// Copy slice timing corrected slice from device, for all time points
-		CopyCurrentfMRISliceToHost(h_fMRI_Volumes, d_Temp_Volumes_Corrected, z, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, EPI_DATA_T);		
 	}
 
-	// Flip data back from x,y,t,z to x,y,z,t
-	//FlipVolumesXYTZtoXYZT(h_fMRI_Volumes, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, EPI_DATA_T);
-
 	clReleaseMemObject(d_Temp_Volumes);
 	clReleaseMemObject(d_Temp_Volumes_Corrected);
+	clReleaseMemObject(c_Slice_Differences);
+
+	deviceMemoryDeallocations += 2;
+	allocatedDeviceMemory -= 2 * slabSlices * sliceSize;
 
 	free(h_Slice_Differences);
+
+	return CL_SUCCESS;
+}
+
+// Corrects all slices in one launch if the original and the corrected volumes fit in device memory, otherwise in slabs
+void BROCCOLI_LIB::PerformSliceTimingCorrectionWrapper()
+{
+	if (AllocateSliceTimingCorrectionVolumes(0))
+	{
+		size_t volumesSize = (size_t)EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * EPI_DATA_T * sizeof(float);
+
+		clEnqueueWriteBuffer(commandQueue, d_fMRI_Volumes, CL_TRUE, 0, volumesSize, h_fMRI_Volumes, 0, NULL, NULL);
+		PerformSliceTimingCorrection();
+		clEnqueueReadBuffer(commandQueue, d_Slice_Timing_Corrected_fMRI_Volumes, CL_TRUE, 0, volumesSize, h_fMRI_Volumes, 0, NULL, NULL);
+
+		ReleaseSliceTimingCorrectionVolumes();
+	}
+	else
+	{
+		PerformSliceTimingCorrectionHost(h_fMRI_Volumes);
+	}
 }
 
 // Only stores one fMRI volume in global memory, to reduce memory usage
@@ -10691,10 +13526,15 @@ void BROCCOLI_LIB::PerformMotionCorrectionWrapper()
 		// Set a new volume to be aligned
 		clEnqueueWriteBuffer(commandQueue, d_Aligned_Volume, CL_TRUE, 0, EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(float), &h_fMRI_Volumes[t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D], 0, NULL, NULL);
 
-		// Also copy the same volume to an image to interpolate from
-		size_t origin[3] = {0, 0, 0};
-		size_t region[3] = {EPI_DATA_W, EPI_DATA_H, EPI_DATA_D};
-		clEnqueueCopyBufferToImage(commandQueue, d_Aligned_Volume, d_Original_Volume, 0, origin, region, 0, NULL, NULL);
+		// Also write the same volume to the buffer to interpolate from, or copy it to an image
+		if (USE_BUFFER_INTERPOLATION)
+		{
+			clEnqueueWriteBuffer(commandQueue, d_Original_Volume, CL_TRUE, 0, EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(float), &h_fMRI_Volumes[t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D], 0, NULL, NULL);
+		}
+		else
+		{
+			CopyVolumeToInterpolationVolume(d_Original_Volume, d_Aligned_Volume, 0, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D);
+		}
 
 		// Do rigid registration with only one scale
 		AlignTwoVolumesLinear(h_Registration_Parameters_Motion_Correction, h_Rotations, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, NUMBER_OF_ITERATIONS_FOR_MOTION_CORRECTION, RIGID, INTERPOLATION_MODE);	
@@ -10719,8 +13559,9 @@ void BROCCOLI_LIB::PerformMotionCorrectionWrapper()
 	AlignTwoVolumesLinearCleanup(EPI_DATA_W, EPI_DATA_H, EPI_DATA_D);
 }
 
-// Performs motion correction in place, only storing volumes in host memory
-void BROCCOLI_LIB::PerformMotionCorrectionHost(float* h_Volumes)
+// Performs motion correction in place, only storing volumes in host memory. If h_Volume_Parameters is not NULL the
+// registration parameters of each volume (12 per volume) are stored there instead, and the volumes are not changed
+void BROCCOLI_LIB::PerformMotionCorrectionHost(float* h_Volumes, float* h_Volume_Parameters)
 {
 	// Setup all parameters and allocate memory on device
 	AlignTwoVolumesLinearSetup(EPI_DATA_W, EPI_DATA_H, EPI_DATA_D);
@@ -10740,6 +13581,15 @@ void BROCCOLI_LIB::PerformMotionCorrectionHost(float* h_Volumes)
 	h_Motion_Parameters[4 * EPI_DATA_T] = 0.0f;
 	h_Motion_Parameters[5 * EPI_DATA_T] = 0.0f;
 
+	// The first volume is the reference volume
+	if (h_Volume_Parameters != NULL)
+	{
+		for (int p = 0; p < NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS; p++)
+		{
+			h_Volume_Parameters[p] = 0.0f;
+		}
+	}
+
 	if ((WRAPPER == BASH) && VERBOS)
 	{
 		printf(", volume");
@@ -10751,16 +13601,32 @@ void BROCCOLI_LIB::PerformMotionCorrectionHost(float* h_Volumes)
 		// Set a new volume to be aligned
 		clEnqueueWriteBuffer(commandQueue, d_Aligned_Volume, CL_TRUE, 0, EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(float), &h_Volumes[t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D], 0, NULL, NULL);
 
-		// Also copy the same volume to an image to interpolate from
-		size_t origin[3] = {0, 0, 0};
-		size_t region[3] = {EPI_DATA_W, EPI_DATA_H, EPI_DATA_D};
-		clEnqueueCopyBufferToImage(commandQueue, d_Aligned_Volume, d_Original_Volume, 0, origin, region, 0, NULL, NULL);
+		// Also write the same volume to the buffer to interpolate from, or copy it to an image
+		if (USE_BUFFER_INTERPOLATION)
+		{
+			clEnqueueWriteBuffer(commandQueue, d_Original_Volume, CL_TRUE, 0, EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(float), &h_Volumes[t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D], 0, NULL, NULL);
+		}
+		else
+		{
+			CopyVolumeToInterpolationVolume(d_Original_Volume, d_Aligned_Volume, 0, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D);
+		}
 
 		// Do rigid registration with only one scale
 		AlignTwoVolumesLinear(h_Registration_Parameters_Motion_Correction, h_Rotations, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, NUMBER_OF_ITERATIONS_FOR_MOTION_CORRECTION, RIGID, INTERPOLATION_MODE);	
 
-		// Copy the corrected volume to the corrected volumes
-		clEnqueueReadBuffer(commandQueue, d_Aligned_Volume, CL_TRUE, 0, EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(float), &h_Volumes[t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D], 0, NULL, NULL);
+		if (h_Volume_Parameters == NULL)
+		{
+			// Copy the corrected volume to the corrected volumes
+			clEnqueueReadBuffer(commandQueue, d_Aligned_Volume, CL_TRUE, 0, EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(float), &h_Volumes[t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D], 0, NULL, NULL);
+		}
+		else
+		{
+			// Save the parameters, the volumes are corrected later
+			for (int p = 0; p < NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS; p++)
+			{
+				h_Volume_Parameters[t * NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS + p] = h_Registration_Parameters_Motion_Correction[p];
+			}
+		}
 
 		// Write the total parameter vector to host
 
@@ -10785,6 +13651,63 @@ void BROCCOLI_LIB::PerformMotionCorrectionHost(float* h_Volumes)
 	AlignTwoVolumesLinearCleanup(EPI_DATA_W, EPI_DATA_H, EPI_DATA_D);
 }
 
+// Performs slice timing correction and motion correction of an fMRI dataset with one interpolation in space and time,
+// the motion parameters are estimated on the volumes without slice timing correction
+void BROCCOLI_LIB::PerformSliceTimingAndMotionCorrectionHost(float* h_Volumes)
+{
+	size_t volumesSize = (size_t)EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * EPI_DATA_T * sizeof(float);
+
+	// Estimate the motion of each volume
+	float* h_Volume_Parameters = (float*)malloc(EPI_DATA_T * NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS * sizeof(float));
+	PerformMotionCorrectionHost(h_Volumes, h_Volume_Parameters);
+
+	h_Slice_Differences = (float*)malloc(EPI_DATA_D * sizeof(float));
+	CalculateSliceTimingDifferences(h_Slice_Differences);
+
+	cl_mem d_Volumes = clCreateBuffer(context, CL_MEM_READ_ONLY, volumesSize, NULL, NULL);
+	cl_mem d_Corrected_Volumes = clCreateBuffer(context, CL_MEM_WRITE_ONLY, volumesSize, NULL, NULL);
+	cl_mem d_Volume_Parameters = clCreateBuffer(context, CL_MEM_READ_ONLY, EPI_DATA_T * NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS * sizeof(float), NULL, NULL);
+	c_Slice_Differences = clCreateBuffer(context, CL_MEM_READ_ONLY, EPI_DATA_D * sizeof(float), NULL, NULL);
+
+	deviceMemoryAllocations += 2;
+	allocatedDeviceMemory += 2 * volumesSize;
+
+	PrintMemoryStatus("Inside slice timing and motion correction host");
+
+	clEnqueueWriteBuffer(commandQueue, d_Volumes, CL_FALSE, 0, volumesSize, h_Volumes, 0, NULL, NULL);
+	clEnqueueWriteBuffer(commandQueue, d_Volume_Parameters, CL_FALSE, 0, EPI_DATA_T * NUMBER_OF_IMAGE_REGISTRATION_PARAMETERS * sizeof(float), h_Volume_Parameters, 0, NULL, NULL);
+	clEnqueueWriteBuffer(commandQueue, c_Slice_Differences, CL_TRUE, 0, EPI_DATA_D * sizeof(float), h_Slice_Differences, 0, NULL, NULL);
+
+	int CUBIC_INTERPOLATION = (INTERPOLATION_MODE == CUBIC) ? 1 : 0;
+
+	SetGlobalAndLocalWorkSizesInterpolateVolume(EPI_DATA_W, EPI_DATA_H, EPI_DATA_D);
+
+	clSetKernelArg(SliceTimingAndMotionCorrectionKernel, 0, sizeof(cl_mem), &d_Corrected_Volumes);
+	clSetKernelArg(SliceTimingAndMotionCorrectionKernel, 1, sizeof(cl_mem), &d_Volumes);
+	clSetKernelArg(SliceTimingAndMotionCorrectionKernel, 2, sizeof(cl_mem), &d_Volume_Parameters);
+	clSetKernelArg(SliceTimingAndMotionCorrectionKernel, 3, sizeof(cl_mem), &c_Slice_Differences);
+	clSetKernelArg(SliceTimingAndMotionCorrectionKernel, 4, sizeof(int), &CUBIC_INTERPOLATION);
+	clSetKernelArg(SliceTimingAndMotionCorrectionKernel, 5, sizeof(int), &EPI_DATA_W);
+	clSetKernelArg(SliceTimingAndMotionCorrectionKernel, 6, sizeof(int), &EPI_DATA_H);
+	clSetKernelArg(SliceTimingAndMotionCorrectionKernel, 7, sizeof(int), &EPI_DATA_D);
+	clSetKernelArg(SliceTimingAndMotionCorrectionKernel, 8, sizeof(int), &EPI_DATA_T);
+
+	runKernelErrorSliceTimingAndMotionCorrection = clEnqueueNDRangeKernel(commandQueue, SliceTimingAndMotionCorrectionKernel, 3, NULL, globalWorkSizeInterpolateVolume, localWorkSizeInterpolateVolume, 0, NULL, NULL);
+
+	clEnqueueReadBuffer(commandQueue, d_Corrected_Volumes, CL_TRUE, 0, volumesSize, h_Volumes, 0, NULL, NULL);
+
+	clReleaseMemObject(d_Volumes);
+	clReleaseMemObject(d_Corrected_Volumes);
+	clReleaseMemObject(d_Volume_Parameters);
+	clReleaseMemObject(c_Slice_Differences);
+
+	deviceMemoryDeallocations += 2;
+	allocatedDeviceMemory -= 2 * volumesSize;
+
+	free(h_Volume_Parameters);
+	free(h_Slice_Differences);
+}
+
 // Performs motion correction of an fMRI dataset
 void BROCCOLI_LIB::PerformMotionCorrection(cl_mem d_Volumes)
 {
@@ -10813,10 +13736,8 @@ void BROCCOLI_LIB::PerformMotionCorrection(cl_mem d_Volumes)
 		// Set a new volume to be aligned
 		clEnqueueCopyBuffer(commandQueue, d_Volumes, d_Aligned_Volume, t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(float), 0, EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(float), 0, NULL, NULL);
 
-		// Also copy the same volume to an image (texture) to interpolate from
-		size_t origin[3] = {0, 0, 0};
-		size_t region[3] = {EPI_DATA_W, EPI_DATA_H, EPI_DATA_D};
-		clEnqueueCopyBufferToImage(commandQueue, d_Volumes, d_Original_Volume, t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(float), origin, region, 0, NULL, NULL);
+		// Interpolate from the same volume, copied to an image or read directly from d_Volumes
+		SetLinearRegistrationInterpolationVolume(d_Volumes, t, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D);
 
 		// Do rigid registration with only one scale
 		AlignTwoVolumesLinear(h_Registration_Parameters_Motion_Correction, h_Rotations, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, NUMBER_OF_ITERATIONS_FOR_MOTION_CORRECTION, RIGID, INTERPOLATION_MODE);
@@ -10842,150 +13763,92 @@ void BROCCOLI_LIB::PerformMotionCorrection(cl_mem d_Volumes)
 }
 
 
-// Slow way of calculating the sum of a volume
-float BROCCOLI_LIB::CalculateSum(cl_mem d_Volume, size_t DATA_W, size_t DATA_H, size_t DATA_D)
+// Reduces each of the volumes to a single value (sum, max or min) with a work-group tree reduction and a small final pass on the device,
+// only voxels where the mask is 1 are used if a mask is given, the indices of the max or min values are returned if h_Indices is not NULL
+void BROCCOLI_LIB::ReduceVolumes(float* h_Results, int* h_Indices, cl_mem d_Volumes, cl_mem d_Mask, size_t N, size_t NUMBER_OF_VOLUMES, int OPERATION)
 {
-	SetGlobalAndLocalWorkSizesCalculateSum(DATA_W, DATA_H, DATA_D);
+	SetGlobalAndLocalWorkSizesReduceVolumes(N, NUMBER_OF_VOLUMES);
+
+	int NUMBER_OF_PARTIALS = (int)(globalWorkSizeReduceVolumes[0] / localWorkSizeReduceVolumes[0]);
+	int N_ = (int)N;
+	int USE_MASK = (d_Mask != NULL);
 
-	cl_mem d_Column_Sums = clCreateBuffer(context, CL_MEM_READ_WRITE, DATA_H * DATA_D * sizeof(float), NULL, NULL);
-	cl_mem d_Sums = clCreateBuffer(context, CL_MEM_READ_WRITE, DATA_D * sizeof(float), NULL, NULL);
+	// The mask argument can not be left unset
+	if (!USE_MASK)
+	{
+		d_Mask = d_Volumes;
+	}
 
-	// Calculate sum of filter smoothed EPI for each slice
-	clSetKernelArg(CalculateColumnSumsKernel, 0, sizeof(cl_mem), &d_Column_Sums);
-	clSetKernelArg(CalculateColumnSumsKernel, 1, sizeof(cl_mem), &d_Volume);
-	clSetKernelArg(CalculateColumnSumsKernel, 2, sizeof(int), &DATA_W);
-	clSetKernelArg(CalculateColumnSumsKernel, 3, sizeof(int), &DATA_H);
-	clSetKernelArg(CalculateColumnSumsKernel, 4, sizeof(int), &DATA_D);
+	cl_mem d_Partial_Values = AllocatePooledBuffer(NUMBER_OF_PARTIALS * NUMBER_OF_VOLUMES * sizeof(float), NULL);
+	cl_mem d_Partial_Indices = AllocatePooledBuffer(NUMBER_OF_PARTIALS * NUMBER_OF_VOLUMES * sizeof(int), NULL);
+	cl_mem d_Results = AllocatePooledBuffer(NUMBER_OF_VOLUMES * sizeof(float), NULL);
+	cl_mem d_Result_Indices = AllocatePooledBuffer(NUMBER_OF_VOLUMES * sizeof(int), NULL);
 
-	runKernelErrorCalculateColumnSums = clEnqueueNDRangeKernel(commandQueue, CalculateColumnSumsKernel, 2, NULL, globalWorkSizeCalculateColumnSums, localWorkSizeCalculateColumnSums, 0, NULL, NULL);
-	clFinish(commandQueue);
+	clSetKernelArg(ReduceVolumesKernel, 0, sizeof(cl_mem), &d_Partial_Values);
+	clSetKernelArg(ReduceVolumesKernel, 1, sizeof(cl_mem), &d_Partial_Indices);
+	clSetKernelArg(ReduceVolumesKernel, 2, sizeof(cl_mem), &d_Volumes);
+	clSetKernelArg(ReduceVolumesKernel, 3, sizeof(cl_mem), &d_Mask);
+	clSetKernelArg(ReduceVolumesKernel, 4, sizeof(int), &N_);
+	clSetKernelArg(ReduceVolumesKernel, 5, sizeof(int), &OPERATION);
+	clSetKernelArg(ReduceVolumesKernel, 6, sizeof(int), &USE_MASK);
 
-	clSetKernelArg(CalculateRowSumsKernel, 0, sizeof(cl_mem), &d_Sums);
-	clSetKernelArg(CalculateRowSumsKernel, 1, sizeof(cl_mem), &d_Column_Sums);
-	clSetKernelArg(CalculateRowSumsKernel, 2, sizeof(int), &DATA_H);
-	clSetKernelArg(CalculateRowSumsKernel, 3, sizeof(int), &DATA_D);
+	runKernelErrorReduceVolumes = clEnqueueNDRangeKernel(commandQueue, ReduceVolumesKernel, 2, NULL, globalWorkSizeReduceVolumes, localWorkSizeReduceVolumes, 0, NULL, NULL);
 
-	runKernelErrorCalculateRowSums = clEnqueueNDRangeKernel(commandQueue, CalculateRowSumsKernel, 2, NULL, globalWorkSizeCalculateRowSums, localWorkSizeCalculateRowSums, 0, NULL, NULL);
-	clFinish(commandQueue);
+	clSetKernelArg(ReduceVolumesFinalKernel, 0, sizeof(cl_mem), &d_Results);
+	clSetKernelArg(ReduceVolumesFinalKernel, 1, sizeof(cl_mem), &d_Result_Indices);
+	clSetKernelArg(ReduceVolumesFinalKernel, 2, sizeof(cl_mem), &d_Partial_Values);
+	clSetKernelArg(ReduceVolumesFinalKernel, 3, sizeof(cl_mem), &d_Partial_Indices);
+	clSetKernelArg(ReduceVolumesFinalKernel, 4, sizeof(int), &NUMBER_OF_PARTIALS);
+	clSetKernelArg(ReduceVolumesFinalKernel, 5, sizeof(int), &OPERATION);
 
-	// Copy slice maxs to host
-	float* h_Sums = (float*)malloc(DATA_D * sizeof(float));
-	clEnqueueReadBuffer(commandQueue, d_Sums, CL_TRUE, 0, DATA_D * sizeof(float), h_Sums, 0, NULL, NULL);
+	runKernelErrorReduceVolumesFinal = clEnqueueNDRangeKernel(commandQueue, ReduceVolumesFinalKernel, 2, NULL, globalWorkSizeReduceVolumesFinal, localWorkSizeReduceVolumes, 0, NULL, NULL);
 
-	float sum = 0.0f;
-	for (int z = 0; z < DATA_D; z++)
+	// The read is blocking, so no clFinish is needed between the passes
+	clEnqueueReadBuffer(commandQueue, d_Results, CL_TRUE, 0, NUMBER_OF_VOLUMES * sizeof(float), h_Results, 0, NULL, NULL);
+	if (h_Indices != NULL)
 	{
-		sum += h_Sums[z];
+		clEnqueueReadBuffer(commandQueue, d_Result_Indices, CL_TRUE, 0, NUMBER_OF_VOLUMES * sizeof(int), h_Indices, 0, NULL, NULL);
 	}
-	free(h_Sums);
 
-	clReleaseMemObject(d_Column_Sums);
-	clReleaseMemObject(d_Sums);
+	ReleasePooledBuffer(d_Partial_Values);
+	ReleasePooledBuffer(d_Partial_Indices);
+	ReleasePooledBuffer(d_Results);
+	ReleasePooledBuffer(d_Result_Indices);
+}
 
+float BROCCOLI_LIB::CalculateSum(cl_mem d_Volume, size_t DATA_W, size_t DATA_H, size_t DATA_D)
+{
+	float sum;
+	ReduceVolumes(&sum, NULL, d_Volume, NULL, DATA_W * DATA_H * DATA_D, 1, REDUCE_SUM);
 	return sum;
 }
 
-// Slow way of calculating the maximum of a volume
 float BROCCOLI_LIB::CalculateMax(cl_mem d_Volume, size_t DATA_W, size_t DATA_H, size_t DATA_D)
 {
-	SetGlobalAndLocalWorkSizesCalculateMax(DATA_W, DATA_H, DATA_D);
-
-	cl_mem d_Column_Maxs = clCreateBuffer(context, CL_MEM_READ_WRITE, DATA_H * DATA_D * sizeof(float), NULL, NULL);
-	cl_mem d_Maxs = clCreateBuffer(context, CL_MEM_READ_WRITE, DATA_D * sizeof(float), NULL, NULL);
-
-	clSetKernelArg(CalculateColumnMaxsKernel, 0, sizeof(cl_mem), &d_Column_Maxs);
-	clSetKernelArg(CalculateColumnMaxsKernel, 1, sizeof(cl_mem), &d_Volume);
-	clSetKernelArg(CalculateColumnMaxsKernel, 2, sizeof(int), &DATA_W);
-	clSetKernelArg(CalculateColumnMaxsKernel, 3, sizeof(int), &DATA_H);
-	clSetKernelArg(CalculateColumnMaxsKernel, 4, sizeof(int), &DATA_D);
-
-	runKernelErrorCalculateColumnMaxs = clEnqueueNDRangeKernel(commandQueue, CalculateColumnMaxsKernel, 2, NULL, globalWorkSizeCalculateColumnMaxs, localWorkSizeCalculateColumnMaxs, 0, NULL, NULL);
-	clFinish(commandQueue);
-
-	clSetKernelArg(CalculateRowMaxsKernel, 0, sizeof(cl_mem), &d_Maxs);
-	clSetKernelArg(CalculateRowMaxsKernel, 1, sizeof(cl_mem), &d_Column_Maxs);
-	clSetKernelArg(CalculateRowMaxsKernel, 2, sizeof(int), &DATA_H);
-	clSetKernelArg(CalculateRowMaxsKernel, 3, sizeof(int), &DATA_D);
-
-	runKernelErrorCalculateRowMaxs = clEnqueueNDRangeKernel(commandQueue, CalculateRowMaxsKernel, 2, NULL, globalWorkSizeCalculateRowMaxs, localWorkSizeCalculateRowMaxs, 0, NULL, NULL);
-	clFinish(commandQueue);
-
-	// Copy slice maxs to host
-	float* h_Maxs = (float*)malloc(DATA_D * sizeof(float));
-	clEnqueueReadBuffer(commandQueue, d_Maxs, CL_TRUE, 0, DATA_D * sizeof(float), h_Maxs, 0, NULL, NULL);
-
-	float max = std::numeric_limits<float>::min();
-	for (int z = 0; z < DATA_D; z++)
-	{
-		max = mymax(max, h_Maxs[z]);
-	}
-	free(h_Maxs);
-
-	clReleaseMemObject(d_Column_Maxs);
-	clReleaseMemObject(d_Maxs);
-
+	float max;
+	ReduceVolumes(&max, NULL, d_Volume, NULL, DATA_W * DATA_H * DATA_D, 1, REDUCE_MAX);
 	return max;
 }
 
-
-
-// Ugly way of calculating max of floats, since there is no atomic function for floats
-float BROCCOLI_LIB::CalculateMaxAtomic(cl_mem d_Array, size_t N)
+float BROCCOLI_LIB::CalculateMax(cl_mem d_Array, size_t N)
 {
-	SetGlobalAndLocalWorkSizesCalculateMax(N, 1, 1);
-
-	cl_mem d_Mask = clCreateBuffer(context, CL_MEM_READ_WRITE, N * sizeof(float), NULL, NULL);
-	SetMemory(d_Mask, 0.0f, N);
-
-	cl_mem d_Max_Value = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int), NULL, NULL);
-	SetMemory(d_Max_Value, -1000000, 1);
-
-	int one = 1;
-	clSetKernelArg(CalculateMaxAtomicKernel, 0, sizeof(cl_mem), &d_Max_Value);
-	clSetKernelArg(CalculateMaxAtomicKernel, 1, sizeof(cl_mem), &d_Array);
-	clSetKernelArg(CalculateMaxAtomicKernel, 2, sizeof(cl_mem), &d_Mask);
-	clSetKernelArg(CalculateMaxAtomicKernel, 3, sizeof(int), &N);
-	clSetKernelArg(CalculateMaxAtomicKernel, 4, sizeof(int), &one);
-	clSetKernelArg(CalculateMaxAtomicKernel, 5, sizeof(int), &one);
-
-	runKernelErrorCalculateMaxAtomic = clEnqueueNDRangeKernel(commandQueue, CalculateMaxAtomicKernel, 3, NULL, globalWorkSizeCalculateMaxAtomic, localWorkSizeCalculateMaxAtomic, 0, NULL, NULL);
-	clFinish(commandQueue);
-
-	int max;
-	clEnqueueReadBuffer(commandQueue, d_Max_Value, CL_TRUE, 0, sizeof(int), &max, 0, NULL, NULL);
-
-	clReleaseMemObject(d_Mask);
-	clReleaseMemObject(d_Max_Value);
-
-	return (float)((float)max/10000.0f);
+	float max;
+	ReduceVolumes(&max, NULL, d_Array, NULL, N, 1, REDUCE_MAX);
+	return max;
 }
 
-
-// Ugly way of calculating max of floats, since there is no atomic function for floats
-float BROCCOLI_LIB::CalculateMaxAtomic(cl_mem d_Volume, cl_mem d_Mask, size_t DATA_W, size_t DATA_H, size_t DATA_D)
+// Calculates the max of all voxels inside the mask
+float BROCCOLI_LIB::CalculateMax(cl_mem d_Volume, cl_mem d_Mask, size_t DATA_W, size_t DATA_H, size_t DATA_D)
 {
-	SetGlobalAndLocalWorkSizesCalculateMax(DATA_W, DATA_H, DATA_D);
-
-	cl_mem d_Max_Value = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int), NULL, NULL);
-
-	SetMemory(d_Max_Value, -1000000, 1);
-
-	clSetKernelArg(CalculateMaxAtomicKernel, 0, sizeof(cl_mem), &d_Max_Value);
-	clSetKernelArg(CalculateMaxAtomicKernel, 1, sizeof(cl_mem), &d_Volume);
-	clSetKernelArg(CalculateMaxAtomicKernel, 2, sizeof(cl_mem), &d_Mask);
-	clSetKernelArg(CalculateMaxAtomicKernel, 3, sizeof(int), &DATA_W);
-	clSetKernelArg(CalculateMaxAtomicKernel, 4, sizeof(int), &DATA_H);
-	clSetKernelArg(CalculateMaxAtomicKernel, 5, sizeof(int), &DATA_D);
-
-	runKernelErrorCalculateMaxAtomic = clEnqueueNDRangeKernel(commandQueue, CalculateMaxAtomicKernel, 3, NULL, globalWorkSizeCalculateMaxAtomic, localWorkSizeCalculateMaxAtomic, 0, NULL, NULL);
-	clFinish(commandQueue);
-
-	int max;
-	clEnqueueReadBuffer(commandQueue, d_Max_Value, CL_TRUE, 0, sizeof(int), &max, 0, NULL, NULL);
-
-	clReleaseMemObject(d_Max_Value);
+	float max;
+	ReduceVolumes(&max, NULL, d_Volume, d_Mask, DATA_W * DATA_H * DATA_D, 1, REDUCE_MAX);
+	return max;
+}
 
-	return (float)((float)max/10000.0f);
+// Calculates the sum of each volume, using the same mask (if any) for all volumes
+void BROCCOLI_LIB::CalculateSums(float* h_Sums, cl_mem d_Volumes, cl_mem d_Mask, size_t DATA_W, size_t DATA_H, size_t DATA_D, size_t NUMBER_OF_VOLUMES)
+{
+	ReduceVolumes(h_Sums, NULL, d_Volumes, d_Mask, DATA_W * DATA_H * DATA_D, NUMBER_OF_VOLUMES, REDUCE_SUM);
 }
 
 // Thresholds a volume
@@ -13108,23 +15971,185 @@ void BROCCOLI_LIB::PerformSearchlightWrapper()
     // Run searchlight
     SetGlobalAndLocalWorkSizesSearchlight(MNI_DATA_W, MNI_DATA_H, MNI_DATA_D);
     
-    float n = 0.001;
-    int EPOCS = 1;
-    
-    clSetKernelArg(CalculateStatisticalMapSearchlightKernel, 0, sizeof(cl_mem),  &d_Statistical_Maps);
-    clSetKernelArg(CalculateStatisticalMapSearchlightKernel, 1, sizeof(cl_mem),  &d_First_Level_Results);
-    clSetKernelArg(CalculateStatisticalMapSearchlightKernel, 2, sizeof(cl_mem),  &d_MNI_Brain_Mask);
-    clSetKernelArg(CalculateStatisticalMapSearchlightKernel, 3, sizeof(cl_mem),  &c_d);
-    clSetKernelArg(CalculateStatisticalMapSearchlightKernel, 4, sizeof(cl_mem),  &c_Correct_Classes);
-    clSetKernelArg(CalculateStatisticalMapSearchlightKernel, 5, sizeof(int),     &MNI_DATA_W);
-    clSetKernelArg(CalculateStatisticalMapSearchlightKernel, 6, sizeof(int),     &MNI_DATA_H);
-    clSetKernelArg(CalculateStatisticalMapSearchlightKernel, 7, sizeof(int),     &MNI_DATA_D);
-    clSetKernelArg(CalculateStatisticalMapSearchlightKernel, 8, sizeof(int),     &NUMBER_OF_SUBJECTS);
-    clSetKernelArg(CalculateStatisticalMapSearchlightKernel, 9, sizeof(float),   &n);
-    clSetKernelArg(CalculateStatisticalMapSearchlightKernel, 10, sizeof(int),    &EPOCS);
-    
-    runKernelErrorCalculateStatisticalMapSearchlight = clEnqueueNDRangeKernel(commandQueue, CalculateStatisticalMapSearchlightKernel, 3, NULL, globalWorkSizeCalculateStatisticalMapSearchlight, localWorkSizeCalculateStatisticalMapSearchlight, 0, NULL, NULL);
-    clFinish(commandQueue);
+    if (SEARCHLIGHT_CLASSIFIER != SEARCHLIGHT_GRADIENT_DESCENT)
+    {
+        // Uncensored volumes
+        std::vector<cl_int> volumeIndices;
+        for (int t = 0; t < NUMBER_OF_SUBJECTS; t++)
+        {
+            if (h_Correct_Classes_In[t] != 9999.0f)
+            {
+                volumeIndices.push_back(t);
+            }
+        }
+
+        int uncensoredVolumes = (int)volumeIndices.size();
+        int folds = NUMBER_OF_SEARCHLIGHT_FOLDS;
+        if ( (folds <= 0) || (folds > uncensoredVolumes) )
+        {
+            folds = uncensoredVolumes;
+        }
+        folds = mymax(folds, 2);
+
+        float regularization = mymin(mymax(SEARCHLIGHT_REGULARIZATION, 0.0f), 1.0f);
+        int classifier = (SEARCHLIGHT_CLASSIFIER == SEARCHLIGHT_RIDGE) ? 1 : 2;
+
+        // Each fold is a block of consecutive volumes, with the same proportion of the two classes
+        std::vector<cl_int> foldStarts;
+        CreateSearchlightFolds(volumeIndices, foldStarts, folds, h_Correct_Classes_In);
+
+        c_Searchlight_Volume_Indices = clCreateBuffer(context, CL_MEM_READ_ONLY, mymax(uncensoredVolumes, 1) * sizeof(cl_int), NULL, NULL);
+        c_Searchlight_Fold_Starts = clCreateBuffer(context, CL_MEM_READ_ONLY, (folds + 1) * sizeof(cl_int), NULL, NULL);
+        if (uncensoredVolumes > 0)
+        {
+            clEnqueueWriteBuffer(commandQueue, c_Searchlight_Volume_Indices, CL_TRUE, 0, uncensoredVolumes * sizeof(cl_int), &volumeIndices[0], 0, NULL, NULL);
+        }
+        clEnqueueWriteBuffer(commandQueue, c_Searchlight_Fold_Starts, CL_TRUE, 0, (folds + 1) * sizeof(cl_int), &foldStarts[0], 0, NULL, NULL);
+
+        if (SEARCHLIGHT_CLASSIFIER == SEARCHLIGHT_DIAGONAL_LDA)
+        {
+            // One work group per voxel in the mask
+            std::vector<cl_int> voxelIndices;
+            for (int i = 0; i < (MNI_DATA_W * MNI_DATA_H * MNI_DATA_D); i++)
+            {
+                if (h_MNI_Brain_Mask[i] == 1.0f)
+                {
+                    voxelIndices.push_back(i);
+                }
+            }
+
+            SetMemory(d_Statistical_Maps, 0.0f, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D);
+
+            CalculateStatisticalMapSearchlightSphere(d_Statistical_Maps, d_First_Level_Results, d_MNI_Brain_Mask, c_Correct_Classes, c_Searchlight_Volume_Indices, c_Searchlight_Fold_Starts, voxelIndices, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, uncensoredVolumes, folds, regularization);
+        }
+        else
+        {
+            clSetKernelArg(CalculateStatisticalMapSearchlightClosedFormKernel, 0, sizeof(cl_mem),  &d_Statistical_Maps);
+            clSetKernelArg(CalculateStatisticalMapSearchlightClosedFormKernel, 1, sizeof(cl_mem),  &d_First_Level_Results);
+            clSetKernelArg(CalculateStatisticalMapSearchlightClosedFormKernel, 2, sizeof(cl_mem),  &d_MNI_Brain_Mask);
+            clSetKernelArg(CalculateStatisticalMapSearchlightClosedFormKernel, 3, sizeof(cl_mem),  &c_d);
+            clSetKernelArg(CalculateStatisticalMapSearchlightClosedFormKernel, 4, sizeof(cl_mem),  &c_Correct_Classes);
+            clSetKernelArg(CalculateStatisticalMapSearchlightClosedFormKernel, 5, sizeof(cl_mem),  &c_Searchlight_Volume_Indices);
+            clSetKernelArg(CalculateStatisticalMapSearchlightClosedFormKernel, 6, sizeof(cl_mem),  &c_Searchlight_Fold_Starts);
+            clSetKernelArg(CalculateStatisticalMapSearchlightClosedFormKernel, 7, sizeof(int),     &MNI_DATA_W);
+            clSetKernelArg(CalculateStatisticalMapSearchlightClosedFormKernel, 8, sizeof(int),     &MNI_DATA_H);
+            clSetKernelArg(CalculateStatisticalMapSearchlightClosedFormKernel, 9, sizeof(int),     &MNI_DATA_D);
+            clSetKernelArg(CalculateStatisticalMapSearchlightClosedFormKernel, 10, sizeof(int),    &uncensoredVolumes);
+            clSetKernelArg(CalculateStatisticalMapSearchlightClosedFormKernel, 11, sizeof(int),    &folds);
+            clSetKernelArg(CalculateStatisticalMapSearchlightClosedFormKernel, 12, sizeof(int),    &classifier);
+            clSetKernelArg(CalculateStatisticalMapSearchlightClosedFormKernel, 13, sizeof(float),  &regularization);
+
+            runKernelErrorCalculateStatisticalMapSearchlightClosedForm = clEnqueueNDRangeKernel(commandQueue, CalculateStatisticalMapSearchlightClosedFormKernel, 3, NULL, globalWorkSizeCalculateStatisticalMapSearchlightClosedForm, localWorkSizeCalculateStatisticalMapSearchlightClosedForm, 0, NULL, NULL);
+            clFinish(commandQueue);
+
+            // Permutation test, the maximum accuracy of each permutation gives the null distribution
+            if ( (SEARCHLIGHT_CLASSIFIER == SEARCHLIGHT_RIDGE) && (NUMBER_OF_SEARCHLIGHT_PERMUTATIONS > 0) && (uncensoredVolumes >= 2) )
+            {
+                int numberOfPermutations = NUMBER_OF_SEARCHLIGHT_PERMUTATIONS;
+                int volumeSize = MNI_DATA_W * MNI_DATA_H * MNI_DATA_D;
+
+                std::vector<cl_int> permutedVolumeIndices;
+                GeneratePermutationMatrixSearchlight(permutedVolumeIndices, volumeIndices, numberOfPermutations);
+
+                // All permutations are evaluated in one run, the inverse of the second moments of each voxel is then only calculated once
+                d_Searchlight_Permuted_Volume_Indices = clCreateBuffer(context, CL_MEM_READ_ONLY, numberOfPermutations * uncensoredVolumes * sizeof(cl_int), NULL, NULL);
+                cl_mem d_Max_Correct_Classifications = clCreateBuffer(context, CL_MEM_READ_WRITE, numberOfPermutations * sizeof(cl_int), NULL, NULL);
+
+                clEnqueueWriteBuffer(commandQueue, d_Searchlight_Permuted_Volume_Indices, CL_TRUE, 0, numberOfPermutations * uncensoredVolumes * sizeof(cl_int), &permutedVolumeIndices[0], 0, NULL, NULL);
+                SetMemoryInt(d_Max_Correct_Classifications, 0, numberOfPermutations);
+
+                clSetKernelArg(CalculateStatisticalMapsSearchlightRidgePermutationKernel, 0, sizeof(cl_mem),  &d_Max_Correct_Classifications);
+                clSetKernelArg(CalculateStatisticalMapsSearchlightRidgePermutationKernel, 1, sizeof(cl_mem),  &d_First_Level_Results);
+                clSetKernelArg(CalculateStatisticalMapsSearchlightRidgePermutationKernel, 2, sizeof(cl_mem),  &d_MNI_Brain_Mask);
+                clSetKernelArg(CalculateStatisticalMapsSearchlightRidgePermutationKernel, 3, sizeof(cl_mem),  &c_d);
+                clSetKernelArg(CalculateStatisticalMapsSearchlightRidgePermutationKernel, 4, sizeof(cl_mem),  &c_Correct_Classes);
+                clSetKernelArg(CalculateStatisticalMapsSearchlightRidgePermutationKernel, 5, sizeof(cl_mem),  &c_Searchlight_Volume_Indices);
+                clSetKernelArg(CalculateStatisticalMapsSearchlightRidgePermutationKernel, 6, sizeof(cl_mem),  &c_Searchlight_Fold_Starts);
+                clSetKernelArg(CalculateStatisticalMapsSearchlightRidgePermutationKernel, 7, sizeof(cl_mem),  &d_Searchlight_Permuted_Volume_Indices);
+                clSetKernelArg(CalculateStatisticalMapsSearchlightRidgePermutationKernel, 8, sizeof(int),     &MNI_DATA_W);
+                clSetKernelArg(CalculateStatisticalMapsSearchlightRidgePermutationKernel, 9, sizeof(int),     &MNI_DATA_H);
+                clSetKernelArg(CalculateStatisticalMapsSearchlightRidgePermutationKernel, 10, sizeof(int),    &MNI_DATA_D);
+                clSetKernelArg(CalculateStatisticalMapsSearchlightRidgePermutationKernel, 11, sizeof(int),    &uncensoredVolumes);
+                clSetKernelArg(CalculateStatisticalMapsSearchlightRidgePermutationKernel, 12, sizeof(int),    &folds);
+                clSetKernelArg(CalculateStatisticalMapsSearchlightRidgePermutationKernel, 13, sizeof(float),  &regularization);
+                clSetKernelArg(CalculateStatisticalMapsSearchlightRidgePermutationKernel, 14, sizeof(int),    &numberOfPermutations);
+
+                double startTime = GetTime();
+
+                // Same voxel grid as the closed form kernel
+                runKernelErrorCalculateStatisticalMapsSearchlightRidgePermutation = clEnqueueNDRangeKernel(commandQueue, CalculateStatisticalMapsSearchlightRidgePermutationKernel, 3, NULL, globalWorkSizeCalculateStatisticalMapSearchlightClosedForm, localWorkSizeCalculateStatisticalMapSearchlightClosedForm, 0, NULL, NULL);
+                clFinish(commandQueue);
+
+                double endTime = GetTime();
+
+                if ((WRAPPER == BASH) && VERBOS && (endTime > startTime))
+                {
+                    printf("Searchlight permutation test, %f permutations per second\n",(float)((double)numberOfPermutations / (endTime - startTime)));
+                }
+
+                // Maximum accuracy in the mask of each permutation
+                std::vector<cl_int> maxCorrectClassifications(numberOfPermutations);
+                clEnqueueReadBuffer(commandQueue, d_Max_Correct_Classifications, CL_TRUE, 0, numberOfPermutations * sizeof(cl_int), &maxCorrectClassifications[0], 0, NULL, NULL);
+
+                clReleaseMemObject(d_Max_Correct_Classifications);
+                clReleaseMemObject(d_Searchlight_Permuted_Volume_Indices);
+
+                std::vector<float> maxAccuracies(numberOfPermutations);
+                for (int p = 0; p < numberOfPermutations; p++)
+                {
+                    maxAccuracies[p] = (float)maxCorrectClassifications[p] / (float)uncensoredVolumes;
+                    h_Permutation_Distribution[p] = maxAccuracies[p];
+                }
+
+                // Corrected p-values, as for voxel level inference in the group analysis (1 - p is stored)
+                SetGlobalAndLocalWorkSizesStatisticalCalculations(MNI_DATA_W, MNI_DATA_H, MNI_DATA_D);
+
+                int contrast = 0;
+                d_P_Values = clCreateBuffer(context, CL_MEM_READ_WRITE, volumeSize * sizeof(float), NULL, NULL);
+                c_Permutation_Distribution = clCreateBuffer(context, CL_MEM_READ_ONLY, numberOfPermutations * sizeof(float), NULL, NULL);
+                clEnqueueWriteBuffer(commandQueue, c_Permutation_Distribution, CL_TRUE, 0, numberOfPermutations * sizeof(float), &maxAccuracies[0], 0, NULL, NULL);
+
+                clSetKernelArg(CalculatePermutationPValuesVoxelLevelInferenceKernel, 0, sizeof(cl_mem), &d_P_Values);
+                clSetKernelArg(CalculatePermutationPValuesVoxelLevelInferenceKernel, 1, sizeof(cl_mem), &d_Statistical_Maps);
+                clSetKernelArg(CalculatePermutationPValuesVoxelLevelInferenceKernel, 2, sizeof(cl_mem), &d_MNI_Brain_Mask);
+                clSetKernelArg(CalculatePermutationPValuesVoxelLevelInferenceKernel, 3, sizeof(cl_mem), &c_Permutation_Distribution);
+                clSetKernelArg(CalculatePermutationPValuesVoxelLevelInferenceKernel, 4, sizeof(int),    &contrast);
+                clSetKernelArg(CalculatePermutationPValuesVoxelLevelInferenceKernel, 5, sizeof(int),    &MNI_DATA_W);
+                clSetKernelArg(CalculatePermutationPValuesVoxelLevelInferenceKernel, 6, sizeof(int),    &MNI_DATA_H);
+                clSetKernelArg(CalculatePermutationPValuesVoxelLevelInferenceKernel, 7, sizeof(int),    &MNI_DATA_D);
+                clSetKernelArg(CalculatePermutationPValuesVoxelLevelInferenceKernel, 8, sizeof(int),    &numberOfPermutations);
+                runKernelErrorCalculatePermutationPValuesVoxelLevelInference = clEnqueueNDRangeKernel(commandQueue, CalculatePermutationPValuesVoxelLevelInferenceKernel, 3, NULL, globalWorkSizeCalculatePermutationPValues, localWorkSizeCalculatePermutationPValues, 0, NULL, NULL);
+
+                clEnqueueReadBuffer(commandQueue, d_P_Values, CL_TRUE, 0, volumeSize * sizeof(float), h_P_Values_MNI, 0, NULL, NULL);
+
+                clReleaseMemObject(d_P_Values);
+                clReleaseMemObject(c_Permutation_Distribution);
+            }
+        }
+
+        clReleaseMemObject(c_Searchlight_Volume_Indices);
+        clReleaseMemObject(c_Searchlight_Fold_Starts);
+    }
+    else
+    {
+        float n = 0.001;
+        int EPOCS = 1;
+
+        clSetKernelArg(CalculateStatisticalMapSearchlightKernel, 0, sizeof(cl_mem),  &d_Statistical_Maps);
+        clSetKernelArg(CalculateStatisticalMapSearchlightKernel, 1, sizeof(cl_mem),  &d_First_Level_Results);
+        clSetKernelArg(CalculateStatisticalMapSearchlightKernel, 2, sizeof(cl_mem),  &d_MNI_Brain_Mask);
+        clSetKernelArg(CalculateStatisticalMapSearchlightKernel, 3, sizeof(cl_mem),  &c_d);
+        clSetKernelArg(CalculateStatisticalMapSearchlightKernel, 4, sizeof(cl_mem),  &c_Correct_Classes);
+        clSetKernelArg(CalculateStatisticalMapSearchlightKernel, 5, sizeof(int),     &MNI_DATA_W);
+        clSetKernelArg(CalculateStatisticalMapSearchlightKernel, 6, sizeof(int),     &MNI_DATA_H);
+        clSetKernelArg(CalculateStatisticalMapSearchlightKernel, 7, sizeof(int),     &MNI_DATA_D);
+        clSetKernelArg(CalculateStatisticalMapSearchlightKernel, 8, sizeof(int),     &NUMBER_OF_SUBJECTS);
+        clSetKernelArg(CalculateStatisticalMapSearchlightKernel, 9, sizeof(float),   &n);
+        clSetKernelArg(CalculateStatisticalMapSearchlightKernel, 10, sizeof(int),    &EPOCS);
+
+        runKernelErrorCalculateStatisticalMapSearchlight = clEnqueueNDRangeKernel(commandQueue, CalculateStatisticalMapSearchlightKernel, 3, NULL, globalWorkSizeCalculateStatisticalMapSearchlight, localWorkSizeCalculateStatisticalMapSearchlight, 0, NULL, NULL);
+        clFinish(commandQueue);
+    }
 
     // Copy results to  host
     clEnqueueReadBuffer(commandQueue, d_Statistical_Maps, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), h_Statistical_Maps_MNI, 0, NULL, NULL);
@@ -13145,6 +16170,10 @@ void BROCCOLI_LIB::PerformMeanSecondLevelPermutationWrapper()
 {
 	NUMBER_OF_TOTAL_GLM_REGRESSORS = 1;
 
+	size_t volumesBytes = (size_t)MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * NUMBER_OF_SUBJECTS * sizeof(float);
+
+	BeginPipelineStage("Copy data to device", volumesBytes);
+
 	// Allocate memory for volumes
 	d_First_Level_Results = clCreateBuffer(context, CL_MEM_READ_WRITE, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * NUMBER_OF_SUBJECTS * sizeof(float), NULL, NULL);
 	d_MNI_Brain_Mask = clCreateBuffer(context, CL_MEM_READ_WRITE, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), NULL, NULL);
@@ -13187,9 +16216,13 @@ void BROCCOLI_LIB::PerformMeanSecondLevelPermutationWrapper()
 	clEnqueueWriteBuffer(commandQueue, c_Permutation_Vector, CL_TRUE, 0, NUMBER_OF_SUBJECTS * sizeof(unsigned short int), temp , 0, NULL, NULL);
 	free(temp);
 
+	BeginPipelineStage("Permutation test", volumesBytes);
+
 	// Run the actual permutation test
 	ApplyPermutationTestSecondLevel();
 
+	BeginPipelineStage("Statistical maps and p-values", volumesBytes);
+
 	CalculateStatisticalMapsGLMTTestSecondLevel(d_First_Level_Results, d_MNI_Brain_Mask);
 
 	CalculatePermutationPValues(d_MNI_Brain_Mask, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D);
@@ -13198,6 +16231,8 @@ void BROCCOLI_LIB::PerformMeanSecondLevelPermutationWrapper()
 	clEnqueueReadBuffer(commandQueue, d_Statistical_Maps, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * NUMBER_OF_CONTRASTS * sizeof(float), h_Statistical_Maps_MNI, 0, NULL, NULL);
 	clEnqueueReadBuffer(commandQueue, d_P_Values, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), h_P_Values_MNI, 0, NULL, NULL);
 
+	EndPipelineStage();
+
 	// Release memory
 	clReleaseMemObject(d_First_Level_Results);
 	clReleaseMemObject(d_MNI_Brain_Mask);
@@ -13224,6 +16259,10 @@ void BROCCOLI_LIB::PerformGLMTTestSecondLevelPermutationWrapper()
 {
 	NUMBER_OF_TOTAL_GLM_REGRESSORS = NUMBER_OF_GLM_REGRESSORS;
 
+	size_t volumesBytes = (size_t)MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * NUMBER_OF_SUBJECTS * sizeof(float);
+
+	BeginPipelineStage("Copy data to device", volumesBytes);
+
 	// Allocate memory for volumes
 	d_First_Level_Results = clCreateBuffer(context, CL_MEM_READ_WRITE, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * NUMBER_OF_SUBJECTS * sizeof(float), NULL, NULL);
 	d_Transformed_Volumes = clCreateBuffer(context, CL_MEM_READ_WRITE, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * NUMBER_OF_SUBJECTS * sizeof(float), NULL, NULL);
@@ -13260,9 +16299,13 @@ void BROCCOLI_LIB::PerformGLMTTestSecondLevelPermutationWrapper()
 	clEnqueueWriteBuffer(commandQueue, c_ctxtxc_GLM, CL_TRUE, 0, NUMBER_OF_CONTRASTS * sizeof(float), h_ctxtxc_GLM_In , 0, NULL, NULL);
 	clFinish(commandQueue);
 
+	BeginPipelineStage("Permutation test", volumesBytes);
+
 	// Run the actual permutation test
 	ApplyPermutationTestSecondLevel();
 
+	BeginPipelineStage("Statistical maps and p-values", volumesBytes);
+
 	// Copy data to device again
 	clEnqueueWriteBuffer(commandQueue, d_First_Level_Results, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * NUMBER_OF_SUBJECTS * sizeof(float), h_First_Level_Results , 0, NULL, NULL);
 
@@ -13274,6 +16317,8 @@ void BROCCOLI_LIB::PerformGLMTTestSecondLevelPermutationWrapper()
 	clEnqueueReadBuffer(commandQueue, d_Statistical_Maps, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * NUMBER_OF_CONTRASTS * sizeof(float), h_Statistical_Maps_MNI, 0, NULL, NULL);
 	clEnqueueReadBuffer(commandQueue, d_P_Values, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * NUMBER_OF_CONTRASTS * sizeof(float), h_P_Values_MNI, 0, NULL, NULL);
 
+	EndPipelineStage();
+
 	// Release memory
 	clReleaseMemObject(d_First_Level_Results);
 	clReleaseMemObject(d_Transformed_Volumes);
@@ -13302,6 +16347,10 @@ void BROCCOLI_LIB::PerformGLMFTestSecondLevelPermutationWrapper()
 {
 	NUMBER_OF_TOTAL_GLM_REGRESSORS = NUMBER_OF_GLM_REGRESSORS;
 
+	size_t volumesBytes = (size_t)MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * NUMBER_OF_SUBJECTS * sizeof(float);
+
+	BeginPipelineStage("Copy data to device", volumesBytes);
+
 	// Allocate memory for volumes
 	d_First_Level_Results = clCreateBuffer(context, CL_MEM_READ_WRITE, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * NUMBER_OF_SUBJECTS * sizeof(float), NULL, NULL);
 	d_Transformed_Volumes = clCreateBuffer(context, CL_MEM_READ_WRITE, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * NUMBER_OF_SUBJECTS * sizeof(float), NULL, NULL);
@@ -13338,9 +16387,13 @@ void BROCCOLI_LIB::PerformGLMFTestSecondLevelPermutationWrapper()
 	clEnqueueWriteBuffer(commandQueue, c_ctxtxc_GLM, CL_TRUE, 0, NUMBER_OF_CONTRASTS * NUMBER_OF_CONTRASTS * sizeof(float), h_ctxtxc_GLM_In , 0, NULL, NULL);
 	clFinish(commandQueue);
 
+	BeginPipelineStage("Permutation test", volumesBytes);
+
 	// Run the actual permutation test
 	ApplyPermutationTestSecondLevel();
 
+	BeginPipelineStage("Statistical maps and p-values", volumesBytes);
+
 	// Copy data to device again
 	clEnqueueWriteBuffer(commandQueue, d_First_Level_Results, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * NUMBER_OF_SUBJECTS * sizeof(float), h_First_Level_Results , 0, NULL, NULL);
 
@@ -13353,6 +16406,8 @@ void BROCCOLI_LIB::PerformGLMFTestSecondLevelPermutationWrapper()
 	//clEnqueueReadBuffer(commandQueue, d_Beta_Volumes, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), h_Statistical_Maps_MNI, 0, NULL, NULL);
 	clEnqueueReadBuffer(commandQueue, d_P_Values, CL_TRUE, 0, MNI_DATA_W * MNI_DATA_H * MNI_DATA_D * sizeof(float), h_P_Values_MNI, 0, NULL, NULL);
 
+	EndPipelineStage();
+
 	// Release memory
 	clReleaseMemObject(d_First_Level_Results);
 	clReleaseMemObject(d_Transformed_Volumes);
@@ -15501,15 +18556,32 @@ void BROCCOLI_LIB::CalculateStatisticalMapsGLMBayesianFirstLevel(float* h_Volume
 	clEnqueueWriteBuffer(commandQueue, c_InvOmega0, CL_TRUE, 0, NUMBER_OF_TOTAL_GLM_REGRESSORS * NUMBER_OF_TOTAL_GLM_REGRESSORS * sizeof(float), h_InvOmega0, 0, NULL, NULL);
 	clFinish(commandQueue);
 
-	// Generate seeds for random number generation
-	int* h_Seeds = (int*)malloc(EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(int));
-	for (size_t i = 0; i < EPI_DATA_W * EPI_DATA_H * EPI_DATA_D; i++)
+	// The float32 sampler uses a counter based random number generator, only one seed is needed
+	cl_uint seed = (cl_uint)rand();
+	int chains = mymax(1, mymin(NUMBER_OF_MCMC_CHAINS, BAYESIAN_MAX_CHAINS));
+
+	// R-hat and number of iterations for each voxel
+	cl_mem d_MCMC_Diagnostics = NULL;
+	if (MCMC_SINGLE_PRECISION)
+	{
+		d_MCMC_Diagnostics = clCreateBuffer(context, CL_MEM_READ_WRITE, EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * 2 * sizeof(float), NULL, NULL);
+		SetMemory(d_MCMC_Diagnostics, 0.0f, EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * 2);
+
+		allocatedDeviceMemory += EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * 2 * sizeof(float);
+		deviceMemoryAllocations += 1;
+	}
+	else
 	{
-		h_Seeds[i] = rand();
+		// Generate seeds for random number generation
+		int* h_Seeds = (int*)malloc(EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(int));
+		for (size_t i = 0; i < EPI_DATA_W * EPI_DATA_H * EPI_DATA_D; i++)
+		{
+			h_Seeds[i] = rand();
+		}
+		clEnqueueWriteBuffer(commandQueue, d_Seeds, CL_TRUE, 0, EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(int), h_Seeds, 0, NULL, NULL);
+		clFinish(commandQueue);
+		free(h_Seeds);
 	}
-	clEnqueueWriteBuffer(commandQueue, d_Seeds, CL_TRUE, 0, EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(int), h_Seeds, 0, NULL, NULL);
-	clFinish(commandQueue);
-	free(h_Seeds);
 
 	// Flip the fMRI data from x,y,z,t to x,y,t,z, to be able to copy all time points for one slice
 	//FlipVolumesXYZTtoXYTZ(h_Volumes, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, EPI_DATA_T);
@@ -15530,6 +18602,34 @@ void BROCCOLI_LIB::CalculateStatisticalMapsGLMBayesianFirstLevel(float* h_Volume
 		PerformDetrendingAndMotionRegressionSlice(d_Regressed_Volumes, d_Volumes, slice, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D, EPI_DATA_T);
 
 		// Calculate PPM(s)
+		if (MCMC_SINGLE_PRECISION)
+		{
+			clSetKernelArg(CalculateStatisticalMapsGLMBayesianMultiChainKernel, 0, sizeof(cl_mem), &d_Statistical_Maps);
+			clSetKernelArg(CalculateStatisticalMapsGLMBayesianMultiChainKernel, 1, sizeof(cl_mem), &d_Beta_Volumes);
+			clSetKernelArg(CalculateStatisticalMapsGLMBayesianMultiChainKernel, 2, sizeof(cl_mem), &d_AR1_Estimates);
+			clSetKernelArg(CalculateStatisticalMapsGLMBayesianMultiChainKernel, 3, sizeof(cl_mem), &d_MCMC_Diagnostics);
+			clSetKernelArg(CalculateStatisticalMapsGLMBayesianMultiChainKernel, 4, sizeof(cl_mem), &d_Regressed_Volumes);
+			clSetKernelArg(CalculateStatisticalMapsGLMBayesianMultiChainKernel, 5, sizeof(cl_mem), &d_EPI_Mask);
+			clSetKernelArg(CalculateStatisticalMapsGLMBayesianMultiChainKernel, 6, sizeof(cl_mem), &c_X_GLM);
+			clSetKernelArg(CalculateStatisticalMapsGLMBayesianMultiChainKernel, 7, sizeof(cl_mem), &c_InvOmega0);
+			clSetKernelArg(CalculateStatisticalMapsGLMBayesianMultiChainKernel, 8, sizeof(cl_mem), &c_S00);
+			clSetKernelArg(CalculateStatisticalMapsGLMBayesianMultiChainKernel, 9, sizeof(cl_mem), &c_S01);
+			clSetKernelArg(CalculateStatisticalMapsGLMBayesianMultiChainKernel, 10, sizeof(cl_mem),&c_S11);
+			clSetKernelArg(CalculateStatisticalMapsGLMBayesianMultiChainKernel, 11, sizeof(int),   &EPI_DATA_W);
+			clSetKernelArg(CalculateStatisticalMapsGLMBayesianMultiChainKernel, 12, sizeof(int),   &EPI_DATA_H);
+			clSetKernelArg(CalculateStatisticalMapsGLMBayesianMultiChainKernel, 13, sizeof(int),   &EPI_DATA_D);
+			clSetKernelArg(CalculateStatisticalMapsGLMBayesianMultiChainKernel, 14, sizeof(int),   &EPI_DATA_T);
+			clSetKernelArg(CalculateStatisticalMapsGLMBayesianMultiChainKernel, 15, sizeof(int),   &NUMBER_OF_TOTAL_GLM_REGRESSORS);
+			clSetKernelArg(CalculateStatisticalMapsGLMBayesianMultiChainKernel, 16, sizeof(int),   &NUMBER_OF_MCMC_ITERATIONS);
+			clSetKernelArg(CalculateStatisticalMapsGLMBayesianMultiChainKernel, 17, sizeof(int),   &chains);
+			clSetKernelArg(CalculateStatisticalMapsGLMBayesianMultiChainKernel, 18, sizeof(float), &MCMC_TOLERANCE);
+			clSetKernelArg(CalculateStatisticalMapsGLMBayesianMultiChainKernel, 19, sizeof(cl_uint), &seed);
+			clSetKernelArg(CalculateStatisticalMapsGLMBayesianMultiChainKernel, 20, sizeof(int),   &slice);
+			runKernelErrorCalculateStatisticalMapsGLMBayesianMultiChain = clEnqueueNDRangeKernel(commandQueue, CalculateStatisticalMapsGLMBayesianMultiChainKernel, 3, NULL, globalWorkSizeCalculateStatisticalMapsGLM, localWorkSizeCalculateStatisticalMapsGLM, 0, NULL, NULL);
+			clFinish(commandQueue);
+			continue;
+		}
+
 		clSetKernelArg(CalculateStatisticalMapsGLMBayesianKernel, 0, sizeof(cl_mem), &d_Statistical_Maps);
 		clSetKernelArg(CalculateStatisticalMapsGLMBayesianKernel, 1, sizeof(cl_mem), &d_Beta_Volumes);
 		clSetKernelArg(CalculateStatisticalMapsGLMBayesianKernel, 2, sizeof(cl_mem), &d_AR1_Estimates);
@@ -15552,6 +18652,47 @@ void BROCCOLI_LIB::CalculateStatisticalMapsGLMBayesianFirstLevel(float* h_Volume
 		clFinish(commandQueue);
 	}
 
+	if (MCMC_SINGLE_PRECISION)
+	{
+		size_t voxels = EPI_DATA_W * EPI_DATA_H * EPI_DATA_D;
+		float* h_Diagnostics = h_MCMC_Diagnostics_EPI;
+		if (h_Diagnostics == NULL)
+		{
+			h_Diagnostics = (float*)malloc(voxels * 2 * sizeof(float));
+		}
+		clEnqueueReadBuffer(commandQueue, d_MCMC_Diagnostics, CL_TRUE, 0, voxels * 2 * sizeof(float), h_Diagnostics, 0, NULL, NULL);
+
+		if ( (WRAPPER == BASH) && (VERBOS) )
+		{
+			// Voxels outside the mask have 0 iterations
+			double totalIterations = 0.0;
+			size_t brainVoxels = 0, unconvergedVoxels = 0;
+			for (size_t i = 0; i < voxels; i++)
+			{
+				if (h_Diagnostics[i + voxels] > 0.0f)
+				{
+					brainVoxels++;
+					totalIterations += h_Diagnostics[i + voxels];
+					if (h_Diagnostics[i] > 1.1f)
+					{
+						unconvergedVoxels++;
+					}
+				}
+			}
+			printf("Bayesian GLM used on average %.0f of %i iterations per chain, %zu of %zu voxels have R-hat > 1.1\n",totalIterations / (double)mymax(1,(int)brainVoxels),NUMBER_OF_MCMC_ITERATIONS,unconvergedVoxels,brainVoxels);
+		}
+
+		if (h_Diagnostics != h_MCMC_Diagnostics_EPI)
+		{
+			free(h_Diagnostics);
+		}
+
+		clReleaseMemObject(d_MCMC_Diagnostics);
+
+		allocatedDeviceMemory -= EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * 2 * sizeof(float);
+		deviceMemoryDeallocations += 1;
+	}
+
 	free(h_X_GLM_);
 	free(h_S00);
 	free(h_S01);
@@ -15957,11 +19098,11 @@ void BROCCOLI_LIB::CleanupPermutationTestFirstLevel()
 	clReleaseMemObject(c_Smoothing_Filter_Y);
 	clReleaseMemObject(c_Smoothing_Filter_Z);
 
-	clReleaseMemObject(d_Rows_Temp);
-	clReleaseMemObject(d_Columns_Temp);
+	ReleasePooledBuffer(d_Rows_Temp);
+	ReleasePooledBuffer(d_Columns_Temp);
 
-	clReleaseMemObject(d_Largest_Cluster);
-	clReleaseMemObject(d_Updated);
+	ReleasePooledBuffer(d_Largest_Cluster);
+	ReleasePooledBuffer(d_Updated);
 }
 
 void BROCCOLI_LIB::SetupPermutationTestFirstLevel()
@@ -15984,8 +19125,8 @@ void BROCCOLI_LIB::SetupPermutationTestFirstLevel()
 	clEnqueueWriteBuffer(commandQueue, c_Smoothing_Filter_Z, CL_TRUE, 0, SMOOTHING_FILTER_SIZE * sizeof(float), h_Smoothing_Filter_Z , 0, NULL, NULL);
 
 	// Allocate temporary memory for smoothing
-	d_Rows_Temp = clCreateBuffer(context, CL_MEM_READ_WRITE, EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(float), NULL, NULL);
-	d_Columns_Temp = clCreateBuffer(context, CL_MEM_READ_WRITE, EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(float), NULL, NULL);
+	d_Rows_Temp = AllocatePooledBuffer(EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(float), NULL);
+	d_Columns_Temp = AllocatePooledBuffer(EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * sizeof(float), NULL);
 
 	// Set arguments for the smoothing kernels
 	
@@ -16054,8 +19195,8 @@ void BROCCOLI_LIB::SetupPermutationTestFirstLevel()
 		clSetKernelArg(CalculateStatisticalMapsGLMFTestFirstLevelPermutationKernel, 12, sizeof(int),   &NUMBER_OF_CONTRASTS);
 	}
 
-	d_Largest_Cluster = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int), NULL, NULL);
-	d_Updated = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(float), NULL, NULL);
+	d_Largest_Cluster = AllocatePooledBuffer(sizeof(int), NULL);
+	d_Updated = AllocatePooledBuffer(sizeof(float), NULL);
 
 	SetGlobalAndLocalWorkSizesClusterize(EPI_DATA_W, EPI_DATA_H, EPI_DATA_D);
 
@@ -16188,8 +19329,8 @@ void BROCCOLI_LIB::SetupPermutationTestSecondLevel(cl_mem d_Volumes, cl_mem d_Ma
 		clSetKernelArg(CalculateStatisticalMapsGLMFTestSecondLevelPermutationKernel, 13, sizeof(int),   &NUMBER_OF_CONTRASTS);
 	}
 
-	d_Largest_Cluster = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(unsigned int), NULL, NULL);
-	d_Updated = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(float), NULL, NULL);
+	d_Largest_Cluster = AllocatePooledBuffer(sizeof(unsigned int), NULL);
+	d_Updated = AllocatePooledBuffer(sizeof(float), NULL);
 
 	SetGlobalAndLocalWorkSizesClusterize(MNI_DATA_W, MNI_DATA_H, MNI_DATA_D);
 
@@ -16273,8 +19414,8 @@ void BROCCOLI_LIB::SetupPermutationTestSecondLevel(cl_mem d_Volumes, cl_mem d_Ma
 
 void BROCCOLI_LIB::CleanupPermutationTestSecondLevel()
 {
-	clReleaseMemObject(d_Largest_Cluster);
-	clReleaseMemObject(d_Updated);
+	ReleasePooledBuffer(d_Largest_Cluster);
+	ReleasePooledBuffer(d_Updated);
 }
 
 void BROCCOLI_LIB::CalculateStatisticalMapsFirstLevelPermutation(int contrast)
@@ -16516,7 +19657,7 @@ void BROCCOLI_LIB::ApplyPermutationTestFirstLevel(float* h_fMRI_Volumes)
 			if (INFERENCE_MODE == VOXEL)
 			{
 				// Get max test value
-				h_Permutation_Distribution[p + c * NUMBER_OF_PERMUTATIONS] = CalculateMaxAtomic(d_Statistical_Maps, d_EPI_Mask, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D);
+				h_Permutation_Distribution[p + c * NUMBER_OF_PERMUTATIONS] = CalculateMax(d_Statistical_Maps, d_EPI_Mask, EPI_DATA_W, EPI_DATA_H, EPI_DATA_D);
 				if ( (WRAPPER == BASH) && VERBOS )
 				{
 					printf("Max test value is %f \n",h_Permutation_Distribution[p + c * NUMBER_OF_PERMUTATIONS]);
@@ -16744,7 +19885,7 @@ void BROCCOLI_LIB::ApplyPermutationTestSecondLevel()
             if (INFERENCE_MODE == VOXEL)
             {
                 // Calculate max test value
-                h_Permutation_Distribution[p] = CalculateMaxAtomic(d_Statistical_Maps, d_MNI_Brain_Mask, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D);
+                h_Permutation_Distribution[p] = CalculateMax(d_Statistical_Maps, d_MNI_Brain_Mask, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D);
             }
             // Cluster distribution, extent or mass
             else if ( (INFERENCE_MODE == CLUSTER_EXTENT) || (INFERENCE_MODE == CLUSTER_MASS) )
@@ -16755,7 +19896,7 @@ void BROCCOLI_LIB::ApplyPermutationTestSecondLevel()
             // Threshold free cluster enhancement
             else if (INFERENCE_MODE == TFCE)
             {
-                maxActivation = CalculateMaxAtomic(d_Statistical_Maps, d_MNI_Brain_Mask, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D);
+                maxActivation = CalculateMax(d_Statistical_Maps, d_MNI_Brain_Mask, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D);
                 float delta = 0.2846;
                 ClusterizeOpenCLTFCEPermutation(MAX_VALUE, d_MNI_Brain_Mask, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, maxActivation, delta);
                 h_Permutation_Distribution[p] = MAX_VALUE;
@@ -17065,6 +20206,65 @@ void BROCCOLI_LIB::GeneratePermutationMatrixSecondLevelCorrelation(int contrast)
     }
 }
 
+// Generates permutations of the labels of the uncensored volumes for the searchlight, for each permutation the volume
+// whose label is given to each uncensored volume is stored. The first permutation is the original labels. Volumes of
+// the same class have the same label, so the permuted labels (not the volume indices) are checked for repetitions
+void BROCCOLI_LIB::GeneratePermutationMatrixSearchlight(std::vector<cl_int>& permutedVolumeIndices, std::vector<cl_int>& volumeIndices, int numberOfPermutations)
+{
+	int uncensoredVolumes = (int)volumeIndices.size();
+
+	std::vector<cl_int> perm = volumeIndices;
+	std::vector<float> labels(uncensoredVolumes);
+	for (int i = 0; i < uncensoredVolumes; i++)
+	{
+		labels[i] = h_Correct_Classes_In[perm[i]];
+	}
+	std::vector< std::vector<float> > allLabels;
+	allLabels.push_back(labels);
+
+	permutedVolumeIndices.resize(numberOfPermutations * uncensoredVolumes);
+	for (int i = 0; i < uncensoredVolumes; i++)
+	{
+		permutedVolumeIndices[i] = perm[i];
+	}
+
+	for (int p = 1; p < numberOfPermutations; p++)
+	{
+		while(true)
+		{
+			// Make random permutation
+			std::random_shuffle(perm.begin(), perm.end());
+
+			for (int i = 0; i < uncensoredVolumes; i++)
+			{
+				labels[i] = h_Correct_Classes_In[perm[i]];
+			}
+
+			// Check for repetitions of the labels
+			bool unique = true;
+			for (int r = 0; r < p; r++)
+			{
+				if (allLabels[r] == labels)
+				{
+					unique = false;
+					break;
+				}
+			}
+
+			if (unique)
+			{
+				allLabels.push_back(labels);
+				break;
+			}
+		}
+
+		for (int i = 0; i < uncensoredVolumes; i++)
+		{
+			permutedVolumeIndices[i + p * uncensoredVolumes] = perm[i];
+		}
+	}
+}
+
 // Generates a sign flipping matrix for group analysis, one sample t-test
 void BROCCOLI_LIB::GenerateSignMatrixSecondLevel()
 {
@@ -18510,7 +21710,7 @@ void BROCCOLI_LIB::ClusterizeOpenCLTFCEPermutation(float& MAX_VALUE, cl_mem d_Ma
 	}
 
 	// Find max TFCE value
-	MAX_VALUE = CalculateMaxAtomic(d_TFCE_Values, d_Mask, DATA_W, DATA_H, DATA_D);
+	MAX_VALUE = CalculateMax(d_TFCE_Values, d_Mask, DATA_W, DATA_H, DATA_D);
 }
 
 
@@ -18896,78 +22096,365 @@ Eigen::MatrixXf BROCCOLI_LIB::PCAWhitenEigen(Eigen::MatrixXf & inputData, bool d
 		printf("It took %f seconds to calculate the covariance matrix using Eigen\n",(float)(endTime - startTime));
 	}
 
-	// Calculate eigen values of covariance matrix	
+	// Calculate eigen values of covariance matrix	
+	if (WRAPPER == BASH)
+	{
+		printf("Calculating eigen values\n");
+	}
+	Eigen::SelfAdjointEigenSolver<Eigen::MatrixXf> es(covarianceMatrix);
+	Eigen::VectorXf eigenValues = es.eigenvalues();
+	Eigen::MatrixXf eigenVectors = es.eigenvectors();
+	
+	float totalVariance = 0.0f;
+	for (int i = 0; i < NUMBER_OF_OBSERVATIONS; i++)
+	{
+		totalVariance += eigenValues(i);
+	}
+
+	// Calculate number of components to save
+	float savedVariance = 0.0;
+	Eigen::VectorXf temp = eigenValues;
+	NUMBER_OF_ICA_COMPONENTS = 0;
+	while (savedVariance/totalVariance*100.0 < (double)PROPORTION_OF_VARIANCE_TO_SAVE_BEFORE_ICA )
+	{
+		NUMBER_OF_ICA_COMPONENTS++;
+		int index = 0;
+		float largestEigenValue = temp.maxCoeff(&index);
+		savedVariance += largestEigenValue;
+		temp(index) = 0.0f;
+	}
+
+	Eigen::VectorXf savedEigenValues(NUMBER_OF_ICA_COMPONENTS);
+	Eigen::MatrixXf savedEigenVectors(NUMBER_OF_ICA_COMPONENTS,NUMBER_OF_OBSERVATIONS);
+
+	// Get a sub matrix of all the eigen vectors, to remove the smallest ones
+	// Get a sub vector of the eigen values, to remove the smallest eigen values
+	for (int i = 0; i < NUMBER_OF_ICA_COMPONENTS; i++)
+	{	
+		// Find largest eigen value for current component, and it's location
+		int index = 0; 
+		float largestEigenValue = eigenValues.maxCoeff(&index);
+		savedEigenValues(i) = largestEigenValue;
+
+		printf("Largest eigen value is %f \n",(float)largestEigenValue);
+
+		// Get the corresponding eigen vector
+		savedEigenVectors.row(i) = eigenVectors.col(index).transpose();
+
+		// Set the previous largest eigen value to 0
+		eigenValues(index) = 0.0f;
+	}
+
+	if ((WRAPPER == BASH) && VERBOSE)
+	{
+		printf("Saved %f %% of the total variance during the dimensionality reduction, using %zu components\n",(float)savedVariance/(float)totalVariance*100.0,NUMBER_OF_ICA_COMPONENTS);
+	}
+
+	// Calculate  ^(-1/2) for all saved eigen values
+	Eigen::VectorXf scaledEigenValues(NUMBER_OF_ICA_COMPONENTS);
+	for (int i = 0; i < NUMBER_OF_ICA_COMPONENTS; i++)
+	{	
+		float eigenValue = savedEigenValues(i);
+		scaledEigenValues(i) = 1.0f/sqrt(eigenValue);
+	}
+
+	// Calculate whitening matrix
+	Eigen::MatrixXf whiteningMatrix = scaledEigenValues.asDiagonal() * savedEigenVectors;
+
+	// Perform the actual whitening
+	if (WRAPPER == BASH)
+	{
+		printf("Applying dimensionality reduction and whitening\n");
+	}
+	Eigen::MatrixXf whitenedData = whiteningMatrix * inputData;
+	
+	return whitenedData;
+}
+
+// Returns the number of components (eigen values sorted in descending order) needed to save the requested proportion of the variance
+int BROCCOLI_LIB::GetNumberOfPCAComponentsToSave(Eigen::VectorXf & eigenValues, float totalVariance, float & savedVariance)
+{
+	int components = 0;
+	savedVariance = 0.0f;
+	while ( (savedVariance/totalVariance*100.0 < (double)PROPORTION_OF_VARIANCE_TO_SAVE_BEFORE_ICA) && (components < eigenValues.size()) )
+	{
+		savedVariance += eigenValues(components);
+		components++;
+	}
+
+	return components;
+}
+
+// Randomized range finder (Halko et al.), estimates only the leading components directly from the data,
+// instead of forming and decomposing the full NUMBER_OF_OBSERVATIONS x NUMBER_OF_OBSERVATIONS covariance matrix
+Eigen::MatrixXf BROCCOLI_LIB::PCAWhitenRandomizedEigen(Eigen::MatrixXf & inputData, bool demean)
+{
+	// inputData, NUMBER_OF_OBSERVATIONS x NUMBER_OF_VOXELS
+	// whitenedData, NUMBER_OF_COMPONENTS x NUMBER_OF_VOXELS
+
+	size_t NUMBER_OF_VOXELS = inputData.cols();
+	size_t NUMBER_OF_OBSERVATIONS = inputData.rows();
+
+	printf("Input data matrix size is %li x %li \n",inputData.rows(),inputData.cols());
+
+	if (demean)
+	{
+		if (WRAPPER == BASH)
+		{	
+			printf("Demeaning data\n");
+		}
+		#pragma omp parallel for
+		for (size_t voxel = 0; voxel < NUMBER_OF_VOXELS; voxel++)
+		{
+			Eigen::VectorXf values = inputData.block(0,voxel,NUMBER_OF_OBSERVATIONS,1);
+			DemeanRegressor(values,NUMBER_OF_OBSERVATIONS);
+			inputData.block(0,voxel,NUMBER_OF_OBSERVATIONS,1) = values;
+		}
+	}
+
+	// The total variance is the trace of the covariance matrix, which does not require the covariance matrix
+	float totalVariance = inputData.squaredNorm()/(float)(NUMBER_OF_VOXELS - 1);
+
+	if (WRAPPER == BASH)
+	{
+		printf("Estimating the leading eigen vectors using a randomized range finder\n");
+	}
+
+	double startTime = GetTime();
+
+	size_t NUMBER_OF_COMPONENTS = mymin(RANDOMIZED_PCA_INITIAL_COMPONENTS,(int)NUMBER_OF_OBSERVATIONS);
+	size_t NUMBER_OF_SAMPLES;
+	Eigen::MatrixXf projectedData, eigenVectors;
+	Eigen::VectorXf eigenValues;
+	float savedVariance = 0.0f;
+	int componentsToSave = 0;
+
+	while (true)
+	{
+		NUMBER_OF_SAMPLES = mymin((int)(NUMBER_OF_COMPONENTS + RANDOMIZED_PCA_OVERSAMPLING),(int)NUMBER_OF_OBSERVATIONS);
+
+		// One pass for the range, plus power iterations to separate the leading eigen values from the tail
+		Eigen::MatrixXf basis = Eigen::MatrixXf::Random(NUMBER_OF_OBSERVATIONS,NUMBER_OF_SAMPLES);
+		for (int i = 0; i < (RANDOMIZED_PCA_POWER_ITERATIONS + 1); i++)
+		{
+			projectedData = inputData.transpose() * basis;
+			Eigen::HouseholderQR<Eigen::MatrixXf> qr(inputData * projectedData);
+			basis = qr.householderQ() * Eigen::MatrixXf::Identity(NUMBER_OF_OBSERVATIONS,NUMBER_OF_SAMPLES);
+		}
+
+		// Covariance matrix restricted to the basis, NUMBER_OF_SAMPLES x NUMBER_OF_SAMPLES
+		projectedData = inputData.transpose() * basis;
+		Eigen::MatrixXf smallCovarianceMatrix = projectedData.transpose() * projectedData;
+		smallCovarianceMatrix *= 1.0f/(float)(NUMBER_OF_VOXELS - 1);
+
+		// Eigen values are returned in ascending order
+		Eigen::SelfAdjointEigenSolver<Eigen::MatrixXf> es(smallCovarianceMatrix);
+		eigenValues = es.eigenvalues().reverse();
+		eigenVectors = es.eigenvectors().rowwise().reverse();
+
+		componentsToSave = GetNumberOfPCAComponentsToSave(eigenValues, totalVariance, savedVariance);
+
+		// The last eigen values are only used as oversampling, increase the basis if they are needed
+		if ( (componentsToSave <= NUMBER_OF_COMPONENTS) || (NUMBER_OF_SAMPLES == NUMBER_OF_OBSERVATIONS) )
+		{
+			break;
+		}
+
+		NUMBER_OF_COMPONENTS = mymin(2 * (int)NUMBER_OF_COMPONENTS,(int)NUMBER_OF_OBSERVATIONS);
+
+		if ((WRAPPER == BASH) && VERBOS)
+		{
+			printf("Saved variance too low, increasing the randomized basis to %zu components\n",NUMBER_OF_COMPONENTS);
+		}
+	}
+
+	NUMBER_OF_ICA_COMPONENTS = componentsToSave;
+
+	double endTime = GetTime();
+	if ((WRAPPER == BASH) && VERBOS)
+	{
+		printf("It took %f seconds to estimate the leading eigen vectors using a randomized range finder\n",(float)(endTime - startTime));
+	}
+
+	if ((WRAPPER == BASH) && VERBOSE)
+	{
+		printf("Saved %f %% of the total variance during the dimensionality reduction, using %zu components\n",(float)savedVariance/(float)totalVariance*100.0,NUMBER_OF_ICA_COMPONENTS);
+	}
+
+	// Whitening matrix in the randomized basis, the projected data is already available
+	Eigen::MatrixXf whiteningMatrix(NUMBER_OF_ICA_COMPONENTS,NUMBER_OF_SAMPLES);
+	for (int i = 0; i < NUMBER_OF_ICA_COMPONENTS; i++)
+	{
+		whiteningMatrix.row(i) = eigenVectors.col(i).transpose() / sqrt(eigenValues(i));
+	}
+
+	// Perform the actual whitening
+	if (WRAPPER == BASH)
+	{
+		printf("Applying dimensionality reduction and whitening\n");
+	}
+	Eigen::MatrixXf whitenedData = whiteningMatrix * projectedData.transpose();
+	
+	return whitenedData;
+}
+
+// Gets the time series of the voxels inside the mask, for a range of voxels in one volume, and demeans (or z-scores) them.
+// With a voxel reader the time series are read from the file, otherwise they are copied from the fMRI volumes
+bool BROCCOLI_LIB::GetICAVoxelChunk(Eigen::MatrixXf & chunk, size_t & numberOfVoxels, std::vector<float> & buffer, size_t firstIndex, size_t numberOfIndices)
+{
+	const float* data;
+	size_t stride;
+	if (ICA_VOXEL_READER != NULL)
+	{
+		if (!ICA_VOXEL_READER(&buffer[0], firstIndex, numberOfIndices, ICA_VOXEL_READER_DATA))
+		{
+			return false;
+		}
+		data = &buffer[0];
+		stride = numberOfIndices;
+	}
+	else
+	{
+		data = h_fMRI_Volumes + firstIndex;
+		stride = EPI_DATA_W * EPI_DATA_H * EPI_DATA_D;
+	}
+
+	std::vector<size_t> maskIndices;
+	for (size_t i = 0; i < numberOfIndices; i++)
+	{
+		if (h_EPI_Mask[firstIndex + i] == 1.0f)
+		{
+			maskIndices.push_back(i);
+		}
+	}
+	numberOfVoxels = maskIndices.size();
+
+	#pragma omp parallel for
+	for (size_t voxel = 0; voxel < numberOfVoxels; voxel++)
+	{
+		size_t index = maskIndices[voxel];
+
+		float sum = 0.0f;
+		for (size_t t = 0; t < EPI_DATA_T; t++)
+		{
+			float value = data[index + t * stride];
+			chunk(t,voxel) = value;
+			sum += value;
+		}
+		float mean = sum/(float)EPI_DATA_T;
+
+		sum = 0.0f;
+		for (size_t t = 0; t < EPI_DATA_T; t++)
+		{
+			float value = chunk(t,voxel) - mean;
+			chunk(t,voxel) = value;
+			sum += value * value;
+		}
+
+		if (Z_SCORE)
+		{
+			float std = sqrt(sum/(float)(EPI_DATA_T-1));
+			for (size_t t = 0; t < EPI_DATA_T; t++)
+			{
+				chunk(t,voxel) /= std;
+			}
+		}
+	}
+
+	return true;
+}
+
+// Calculates the whitening matrix from a covariance matrix, saves a certain percentage of the variance
+Eigen::MatrixXf BROCCOLI_LIB::GetPCAWhiteningMatrix(Eigen::MatrixXf & covarianceMatrix)
+{
 	if (WRAPPER == BASH)
 	{
 		printf("Calculating eigen values\n");
 	}
+
+	// Eigen values are returned in ascending order
 	Eigen::SelfAdjointEigenSolver<Eigen::MatrixXf> es(covarianceMatrix);
-	Eigen::VectorXf eigenValues = es.eigenvalues();
-	Eigen::MatrixXf eigenVectors = es.eigenvectors();
-	
-	float totalVariance = 0.0f;
-	for (int i = 0; i < NUMBER_OF_OBSERVATIONS; i++)
-	{
-		totalVariance += eigenValues(i);
-	}
+	Eigen::VectorXf eigenValues = es.eigenvalues().reverse();
+	Eigen::MatrixXf eigenVectors = es.eigenvectors().rowwise().reverse();
 
-	// Calculate number of components to save
-	float savedVariance = 0.0;
-	Eigen::VectorXf temp = eigenValues;
-	NUMBER_OF_ICA_COMPONENTS = 0;
-	while (savedVariance/totalVariance*100.0 < (double)PROPORTION_OF_VARIANCE_TO_SAVE_BEFORE_ICA )
+	float totalVariance = eigenValues.sum();
+	float savedVariance = 0.0f;
+	NUMBER_OF_ICA_COMPONENTS = GetNumberOfPCAComponentsToSave(eigenValues, totalVariance, savedVariance);
+
+	if ((WRAPPER == BASH) && VERBOSE)
 	{
-		NUMBER_OF_ICA_COMPONENTS++;
-		int index = 0;
-		float largestEigenValue = temp.maxCoeff(&index);
-		savedVariance += largestEigenValue;
-		temp(index) = 0.0f;
+		printf("Saved %f %% of the total variance during the dimensionality reduction, using %zu components\n",(float)savedVariance/(float)totalVariance*100.0,NUMBER_OF_ICA_COMPONENTS);
 	}
 
-	Eigen::VectorXf savedEigenValues(NUMBER_OF_ICA_COMPONENTS);
-	Eigen::MatrixXf savedEigenVectors(NUMBER_OF_ICA_COMPONENTS,NUMBER_OF_OBSERVATIONS);
-
-	// Get a sub matrix of all the eigen vectors, to remove the smallest ones
-	// Get a sub vector of the eigen values, to remove the smallest eigen values
+	Eigen::MatrixXf whiteningMatrix(NUMBER_OF_ICA_COMPONENTS,covarianceMatrix.rows());
 	for (int i = 0; i < NUMBER_OF_ICA_COMPONENTS; i++)
-	{	
-		// Find largest eigen value for current component, and it's location
-		int index = 0; 
-		float largestEigenValue = eigenValues.maxCoeff(&index);
-		savedEigenValues(i) = largestEigenValue;
+	{
+		whiteningMatrix.row(i) = eigenVectors.col(i).transpose() / sqrt(eigenValues(i));
+	}
 
-		printf("Largest eigen value is %f \n",(float)largestEigenValue);
+	return whiteningMatrix;
+}
 
-		// Get the corresponding eigen vector
-		savedEigenVectors.row(i) = eigenVectors.col(index).transpose();
+// Streaming version, accumulates the covariance matrix over chunks of voxels and then projects the chunks onto the whitening matrix.
+// Only one chunk of ICA_STREAMING_CHUNK_VOXELS voxels is in memory at a time, an empty matrix is returned if the voxel reader fails
+Eigen::MatrixXf BROCCOLI_LIB::PCAWhitenStreamingEigen()
+{
+	size_t NUMBER_OF_INDICES = EPI_DATA_W * EPI_DATA_H * EPI_DATA_D;
+	size_t CHUNK_SIZE = std::min((size_t)ICA_STREAMING_CHUNK_VOXELS,NUMBER_OF_INDICES);
+	Eigen::MatrixXf chunk(NUMBER_OF_ICA_OBSERVATIONS,CHUNK_SIZE);
+	std::vector<float> buffer;
+	if (ICA_VOXEL_READER != NULL)
+	{
+		buffer.resize(CHUNK_SIZE * EPI_DATA_T);
+	}
 
-		// Set the previous largest eigen value to 0
-		eigenValues(index) = 0.0f;
+	if (WRAPPER == BASH)
+	{
+		printf("Estimating the covariance matrix in chunks of %zu voxels\n",CHUNK_SIZE);
 	}
 
-	if ((WRAPPER == BASH) && VERBOSE)
+	double startTime = GetTime();
+
+	Eigen::MatrixXf covarianceMatrix = Eigen::MatrixXf::Zero(NUMBER_OF_ICA_OBSERVATIONS,NUMBER_OF_ICA_OBSERVATIONS);
+	for (size_t firstIndex = 0; firstIndex < NUMBER_OF_INDICES; firstIndex += CHUNK_SIZE)
 	{
-		printf("Saved %f %% of the total variance during the dimensionality reduction, using %zu components\n",(float)savedVariance/(float)totalVariance*100.0,NUMBER_OF_ICA_COMPONENTS);
+		size_t voxels;
+		if (!GetICAVoxelChunk(chunk, voxels, buffer, firstIndex, std::min(CHUNK_SIZE,NUMBER_OF_INDICES - firstIndex)))
+		{
+			NUMBER_OF_ICA_COMPONENTS = 0;
+			return Eigen::MatrixXf();
+		}
+		covarianceMatrix.noalias() += chunk.leftCols(voxels) * chunk.leftCols(voxels).transpose();
 	}
+	covarianceMatrix *= 1.0f/(float)(NUMBER_OF_ICA_VARIABLES - 1);
 
-	// Calculate  ^(-1/2) for all saved eigen values
-	Eigen::VectorXf scaledEigenValues(NUMBER_OF_ICA_COMPONENTS);
-	for (int i = 0; i < NUMBER_OF_ICA_COMPONENTS; i++)
-	{	
-		float eigenValue = savedEigenValues(i);
-		scaledEigenValues(i) = 1.0f/sqrt(eigenValue);
+	double endTime = GetTime();
+	if ((WRAPPER == BASH) && VERBOS)
+	{
+		printf("It took %f seconds to calculate the covariance matrix using Eigen\n",(float)(endTime - startTime));
 	}
 
-	// Calculate whitening matrix
-	Eigen::MatrixXf whiteningMatrix = scaledEigenValues.asDiagonal() * savedEigenVectors;
+	Eigen::MatrixXf whiteningMatrix = GetPCAWhiteningMatrix(covarianceMatrix);
 
-	// Perform the actual whitening
+	// Perform the actual whitening, one chunk at a time
 	if (WRAPPER == BASH)
 	{
 		printf("Applying dimensionality reduction and whitening\n");
 	}
-	Eigen::MatrixXf whitenedData = whiteningMatrix * inputData;
-	
+	Eigen::MatrixXf whitenedData(NUMBER_OF_ICA_COMPONENTS,NUMBER_OF_ICA_VARIABLES);
+	size_t firstVoxel = 0;
+	for (size_t firstIndex = 0; firstIndex < NUMBER_OF_INDICES; firstIndex += CHUNK_SIZE)
+	{
+		size_t voxels;
+		if (!GetICAVoxelChunk(chunk, voxels, buffer, firstIndex, std::min(CHUNK_SIZE,NUMBER_OF_INDICES - firstIndex)))
+		{
+			NUMBER_OF_ICA_COMPONENTS = 0;
+			return Eigen::MatrixXf();
+		}
+		whitenedData.middleCols(firstVoxel,voxels).noalias() = whiteningMatrix * chunk.leftCols(voxels);
+		firstVoxel += voxels;
+	}
+
 	return whitenedData;
 }
 
@@ -19216,8 +22703,298 @@ Eigen::MatrixXf BROCCOLI_LIB::PCAWhiten(Eigen::MatrixXf & inputData, bool demean
 	return whitenedData;
 }
 #elif __APPLE__
-Eigen::MatrixXf BROCCOLI_LIB::PCAWhiten(Eigen::MatrixXf & inputData, bool demean)
+Eigen::MatrixXf BROCCOLI_LIB::PCAWhiten(Eigen::MatrixXf & inputData, bool demean)
+{	
+}
+#endif
+
+
+// Randomized range finder using clBLAS, the data matrix is only copied to the device once
+#ifdef __linux
+Eigen::MatrixXf BROCCOLI_LIB::PCAWhitenRandomized(Eigen::MatrixXf & inputData, bool demean)
+{
+	// inputData, NUMBER_OF_OBSERVATIONS x NUMBER_OF_VOXELS
+	// whitenedData, NUMBER_OF_COMPONENTS x NUMBER_OF_VOXELS
+
+	printf("Input data matrix size is %li x %li \n",inputData.rows(),inputData.cols());
+
+	if (demean)
+	{
+		if (WRAPPER == BASH)
+		{	
+			printf("Demeaning data\n");
+		}
+		#pragma omp parallel for
+		for (size_t voxel = 0; voxel < NUMBER_OF_ICA_VARIABLES; voxel++)
+		{
+			Eigen::VectorXf values = inputData.block(0,voxel,NUMBER_OF_ICA_OBSERVATIONS,1);
+			DemeanRegressor(values,NUMBER_OF_ICA_OBSERVATIONS);
+			inputData.block(0,voxel,NUMBER_OF_ICA_OBSERVATIONS,1) = values;
+		}
+	}
+
+	// The total variance is the trace of the covariance matrix, which does not require the covariance matrix
+	float totalVariance = inputData.squaredNorm()/(float)(NUMBER_OF_ICA_VARIABLES - 1);
+
+	if (WRAPPER == BASH)
+	{
+		printf("Estimating the leading eigen vectors using a randomized range finder and clBLAS\n");
+	}
+
+	double startTime, endTime;
+	startTime = GetTime();
+
+	cl_mem d_Data = AllocatePooledBuffer(NUMBER_OF_ICA_OBSERVATIONS * NUMBER_OF_ICA_VARIABLES * sizeof(float), NULL);
+	clEnqueueWriteBuffer(commandQueue, d_Data, CL_TRUE, 0, NUMBER_OF_ICA_OBSERVATIONS * NUMBER_OF_ICA_VARIABLES * sizeof(float), inputData.data(), 0, NULL, NULL);
+
+	size_t NUMBER_OF_COMPONENTS = mymin(RANDOMIZED_PCA_INITIAL_COMPONENTS,(int)NUMBER_OF_ICA_OBSERVATIONS);
+	size_t NUMBER_OF_SAMPLES;
+	cl_mem d_Basis = NULL;
+	cl_mem d_Projected_Data = NULL;
+	cl_mem d_Range = NULL;
+	Eigen::MatrixXf eigenVectors;
+	Eigen::VectorXf eigenValues;
+	float savedVariance = 0.0f;
+	int componentsToSave = 0;
+
+	while (true)
+	{
+		NUMBER_OF_SAMPLES = mymin((int)(NUMBER_OF_COMPONENTS + RANDOMIZED_PCA_OVERSAMPLING),(int)NUMBER_OF_ICA_OBSERVATIONS);
+
+		d_Basis = AllocatePooledBuffer(NUMBER_OF_ICA_OBSERVATIONS * NUMBER_OF_SAMPLES * sizeof(float), NULL);
+		d_Projected_Data = AllocatePooledBuffer(NUMBER_OF_ICA_VARIABLES * NUMBER_OF_SAMPLES * sizeof(float), NULL);
+		d_Range = AllocatePooledBuffer(NUMBER_OF_ICA_OBSERVATIONS * NUMBER_OF_SAMPLES * sizeof(float), NULL);
+
+		Eigen::MatrixXf basis = Eigen::MatrixXf::Random(NUMBER_OF_ICA_OBSERVATIONS,NUMBER_OF_SAMPLES);
+		Eigen::MatrixXf range(NUMBER_OF_ICA_OBSERVATIONS,NUMBER_OF_SAMPLES);
+
+		// One pass for the range, plus power iterations to separate the leading eigen values from the tail
+		for (int i = 0; i < (RANDOMIZED_PCA_POWER_ITERATIONS + 1); i++)
+		{
+			clEnqueueWriteBuffer(commandQueue, d_Basis, CL_TRUE, 0, NUMBER_OF_ICA_OBSERVATIONS * NUMBER_OF_SAMPLES * sizeof(float), basis.data(), 0, NULL, NULL);
+
+			// Projected data = data' * basis, NUMBER_OF_VOXELS x NUMBER_OF_SAMPLES
+		 	error = clblasSgemm (clblasColumnMajor, clblasTrans, clblasNoTrans, NUMBER_OF_ICA_VARIABLES, NUMBER_OF_SAMPLES, NUMBER_OF_ICA_OBSERVATIONS, 1.0f, d_Data, 0, NUMBER_OF_ICA_OBSERVATIONS, d_Basis, 0, NUMBER_OF_ICA_OBSERVATIONS, 0.0f, d_Projected_Data, 0, NUMBER_OF_ICA_VARIABLES, 1, &commandQueue, 0, NULL, NULL);
+			// Range = data * projected data, NUMBER_OF_OBSERVATIONS x NUMBER_OF_SAMPLES
+		 	error = clblasSgemm (clblasColumnMajor, clblasNoTrans, clblasNoTrans, NUMBER_OF_ICA_OBSERVATIONS, NUMBER_OF_SAMPLES, NUMBER_OF_ICA_VARIABLES, 1.0f, d_Data, 0, NUMBER_OF_ICA_OBSERVATIONS, d_Projected_Data, 0, NUMBER_OF_ICA_VARIABLES, 0.0f, d_Range, 0, NUMBER_OF_ICA_OBSERVATIONS, 1, &commandQueue, 0, NULL, NULL);
+			clFinish(commandQueue);
+
+			// Orthonormalize the small range matrix on the host
+			clEnqueueReadBuffer(commandQueue, d_Range, CL_TRUE, 0, NUMBER_OF_ICA_OBSERVATIONS * NUMBER_OF_SAMPLES * sizeof(float), range.data(), 0, NULL, NULL);
+			Eigen::HouseholderQR<Eigen::MatrixXf> qr(range);
+			basis = qr.householderQ() * Eigen::MatrixXf::Identity(NUMBER_OF_ICA_OBSERVATIONS,NUMBER_OF_SAMPLES);
+		}
+
+		clEnqueueWriteBuffer(commandQueue, d_Basis, CL_TRUE, 0, NUMBER_OF_ICA_OBSERVATIONS * NUMBER_OF_SAMPLES * sizeof(float), basis.data(), 0, NULL, NULL);
+	 	error = clblasSgemm (clblasColumnMajor, clblasTrans, clblasNoTrans, NUMBER_OF_ICA_VARIABLES, NUMBER_OF_SAMPLES, NUMBER_OF_ICA_OBSERVATIONS, 1.0f, d_Data, 0, NUMBER_OF_ICA_OBSERVATIONS, d_Basis, 0, NUMBER_OF_ICA_OBSERVATIONS, 0.0f, d_Projected_Data, 0, NUMBER_OF_ICA_VARIABLES, 1, &commandQueue, 0, NULL, NULL);
+
+		// Covariance matrix restricted to the basis, NUMBER_OF_SAMPLES x NUMBER_OF_SAMPLES (re-use the range buffer)
+	 	error = clblasSgemm (clblasColumnMajor, clblasTrans, clblasNoTrans, NUMBER_OF_SAMPLES, NUMBER_OF_SAMPLES, NUMBER_OF_ICA_VARIABLES, 1.0f/(float)(NUMBER_OF_ICA_VARIABLES - 1), d_Projected_Data, 0, NUMBER_OF_ICA_VARIABLES, d_Projected_Data, 0, NUMBER_OF_ICA_VARIABLES, 0.0f, d_Range, 0, NUMBER_OF_SAMPLES, 1, &commandQueue, 0, NULL, NULL);
+		clFinish(commandQueue);
+
+		Eigen::MatrixXf smallCovarianceMatrix(NUMBER_OF_SAMPLES,NUMBER_OF_SAMPLES);
+		clEnqueueReadBuffer(commandQueue, d_Range, CL_TRUE, 0, NUMBER_OF_SAMPLES * NUMBER_OF_SAMPLES * sizeof(float), smallCovarianceMatrix.data(), 0, NULL, NULL);
+
+		// Eigen values are returned in ascending order
+		Eigen::SelfAdjointEigenSolver<Eigen::MatrixXf> es(smallCovarianceMatrix);
+		eigenValues = es.eigenvalues().reverse();
+		eigenVectors = es.eigenvectors().rowwise().reverse();
+
+		componentsToSave = GetNumberOfPCAComponentsToSave(eigenValues, totalVariance, savedVariance);
+
+		ReleasePooledBuffer(d_Basis);
+		ReleasePooledBuffer(d_Range);
+
+		// The last eigen values are only used as oversampling, increase the basis if they are needed
+		if ( (componentsToSave <= NUMBER_OF_COMPONENTS) || (NUMBER_OF_SAMPLES == NUMBER_OF_ICA_OBSERVATIONS) )
+		{
+			break;
+		}
+
+		ReleasePooledBuffer(d_Projected_Data);
+
+		NUMBER_OF_COMPONENTS = mymin(2 * (int)NUMBER_OF_COMPONENTS,(int)NUMBER_OF_ICA_OBSERVATIONS);
+
+		if ((WRAPPER == BASH) && VERBOS)
+		{
+			printf("Saved variance too low, increasing the randomized basis to %zu components\n",NUMBER_OF_COMPONENTS);
+		}
+	}
+
+	ReleasePooledBuffer(d_Data);
+
+	NUMBER_OF_ICA_COMPONENTS = componentsToSave;
+
+	endTime = GetTime();
+	if ((WRAPPER == BASH) && VERBOS)
+	{
+		printf("It took %f seconds to estimate the leading eigen vectors using a randomized range finder and clBLAS\n",(float)(endTime - startTime));
+	}
+
+	if ((WRAPPER == BASH) && VERBOSE)
+	{
+		printf("Saved %f %% of the total variance during the dimensionality reduction, using %zu components\n",(float)savedVariance/(float)totalVariance*100.0,NUMBER_OF_ICA_COMPONENTS);
+	}
+
+	// Whitening matrix in the randomized basis, the projected data is already on the device
+	Eigen::MatrixXf whiteningMatrix(NUMBER_OF_ICA_COMPONENTS,NUMBER_OF_SAMPLES);
+	for (int i = 0; i < NUMBER_OF_ICA_COMPONENTS; i++)
+	{
+		whiteningMatrix.row(i) = eigenVectors.col(i).transpose() / sqrt(eigenValues(i));
+	}
+
+	startTime = GetTime();
+
+	cl_mem d_Whitening_Matrix = AllocatePooledBuffer(NUMBER_OF_ICA_COMPONENTS * NUMBER_OF_SAMPLES * sizeof(float), NULL);
+	cl_mem d_Whitened_Data = AllocatePooledBuffer(NUMBER_OF_ICA_COMPONENTS * NUMBER_OF_ICA_VARIABLES * sizeof(float), NULL);
+
+	clEnqueueWriteBuffer(commandQueue, d_Whitening_Matrix, CL_TRUE, 0, NUMBER_OF_ICA_COMPONENTS * NUMBER_OF_SAMPLES * sizeof(float), whiteningMatrix.data(), 0, NULL, NULL);
+
+	// Whitened data = whitening matrix * projected data'
+ 	error = clblasSgemm (clblasColumnMajor, clblasNoTrans, clblasTrans, NUMBER_OF_ICA_COMPONENTS, NUMBER_OF_ICA_VARIABLES, NUMBER_OF_SAMPLES, 1.0f, d_Whitening_Matrix, 0, NUMBER_OF_ICA_COMPONENTS, d_Projected_Data, 0, NUMBER_OF_ICA_VARIABLES, 0.0f, d_Whitened_Data, 0, NUMBER_OF_ICA_COMPONENTS, 1, &commandQueue, 0, NULL, NULL);
+	clFinish(commandQueue);
+
+	Eigen::MatrixXf whitenedData(NUMBER_OF_ICA_COMPONENTS,NUMBER_OF_ICA_VARIABLES);
+	clEnqueueReadBuffer(commandQueue, d_Whitened_Data, CL_TRUE, 0, NUMBER_OF_ICA_COMPONENTS * NUMBER_OF_ICA_VARIABLES * sizeof(float), whitenedData.data(), 0, NULL, NULL);
+
+	ReleasePooledBuffer(d_Projected_Data);
+	ReleasePooledBuffer(d_Whitening_Matrix);
+	ReleasePooledBuffer(d_Whitened_Data);
+
+	endTime = GetTime();
+	if ((WRAPPER == BASH) && VERBOS)
+	{
+		printf("It took %f seconds to perform the whitening using clBLAS\n",(float)(endTime - startTime));
+	}
+
+	return whitenedData;
+}
+#elif __APPLE__
+Eigen::MatrixXf BROCCOLI_LIB::PCAWhitenRandomized(Eigen::MatrixXf & inputData, bool demean)
+{	
+	return PCAWhitenRandomizedEigen(inputData, demean);
+}
+#endif
+
+
+// Streaming version using clBLAS, only one chunk of voxels is on the device at a time
+#ifdef __linux
+Eigen::MatrixXf BROCCOLI_LIB::PCAWhitenStreaming()
+{
+	size_t NUMBER_OF_INDICES = EPI_DATA_W * EPI_DATA_H * EPI_DATA_D;
+	size_t CHUNK_SIZE = std::min((size_t)ICA_STREAMING_CHUNK_VOXELS,NUMBER_OF_INDICES);
+	Eigen::MatrixXf chunk(NUMBER_OF_ICA_OBSERVATIONS,CHUNK_SIZE);
+	std::vector<float> buffer;
+	if (ICA_VOXEL_READER != NULL)
+	{
+		buffer.resize(CHUNK_SIZE * EPI_DATA_T);
+	}
+
+	if (WRAPPER == BASH)
+	{
+		printf("Estimating the covariance matrix in chunks of %zu voxels using clBLAS\n",CHUNK_SIZE);
+	}
+
+	double startTime, endTime;
+	startTime = GetTime();
+
+	cl_mem d_Chunk = AllocatePooledBuffer(NUMBER_OF_ICA_OBSERVATIONS * CHUNK_SIZE * sizeof(float), NULL);
+	cl_mem d_Covariance_Matrix = AllocatePooledBuffer(NUMBER_OF_ICA_OBSERVATIONS * NUMBER_OF_ICA_OBSERVATIONS * sizeof(float), NULL);
+
+	// Accumulate the covariance matrix, beta = 1 for all chunks except the first
+	float beta = 0.0f;
+	for (size_t firstIndex = 0; firstIndex < NUMBER_OF_INDICES; firstIndex += CHUNK_SIZE)
+	{
+		size_t voxels;
+		if (!GetICAVoxelChunk(chunk, voxels, buffer, firstIndex, std::min(CHUNK_SIZE,NUMBER_OF_INDICES - firstIndex)))
+		{
+			ReleasePooledBuffer(d_Chunk);
+			ReleasePooledBuffer(d_Covariance_Matrix);
+			NUMBER_OF_ICA_COMPONENTS = 0;
+			return Eigen::MatrixXf();
+		}
+
+		if (voxels == 0)
+		{
+			continue;
+		}
+
+		clEnqueueWriteBuffer(commandQueue, d_Chunk, CL_TRUE, 0, NUMBER_OF_ICA_OBSERVATIONS * voxels * sizeof(float), chunk.data(), 0, NULL, NULL);
+
+	 	error = clblasSgemm (clblasColumnMajor, clblasNoTrans, clblasTrans, NUMBER_OF_ICA_OBSERVATIONS, NUMBER_OF_ICA_OBSERVATIONS, voxels, 1.0f/(float)(NUMBER_OF_ICA_VARIABLES - 1), d_Chunk, 0, NUMBER_OF_ICA_OBSERVATIONS, d_Chunk, 0, NUMBER_OF_ICA_OBSERVATIONS, beta, d_Covariance_Matrix, 0, NUMBER_OF_ICA_OBSERVATIONS, 1, &commandQueue, 0, NULL, NULL);
+		clFinish(commandQueue);
+		beta = 1.0f;
+	}
+
+	Eigen::MatrixXf covarianceMatrix(NUMBER_OF_ICA_OBSERVATIONS,NUMBER_OF_ICA_OBSERVATIONS);
+	clEnqueueReadBuffer(commandQueue, d_Covariance_Matrix, CL_TRUE, 0, NUMBER_OF_ICA_OBSERVATIONS * NUMBER_OF_ICA_OBSERVATIONS * sizeof(float), covarianceMatrix.data(), 0, NULL, NULL);
+	ReleasePooledBuffer(d_Covariance_Matrix);
+
+	endTime = GetTime();
+	if ((WRAPPER == BASH) && VERBOS)
+	{
+		printf("It took %f seconds to calculate the covariance matrix using clBLAS\n",(float)(endTime - startTime));
+	}
+
+	Eigen::MatrixXf whiteningMatrix = GetPCAWhiteningMatrix(covarianceMatrix);
+
+	// Perform the actual whitening, one chunk at a time
+	if (WRAPPER == BASH)
+	{
+		printf("Applying dimensionality reduction and whitening\n");
+	}
+
+	startTime = GetTime();
+
+	cl_mem d_Whitening_Matrix = AllocatePooledBuffer(NUMBER_OF_ICA_COMPONENTS * NUMBER_OF_ICA_OBSERVATIONS * sizeof(float), NULL);
+	cl_mem d_Whitened_Data = AllocatePooledBuffer(NUMBER_OF_ICA_COMPONENTS * NUMBER_OF_ICA_VARIABLES * sizeof(float), NULL);
+	clEnqueueWriteBuffer(commandQueue, d_Whitening_Matrix, CL_TRUE, 0, NUMBER_OF_ICA_COMPONENTS * NUMBER_OF_ICA_OBSERVATIONS * sizeof(float), whiteningMatrix.data(), 0, NULL, NULL);
+
+	size_t firstVoxel = 0;
+	for (size_t firstIndex = 0; firstIndex < NUMBER_OF_INDICES; firstIndex += CHUNK_SIZE)
+	{
+		size_t voxels;
+		if (!GetICAVoxelChunk(chunk, voxels, buffer, firstIndex, std::min(CHUNK_SIZE,NUMBER_OF_INDICES - firstIndex)))
+		{
+			ReleasePooledBuffer(d_Chunk);
+			ReleasePooledBuffer(d_Whitening_Matrix);
+			ReleasePooledBuffer(d_Whitened_Data);
+			NUMBER_OF_ICA_COMPONENTS = 0;
+			return Eigen::MatrixXf();
+		}
+
+		if (voxels == 0)
+		{
+			continue;
+		}
+
+		clEnqueueWriteBuffer(commandQueue, d_Chunk, CL_TRUE, 0, NUMBER_OF_ICA_OBSERVATIONS * voxels * sizeof(float), chunk.data(), 0, NULL, NULL);
+
+		// Whitened data for the chunk starts at column firstVoxel
+	 	error = clblasSgemm (clblasColumnMajor, clblasNoTrans, clblasNoTrans, NUMBER_OF_ICA_COMPONENTS, voxels, NUMBER_OF_ICA_OBSERVATIONS, 1.0f, d_Whitening_Matrix, 0, NUMBER_OF_ICA_COMPONENTS, d_Chunk, 0, NUMBER_OF_ICA_OBSERVATIONS, 0.0f, d_Whitened_Data, firstVoxel * NUMBER_OF_ICA_COMPONENTS, NUMBER_OF_ICA_COMPONENTS, 1, &commandQueue, 0, NULL, NULL);
+		clFinish(commandQueue);
+		firstVoxel += voxels;
+	}
+
+	Eigen::MatrixXf whitenedData(NUMBER_OF_ICA_COMPONENTS,NUMBER_OF_ICA_VARIABLES);
+	clEnqueueReadBuffer(commandQueue, d_Whitened_Data, CL_TRUE, 0, NUMBER_OF_ICA_COMPONENTS * NUMBER_OF_ICA_VARIABLES * sizeof(float), whitenedData.data(), 0, NULL, NULL);
+
+	ReleasePooledBuffer(d_Chunk);
+	ReleasePooledBuffer(d_Whitening_Matrix);
+	ReleasePooledBuffer(d_Whitened_Data);
+
+	endTime = GetTime();
+	if ((WRAPPER == BASH) && VERBOS)
+	{
+		printf("It took %f seconds to perform the whitening using clBLAS\n",(float)(endTime - startTime));
+	}
+
+	return whitenedData;
+}
+#elif __APPLE__
+Eigen::MatrixXf BROCCOLI_LIB::PCAWhitenStreaming()
 {	
+	return PCAWhitenStreamingEigen();
 }
 #endif
 
@@ -19668,7 +23445,7 @@ int BROCCOLI_LIB::UpdateInfomaxWeights(cl_mem d_Weights, cl_mem d_Whitened_Data,
 		}
 
 	    // Check if blows up
-	    double max = CalculateMaxAtomic(d_Weights, NUMBER_OF_ICA_COMPONENTS * NUMBER_OF_ICA_COMPONENTS);
+	    double max = CalculateMax(d_Weights, NUMBER_OF_ICA_COMPONENTS * NUMBER_OF_ICA_COMPONENTS);
 
 		if (max > MAX_W)
 	    {
@@ -19818,7 +23595,7 @@ int BROCCOLI_LIB::UpdateInfomaxWeightsDouble(cl_mem d_Weights, cl_mem d_Whitened
 		}
 
 	    // Check if blows up
-	    double max = CalculateMaxAtomic(d_Weights, NUMBER_OF_ICA_COMPONENTS * NUMBER_OF_ICA_COMPONENTS);
+	    double max = CalculateMax(d_Weights, NUMBER_OF_ICA_COMPONENTS * NUMBER_OF_ICA_COMPONENTS);
 
 		if (max > MAX_W)
 	    {
@@ -20471,6 +24248,180 @@ void BROCCOLI_LIB::InfomaxICAEigen(Eigen::MatrixXf & whitenedData, Eigen::Matrix
 }
 
 
+// Symmetric decorrelation for FastICA, weights = (weights * weights')^(-1/2) * weights
+void BROCCOLI_LIB::SymmetricDecorrelation(Eigen::MatrixXf & weights)
+{
+	Eigen::MatrixXf product = weights * weights.transpose();
+	Eigen::SelfAdjointEigenSolver<Eigen::MatrixXf> es(product);
+	Eigen::VectorXf scaledEigenValues = es.eigenvalues().array().sqrt().inverse();
+	weights = es.eigenvectors() * scaledEigenValues.asDiagonal() * es.eigenvectors().transpose() * weights;
+}
+
+// Applies one Newton step to the FastICA weights, given g(weights * whitenedData) multiplied with whitenedData' and the mean of g',
+// returns the largest change of direction for any component
+float BROCCOLI_LIB::UpdateFastICAWeights(Eigen::MatrixXf & weights, Eigen::MatrixXf & newWeights, Eigen::VectorXf & derivativeMeans)
+{
+	// weights = E{x g(w'x)} - E{g'(w'x)} w
+	newWeights -= derivativeMeans.asDiagonal() * weights;
+	SymmetricDecorrelation(newWeights);
+
+	// Converged when each new weight vector points in the same direction as the old one
+	Eigen::VectorXf similarity = (newWeights * weights.transpose()).diagonal().cwiseAbs();
+	float change = (1.0f - similarity.array()).abs().maxCoeff();
+
+	weights = newWeights;
+
+	return change;
+}
+
+// Computes symmetric FastICA in whitened data, with a logcosh or exp nonlinearity (Hyvarinen 1999)
+// Converges in far fewer passes over the data than Infomax
+void BROCCOLI_LIB::FastICAEigen(Eigen::MatrixXf & whitenedData, Eigen::MatrixXf & weights, Eigen::MatrixXf & sourceMatrix)
+{
+	size_t NUMBER_OF_VOXELS = whitenedData.cols();
+
+	Eigen::MatrixXf unmixed(NUMBER_OF_ICA_COMPONENTS,NUMBER_OF_VOXELS);
+	Eigen::MatrixXf derivative(NUMBER_OF_ICA_COMPONENTS,NUMBER_OF_VOXELS);
+	Eigen::MatrixXf newWeights(NUMBER_OF_ICA_COMPONENTS,NUMBER_OF_ICA_COMPONENTS);
+	Eigen::VectorXf derivativeMeans(NUMBER_OF_ICA_COMPONENTS);
+
+	weights = Eigen::MatrixXf::Random(NUMBER_OF_ICA_COMPONENTS,NUMBER_OF_ICA_COMPONENTS);
+	SymmetricDecorrelation(weights);
+
+	float change = 1.0f;
+	size_t iteration = 0;
+
+	while ( (iteration < FASTICA_MAX_ITERATIONS) && (change > FASTICA_TOLERANCE) )
+	{
+		double start = GetTime();
+
+		unmixed.noalias() = weights * whitenedData;
+
+		#pragma omp parallel for
+		for (size_t voxel = 0; voxel < NUMBER_OF_VOXELS; voxel++)
+		{
+			for (size_t component = 0; component < NUMBER_OF_ICA_COMPONENTS; component++)
+			{
+				float value = unmixed(component,voxel);
+				if (FASTICA_NONLINEARITY == FASTICA_LOGCOSH)
+				{
+					float t = tanh(value);
+					unmixed(component,voxel) = t;
+					derivative(component,voxel) = 1.0f - t * t;
+				}
+				else
+				{
+					float e = exp(-0.5f * value * value);
+					unmixed(component,voxel) = value * e;
+					derivative(component,voxel) = (1.0f - value * value) * e;
+				}
+			}
+		}
+
+		newWeights.noalias() = unmixed * whitenedData.transpose() / (float)NUMBER_OF_VOXELS;
+		derivativeMeans = derivative.rowwise().mean();
+
+		change = UpdateFastICAWeights(weights, newWeights, derivativeMeans);
+		iteration++;
+
+		double end = GetTime();
+
+		if (VERBOS)
+		{
+			printf("FastICA iteration %zu: change %.1e, took %f seconds \n",iteration,change,(float)(end-start));
+		}
+	}
+
+	if ((WRAPPER == BASH) && (change > FASTICA_TOLERANCE))
+	{
+		printf("FastICA did not converge in %i iterations\n",FASTICA_MAX_ITERATIONS);
+	}
+
+	sourceMatrix = weights * whitenedData;	
+}
+
+#ifdef __linux
+void BROCCOLI_LIB::FastICA(Eigen::MatrixXf & whitenedData, Eigen::MatrixXf & weights, Eigen::MatrixXf & sourceMatrix)
+{
+	cl_mem d_Whitened_Data = AllocatePooledBuffer(NUMBER_OF_ICA_COMPONENTS * NUMBER_OF_ICA_VARIABLES * sizeof(float), NULL);
+	cl_mem d_Unmixed = AllocatePooledBuffer(NUMBER_OF_ICA_COMPONENTS * NUMBER_OF_ICA_VARIABLES * sizeof(float), NULL);
+	cl_mem d_Derivative = AllocatePooledBuffer(NUMBER_OF_ICA_COMPONENTS * NUMBER_OF_ICA_VARIABLES * sizeof(float), NULL);
+	cl_mem d_Ones = AllocatePooledBuffer(NUMBER_OF_ICA_VARIABLES * sizeof(float), NULL);
+	cl_mem d_Weights = AllocatePooledBuffer(NUMBER_OF_ICA_COMPONENTS * NUMBER_OF_ICA_COMPONENTS * sizeof(float), NULL);
+	cl_mem d_New_Weights = AllocatePooledBuffer(NUMBER_OF_ICA_COMPONENTS * NUMBER_OF_ICA_COMPONENTS * sizeof(float), NULL);
+	cl_mem d_Derivative_Means = AllocatePooledBuffer(NUMBER_OF_ICA_COMPONENTS * sizeof(float), NULL);
+
+	// Copy data to device
+	clEnqueueWriteBuffer(commandQueue, d_Whitened_Data, CL_TRUE, 0, NUMBER_OF_ICA_COMPONENTS * NUMBER_OF_ICA_VARIABLES * sizeof(float), whitenedData.data(), 0, NULL, NULL);
+	SetMemory(d_Ones, 1.0f, NUMBER_OF_ICA_VARIABLES);
+
+	Eigen::MatrixXf newWeights(NUMBER_OF_ICA_COMPONENTS,NUMBER_OF_ICA_COMPONENTS);
+	Eigen::VectorXf derivativeMeans(NUMBER_OF_ICA_COMPONENTS);
+
+	weights = Eigen::MatrixXf::Random(NUMBER_OF_ICA_COMPONENTS,NUMBER_OF_ICA_COMPONENTS);
+	SymmetricDecorrelation(weights);
+
+	float change = 1.0f;
+	size_t iteration = 0;
+
+	while ( (iteration < FASTICA_MAX_ITERATIONS) && (change > FASTICA_TOLERANCE) )
+	{
+		double start = GetTime();
+
+		clEnqueueWriteBuffer(commandQueue, d_Weights, CL_TRUE, 0, NUMBER_OF_ICA_COMPONENTS * NUMBER_OF_ICA_COMPONENTS * sizeof(float), weights.data(), 0, NULL, NULL);
+
+		// Unmixed = weights * whitened data
+		// C = alpha * A * B  + beta * C                         
+		error = clblasSgemm (clblasColumnMajor, clblasNoTrans, clblasNoTrans, NUMBER_OF_ICA_COMPONENTS, NUMBER_OF_ICA_VARIABLES, NUMBER_OF_ICA_COMPONENTS, 1.0f, d_Weights, 0, NUMBER_OF_ICA_COMPONENTS, d_Whitened_Data, 0, NUMBER_OF_ICA_COMPONENTS, 0.0f, d_Unmixed, 0, NUMBER_OF_ICA_COMPONENTS, 1, &commandQueue, 0, NULL, NULL);
+
+		FastICANonlinearity(d_Unmixed, d_Derivative, NUMBER_OF_ICA_COMPONENTS * NUMBER_OF_ICA_VARIABLES);
+
+		// New weights = g(unmixed) * whitened data' / number of voxels
+		error = clblasSgemm (clblasColumnMajor, clblasNoTrans, clblasTrans, NUMBER_OF_ICA_COMPONENTS, NUMBER_OF_ICA_COMPONENTS, NUMBER_OF_ICA_VARIABLES, 1.0f/(float)NUMBER_OF_ICA_VARIABLES, d_Unmixed, 0, NUMBER_OF_ICA_COMPONENTS, d_Whitened_Data, 0, NUMBER_OF_ICA_COMPONENTS, 0.0f, d_New_Weights, 0, NUMBER_OF_ICA_COMPONENTS, 1, &commandQueue, 0, NULL, NULL);
+
+		// Mean of g' for each component
+		// y = alpha * A * x  + beta * y
+		error = clblasSgemv(clblasColumnMajor, clblasNoTrans, NUMBER_OF_ICA_COMPONENTS, NUMBER_OF_ICA_VARIABLES, 1.0f/(float)NUMBER_OF_ICA_VARIABLES, d_Derivative, 0, NUMBER_OF_ICA_COMPONENTS, d_Ones, 0, 1, 0.0f, d_Derivative_Means, 0, 1, 1, &commandQueue, 0, NULL, NULL);
+		clFinish(commandQueue);
+
+		// The Newton step and the decorrelation only involve small matrices, do them on the host
+		clEnqueueReadBuffer(commandQueue, d_New_Weights, CL_TRUE, 0, NUMBER_OF_ICA_COMPONENTS * NUMBER_OF_ICA_COMPONENTS * sizeof(float), newWeights.data(), 0, NULL, NULL);
+		clEnqueueReadBuffer(commandQueue, d_Derivative_Means, CL_TRUE, 0, NUMBER_OF_ICA_COMPONENTS * sizeof(float), derivativeMeans.data(), 0, NULL, NULL);
+
+		change = UpdateFastICAWeights(weights, newWeights, derivativeMeans);
+		iteration++;
+
+		double end = GetTime();
+
+		if (VERBOS)
+		{
+			printf("FastICA iteration %zu: change %.1e, took %f seconds \n",iteration,change,(float)(end-start));
+		}
+	}
+
+	if ((WRAPPER == BASH) && (change > FASTICA_TOLERANCE))
+	{
+		printf("FastICA did not converge in %i iterations\n",FASTICA_MAX_ITERATIONS);
+	}
+
+	sourceMatrix = weights * whitenedData;	
+
+	ReleasePooledBuffer(d_Whitened_Data);
+	ReleasePooledBuffer(d_Unmixed);
+	ReleasePooledBuffer(d_Derivative);
+	ReleasePooledBuffer(d_Ones);
+	ReleasePooledBuffer(d_Weights);
+	ReleasePooledBuffer(d_New_Weights);
+	ReleasePooledBuffer(d_Derivative_Means);
+}
+#elif __APPLE__
+void BROCCOLI_LIB::FastICA(Eigen::MatrixXf & whitenedData, Eigen::MatrixXf & weights, Eigen::MatrixXf & sourceMatrix)
+{
+	FastICAEigen(whitenedData, weights, sourceMatrix);
+}
+#endif
+
+
 
 
 void BROCCOLI_LIB::PerformICACPUWrapper()
@@ -20504,72 +24455,93 @@ void BROCCOLI_LIB::PerformICACPUWrapper()
 
 	NUMBER_OF_ICA_OBSERVATIONS = EPI_DATA_T;
 
-	Eigen::MatrixXf inputData(NUMBER_OF_ICA_OBSERVATIONS,NUMBER_OF_ICA_VARIABLES);
-
 	if (WRAPPER == BASH)
 	{
 		printf("Original number of voxels is %zu, reduced to %zu voxels using a mask\n",EPI_DATA_W*EPI_DATA_H*EPI_DATA_D,NUMBER_OF_ICA_VARIABLES);
 	}
 
-	// Put data into Eigen object
+	// First whiten the data and reduce the number of dimensions
+	Eigen::MatrixXf whitenedData;
 	int v = 0;
-	for (int z = 0; z < EPI_DATA_D; z++)
+	if (ICA_STREAMING)
 	{
-		for (int y = 0; y < EPI_DATA_H; y++)
+		// Read the data in chunks of voxels, without a copy of all the data
+		whitenedData = PCAWhitenStreamingEigen();
+		if (whitenedData.size() == 0)
 		{
-			for (int x = 0; x < EPI_DATA_W; x++)
+			clReleaseMemObject(d_EPI_Mask);
+			return;
+		}
+	}
+	else
+	{
+		Eigen::MatrixXf inputData(NUMBER_OF_ICA_OBSERVATIONS,NUMBER_OF_ICA_VARIABLES);
+
+		// Put data into Eigen object
+		for (int z = 0; z < EPI_DATA_D; z++)
+		{
+			for (int y = 0; y < EPI_DATA_H; y++)
 			{
-				if (h_EPI_Mask[x + y * EPI_DATA_W + z * EPI_DATA_W * EPI_DATA_H] == 1.0f)
+				for (int x = 0; x < EPI_DATA_W; x++)
 				{
-					if (Z_SCORE)
+					if (h_EPI_Mask[x + y * EPI_DATA_W + z * EPI_DATA_W * EPI_DATA_H] == 1.0f)
 					{
-						// z-score each time series
-
-						// Estimate mean
-						float sum = 0.0f;
-						for (int t = 0; t < EPI_DATA_T; t++)
+						if (Z_SCORE)
 						{
-							sum += h_fMRI_Volumes[x + y * EPI_DATA_W + z * EPI_DATA_W * EPI_DATA_H + t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D];
-						}
-						float mean = sum/(float)EPI_DATA_T;
+							// z-score each time series
 
-						// Remove mean
-						for (int t = 0; t < EPI_DATA_T; t++)
-						{
-							h_fMRI_Volumes[x + y * EPI_DATA_W + z * EPI_DATA_W * EPI_DATA_H + t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D] -= mean;
-						}				
+							// Estimate mean
+							float sum = 0.0f;
+							for (int t = 0; t < EPI_DATA_T; t++)
+							{
+								sum += h_fMRI_Volumes[x + y * EPI_DATA_W + z * EPI_DATA_W * EPI_DATA_H + t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D];
+							}
+							float mean = sum/(float)EPI_DATA_T;
 
-						// Estimate variance					
-						sum = 0.0f;
-						for (int t = 0; t < EPI_DATA_T; t++)
-						{
-							float value = h_fMRI_Volumes[x + y * EPI_DATA_W + z * EPI_DATA_W * EPI_DATA_H + t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D];
-							sum += value * value;
-						}
-						float variance = sum/(float)(EPI_DATA_T-1);
-						float std = sqrt(variance);
+							// Remove mean
+							for (int t = 0; t < EPI_DATA_T; t++)
+							{
+								h_fMRI_Volumes[x + y * EPI_DATA_W + z * EPI_DATA_W * EPI_DATA_H + t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D] -= mean;
+							}				
 
-						// Divide by standard deviation
+							// Estimate variance					
+							sum = 0.0f;
+							for (int t = 0; t < EPI_DATA_T; t++)
+							{
+								float value = h_fMRI_Volumes[x + y * EPI_DATA_W + z * EPI_DATA_W * EPI_DATA_H + t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D];
+								sum += value * value;
+							}
+							float variance = sum/(float)(EPI_DATA_T-1);
+							float std = sqrt(variance);
+
+							// Divide by standard deviation
+							for (int t = 0; t < EPI_DATA_T; t++)
+							{
+								h_fMRI_Volumes[x + y * EPI_DATA_W + z * EPI_DATA_W * EPI_DATA_H + t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D] /= std;
+							}
+						}
+	
 						for (int t = 0; t < EPI_DATA_T; t++)
 						{
-							h_fMRI_Volumes[x + y * EPI_DATA_W + z * EPI_DATA_W * EPI_DATA_H + t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D] /= std;
+							inputData(t,v) = h_fMRI_Volumes[x + y * EPI_DATA_W + z * EPI_DATA_W * EPI_DATA_H + t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D];
 						}
-					}
-	
-					for (int t = 0; t < EPI_DATA_T; t++)
-					{
-						inputData(t,v) = h_fMRI_Volumes[x + y * EPI_DATA_W + z * EPI_DATA_W * EPI_DATA_H + t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D];
-					}
 					
-					v++;
-				}				
+						v++;
+					}				
+				}
 			}
 		}
-	}
 
 
-	// First whiten the data and reduce the number of dimensions
-	Eigen::MatrixXf whitenedData = PCAWhitenEigen(inputData, true);
+		if (PCA_METHOD == PCA_RANDOMIZED)
+		{
+			whitenedData = PCAWhitenRandomizedEigen(inputData, true);
+		}
+		else
+		{
+			whitenedData = PCAWhitenEigen(inputData, true);
+		}
+	}
 	
 	//Eigen::MatrixXd whitenedData(NUMBER_OF_ICA_COMPONENTS,NUMBER_OF_ICA_VARIABLES);
 	//PCAWhitenEigen(whitenedData,  inputData, NUMBER_OF_ICA_COMPONENTS, true);
@@ -20579,10 +24551,25 @@ void BROCCOLI_LIB::PerformICACPUWrapper()
 	Eigen::MatrixXf sourceMatrix(NUMBER_OF_ICA_COMPONENTS,NUMBER_OF_ICA_VARIABLES);
 
 	// Run the actual ICA algorithm
-	InfomaxICAEigen(whitenedData, weights, sourceMatrix);
+	if (ICA_ALGORITHM == ICA_FASTICA)
+	{
+		FastICAEigen(whitenedData, weights, sourceMatrix);
+	}
+	else
+	{
+		InfomaxICAEigen(whitenedData, weights, sourceMatrix);
+	}
 
 	//Eigen::MatrixXd inverseWeights = weights.inverse();
 
+	// With a voxel reader the fMRI volumes only hold the first volume, keep the components for GetICAComponents
+	if (ICA_STREAMING && (ICA_VOXEL_READER != NULL))
+	{
+		icaSourceMatrix.swap(sourceMatrix);
+		clReleaseMemObject(d_EPI_Mask);
+		return;
+	}
+
 	// Put components back into fMRI volumes
 	v = 0;
 	for (int z = 0; z < EPI_DATA_D; z++)
@@ -20710,7 +24697,15 @@ void BROCCOLI_LIB::PerformICADoubleCPUWrapper()
 
 
 	// First whiten the data and reduce the number of dimensions
-	Eigen::MatrixXf whitenedData = PCAWhitenEigen(inputData, true);
+	Eigen::MatrixXf whitenedData;
+	if (PCA_METHOD == PCA_RANDOMIZED)
+	{
+		whitenedData = PCAWhitenRandomizedEigen(inputData, true);
+	}
+	else
+	{
+		whitenedData = PCAWhitenEigen(inputData, true);
+	}
 	
 	Eigen::MatrixXd weightsDouble(NUMBER_OF_ICA_COMPONENTS,NUMBER_OF_ICA_COMPONENTS);
 	Eigen::MatrixXd sourceMatrixDouble(NUMBER_OF_ICA_COMPONENTS,NUMBER_OF_ICA_VARIABLES);
@@ -20796,74 +24791,98 @@ void BROCCOLI_LIB::PerformICAWrapper()
 
 	NUMBER_OF_ICA_OBSERVATIONS = EPI_DATA_T;
 
-	Eigen::MatrixXf inputData(NUMBER_OF_ICA_OBSERVATIONS,NUMBER_OF_ICA_VARIABLES);
-
 	if (WRAPPER == BASH)
 	{
 		printf("Original number of voxels is %zu, reduced to %zu voxels using a mask\n",EPI_DATA_W*EPI_DATA_H*EPI_DATA_D,NUMBER_OF_ICA_VARIABLES);
 	}
 
-	// Put data into Eigen object
+	// First whiten the data and reduce the number of dimensions
+	Eigen::MatrixXf whitenedData;
 	int v = 0;
-	for (int z = 0; z < EPI_DATA_D; z++)
+	if (ICA_STREAMING)
 	{
-		for (int y = 0; y < EPI_DATA_H; y++)
+		// Read the data in chunks of voxels, without a copy of all the data
+		whitenedData = PCAWhitenStreaming();
+		if (whitenedData.size() == 0)
 		{
-			for (int x = 0; x < EPI_DATA_W; x++)
+			clReleaseMemObject(d_EPI_Mask);
+			#ifdef __linux
+			clblasTeardown();
+			#endif
+			return;
+		}
+	}
+	else
+	{
+		Eigen::MatrixXf inputData(NUMBER_OF_ICA_OBSERVATIONS,NUMBER_OF_ICA_VARIABLES);
+
+		// Put data into Eigen object
+		for (int z = 0; z < EPI_DATA_D; z++)
+		{
+			for (int y = 0; y < EPI_DATA_H; y++)
 			{
-				if (h_EPI_Mask[x + y * EPI_DATA_W + z * EPI_DATA_W * EPI_DATA_H] == 1.0f)
+				for (int x = 0; x < EPI_DATA_W; x++)
 				{
-					// z-score each time series
-					if (Z_SCORE)
+					if (h_EPI_Mask[x + y * EPI_DATA_W + z * EPI_DATA_W * EPI_DATA_H] == 1.0f)
 					{
-
-						// Estimate mean
-						float sum = 0.0f;
-						for (int t = 0; t < EPI_DATA_T; t++)
+						// z-score each time series
+						if (Z_SCORE)
 						{
-							sum += h_fMRI_Volumes[x + y * EPI_DATA_W + z * EPI_DATA_W * EPI_DATA_H + t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D];
-						}
-						float mean = sum/(float)EPI_DATA_T;
+
+							// Estimate mean
+							float sum = 0.0f;
+							for (int t = 0; t < EPI_DATA_T; t++)
+							{
+								sum += h_fMRI_Volumes[x + y * EPI_DATA_W + z * EPI_DATA_W * EPI_DATA_H + t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D];
+							}
+							float mean = sum/(float)EPI_DATA_T;
 	
-						// Remove mean
-						for (int t = 0; t < EPI_DATA_T; t++)
-						{
-							h_fMRI_Volumes[x + y * EPI_DATA_W + z * EPI_DATA_W * EPI_DATA_H + t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D] -= mean;
-						}				
+							// Remove mean
+							for (int t = 0; t < EPI_DATA_T; t++)
+							{
+								h_fMRI_Volumes[x + y * EPI_DATA_W + z * EPI_DATA_W * EPI_DATA_H + t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D] -= mean;
+							}				
 
-						// Estimate variance					
-						sum = 0.0f;
-						for (int t = 0; t < EPI_DATA_T; t++)
-						{
-							float value = h_fMRI_Volumes[x + y * EPI_DATA_W + z * EPI_DATA_W * EPI_DATA_H + t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D];
-							sum += value * value;
+							// Estimate variance					
+							sum = 0.0f;
+							for (int t = 0; t < EPI_DATA_T; t++)
+							{
+								float value = h_fMRI_Volumes[x + y * EPI_DATA_W + z * EPI_DATA_W * EPI_DATA_H + t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D];
+								sum += value * value;
+							}
+							float variance = sum/(float)(EPI_DATA_T-1);
+							float std = sqrt(variance);
+
+							// Divide by standard deviation
+							for (int t = 0; t < EPI_DATA_T; t++)
+							{
+								h_fMRI_Volumes[x + y * EPI_DATA_W + z * EPI_DATA_W * EPI_DATA_H + t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D] /= std;
+							}	
 						}
-						float variance = sum/(float)(EPI_DATA_T-1);
-						float std = sqrt(variance);
 
-						// Divide by standard deviation
 						for (int t = 0; t < EPI_DATA_T; t++)
 						{
-							h_fMRI_Volumes[x + y * EPI_DATA_W + z * EPI_DATA_W * EPI_DATA_H + t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D] /= std;
-						}	
-					}
-
-					for (int t = 0; t < EPI_DATA_T; t++)
-					{
-						inputData(t,v) = h_fMRI_Volumes[x + y * EPI_DATA_W + z * EPI_DATA_W * EPI_DATA_H + t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D];
-					}
+							inputData(t,v) = h_fMRI_Volumes[x + y * EPI_DATA_W + z * EPI_DATA_W * EPI_DATA_H + t * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D];
+						}
 
-					v++;
-				}				
+						v++;
+					}				
+				}
 			}
 		}
-	}
 
-	//Eigen::MatrixXd whitenedData(NUMBER_OF_ICA_COMPONENTS,NUMBER_OF_VOXELS);
+		//Eigen::MatrixXd whitenedData(NUMBER_OF_ICA_COMPONENTS,NUMBER_OF_VOXELS);
 
 
-	// First whiten the data and reduce the number of dimensions
-	Eigen::MatrixXf whitenedData = PCAWhiten(inputData, true);
+		if (PCA_METHOD == PCA_RANDOMIZED)
+		{
+			whitenedData = PCAWhitenRandomized(inputData, true);
+		}
+		else
+		{
+			whitenedData = PCAWhiten(inputData, true);
+		}
+	}
 	//PCAWhiten(whitenedData,  inputData, NUMBER_OF_ICA_COMPONENTS, true);
 	//PCADimensionalityReduction(whitenedData,  inputData, NUMBER_OF_ICA_COMPONENTS, true);
 
@@ -20871,10 +24890,28 @@ void BROCCOLI_LIB::PerformICAWrapper()
 	Eigen::MatrixXf sourceMatrix(NUMBER_OF_ICA_COMPONENTS,NUMBER_OF_ICA_VARIABLES);
 
 	// Run the actual ICA algorithm
-	InfomaxICA(whitenedData, weights, sourceMatrix);
+	if (ICA_ALGORITHM == ICA_FASTICA)
+	{
+		FastICA(whitenedData, weights, sourceMatrix);
+	}
+	else
+	{
+		InfomaxICA(whitenedData, weights, sourceMatrix);
+	}
 
 	//Eigen::MatrixXd inverseWeights = weights.inverse();
 
+	// With a voxel reader the fMRI volumes only hold the first volume, keep the components for GetICAComponents
+	if (ICA_STREAMING && (ICA_VOXEL_READER != NULL))
+	{
+		icaSourceMatrix.swap(sourceMatrix);
+		clReleaseMemObject(d_EPI_Mask);
+		#ifdef __linux
+		clblasTeardown();
+		#endif
+		return;
+	}
+
 	// Put components back into fMRI volumes
 	v = 0;
 	for (int z = 0; z < EPI_DATA_D; z++)
@@ -21023,7 +25060,15 @@ void BROCCOLI_LIB::PerformICADoubleWrapper()
 
 
 	// First whiten the data and reduce the number of dimensions
-	Eigen::MatrixXf whitenedData = PCAWhiten(inputData, true);
+	Eigen::MatrixXf whitenedData;
+	if (PCA_METHOD == PCA_RANDOMIZED)
+	{
+		whitenedData = PCAWhitenRandomized(inputData, true);
+	}
+	else
+	{
+		whitenedData = PCAWhiten(inputData, true);
+	}
 	//PCAWhiten(whitenedData,  inputData, NUMBER_OF_ICA_COMPONENTS, true);
 	//PCADimensionalityReduction(whitenedData,  inputData, NUMBER_OF_ICA_COMPONENTS, true);
 
@@ -31,14 +31,46 @@
 #include <opencl.h>
 #include <string>
 #include <vector>
+#include <map>
 #include <Dense>
 
 typedef unsigned int uint;
 typedef unsigned char uchar;
 typedef unsigned short int uint16;
 
+// Reads the time series of the voxels firstVoxel ... firstVoxel + numberOfVoxels - 1 of each volume, time point t is stored
+// at data + t * numberOfVoxels, returns false if the data could not be read
+typedef bool (*VoxelReader)(float* data, size_t firstVoxel, size_t numberOfVoxels, void* userData);
+
 struct float2 {float x; float y;};
 
+// One profiled kernel launch or transfer, start and end are device times in ns
+struct ProfilingRecord
+{
+	int name;
+	int type;
+	size_t bytes;
+	cl_ulong start, end;
+};
+
+// One stage of a pipeline, times in seconds and memory in bytes, the device times are only measured with profiling
+struct PipelineStage
+{
+	std::string name;
+	double wallTime, deviceTime;
+	size_t dataBytes;
+	size_t deviceMemoryHighWater, hostMemoryHighWater, peakResidentMemory;
+	std::map<int, double> deviceTimes;
+};
+
+// Result of one kernel benchmark, the time is the mean over the repetitions in seconds, bytes and flops are estimated per repetition
+struct KernelBenchmark
+{
+	std::string name;
+	double time;
+	double bytes, flops;
+};
+
 // Enumerated constants for axes
 enum { X, Y, Z };
 
@@ -148,11 +180,19 @@ class BROCCOLI_LIB
 		void SetNumberOfContrasts(size_t NC);
 		void SetDesignMatrix(float* X_GLM, float* xtxxt_GLM);
         void SetCorrectClasses(float* C, float *D);
+		void SetSearchlightClassifier(int);
+		void SetNumberOfSearchlightFolds(int);
+		void SetSearchlightRegularization(float);
+		void SetSearchlightRadius(float);
+		void SetNumberOfSearchlightPermutations(int);
 		void SetContrasts(float* contrasts);
 		void SetGLMScalars(float* ctxtxc);
 		void SetNumberOfPermutations(size_t);
 		void SetNumberOfGroupPermutations(size_t*);
 		void SetNumberOfMCMCIterations(int);
+		void SetMCMCSinglePrecision(bool);
+		void SetNumberOfMCMCChains(int);
+		void SetMCMCTolerance(float);
 		void SetBetaSpace(int space);
 		void SetStatisticalTest(int test);
 		void SetGroupDesigns(int *designs);
@@ -168,6 +208,11 @@ class BROCCOLI_LIB
 		void SetCustomReferenceSlice(int);
 		void SetNumberOfICAComponents(int);
 		void SetVarianceToSaveBeforeICA(double);
+		void SetPCAMethod(int);
+		void SetICAStreaming(bool);
+		void SetICAVoxelReader(VoxelReader reader, void* userData);
+		void SetICAAlgorithm(int);
+		void SetFastICANonlinearity(int);
 		void SetZScore(bool);
 
 		// Smoothing
@@ -209,6 +254,7 @@ class BROCCOLI_LIB
 		// Slice timing
 		void SetCustomSliceTimes(float *times);
 		void SetApplySliceTimingCorrection(bool);
+		void SetFuseSliceTimingAndMotionCorrection(bool);
 
 		// EPI data
 		void SetEPIVoxelSizeX(float value);
@@ -321,6 +367,7 @@ class BROCCOLI_LIB
 		void SetOutputPermutedfMRIVolumes(float*);
 		void SetOutputPermutedFirstLevelResults(float*);
 		void SetOutputAREstimatesEPI(float*, float*, float*, float*);
+		void SetOutputMCMCDiagnosticsEPI(float*);
 		void SetOutputAREstimatesT1(float*, float*, float*, float*);
 		void SetOutputAREstimatesMNI(float*, float*, float*, float*);
 		void SetOutputSliceSums(float*);
@@ -381,6 +428,7 @@ class BROCCOLI_LIB
 		int GetNumberOfSignificantlyActiveClusters();
 
 		int GetNumberOfICAComponents();
+		void GetICAComponents(float* h_Components);
 
 		// OpenCL
 
@@ -415,6 +463,36 @@ class BROCCOLI_LIB
 		int GetProgramBinarySize();
 		int GetWrittenElements();
 
+		// Device buffer pool
+
+		void SetDeviceBufferPoolCacheLimit(size_t bytes);
+		size_t GetDeviceBufferPoolHighWaterMark();
+		size_t GetDeviceBufferPoolReservedHighWaterMark();
+		int GetDeviceBufferPoolRequests();
+		int GetDeviceBufferPoolHits();
+
+		// Template registration assets
+
+		void SetTemplateCacheDirectory(const char* directory);
+		void SetKeepTemplateOnDevice(bool keep);
+
+		// Registration results
+
+		void SetRegistrationCacheDirectory(const char* directory);
+
+		// Profiling of kernel launches and transfers
+
+		void SetProfiling(bool profiling);
+		void ResetProfiling();
+		void PrintProfilingSummary();
+		bool WriteProfilingTrace(const char* filename);
+
+		// Timeline of the processing stages
+
+		void SetPipelineTimeline(bool timeline);
+		void AddPipelineStage(const char* name, double wallTime, size_t dataBytes);
+		bool WritePipelineTimeline(const char* filename);
+
 		// Processing times
 
 		double GetProcessingTimeSliceTimingCorrection();
@@ -463,6 +541,7 @@ class BROCCOLI_LIB
 
 		void GetOpenCLInfo();
 		void GetBandwidth();
+		std::vector<KernelBenchmark> RunKernelBenchmarks(int DATA_W, int DATA_H, int DATA_D, int DATA_T, int warmup, int repetitions);
 
 		bool OpenCLInitiate(cl_uint OPENCL_PLATFORM, cl_uint OPENCL_DEVICE);
 
@@ -489,9 +568,13 @@ class BROCCOLI_LIB
 		void SegmentEPIData();
 		void SegmentEPIData(cl_mem Volume);
 		void PerformSliceTimingCorrection();
-		void PerformSliceTimingCorrectionHost(float* h_Volumes);
+		cl_int PerformSliceTimingCorrectionHost(float* h_Volumes);
+		bool AllocateSliceTimingCorrectionVolumes(size_t otherMemory);
+		void ReleaseSliceTimingCorrectionVolumes();
+		void CalculateSliceTimingDifferences(float* h_Differences);
 		void PerformMotionCorrection(cl_mem Volumes);
-		void PerformMotionCorrectionHost(float* h_Volumes);
+		void PerformMotionCorrectionHost(float* h_Volumes, float* h_Volume_Parameters);
+		void PerformSliceTimingAndMotionCorrectionHost(float* h_Volumes);
 
 		void PerformRegression(cl_mem, cl_mem, size_t, size_t, size_t, size_t);
 		void PerformRegressionSlice(cl_mem, cl_mem, size_t, size_t, size_t, size_t, size_t);
@@ -573,16 +656,27 @@ class BROCCOLI_LIB
 		void PCAWhitenEigen(Eigen::MatrixXd &, Eigen::MatrixXd &, int, bool);
 		Eigen::MatrixXd PCAWhitenEigen(Eigen::MatrixXd &, bool);
 		Eigen::MatrixXf PCAWhitenEigen(Eigen::MatrixXf &, bool);
+		Eigen::MatrixXf PCAWhitenRandomizedEigen(Eigen::MatrixXf &, bool);
+		int GetNumberOfPCAComponentsToSave(Eigen::VectorXf & eigenValues, float totalVariance, float & savedVariance);
+		Eigen::MatrixXf GetPCAWhiteningMatrix(Eigen::MatrixXf & covarianceMatrix);
+		bool GetICAVoxelChunk(Eigen::MatrixXf & chunk, size_t & numberOfVoxels, std::vector<float> & buffer, size_t firstIndex, size_t numberOfIndices);
+		Eigen::MatrixXf PCAWhitenStreamingEigen();
 		void PCADimensionalityReductionEigen(Eigen::MatrixXd &, Eigen::MatrixXd &, int, bool);
 		void InfomaxICAEigen(Eigen::MatrixXd & whitenedData, Eigen::MatrixXd & weights, Eigen::MatrixXd & sourceMatrix);
 		void InfomaxICAEigen(Eigen::MatrixXf & whitenedData, Eigen::MatrixXf & weights, Eigen::MatrixXf & sourceMatrix);
 		int UpdateInfomaxWeightsEigen(Eigen::MatrixXd & weights, Eigen::MatrixXd & whitenedData, Eigen::MatrixXd & bias, Eigen::MatrixXd & shuffledWhitenedData, double updateRate);
 		int UpdateInfomaxWeightsEigen(Eigen::MatrixXf & weights, Eigen::MatrixXf & whitenedData, Eigen::MatrixXf & bias, Eigen::MatrixXf & shuffledWhitenedData, double updateRate);
+		void FastICAEigen(Eigen::MatrixXf & whitenedData, Eigen::MatrixXf & weights, Eigen::MatrixXf & sourceMatrix);
+		void SymmetricDecorrelation(Eigen::MatrixXf & weights);
+		float UpdateFastICAWeights(Eigen::MatrixXf & weights, Eigen::MatrixXf & newWeights, Eigen::VectorXf & derivativeMeans);
 
 		void PCAWhiten(Eigen::MatrixXd &, Eigen::MatrixXd &, int, bool);
 		Eigen::MatrixXf PCAWhiten(Eigen::MatrixXf &, bool);
+		Eigen::MatrixXf PCAWhitenRandomized(Eigen::MatrixXf &, bool);
+		Eigen::MatrixXf PCAWhitenStreaming();
 		void InfomaxICA(Eigen::MatrixXf & whitenedData, Eigen::MatrixXf & weights, Eigen::MatrixXf & sourceMatrix);
 		void InfomaxICADouble(Eigen::MatrixXd & whitenedData, Eigen::MatrixXd & weights, Eigen::MatrixXd & sourceMatrix);
+		void FastICA(Eigen::MatrixXf & whitenedData, Eigen::MatrixXf & weights, Eigen::MatrixXf & sourceMatrix);
 		int UpdateInfomaxWeights(cl_mem d_Weights, cl_mem d_Whitened_Data, cl_mem d_Bias, cl_mem d_Permutation, cl_mem d_Shuffled_Whitened_Data, double updateRate);
 		int UpdateInfomaxWeightsDouble(cl_mem d_Weights, cl_mem d_Whitened_Data, cl_mem d_Bias, cl_mem d_Permutation, cl_mem d_Shuffled_Whitened_Data, double updateRate);
 
@@ -621,6 +715,7 @@ class BROCCOLI_LIB
 
 		void TransformVolumesLinear(cl_mem d_Volumes, float* h_Registration_Parameters, int DATA_W, int DATA_H, int DATA_D, int NUMBER_OF_VOLUMES, int INTERPOLATION_MODE);
 		void TransformVolumesNonLinear(cl_mem d_Volumes, cl_mem d_Displacement_Field_X, cl_mem d_Displacement_Field_Y, cl_mem d_Displacement_Field_Z, int DATA_W, int DATA_H, int DATA_D, int NUMBER_OF_VOLUMES, int INTERPOLATION_MODE);
+		void TransformVolumesEPIToMNI(cl_mem d_MNI_Volumes, cl_mem d_EPI_Volumes, int NUMBER_OF_VOLUMES, int offset, int INTERPOLATION_MODE);
 		void TransformFirstLevelResultsToMNI(bool WHITENED);
 		void TransformResidualsToMNI();
 		void TransformfMRIVolumesToMNI();
@@ -665,16 +760,19 @@ class BROCCOLI_LIB
 		void SubtractArraysDouble(cl_mem d_Array_1, cl_mem d_Array_2, size_t N);
 		void LogitMatrix(cl_mem d_Array, size_t N);
 		void LogitMatrixDouble(cl_mem d_Array, size_t N);
+		void FastICANonlinearity(cl_mem d_Array, cl_mem d_Derivative, size_t N);
 		void AddVolume(cl_mem d_Volume, float value, size_t DATA_W, size_t DATA_H, size_t DATA_D);
 		void AddVolumes(cl_mem d_Volume_1, cl_mem d_Volume_2, size_t DATA_W, size_t DATA_H, size_t DATA_D);
 		void AddVolumes(cl_mem d_Result, cl_mem d_Volume_1, cl_mem d_Volume_2, size_t DATA_W, size_t DATA_H, size_t DATA_D);
 		void SubtractVolumes(cl_mem d_Volume_1, cl_mem d_Volume_2, size_t DATA_W, size_t DATA_H, size_t DATA_D);
 		void SubtractVolumes(cl_mem d_Result, cl_mem d_Volume_1, cl_mem d_Volume_2, size_t DATA_W, size_t DATA_H, size_t DATA_D);
+		void ReduceVolumes(float* h_Results, int* h_Indices, cl_mem Volumes, cl_mem Mask, size_t N, size_t NUMBER_OF_VOLUMES, int OPERATION);
 		float CalculateSum(cl_mem Volume, size_t DATA_W, size_t DATA_H, size_t DATA_D);
 		float CalculateMax(cl_mem Volume, size_t DATA_W, size_t DATA_H, size_t DATA_D);
+		float CalculateMax(cl_mem Array, size_t N);
+		float CalculateMax(cl_mem Volume, cl_mem Mask, size_t DATA_W, size_t DATA_H, size_t DATA_D);
+		void CalculateSums(float* h_Sums, cl_mem Volumes, cl_mem Mask, size_t DATA_W, size_t DATA_H, size_t DATA_D, size_t NUMBER_OF_VOLUMES);
 
-		float CalculateMaxAtomic(cl_mem Array, size_t N);
-		float CalculateMaxAtomic(cl_mem Volume, cl_mem Mask, size_t DATA_W, size_t DATA_H, size_t DATA_D);
 		float CalculateMax(float *data, size_t N);
 		int   CalculateMax(int *data, size_t N);
 		float CalculateMin(float *data, size_t N);
@@ -715,6 +813,73 @@ class BROCCOLI_LIB
 
 		void PrintMemoryStatus(const char* text);
 
+		//------------------------------------------------
+		// Device buffer pool
+		//------------------------------------------------
+
+		int GetDeviceBufferPoolSizeClass(size_t size);
+		size_t GetDeviceBufferPoolClassSize(int sizeClass);
+		cl_mem AllocatePooledBuffer(size_t size, cl_int* error);
+		void ReleasePooledBuffer(cl_mem buffer);
+		cl_mem AllocatePooledImage3D(size_t DATA_W, size_t DATA_H, size_t DATA_D);
+		void ReleasePooledImage3D(cl_mem image);
+		void CopyVolumeToInterpolationVolume(cl_mem d_Interpolation_Volume, cl_mem d_Volumes, size_t offset, size_t DATA_W, size_t DATA_H, size_t DATA_D);
+		void SetLinearRegistrationInterpolationVolume(cl_mem d_Volumes, size_t t, int DATA_W, int DATA_H, int DATA_D);
+		void ReleaseCachedDeviceBuffers();
+		void ReleaseDeviceBufferPool();
+		void UpdateDeviceBufferPoolHighWaterMarks();
+
+		//------------------------------------------------
+		// Profiling
+		//------------------------------------------------
+
+		cl_int ProfiledEnqueueNDRangeKernel(cl_command_queue queue, cl_kernel kernel, cl_uint dimensions, const size_t* globalOffset, const size_t* globalSize, const size_t* localSize, cl_uint numberOfEvents, const cl_event* waitList, cl_event* event);
+		cl_int ProfiledEnqueueReadBuffer(cl_command_queue queue, cl_mem buffer, cl_bool blocking, size_t offset, size_t size, void* hostPointer, cl_uint numberOfEvents, const cl_event* waitList, cl_event* event);
+		cl_int ProfiledEnqueueWriteBuffer(cl_command_queue queue, cl_mem buffer, cl_bool blocking, size_t offset, size_t size, const void* hostPointer, cl_uint numberOfEvents, const cl_event* waitList, cl_event* event);
+		cl_int ProfiledEnqueueCopyBuffer(cl_command_queue queue, cl_mem source, cl_mem destination, size_t sourceOffset, size_t destinationOffset, size_t size, cl_uint numberOfEvents, const cl_event* waitList, cl_event* event);
+		cl_int ProfiledEnqueueCopyBufferToImage(cl_command_queue queue, cl_mem source, cl_mem destination, size_t sourceOffset, const size_t* origin, const size_t* region, cl_uint numberOfEvents, const cl_event* waitList, cl_event* event);
+		void* ProfiledEnqueueMapBuffer(cl_command_queue queue, cl_mem buffer, cl_bool blocking, cl_map_flags flags, size_t offset, size_t size, cl_uint numberOfEvents, const cl_event* waitList, cl_event* event, cl_int* error);
+		cl_int ProfiledSetKernelArg(cl_kernel kernel, cl_uint index, size_t size, const void* value);
+		cl_mem ProfiledCreateBuffer(cl_context context, cl_mem_flags flags, size_t size, void* hostPointer, cl_int* error);
+		cl_int ProfiledReleaseMemObject(cl_mem memory);
+		void AddProfilingEvent(cl_int error, cl_event profilingEvent, cl_event* event, int name, int type, size_t bytes);
+		int GetProfilingNameIndex(const std::string& name);
+		int GetProfilingKernelNameIndex(cl_kernel kernel);
+		size_t GetProfilingKernelBytes(cl_kernel kernel);
+		void CollectProfilingEvents();
+		void BeginPipelineStage(const char* name, size_t dataBytes);
+		void EndPipelineStage();
+		void UpdateMemoryHighWater();
+		size_t GetPeakResidentMemory();
+
+		//------------------------------------------------
+		// Template registration assets
+		//------------------------------------------------
+
+		unsigned long long HashData(const void* data, size_t bytes, unsigned long long hash);
+		unsigned long long HashRegistrationFilters(unsigned long long hash);
+		std::string GetTemplateAssetsFilename();
+		void BeginTemplateAssets(float* h_Template_Volume, int DATA_W, int DATA_H, int DATA_D, float VOXEL_SIZE_X, float VOXEL_SIZE_Y, float VOXEL_SIZE_Z);
+		void EndTemplateAssets();
+		bool ReadTemplateAssets();
+		bool WriteTemplateAssets();
+		std::string GetTemplateAssetName(const char* name, int index, int DATA_W, int DATA_H, int DATA_D);
+		bool GetTemplateAssets(const char* name, cl_mem* buffers, int numberOfBuffers, int DATA_W, int DATA_H, int DATA_D, int valuesPerVoxel);
+		void StoreTemplateAssets(const char* name, cl_mem* buffers, int numberOfBuffers, int DATA_W, int DATA_H, int DATA_D, int valuesPerVoxel);
+		void StoreTemplateDeviceAssets(const char* name, cl_mem* buffers, int numberOfBuffers, int DATA_W, int DATA_H, int DATA_D, int valuesPerVoxel);
+		void ReleaseTemplateDeviceAssets();
+		void WriteTemplateVolume(cl_mem d_Volume, float* h_Template_Volume, int DATA_W, int DATA_H, int DATA_D, float VOXEL_SIZE_X, float VOXEL_SIZE_Y, float VOXEL_SIZE_Z);
+		std::string GetTemporaryFilename(const std::string& filename);
+
+		//------------------------------------------------
+		// Registration results
+		//------------------------------------------------
+
+		void CalculateRegistrationResultsKeys();
+		std::string GetRegistrationResultsFilename(const char* name, unsigned long long key);
+		bool ReadRegistrationResults(const char* name, unsigned long long key, float** h_Results, size_t* numberOfValues, int numberOfResults);
+		bool WriteRegistrationResults(const char* name, unsigned long long key, float** h_Results, size_t* numberOfValues, int numberOfResults);
+
 		//------------------------------------------------
 		// Set functions
 		//------------------------------------------------
@@ -724,6 +889,10 @@ class BROCCOLI_LIB
 		void SetGlobalAndLocalWorkSizesImageRegistration(int DATA_W, int DATA_H, int DATA_D);
 		void SetGlobalAndLocalWorkSizesStatisticalCalculations(int DATA_W, int DATA_H, int DATA_D);
         void SetGlobalAndLocalWorkSizesSearchlight(int DATA_W, int DATA_H, int DATA_D);
+		int CreateSearchlightSphereOffsets(std::vector<cl_int>& offsets);
+		void CreateSearchlightFolds(std::vector<cl_int>& volumeIndices, std::vector<cl_int>& foldStarts, int folds, float* classes);
+		cl_int CalculateStatisticalMapSearchlightSphere(cl_mem d_Maps, cl_mem d_Volumes, cl_mem d_Mask, cl_mem c_Classes, cl_mem c_Volume_Indices, cl_mem c_Fold_Starts, std::vector<cl_int>& voxelIndices, int DATA_W, int DATA_H, int DATA_D, int uncensoredVolumes, int folds, float regularization);
+		void GeneratePermutationMatrixSearchlight(std::vector<cl_int>& permutedVolumeIndices, std::vector<cl_int>& volumeIndices, int numberOfPermutations);
 		void SetGlobalAndLocalWorkSizesInterpolateVolume(int DATA_W, int DATA_H, int DATA_D);
 		void SetGlobalAndLocalWorkSizesCopyVolumeToNew(int DATA_W, int DATA_H, int DATA_D);
 		void SetGlobalAndLocalWorkSizesMemset(int N);
@@ -731,6 +900,7 @@ class BROCCOLI_LIB
 		void SetGlobalAndLocalWorkSizesAddVolumes(int DATA_W, int DATA_H, int DATA_D);
 		void SetGlobalAndLocalWorkSizesCalculateSum(int DATA_W, int DATA_H, int DATA_D);
 		void SetGlobalAndLocalWorkSizesCalculateMax(int DATA_W, int DATA_H, int DATA_D);
+		void SetGlobalAndLocalWorkSizesReduceVolumes(size_t N, size_t NUMBER_OF_VOLUMES);
 		void SetGlobalAndLocalWorkSizesThresholdVolume(int DATA_W, int DATA_H, int DATA_D);
 		void SetGlobalAndLocalWorkSizesCalculateMagnitudes(int DATA_W, int DATA_H, int DATA_D);
 		void SetGlobalAndLocalWorkSizesClusterize(int DATA_W, int DATA_H, int DATA_D);
@@ -770,9 +940,13 @@ class BROCCOLI_LIB
 
 		cl_ulong localMemorySize;
 		size_t globalMemorySize;
+		cl_ulong maxMemoryAllocationSize;
 		size_t maxThreadsPerBlock;
 		size_t maxThreadsPerDimension[3];
 
+		// Interpolate from buffers instead of images, for CPU devices (where images are emulated) and devices without images
+		bool USE_BUFFER_INTERPOLATION;
+
 		std::string binaryPathAndFilename;
 		std::string binaryFilename;
 		std::string deviceInfo;
@@ -818,6 +992,7 @@ class BROCCOLI_LIB
 		cl_kernel CalculateColumnSumsKernel, CalculateRowSumsKernel;
 		cl_kernel CalculateColumnMaxsKernel, CalculateRowMaxsKernel;
 		cl_kernel CalculateMaxAtomicKernel;
+		cl_kernel ReduceVolumesKernel, ReduceVolumesFinalKernel, CalculateMassMomentsKernel;
 		cl_kernel ThresholdVolumeKernel;
 		cl_kernel RemoveMeanKernel;
 		cl_kernel SetStartClusterIndicesKernel;
@@ -832,12 +1007,13 @@ class BROCCOLI_LIB
 		cl_kernel PermuteMatrixKernel, PermuteMatrixDoubleKernel;
 		cl_kernel IdentityMatrixKernel, IdentityMatrixDoubleKernel;
 		cl_kernel LogitMatrixKernel, LogitMatrixDoubleKernel;
+		cl_kernel FastICANonlinearityKernel;
 
 		// Convolution kernels
 		cl_kernel SeparableConvolutionRowsKernel, SeparableConvolutionColumnsKernel, SeparableConvolutionRodsKernel;
 		cl_kernel NonseparableConvolution3DComplexThreeFiltersKernel;
 
-		cl_kernel SliceTimingCorrectionKernel;
+		cl_kernel SliceTimingCorrectionSlicesKernel, SliceTimingAndMotionCorrectionKernel;
 
 		// Image registration kernels
 		cl_kernel CalculatePhaseDifferencesAndCertaintiesKernel, CalculatePhaseGradientsXKernel, CalculatePhaseGradientsYKernel, CalculatePhaseGradientsZKernel;
@@ -845,6 +1021,7 @@ class BROCCOLI_LIB
 		cl_kernel CalculateAMatrix1DValuesKernel, CalculateHVector1DValuesKernel, CalculateHVectorKernel, ResetAMatrixKernel, CalculateAMatrixKernel;
 		cl_kernel InterpolateVolumeNearestLinearKernel, InterpolateVolumeLinearLinearKernel, InterpolateVolumeCubicLinearKernel;
 		cl_kernel InterpolateVolumeNearestNonLinearKernel, InterpolateVolumeLinearNonLinearKernel, InterpolateVolumeCubicNonLinearKernel;
+		cl_kernel InterpolateVolumeNearestComposedKernel, InterpolateVolumeLinearComposedKernel, InterpolateVolumeCubicComposedKernel;
 		cl_kernel RescaleVolumeNearestKernel, RescaleVolumeLinearKernel, RescaleVolumeCubicKernel;
 		cl_kernel CopyT1VolumeToMNIKernel, CopyEPIVolumeToT1Kernel, CopyVolumeToNewKernel;
 		cl_kernel CalculateMagnitudesKernel;
@@ -859,10 +1036,10 @@ class BROCCOLI_LIB
 		cl_kernel CalculateGLMResidualsKernel, CalculateGLMResidualsSliceKernel;
 		cl_kernel CalculateStatisticalMapsGLMTTestFirstLevelKernel, CalculateStatisticalMapsGLMFTestFirstLevelKernel;
 		cl_kernel CalculateStatisticalMapsGLMTTestFirstLevelSliceKernel, CalculateStatisticalMapsGLMFTestFirstLevelSliceKernel;
-		cl_kernel CalculateStatisticalMapsGLMTTestKernel, CalculateStatisticalMapsGLMFTestKernel, CalculateStatisticalMapsGLMBayesianKernel;
+		cl_kernel CalculateStatisticalMapsGLMTTestKernel, CalculateStatisticalMapsGLMFTestKernel, CalculateStatisticalMapsGLMBayesianKernel, CalculateStatisticalMapsGLMBayesianMultiChainKernel;
 		cl_kernel CalculateStatisticalMapsGLMTTestFirstLevelPermutationKernel,CalculateStatisticalMapsGLMFTestFirstLevelPermutationKernel;
 		cl_kernel CalculateStatisticalMapsMeanSecondLevelPermutationKernel, CalculateStatisticalMapsGLMTTestSecondLevelPermutationKernel,CalculateStatisticalMapsGLMFTestSecondLevelPermutationKernel;
-		cl_kernel CalculateStatisticalMapSearchlightKernel;
+		cl_kernel CalculateStatisticalMapSearchlightKernel, CalculateStatisticalMapSearchlightClosedFormKernel, CalculateStatisticalMapSearchlightSphereKernel, CalculateStatisticalMapsSearchlightRidgePermutationKernel;
         cl_kernel RemoveLinearFitKernel, RemoveLinearFitSliceKernel;
 		cl_kernel EstimateAR4ModelsKernel, EstimateAR4ModelsSliceKernel, ApplyWhiteningAR4Kernel, ApplyWhiteningAR4SliceKernel, GeneratePermutedVolumesFirstLevelKernel;
 		cl_kernel CalculatePermutationPValuesVoxelLevelInferenceKernel, CalculatePermutationPValuesClusterExtentInferenceKernel, CalculatePermutationPValuesClusterMassInferenceKernel;
@@ -907,9 +1084,11 @@ class BROCCOLI_LIB
 		cl_int createKernelErrorCalculateColumnMaxs;
 		cl_int createKernelErrorCalculateRowMaxs;
 		cl_int createKernelErrorCalculateMaxAtomic;
+		cl_int createKernelErrorReduceVolumes, createKernelErrorReduceVolumesFinal, createKernelErrorCalculateMassMoments;
 		cl_int createKernelErrorThresholdVolume;
+		cl_int createKernelErrorFastICANonlinearity;
 
-		cl_int createKernelErrorSliceTimingCorrection;
+		cl_int createKernelErrorSliceTimingCorrectionSlices, createKernelErrorSliceTimingAndMotionCorrection;
 
 		// Image registration kernels
 		cl_int createKernelErrorCalculatePhaseDifferencesAndCertainties, createKernelErrorCalculatePhaseGradientsX, createKernelErrorCalculatePhaseGradientsY, createKernelErrorCalculatePhaseGradientsZ;
@@ -918,6 +1097,7 @@ class BROCCOLI_LIB
 		cl_int createKernelErrorCalculateAMatrix, createKernelErrorCalculateHVector;
 		cl_int createKernelErrorInterpolateVolumeNearestLinear, createKernelErrorInterpolateVolumeLinearLinear,  createKernelErrorInterpolateVolumeCubicLinear;
 		cl_int createKernelErrorInterpolateVolumeNearestNonLinear, createKernelErrorInterpolateVolumeLinearNonLinear,  createKernelErrorInterpolateVolumeCubicNonLinear;
+		cl_int createKernelErrorInterpolateVolumeNearestComposed, createKernelErrorInterpolateVolumeLinearComposed,  createKernelErrorInterpolateVolumeCubicComposed;
 		cl_int createKernelErrorRescaleVolumeNearest, createKernelErrorRescaleVolumeLinear, createKernelErrorRescaleVolumeCubic;
 		cl_int createKernelErrorCopyT1VolumeToMNI, createKernelErrorCopyEPIVolumeToT1, createKernelErrorCopyVolumeToNew;
 		cl_int createKernelErrorCalculateMagnitudes;
@@ -932,10 +1112,10 @@ class BROCCOLI_LIB
 		cl_int createKernelErrorCalculateGLMResiduals, createKernelErrorCalculateGLMResidualsSlice;
 		cl_int createKernelErrorCalculateStatisticalMapsGLMTTestFirstLevel, createKernelErrorCalculateStatisticalMapsGLMFTestFirstLevel;
 		cl_int createKernelErrorCalculateStatisticalMapsGLMTTestFirstLevelSlice, createKernelErrorCalculateStatisticalMapsGLMFTestFirstLevelSlice;
-		cl_int createKernelErrorCalculateStatisticalMapsGLMTTest, createKernelErrorCalculateStatisticalMapsGLMFTest, createKernelErrorCalculateStatisticalMapsGLMBayesian;
+		cl_int createKernelErrorCalculateStatisticalMapsGLMTTest, createKernelErrorCalculateStatisticalMapsGLMFTest, createKernelErrorCalculateStatisticalMapsGLMBayesian, createKernelErrorCalculateStatisticalMapsGLMBayesianMultiChain;
 		cl_int createKernelErrorCalculateStatisticalMapsGLMTTestFirstLevelPermutation, createKernelErrorCalculateStatisticalMapsGLMFTestFirstLevelPermutation;
 		cl_int createKernelErrorCalculateStatisticalMapsMeanSecondLevelPermutation, createKernelErrorCalculateStatisticalMapsGLMTTestSecondLevelPermutation, createKernelErrorCalculateStatisticalMapsGLMFTestSecondLevelPermutation;
-        cl_int createKernelErrorCalculateStatisticalMapSearchlight;
+        cl_int createKernelErrorCalculateStatisticalMapSearchlight, createKernelErrorCalculateStatisticalMapSearchlightClosedForm, createKernelErrorCalculateStatisticalMapSearchlightSphere, createKernelErrorCalculateStatisticalMapsSearchlightRidgePermutation;
         cl_int createKernelErrorEstimateAR4Models, createKernelErrorEstimateAR4ModelsSlice, createKernelErrorApplyWhiteningAR4, createKernelErrorApplyWhiteningAR4Slice;
 		cl_int createKernelErrorGeneratePermutedVolumesFirstLevel;
 		cl_int createKernelErrorRemoveLinearFit, createKernelErrorRemoveLinearFitSlice;
@@ -1004,9 +1184,11 @@ class BROCCOLI_LIB
 		cl_int runKernelErrorCalculateColumnMaxs;
 		cl_int runKernelErrorCalculateRowMaxs;
 		cl_int runKernelErrorCalculateMaxAtomic;
+		cl_int runKernelErrorReduceVolumes, runKernelErrorReduceVolumesFinal, runKernelErrorCalculateMassMoments;
 		cl_int runKernelErrorThresholdVolume;
+		cl_int runKernelErrorFastICANonlinearity;
 
-		cl_int runKernelErrorSliceTimingCorrection;
+		cl_int runKernelErrorSliceTimingCorrectionSlices, runKernelErrorSliceTimingAndMotionCorrection;
 
 		// Image registration kernels
 		cl_int runKernelErrorCalculatePhaseDifferencesAndCertainties, runKernelErrorCalculatePhaseGradientsX, runKernelErrorCalculatePhaseGradientsY, runKernelErrorCalculatePhaseGradientsZ;
@@ -1015,6 +1197,7 @@ class BROCCOLI_LIB
 		cl_int runKernelErrorCalculateAMatrix, runKernelErrorCalculateHVector;
 		cl_int runKernelErrorInterpolateVolumeNearestLinear, runKernelErrorInterpolateVolumeLinearLinear,  runKernelErrorInterpolateVolumeCubicLinear;
 		cl_int runKernelErrorInterpolateVolumeNearestNonLinear, runKernelErrorInterpolateVolumeLinearNonLinear,  runKernelErrorInterpolateVolumeCubicNonLinear;
+		cl_int runKernelErrorInterpolateVolumeNearestComposed, runKernelErrorInterpolateVolumeLinearComposed,  runKernelErrorInterpolateVolumeCubicComposed;
 		cl_int runKernelErrorRescaleVolumeNearest, runKernelErrorRescaleVolumeLinear, runKernelErrorRescaleVolumeCubic;
 		cl_int runKernelErrorCopyT1VolumeToMNI, runKernelErrorCopyEPIVolumeToT1, runKernelErrorCopyVolumeToNew;
 		cl_int runKernelErrorCalculateMagnitudes;
@@ -1029,10 +1212,10 @@ class BROCCOLI_LIB
 		cl_int runKernelErrorCalculateGLMResiduals, runKernelErrorCalculateGLMResidualsSlice;
 		cl_int runKernelErrorCalculateStatisticalMapsGLMTTestFirstLevel, runKernelErrorCalculateStatisticalMapsGLMFTestFirstLevel;
 		cl_int runKernelErrorCalculateStatisticalMapsGLMTTestFirstLevelSlice, runKernelErrorCalculateStatisticalMapsGLMFTestFirstLevelSlice;
-		cl_int runKernelErrorCalculateStatisticalMapsGLMTTest, runKernelErrorCalculateStatisticalMapsGLMFTest, runKernelErrorCalculateStatisticalMapsGLMBayesian;
+		cl_int runKernelErrorCalculateStatisticalMapsGLMTTest, runKernelErrorCalculateStatisticalMapsGLMFTest, runKernelErrorCalculateStatisticalMapsGLMBayesian, runKernelErrorCalculateStatisticalMapsGLMBayesianMultiChain;
 		cl_int runKernelErrorCalculateStatisticalMapsGLMTTestFirstLevelPermutation, runKernelErrorCalculateStatisticalMapsGLMFTestFirstLevelPermutation;
 		cl_int runKernelErrorCalculateStatisticalMapsMeanSecondLevelPermutation, runKernelErrorCalculateStatisticalMapsGLMTTestSecondLevelPermutation, runKernelErrorCalculateStatisticalMapsGLMFTestSecondLevelPermutation;
-        cl_int runKernelErrorCalculateStatisticalMapSearchlight;
+        cl_int runKernelErrorCalculateStatisticalMapSearchlight, runKernelErrorCalculateStatisticalMapSearchlightClosedForm, runKernelErrorCalculateStatisticalMapSearchlightSphere, runKernelErrorCalculateStatisticalMapsSearchlightRidgePermutation;
         cl_int runKernelErrorEstimateAR4Models, runKernelErrorEstimateAR4ModelsSlice, runKernelErrorApplyWhiteningAR4, runKernelErrorApplyWhiteningAR4Slice;
 		cl_int runKernelErrorGeneratePermutedVolumesFirstLevel;
 		cl_int runKernelErrorRemoveLinearFit, runKernelErrorRemoveLinearFitSlice;
@@ -1073,10 +1256,13 @@ class BROCCOLI_LIB
 		size_t localWorkSizeCalculateColumnMaxs[3];
 		size_t localWorkSizeCalculateRowMaxs[3];
 		size_t localWorkSizeCalculateMaxAtomic[3];
+		size_t localWorkSizeReduceVolumes[3];
 		size_t localWorkSizeThresholdVolume[3];
 		size_t localWorkSizeCalculateBetaWeightsGLM[3];
 		size_t localWorkSizeCalculateStatisticalMapsGLM[3];
         size_t localWorkSizeCalculateStatisticalMapSearchlight[3];
+        size_t localWorkSizeCalculateStatisticalMapSearchlightClosedForm[3];
+        size_t localWorkSizeCalculateStatisticalMapSearchlightSphere[3];
 		size_t localWorkSizeRemoveLinearFit[3];
 		size_t localWorkSizeEstimateAR4Models[3];
 		size_t localWorkSizeApplyWhiteningAR4[3];
@@ -1114,10 +1300,14 @@ class BROCCOLI_LIB
 		size_t globalWorkSizeCalculateColumnMaxs[3];
 		size_t globalWorkSizeCalculateRowMaxs[3];
 		size_t globalWorkSizeCalculateMaxAtomic[3];
+		size_t globalWorkSizeReduceVolumes[3];
+		size_t globalWorkSizeReduceVolumesFinal[3];
 		size_t globalWorkSizeThresholdVolume[3];
 		size_t globalWorkSizeCalculateBetaWeightsGLM[3];
 		size_t globalWorkSizeCalculateStatisticalMapsGLM[3];
         size_t globalWorkSizeCalculateStatisticalMapSearchlight[3];
+        size_t globalWorkSizeCalculateStatisticalMapSearchlightClosedForm[3];
+        size_t globalWorkSizeCalculateStatisticalMapSearchlightSphere[3];
 		size_t globalWorkSizeRemoveLinearFit[3];
 		size_t globalWorkSizeEstimateAR4Models[3];
 		size_t globalWorkSizeApplyWhiteningAR4[3];
@@ -1143,6 +1333,7 @@ class BROCCOLI_LIB
 		bool DO_ALL_PERMUTATIONS;
 
 		bool APPLY_SLICE_TIMING_CORRECTION;
+		bool FUSE_SLICE_TIMING_AND_MOTION_CORRECTION;
 		bool APPLY_MOTION_CORRECTION;
 		bool APPLY_SMOOTHING;
 
@@ -1276,6 +1467,13 @@ class BROCCOLI_LIB
 		size_t NUMBER_OF_ICA_VARIABLES;
 		size_t NUMBER_OF_ICA_OBSERVATIONS;
 		double PROPORTION_OF_VARIANCE_TO_SAVE_BEFORE_ICA;
+		int PCA_METHOD;
+		bool ICA_STREAMING;
+		VoxelReader ICA_VOXEL_READER;
+		void* ICA_VOXEL_READER_DATA;
+		Eigen::MatrixXf icaSourceMatrix;
+		int ICA_ALGORITHM;
+		int FASTICA_NONLINEARITY;
 
 		// Random permutation variables
 		size_t NUMBER_OF_PERMUTATIONS;
@@ -1283,8 +1481,18 @@ class BROCCOLI_LIB
 		int NUMBER_OF_SIGNIFICANTLY_ACTIVE_VOXELS;
 		int NUMBER_OF_SIGNIFICANTLY_ACTIVE_CLUSTERS;
 
+		// Searchlight variables
+		int SEARCHLIGHT_CLASSIFIER;
+		int NUMBER_OF_SEARCHLIGHT_FOLDS;
+		float SEARCHLIGHT_REGULARIZATION;
+		float SEARCHLIGHT_RADIUS;
+		int NUMBER_OF_SEARCHLIGHT_PERMUTATIONS;
+
 		// MCMC variables
 		int NUMBER_OF_MCMC_ITERATIONS;
+		bool MCMC_SINGLE_PRECISION;
+		int NUMBER_OF_MCMC_CHAINS;
+		float MCMC_TOLERANCE;
 
 		//--------------------------------------------------
 		// Host pointers
@@ -1393,6 +1601,7 @@ class BROCCOLI_LIB
 		float       	*h_Residuals_MNI;
 		float       	*h_Residual_Variances;
 		float		*h_AR1_Estimates_EPI, *h_AR2_Estimates_EPI, *h_AR3_Estimates_EPI, *h_AR4_Estimates_EPI;
+		float		*h_MCMC_Diagnostics_EPI;
 		float		*h_AR1_Estimates_T1, *h_AR2_Estimates_T1, *h_AR3_Estimates_T1, *h_AR4_Estimates_T1;
 		float		*h_AR1_Estimates_MNI, *h_AR2_Estimates_MNI, *h_AR3_Estimates_MNI, *h_AR4_Estimates_MNI;
 		int		*h_Cluster_Indices;
@@ -1486,7 +1695,7 @@ class BROCCOLI_LIB
 		cl_mem		d_Statistical_Maps, d_Statistical_Maps_T1, d_Statistical_Maps_MNI;
 		cl_mem		c_Censor;
 		cl_mem		c_xtxxt_GLM, c_X_GLM, c_Contrasts, c_ctxtxc_GLM, c_Transformation_Matrix;
-        cl_mem      c_Correct_Classes, c_d;
+        cl_mem      c_Correct_Classes, c_d, c_Searchlight_Volume_Indices, c_Searchlight_Fold_Starts, c_Searchlight_Sphere_Offsets, d_Searchlight_Voxel_Indices, d_Searchlight_Permuted_Volume_Indices;
 		cl_mem		d_Residuals;
 		cl_mem		d_Residual_Variances, d_Residual_Variances_T1, d_Residual_Variances_MNI;
 		cl_mem		c_Censored_Timepoints, c_Censored_Volumes;
@@ -1512,6 +1721,56 @@ class BROCCOLI_LIB
 		int	deviceMemoryAllocations, deviceMemoryDeallocations;
 		size_t	allocatedDeviceMemory, allocatedHostMemory;
 
+		// Device buffer pool, free buffers are binned in size classes, images by their dimensions
+		std::vector<cl_mem> devicePoolFreeBuffers[DEVICE_POOL_SIZE_CLASSES];
+		std::vector<cl_mem> devicePoolUsedBuffers;
+		std::vector<int> devicePoolUsedSizeClasses;
+		std::vector<cl_mem> devicePoolImages;
+		std::vector<size_t> devicePoolImageSizes;
+		std::vector<bool> devicePoolImageInUse;
+
+		size_t	devicePoolBytesInUse, devicePoolBytesCached, devicePoolCacheLimit;
+		size_t	devicePoolBytesInUseHighWater, devicePoolBytesReservedHighWater;
+		int	devicePoolRequests, devicePoolHits;
+
+		// Profiling, events are read back in batches of PROFILING_EVENT_BATCH, names are kernel names or transfer types
+		bool	PROFILING;
+		std::vector<std::string> profilingNames;
+		std::map<std::string, int> profilingNameIndices;
+		std::map<cl_kernel, int> profilingKernelNames;
+		std::map<cl_mem, size_t> profilingBufferSizes;
+		std::map<cl_kernel, std::map<cl_uint, size_t> > profilingKernelArgumentBytes;
+		std::vector<cl_event> profilingPendingEvents;
+		std::vector<ProfilingRecord> profilingPendingRecords;
+		std::vector<ProfilingRecord> profilingRecords;
+
+		// Pipeline stages, a stage lasts until the next one begins, the high water marks are reset for each stage
+		bool	PIPELINE_TIMELINE;
+		std::vector<PipelineStage> pipelineStages;
+		bool	pipelineStageActive;
+		double	pipelineStageStart;
+		size_t	pipelineStageFirstRecord;
+		size_t	deviceBufferBytes, deviceBufferBytesHighWater, allocatedHostMemoryHighWater;
+		size_t	stageDeviceBufferBytesHighWater, stageAllocatedHostMemoryHighWater;
+
+		// Resized reference volumes and reference filter responses for registrations to a template, by name,
+		// valid for the template, voxel size and registration filters hashed into templateAssetsKey
+		std::map<std::string, std::vector<float> > templateAssets;
+		unsigned long long templateAssetsKey;
+		size_t	templateAssetsBytes;
+		bool	USE_TEMPLATE_ASSETS, templateAssetsChanged;
+
+		// Device copies of the template assets, kept between registrations with KEEP_TEMPLATE_ON_DEVICE
+		std::map<std::string, cl_mem> templateDeviceAssets;
+		size_t	templateDeviceAssetsBytes;
+		bool	KEEP_TEMPLATE_ON_DEVICE;
+		std::string	TEMPLATE_CACHE_DIRECTORY;
+
+		// Keys of the T1-MNI and fMRI-T1 registration results of the current first level analysis, 0 if the
+		// results should not be read or written
+		unsigned long long registrationResultsKeyT1MNI, registrationResultsKeyEPIT1;
+		std::string	REGISTRATION_CACHE_DIRECTORY;
+
 };
 
 #endif
@@ -0,0 +1,143 @@
+#include <pthread.h>
+#include <deque>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Background writers for output volumes. Between StartNiftiWriters and FinishNiftiWriters, WriteNifti only prepares
+// the header and places the image in a queue, a small pool of threads then compresses and writes the files while the
+// main thread continues. The wrappers start the writers once all GPU work is done, so the files are compressed and written
+// in parallel with each other and with the remaining host work, not with the GPU work. The data pointers given to WriteNifti
+// must not be changed or freed before FinishNiftiWriters.
+
+// Number of files that are written at the same time
+#define NUMBER_OF_NIFTI_WRITERS 4
+
+bool WriteNiftiImage(nifti_image* outputNifti);
+
+struct NiftiWriterQueue
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t imageQueued;
+	std::deque<nifti_image*> images;
+	std::vector<pthread_t> threads;
+	int threadsPerWriter;
+	int failures;
+	bool active;
+	bool finished;
+};
+
+NiftiWriterQueue niftiWriterQueue = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, std::deque<nifti_image*>(), std::vector<pthread_t>(), 1, 0, false, false };
+
+void* NiftiWriterThread(void*)
+{
+#ifdef _OPENMP
+	// Share the cores between the writers, each writer compresses its file with the remaining threads
+	omp_set_num_threads(niftiWriterQueue.threadsPerWriter);
+#endif
+
+	while (true)
+	{
+		pthread_mutex_lock(&niftiWriterQueue.mutex);
+		while (niftiWriterQueue.images.empty() && !niftiWriterQueue.finished)
+		{
+			pthread_cond_wait(&niftiWriterQueue.imageQueued, &niftiWriterQueue.mutex);
+		}
+
+		if (niftiWriterQueue.images.empty())
+		{
+			pthread_mutex_unlock(&niftiWriterQueue.mutex);
+			break;
+		}
+
+		nifti_image* outputNifti = niftiWriterQueue.images.front();
+		niftiWriterQueue.images.pop_front();
+		pthread_mutex_unlock(&niftiWriterQueue.mutex);
+
+		bool written = WriteNiftiImage(outputNifti);
+		if (!written)
+		{
+			printf("Could not write %s !\n",outputNifti->fname);
+		}
+
+		// The data belongs to the wrapper, only free the header information
+		outputNifti->data = NULL;
+		nifti_image_free(outputNifti);
+
+		if (!written)
+		{
+			pthread_mutex_lock(&niftiWriterQueue.mutex);
+			niftiWriterQueue.failures++;
+			pthread_mutex_unlock(&niftiWriterQueue.mutex);
+		}
+	}
+
+	return NULL;
+}
+
+// Starts the writer threads, if no thread can be started WriteNifti keeps writing on the calling thread
+void StartNiftiWriters()
+{
+	if (niftiWriterQueue.active)
+	{
+		return;
+	}
+
+	niftiWriterQueue.failures = 0;
+	niftiWriterQueue.finished = false;
+	niftiWriterQueue.threadsPerWriter = 1;
+#ifdef _OPENMP
+	niftiWriterQueue.threadsPerWriter = std::max(1, omp_get_max_threads() / NUMBER_OF_NIFTI_WRITERS);
+#endif
+
+	for (int i = 0; i < NUMBER_OF_NIFTI_WRITERS; i++)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, NiftiWriterThread, NULL) == 0)
+		{
+			niftiWriterQueue.threads.push_back(thread);
+		}
+	}
+
+	niftiWriterQueue.active = (niftiWriterQueue.threads.size() > 0);
+}
+
+// Gives an image with header, filename and data pointer to the writers, returns false if the writers are not running
+bool QueueNiftiImage(nifti_image* outputNifti)
+{
+	if (!niftiWriterQueue.active)
+	{
+		return false;
+	}
+
+	pthread_mutex_lock(&niftiWriterQueue.mutex);
+	niftiWriterQueue.images.push_back(outputNifti);
+	pthread_cond_signal(&niftiWriterQueue.imageQueued);
+	pthread_mutex_unlock(&niftiWriterQueue.mutex);
+
+	return true;
+}
+
+// Waits until all queued images have been written and stops the writers, returns false if any file could not be written
+bool FinishNiftiWriters()
+{
+	if (!niftiWriterQueue.active)
+	{
+		return true;
+	}
+
+	pthread_mutex_lock(&niftiWriterQueue.mutex);
+	niftiWriterQueue.finished = true;
+	pthread_cond_broadcast(&niftiWriterQueue.imageQueued);
+	pthread_mutex_unlock(&niftiWriterQueue.mutex);
+
+	for (size_t i = 0; i < niftiWriterQueue.threads.size(); i++)
+	{
+		pthread_join(niftiWriterQueue.threads[i], NULL);
+	}
+
+	niftiWriterQueue.threads.clear();
+	niftiWriterQueue.active = false;
+
+	return (niftiWriterQueue.failures == 0);
+}
@@ -0,0 +1,144 @@
+/*
+ * BROCCOLI: Software for Fast fMRI Analysis on Many-Core CPUs and GPUs
+ * Copyright (C) <2013>  Anders Eklund, andek034@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "broccoli_lib.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "nifti1_io.h"
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+
+#include "HelpFunctions.cpp"
+
+#define DONT_CHECK_EXISTING_FILE false
+
+int main(int argc, char ** argv)
+{
+    bool            VERBOS = false;
+    double          startTime, endTime;
+
+    //-----------------------
+    // Output parameters
+
+    std::string     outputFilename;
+    bool            CHANGE_OUTPUT_FILENAME = false;
+
+    //---------------------
+
+    /* Input arguments */
+    FILE *fp = NULL;
+
+    // No inputs, so print help text
+    if (argc == 1)
+    {
+        printf("Converts masked volumes (.bmv, written with -maskedoutput) to a nifti file.\n\n");
+        printf("Usage:\n\n");
+        printf("ConvertMaskedVolumes input.bmv [options]\n\n");
+        printf("Options:\n\n");
+        printf(" -output      Set filename of nifti file (default input.nii, use .nii.gz for a compressed file) \n");
+        printf(" -verbose     Print extra stuff (default false) \n");
+        printf("\n\n");
+
+        return EXIT_SUCCESS;
+    }
+    // Try to open file
+    else if (argc > 1)
+    {
+        fp = fopen(argv[1],"r");
+        if (fp == NULL)
+        {
+            printf("Could not open file %s !\n",argv[1]);
+            return EXIT_FAILURE;
+        }
+        fclose(fp);
+    }
+
+    // Loop over additional inputs
+    int i = 2;
+    while (i < argc)
+    {
+        char *input = argv[i];
+        if (strcmp(input,"-output") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read name after -output !\n");
+                return EXIT_FAILURE;
+			}
+
+			CHANGE_OUTPUT_FILENAME = true;
+            outputFilename = argv[i+1];
+            i += 2;
+        }
+        else if (strcmp(input,"-verbose") == 0)
+        {
+            VERBOS = true;
+            i += 1;
+        }
+        else
+        {
+            printf("Unrecognized option! %s \n",argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Default name is the input name with the .bmv replaced by .nii
+    if (!CHANGE_OUTPUT_FILENAME)
+    {
+        std::string inputFilename(argv[1]);
+        outputFilename = inputFilename.substr(0, inputFilename.rfind(".bmv")) + ".nii";
+    }
+
+    startTime = GetWallTime();
+
+    nifti_image *inputVolumes = ReadMaskedVolumes(argv[1]);
+    if (inputVolumes == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+
+    endTime = GetWallTime();
+
+    if (VERBOS)
+    {
+        printf("It took %f seconds to read the masked volumes\n",(float)(endTime - startTime));
+        printf("Volumes are of size %i x %i x %i x %i \n",inputVolumes->nx,inputVolumes->ny,inputVolumes->nz,inputVolumes->nt);
+    }
+
+    startTime = GetWallTime();
+
+    bool written = WriteNifti(inputVolumes,(float*)inputVolumes->data,outputFilename.c_str(),false,DONT_CHECK_EXISTING_FILE);
+
+    endTime = GetWallTime();
+
+    if (VERBOS)
+    {
+        printf("It took %f seconds to write the nifti file\n",(float)(endTime - startTime));
+    }
+
+    nifti_image_free(inputVolumes);
+
+    if (!written)
+    {
+        printf("Could not write %s !\n",outputFilename.c_str());
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
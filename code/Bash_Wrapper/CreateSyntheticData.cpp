@@ -0,0 +1,819 @@
+/*
+ * BROCCOLI: Software for fast fMRI analysis on many-core CPUs and GPUs
+ * Copyright (C) <2013>  Anders Eklund, andek034@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "broccoli_lib.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "nifti1_io.h"
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <math.h>
+#include <stdint.h>
+
+#include "HelpFunctions.cpp"
+
+#define DONT_ADD_FILENAME false
+
+#define DONT_CHECK_EXISTING_FILE false
+
+// The synthetic head is one ellipsoid with white matter inside, two ventricles and gray matter in between
+#define SYNTHETIC_BACKGROUND 0
+#define SYNTHETIC_GRAY_MATTER 1
+#define SYNTHETIC_WHITE_MATTER 2
+#define SYNTHETIC_CSF 3
+
+// Intensities of background, gray matter, white matter and CSF
+const float T1_INTENSITIES[4] = {0.0f, 600.0f, 1000.0f, 250.0f};
+const float EPI_INTENSITIES[4] = {0.0f, 900.0f, 700.0f, 1300.0f};
+
+// AR(4) coefficients of the noise, similar to what is estimated for real fMRI data
+const double AR_COEFFICIENTS[4] = {0.4, 0.15, 0.05, 0.02};
+
+// Random numbers from one generator per voxel, so that the data do not depend on the number of threads
+uint64_t SeedRandom(uint64_t seed, uint64_t stream)
+{
+	uint64_t z = seed + (stream + 1) * 0x9E3779B97F4A7C15ULL;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	z = z ^ (z >> 31);
+	return (z == 0) ? 1 : z;
+}
+
+double UniformRandom(uint64_t& state)
+{
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return (double)((state * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+}
+
+double GaussianRandom(uint64_t& state)
+{
+	double u1 = 1.0 - UniformRandom(state);
+	double u2 = UniformRandom(state);
+	return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+// x, y and z are in mm from the centre of the head
+int SyntheticTissue(double x, double y, double z, const double* radii)
+{
+	double r = (x / radii[0]) * (x / radii[0]) + (y / radii[1]) * (y / radii[1]) + (z / radii[2]) * (z / radii[2]);
+	if (r > 1.0)
+	{
+		return SYNTHETIC_BACKGROUND;
+	}
+
+	double vx = (fabs(x) - 0.12 * radii[0]) / (0.08 * radii[0]);
+	double vy = (y - 0.05 * radii[1]) / (0.3 * radii[1]);
+	double vz = (z - 0.1 * radii[2]) / (0.15 * radii[2]);
+	if ((vx * vx + vy * vy + vz * vz) < 1.0)
+	{
+		return SYNTHETIC_CSF;
+	}
+
+	// A folded border between gray and white matter, to give the registrations some structure
+	double border = 0.75 + 0.06 * sin(0.15 * x) * sin(0.12 * y) * sin(0.1 * z);
+	if (r < border * border)
+	{
+		return SYNTHETIC_WHITE_MATTER;
+	}
+
+	return SYNTHETIC_GRAY_MATTER;
+}
+
+bool InsideActivation(double x, double y, double z, const double* center, double radius)
+{
+	return ((x - center[0]) * (x - center[0]) + (y - center[1]) * (y - center[1]) + (z - center[2]) * (z - center[2])) < (radius * radius);
+}
+
+double GammaPDF(double t, double shape)
+{
+	if (t <= 0.0)
+	{
+		return 0.0;
+	}
+	return exp((shape - 1.0) * log(t) - t - lgamma(shape));
+}
+
+// Boxcar convolved with a double gamma hemodynamic response, sampled every TR and scaled to a maximum of 1 (the regressor
+// is zero if no block starts within the run)
+void CreateBlockRegressor(double* regressor, int DATA_T, double TR, double firstOnset, double blockLength)
+{
+	double dt = 0.1;
+	double maximum = 0.0;
+	for (int t = 0; t < DATA_T; t++)
+	{
+		regressor[t] = 0.0;
+		for (double s = 0.0; s < 32.0; s += dt)
+		{
+			double time = t * TR - s - firstOnset;
+			if ( (time >= 0.0) && (fmod(time, 2.0 * blockLength) < blockLength) )
+			{
+				regressor[t] += (GammaPDF(s, 6.0) - GammaPDF(s, 16.0) / 6.0) * dt;
+			}
+		}
+		maximum = std::max(maximum, regressor[t]);
+	}
+
+	if (maximum == 0.0)
+	{
+		return;
+	}
+
+	for (int t = 0; t < DATA_T; t++)
+	{
+		regressor[t] /= maximum;
+	}
+}
+
+// Header for a float volume with the centre of the volume at the origin
+nifti_image* CreateSyntheticNifti(int DATA_W, int DATA_H, int DATA_D, int DATA_T, float VOXEL_SIZE, float TR)
+{
+	int dims[8] = {(DATA_T > 1) ? 4 : 3, DATA_W, DATA_H, DATA_D, DATA_T, 1, 1, 1};
+	nifti_image* nim = nifti_make_new_nim(dims, DT_FLOAT, 0);
+	if (nim == NULL)
+	{
+		return NULL;
+	}
+
+	nim->dx = nim->dy = nim->dz = VOXEL_SIZE;
+	nim->pixdim[1] = nim->pixdim[2] = nim->pixdim[3] = VOXEL_SIZE;
+	nim->dt = TR;
+	nim->pixdim[4] = TR;
+	nim->xyz_units = NIFTI_UNITS_MM;
+	nim->time_units = NIFTI_UNITS_SEC;
+
+	nim->qform_code = NIFTI_XFORM_SCANNER_ANAT;
+	nim->quatern_b = nim->quatern_c = nim->quatern_d = 0.0f;
+	nim->qfac = 1.0f;
+	nim->qoffset_x = -0.5f * (DATA_W - 1) * VOXEL_SIZE;
+	nim->qoffset_y = -0.5f * (DATA_H - 1) * VOXEL_SIZE;
+	nim->qoffset_z = -0.5f * (DATA_D - 1) * VOXEL_SIZE;
+	nim->qto_xyz = nifti_quatern_to_mat44(nim->quatern_b, nim->quatern_c, nim->quatern_d, nim->qoffset_x, nim->qoffset_y, nim->qoffset_z, nim->dx, nim->dy, nim->dz, nim->qfac);
+	nim->qto_ijk = nifti_mat44_inverse(nim->qto_xyz);
+
+	return nim;
+}
+
+bool WriteSyntheticVolumes(std::string filename, float* data, int DATA_W, int DATA_H, int DATA_D, int DATA_T, float VOXEL_SIZE, float TR)
+{
+	nifti_image* nim = CreateSyntheticNifti(DATA_W, DATA_H, DATA_D, DATA_T, VOXEL_SIZE, TR);
+	if (nim == NULL)
+	{
+		return false;
+	}
+
+	bool written = WriteNifti(nim, data, filename.c_str(), DONT_ADD_FILENAME, DONT_CHECK_EXISTING_FILE);
+	nifti_image_free(nim);
+	return written;
+}
+
+// Anatomical volume (T1 contrast) of the head without motion
+void CreateAnatomicalVolume(float* volume, int DATA_W, int DATA_H, int DATA_D, float VOXEL_SIZE, const double* radii)
+{
+	#pragma omp parallel for
+	for (int z = 0; z < DATA_D; z++)
+	{
+		for (int y = 0; y < DATA_H; y++)
+		{
+			for (int x = 0; x < DATA_W; x++)
+			{
+				double xx = (x - 0.5 * (DATA_W - 1)) * VOXEL_SIZE;
+				double yy = (y - 0.5 * (DATA_H - 1)) * VOXEL_SIZE;
+				double zz = (z - 0.5 * (DATA_D - 1)) * VOXEL_SIZE;
+				volume[x + y * DATA_W + z * DATA_W * DATA_H] = T1_INTENSITIES[SyntheticTissue(xx, yy, zz, radii)];
+			}
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+    // Default parameters
+	int		DATA_W = 64;
+	int		DATA_H = 64;
+	int		DATA_D = 64;
+	int		DATA_T = 200;
+
+	float	VOXEL_SIZE = 3.0f;
+	float	T1_VOXEL_SIZE = 1.0f;
+	float	TR = 2.0f;
+
+	float	ACTIVATION = 3.0f;
+	float	NOISE = 2.0f;
+	float	MAX_TRANSLATION = 1.0f;
+	float	MAX_ROTATION = 1.0f;
+
+	int		NUMBER_OF_SUBJECTS = 0;
+	float	GROUP_EFFECT = 0.5f;
+
+	int		SEED = 1234;
+
+	const char*	OUTPUT_PREFIX = "synthetic";
+
+	bool	VERBOS = false;
+
+    // No inputs, so print help text
+    if (argc == 1)
+    {
+        printf("\nThe function creates synthetic fMRI data with a known activation, head motion and AR(4) noise,\n");
+        printf("together with a T1 volume, an MNI template, regressors and contrasts for FirstLevelAnalysis.\n");
+        printf("Group level data, a mask, a design and contrasts for RandomiseGroupLevel are created with -subjects.\n\n");
+        printf("Usage:\n\n");
+        printf("CreateSyntheticData -output prefix [options]\n\n");
+        printf("Options:\n\n");
+        printf(" -output             Prefix of all created files, e.g. prefix_fMRI.nii.gz (default synthetic) \n");
+        printf(" -size               Size of the fMRI data, width height depth timepoints (default 64 64 64 200) \n");
+        printf(" -voxelsize          Voxel size of the fMRI data in mm (default 3) \n");
+        printf(" -t1voxelsize        Voxel size of the T1 volume in mm (default 1) \n");
+        printf(" -tr                 Repetition time in seconds (default 2) \n");
+        printf(" -activation         Size of the activation in percent of the baseline (default 3) \n");
+        printf(" -noise              Standard deviation of the AR(4) noise innovations in percent of the gray matter intensity (default 2) \n");
+        printf(" -translation        Largest translation of the head in mm (default 1) \n");
+        printf(" -rotation           Largest rotation of the head in degrees (default 1) \n");
+        printf(" -subjects           Number of subjects for the group level data, 0 means no group level data (default 0) \n");
+        printf(" -groupeffect        Size of the group level activation, relative to the standard deviation of the noise (default 0.5) \n");
+        printf(" -seed               Seed for the random numbers (default 1234) \n");
+        printf(" -verbose            Print extra stuff (default false) \n");
+        printf("\n\n");
+
+        return EXIT_SUCCESS;
+    }
+
+ 	// Loop over additional inputs
+    int i = 1;
+    while (i < argc)
+    {
+        char *input = argv[i];
+        char *p;
+        if (strcmp(input,"-output") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read name after -output !\n");
+                return EXIT_FAILURE;
+			}
+
+            OUTPUT_PREFIX = argv[i+1];
+            i += 2;
+        }
+        else if (strcmp(input,"-size") == 0)
+        {
+			if ( (i+4) >= argc  )
+			{
+			    printf("Unable to read four values after -size !\n");
+                return EXIT_FAILURE;
+			}
+
+			int* sizes[4] = {&DATA_W, &DATA_H, &DATA_D, &DATA_T};
+			for (int s = 0; s < 4; s++)
+			{
+	            *sizes[s] = (int)strtol(argv[i+1+s], &p, 10);
+
+				if (!isspace(*p) && *p != 0)
+			    {
+			        printf("Size must be an integer! You provided %s \n",argv[i+1+s]);
+					return EXIT_FAILURE;
+			    }
+	            else if (*sizes[s] <= 0)
+	            {
+	                printf("Size must be > 0!\n");
+	                return EXIT_FAILURE;
+	            }
+			}
+            i += 5;
+        }
+        else if (strcmp(input,"-voxelsize") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read value after -voxelsize !\n");
+                return EXIT_FAILURE;
+			}
+
+            VOXEL_SIZE = (float)strtod(argv[i+1], &p);
+
+			if (!isspace(*p) && *p != 0)
+		    {
+		        printf("Voxel size must be a float! You provided %s \n",argv[i+1]);
+				return EXIT_FAILURE;
+		    }
+            else if (VOXEL_SIZE <= 0.0f)
+            {
+                printf("Voxel size must be > 0!\n");
+                return EXIT_FAILURE;
+            }
+            i += 2;
+        }
+        else if (strcmp(input,"-t1voxelsize") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read value after -t1voxelsize !\n");
+                return EXIT_FAILURE;
+			}
+
+            T1_VOXEL_SIZE = (float)strtod(argv[i+1], &p);
+
+			if (!isspace(*p) && *p != 0)
+		    {
+		        printf("T1 voxel size must be a float! You provided %s \n",argv[i+1]);
+				return EXIT_FAILURE;
+		    }
+            else if (T1_VOXEL_SIZE <= 0.0f)
+            {
+                printf("T1 voxel size must be > 0!\n");
+                return EXIT_FAILURE;
+            }
+            i += 2;
+        }
+        else if (strcmp(input,"-tr") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read value after -tr !\n");
+                return EXIT_FAILURE;
+			}
+
+            TR = (float)strtod(argv[i+1], &p);
+
+			if (!isspace(*p) && *p != 0)
+		    {
+		        printf("TR must be a float! You provided %s \n",argv[i+1]);
+				return EXIT_FAILURE;
+		    }
+            else if (TR <= 0.0f)
+            {
+                printf("TR must be > 0!\n");
+                return EXIT_FAILURE;
+            }
+            i += 2;
+        }
+        else if (strcmp(input,"-activation") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read value after -activation !\n");
+                return EXIT_FAILURE;
+			}
+
+            ACTIVATION = (float)strtod(argv[i+1], &p);
+
+			if (!isspace(*p) && *p != 0)
+		    {
+		        printf("Activation must be a float! You provided %s \n",argv[i+1]);
+				return EXIT_FAILURE;
+		    }
+            i += 2;
+        }
+        else if (strcmp(input,"-noise") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read value after -noise !\n");
+                return EXIT_FAILURE;
+			}
+
+            NOISE = (float)strtod(argv[i+1], &p);
+
+			if (!isspace(*p) && *p != 0)
+		    {
+		        printf("Noise must be a float! You provided %s \n",argv[i+1]);
+				return EXIT_FAILURE;
+		    }
+            else if (NOISE < 0.0f)
+            {
+                printf("Noise must be >= 0!\n");
+                return EXIT_FAILURE;
+            }
+            i += 2;
+        }
+        else if (strcmp(input,"-translation") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read value after -translation !\n");
+                return EXIT_FAILURE;
+			}
+
+            MAX_TRANSLATION = (float)strtod(argv[i+1], &p);
+
+			if (!isspace(*p) && *p != 0)
+		    {
+		        printf("Translation must be a float! You provided %s \n",argv[i+1]);
+				return EXIT_FAILURE;
+		    }
+            i += 2;
+        }
+        else if (strcmp(input,"-rotation") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read value after -rotation !\n");
+                return EXIT_FAILURE;
+			}
+
+            MAX_ROTATION = (float)strtod(argv[i+1], &p);
+
+			if (!isspace(*p) && *p != 0)
+		    {
+		        printf("Rotation must be a float! You provided %s \n",argv[i+1]);
+				return EXIT_FAILURE;
+		    }
+            i += 2;
+        }
+        else if (strcmp(input,"-subjects") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read value after -subjects !\n");
+                return EXIT_FAILURE;
+			}
+
+            NUMBER_OF_SUBJECTS = (int)strtol(argv[i+1], &p, 10);
+
+			if (!isspace(*p) && *p != 0)
+		    {
+		        printf("Number of subjects must be an integer! You provided %s \n",argv[i+1]);
+				return EXIT_FAILURE;
+		    }
+            else if ( (NUMBER_OF_SUBJECTS < 0) || (NUMBER_OF_SUBJECTS == 1) || (NUMBER_OF_SUBJECTS == 2) )
+            {
+                printf("Number of subjects must be 0 or > 2!\n");
+                return EXIT_FAILURE;
+            }
+            i += 2;
+        }
+        else if (strcmp(input,"-groupeffect") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read value after -groupeffect !\n");
+                return EXIT_FAILURE;
+			}
+
+            GROUP_EFFECT = (float)strtod(argv[i+1], &p);
+
+			if (!isspace(*p) && *p != 0)
+		    {
+		        printf("Group effect must be a float! You provided %s \n",argv[i+1]);
+				return EXIT_FAILURE;
+		    }
+            i += 2;
+        }
+        else if (strcmp(input,"-seed") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read value after -seed !\n");
+                return EXIT_FAILURE;
+			}
+
+            SEED = (int)strtol(argv[i+1], &p, 10);
+
+			if (!isspace(*p) && *p != 0)
+		    {
+		        printf("Seed must be an integer! You provided %s \n",argv[i+1]);
+				return EXIT_FAILURE;
+		    }
+            i += 2;
+        }
+        else if (strcmp(input,"-verbose") == 0)
+        {
+            VERBOS = true;
+            i += 1;
+        }
+        else
+        {
+            printf("Unrecognized option! %s \n",argv[i]);
+            return EXIT_FAILURE;
+        }
+	}
+
+	// The first block starts after 10 seconds, a shorter run would contain no activity
+	if ((DATA_T - 1) * TR <= 10.0f)
+	{
+		printf("The run is only %f seconds, the first block starts after 10 seconds! Increase the number of volumes (the last value of -size) or the TR.\n",(DATA_T - 1) * TR);
+		return EXIT_FAILURE;
+	}
+
+	std::string prefix(OUTPUT_PREFIX);
+
+	// The head is as large as an adult brain, but has to fit in the field of view of the fMRI data
+	double radii[3];
+	radii[0] = std::min(68.0, 0.45 * DATA_W * VOXEL_SIZE);
+	radii[1] = std::min(85.0, 0.45 * DATA_H * VOXEL_SIZE);
+	radii[2] = std::min(70.0, 0.45 * DATA_D * VOXEL_SIZE);
+
+	double activationCenter[3] = {0.35 * radii[0], 0.3 * radii[1], 0.2 * radii[2]};
+	double activationRadius = std::max(10.0, 2.0 * VOXEL_SIZE);
+
+	// MNI template with 2 mm voxels, also used for the group level data
+	int MNI_DATA_W = 91;
+	int MNI_DATA_H = 109;
+	int MNI_DATA_D = 91;
+	float MNI_VOXEL_SIZE = 2.0f;
+
+	int T1_DATA_W = (int)ceil(DATA_W * VOXEL_SIZE / T1_VOXEL_SIZE);
+	int T1_DATA_H = (int)ceil(DATA_H * VOXEL_SIZE / T1_VOXEL_SIZE);
+	int T1_DATA_D = (int)ceil(DATA_D * VOXEL_SIZE / T1_VOXEL_SIZE);
+
+	size_t EPI_VOXELS = (size_t)DATA_W * DATA_H * DATA_D;
+	size_t T1_VOXELS = (size_t)T1_DATA_W * T1_DATA_H * T1_DATA_D;
+	size_t MNI_VOXELS = (size_t)MNI_DATA_W * MNI_DATA_H * MNI_DATA_D;
+
+	float* h_fMRI_Volumes = (float*)malloc(EPI_VOXELS * DATA_T * sizeof(float));
+	float* h_T1_Volume = (float*)malloc(T1_VOXELS * sizeof(float));
+	float* h_MNI_Volume = (float*)malloc(MNI_VOXELS * sizeof(float));
+	float* h_Activation_Volume = (float*)malloc(EPI_VOXELS * sizeof(float));
+	float* h_Group_Volumes = NULL;
+	float* h_Group_Mask = NULL;
+	if (NUMBER_OF_SUBJECTS > 0)
+	{
+		h_Group_Volumes = (float*)malloc(MNI_VOXELS * NUMBER_OF_SUBJECTS * sizeof(float));
+		h_Group_Mask = (float*)malloc(MNI_VOXELS * sizeof(float));
+	}
+
+	double* regressor = (double*)malloc(DATA_T * sizeof(double));
+	double* motion = (double*)malloc(DATA_T * 6 * sizeof(double));
+	double* rotations = (double*)malloc(DATA_T * 9 * sizeof(double));
+
+	if ( (h_fMRI_Volumes == NULL) || (h_T1_Volume == NULL) || (h_MNI_Volume == NULL) || (h_Activation_Volume == NULL) || (regressor == NULL) || (motion == NULL) || (rotations == NULL) || ((NUMBER_OF_SUBJECTS > 0) && ((h_Group_Volumes == NULL) || (h_Group_Mask == NULL))) )
+	{
+		printf("Could not allocate host memory for the synthetic data, aborting! \n");
+		free(h_fMRI_Volumes);
+		free(h_T1_Volume);
+		free(h_MNI_Volume);
+		free(h_Activation_Volume);
+		free(h_Group_Volumes);
+		free(h_Group_Mask);
+		free(regressor);
+		free(motion);
+		free(rotations);
+		return EXIT_FAILURE;
+	}
+
+	double startTime = GetWallTime();
+
+	// Blocks of 20 seconds activity and 20 seconds rest, starting after 10 seconds
+	double firstOnset = 10.0;
+	double blockLength = 20.0;
+	CreateBlockRegressor(regressor, DATA_T, TR, firstOnset, blockLength);
+
+	// Smooth head motion with some jitter, three translations (mm) and three rotations (degrees), relative to the first volume
+	uint64_t motionState = SeedRandom(SEED, EPI_VOXELS);
+	for (int t = 0; t < DATA_T; t++)
+	{
+		for (int m = 0; m < 6; m++)
+		{
+			double amplitude = (m < 3) ? MAX_TRANSLATION : MAX_ROTATION;
+			motion[t * 6 + m] = amplitude * (0.9 * sin(2.0 * M_PI * (m % 3 + 1) * t / DATA_T + 0.7 * m) + 0.1 * GaussianRandom(motionState));
+		}
+	}
+
+	for (int t = DATA_T - 1; t >= 0; t--)
+	{
+		for (int m = 0; m < 6; m++)
+		{
+			motion[t * 6 + m] -= motion[m];
+		}
+	}
+
+	// Rotation matrices, R = Rz * Ry * Rx
+	for (int t = 0; t < DATA_T; t++)
+	{
+		double ax = motion[t * 6 + 3] * M_PI / 180.0;
+		double ay = motion[t * 6 + 4] * M_PI / 180.0;
+		double az = motion[t * 6 + 5] * M_PI / 180.0;
+		double* R = &rotations[t * 9];
+		R[0] = cos(az) * cos(ay);	R[1] = cos(az) * sin(ay) * sin(ax) - sin(az) * cos(ax);	R[2] = cos(az) * sin(ay) * cos(ax) + sin(az) * sin(ax);
+		R[3] = sin(az) * cos(ay);	R[4] = sin(az) * sin(ay) * sin(ax) + cos(az) * cos(ax);	R[5] = sin(az) * sin(ay) * cos(ax) - cos(az) * sin(ax);
+		R[6] = -sin(ay);			R[7] = cos(ay) * sin(ax);								R[8] = cos(ay) * cos(ax);
+	}
+
+	// Each voxel is sampled from the moving head, which avoids interpolation, followed by AR(4) noise along time
+	double noiseStd = NOISE / 100.0 * EPI_INTENSITIES[SYNTHETIC_GRAY_MATTER];
+	#pragma omp parallel for
+	for (int z = 0; z < DATA_D; z++)
+	{
+		for (int y = 0; y < DATA_H; y++)
+		{
+			for (int x = 0; x < DATA_W; x++)
+			{
+				size_t voxel = x + y * DATA_W + z * DATA_W * DATA_H;
+				uint64_t state = SeedRandom(SEED, voxel);
+
+				double xx = (x - 0.5 * (DATA_W - 1)) * VOXEL_SIZE;
+				double yy = (y - 0.5 * (DATA_H - 1)) * VOXEL_SIZE;
+				double zz = (z - 0.5 * (DATA_D - 1)) * VOXEL_SIZE;
+
+				h_Activation_Volume[voxel] = (float)(InsideActivation(xx, yy, zz, activationCenter, activationRadius) && (SyntheticTissue(xx, yy, zz, radii) != SYNTHETIC_BACKGROUND));
+
+				double noise[4] = {0.0, 0.0, 0.0, 0.0};
+				for (int t = 0; t < DATA_T; t++)
+				{
+					// Position in the head, x_head = R^T (x_scanner - translation)
+					const double* R = &rotations[t * 9];
+					double dx = xx - motion[t * 6 + 0];
+					double dy = yy - motion[t * 6 + 1];
+					double dz = zz - motion[t * 6 + 2];
+					double hx = R[0] * dx + R[3] * dy + R[6] * dz;
+					double hy = R[1] * dx + R[4] * dy + R[7] * dz;
+					double hz = R[2] * dx + R[5] * dy + R[8] * dz;
+
+					int tissue = SyntheticTissue(hx, hy, hz, radii);
+					double signal = EPI_INTENSITIES[tissue];
+					if ( (tissue != SYNTHETIC_BACKGROUND) && InsideActivation(hx, hy, hz, activationCenter, activationRadius) )
+					{
+						signal *= 1.0 + ACTIVATION / 100.0 * regressor[t];
+					}
+
+					double newNoise = AR_COEFFICIENTS[0] * noise[0] + AR_COEFFICIENTS[1] * noise[1] + AR_COEFFICIENTS[2] * noise[2] + AR_COEFFICIENTS[3] * noise[3] + noiseStd * GaussianRandom(state);
+					noise[3] = noise[2];
+					noise[2] = noise[1];
+					noise[1] = noise[0];
+					noise[0] = newNoise;
+
+					h_fMRI_Volumes[voxel + t * EPI_VOXELS] = (float)(signal + newNoise);
+				}
+			}
+		}
+	}
+
+	CreateAnatomicalVolume(h_T1_Volume, T1_DATA_W, T1_DATA_H, T1_DATA_D, T1_VOXEL_SIZE, radii);
+	CreateAnatomicalVolume(h_MNI_Volume, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, MNI_VOXEL_SIZE, radii);
+
+	// Group level data, one contrast volume per subject with white noise and a known activation
+	if (NUMBER_OF_SUBJECTS > 0)
+	{
+		#pragma omp parallel for
+		for (int z = 0; z < MNI_DATA_D; z++)
+		{
+			for (int y = 0; y < MNI_DATA_H; y++)
+			{
+				for (int x = 0; x < MNI_DATA_W; x++)
+				{
+					size_t voxel = x + y * MNI_DATA_W + z * MNI_DATA_W * MNI_DATA_H;
+					uint64_t state = SeedRandom(SEED + 1, voxel);
+
+					double xx = (x - 0.5 * (MNI_DATA_W - 1)) * MNI_VOXEL_SIZE;
+					double yy = (y - 0.5 * (MNI_DATA_H - 1)) * MNI_VOXEL_SIZE;
+					double zz = (z - 0.5 * (MNI_DATA_D - 1)) * MNI_VOXEL_SIZE;
+
+					bool brain = (SyntheticTissue(xx, yy, zz, radii) != SYNTHETIC_BACKGROUND);
+					double effect = InsideActivation(xx, yy, zz, activationCenter, activationRadius) ? GROUP_EFFECT : 0.0;
+
+					h_Group_Mask[voxel] = (float)brain;
+					for (int s = 0; s < NUMBER_OF_SUBJECTS; s++)
+					{
+						h_Group_Volumes[voxel + s * MNI_VOXELS] = brain ? (float)(effect + GaussianRandom(state)) : 0.0f;
+					}
+				}
+			}
+		}
+	}
+
+	double endTime = GetWallTime();
+
+	if (VERBOS)
+	{
+		printf("It took %f seconds to create the synthetic data\n",(float)(endTime - startTime));
+	}
+
+	// Regressor, design and contrast files in the formats of FirstLevelAnalysis and RandomiseGroupLevel
+	bool textFilesOK = true;
+
+	std::ofstream events((prefix + "_cond001.txt").c_str());
+	int numberOfEvents = 0;
+	for (double onset = firstOnset; onset < DATA_T * TR; onset += 2.0 * blockLength)
+	{
+		numberOfEvents++;
+	}
+	events << "NumEvents " << numberOfEvents << std::endl << std::endl;
+	for (double onset = firstOnset; onset < DATA_T * TR; onset += 2.0 * blockLength)
+	{
+		events << std::setprecision(6) << std::fixed << onset << "\t" << blockLength << "\t" << 1.0 << std::endl;
+	}
+	textFilesOK = textFilesOK && events.good();
+	events.close();
+
+	std::ofstream regressors((prefix + "_regressors.txt").c_str());
+	regressors << "NumRegressors 1" << std::endl << std::endl << prefix << "_cond001.txt" << std::endl;
+	textFilesOK = textFilesOK && regressors.good();
+	regressors.close();
+
+	std::ofstream contrasts((prefix + "_contrasts.txt").c_str());
+	contrasts << "NumRegressors 1" << std::endl << "NumContrasts 1" << std::endl << std::endl << "1.0" << std::endl;
+	textFilesOK = textFilesOK && contrasts.good();
+	contrasts.close();
+
+	// The true motion, one line per volume with the translations (mm) followed by the rotations (degrees)
+	std::ofstream motionFile((prefix + "_motion.txt").c_str());
+	for (int t = 0; t < DATA_T; t++)
+	{
+		for (int m = 0; m < 6; m++)
+		{
+			motionFile << std::setprecision(6) << std::fixed << motion[t * 6 + m] << ((m < 5) ? "  " : "");
+		}
+		motionFile << std::endl;
+	}
+	textFilesOK = textFilesOK && motionFile.good();
+	motionFile.close();
+
+	if (NUMBER_OF_SUBJECTS > 0)
+	{
+		// Group mean and a demeaned covariate
+		uint64_t covariateState = SeedRandom(SEED + 2, 0);
+		double* covariate = (double*)malloc(NUMBER_OF_SUBJECTS * sizeof(double));
+		double mean = 0.0;
+		for (int s = 0; s < NUMBER_OF_SUBJECTS; s++)
+		{
+			covariate[s] = GaussianRandom(covariateState);
+			mean += covariate[s] / NUMBER_OF_SUBJECTS;
+		}
+
+		std::ofstream design((prefix + "_design.txt").c_str());
+		design << "NumRegressors 2" << std::endl << "NumSubjects " << NUMBER_OF_SUBJECTS << std::endl << std::endl;
+		for (int s = 0; s < NUMBER_OF_SUBJECTS; s++)
+		{
+			design << std::setprecision(6) << std::fixed << 1.0 << " " << covariate[s] - mean << std::endl;
+		}
+		textFilesOK = textFilesOK && design.good();
+		design.close();
+		free(covariate);
+
+		std::ofstream groupContrasts((prefix + "_design_contrasts.txt").c_str());
+		groupContrasts << "NumRegressors 2" << std::endl << "NumContrasts 1" << std::endl << std::endl << "1.0 0.0" << std::endl;
+		textFilesOK = textFilesOK && groupContrasts.good();
+		groupContrasts.close();
+	}
+
+	if (!textFilesOK)
+	{
+		printf("Could not write the regressor, contrast or design files for %s !\n",OUTPUT_PREFIX);
+	}
+
+	startTime = GetWallTime();
+
+	// Compress and write the volumes in the background
+	StartNiftiWriters();
+
+	bool volumesOK = true;
+	volumesOK = WriteSyntheticVolumes(prefix + "_fMRI.nii.gz", h_fMRI_Volumes, DATA_W, DATA_H, DATA_D, DATA_T, VOXEL_SIZE, TR) && volumesOK;
+	volumesOK = WriteSyntheticVolumes(prefix + "_activation.nii.gz", h_Activation_Volume, DATA_W, DATA_H, DATA_D, 1, VOXEL_SIZE, TR) && volumesOK;
+	volumesOK = WriteSyntheticVolumes(prefix + "_T1.nii.gz", h_T1_Volume, T1_DATA_W, T1_DATA_H, T1_DATA_D, 1, T1_VOXEL_SIZE, TR) && volumesOK;
+	volumesOK = WriteSyntheticVolumes(prefix + "_MNI.nii.gz", h_MNI_Volume, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, MNI_VOXEL_SIZE, TR) && volumesOK;
+	if (NUMBER_OF_SUBJECTS > 0)
+	{
+		volumesOK = WriteSyntheticVolumes(prefix + "_group.nii.gz", h_Group_Volumes, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, NUMBER_OF_SUBJECTS, MNI_VOXEL_SIZE, TR) && volumesOK;
+		volumesOK = WriteSyntheticVolumes(prefix + "_group_mask.nii.gz", h_Group_Mask, MNI_DATA_W, MNI_DATA_H, MNI_DATA_D, 1, MNI_VOXEL_SIZE, TR) && volumesOK;
+	}
+
+	volumesOK = FinishNiftiWriters() && volumesOK;
+
+	endTime = GetWallTime();
+
+	if (!volumesOK)
+	{
+		printf("Could not write all volumes for %s !\n",OUTPUT_PREFIX);
+	}
+
+	if (VERBOS)
+	{
+		printf("It took %f seconds to write the nifti files\n",(float)(endTime - startTime));
+	}
+
+	free(h_fMRI_Volumes);
+	free(h_T1_Volume);
+	free(h_MNI_Volume);
+	free(h_Activation_Volume);
+	free(h_Group_Volumes);
+	free(h_Group_Mask);
+	free(regressor);
+	free(motion);
+	free(rotations);
+
+	if (!textFilesOK || !volumesOK)
+	{
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -148,7 +148,7 @@ int main(int argc, char ** argv)
 	// ---------------------
     // Read data
 	// ---------------------
-    nifti_image *inputData = nifti_image_read(argv[1],1);
+    nifti_image *inputData = nifti_image_read(argv[1],0);
     
     if (inputData == NULL)
     {
@@ -159,7 +159,7 @@ int main(int argc, char ** argv)
 	numberOfNiftiImages++;
 
 
-    nifti_image *inputMask = nifti_image_read(argv[2],1);
+    nifti_image *inputMask = nifti_image_read(argv[2],0);
     
     if (inputMask == NULL)
     {
@@ -211,97 +211,25 @@ int main(int argc, char ** argv)
 
 	startTime = GetWallTime();
 
-    // Convert data to floats
-    if ( inputData->datatype == DT_SIGNED_SHORT )
+    // Read data in chunks and convert to floats
+    if (!ReadNiftiDataAsFloats(h_Volumes, inputData))
     {
-        short int *p = (short int*)inputData->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * DATA_T; i++)
-        {
-            h_Volumes[i] = (float)p[i];
-        }
-    }
-    else if ( inputData->datatype == DT_UINT8 )
-    {
-        unsigned char *p = (unsigned char*)inputData->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * DATA_T; i++)
-        {
-            h_Volumes[i] = (float)p[i];
-        }
-    }
-    else if ( inputData->datatype == DT_UINT16 )
-    {
-        unsigned short int *p = (unsigned short int*)inputData->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * DATA_T; i++)
-        {
-            h_Volumes[i] = (float)p[i];
-        }
-    }
-	else if ( inputData->datatype == DT_FLOAT )
-    {
-        float *p = (float*)inputData->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * DATA_T; i++)
-        {
-            h_Volumes[i] = p[i];
-        }
-    }
-    else
-    {
-        printf("Unknown data type in input data, aborting!\n");
-        FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
-        FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
-        return EXIT_FAILURE;
+    	printf("Could not read the input data, aborting!\n");
+    	FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+    	FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+    	return EXIT_FAILURE;
     }
 
 
 
 
-    // Convert data to floats
-    if ( inputMask->datatype == DT_SIGNED_SHORT )
+    // Read data in chunks and convert to floats
+    if (!ReadNiftiDataAsFloats(h_Mask, inputMask))
     {
-        short int *p = (short int*)inputMask->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-        {
-            h_Mask[i] = (float)p[i];
-        }
-    }
-    else if ( inputMask->datatype == DT_UINT8 )
-    {
-        unsigned char *p = (unsigned char*)inputMask->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-        {
-            h_Mask[i] = (float)p[i];
-        }
-    }
-    else if ( inputMask->datatype == DT_UINT16 )
-    {
-        unsigned short int *p = (unsigned short int*)inputMask->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-        {
-            h_Mask[i] = (float)p[i];
-        }
-    }
-	else if ( inputMask->datatype == DT_FLOAT )
-    {
-        float *p = (float*)inputMask->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-        {
-            h_Mask[i] = p[i];
-        }
-    }
-    else
-    {
-        printf("Unknown data type in input data, aborting!\n");
-        FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
-        FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
-        return EXIT_FAILURE;
+    	printf("Could not read the mask volume, aborting!\n");
+    	FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+    	FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+    	return EXIT_FAILURE;
     }
 
 
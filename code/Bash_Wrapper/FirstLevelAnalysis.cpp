@@ -23,6 +23,8 @@
 #include <iostream>
 #include <fstream>
 #include <iomanip>
+#include <sstream>
+#include <map>
 
 #include "HelpFunctions.cpp"
 
@@ -32,8 +34,100 @@
 #define CHECK_EXISTING_FILE true
 #define DONT_CHECK_EXISTING_FILE false
 
+// Everything that is the same for all subjects in a batch is only initiated or read once
 
-int main(int argc, char **argv)
+// OpenCL context and compiled kernels, and the options they were created with
+BROCCOLI_LIB*	batchBROCCOLI = NULL;
+int				batchPlatform = 0;
+int				batchDevice = 0;
+bool			batchVerbose = false;
+
+// True when several subjects are analyzed with -batch, the template is then also kept on the device
+bool			batchMode = false;
+
+// Brain templates, by filename, and their data converted to floats
+std::map<std::string, nifti_image*>	batchTemplates;
+std::map<nifti_image*, std::vector<float> >	batchTemplateData;
+
+// Filters, projection tensors and filter directions for the image registration, by filename
+std::map<std::string, std::vector<float> >	batchBinaryFiles;
+
+// Reads the header of a brain template the first time it is used, the data are read with ReadBatchTemplateData.
+// The template is freed by FreeBatch
+nifti_image* ReadBatchTemplate(const char* filename)
+{
+	std::map<std::string, nifti_image*>::iterator cached = batchTemplates.find(filename);
+	if (cached != batchTemplates.end())
+	{
+		return cached->second;
+	}
+
+	nifti_image* inputTemplate = nifti_image_read(filename,0);
+	if (inputTemplate != NULL)
+	{
+		batchTemplates[filename] = inputTemplate;
+	}
+	return inputTemplate;
+}
+
+// Same as ReadNiftiDataAsFloats for a template from ReadBatchTemplate, the data are only read and converted once per batch
+bool ReadBatchTemplateData(float* pointer, nifti_image* inputTemplate)
+{
+	size_t size = (size_t)inputTemplate->nx * inputTemplate->ny * inputTemplate->nz;
+	std::map<nifti_image*, std::vector<float> >::iterator cached = batchTemplateData.find(inputTemplate);
+	if ( (cached != batchTemplateData.end()) && (cached->second.size() == size) )
+	{
+		memcpy(pointer, &cached->second[0], size * sizeof(float));
+		return true;
+	}
+
+	if (!ReadNiftiDataAsFloats(pointer, inputTemplate))
+	{
+		return false;
+	}
+	if (batchMode)
+	{
+		batchTemplateData[inputTemplate] = std::vector<float>(pointer, pointer + size);
+	}
+	return true;
+}
+
+// Same as ReadBinaryFile, but each file is only read the first time it is used
+void ReadBatchBinaryFile(float* pointer, int size, const char* filename, void** pointers, int& Npointers, nifti_image** niftiImages, int Nimages)
+{
+	std::map<std::string, std::vector<float> >::iterator cached = batchBinaryFiles.find(filename);
+	if ( (cached != batchBinaryFiles.end()) && (cached->second.size() == (size_t)size) && (pointer != NULL) )
+	{
+		memcpy(pointer, &cached->second[0], size * sizeof(float));
+		return;
+	}
+
+	int errors = numberOfHostErrors;
+	ReadBinaryFile(pointer, size, filename, pointers, Npointers, niftiImages, Nimages);
+	if (numberOfHostErrors == errors)
+	{
+		batchBinaryFiles[filename] = std::vector<float>(pointer, pointer + size);
+	}
+}
+
+// Releases OpenCL and everything that was kept between subjects
+void FreeBatch()
+{
+	delete batchBROCCOLI;
+	batchBROCCOLI = NULL;
+
+	for (std::map<std::string, nifti_image*>::iterator it = batchTemplates.begin(); it != batchTemplates.end(); it++)
+	{
+		FreeNiftiData(it->second);
+		nifti_image_free(it->second);
+	}
+	batchTemplates.clear();
+	batchTemplateData.clear();
+	batchBinaryFiles.clear();
+}
+
+// Analyzes one subject, the arguments are the same as for the FirstLevelAnalysis command
+int RunFirstLevelAnalysis(int argc, char **argv)
 {
     //-----------------------
     // Input pointers
@@ -76,6 +170,7 @@ int main(int argc, char **argv)
 	float			*h_Beta_Volumes_No_Whitening_MNI, *h_Contrast_Volumes_No_Whitening_MNI, *h_Statistical_Maps_No_Whitening_MNI;
 
     float           *h_AR1_Estimates_EPI, *h_AR2_Estimates_EPI, *h_AR3_Estimates_EPI, *h_AR4_Estimates_EPI;
+    float           *h_MCMC_Diagnostics_EPI;
     float           *h_AR1_Estimates_T1, *h_AR2_Estimates_T1, *h_AR3_Estimates_T1, *h_AR4_Estimates_T1;
     float           *h_AR1_Estimates_MNI, *h_AR2_Estimates_MNI, *h_AR3_Estimates_MNI, *h_AR4_Estimates_MNI;
         
@@ -137,9 +232,12 @@ int main(int argc, char **argv)
 	int				MM_T1_Z_CUT = 0;
 	int				MM_EPI_Z_CUT = 0;
     float           SIGMA = 5.0f;
+	const char*		TEMPLATE_CACHE_DIRECTORY = "";
+	const char*		REGISTRATION_CACHE_DIRECTORY = "";
     
 	bool			APPLY_SLICE_TIMING_CORRECTION = true;
 	bool			APPLY_MOTION_CORRECTION = true;
+	bool			FUSE_SLICE_TIMING_AND_MOTION_CORRECTION = false;
 	bool			APPLY_SMOOTHING = true;
 
 	int				SLICE_ORDER = UNDEFINED;
@@ -174,6 +272,10 @@ int main(int argc, char **argv)
     float           CLUSTER_DEFINING_THRESHOLD = 2.5f;
     bool            BAYESIAN = false;
     int             NUMBER_OF_MCMC_ITERATIONS = 1000;
+    bool            MCMC_SINGLE_PRECISION = false;
+    int             NUMBER_OF_MCMC_CHAINS = 4;
+    float           MCMC_TOLERANCE = 0.005f;
+    bool            WRITE_MCMC_DIAGNOSTICS = false;
 	bool			MASK = false;
 	const char*		MASK_NAME;
 	const char*		SLICE_TIMINGS_FILE;
@@ -196,6 +298,7 @@ int main(int argc, char **argv)
     bool            WRITE_ACTIVITY_T1 = false;
     bool            WRITE_RESIDUALS_EPI = false;
     bool            WRITE_RESIDUALS_MNI = false;
+    bool            MASKED_OUTPUT = false;
     bool            WRITE_DESIGNMATRIX = false;
 	bool			WRITE_ORIGINAL_DESIGNMATRIX = false;
     bool            WRITE_AR_ESTIMATES_EPI = false;
@@ -206,6 +309,9 @@ int main(int argc, char **argv)
 
     bool            PRINT = true;
     bool            VERBOS = false;
+    bool            PROFILE = false;
+    const char*     PROFILE_TRACE_FILENAME = NULL;
+    bool            TIMELINE = false;
     bool            DEBUG = false;
     
     //---------------------    
@@ -231,6 +337,12 @@ int main(int argc, char **argv)
 
         printf("Usage, preprocessing only (no GLM):\n\n");
         printf("FirstLevelAnalysis fMRI_data.nii T1_volume.nii MNI_volume.nii -preprocessingonly [options]\n\n");
+
+        printf("Usage, several subjects after each other (OpenCL is only initiated once, the options are used for all subjects):\n\n");
+        printf("FirstLevelAnalysis -batch subjects.txt [options]\n\n");
+        printf("                            subjects.txt contains the arguments for one subject per line, for example\n");
+        printf("                            subject1/fMRI.nii subject1/T1.nii MNI_volume.nii subject1/regressors.txt contrasts.txt -output subject1/results\n");
+        printf("                            (empty lines and lines starting with # are skipped, OpenCL is initiated again if a line changes -platform, -device or -verbose) \n\n");
         
         printf("OpenCL options:\n\n");
         printf(" -platform                  The OpenCL platform to use (default 0) \n");
@@ -243,11 +355,14 @@ int main(int argc, char **argv)
         //printf(" -lowestscaleepi            The lowest scale for the linear registration of the fMRI volume to the T1 volume, should be 1, 2, 4 or 8 (default 4), x means downsampling a factor x in each dimension  \n");        
         printf(" -zcutt1                    Number of mm to cut from the bottom of the T1 volume, can be negative, useful if the head in the volume is placed very high or low (default 0) \n\n");
         printf(" -zcutepi                   Number of mm to cut from the bottom of the fMRI volume, can be negative, useful if the head in the volume is placed very high or low (default 0) \n");
+        printf(" -templatecache             Directory where the resized MNI volume and its filter responses are saved, to be reused by later registrations to the same MNI volume (default none) \n");
+        printf(" -registrationcache         Directory where the T1-MNI and fMRI-T1 registration results are saved, to be reused when the same volumes are analysed again with the same registration settings (default none) \n");
         printf(" -sigma                     Amount of Gaussian smoothing applied for regularization of the displacement field, defined as sigma of the Gaussian kernel (default 5.0)  \n\n\n\n");        
         
         printf("Preprocessing options:\n\n");
         printf(" -noslicetimingcorrection   Do not apply slice timing correction\n");
         printf(" -nomotioncorrection        Do not apply motion correction\n");
+        printf(" -fuseslicetimingmotion     Apply slice timing and motion correction in one interpolation, motion is then estimated before slice timing correction (default false)\n");
         printf(" -nosmoothing               Do not apply any smoothing\n\n");
 
         printf(" -slicepattern              The sampling pattern used during scanning (overrides pattern provided in NIFTI file)\n");
@@ -276,6 +391,9 @@ int main(int argc, char **argv)
         printf(" -cdt                       Cluster defining threshold for cluster inference (default 2.5) \n");
         printf(" -bayesian                  Do Bayesian analysis using MCMC, currently only supports 2 regressors (default no) \n");
         printf(" -iterationsmcmc            Number of iterations for MCMC chains (default 1,000) \n");
+        printf(" -mcmcfloat                 Use the single precision MCMC sampler, with several chains and early stopping (default no) \n");
+        printf(" -chainsmcmc                Number of MCMC chains per voxel for the single precision sampler, 1 - 8 (default 4) \n");
+        printf(" -tolerancemcmc             Stop the single precision sampler when the PPMs change less than this between two checks, 0 = never (default 0.005) \n");
         printf(" -mask                      Apply a mask to the statistical maps after the statistical analysis, in MNI space (default none) \n\n");
 
         printf("Misc options:\n\n");
@@ -296,17 +414,22 @@ int main(int argc, char **argv)
         printf(" -saveactivityt1            Save activity maps in T1 space (in addition to MNI space, default no) \n");
         printf(" -saveresiduals             Save residuals after GLM analysis (default no) \n");
         printf(" -saveresidualsmni          Save residuals after GLM analysis, in MNI space (default no) \n");
+        printf(" -maskedoutput              Save residuals and preprocessed fMRI data in EPI space only inside the EPI mask, as .bmv files (convert with ConvertMaskedVolumes) (default no) \n");
         printf(" -saveoriginaldesignmatrix  Save the original design matrix used (default no) \n");
         printf(" -savedesignmatrix          Save the total design matrix used (default no) \n");
         printf(" -savearparameters          Save the estimated AR coefficients (default no) \n");
         printf(" -savearparameterst1        Save the estimated AR coefficients, in T1 space (default no) \n");
         printf(" -savearparametersmni       Save the estimated AR coefficients, in MNI space (default no) \n");
+        printf(" -savemcmcdiagnostics       Save R-hat and number of iterations of the single precision MCMC sampler (default no) \n");
         printf(" -saveallaligned            Save all aligned volumes (T1 interpolated, T1-MNI linear, T1-MNI non-linear, EPI-T1, EPI-MNI) (default no) \n");
         printf(" -saveallpreprocessed       Save all preprocessed fMRI data (slice timing corrected, motion corrected, smoothed) (default no) \n");
         printf(" -saveunwhitenedresults     Save all statistical results without voxel-wise whitening (default no) \n");
         printf(" -saveall                   Save everything (default no) \n");
         printf(" -output                    Set output filename (default fMRI*.nii) \n");
         printf(" -quiet                     Don't print anything to the terminal (default false) \n");
+        printf(" -profile                   Print the time and bytes of each OpenCL kernel and transfer (default false) \n");
+        printf(" -profiletrace              Write all OpenCL kernels and transfers to a Chrome trace file (chrome://tracing) (default none) \n");
+        printf(" -timeline                  Save the time, memory use and data size of each processing stage as JSON (default no) \n");
         printf(" -verbose                   Print extra stuff (default false) \n");
         printf(" -debug                     Get additional debug information saved as nifti files (default no). Warning: This will use a lot of extra memory! \n");
         printf("\n\n");
@@ -631,6 +754,28 @@ int main(int argc, char **argv)
             }
             i += 2;
         }      
+        else if (strcmp(input,"-templatecache") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read name after -templatecache !\n");
+                return EXIT_FAILURE;
+			}
+
+            TEMPLATE_CACHE_DIRECTORY = argv[i+1];
+            i += 2;
+        }
+        else if (strcmp(input,"-registrationcache") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read name after -registrationcache !\n");
+                return EXIT_FAILURE;
+			}
+
+            REGISTRATION_CACHE_DIRECTORY = argv[i+1];
+            i += 2;
+        }
         
         // Preprocessing options
         else if (strcmp(input,"-noslicetimingcorrection") == 0)
@@ -643,6 +788,11 @@ int main(int argc, char **argv)
 			APPLY_MOTION_CORRECTION = false;
 			i += 1;
 		}
+        else if (strcmp(input,"-fuseslicetimingmotion") == 0)
+        {
+			FUSE_SLICE_TIMING_AND_MOTION_CORRECTION = true;
+			i += 1;
+		}
         else if (strcmp(input,"-nosmoothing") == 0)
         {
 			APPLY_SMOOTHING = false;
@@ -914,6 +1064,55 @@ int main(int argc, char **argv)
             }
             i += 2;
         }
+        else if (strcmp(input,"-mcmcfloat") == 0)
+        {
+            MCMC_SINGLE_PRECISION = true;
+            i += 1;
+        }
+        else if (strcmp(input,"-chainsmcmc") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read value after -chainsmcmc !\n");
+                return EXIT_FAILURE;
+			}
+            
+            NUMBER_OF_MCMC_CHAINS = (int)strtol(argv[i+1], &p, 10);
+            
+			if (!isspace(*p) && *p != 0)
+		    {
+		        printf("Number of MCMC chains must be an integer! You provided %s \n",argv[i+1]);
+				return EXIT_FAILURE;
+		    }
+            else if ( (NUMBER_OF_MCMC_CHAINS <= 0) || (NUMBER_OF_MCMC_CHAINS > BAYESIAN_MAX_CHAINS) )
+            {
+                printf("Number of MCMC chains must be between 1 and %i !\n",BAYESIAN_MAX_CHAINS);
+                return EXIT_FAILURE;
+            }
+            i += 2;
+        }
+        else if (strcmp(input,"-tolerancemcmc") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read value after -tolerancemcmc !\n");
+                return EXIT_FAILURE;
+			}
+            
+            MCMC_TOLERANCE = (float)strtod(argv[i+1], &p);
+            
+			if (!isspace(*p) && *p != 0)
+		    {
+		        printf("MCMC tolerance must be a float! You provided %s \n",argv[i+1]);
+				return EXIT_FAILURE;
+		    }
+            else if (MCMC_TOLERANCE < 0.0f)
+            {
+                printf("MCMC tolerance must be >= 0 !\n");
+                return EXIT_FAILURE;
+            }
+            i += 2;
+        }
         else if (strcmp(input,"-mask") == 0)
         {
 			if ( (i+1) >= argc  )
@@ -1015,6 +1214,11 @@ int main(int argc, char **argv)
 			printf("Saving residuals to MNI space is currently turned off!\n");
     	    return EXIT_FAILURE;
         }
+        else if (strcmp(input,"-maskedoutput") == 0)
+        {
+            MASKED_OUTPUT = true;
+            i += 1;
+        }
         else if (strcmp(input,"-savedesignmatrix") == 0)
         {
             WRITE_DESIGNMATRIX = true;
@@ -1035,6 +1239,11 @@ int main(int argc, char **argv)
             WRITE_AR_ESTIMATES_T1 = true;
             i += 1;
         }
+        else if (strcmp(input,"-savemcmcdiagnostics") == 0)
+        {
+            WRITE_MCMC_DIAGNOSTICS = true;
+            i += 1;
+        }
         else if (strcmp(input,"-savearparametersmni") == 0)
         {
             WRITE_AR_ESTIMATES_MNI = true;
@@ -1087,6 +1296,27 @@ int main(int argc, char **argv)
             PRINT = false;
             i += 1;
         }
+        else if (strcmp(input,"-profile") == 0)
+        {
+            PROFILE = true;
+            i += 1;
+        }
+        else if (strcmp(input,"-profiletrace") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read name after -profiletrace !\n");
+                return EXIT_FAILURE;
+			}
+
+            PROFILE_TRACE_FILENAME = argv[i+1];
+            i += 2;
+        }
+        else if (strcmp(input,"-timeline") == 0)
+        {
+            TIMELINE = true;
+            i += 1;
+        }
         else if (strcmp(input,"-verbose") == 0)
         {
             VERBOS = true;
@@ -1131,6 +1361,11 @@ int main(int argc, char **argv)
     {
         printf("Cannot do both Bayesian and non-parametric fMRI analysis, pick one!\n");
         return EXIT_FAILURE;
+    }
+    if (WRITE_MCMC_DIAGNOSTICS && !(BAYESIAN && MCMC_SINGLE_PRECISION))
+    {
+        printf("MCMC diagnostics are only available for Bayesian analysis with -mcmcfloat!\n");
+        return EXIT_FAILURE;
     }
 	if (WRITE_UNWHITENED_RESULTS && (REGRESS_ONLY || PREPROCESSING_ONLY))
 	{
@@ -1375,7 +1610,8 @@ int main(int argc, char **argv)
 
 	if (!MULTIPLE_RUNS)
 	{
-		inputfMRI = nifti_image_read(argv[1],1);
+		// Only read the header, the data is read later directly into float format
+		inputfMRI = nifti_image_read(argv[1],0);
 	    allfMRINiftiImages.push_back(inputfMRI);
 
     	if (inputfMRI == NULL)
@@ -1390,7 +1626,7 @@ int main(int argc, char **argv)
 	{
 		for (int i = 0; i < NUMBER_OF_RUNS; i++)
 		{
-			inputfMRI = nifti_image_read(argv[3+i],1);
+			inputfMRI = nifti_image_read(argv[3+i],0);
 			allfMRINiftiImages.push_back(inputfMRI);    
 
     		if (inputfMRI == NULL)
@@ -1411,11 +1647,11 @@ int main(int argc, char **argv)
 
 	if (!MULTIPLE_RUNS)
 	{
-		inputT1 = nifti_image_read(argv[2],1);
+		inputT1 = nifti_image_read(argv[2],0);
 	}
 	else
 	{
-		inputT1 = nifti_image_read(argv[3+NUMBER_OF_RUNS],1);
+		inputT1 = nifti_image_read(argv[3+NUMBER_OF_RUNS],0);
 	}
     
     if (inputT1 == NULL)
@@ -1432,13 +1668,14 @@ int main(int argc, char **argv)
 	// -----------------------
 	nifti_image *inputMNI;
 
+	// The template is kept for the next subject in a batch, and is therefore not added to allNiftiImages
 	if (!MULTIPLE_RUNS)
 	{
-		inputMNI = nifti_image_read(argv[3],1);
+		inputMNI = ReadBatchTemplate(argv[3]);
 	}
 	else
 	{
-		inputMNI = nifti_image_read(argv[4+NUMBER_OF_RUNS],1);
+		inputMNI = ReadBatchTemplate(argv[4+NUMBER_OF_RUNS]);
 	}
     
     if (inputMNI == NULL)
@@ -1447,8 +1684,6 @@ int main(int argc, char **argv)
 		FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
         return EXIT_FAILURE;
     }
-	allNiftiImages[numberOfNiftiImages] = inputMNI;
-	numberOfNiftiImages++;
     
 	// -----------------------    
     // Read mask
@@ -1457,7 +1692,7 @@ int main(int argc, char **argv)
     nifti_image *inputMask;
     if (MASK)
     {
-        inputMask = nifti_image_read(MASK_NAME,1);
+        inputMask = ReadNifti(MASK_NAME);
         if (inputMask == NULL)
         {
             printf("Could not open mask volume!\n");
@@ -1469,6 +1704,7 @@ int main(int argc, char **argv)
     }
 
 	double endTime = GetWallTime();
+	double readTime = endTime - startTime;
 
 	if (VERBOS)
  	{
@@ -1805,17 +2041,18 @@ int main(int argc, char **argv)
 
 	startTime = GetWallTime();
 
-	if (!MULTIPLE_RUNS)
+	// A single uncompressed float run without intensity scaling is memory mapped, instead of allocated and read
+	bool fMRIMapped = false;
+	nifti_image* firstRun = allfMRINiftiImages[0];
+	if ( (allfMRINiftiImages.size() == 1) && CanMapNiftiData(firstRun) && ( (firstRun->scl_slope == 0.0f) || ((firstRun->scl_slope == 1.0f) && (firstRun->scl_inter == 0.0f)) ) && MapNiftiData(firstRun) )
 	{
-		// If the data is in float format, we can just copy the pointer
-		if ( inputfMRI->datatype != DT_FLOAT )
-		{
-			AllocateMemory(h_fMRI_Volumes, EPI_DATA_SIZE, allMemoryPointers, numberOfMemoryPointers, allNiftiImages, numberOfNiftiImages, allocatedHostMemory, "fMRI_VOLUMES");
-		}
-		else
-		{
-			allocatedHostMemory += EPI_DATA_SIZE;
-		}
+		// Move the pointer to the pointer list, it is unmapped by FreeAllMemory
+		h_fMRI_Volumes = (float*)firstRun->data;
+		firstRun->data = NULL;
+		allMemoryPointers[numberOfMemoryPointers] = (void*)h_fMRI_Volumes;
+		numberOfMemoryPointers++;
+		allocatedHostMemory += EPI_DATA_SIZE;
+		fMRIMapped = true;
 	}
 	else
 	{
@@ -1880,7 +2117,7 @@ int main(int argc, char **argv)
    
 	AllocateMemory(h_Motion_Parameters, MOTION_PARAMETERS_SIZE, allMemoryPointers, numberOfMemoryPointers, allNiftiImages, numberOfNiftiImages, allocatedHostMemory, "MOTION_PARAMETERS");       
 
-	if (WRITE_EPI_MASK || WRITE_MNI_MASK)
+	if (WRITE_EPI_MASK || WRITE_MNI_MASK || MASKED_OUTPUT)
 	{
 		AllocateMemory(h_EPI_Mask, EPI_VOLUME_SIZE, allMemoryPointers, numberOfMemoryPointers, allNiftiImages, numberOfNiftiImages, allocatedHostMemory, "EPI_MASK");
 	}
@@ -2017,6 +2254,12 @@ int main(int argc, char **argv)
 	    AllocateMemory(h_AR4_Estimates_EPI, EPI_VOLUME_SIZE, allMemoryPointers, numberOfMemoryPointers, allNiftiImages, numberOfNiftiImages, allocatedHostMemory, "AR4_ESTIMATES");
 	}
 
+	h_MCMC_Diagnostics_EPI = NULL;
+	if (WRITE_MCMC_DIAGNOSTICS)
+	{
+	    AllocateMemory(h_MCMC_Diagnostics_EPI, EPI_VOLUME_SIZE * 2, allMemoryPointers, numberOfMemoryPointers, allNiftiImages, numberOfNiftiImages, allocatedHostMemory, "MCMC_DIAGNOSTICS");
+	}
+
     if (WRITE_AR_ESTIMATES_MNI)
     {
         AllocateMemory(h_AR1_Estimates_MNI, MNI_VOLUME_SIZE, allMemoryPointers, numberOfMemoryPointers, allNiftiImages, numberOfNiftiImages, allocatedHostMemory, "AR1_ESTIMATES_MNI");
@@ -2039,6 +2282,15 @@ int main(int argc, char **argv)
  	{
 		printf("It took %f seconds to allocate memory\n",(float)(endTime - startTime));
 	}
+
+	// Only happens in a batch, otherwise AllocateMemory and ReadBinaryFile exit
+	if (numberOfHostErrors > 0)
+	{
+		FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+		FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+		free(EPI_DATA_T_PER_RUN);
+		return EXIT_FAILURE;
+	}
     
     // ------------------------------------------------
 	// Read events for each regressor    	
@@ -2391,198 +2643,39 @@ int main(int argc, char **argv)
     
 	startTime = GetWallTime();
     
-	// Convert fMRI data to floats
+	// Read fMRI data in chunks and convert to floats, each run is placed at its accumulated offset (mapped data is already in place)
 	size_t accumulatedTRs = 0;
 
-	if (MULTIPLE_RUNS)
-	{
-		for (size_t run = 0; run < NUMBER_OF_RUNS; run++)
-		{
-			inputfMRI = allfMRINiftiImages[run];
-	
-		    if ( inputfMRI->datatype == DT_SIGNED_SHORT )
-		    {
-		        short int *p = (short int*)inputfMRI->data;
-    			
-		        for (size_t i = 0; i < EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * EPI_DATA_T_PER_RUN[run]; i++)
-    		    {
-    		        h_fMRI_Volumes[i + accumulatedTRs * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D] = (float)p[i];
-    		    }
-			}
-		    else if ( inputfMRI->datatype == DT_UINT8 )
-		    {
-		        unsigned char *p = (unsigned char*)inputfMRI->data;
-		    
-		        for (size_t i = 0; i < EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * EPI_DATA_T_PER_RUN[run]; i++)
-		        {
-		            h_fMRI_Volumes[i + accumulatedTRs * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D] = (float)p[i];
-		        }
-		    }
-		    else if ( inputfMRI->datatype == DT_UINT16 )
-		    {
-		        unsigned short int *p = (unsigned short int*)inputfMRI->data;
-		    
-		        for (size_t i = 0; i < EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * EPI_DATA_T_PER_RUN[run]; i++)
-		        {
-		            h_fMRI_Volumes[i + accumulatedTRs * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D] = (float)p[i];
-		        }
-		    }
-		    else if ( inputfMRI->datatype == DT_FLOAT )
-		    {		
-		        float *p = (float*)inputfMRI->data;
-		    
-		        for (size_t i = 0; i < EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * EPI_DATA_T_PER_RUN[run]; i++)
-		        {
-		            h_fMRI_Volumes[i + accumulatedTRs * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D] = (float)p[i];
-		        }
-		    }
-		    else
-		    {
-		        printf("Unknown data type in fMRI data for run %i, aborting!\n",run+1);
-		        FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
-				FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
-		        return EXIT_FAILURE;
-		    }
-			accumulatedTRs += EPI_DATA_T_PER_RUN[run];
-		}
-	}
-	else
+	for (size_t run = 0; (run < allfMRINiftiImages.size()) && !fMRIMapped; run++)
 	{
-	    if ( inputfMRI->datatype == DT_SIGNED_SHORT )
-	    {
-	        short int *p = (short int*)inputfMRI->data;
-    		
-	        for (size_t i = 0; i < EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * EPI_DATA_T; i++)
-    	    {
-    	        h_fMRI_Volumes[i] = (float)p[i];
-    	    }
-		}
-	    else if ( inputfMRI->datatype == DT_UINT8 )
-	    {
-	        unsigned char *p = (unsigned char*)inputfMRI->data;
-	    
-	        for (size_t i = 0; i < EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * EPI_DATA_T; i++)
-	        {
-	            h_fMRI_Volumes[i] = (float)p[i];
-	        }
-	    }
-	    else if ( inputfMRI->datatype == DT_UINT16 )
-	    {
-	        unsigned short int *p = (unsigned short int*)inputfMRI->data;
-	    
-	        for (size_t i = 0; i < EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * EPI_DATA_T; i++)
-	        {
-	            h_fMRI_Volumes[i] = (float)p[i];
-	        }
-	    }
-		// Correct data type, just copy the pointer
-	    else if ( inputfMRI->datatype == DT_FLOAT )
-	    {		
-			h_fMRI_Volumes = (float*)inputfMRI->data;
-	
-			// Save the pointer in the pointer list
-			allMemoryPointers[numberOfMemoryPointers] = (void*)h_fMRI_Volumes;
-	        numberOfMemoryPointers++;
-	    }	
-	}
+		inputfMRI = allfMRINiftiImages[run];
 
-	if (MULTIPLE_RUNS)
-	{
-		// Free memory, as it is stored in a big array
-		for (size_t run = 0; run < NUMBER_OF_RUNS; run++)
+		if (!ReadNiftiDataAsFloats(&h_fMRI_Volumes[accumulatedTRs * EPI_DATA_W * EPI_DATA_H * EPI_DATA_D], inputfMRI))
 		{
-			inputfMRI = allfMRINiftiImages[run];
-			free(inputfMRI->data);
-			inputfMRI->data = NULL;
-		}
-	}
-	else
-	{	
-		// Free input fMRI data, it has been converted to floats
-		if ( inputfMRI->datatype != DT_FLOAT )
-		{		
-			free(inputfMRI->data);
-			inputfMRI->data = NULL;
-		}
-		// Pointer has been copied to h_fMRI_Volumes and pointer list, so set the input data pointer to NULL
-		else
-		{		
-			inputfMRI->data = NULL;
+	        printf("Could not read fMRI data for run %zu, aborting!\n",run+1);
+	        FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+			FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+	        return EXIT_FAILURE;
 		}
+		accumulatedTRs += inputfMRI->nt;
 	}
 
-
-
-	// Convert T1 volume to floats
-    if ( inputT1->datatype == DT_SIGNED_SHORT )
+    // Read T1 volume in chunks and convert to floats
+    if (!ReadNiftiDataAsFloats(h_T1_Volume, inputT1))
     {
-        short int *p = (short int*)inputT1->data;
-    
-        for (size_t i = 0; i < T1_DATA_W * T1_DATA_H * T1_DATA_D; i++)
-        {
-            h_T1_Volume[i] = (float)p[i];
-        }
-    }
-    else if ( inputT1->datatype == DT_UINT8 )
-    {
-        unsigned char *p = (unsigned char*)inputT1->data;
-    
-        for (size_t i = 0; i < T1_DATA_W * T1_DATA_H * T1_DATA_D; i++)
-        {
-            h_T1_Volume[i] = (float)p[i];
-        }
-    }
-    else if ( inputT1->datatype == DT_FLOAT )
-    {
-        float *p = (float*)inputT1->data;
-    
-        for (size_t i = 0; i < T1_DATA_W * T1_DATA_H * T1_DATA_D; i++)
-        {
-            h_T1_Volume[i] = p[i];
-        }
-    }
-    else
-    {
-        printf("Unknown data type in T1 volume, aborting!\n");
-        FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
-		FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
-        return EXIT_FAILURE;
+    	printf("Could not read the T1 volume, aborting!\n");
+    	FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+    	FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+    	return EXIT_FAILURE;
     }
 
-	// Convert MNI volume to floats
-    if ( inputMNI->datatype == DT_SIGNED_SHORT )
+    // Read MNI volume in chunks and convert to floats
+    if (!ReadBatchTemplateData(h_MNI_Brain_Volume, inputMNI))
     {
-        short int *p = (short int*)inputMNI->data;
-    
-        for (size_t i = 0; i < MNI_DATA_W * MNI_DATA_H * MNI_DATA_D; i++)
-        {
-            h_MNI_Brain_Volume[i] = (float)p[i];
-        }
-    }
-    else if ( inputMNI->datatype == DT_UINT8 )
-    {
-        unsigned char *p = (unsigned char*)inputMNI->data;
-    
-        for (size_t i = 0; i < MNI_DATA_W * MNI_DATA_H * MNI_DATA_D; i++)
-        {
-            h_MNI_Brain_Volume[i] = (float)p[i];
-        }
-    }
-    else if ( inputMNI->datatype == DT_FLOAT )
-    {
-        float *p = (float*)inputMNI->data;
-    
-        for (size_t i = 0; i < MNI_DATA_W * MNI_DATA_H * MNI_DATA_D; i++)
-        {
-            h_MNI_Brain_Volume[i] = p[i];
-        }
-    }
-    else
-    {
-        printf("Unknown data type in MNI volume, aborting!\n");
-        FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
-		FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
-        return EXIT_FAILURE;
+    	printf("Could not read the MNI volume, aborting!\n");
+    	FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+    	FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+    	return EXIT_FAILURE;
     }
 
 	endTime = GetWallTime();
@@ -2616,12 +2709,12 @@ int main(int argc, char **argv)
 	filter3ImagLinearPathAndName.append("filters/filter3_imag_linear_registration.bin");
     
     // Read quadrature filters for linear registration, three real valued and three imaginary valued
-	ReadBinaryFile(h_Quadrature_Filter_1_Linear_Registration_Real,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter1RealLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
-	ReadBinaryFile(h_Quadrature_Filter_1_Linear_Registration_Imag,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter1ImagLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
-	ReadBinaryFile(h_Quadrature_Filter_2_Linear_Registration_Real,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter2RealLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
-	ReadBinaryFile(h_Quadrature_Filter_2_Linear_Registration_Imag,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter2ImagLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
-	ReadBinaryFile(h_Quadrature_Filter_3_Linear_Registration_Real,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter3RealLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
-	ReadBinaryFile(h_Quadrature_Filter_3_Linear_Registration_Imag,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter3ImagLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
+	ReadBatchBinaryFile(h_Quadrature_Filter_1_Linear_Registration_Real,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter1RealLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
+	ReadBatchBinaryFile(h_Quadrature_Filter_1_Linear_Registration_Imag,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter1ImagLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
+	ReadBatchBinaryFile(h_Quadrature_Filter_2_Linear_Registration_Real,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter2RealLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
+	ReadBatchBinaryFile(h_Quadrature_Filter_2_Linear_Registration_Imag,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter2ImagLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
+	ReadBatchBinaryFile(h_Quadrature_Filter_3_Linear_Registration_Real,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter3RealLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
+	ReadBatchBinaryFile(h_Quadrature_Filter_3_Linear_Registration_Imag,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter3ImagLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
 
 	std::string filter1RealNonLinearPathAndName;
 	std::string filter1ImagNonLinearPathAndName;
@@ -2663,18 +2756,18 @@ int main(int argc, char **argv)
 	filter6ImagNonLinearPathAndName.append("filters/filter6_imag_nonlinear_registration.bin");
 
 	// Read quadrature filters for nonLinear registration, six real valued and six imaginary valued
-	ReadBinaryFile(h_Quadrature_Filter_1_NonLinear_Registration_Real,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter1RealNonLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
-	ReadBinaryFile(h_Quadrature_Filter_1_NonLinear_Registration_Imag,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter1ImagNonLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
-	ReadBinaryFile(h_Quadrature_Filter_2_NonLinear_Registration_Real,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter2RealNonLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
-	ReadBinaryFile(h_Quadrature_Filter_2_NonLinear_Registration_Imag,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter2ImagNonLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
-	ReadBinaryFile(h_Quadrature_Filter_3_NonLinear_Registration_Real,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter3RealNonLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
-	ReadBinaryFile(h_Quadrature_Filter_3_NonLinear_Registration_Imag,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter3ImagNonLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
-	ReadBinaryFile(h_Quadrature_Filter_4_NonLinear_Registration_Real,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter4RealNonLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
-	ReadBinaryFile(h_Quadrature_Filter_4_NonLinear_Registration_Imag,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter4ImagNonLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
-	ReadBinaryFile(h_Quadrature_Filter_5_NonLinear_Registration_Real,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter5RealNonLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
-	ReadBinaryFile(h_Quadrature_Filter_5_NonLinear_Registration_Imag,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter5ImagNonLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
-	ReadBinaryFile(h_Quadrature_Filter_6_NonLinear_Registration_Real,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter6RealNonLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
-	ReadBinaryFile(h_Quadrature_Filter_6_NonLinear_Registration_Imag,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter6ImagNonLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
+	ReadBatchBinaryFile(h_Quadrature_Filter_1_NonLinear_Registration_Real,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter1RealNonLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
+	ReadBatchBinaryFile(h_Quadrature_Filter_1_NonLinear_Registration_Imag,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter1ImagNonLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
+	ReadBatchBinaryFile(h_Quadrature_Filter_2_NonLinear_Registration_Real,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter2RealNonLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
+	ReadBatchBinaryFile(h_Quadrature_Filter_2_NonLinear_Registration_Imag,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter2ImagNonLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
+	ReadBatchBinaryFile(h_Quadrature_Filter_3_NonLinear_Registration_Real,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter3RealNonLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
+	ReadBatchBinaryFile(h_Quadrature_Filter_3_NonLinear_Registration_Imag,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter3ImagNonLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
+	ReadBatchBinaryFile(h_Quadrature_Filter_4_NonLinear_Registration_Real,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter4RealNonLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
+	ReadBatchBinaryFile(h_Quadrature_Filter_4_NonLinear_Registration_Imag,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter4ImagNonLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
+	ReadBatchBinaryFile(h_Quadrature_Filter_5_NonLinear_Registration_Real,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter5RealNonLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
+	ReadBatchBinaryFile(h_Quadrature_Filter_5_NonLinear_Registration_Imag,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter5ImagNonLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
+	ReadBatchBinaryFile(h_Quadrature_Filter_6_NonLinear_Registration_Real,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter6RealNonLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
+	ReadBatchBinaryFile(h_Quadrature_Filter_6_NonLinear_Registration_Imag,IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE*IMAGE_REGISTRATION_FILTER_SIZE,filter6ImagNonLinearPathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
 
 	std::string projectionTensor1PathAndName;
 	std::string projectionTensor2PathAndName;
@@ -2698,12 +2791,12 @@ int main(int argc, char **argv)
 	projectionTensor6PathAndName.append("filters/projection_tensor6.bin");
 
     // Read projection tensors   
-    ReadBinaryFile(h_Projection_Tensor_1,NUMBER_OF_FILTERS_FOR_NONLINEAR_REGISTRATION,projectionTensor1PathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
-    ReadBinaryFile(h_Projection_Tensor_2,NUMBER_OF_FILTERS_FOR_NONLINEAR_REGISTRATION,projectionTensor2PathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
-    ReadBinaryFile(h_Projection_Tensor_3,NUMBER_OF_FILTERS_FOR_NONLINEAR_REGISTRATION,projectionTensor3PathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
-    ReadBinaryFile(h_Projection_Tensor_4,NUMBER_OF_FILTERS_FOR_NONLINEAR_REGISTRATION,projectionTensor4PathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
-    ReadBinaryFile(h_Projection_Tensor_5,NUMBER_OF_FILTERS_FOR_NONLINEAR_REGISTRATION,projectionTensor5PathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
-    ReadBinaryFile(h_Projection_Tensor_6,NUMBER_OF_FILTERS_FOR_NONLINEAR_REGISTRATION,projectionTensor6PathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
+    ReadBatchBinaryFile(h_Projection_Tensor_1,NUMBER_OF_FILTERS_FOR_NONLINEAR_REGISTRATION,projectionTensor1PathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
+    ReadBatchBinaryFile(h_Projection_Tensor_2,NUMBER_OF_FILTERS_FOR_NONLINEAR_REGISTRATION,projectionTensor2PathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
+    ReadBatchBinaryFile(h_Projection_Tensor_3,NUMBER_OF_FILTERS_FOR_NONLINEAR_REGISTRATION,projectionTensor3PathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
+    ReadBatchBinaryFile(h_Projection_Tensor_4,NUMBER_OF_FILTERS_FOR_NONLINEAR_REGISTRATION,projectionTensor4PathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
+    ReadBatchBinaryFile(h_Projection_Tensor_5,NUMBER_OF_FILTERS_FOR_NONLINEAR_REGISTRATION,projectionTensor5PathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
+    ReadBatchBinaryFile(h_Projection_Tensor_6,NUMBER_OF_FILTERS_FOR_NONLINEAR_REGISTRATION,projectionTensor6PathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
         
 	std::string filterDirections1PathAndName;
 	std::string filterDirections2PathAndName;
@@ -2718,9 +2811,9 @@ int main(int argc, char **argv)
 	filterDirections3PathAndName.append("filters/filter_directions_z.bin");
 
     // Read filter directions
-    ReadBinaryFile(h_Filter_Directions_X,NUMBER_OF_FILTERS_FOR_NONLINEAR_REGISTRATION,filterDirections1PathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages);
-    ReadBinaryFile(h_Filter_Directions_Y,NUMBER_OF_FILTERS_FOR_NONLINEAR_REGISTRATION,filterDirections2PathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
-    ReadBinaryFile(h_Filter_Directions_Z,NUMBER_OF_FILTERS_FOR_NONLINEAR_REGISTRATION,filterDirections3PathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages);  
+    ReadBatchBinaryFile(h_Filter_Directions_X,NUMBER_OF_FILTERS_FOR_NONLINEAR_REGISTRATION,filterDirections1PathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages);
+    ReadBatchBinaryFile(h_Filter_Directions_Y,NUMBER_OF_FILTERS_FOR_NONLINEAR_REGISTRATION,filterDirections2PathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages); 
+    ReadBatchBinaryFile(h_Filter_Directions_Z,NUMBER_OF_FILTERS_FOR_NONLINEAR_REGISTRATION,filterDirections3PathAndName.c_str(),allMemoryPointers,numberOfMemoryPointers,allNiftiImages,numberOfNiftiImages);  
 
 	endTime = GetWallTime();
 
@@ -2728,59 +2821,85 @@ int main(int argc, char **argv)
  	{
 		printf("It took %f seconds to read all binary files\n",(float)(endTime - startTime));
 	}       
+
+	// Only happens in a batch, otherwise AllocateMemory and ReadBinaryFile exit
+	if (numberOfHostErrors > 0)
+	{
+		FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+		FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+		free(EPI_DATA_T_PER_RUN);
+		return EXIT_FAILURE;
+	}
     
     //------------------------
     
 	startTime = GetWallTime();
 
-	// Initialize BROCCOLI
-    BROCCOLI_LIB BROCCOLI(OPENCL_PLATFORM,OPENCL_DEVICE,2,VERBOS); // 2 = Bash wrapper
+	// Initialize BROCCOLI, OpenCL is only initiated for the first subject in a batch, or if a subject uses another platform, device or verbosity
+	if ( (batchBROCCOLI != NULL) && ((OPENCL_PLATFORM != batchPlatform) || (OPENCL_DEVICE != batchDevice) || (VERBOS != batchVerbose)) )
+	{
+		delete batchBROCCOLI;
+		batchBROCCOLI = NULL;
+	}
+
+	bool newBROCCOLI = (batchBROCCOLI == NULL);
+	if (newBROCCOLI)
+	{
+		batchBROCCOLI = new BROCCOLI_LIB(OPENCL_PLATFORM,OPENCL_DEVICE,2,VERBOS); // 2 = Bash wrapper
+		batchPlatform = OPENCL_PLATFORM;
+		batchDevice = OPENCL_DEVICE;
+		batchVerbose = VERBOS;
+	}
+	BROCCOLI_LIB& BROCCOLI = *batchBROCCOLI;
 
 	endTime = GetWallTime();
 
-	if (VERBOS)
+	if (VERBOS && newBROCCOLI)
  	{
 		printf("It took %f seconds to initiate BROCCOLI\n",(float)(endTime - startTime));
 	}
 
-    // Print build info to file (always)
-	std::vector<std::string> buildInfo = BROCCOLI.GetOpenCLBuildInfo();
-	std::vector<std::string> kernelFileNames = BROCCOLI.GetKernelFileNames();
+	if (newBROCCOLI)
+	{
+		// Print build info to file (always, once per batch)
+		std::vector<std::string> buildInfo = BROCCOLI.GetOpenCLBuildInfo();
+		std::vector<std::string> kernelFileNames = BROCCOLI.GetKernelFileNames();
 
-	std::string buildInfoPath;
-	buildInfoPath.append(getenv("BROCCOLI_DIR"));
-	buildInfoPath.append("compiled/Kernels/");
+		std::string buildInfoPath;
+		buildInfoPath.append(getenv("BROCCOLI_DIR"));
+		buildInfoPath.append("compiled/Kernels/");
 
-	for (int k = 0; k < BROCCOLI.GetNumberOfKernelFiles(); k++)
-	{
-		std::string temp = buildInfoPath;
-		temp.append("buildInfo_");
-		temp.append(BROCCOLI.GetOpenCLPlatformName());
-		temp.append("_");	
-		temp.append(BROCCOLI.GetOpenCLDeviceName());
-		temp.append("_");	
-		std::string name = kernelFileNames[k];
-		// Remove "kernel" and ".cpp" from kernel filename
-		name = name.substr(0,name.size()-4);
-		name = name.substr(6,name.size());
-		temp.append(name);
-		temp.append(".txt");
-		fp = fopen(temp.c_str(),"w");
-		if (fp == NULL)
-		{     
-		    printf("Could not open %s for writing ! \n",temp.c_str());
-		}
-		else
-		{	
-			if (buildInfo[k].c_str() != NULL)
-			{
-			    int error = fputs(buildInfo[k].c_str(),fp);
-			    if (error == EOF)
-			    {
-			        printf("Could not write to %s ! \n",temp.c_str());
-			    }
+		for (int k = 0; k < BROCCOLI.GetNumberOfKernelFiles(); k++)
+		{
+			std::string temp = buildInfoPath;
+			temp.append("buildInfo_");
+			temp.append(BROCCOLI.GetOpenCLPlatformName());
+			temp.append("_");	
+			temp.append(BROCCOLI.GetOpenCLDeviceName());
+			temp.append("_");	
+			std::string name = kernelFileNames[k];
+			// Remove "kernel" and ".cpp" from kernel filename
+			name = name.substr(0,name.size()-4);
+			name = name.substr(6,name.size());
+			temp.append(name);
+			temp.append(".txt");
+			fp = fopen(temp.c_str(),"w");
+			if (fp == NULL)
+			{     
+			    printf("Could not open %s for writing ! \n",temp.c_str());
+			}
+			else
+			{	
+				if (buildInfo[k].c_str() != NULL)
+				{
+				    int error = fputs(buildInfo[k].c_str(),fp);
+				    if (error == EOF)
+				    {
+				        printf("Could not write to %s ! \n",temp.c_str());
+				    }
+				}
+				fclose(fp);
 			}
-			fclose(fp);
 		}
 	}
 
@@ -2823,6 +2942,7 @@ int main(int argc, char **argv)
 
 		BROCCOLI.SetApplySliceTimingCorrection(APPLY_SLICE_TIMING_CORRECTION);
 		BROCCOLI.SetApplyMotionCorrection(APPLY_MOTION_CORRECTION);
+		BROCCOLI.SetFuseSliceTimingAndMotionCorrection(FUSE_SLICE_TIMING_AND_MOTION_CORRECTION);
 		BROCCOLI.SetApplySmoothing(APPLY_SMOOTHING);
 
         BROCCOLI.SetT1Width(T1_DATA_W);
@@ -2853,6 +2973,8 @@ int main(int argc, char **argv)
         BROCCOLI.SetNumberOfIterationsForLinearImageRegistration(NUMBER_OF_ITERATIONS_FOR_LINEAR_IMAGE_REGISTRATION);
         BROCCOLI.SetNumberOfIterationsForNonLinearImageRegistration(NUMBER_OF_ITERATIONS_FOR_NONLINEAR_IMAGE_REGISTRATION);
         BROCCOLI.SetImageRegistrationFilterSize(IMAGE_REGISTRATION_FILTER_SIZE);    
+        BROCCOLI.SetTemplateCacheDirectory(TEMPLATE_CACHE_DIRECTORY);
+        BROCCOLI.SetRegistrationCacheDirectory(REGISTRATION_CACHE_DIRECTORY);
         BROCCOLI.SetLinearImageRegistrationFilters(h_Quadrature_Filter_1_Linear_Registration_Real, h_Quadrature_Filter_1_Linear_Registration_Imag, h_Quadrature_Filter_2_Linear_Registration_Real, h_Quadrature_Filter_2_Linear_Registration_Imag, h_Quadrature_Filter_3_Linear_Registration_Real, h_Quadrature_Filter_3_Linear_Registration_Imag);
         BROCCOLI.SetNonLinearImageRegistrationFilters(h_Quadrature_Filter_1_NonLinear_Registration_Real, h_Quadrature_Filter_1_NonLinear_Registration_Imag, h_Quadrature_Filter_2_NonLinear_Registration_Real, h_Quadrature_Filter_2_NonLinear_Registration_Imag, h_Quadrature_Filter_3_NonLinear_Registration_Real, h_Quadrature_Filter_3_NonLinear_Registration_Imag, h_Quadrature_Filter_4_NonLinear_Registration_Real, h_Quadrature_Filter_4_NonLinear_Registration_Imag, h_Quadrature_Filter_5_NonLinear_Registration_Real, h_Quadrature_Filter_5_NonLinear_Registration_Imag, h_Quadrature_Filter_6_NonLinear_Registration_Real, h_Quadrature_Filter_6_NonLinear_Registration_Imag);    
         BROCCOLI.SetProjectionTensorMatrixFirstFilter(h_Projection_Tensor_1[0],h_Projection_Tensor_1[1],h_Projection_Tensor_1[2],h_Projection_Tensor_1[3],h_Projection_Tensor_1[4],h_Projection_Tensor_1[5]);
@@ -2877,7 +2999,8 @@ int main(int argc, char **argv)
 		BROCCOLI.SetSaveAlignedEPIT1(WRITE_ALIGNED_EPI_T1);	
 		BROCCOLI.SetSaveAlignedEPIMNI(WRITE_ALIGNED_EPI_MNI);	
 
-		BROCCOLI.SetSaveEPIMask(WRITE_EPI_MASK);
+		// The EPI mask is also needed for masked output
+		BROCCOLI.SetSaveEPIMask(WRITE_EPI_MASK || MASKED_OUTPUT);
 		BROCCOLI.SetSaveMNIMask(WRITE_MNI_MASK);
 		BROCCOLI.SetSaveSliceTimingCorrected(WRITE_SLICETIMING_CORRECTED);
 		BROCCOLI.SetSaveMotionCorrected(WRITE_MOTION_CORRECTED);
@@ -2909,6 +3032,9 @@ int main(int argc, char **argv)
         //BROCCOLI.SetRegressConfounds(REGRESS_CONFOUNDS);
 
         BROCCOLI.SetNumberOfMCMCIterations(NUMBER_OF_MCMC_ITERATIONS);
+        BROCCOLI.SetMCMCSinglePrecision(MCMC_SINGLE_PRECISION);
+        BROCCOLI.SetNumberOfMCMCChains(NUMBER_OF_MCMC_CHAINS);
+        BROCCOLI.SetMCMCTolerance(MCMC_TOLERANCE);
     
         if (REGRESS_CONFOUNDS == 1)
         {
@@ -2981,11 +3107,17 @@ int main(int argc, char **argv)
 
         //BROCCOLI.SetOutputResidualVariances(h_Residual_Variances);
         BROCCOLI.SetOutputAREstimatesEPI(h_AR1_Estimates_EPI, h_AR2_Estimates_EPI, h_AR3_Estimates_EPI, h_AR4_Estimates_EPI);
+        BROCCOLI.SetOutputMCMCDiagnosticsEPI(h_MCMC_Diagnostics_EPI);
         BROCCOLI.SetOutputAREstimatesMNI(h_AR1_Estimates_MNI, h_AR2_Estimates_MNI, h_AR3_Estimates_MNI, h_AR4_Estimates_MNI);
         BROCCOLI.SetOutputAREstimatesT1(h_AR1_Estimates_T1, h_AR2_Estimates_T1, h_AR3_Estimates_T1, h_AR4_Estimates_T1);
         //BROCCOLI.SetOutputWhitenedModels(h_Whitened_Models);
 		    
 		BROCCOLI.SetPrint(PRINT);
+		BROCCOLI.SetKeepTemplateOnDevice(batchMode);
+		BROCCOLI.ResetProfiling();
+		BROCCOLI.SetProfiling(PROFILE || (PROFILE_TRACE_FILENAME != NULL) || TIMELINE);
+		BROCCOLI.SetPipelineTimeline(TIMELINE);
+		BROCCOLI.AddPipelineStage("Read data", readTime, EPI_DATA_SIZE + T1_VOLUME_SIZE + MNI_VOLUME_SIZE);
 
         BROCCOLI.SetOutputDesignMatrix(h_Design_Matrix, h_Design_Matrix2);
         
@@ -2998,6 +3130,8 @@ int main(int argc, char **argv)
 			printf("\nIt took %f seconds to run the first level analysis\n",(float)(endTime - startTime));
 		}
 
+        WriteProfilingResults(BROCCOLI, PROFILE, PROFILE_TRACE_FILENAME);
+
         // Print create buffer errors
         int* createBufferErrors = BROCCOLI.GetOpenCLCreateBufferErrors();
         for (int i = 0; i < BROCCOLI.GetNumberOfOpenCLKernels(); i++)
@@ -3181,6 +3315,9 @@ int main(int argc, char **argv)
 		printf("Writing results to file\n");
 	}
 
+	// Compress and write the files in the background, the host buffers are not changed or freed before FinishNiftiWriters
+	StartNiftiWriters();
+
     // Create new nifti image
     nifti_image *outputNiftiT1 = nifti_copy_nim_info(inputMNI);
     allNiftiImages[numberOfNiftiImages] = outputNiftiT1;
@@ -3262,10 +3399,10 @@ int main(int argc, char **argv)
     //----------------------------
     
     // Create new nifti image	
-    nifti_image *outputNiftifMRI = nifti_copy_nim_info(inputfMRI);
+    nifti_image *outputNiftifMRI = nifti_copy_nim_info(inputfMRI);
 	outputNiftifMRI->nt = EPI_DATA_T;
     outputNiftifMRI->dim[4] = EPI_DATA_T;
-    outputNiftifMRI->nvox = EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * EPI_DATA_T;
+    outputNiftifMRI->nvox = EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * EPI_DATA_T;
     allNiftiImages[numberOfNiftiImages] = outputNiftifMRI;
 	numberOfNiftiImages++;
     
@@ -4151,6 +4288,12 @@ int main(int argc, char **argv)
     	    WriteNifti(outputNiftiStatisticsEPI,h_AR1_Estimates_EPI,"_ar1_estimates_EPI",ADD_FILENAME,DONT_CHECK_EXISTING_FILE);
     	}    
 
+    	if (WRITE_MCMC_DIAGNOSTICS)
+    	{
+    	    WriteNifti(outputNiftiStatisticsEPI,h_MCMC_Diagnostics_EPI,"_mcmc_rhat_EPI",ADD_FILENAME,DONT_CHECK_EXISTING_FILE);
+    	    WriteNifti(outputNiftiStatisticsEPI,&h_MCMC_Diagnostics_EPI[EPI_DATA_W * EPI_DATA_H * EPI_DATA_D],"_mcmc_iterations_EPI",ADD_FILENAME,DONT_CHECK_EXISTING_FILE);
+    	}
+
 		if (WRITE_RESIDUALS_EPI && !BAYESIAN && !BETAS_ONLY)
 		{
 		    outputNiftiStatisticsEPI->ndim = 4;
@@ -4158,7 +4301,14 @@ int main(int argc, char **argv)
 			outputNiftiStatisticsEPI->dim[0] = 4;
 	    	outputNiftiStatisticsEPI->dim[4] = EPI_DATA_T;
 	    	outputNiftiStatisticsEPI->nvox = EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * EPI_DATA_T;
-			WriteNifti(outputNiftiStatisticsEPI,h_Residuals_EPI,"_residuals",ADD_FILENAME,DONT_CHECK_EXISTING_FILE);
+			if (MASKED_OUTPUT)
+			{
+				WriteMaskedVolumes(outputNiftiStatisticsEPI,h_Residuals_EPI,h_EPI_Mask,"_residuals",ADD_FILENAME);
+			}
+			else
+			{
+				WriteNifti(outputNiftiStatisticsEPI,h_Residuals_EPI,"_residuals",ADD_FILENAME,DONT_CHECK_EXISTING_FILE);
+			}
 		}
 	}
 	else if (REGRESS_ONLY)
@@ -4170,7 +4320,14 @@ int main(int argc, char **argv)
 			outputNiftiStatisticsEPI->dim[0] = 4;
 	    	outputNiftiStatisticsEPI->dim[4] = EPI_DATA_T;
 	    	outputNiftiStatisticsEPI->nvox = EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * EPI_DATA_T;
-			WriteNifti(outputNiftiStatisticsEPI,h_Residuals_EPI,"_residuals",ADD_FILENAME,DONT_CHECK_EXISTING_FILE);
+			if (MASKED_OUTPUT)
+			{
+				WriteMaskedVolumes(outputNiftiStatisticsEPI,h_Residuals_EPI,h_EPI_Mask,"_residuals",ADD_FILENAME);
+			}
+			else
+			{
+				WriteNifti(outputNiftiStatisticsEPI,h_Residuals_EPI,"_residuals",ADD_FILENAME,DONT_CHECK_EXISTING_FILE);
+			}
 		}
 	}
 	else if (PREPROCESSING_ONLY)
@@ -4182,7 +4339,14 @@ int main(int argc, char **argv)
 			outputNiftiStatisticsEPI->dim[0] = 4;
 	    	outputNiftiStatisticsEPI->dim[4] = EPI_DATA_T;
 	    	outputNiftiStatisticsEPI->nvox = EPI_DATA_W * EPI_DATA_H * EPI_DATA_D * EPI_DATA_T;
-			WriteNifti(outputNiftiStatisticsEPI,h_fMRI_Volumes,"_preprocessed",ADD_FILENAME,DONT_CHECK_EXISTING_FILE);
+			if (MASKED_OUTPUT)
+			{
+				WriteMaskedVolumes(outputNiftiStatisticsEPI,h_fMRI_Volumes,h_EPI_Mask,"_preprocessed",ADD_FILENAME);
+			}
+			else
+			{
+				WriteNifti(outputNiftiStatisticsEPI,h_fMRI_Volumes,"_preprocessed",ADD_FILENAME,DONT_CHECK_EXISTING_FILE);
+			}
 		}
 	}
 
@@ -4579,21 +4743,164 @@ int main(int argc, char **argv)
     	}
 	}
    
+	// Wait for the background writers
+	bool volumesOK = FinishNiftiWriters();
+
     endTime = GetWallTime();
     
 	if (VERBOS)
 	{
 		printf("It took %f seconds to write the nifti files\n",(float)(endTime - startTime));
 	}  
+
+	if (!volumesOK)
+	{
+		printf("Could not write all the nifti files!\n");
+	}
+
+	// Save the timeline next to the outputs, the size of the written files is not known here
+	if (TIMELINE)
+	{
+		BROCCOLI.AddPipelineStage("Write results", endTime - startTime, 0);
+
+		const char* extension = "_timeline.json";
+		char* filenameWithExtension;
+
+		CreateFilename(filenameWithExtension, inputfMRI, extension, CHANGE_OUTPUT_FILENAME, outputFilename);
+
+		if (!BROCCOLI.WritePipelineTimeline(filenameWithExtension))
+		{
+			printf("Could not write %s !\n",filenameWithExtension);
+		}
+		free(filenameWithExtension);
+	}
     
     // Free all memory
     FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
     FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
 
 	free(EPI_DATA_T_PER_RUN);
+
+	if (!volumesOK)
+	{
+		return EXIT_FAILURE;
+	}
     
     return EXIT_SUCCESS;
 }
 
+// Analyzes the subjects in a text file after each other, with the options given after the filename
+int RunBatch(int argc, char **argv)
+{
+	if (argc < 3)
+	{
+		printf("Unable to read name of subject file after -batch !\n");
+		return EXIT_FAILURE;
+	}
+
+	std::ifstream subjects(argv[2]);
+	if (!subjects.good())
+	{
+		printf("Could not open subject file %s !\n",argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	// Read the arguments for each subject
+	std::vector< std::vector<std::string> > allArguments;
+	std::vector<int> lineNumbers;
+	std::string line;
+	int lineNumber = 0;
+	while (std::getline(subjects,line))
+	{
+		lineNumber++;
+
+		std::istringstream ss(line);
+		std::vector<std::string> arguments;
+		std::string argument;
+		while (ss >> argument)
+		{
+			arguments.push_back(argument);
+		}
+
+		if ( (arguments.size() == 0) || (arguments[0][0] == '#') )
+		{
+			continue;
+		}
+
+		// Options for all subjects
+		for (int i = 3; i < argc; i++)
+		{
+			arguments.push_back(argv[i]);
+		}
+
+		allArguments.push_back(arguments);
+		lineNumbers.push_back(lineNumber);
+	}
+	subjects.close();
+
+	int failedSubjects = 0;
+	int analyzedSubjects = 0;
+	double batchStartTime = GetWallTime();
+
+	// A subject that can not be allocated or read fails, but the other subjects are still analyzed
+	exitOnHostErrors = false;
+	batchMode = true;
+
+	for (size_t subject = 0; subject < allArguments.size(); subject++)
+	{
+		printf("\nAnalyzing subject %i of %i (line %i in %s)\n",(int)subject+1,(int)allArguments.size(),lineNumbers[subject],argv[2]);
+
+		std::vector<char*> subjectArgv;
+		subjectArgv.push_back(argv[0]);
+		for (size_t i = 0; i < allArguments[subject].size(); i++)
+		{
+			subjectArgv.push_back(&allArguments[subject][i][0]);
+		}
+		subjectArgv.push_back(NULL);
+
+		numberOfHostErrors = 0;
+		int result = RunFirstLevelAnalysis((int)subjectArgv.size() - 1, &subjectArgv[0]);
+		analyzedSubjects++;
+
+		if (result != EXIT_SUCCESS)
+		{
+			printf("Analysis of subject %i (line %i in %s) failed!\n",(int)subject+1,lineNumbers[subject],argv[2]);
+			failedSubjects++;
+		}
+
+		// No reason to continue if OpenCL could not be initiated
+		if ( (batchBROCCOLI != NULL) && !batchBROCCOLI->GetOpenCLInitiated() )
+		{
+			break;
+		}
+	}
+
+	printf("\nAnalyzed %i of %i subjects in %f seconds, %i failed\n",analyzedSubjects,(int)allArguments.size(),(float)(GetWallTime() - batchStartTime),failedSubjects);
+
+	if ( (failedSubjects > 0) || (analyzedSubjects < (int)allArguments.size()) )
+	{
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+	int result;
+	if ( (argc > 1) && (strcmp(argv[1],"-batch") == 0) )
+	{
+		result = RunBatch(argc,argv);
+	}
+	else
+	{
+		result = RunFirstLevelAnalysis(argc,argv);
+	}
+
+	FreeBatch();
+
+	return result;
+}
+
 
 
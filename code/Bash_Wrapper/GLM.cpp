@@ -90,6 +90,8 @@ int main(int argc, char **argv)
     bool            DEBUG = false;
     bool            PRINT = true;
 	bool			VERBOS = false;
+	bool			PROFILE = false;
+	const char*		PROFILE_TRACE_FILENAME = NULL;
    	bool			CHANGE_OUTPUT_FILENAME = false;    
                    
 	float           AR_SMOOTHING_AMOUNT = 6.0f;
@@ -126,6 +128,7 @@ int main(int argc, char **argv)
 	bool WRITE_DESIGNMATRIX = false;
 	bool WRITE_ORIGINAL_DESIGNMATRIX = false;
 	bool WRITE_RESIDUALS = false;
+	bool MASKED_OUTPUT = false;
 	bool WRITE_RESIDUAL_VARIANCES = false;
 	bool WRITE_AR_ESTIMATES = false;
 
@@ -180,12 +183,15 @@ int main(int argc, char **argv)
         printf(" \nMisc options \n\n");
         printf(" -mask                      A mask that defines which voxels to run the GLM for (default none) \n");
 		printf(" -saveresiduals             Save the residuals (default no) \n");
+		printf(" -maskedoutput              Save the residuals only inside the mask, as a .bmv file (convert with ConvertMaskedVolumes) (default no) \n");
 		printf(" -saveresidualvariance      Save residual variance (default no) \n");
         printf(" -savearparameters          Save the estimated AR coefficients (first level only, default no) \n");
 		printf(" -saveoriginaldesignmatrix  Save the original design matrix used (default no) \n");
         printf(" -savedesignmatrix          Save the total design matrix used (default no) \n");        
 		printf(" -output                    Set output filename (default volumes_) \n");
         printf(" -quiet                     Don't print anything to the terminal (default false) \n");
+        printf(" -profile                   Print the time and bytes of each OpenCL kernel and transfer (default false) \n");
+        printf(" -profiletrace              Write all OpenCL kernels and transfers to a Chrome trace file (chrome://tracing) (default none) \n");
         printf(" -verbose                   Print extra stuff (default false) \n");
         printf("\n\n");
         
@@ -448,6 +454,11 @@ int main(int argc, char **argv)
             WRITE_RESIDUALS = true;
             i += 1;
         }
+        else if (strcmp(input,"-maskedoutput") == 0)
+        {
+            MASKED_OUTPUT = true;
+            i += 1;
+        }
         else if (strcmp(input,"-saveresidualvariance") == 0)
         {
             WRITE_RESIDUAL_VARIANCES = true;
@@ -478,6 +489,22 @@ int main(int argc, char **argv)
             PRINT = false;
             i += 1;
         }
+        else if (strcmp(input,"-profile") == 0)
+        {
+            PROFILE = true;
+            i += 1;
+        }
+        else if (strcmp(input,"-profiletrace") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read name after -profiletrace !\n");
+                return EXIT_FAILURE;
+			}
+
+            PROFILE_TRACE_FILENAME = argv[i+1];
+            i += 2;
+        }
         else if (strcmp(input,"-verbose") == 0)
         {
             VERBOS = true;
@@ -696,7 +723,7 @@ int main(int argc, char **argv)
             return EXIT_FAILURE;
 		}
 
-		inputData = nifti_image_read(argv[1],1);
+		inputData = nifti_image_read(argv[1],0);
 	    allfMRINiftiImages.push_back(inputData);
 
     	if (inputData == NULL)
@@ -722,7 +749,7 @@ int main(int argc, char **argv)
 			}
 
 
-			inputData = nifti_image_read(argv[3+i],1);
+			inputData = nifti_image_read(argv[3+i],0);
 			allfMRINiftiImages.push_back(inputData);    
 
     		if (inputData == NULL)
@@ -750,7 +777,7 @@ int main(int argc, char **argv)
             return EXIT_FAILURE;
 		}
 
-	    inputMask = nifti_image_read(MASK_NAME,1);
+	    inputMask = nifti_image_read(MASK_NAME,0);
     
 	    if (inputMask == NULL)
 	    {
@@ -925,19 +952,8 @@ int main(int argc, char **argv)
     size_t MOTION_PARAMETERS_SIZE = NUMBER_OF_MOTION_REGRESSORS * DATA_T * sizeof(float);
    
 
-	if (!MULTIPLE_RUNS)
-	{
-		// If the data is in float format, we can just copy the pointer
-		if ( inputData->datatype != DT_FLOAT )
-		{
-			AllocateMemory(h_Data, DATA_SIZE, allMemoryPointers, numberOfMemoryPointers, allNiftiImages, numberOfNiftiImages, allocatedHostMemory, "fMRI_VOLUMES");
-		}
-		else
-		{
-			allocatedHostMemory += DATA_SIZE;
-		}
-	}
-	else
+	// A single run is read (or memory mapped) when the data are read, several runs are placed in one array
+	if (MULTIPLE_RUNS)
 	{
 		AllocateMemory(h_Data, DATA_SIZE, allMemoryPointers, numberOfMemoryPointers, allNiftiImages, numberOfNiftiImages, allocatedHostMemory, "fMRI_VOLUMES");
 	}
@@ -1467,164 +1483,45 @@ int main(int argc, char **argv)
 
 	startTime = GetWallTime();
 
-	// Convert fMRI data to floats
-	size_t accumulatedTRs = 0;
-
+	// Read fMRI data in chunks and convert to floats, each run is placed at its accumulated offset
 	if (MULTIPLE_RUNS)
 	{
+		size_t accumulatedTRs = 0;
 		for (size_t run = 0; run < NUMBER_OF_RUNS; run++)
 		{
-			inputData = allfMRINiftiImages[run];
-	
-		    if ( inputData->datatype == DT_SIGNED_SHORT )
-		    {
-		        short int *p = (short int*)inputData->data;
-    			
-		        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * DATA_T_PER_RUN[run]; i++)
-    		    {
-    		        h_Data[i + accumulatedTRs * DATA_W * DATA_H * DATA_D] = (float)p[i];
-    		    }
-			}
-		    else if ( inputData->datatype == DT_UINT8 )
-		    {
-		        unsigned char *p = (unsigned char*)inputData->data;
-		    
-		        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * DATA_T_PER_RUN[run]; i++)
-		        {
-		            h_Data[i + accumulatedTRs * DATA_W * DATA_H * DATA_D] = (float)p[i];
-		        }
-		    }
-		    else if ( inputData->datatype == DT_UINT16 )
-		    {
-		        unsigned short int *p = (unsigned short int*)inputData->data;
-		    
-		        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * DATA_T_PER_RUN[run]; i++)
-		        {
-		            h_Data[i + accumulatedTRs * DATA_W * DATA_H * DATA_D] = (float)p[i];
-		        }
-		    }
-		    else if ( inputData->datatype == DT_FLOAT )
-		    {		
-		        float *p = (float*)inputData->data;
-		    
-		        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * DATA_T_PER_RUN[run]; i++)
-		        {
-		            h_Data[i + accumulatedTRs * DATA_W * DATA_H * DATA_D] = (float)p[i];
-		        }
-		    }
-		    else
-		    {
-		        printf("Unknown data type in fMRI data for run %i, aborting!\n",run+1);
+			if (!ReadNiftiDataAsFloats(&h_Data[accumulatedTRs * DATA_W * DATA_H * DATA_D], allfMRINiftiImages[run]))
+			{
+		        printf("Could not read fMRI data for run %zu, aborting!\n",run+1);
 		        FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
 				FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
 		        return EXIT_FAILURE;
-		    }
+			}
 			accumulatedTRs += DATA_T_PER_RUN[run];
 		}
 	}
 	else
 	{
-	    if ( inputData->datatype == DT_SIGNED_SHORT )
-	    {
-	        short int *p = (short int*)inputData->data;
-    		
-	        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * DATA_T; i++)
-    	    {
-    	        h_Data[i] = (float)p[i];
-    	    }
-		}
-	    else if ( inputData->datatype == DT_UINT8 )
-	    {
-	        unsigned char *p = (unsigned char*)inputData->data;
-	    
-	        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * DATA_T; i++)
-	        {
-	            h_Data[i] = (float)p[i];
-	        }
-	    }
-	    else if ( inputData->datatype == DT_UINT16 )
-	    {
-	        unsigned short int *p = (unsigned short int*)inputData->data;
-	    
-	        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * DATA_T; i++)
-	        {
-	            h_Data[i] = (float)p[i];
-	        }
-	    }
-		// Correct data type, just copy the pointer
-	    else if ( inputData->datatype == DT_FLOAT )
-	    {		
-			h_Data = (float*)inputData->data;
-	
-			// Save the pointer in the pointer list
-			allMemoryPointers[numberOfMemoryPointers] = (void*)h_Data;
-	        numberOfMemoryPointers++;
-	    }	
-	}
-
-	if (MULTIPLE_RUNS)
-	{
-		// Free memory, as it is stored in a big array
-		for (size_t run = 0; run < NUMBER_OF_RUNS; run++)
+		// Float data is memory mapped
+		h_Data = ReadNiftiAsFloats(inputData, allMemoryPointers, numberOfMemoryPointers, allocatedHostMemory);
+		if (h_Data == NULL)
 		{
-			inputData = allfMRINiftiImages[run];
-			free(inputData->data);
-			inputData->data = NULL;
-		}
-	}
-	else
-	{	
-		// Free input fMRI data, it has been converted to floats
-		if ( inputData->datatype != DT_FLOAT )
-		{		
-			free(inputData->data);
-			inputData->data = NULL;
-		}
-		// Pointer has been copied to h_Data and pointer list, so set the input data pointer to NULL
-		else
-		{		
-			inputData->data = NULL;
+			printf("Could not read the fMRI data, aborting!\n");
+			FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+			FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+			return EXIT_FAILURE;
 		}
 	}
 
-
 	// Mask is provided by user
 	if (MASK)
 	{
-	    if ( inputMask->datatype == DT_SIGNED_SHORT )
-	    {
-	        short int *p = (short int*)inputMask->data;
-    
-	        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-	        {
-	            h_Mask[i] = (float)p[i];
-	        }
-	    }
-	    else if ( inputMask->datatype == DT_FLOAT )
-	    {
-	        float *p = (float*)inputMask->data;
-    
-	        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-        	{
-	            h_Mask[i] = p[i];
-	        }
-	    }
-	    else if ( inputMask->datatype == DT_UINT8 )
-	    {
-    	    unsigned char *p = (unsigned char*)inputMask->data;
-    
-	        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-	        {
-	            h_Mask[i] = (float)p[i];
-	        }
-	    }
-	    else
-	    {
-	        printf("Unknown data type in mask volume, aborting!\n");
-	        FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+		if (!ReadNiftiDataAsFloats(h_Mask, inputMask))
+		{
+			printf("Could not read the mask volume, aborting!\n");
+			FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
 			FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
-	        return EXIT_FAILURE;
-	    }
+			return EXIT_FAILURE;
+		}
 	}
 	// Mask is NOT provided by user, set all mask voxels to 1
 	else
@@ -1721,6 +1618,8 @@ int main(int argc, char **argv)
     // Initialization OK
     else
     {        
+		BROCCOLI.SetProfiling(PROFILE || (PROFILE_TRACE_FILENAME != NULL));
+
 		BROCCOLI.SetAllocatedHostMemory(allocatedHostMemory);
 
         BROCCOLI.SetNumberOfGLMRegressors(NUMBER_OF_GLM_REGRESSORS);
@@ -1854,6 +1753,8 @@ int main(int argc, char **argv)
 			printf("\nIt took %f seconds to run the GLM\n",(float)(endTime - startTime));
 		}
 
+        WriteProfilingResults(BROCCOLI, PROFILE, PROFILE_TRACE_FILENAME);
+
         // Print create buffer errors
         int* createBufferErrors = BROCCOLI.GetOpenCLCreateBufferErrors();
         for (int i = 0; i < BROCCOLI.GetNumberOfOpenCLKernels(); i++)
@@ -1950,7 +1851,14 @@ int main(int argc, char **argv)
 	    outputNifti->dim[4] = DATA_T;
 	    outputNifti->nvox = DATA_W * DATA_H * DATA_D * DATA_T;
 		
-		WriteNifti(outputNifti,h_Residuals,"_residuals",ADD_FILENAME,DONT_CHECK_EXISTING_FILE);
+		if (MASKED_OUTPUT)
+		{
+			WriteMaskedVolumes(outputNifti,h_Residuals,h_Mask,"_residuals",ADD_FILENAME);
+		}
+		else
+		{
+			WriteNifti(outputNifti,h_Residuals,"_residuals",ADD_FILENAME,DONT_CHECK_EXISTING_FILE);
+		}
 	}
 
 	outputNifti->nt = 1;
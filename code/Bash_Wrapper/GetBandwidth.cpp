@@ -32,6 +32,9 @@ int main(int argc, char **argv)
 	bool	FOUND_PLATFORM = false;
 	bool 	FOUND_DEVICE = false;
 
+	bool	PROFILE = false;
+	const char*	PROFILE_TRACE_FILENAME = NULL;
+
     // No inputs, so print help text
     if (argc == 1)
     {        
@@ -39,6 +42,8 @@ int main(int argc, char **argv)
         printf("GetBandwidthPerformance -platform x -device y\n\n");
         printf(" -platform           The OpenCL platform to use \n");
         printf(" -device             The OpenCL device to use for the specificed platform  \n");
+        printf(" -profile            Print the time and bytes of each OpenCL transfer (default false) \n");
+        printf(" -profiletrace       Write all OpenCL transfers to a Chrome trace file (chrome://tracing) (default none) \n");
         printf("\n\n");
         
         return EXIT_SUCCESS;
@@ -96,6 +101,22 @@ int main(int argc, char **argv)
             }
             i += 2;
         }
+        else if (strcmp(input,"-profile") == 0)
+        {
+            PROFILE = true;
+            i += 1;
+        }
+        else if (strcmp(input,"-profiletrace") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read name after -profiletrace !\n");
+                return EXIT_FAILURE;
+			}
+
+            PROFILE_TRACE_FILENAME = argv[i+1];
+            i += 2;
+        }
         else
         {
             printf("Unrecognized option! %s \n",argv[i]);
@@ -117,7 +138,19 @@ int main(int argc, char **argv)
 
 	BROCCOLI_LIB BROCCOLI(OPENCL_PLATFORM,OPENCL_DEVICE,2,false); // 2 = Bash wrapper
 
+	BROCCOLI.SetProfiling(PROFILE || (PROFILE_TRACE_FILENAME != NULL));
+
 	BROCCOLI.GetBandwidth();
+
+	if (PROFILE)
+	{
+		BROCCOLI.PrintProfilingSummary();
+	}
+
+	if ( (PROFILE_TRACE_FILENAME != NULL) && !BROCCOLI.WriteProfilingTrace(PROFILE_TRACE_FILENAME) )
+	{
+		printf("Could not write profiling trace %s !\n",PROFILE_TRACE_FILENAME);
+	}
     
             
     return EXIT_SUCCESS;
@@ -2,6 +2,11 @@
 #include <time.h>
 #include <string.h>
 #include <sys/time.h>
+#include <algorithm>
+#include "ParallelGzip.cpp"
+#include "MappedNifti.cpp"
+#include "AsyncNiftiWriter.cpp"
+#include "MaskedVolumes.cpp"
 
 void CheckFileExtension(const char* filename, bool& extensionOK, std::string& extension)
 {
@@ -196,7 +201,11 @@ void FreeAllMemory(void **pointers, int N)
     {
         if (pointers[i] != NULL)
         {
-            free(pointers[i]);
+            // Mapped input data is unmapped instead of freed
+            if (!UnmapNiftiData(pointers[i]))
+            {
+                free(pointers[i]);
+            }
         }
     }
 }
@@ -207,19 +216,37 @@ void FreeAllNiftiImages(nifti_image **niftiImages, int N)
     {
 		if (niftiImages[i] != NULL)
 		{
+			FreeNiftiData(niftiImages[i]);
 			nifti_image_free(niftiImages[i]);
 		}
     }
 }
 
+// When false, AllocateMemory and ReadBinaryFile count their errors in numberOfHostErrors instead of freeing all memory and exiting,
+// such that a program that analyzes several datasets can report the error and continue with the next dataset
+bool exitOnHostErrors = true;
+int numberOfHostErrors = 0;
+
+void HandleHostError(void** pointers, int Npointers, nifti_image** niftiImages, int Nimages)
+{
+	if (!exitOnHostErrors)
+	{
+		numberOfHostErrors++;
+		return;
+	}
+
+	FreeAllMemory(pointers,Npointers);
+	FreeAllNiftiImages(niftiImages,Nimages);
+	exit(EXIT_FAILURE);
+}
+
 void ReadBinaryFile(float* pointer, int size, const char* filename, void** pointers, int& Npointers, nifti_image** niftiImages, int Nimages)
 {
 	if (pointer == NULL)
     {
         printf("The provided pointer for file %s is NULL, aborting! \n",filename);
-        FreeAllMemory(pointers,Npointers);
-		FreeAllNiftiImages(niftiImages,Nimages);
-        exit(EXIT_FAILURE);
+		HandleHostError(pointers,Npointers,niftiImages,Nimages);
+		return;
 	}	
 
 	FILE *fp = NULL; 
@@ -227,15 +254,19 @@ void ReadBinaryFile(float* pointer, int size, const char* filename, void** point
 
     if (fp != NULL)
     {
-        fread(pointer,sizeof(float),size,fp);
+        size_t elements = fread(pointer,sizeof(float),size,fp);
         fclose(fp);
+
+		if (elements != (size_t)size)
+		{
+			printf("Could not read %i values from %s , aborting! \n",size,filename);
+			HandleHostError(pointers,Npointers,niftiImages,Nimages);
+		}
     }
     else
     {
         printf("Could not open %s , aborting! \n",filename);
-        FreeAllMemory(pointers,Npointers);
-		FreeAllNiftiImages(niftiImages,Nimages);
-        exit(EXIT_FAILURE);
+		HandleHostError(pointers,Npointers,niftiImages,Nimages);
     }
 }
 
@@ -252,9 +283,7 @@ void AllocateMemory(float *& pointer, size_t size, void** pointers, int& Npointe
     {
    		perror ("The following error occurred");
 	    printf("Could not allocate host memory for variable %s ! \n",variable);     
-	 	FreeAllMemory(pointers, Npointers);
-		FreeAllNiftiImages(niftiImages, Nimages);
-		exit(EXIT_FAILURE);        
+		HandleHostError(pointers, Npointers, niftiImages, Nimages);
     }
 }
 
@@ -271,9 +300,7 @@ void AllocateMemoryInt(unsigned short int *& pointer, size_t size, void** pointe
     {
 		perror ("The following error occurred");
         printf("Could not allocate host memory for variable %s ! \n",variable);        
-		FreeAllMemory(pointers, Npointers);
-		FreeAllNiftiImages(niftiImages, Nimages);
-		exit(EXIT_FAILURE);        
+		HandleHostError(pointers, Npointers, niftiImages, Nimages);
     }
 }
 
@@ -291,9 +318,7 @@ void AllocateMemoryFloat2(cl_float2 *& pointer, int size, void** pointers, int&
     {
 		perror ("The following error occurred");
         printf("Could not allocate host memory for variable %s ! \n",variable);        
-		FreeAllMemory(pointers, Npointers);
-		FreeAllNiftiImages(niftiImages, Nimages);
-		exit(EXIT_FAILURE);        
+		HandleHostError(pointers, Npointers, niftiImages, Nimages);
     }
 }
 
@@ -322,6 +347,53 @@ float mymin(float* data, int N)
 	return min;
 }
 
+// Drop in replacement for nifti_image_read(filename,1). Uncompressed float data is memory mapped, files written
+// by WriteNifti are decompressed in parallel. The data should be freed with FreeNiftiData or FreeAllNiftiImages.
+nifti_image* ReadNifti(const char* filename)
+{
+	nifti_image* inputNifti = nifti_image_read(filename,0);
+	if (inputNifti == NULL)
+	{
+		return NULL;
+	}
+
+	if (CanMapNiftiData(inputNifti) && MapNiftiData(inputNifti))
+	{
+		return inputNifti;
+	}
+
+	if (IsParallelGzipFile(inputNifti->iname))
+	{
+		inputNifti->data = malloc(inputNifti->nvox * inputNifti->nbyper);
+		if ( (inputNifti->data == NULL) || !ReadParallelGzipNiftiData(inputNifti, CopyNiftiBlock, NULL) )
+		{
+			nifti_image_free(inputNifti);
+			return NULL;
+		}
+		return inputNifti;
+	}
+
+	if (nifti_image_load(inputNifti) < 0)
+	{
+		nifti_image_free(inputNifti);
+		return NULL;
+	}
+
+	return inputNifti;
+}
+
+// Compressed files are written as blocks that are compressed in parallel, everything else through nifticlib
+bool WriteNiftiImage(nifti_image* outputNifti)
+{
+	if (CanWriteParallelGzipNifti(outputNifti))
+	{
+		return WriteParallelGzipNifti(outputNifti);
+	}
+
+	nifti_image_write(outputNifti);
+	return true;
+}
+
 bool WriteNifti(nifti_image* inputNifti, float* data, const char* filename, bool addFilename, bool checkFilename)
 {       
 	if (data == NULL)
@@ -380,27 +452,32 @@ bool WriteNifti(nifti_image* inputNifti, float* data, const char* filename, bool
 	outputNifti->cal_min = mymin(data,N);
 	outputNifti->cal_max = mymax(data,N);
 
-    // Change filename and write
+    // Change filename and write, or give the image to the background writers
     bool written = false;
+    bool queued = false;
     if (addFilename)
     {
         if ( nifti_set_filenames(outputNifti, filenameWithExtension, checkFilename, 1) == 0)
         {
-            nifti_image_write(outputNifti);
-            written = true;
+            queued = QueueNiftiImage(outputNifti);
+            written = queued || WriteNiftiImage(outputNifti);
         }
     }
     else if (!addFilename)
     {
         if ( nifti_set_filenames(outputNifti, filename, checkFilename, 1) == 0)
         {
-            nifti_image_write(outputNifti);
-            written = true;
+            queued = QueueNiftiImage(outputNifti);
+            written = queued || WriteNiftiImage(outputNifti);
         }                
     }    
     
-    outputNifti->data = NULL;
-    nifti_image_free(outputNifti);
+    // Queued images are freed by the writer
+    if (!queued)
+    {
+        outputNifti->data = NULL;
+        nifti_image_free(outputNifti);
+    }
 
     if (addFilename)
     {
@@ -428,3 +505,294 @@ double GetWallTime()
     return (double)time.tv_sec + (double)time.tv_usec * .000001;
 }
 
+// Prints the profiling summary (-profile) and writes the Chrome trace (-profiletrace) after the processing
+void WriteProfilingResults(BROCCOLI_LIB& BROCCOLI, bool PROFILE, const char* traceFilename)
+{
+	if (PROFILE)
+	{
+		BROCCOLI.PrintProfilingSummary();
+	}
+
+	if ( (traceFilename != NULL) && !BROCCOLI.WriteProfilingTrace(traceFilename) )
+	{
+		printf("Could not write profiling trace %s !\n",traceFilename);
+	}
+}
+
+
+// Size of each chunk read from disk, in bytes
+#define NIFTI_READ_CHUNK_SIZE (16*1024*1024)
+
+// Converts native typed nifti data to floats and applies the intensity scaling, simple enough for the compiler to vectorize
+template <typename T>
+void ConvertNiftiDataToFloats(float* destination, const void* source, size_t N, float slope, float intercept)
+{
+	const T* p = (const T*)source;
+	for (size_t i = 0; i < N; i++)
+	{
+		destination[i] = (float)p[i] * slope + intercept;
+	}
+}
+
+// Converts one chunk of any supported data type to floats
+void ConvertNiftiChunkToFloats(float* destination, const void* source, size_t N, int datatype, float slope, float intercept)
+{
+	switch (datatype)
+	{
+		case DT_UINT8:
+			ConvertNiftiDataToFloats<unsigned char>(destination, source, N, slope, intercept);
+			break;
+		case DT_INT8:
+			ConvertNiftiDataToFloats<signed char>(destination, source, N, slope, intercept);
+			break;
+		case DT_SIGNED_SHORT:
+			ConvertNiftiDataToFloats<short int>(destination, source, N, slope, intercept);
+			break;
+		case DT_UINT16:
+			ConvertNiftiDataToFloats<unsigned short int>(destination, source, N, slope, intercept);
+			break;
+		case DT_SIGNED_INT:
+			ConvertNiftiDataToFloats<int>(destination, source, N, slope, intercept);
+			break;
+		case DT_FLOAT:
+			ConvertNiftiDataToFloats<float>(destination, source, N, slope, intercept);
+			break;
+		case DT_DOUBLE:
+			ConvertNiftiDataToFloats<double>(destination, source, N, slope, intercept);
+			break;
+	}
+}
+
+struct NiftiFloatConversion
+{
+	float* destination;
+	float slope;
+	float intercept;
+};
+
+// Block handler for ReadParallelGzipNiftiData, converts each decompressed block into the float destination
+void ConvertNiftiBlockToFloats(void* block, size_t firstElement, size_t elements, nifti_image* inputNifti, void* userData)
+{
+	NiftiFloatConversion* conversion = (NiftiFloatConversion*)userData;
+	ConvertNiftiChunkToFloats(conversion->destination + firstElement, block, elements, inputNifti->datatype, conversion->slope, conversion->intercept);
+}
+
+// A slope of 0 means that the data should not be scaled
+void GetNiftiScaling(nifti_image* inputNifti, float& slope, float& intercept)
+{
+	slope = 1.0f;
+	intercept = 0.0f;
+	if (inputNifti->scl_slope != 0.0f)
+	{
+		slope = inputNifti->scl_slope;
+		intercept = inputNifti->scl_inter;
+	}
+}
+
+// Reads the data of a nifti file in chunks, and converts it to floats directly into the destination buffer,
+// such that there is never a second copy of the whole dataset. The nifti image should be read without data,
+// i.e. nifti_image_read(filename,0). For several runs, destination can point at the accumulated offset of each run.
+// Files written by WriteNifti are decompressed in parallel, for other files the next chunk is read and decompressed
+// while the current chunk is converted.
+bool ReadNiftiDataAsFloats(float* destination, nifti_image* inputNifti)
+{
+	if (destination == NULL)
+	{
+		printf("The provided pointer for file %s is NULL, aborting! \n",inputNifti->iname);
+		return false;
+	}
+
+	if ( (inputNifti->datatype != DT_UINT8) && (inputNifti->datatype != DT_INT8) && (inputNifti->datatype != DT_SIGNED_SHORT) && (inputNifti->datatype != DT_UINT16) && (inputNifti->datatype != DT_SIGNED_INT) && (inputNifti->datatype != DT_FLOAT) && (inputNifti->datatype != DT_DOUBLE) )
+	{
+		printf("Unknown data type in %s !\n",inputNifti->iname);
+		return false;
+	}
+
+	float slope, intercept;
+	GetNiftiScaling(inputNifti, slope, intercept);
+
+	if (IsParallelGzipFile(inputNifti->iname))
+	{
+		NiftiFloatConversion conversion;
+		conversion.destination = destination;
+		conversion.slope = slope;
+		conversion.intercept = intercept;
+		return ReadParallelGzipNiftiData(inputNifti, ConvertNiftiBlockToFloats, &conversion);
+	}
+
+	znzFile fp = znzopen(inputNifti->iname, "rb", nifti_is_gzfile(inputNifti->iname));
+	if (znz_isnull(fp))
+	{
+		printf("Could not open %s for reading !\n",inputNifti->iname);
+		return false;
+	}
+
+	if (znzseek(fp, (long)inputNifti->iname_offset, SEEK_SET) < 0)
+	{
+		printf("Could not find the start of the data in %s !\n",inputNifti->iname);
+		znzclose(fp);
+		return false;
+	}
+
+	size_t N = inputNifti->nvox;
+	size_t bytesPerElement = inputNifti->nbyper;
+	bool success = true;
+
+	if (inputNifti->datatype == DT_FLOAT)
+	{
+		// Data is already in float format, read it in place
+		for (size_t start = 0; start < N; start += NIFTI_READ_CHUNK_SIZE/sizeof(float))
+		{
+			size_t elements = std::min((size_t)(NIFTI_READ_CHUNK_SIZE/sizeof(float)), N - start);
+			if (nifti_read_buffer(fp, destination + start, elements * sizeof(float), inputNifti) != (elements * sizeof(float)))
+			{
+				success = false;
+				break;
+			}
+			if ( (slope != 1.0f) || (intercept != 0.0f) )
+			{
+				ConvertNiftiDataToFloats<float>(destination + start, destination + start, elements, slope, intercept);
+			}
+		}
+	}
+	else
+	{
+		// Two chunks, one is read while the other one is converted
+		size_t elementsPerChunk = NIFTI_READ_CHUNK_SIZE / bytesPerElement;
+		void* chunks[2];
+		chunks[0] = malloc(elementsPerChunk * bytesPerElement);
+		chunks[1] = malloc(elementsPerChunk * bytesPerElement);
+		if ( (chunks[0] == NULL) || (chunks[1] == NULL) )
+		{
+			printf("Could not allocate host memory for reading %s !\n",inputNifti->iname);
+			free(chunks[0]);
+			free(chunks[1]);
+			znzclose(fp);
+			return false;
+		}
+
+		size_t numberOfChunks = (N + elementsPerChunk - 1) / elementsPerChunk;
+		if (numberOfChunks > 0)
+		{
+			size_t elements = std::min(elementsPerChunk, N);
+			success = (nifti_read_buffer(fp, chunks[0], elements * bytesPerElement, inputNifti) == (elements * bytesPerElement));
+		}
+
+		for (size_t chunk = 0; success && (chunk < numberOfChunks); chunk++)
+		{
+			size_t start = chunk * elementsPerChunk;
+			size_t elements = std::min(elementsPerChunk, N - start);
+			size_t nextStart = start + elementsPerChunk;
+			bool readOK = true;
+
+			#pragma omp parallel sections num_threads(2)
+			{
+				#pragma omp section
+				{
+					if (nextStart < N)
+					{
+						size_t nextElements = std::min(elementsPerChunk, N - nextStart);
+						readOK = (nifti_read_buffer(fp, chunks[(chunk + 1) % 2], nextElements * bytesPerElement, inputNifti) == (nextElements * bytesPerElement));
+					}
+				}
+				#pragma omp section
+				{
+					ConvertNiftiChunkToFloats(destination + start, chunks[chunk % 2], elements, inputNifti->datatype, slope, intercept);
+				}
+			}
+
+			success = readOK;
+		}
+
+		free(chunks[0]);
+		free(chunks[1]);
+	}
+
+	znzclose(fp);
+
+	if (!success)
+	{
+		printf("Could not read all the data in %s !\n",inputNifti->iname);
+	}
+
+	return success;
+}
+
+// Gets the data of a nifti image read without data as floats. Uncompressed float data without intensity scaling are memory mapped,
+// other data are read in chunks and converted into new memory. The pointer is added to the pointer list, such that it is unmapped
+// or freed by FreeAllMemory. Returns NULL if the data could not be read.
+float* ReadNiftiAsFloats(nifti_image* inputNifti, void** pointers, int& Npointers, size_t& allocatedMemory)
+{
+	size_t size = inputNifti->nvox * sizeof(float);
+	float* data;
+
+	if ( CanMapNiftiData(inputNifti) && ( (inputNifti->scl_slope == 0.0f) || ((inputNifti->scl_slope == 1.0f) && (inputNifti->scl_inter == 0.0f)) ) && MapNiftiData(inputNifti) )
+	{
+		data = (float*)inputNifti->data;
+		inputNifti->data = NULL;
+	}
+	else
+	{
+		data = (float*)malloc(size);
+		if (data == NULL)
+		{
+			perror ("The following error occurred");
+			printf("Could not allocate host memory for %s ! \n",inputNifti->iname);
+			return NULL;
+		}
+
+		if (!ReadNiftiDataAsFloats(data, inputNifti))
+		{
+			free(data);
+			return NULL;
+		}
+	}
+
+	pointers[Npointers] = (void*)data;
+	Npointers++;
+	allocatedMemory += size;
+
+	return data;
+}
+
+// Reads the voxels firstVoxel ... firstVoxel + numberOfVoxels - 1 of the volumes firstVolume ... firstVolume + numberOfVolumes - 1
+// from an uncompressed nifti file, and converts them to floats. Volume t is stored at destination + (t - firstVolume) * numberOfVoxels
+bool ReadNiftiVoxelsAsFloats(float* destination, znzFile fp, nifti_image* inputNifti, size_t firstVoxel, size_t numberOfVoxels, size_t firstVolume, size_t numberOfVolumes, std::vector<unsigned char>& buffer)
+{
+	float slope, intercept;
+	GetNiftiScaling(inputNifti, slope, intercept);
+
+	size_t voxelsPerVolume = (size_t)inputNifti->nx * inputNifti->ny * inputNifti->nz;
+	size_t bytes = numberOfVoxels * inputNifti->nbyper;
+	buffer.resize(bytes);
+
+	for (size_t t = firstVolume; t < firstVolume + numberOfVolumes; t++)
+	{
+		long offset = (long)(inputNifti->iname_offset + (t * voxelsPerVolume + firstVoxel) * inputNifti->nbyper);
+
+		// nifti_read_buffer swaps the bytes if needed and removes non-finite values
+		if ( (znzseek(fp, offset, SEEK_SET) < 0) || (nifti_read_buffer(fp, &buffer[0], bytes, inputNifti) != bytes) )
+		{
+			printf("Could not read voxels %zu to %zu of volume %zu in %s !\n",firstVoxel,firstVoxel + numberOfVoxels - 1,t,inputNifti->iname);
+			return false;
+		}
+
+		ConvertNiftiChunkToFloats(destination + (t - firstVolume) * numberOfVoxels, &buffer[0], numberOfVoxels, inputNifti->datatype, slope, intercept);
+	}
+
+	return true;
+}
+
+struct NiftiVoxelReader
+{
+	nifti_image* inputNifti;
+	znzFile fp;
+	std::vector<unsigned char> buffer;
+};
+
+// Voxel reader for BROCCOLI_LIB, gives the time series of a range of voxels from the file
+bool ReadNiftiTimeSeries(float* data, size_t firstVoxel, size_t numberOfVoxels, void* userData)
+{
+	NiftiVoxelReader* reader = (NiftiVoxelReader*)userData;
+	return ReadNiftiVoxelsAsFloats(data, reader->fp, reader->inputNifti, firstVoxel, numberOfVoxels, 0, reader->inputNifti->nt, reader->buffer);
+}
@@ -43,6 +43,7 @@ int main(int argc, char ** argv)
     
     float           *h_fMRI_Volumes = NULL;
 	float			*h_EPI_Mask = NULL;
+	float			*h_ICA_Components = NULL;
 
     float           *h_Quadrature_Filter_1_Real = NULL;
     float           *h_Quadrature_Filter_2_Real = NULL;
@@ -82,6 +83,8 @@ int main(int argc, char ** argv)
     const char*     FILENAME_EXTENSION = "_ica";
     bool            PRINT = true;
 	bool			VERBOS = false;
+	bool			PROFILE = false;
+	const char*		PROFILE_TRACE_FILENAME = NULL;
     
 	bool			CHANGE_OUTPUT_FILENAME = false;
 
@@ -96,6 +99,10 @@ int main(int argc, char ** argv)
 	size_t			NUMBER_OF_ICA_COMPONENTS = 55;
 
 	double			PROPORTION_OF_VARIANCE_TO_SAVE_BEFORE_ICA = 80.0;
+	int				PCA_METHOD = PCA_FULL;
+	bool			STREAMING = false;
+	int				ALGORITHM = ICA_INFOMAX;
+	int				NONLINEARITY = FASTICA_LOGCOSH;
 
     //-----------------------
     // Output parameters
@@ -117,12 +124,18 @@ int main(int argc, char ** argv)
         printf(" -platform           The OpenCL platform to use (default 0) \n");
         printf(" -device             The OpenCL device to use for the specificed platform (default 0) \n");
         printf(" -var                Proportion of variance to save before ICA (default 80 %%) \n");
+        printf(" -randomizedpca      Estimate only the leading PCA components with a randomized method, faster for long time series (default false) \n");
+        printf(" -streaming          Read the data from the file in chunks of voxels during the whitening, only one chunk is in memory, needs an uncompressed .nii file and can not be combined with -double (default false) \n");
+        printf(" -algorithm          The ICA algorithm to use, 0 = Infomax, 1 = FastICA (default 0) \n");
+        printf(" -nonlinearity       The nonlinearity for FastICA, 0 = logcosh, 1 = exp (default 0) \n");
 		printf(" -mask               Provide a spatial mask (default false) \n");
 		printf(" -zscore             Z-score each time series before ICA (default false) \n");
 		printf(" -cpu	             Use the CPU only (default false) \n");
 		printf(" -double             Use double precision (default false) \n");
         printf(" -output             Set output filename (default input_ica.nii) \n");
         printf(" -quiet              Don't print anything to the terminal (default false) \n");
+        printf(" -profile            Print the time and bytes of each OpenCL kernel and transfer (default false) \n");
+        printf(" -profiletrace       Write all OpenCL kernels and transfers to a Chrome trace file (chrome://tracing) (default none) \n");
         printf(" -verbose            Print extra stuff (default false) \n");
         printf("\n\n");
         
@@ -231,6 +244,60 @@ int main(int argc, char ** argv)
             MASK_NAME = argv[i+1];
             i += 2;
         }
+        else if (strcmp(input,"-randomizedpca") == 0)
+        {
+            PCA_METHOD = PCA_RANDOMIZED;
+            i += 1;
+        }
+        else if (strcmp(input,"-streaming") == 0)
+        {
+            STREAMING = true;
+            i += 1;
+        }
+        else if (strcmp(input,"-algorithm") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read value after -algorithm !\n");
+                return EXIT_FAILURE;
+			}
+
+            ALGORITHM = (int)strtol(argv[i+1], &p, 10);
+
+			if (!isspace(*p) && *p != 0)
+		    {
+		        printf("ICA algorithm must be an integer! You provided %s \n",argv[i+1]);
+				return EXIT_FAILURE;
+		    }
+			if ( (ALGORITHM != 0) && (ALGORITHM != 1) )
+            {
+			    printf("ICA algorithm has to be 0 or 1!\n");
+                return EXIT_FAILURE;          	
+			}
+            i += 2;
+        }
+        else if (strcmp(input,"-nonlinearity") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read value after -nonlinearity !\n");
+                return EXIT_FAILURE;
+			}
+
+            NONLINEARITY = (int)strtol(argv[i+1], &p, 10);
+
+			if (!isspace(*p) && *p != 0)
+		    {
+		        printf("Nonlinearity must be an integer! You provided %s \n",argv[i+1]);
+				return EXIT_FAILURE;
+		    }
+			if ( (NONLINEARITY != 0) && (NONLINEARITY != 1) )
+            {
+			    printf("Nonlinearity has to be 0 or 1!\n");
+                return EXIT_FAILURE;          	
+			}
+            i += 2;
+        }
         else if (strcmp(input,"-zscore") == 0)
         {
             Z_SCORE = true;
@@ -256,6 +323,22 @@ int main(int argc, char ** argv)
             PRINT = false;
             i += 1;
         }
+        else if (strcmp(input,"-profile") == 0)
+        {
+            PROFILE = true;
+            i += 1;
+        }
+        else if (strcmp(input,"-profiletrace") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read name after -profiletrace !\n");
+                return EXIT_FAILURE;
+			}
+
+            PROFILE_TRACE_FILENAME = argv[i+1];
+            i += 2;
+        }
         else if (strcmp(input,"-verbose") == 0)
         {
             VERBOS = true;
@@ -281,6 +364,12 @@ int main(int argc, char ** argv)
         }                
     }
     
+	if (STREAMING && DOUBLEPRECISION)
+	{
+		printf("-streaming can not be combined with -double !\n");
+		return EXIT_FAILURE;
+	}
+
 	// Check if BROCCOLI_DIR variable is set
 	if (getenv("BROCCOLI_DIR") == NULL)
 	{
@@ -293,7 +382,8 @@ int main(int argc, char ** argv)
 	// ---------------------
     // Read data
 	// ---------------------
-    nifti_image *inputData = nifti_image_read(argv[1],1);
+	// Only the header is read here, for streaming the data are read in chunks during the ICA
+    nifti_image *inputData = nifti_image_read(argv[1],0);
     
     if (inputData == NULL)
     {
@@ -303,6 +393,13 @@ int main(int argc, char ** argv)
     allNiftiImages[numberOfNiftiImages] = inputData;
 	numberOfNiftiImages++;
 
+	if (STREAMING && nifti_is_gzfile(inputData->iname))
+	{
+		printf("-streaming needs an uncompressed nifti file, a compressed file can not be read in chunks of voxels !\n");
+		FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+		return EXIT_FAILURE;
+	}
+
 	// -----------------------    
     // Read mask
 	// -----------------------
@@ -310,7 +407,7 @@ int main(int argc, char ** argv)
     nifti_image *inputMask;
     if (MASK)
     {
-        inputMask = nifti_image_read(MASK_NAME,1);
+        inputMask = nifti_image_read(MASK_NAME,0);
         if (inputMask == NULL)
         {
             printf("Could not open mask volume!\n");
@@ -360,7 +457,6 @@ int main(int argc, char ** argv)
 	}
    	
     // Calculate size, in bytes
-    size_t DATA_SIZE = DATA_W * DATA_H * DATA_D * DATA_T * sizeof(float);
     size_t VOLUME_SIZE = DATA_W * DATA_H * DATA_D * sizeof(float);
 
     // Print some info
@@ -377,14 +473,10 @@ int main(int argc, char ** argv)
     
 	startTime = GetWallTime();
 
-	// If the data is in float format, we can just copy the pointer
-	if ( inputData->datatype != DT_FLOAT )
+	// For streaming, only the first volume is kept in memory (for the automatic mask)
+	if (STREAMING)
 	{
-		AllocateMemory(h_fMRI_Volumes, DATA_SIZE, allMemoryPointers, numberOfMemoryPointers, allNiftiImages, numberOfNiftiImages, allocatedHostMemory, "INPUT_DATA");
-	}
-	else
-	{
-		allocatedHostMemory += DATA_SIZE;
+		AllocateMemory(h_fMRI_Volumes, VOLUME_SIZE, allMemoryPointers, numberOfMemoryPointers, allNiftiImages, numberOfNiftiImages, allocatedHostMemory, "INPUT_DATA");
 	}
 	AllocateMemory(h_EPI_Mask, VOLUME_SIZE, allMemoryPointers, numberOfMemoryPointers, allNiftiImages, numberOfNiftiImages, allocatedHostMemory, "EPI_MASK");
 
@@ -397,117 +489,60 @@ int main(int argc, char ** argv)
 
 	startTime = GetWallTime();
 
-    // Convert data to floats
-    if ( inputData->datatype == DT_SIGNED_SHORT )
-    {
-        short int *p = (short int*)inputData->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * DATA_T; i++)
-        {
-            h_fMRI_Volumes[i] = (float)p[i];
-        }
-    }
-    else if ( inputData->datatype == DT_UINT8 )
-    {
-        unsigned char *p = (unsigned char*)inputData->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * DATA_T; i++)
-        {
-            h_fMRI_Volumes[i] = (float)p[i];
-        }
-    }
-    else if ( inputData->datatype == DT_UINT16 )
-    {
-        unsigned short int *p = (unsigned short int*)inputData->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * DATA_T; i++)
-        {
-            h_fMRI_Volumes[i] = (float)p[i];
-        }
-    }
-	// Correct data type, just copy the pointer
-	else if ( inputData->datatype == DT_FLOAT )
-    {
-		h_fMRI_Volumes = (float*)inputData->data;
-
-		// Save the pointer in the pointer list
-		allMemoryPointers[numberOfMemoryPointers] = (void*)h_fMRI_Volumes;
-        numberOfMemoryPointers++;		
+	NiftiVoxelReader voxelReader;
+	if (STREAMING)
+	{
+		voxelReader.inputNifti = inputData;
+		voxelReader.fp = znzopen(inputData->iname, "rb", 0);
+		if (znz_isnull(voxelReader.fp))
+		{
+			printf("Could not open %s for reading !\n",inputData->iname);
+			FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+			FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+			return EXIT_FAILURE;
+		}
 
-        //float *p = (float*)inputData->data;
-    
-        //for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * DATA_T; i++)
-        //{
-        //    h_fMRI_Volumes[i] = p[i];
-        //}
-    }
-    else
-    {
-        printf("Unknown data type in input data, aborting!\n");
-        FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
-        FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
-        return EXIT_FAILURE;
-    }
+		if ( (inputData->datatype != DT_UINT8) && (inputData->datatype != DT_INT8) && (inputData->datatype != DT_SIGNED_SHORT) && (inputData->datatype != DT_UINT16) && (inputData->datatype != DT_SIGNED_INT) && (inputData->datatype != DT_FLOAT) && (inputData->datatype != DT_DOUBLE) )
+		{
+			printf("Unknown data type in input data, aborting!\n");
+			znzclose(voxelReader.fp);
+			FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+			FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+			return EXIT_FAILURE;
+		}
 
-	// Free input fMRI data, it has been converted to floats
-	if ( inputData->datatype != DT_FLOAT )
-	{		
-		free(inputData->data);
-		inputData->data = NULL;
+		if (!ReadNiftiVoxelsAsFloats(h_fMRI_Volumes, voxelReader.fp, inputData, 0, DATA_W * DATA_H * DATA_D, 0, 1, voxelReader.buffer))
+		{
+			znzclose(voxelReader.fp);
+			FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+			FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+			return EXIT_FAILURE;
+		}
 	}
-	// Pointer has been copied to h_fMRI_Volumes and pointer list, so set the input data pointer to NULL
 	else
-	{		
-		inputData->data = NULL;
+	{
+		// Read the data in chunks and convert to floats, float data is memory mapped
+		h_fMRI_Volumes = ReadNiftiAsFloats(inputData, allMemoryPointers, numberOfMemoryPointers, allocatedHostMemory);
+		if (h_fMRI_Volumes == NULL)
+		{
+			printf("Could not read the input data, aborting!\n");
+			FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+			FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+			return EXIT_FAILURE;
+		}
 	}
     
 
 	// Mask is provided by user
 	if (MASK)
 	{
-	    if ( inputMask->datatype == DT_SIGNED_SHORT )
-	    {
-	        short int *p = (short int*)inputMask->data;
-    
-	        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-	        {
-	            h_EPI_Mask[i] = (float)p[i];
-	        }
-	    }
-	    else if ( inputMask->datatype == DT_UINT16 )
-	    {
-	        unsigned short int *p = (unsigned short int*)inputMask->data;
-    
-	        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-        	{
-	            h_EPI_Mask[i] = (float)p[i];
-	        }
-	    }
-	    else if ( inputMask->datatype == DT_FLOAT )
-	    {
-	        float *p = (float*)inputMask->data;
-    
-	        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-        	{
-	            h_EPI_Mask[i] = p[i];
-	        }
-	    }
-	    else if ( inputMask->datatype == DT_UINT8 )
-	    {
-    	    unsigned char *p = (unsigned char*)inputMask->data;
-    
-	        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-	        {
-	            h_EPI_Mask[i] = (float)p[i];
-	        }
-	    }
-	    else
-	    {
-	        printf("Unknown data type in mask volume, aborting!\n");
-	        FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+		if (!ReadNiftiDataAsFloats(h_EPI_Mask, inputMask))
+		{
+			printf("Could not read the mask volume, aborting!\n");
+			FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
 			FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
-	        return EXIT_FAILURE;
-	    }
+			return EXIT_FAILURE;
+		}
 	}
 
 
@@ -590,6 +625,10 @@ int main(int argc, char ** argv)
         }                        
                 
         printf("OpenCL initialization failed, aborting! \nSee buildInfo* for output of OpenCL compilation!\n");      
+		if (STREAMING)
+		{
+			znzclose(voxelReader.fp);
+		}
         FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
         FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
         return EXIT_FAILURE;
@@ -597,6 +636,8 @@ int main(int argc, char ** argv)
     // Initialization OK
     else
     {
+        BROCCOLI.SetProfiling(PROFILE || (PROFILE_TRACE_FILENAME != NULL));
+
         // Set all necessary pointers and values
         BROCCOLI.SetInputfMRIVolumes(h_fMRI_Volumes);
         BROCCOLI.SetEPIWidth(DATA_W);
@@ -613,6 +654,14 @@ int main(int argc, char ** argv)
           
 		BROCCOLI.SetVarianceToSaveBeforeICA(PROPORTION_OF_VARIANCE_TO_SAVE_BEFORE_ICA);                  
 		BROCCOLI.SetNumberOfICAComponents(NUMBER_OF_ICA_COMPONENTS);
+		BROCCOLI.SetPCAMethod(PCA_METHOD);
+		BROCCOLI.SetICAStreaming(STREAMING);
+		if (STREAMING)
+		{
+			BROCCOLI.SetICAVoxelReader(ReadNiftiTimeSeries, &voxelReader);
+		}
+		BROCCOLI.SetICAAlgorithm(ALGORITHM);
+		BROCCOLI.SetFastICANonlinearity(NONLINEARITY);
    
         // Run the actual ICA
 		startTime = GetWallTime();   
@@ -645,6 +694,29 @@ int main(int argc, char ** argv)
 			printf("\nIt took %f seconds to run the ICA\n",(float)(endTime - startTime));
 		}    
 
+		if (STREAMING)
+		{
+			znzclose(voxelReader.fp);
+
+			// The reader has printed the error
+			if (BROCCOLI.GetNumberOfICAComponents() == 0)
+			{
+				FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+				FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+				return EXIT_FAILURE;
+			}
+
+			// The input volumes only hold the first volume, get the components in new memory
+			AllocateMemory(h_ICA_Components, VOLUME_SIZE * BROCCOLI.GetNumberOfICAComponents(), allMemoryPointers, numberOfMemoryPointers, allNiftiImages, numberOfNiftiImages, allocatedHostMemory, "ICA_COMPONENTS");
+			BROCCOLI.GetICAComponents(h_ICA_Components);
+		}
+		else
+		{
+			h_ICA_Components = h_fMRI_Volumes;
+		}
+
+        WriteProfilingResults(BROCCOLI, PROFILE, PROFILE_TRACE_FILENAME);
+
         // Print create buffer errors
         int* createBufferErrors = BROCCOLI.GetOpenCLCreateBufferErrors();
         for (int i = 0; i < BROCCOLI.GetNumberOfOpenCLKernels(); i++)
@@ -689,12 +761,12 @@ int main(int argc, char ** argv)
 
 	if (!CHANGE_OUTPUT_FILENAME)
 	{
-	    WriteNifti(outputData,h_fMRI_Volumes,FILENAME_EXTENSION,ADD_FILENAME,DONT_CHECK_EXISTING_FILE);
+	    WriteNifti(outputData,h_ICA_Components,FILENAME_EXTENSION,ADD_FILENAME,DONT_CHECK_EXISTING_FILE);
 	}
 	else
 	{
 		nifti_set_filenames(outputData, outputFilename, 0, 1);
-		WriteNifti(outputData,h_fMRI_Volumes,"",DONT_ADD_FILENAME,DONT_CHECK_EXISTING_FILE);
+		WriteNifti(outputData,h_ICA_Components,"",DONT_ADD_FILENAME,DONT_CHECK_EXISTING_FILE);
 	}
 
 	endTime = GetWallTime();
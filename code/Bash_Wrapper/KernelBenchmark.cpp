@@ -0,0 +1,476 @@
+/*
+ * BROCCOLI: Software for fast fMRI analysis on many-core CPUs and GPUs
+ * Copyright (C) <2013>  Anders Eklund, andek034@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "broccoli_lib.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+
+// Reads the benchmark times (in seconds) from a file written with -output, one benchmark per line
+bool ReadBaseline(const char* filename, std::map<std::string,double>& times, int* size)
+{
+	std::ifstream file(filename);
+	if (!file.good())
+	{
+		return false;
+	}
+
+	std::string line;
+	while (std::getline(file, line))
+	{
+		const char* sizeStart = strstr(line.c_str(), "\"size\": [");
+		if (sizeStart != NULL)
+		{
+			sscanf(sizeStart, "\"size\": [%d, %d, %d, %d]", &size[0], &size[1], &size[2], &size[3]);
+		}
+
+		const char* nameStart = strstr(line.c_str(), "\"name\": \"");
+		const char* timeStart = strstr(line.c_str(), "\"time\": ");
+		if ((nameStart != NULL) && (timeStart != NULL))
+		{
+			nameStart += strlen("\"name\": \"");
+			const char* nameEnd = strchr(nameStart, '"');
+			if (nameEnd != NULL)
+			{
+				times[std::string(nameStart, nameEnd - nameStart)] = atof(timeStart + strlen("\"time\": "));
+			}
+		}
+	}
+
+	return true;
+}
+
+// Escapes quotes, backslashes and control characters, for strings in the JSON output
+std::string EscapeJSON(const char* text)
+{
+	std::string escaped;
+	for (const char* c = text; *c != '\0'; c++)
+	{
+		if ((*c == '"') || (*c == '\\'))
+		{
+			escaped += '\\';
+			escaped += *c;
+		}
+		else if ((unsigned char)*c < 0x20)
+		{
+			char code[8];
+			sprintf(code, "\\u%04x", (unsigned int)(unsigned char)*c);
+			escaped += code;
+		}
+		else
+		{
+			escaped += *c;
+		}
+	}
+	return escaped;
+}
+
+bool WriteBenchmarks(const char* filename, BROCCOLI_LIB& BROCCOLI, std::vector<KernelBenchmark>& benchmarks, int DATA_W, int DATA_H, int DATA_D, int DATA_T, int WARMUP, int REPETITIONS)
+{
+	FILE* fp = fopen(filename, "w");
+	if (fp == NULL)
+	{
+		return false;
+	}
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"platform\": \"%s\",\n", EscapeJSON(BROCCOLI.GetOpenCLPlatformName()).c_str());
+	fprintf(fp, "  \"device\": \"%s\",\n", EscapeJSON(BROCCOLI.GetOpenCLDeviceName()).c_str());
+	fprintf(fp, "  \"size\": [%i, %i, %i, %i],\n", DATA_W, DATA_H, DATA_D, DATA_T);
+	fprintf(fp, "  \"warmup\": %i,\n", WARMUP);
+	fprintf(fp, "  \"repetitions\": %i,\n", REPETITIONS);
+	fprintf(fp, "  \"benchmarks\": [\n");
+	for (size_t b = 0; b < benchmarks.size(); b++)
+	{
+		fprintf(fp, "    {\"name\": \"%s\", \"time\": %.9f, \"bytes\": %.0f, \"flops\": %.0f}%s\n", EscapeJSON(benchmarks[b].name.c_str()).c_str(), benchmarks[b].time, benchmarks[b].bytes, benchmarks[b].flops, (b + 1 < benchmarks.size()) ? "," : "");
+	}
+	fprintf(fp, "  ]\n");
+	fprintf(fp, "}\n");
+
+	fclose(fp);
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+    // Default parameters
+    int     OPENCL_PLATFORM = 0;
+    int     OPENCL_DEVICE = 0;
+
+	bool	FOUND_PLATFORM = false;
+	bool 	FOUND_DEVICE = false;
+
+	int		DATA_W = 64;
+	int		DATA_H = 64;
+	int		DATA_D = 33;
+	int		DATA_T = 200;
+
+	int		WARMUP = 2;
+	int		REPETITIONS = 10;
+
+	const char*	OUTPUT_FILENAME = NULL;
+	const char*	BASELINE_FILENAME = NULL;
+	float	TOLERANCE = 10.0f;
+
+	bool	VERBOS = false;
+
+    // No inputs, so print help text
+    if (argc == 1)
+    {
+        printf("Usage:\n\n");
+        printf("KernelBenchmark -platform x -device y [options]\n\n");
+        printf("Options:\n\n");
+        printf(" -platform           The OpenCL platform to use \n");
+        printf(" -device             The OpenCL device to use for the specificed platform  \n");
+        printf(" -size               Size of the synthetic fMRI data, width height depth timepoints (default 64 64 33 200) \n");
+        printf(" -warmup             Number of runs of each kernel before the timing starts (default 2) \n");
+        printf(" -repetitions        Number of timed runs of each kernel (default 10) \n");
+        printf(" -output             Write the results to a JSON file, which can be used as a baseline (default none) \n");
+        printf(" -baseline           Compare the results to a JSON file written with -output (default none) \n");
+        printf(" -tolerance          Allowed slowdown in percent compared to the baseline (default 10) \n");
+        printf(" -verbose            Print extra stuff (default false) \n");
+        printf("\n\n");
+
+        return EXIT_SUCCESS;
+    }
+
+ 	// Loop over additional inputs
+    int i = 1;
+    while (i < argc)
+    {
+        char *input = argv[i];
+        char *p;
+        if (strcmp(input,"-platform") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read value after -platform !\n");
+                return EXIT_FAILURE;
+			}
+
+            OPENCL_PLATFORM = (int)strtol(argv[i+1], &p, 10);
+			FOUND_PLATFORM = true;
+
+			if (!isspace(*p) && *p != 0)
+		    {
+		        printf("OpenCL platform must be an integer! You provided %s \n",argv[i+1]);
+				return EXIT_FAILURE;
+		    }
+            else if (OPENCL_PLATFORM < 0)
+            {
+                printf("OpenCL platform must be >= 0!\n");
+                return EXIT_FAILURE;
+            }
+            i += 2;
+        }
+        else if (strcmp(input,"-device") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read value after -device !\n");
+                return EXIT_FAILURE;
+			}
+
+            OPENCL_DEVICE = (int)strtol(argv[i+1], &p, 10);
+			FOUND_DEVICE = true;
+
+			if (!isspace(*p) && *p != 0)
+		    {
+		        printf("OpenCL device must be an integer! You provided %s \n",argv[i+1]);
+				return EXIT_FAILURE;
+		    }
+            else if (OPENCL_DEVICE < 0)
+            {
+                printf("OpenCL device must be >= 0!\n");
+                return EXIT_FAILURE;
+            }
+            i += 2;
+        }
+        else if (strcmp(input,"-size") == 0)
+        {
+			if ( (i+4) >= argc  )
+			{
+			    printf("Unable to read four values after -size !\n");
+                return EXIT_FAILURE;
+			}
+
+			int* sizes[4] = {&DATA_W, &DATA_H, &DATA_D, &DATA_T};
+			for (int s = 0; s < 4; s++)
+			{
+	            *sizes[s] = (int)strtol(argv[i+1+s], &p, 10);
+
+				if (!isspace(*p) && *p != 0)
+			    {
+			        printf("Size must be an integer! You provided %s \n",argv[i+1+s]);
+					return EXIT_FAILURE;
+			    }
+	            else if (*sizes[s] <= 0)
+	            {
+	                printf("Size must be > 0!\n");
+	                return EXIT_FAILURE;
+	            }
+			}
+            i += 5;
+        }
+        else if (strcmp(input,"-warmup") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read value after -warmup !\n");
+                return EXIT_FAILURE;
+			}
+
+            WARMUP = (int)strtol(argv[i+1], &p, 10);
+
+			if (!isspace(*p) && *p != 0)
+		    {
+		        printf("Number of warmup runs must be an integer! You provided %s \n",argv[i+1]);
+				return EXIT_FAILURE;
+		    }
+            else if (WARMUP < 0)
+            {
+                printf("Number of warmup runs must be >= 0!\n");
+                return EXIT_FAILURE;
+            }
+            i += 2;
+        }
+        else if (strcmp(input,"-repetitions") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read value after -repetitions !\n");
+                return EXIT_FAILURE;
+			}
+
+            REPETITIONS = (int)strtol(argv[i+1], &p, 10);
+
+			if (!isspace(*p) && *p != 0)
+		    {
+		        printf("Number of repetitions must be an integer! You provided %s \n",argv[i+1]);
+				return EXIT_FAILURE;
+		    }
+            else if (REPETITIONS <= 0)
+            {
+                printf("Number of repetitions must be > 0!\n");
+                return EXIT_FAILURE;
+            }
+            i += 2;
+        }
+        else if (strcmp(input,"-output") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read name after -output !\n");
+                return EXIT_FAILURE;
+			}
+
+            OUTPUT_FILENAME = argv[i+1];
+            i += 2;
+        }
+        else if (strcmp(input,"-baseline") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read name after -baseline !\n");
+                return EXIT_FAILURE;
+			}
+
+            BASELINE_FILENAME = argv[i+1];
+            i += 2;
+        }
+        else if (strcmp(input,"-tolerance") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read value after -tolerance !\n");
+                return EXIT_FAILURE;
+			}
+
+            TOLERANCE = (float)strtod(argv[i+1], &p);
+
+			if (!isspace(*p) && *p != 0)
+		    {
+		        printf("Tolerance must be a float! You provided %s \n",argv[i+1]);
+				return EXIT_FAILURE;
+		    }
+            else if (TOLERANCE < 0.0f)
+            {
+                printf("Tolerance must be >= 0!\n");
+                return EXIT_FAILURE;
+            }
+            i += 2;
+        }
+        else if (strcmp(input,"-verbose") == 0)
+        {
+            VERBOS = true;
+            i += 1;
+        }
+        else
+        {
+            printf("Unrecognized option! %s \n",argv[i]);
+            return EXIT_FAILURE;
+        }
+	}
+
+	if (!FOUND_PLATFORM)
+	{
+        printf("No OpenCL platform given, aborting!\n");
+        return EXIT_FAILURE;
+	}
+
+	if (!FOUND_DEVICE)
+	{
+        printf("No OpenCL device given, aborting!\n");
+        return EXIT_FAILURE;
+	}
+
+	// Read the baseline first, to not run all benchmarks for nothing
+	std::map<std::string,double> baselineTimes;
+	int baselineSize[4] = {0, 0, 0, 0};
+	if ( (BASELINE_FILENAME != NULL) && !ReadBaseline(BASELINE_FILENAME, baselineTimes, baselineSize) )
+	{
+        printf("Could not open baseline %s !\n",BASELINE_FILENAME);
+        return EXIT_FAILURE;
+	}
+
+	BROCCOLI_LIB BROCCOLI(OPENCL_PLATFORM,OPENCL_DEVICE,2,VERBOS); // 2 = Bash wrapper
+
+    // Something went wrong...
+    if (!BROCCOLI.GetOpenCLInitiated())
+    {
+        printf("Initialization error is \"%s\" \n",BROCCOLI.GetOpenCLInitializationError().c_str());
+		printf("OpenCL error is \"%s\" \n",BROCCOLI.GetOpenCLError());
+
+        // Print create kernel errors
+        int* createKernelErrors = BROCCOLI.GetOpenCLCreateKernelErrors();
+        for (int i = 0; i < BROCCOLI.GetNumberOfOpenCLKernels(); i++)
+        {
+            if (createKernelErrors[i] != 0)
+            {
+                printf("Create kernel error for kernel '%s' is '%s' \n",BROCCOLI.GetOpenCLKernelName(i),BROCCOLI.GetOpenCLErrorMessage(createKernelErrors[i]));
+            }
+        }
+
+        printf("OpenCL initialization failed, aborting! \nSee buildInfo* for output of OpenCL compilation!\n");
+        return EXIT_FAILURE;
+    }
+
+	printf("Running kernel benchmarks on %s, data size %i x %i x %i x %i, %i warmup runs and %i repetitions\n\n",BROCCOLI.GetOpenCLDeviceName(),DATA_W,DATA_H,DATA_D,DATA_T,WARMUP,REPETITIONS);
+
+	std::vector<KernelBenchmark> benchmarks = BROCCOLI.RunKernelBenchmarks(DATA_W, DATA_H, DATA_D, DATA_T, WARMUP, REPETITIONS);
+
+	// No results are returned if the memory for the benchmarks could not be allocated
+	if (benchmarks.size() == 0)
+	{
+		printf("Could not allocate memory on the device for data size %i x %i x %i x %i, aborting!\n",DATA_W,DATA_H,DATA_D,DATA_T);
+		return EXIT_FAILURE;
+	}
+
+	// Print run kernel errors
+	int NUMBER_OF_KERNEL_ERRORS = 0;
+	int* runKernelErrors = BROCCOLI.GetOpenCLRunKernelErrors();
+	for (int i = 0; i < BROCCOLI.GetNumberOfOpenCLKernels(); i++)
+	{
+		if (runKernelErrors[i] != 0)
+		{
+			printf("Run kernel error for kernel '%s' is '%s' \n",BROCCOLI.GetOpenCLKernelName(i),BROCCOLI.GetOpenCLErrorMessage(runKernelErrors[i]));
+			NUMBER_OF_KERNEL_ERRORS++;
+		}
+	}
+
+	if (BASELINE_FILENAME != NULL)
+	{
+		if ( (baselineSize[0] != DATA_W) || (baselineSize[1] != DATA_H) || (baselineSize[2] != DATA_D) || (baselineSize[3] != DATA_T) )
+		{
+			printf("Warning: the baseline was run with data size %i x %i x %i x %i \n\n",baselineSize[0],baselineSize[1],baselineSize[2],baselineSize[3]);
+		}
+
+		printf("%-26s %12s %10s %10s %14s %10s\n","Kernel","Time (ms)","GB/s","GFLOP/s","Baseline (ms)","Change (%)");
+	}
+	else
+	{
+		printf("%-26s %12s %10s %10s\n","Kernel","Time (ms)","GB/s","GFLOP/s");
+	}
+
+	// Bandwidth and throughput are left out for data dependent kernels (clustering)
+	int NUMBER_OF_SLOWER_KERNELS = 0;
+	for (size_t b = 0; b < benchmarks.size(); b++)
+	{
+		char bandwidth[32], throughput[32];
+		if (benchmarks[b].bytes > 0.0)
+		{
+			sprintf(bandwidth, "%10.2f", benchmarks[b].bytes / benchmarks[b].time / 1.0e9);
+			sprintf(throughput, "%10.2f", benchmarks[b].flops / benchmarks[b].time / 1.0e9);
+		}
+		else
+		{
+			sprintf(bandwidth, "%10s", "-");
+			sprintf(throughput, "%10s", "-");
+		}
+
+		printf("%-26s %12.3f %s %s",benchmarks[b].name.c_str(),benchmarks[b].time * 1000.0,bandwidth,throughput);
+
+		if (BASELINE_FILENAME != NULL)
+		{
+			std::map<std::string,double>::iterator baseline = baselineTimes.find(benchmarks[b].name);
+			if (baseline == baselineTimes.end())
+			{
+				printf(" %14s %10s","-","-");
+			}
+			else
+			{
+				double change = 100.0 * (benchmarks[b].time - baseline->second) / baseline->second;
+				printf(" %14.3f %+10.1f",baseline->second * 1000.0,change);
+				if (change > TOLERANCE)
+				{
+					printf("  slower");
+					NUMBER_OF_SLOWER_KERNELS++;
+				}
+			}
+		}
+		printf("\n");
+	}
+
+	// The times of kernels that failed to run are not valid, and should not be saved as a baseline
+	if (NUMBER_OF_KERNEL_ERRORS > 0)
+	{
+		printf("\n%i kernel(s) failed to run, not saving the benchmark results!\n",NUMBER_OF_KERNEL_ERRORS);
+		return EXIT_FAILURE;
+	}
+
+	if ( (OUTPUT_FILENAME != NULL) && !WriteBenchmarks(OUTPUT_FILENAME, BROCCOLI, benchmarks, DATA_W, DATA_H, DATA_D, DATA_T, WARMUP, REPETITIONS) )
+	{
+		printf("Could not write benchmark results to %s !\n",OUTPUT_FILENAME);
+		return EXIT_FAILURE;
+	}
+
+	// Fail if any kernel is slower than the baseline, so the benchmark can be used in scripts
+	if (NUMBER_OF_SLOWER_KERNELS > 0)
+	{
+		printf("\n%i kernel(s) are more than %.1f %% slower than the baseline!\n",NUMBER_OF_SLOWER_KERNELS,TOLERANCE);
+		return EXIT_FAILURE;
+	}
+
+    return EXIT_SUCCESS;
+}
@@ -279,7 +279,7 @@ int main(int argc, char ** argv)
 	// ---------------------
     // Read data
 	// ---------------------
-    nifti_image *inputData = nifti_image_read(argv[1],1);
+    nifti_image *inputData = nifti_image_read(argv[1],0);
     
     if (inputData == NULL)
     {
@@ -346,50 +346,13 @@ int main(int argc, char ** argv)
 
 	startTime = GetWallTime();
 
-    // Convert data to floats
-    if ( inputData->datatype == DT_SIGNED_SHORT )
+    // Read data in chunks and convert to floats
+    if (!ReadNiftiDataAsFloats(h_Volume, inputData))
     {
-        short int *p = (short int*)inputData->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-        {
-            h_Volume[i] = (float)p[i];
-        }
-    }
-    else if ( inputData->datatype == DT_UINT8 )
-    {
-        unsigned char *p = (unsigned char*)inputData->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-        {
-            h_Volume[i] = (float)p[i];
-        }
-    }
-    else if ( inputData->datatype == DT_UINT16 )
-    {
-        unsigned short int *p = (unsigned short int*)inputData->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-        {
-            h_Volume[i] = (float)p[i];
-        }
-    }
-	// Correct data type, just copy the pointer
-	else if ( inputData->datatype == DT_FLOAT )
-    {
-        float *p = (float*)inputData->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-        {
-            h_Volume[i] = p[i];
-        }
-    }
-    else
-    {
-        printf("Unknown data type in input data, aborting!\n");
-        FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
-        FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
-        return EXIT_FAILURE;
+    	printf("Could not read the input volume, aborting!\n");
+    	FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+    	FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+    	return EXIT_FAILURE;
     }
 
 	endTime = GetWallTime();
@@ -0,0 +1,114 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+#include <cmath>
+
+// Uncompressed float nifti files are memory mapped instead of read, such that loading is almost free and the page
+// cache is shared between several processes reading the same file. The mapping is private, if a wrapper writes to
+// the data only the modified pages are copied, the file is never changed.
+
+struct MappedNiftiData
+{
+	void* mapping;
+	size_t mappingSize;
+	void* data;
+};
+
+std::vector<MappedNiftiData> mappedNiftiData;
+
+// Only data that does not need any conversion can be used directly from the file
+bool CanMapNiftiData(nifti_image* inputNifti)
+{
+	return ( (inputNifti->iname != NULL) && !nifti_is_gzfile(inputNifti->iname) && (inputNifti->datatype == DT_FLOAT) && (inputNifti->iname_offset >= 0) && ((inputNifti->iname_offset % sizeof(float)) == 0) && ((inputNifti->swapsize <= 1) || (inputNifti->byteorder == nifti_short_order())) );
+}
+
+// Maps the file and sets the data pointer of the nifti image to the start of the data
+bool MapNiftiData(nifti_image* inputNifti)
+{
+	int file = open(inputNifti->iname, O_RDONLY);
+	if (file < 0)
+	{
+		return false;
+	}
+
+	size_t dataSize = inputNifti->nvox * sizeof(float);
+	size_t mappingSize = (size_t)inputNifti->iname_offset + dataSize;
+
+	struct stat fileInfo;
+	if ( (fstat(file, &fileInfo) != 0) || ((size_t)fileInfo.st_size < mappingSize) )
+	{
+		close(file);
+		return false;
+	}
+
+	// Populate the mapping read only, populating a writable private mapping would copy every page
+	int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+	flags |= MAP_POPULATE;
+#endif
+	void* mapping = mmap(NULL, mappingSize, PROT_READ, flags, file, 0);
+	close(file);
+
+	if (mapping == MAP_FAILED)
+	{
+		return false;
+	}
+
+	madvise(mapping, mappingSize, MADV_SEQUENTIAL);
+
+	// Allow writes, pages are copied on the first write
+	if (mprotect(mapping, mappingSize, PROT_READ | PROT_WRITE) != 0)
+	{
+		munmap(mapping, mappingSize);
+		return false;
+	}
+
+	float* data = (float*)((char*)mapping + inputNifti->iname_offset);
+
+	// Same check as nifti_read_buffer, bad floats are set to 0 (only these pages are copied)
+	for (size_t i = 0; i < inputNifti->nvox; i++)
+	{
+		if (!std::isfinite(data[i]))
+		{
+			data[i] = 0.0f;
+		}
+	}
+
+	MappedNiftiData mapped;
+	mapped.mapping = mapping;
+	mapped.mappingSize = mappingSize;
+	mapped.data = (void*)data;
+	mappedNiftiData.push_back(mapped);
+
+	inputNifti->data = (void*)data;
+
+	return true;
+}
+
+// Unmaps data mapped by MapNiftiData, returns false if the pointer was not mapped (i.e. should be freed)
+bool UnmapNiftiData(void* data)
+{
+	for (size_t i = 0; i < mappedNiftiData.size(); i++)
+	{
+		if (mappedNiftiData[i].data == data)
+		{
+			munmap(mappedNiftiData[i].mapping, mappedNiftiData[i].mappingSize);
+			mappedNiftiData.erase(mappedNiftiData.begin() + i);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Frees the data of a nifti image, regardless of if it was mapped or read
+void FreeNiftiData(nifti_image* inputNifti)
+{
+	if ( (inputNifti->data != NULL) && !UnmapNiftiData(inputNifti->data) )
+	{
+		free(inputNifti->data);
+	}
+	inputNifti->data = NULL;
+}
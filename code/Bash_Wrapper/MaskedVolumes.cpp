@@ -0,0 +1,212 @@
+#include <stdint.h>
+
+// Masked volumes (.bmv) store only the voxels inside a mask, as a voxels x time matrix. The file contains
+//
+//   8 bytes         "BROCMV01"
+//   348 bytes       nifti-1 header of the full 4D volume (float data), used to convert the file back to nifti
+//   3 x uint64      number of voxels in the mask, number of volumes, voxels per chunk
+//   uint32          linear index (x + y * W + z * W * H) of each voxel in the mask
+//   chunks          for each chunk of voxels, the time series of each voxel after each other (float)
+//
+// All values are stored in the byte order of the computer that wrote the file. A tool that needs the time series
+// of some voxels only has to read the chunks that contain them.
+
+// Number of voxels in each chunk of time series
+#define MASKED_VOLUMES_CHUNK_VOXELS 4096
+
+#define MASKED_VOLUMES_MAGIC "BROCMV01"
+
+float mymin(float* data, int N);
+float mymax(float* data, int N);
+
+// Creates the name of a masked output from the name of a nifti file, in the same way as WriteNifti
+std::string CreateMaskedVolumesFilename(const char* niftiFilename, const char* filename, bool addFilename)
+{
+	std::string name;
+	if (addFilename)
+	{
+		std::string original(niftiFilename);
+		name = original.substr(0, original.find('.')) + filename;
+	}
+	else
+	{
+		std::string original(filename);
+		name = original.substr(0, original.find('.'));
+	}
+
+	return name + ".bmv";
+}
+
+// Writes the voxels of a 4D volume that are inside the mask (mask value > 0.5)
+bool WriteMaskedVolumes(nifti_image* inputNifti, float* data, float* mask, const char* filename, bool addFilename)
+{
+	if ( (data == NULL) || (mask == NULL) || (inputNifti == NULL) )
+	{
+		printf("The provided pointers for file %s are NULL, aborting writing masked volumes! \n",filename);
+		return false;
+	}
+
+	size_t volumeSize = (size_t)inputNifti->nx * inputNifti->ny * inputNifti->nz;
+	size_t numberOfVolumes = (size_t)inputNifti->nt;
+
+	std::vector<uint32_t> maskIndices;
+	for (size_t i = 0; i < volumeSize; i++)
+	{
+		if (mask[i] > 0.5f)
+		{
+			maskIndices.push_back((uint32_t)i);
+		}
+	}
+
+	// Header of the full volume
+	nifti_image* outputNifti = nifti_copy_nim_info(inputNifti);
+	outputNifti->datatype = DT_FLOAT;
+	outputNifti->nbyper = 4;
+	outputNifti->cal_min = mymin(data, (int)(volumeSize * numberOfVolumes));
+	outputNifti->cal_max = mymax(data, (int)(volumeSize * numberOfVolumes));
+	struct nifti_1_header header = nifti_convert_nim2nhdr(outputNifti);
+	nifti_image_free(outputNifti);
+
+	std::string outputFilename = CreateMaskedVolumesFilename(inputNifti->fname, filename, addFilename);
+	FILE* file = fopen(outputFilename.c_str(), "wb");
+	if (file == NULL)
+	{
+		printf("Could not open %s for writing !\n",outputFilename.c_str());
+		return false;
+	}
+
+	uint64_t sizes[3];
+	sizes[0] = maskIndices.size();
+	sizes[1] = numberOfVolumes;
+	sizes[2] = MASKED_VOLUMES_CHUNK_VOXELS;
+
+	bool success = (fwrite(MASKED_VOLUMES_MAGIC, 1, 8, file) == 8);
+	success = success && (fwrite(&header, sizeof(header), 1, file) == 1);
+	success = success && (fwrite(sizes, sizeof(uint64_t), 3, file) == 3);
+	success = success && ( (maskIndices.size() == 0) || (fwrite(&maskIndices[0], sizeof(uint32_t), maskIndices.size(), file) == maskIndices.size()) );
+
+	// Gather the time series of one chunk of voxels at a time
+	float* chunk = (float*)malloc(MASKED_VOLUMES_CHUNK_VOXELS * numberOfVolumes * sizeof(float));
+	if (chunk == NULL)
+	{
+		printf("Could not allocate host memory for writing %s !\n",outputFilename.c_str());
+		fclose(file);
+		return false;
+	}
+
+	for (size_t firstVoxel = 0; success && (firstVoxel < maskIndices.size()); firstVoxel += MASKED_VOLUMES_CHUNK_VOXELS)
+	{
+		size_t voxels = std::min((size_t)MASKED_VOLUMES_CHUNK_VOXELS, maskIndices.size() - firstVoxel);
+
+		for (size_t t = 0; t < numberOfVolumes; t++)
+		{
+			const float* volume = &data[t * volumeSize];
+			for (size_t v = 0; v < voxels; v++)
+			{
+				chunk[v * numberOfVolumes + t] = volume[maskIndices[firstVoxel + v]];
+			}
+		}
+
+		success = (fwrite(chunk, sizeof(float), voxels * numberOfVolumes, file) == (voxels * numberOfVolumes));
+	}
+
+	free(chunk);
+
+	if (fclose(file) != 0)
+	{
+		success = false;
+	}
+
+	if (!success)
+	{
+		printf("Could not write %s !\n",outputFilename.c_str());
+	}
+
+	return success;
+}
+
+// Reads a masked volumes file into a full 4D volume (zero outside the mask), the returned nifti image owns the data
+nifti_image* ReadMaskedVolumes(const char* filename)
+{
+	FILE* file = fopen(filename, "rb");
+	if (file == NULL)
+	{
+		printf("Could not open %s for reading !\n",filename);
+		return NULL;
+	}
+
+	char magic[8];
+	struct nifti_1_header header;
+	uint64_t sizes[3];
+
+	if ( (fread(magic, 1, 8, file) != 8) || (memcmp(magic, MASKED_VOLUMES_MAGIC, 8) != 0) || (fread(&header, sizeof(header), 1, file) != 1) || (fread(sizes, sizeof(uint64_t), 3, file) != 3) || (header.sizeof_hdr != (int)sizeof(header)) )
+	{
+		printf("%s is not a masked volumes file written on this type of computer !\n",filename);
+		fclose(file);
+		return NULL;
+	}
+
+	nifti_image* outputNifti = nifti_convert_nhdr2nim(header, filename);
+	if (outputNifti == NULL)
+	{
+		fclose(file);
+		return NULL;
+	}
+
+	size_t numberOfVoxels = (size_t)sizes[0];
+	size_t numberOfVolumes = (size_t)sizes[1];
+	size_t voxelsPerChunk = (size_t)sizes[2];
+	size_t volumeSize = (size_t)outputNifti->nx * outputNifti->ny * outputNifti->nz;
+
+	if ( (numberOfVolumes != (size_t)outputNifti->nt) || (numberOfVoxels > volumeSize) || (voxelsPerChunk == 0) )
+	{
+		printf("The sizes in %s do not match its header !\n",filename);
+		nifti_image_free(outputNifti);
+		fclose(file);
+		return NULL;
+	}
+
+	std::vector<uint32_t> maskIndices(numberOfVoxels);
+	outputNifti->data = calloc(volumeSize * numberOfVolumes, sizeof(float));
+	float* chunk = (float*)malloc(voxelsPerChunk * numberOfVolumes * sizeof(float));
+
+	bool success = (outputNifti->data != NULL) && (chunk != NULL);
+	success = success && ( (numberOfVoxels == 0) || (fread(&maskIndices[0], sizeof(uint32_t), numberOfVoxels, file) == numberOfVoxels) );
+
+	float* data = (float*)outputNifti->data;
+	for (size_t firstVoxel = 0; success && (firstVoxel < numberOfVoxels); firstVoxel += voxelsPerChunk)
+	{
+		size_t voxels = std::min(voxelsPerChunk, numberOfVoxels - firstVoxel);
+		if (fread(chunk, sizeof(float), voxels * numberOfVolumes, file) != (voxels * numberOfVolumes))
+		{
+			success = false;
+			break;
+		}
+
+		for (size_t v = 0; v < voxels; v++)
+		{
+			uint32_t index = maskIndices[firstVoxel + v];
+			if (index >= volumeSize)
+			{
+				success = false;
+				break;
+			}
+			for (size_t t = 0; t < numberOfVolumes; t++)
+			{
+				data[index + t * volumeSize] = chunk[v * numberOfVolumes + t];
+			}
+		}
+	}
+
+	free(chunk);
+	fclose(file);
+
+	if (!success)
+	{
+		printf("Could not read all the data in %s !\n",filename);
+		nifti_image_free(outputNifti);
+		return NULL;
+	}
+
+	return outputNifti;
+}
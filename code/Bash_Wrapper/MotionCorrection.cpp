@@ -83,6 +83,8 @@ int main(int argc, char ** argv)
     const char*     FILENAME_EXTENSION = "_mc";
     bool            PRINT = true;
 	bool			VERBOS = false;
+	bool			PROFILE = false;
+	const char*		PROFILE_TRACE_FILENAME = NULL;
 	bool			CHANGE_OUTPUT_FILENAME = false;
 	bool			CHANGE_REFERENCE_VOLUME = false;
 	const char*		referenceVolumeFilename;
@@ -124,6 +126,8 @@ int main(int argc, char ** argv)
         printf(" -iterations         Number of iterations for the motion correction algorithm (default 5) \n");        
         printf(" -output             Set output filename (default input_mc.nii) \n");
         printf(" -quiet              Don't print anything to the terminal (default false) \n");
+        printf(" -profile            Print the time and bytes of each OpenCL kernel and transfer (default false) \n");
+        printf(" -profiletrace       Write all OpenCL kernels and transfers to a Chrome trace file (chrome://tracing) (default none) \n");
         printf(" -verbose            Print extra stuff (default false) \n");
         printf(" -debug              Get additional debug information (default false) \n");
         printf("\n\n");
@@ -246,6 +250,22 @@ int main(int argc, char ** argv)
             PRINT = false;
             i += 1;
         }
+        else if (strcmp(input,"-profile") == 0)
+        {
+            PROFILE = true;
+            i += 1;
+        }
+        else if (strcmp(input,"-profiletrace") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read name after -profiletrace !\n");
+                return EXIT_FAILURE;
+			}
+
+            PROFILE_TRACE_FILENAME = argv[i+1];
+            i += 2;
+        }
         else if (strcmp(input,"-verbose") == 0)
         {
             VERBOS = true;
@@ -281,7 +301,7 @@ int main(int argc, char ** argv)
     double startTime = GetWallTime();
 
     // Read data
-    nifti_image *inputData = nifti_image_read(argv[1],1);
+    nifti_image *inputData = nifti_image_read(argv[1],0);
     
     if (inputData == NULL)
     {
@@ -294,7 +314,7 @@ int main(int argc, char ** argv)
     nifti_image *referenceVolume;
 	if (CHANGE_REFERENCE_VOLUME)
 	{
-		referenceVolume = nifti_image_read(referenceVolumeFilename,1);
+		referenceVolume = nifti_image_read(referenceVolumeFilename,0);
 		if (referenceVolume == NULL)
 		{
 	        printf("Could not open reference volume nifti file!\n");
@@ -353,7 +373,6 @@ int main(int argc, char ** argv)
 	}
                                
     // Calculate size, in bytes
-    size_t DATA_SIZE = DATA_W * DATA_H * DATA_D * DATA_T * sizeof(float);
     size_t MOTION_PARAMETERS_SIZE = NUMBER_OF_MOTION_CORRECTION_PARAMETERS * DATA_T * sizeof(float);
     size_t FILTER_SIZE = MOTION_CORRECTION_FILTER_SIZE * MOTION_CORRECTION_FILTER_SIZE * MOTION_CORRECTION_FILTER_SIZE * sizeof(float);
     size_t VOLUME_SIZE = DATA_W * DATA_H * DATA_D * sizeof(float);
@@ -373,16 +392,6 @@ int main(int argc, char ** argv)
     
 	startTime = GetWallTime();
 
-	// If the data is in float format, we can just copy the pointer
-	if ( inputData->datatype != DT_FLOAT )
-	{
-		AllocateMemory(h_fMRI_Volumes, DATA_SIZE, allMemoryPointers, numberOfMemoryPointers, allNiftiImages, numberOfNiftiImages, allocatedHostMemory, "INPUT_DATA");
-	}
-	else
-	{
-		allocatedHostMemory += DATA_SIZE;
-	}
-
 	if (CHANGE_REFERENCE_VOLUME)
 	{
 		AllocateMemory(h_Reference_Volume, VOLUME_SIZE, allMemoryPointers, numberOfMemoryPointers, allNiftiImages, numberOfNiftiImages, allocatedHostMemory, "REFERENCE_VOLUME");
@@ -418,116 +427,26 @@ int main(int argc, char ** argv)
 
 	startTime = GetWallTime();
 
-    // Convert data to floats
-    if ( inputData->datatype == DT_SIGNED_SHORT )
+    // Read the data in chunks and convert to floats, float data is memory mapped
+    h_fMRI_Volumes = ReadNiftiAsFloats(inputData, allMemoryPointers, numberOfMemoryPointers, allocatedHostMemory);
+    if (h_fMRI_Volumes == NULL)
     {
-        short int *p = (short int*)inputData->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * DATA_T; i++)
-        {
-            h_fMRI_Volumes[i] = (float)p[i];
-        }
+    	printf("Could not read the fMRI data, aborting!\n");
+    	FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+    	FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+    	return EXIT_FAILURE;
     }
-    else if ( inputData->datatype == DT_UINT8 )
-    {
-        unsigned char *p = (unsigned char*)inputData->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * DATA_T; i++)
-        {
-            h_fMRI_Volumes[i] = (float)p[i];
-        }
-    }
-    else if ( inputData->datatype == DT_UINT16 )
-    {
-        unsigned short int *p = (unsigned short int*)inputData->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * DATA_T; i++)
-        {
-            h_fMRI_Volumes[i] = (float)p[i];
-        }
-    }
-	// Correct data type, just copy the pointer
-	else if ( inputData->datatype == DT_FLOAT )
-    {
-		h_fMRI_Volumes = (float*)inputData->data;
-
-		// Save the pointer in the pointer list
-		allMemoryPointers[numberOfMemoryPointers] = (void*)h_fMRI_Volumes;
-        numberOfMemoryPointers++;
-
-        //float *p = (float*)inputData->data;
-    
-        //for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * DATA_T; i++)
-        //{
-        //    h_fMRI_Volumes[i] = p[i];
-        //}
-    }
-    else
-    {
-        printf("Unknown data type in fMRI data, aborting!\n");
-        FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
-        FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
-        return EXIT_FAILURE;
-    }
-    
-	// Free input fMRI data, it has been converted to floats
-	if ( inputData->datatype != DT_FLOAT )
-	{		
-		free(inputData->data);
-		inputData->data = NULL;
-	}
-	// Pointer has been copied to h_fMRI_Volumes and pointer list, so set the input data pointer to NULL
-	else
-	{		
-		inputData->data = NULL;
-	}
 
 	if (CHANGE_REFERENCE_VOLUME)
 	{
-    	// Convert data to floats
-	    if ( referenceVolume->datatype == DT_SIGNED_SHORT )
+	    // Read data in chunks and convert to floats
+	    if (!ReadNiftiDataAsFloats(h_Reference_Volume, referenceVolume))
 	    {
-	        short int *p = (short int*)referenceVolume->data;
-	    
-	        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-	        {
-	            h_Reference_Volume[i] = (float)p[i];
-	        }
+	    	printf("Could not read the reference volume, aborting!\n");
+	    	FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+	    	FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+	    	return EXIT_FAILURE;
 	    }
-	    else if ( referenceVolume->datatype == DT_UINT8 )
-	    {
-	        unsigned char *p = (unsigned char*)referenceVolume->data;
-	    
-	        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-	        {
-	            h_Reference_Volume[i] = (float)p[i];
-    	    }
-    	}
-    	else if ( referenceVolume->datatype == DT_UINT16 )
-    	{
-    	    unsigned short int *p = (unsigned short int*)referenceVolume->data;
-    	
-    	    for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-    	    {
-    	        h_Reference_Volume[i] = (float)p[i];
-    	    }
-    	}
-		else if ( referenceVolume->datatype == DT_FLOAT )
-    	{	
-			float *p = (float*)referenceVolume->data;
-    
-        	for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-        	{
-        	    h_Reference_Volume[i] = p[i];
-        	}
-	    }
-    	else
-    	{
-    	    printf("Unknown data type in reference volume, aborting!\n");
-    	    FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
-    	    FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
-    	    return EXIT_FAILURE;
-    	}
 	}
 	
 	endTime = GetWallTime();
@@ -655,6 +574,8 @@ int main(int argc, char ** argv)
     // Initialization OK
     else
     {
+        BROCCOLI.SetProfiling(PROFILE || (PROFILE_TRACE_FILENAME != NULL));
+
         // Set all necessary pointers and values
         BROCCOLI.SetInputfMRIVolumes(h_fMRI_Volumes);
         
@@ -697,6 +618,8 @@ int main(int argc, char ** argv)
 			printf("\nIt took %f seconds to run the motion correction\n",(float)(endTime - startTime));
 		}    
 
+        WriteProfilingResults(BROCCOLI, PROFILE, PROFILE_TRACE_FILENAME);
+
         // Print create buffer errors
         int* createBufferErrors = BROCCOLI.GetOpenCLCreateBufferErrors();
         for (int i = 0; i < BROCCOLI.GetNumberOfOpenCLKernels(); i++)
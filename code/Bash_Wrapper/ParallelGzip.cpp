@@ -0,0 +1,466 @@
+#include <zlib.h>
+#include <vector>
+#include <cmath>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Nifti files ending with .gz are written as a sequence of independently compressed gzip members (pigz / bgzip style),
+// the concatenation is a valid gzip file that can be read by any gzip reader. The first member holds the nifti header,
+// every following member holds PARALLEL_GZIP_BLOCK_SIZE bytes of data. Each member stores its compressed size in a
+// gzip extra field (subfield id 'B','R'), such that all members can be located and decompressed in parallel.
+
+// Uncompressed size of each data member, must be a multiple of 8 bytes to never split a voxel value
+#define PARALLEL_GZIP_BLOCK_SIZE (1024*1024)
+
+// Number of members given to each thread before the next batch is read or written
+#define PARALLEL_GZIP_MEMBERS_PER_THREAD 4
+
+// Gzip header with one 8 byte extra field, and gzip trailer (crc32 + uncompressed size)
+#define PARALLEL_GZIP_HEADER_SIZE 20
+#define PARALLEL_GZIP_TRAILER_SIZE 8
+
+// Called for each decompressed data member, with the data already in the byte order of this computer and with
+// non-finite values set to 0 (as for nifti_read_buffer)
+typedef void (*ParallelGzipBlockHandler)(void* block, size_t firstElement, size_t elements, nifti_image* inputNifti, void* userData);
+
+struct ParallelGzipMember
+{
+	long offset;
+	size_t compressedSize;
+	size_t uncompressedSize;
+};
+
+int GetNumberOfGzipThreads()
+{
+#ifdef _OPENMP
+	return omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
+
+int GetGzipThreadIndex()
+{
+#ifdef _OPENMP
+	return omp_get_thread_num();
+#else
+	return 0;
+#endif
+}
+
+// Same check as nifti_read_buffer, non-finite values are set to 0
+template <typename T>
+void RemoveNonFiniteValues(void* block, size_t N)
+{
+	T* p = (T*)block;
+	for (size_t i = 0; i < N; i++)
+	{
+		if (!std::isfinite(p[i]))
+		{
+			p[i] = (T)0;
+		}
+	}
+}
+
+void WriteLittleEndian32(unsigned char* p, unsigned int value)
+{
+	p[0] = (unsigned char)(value & 0xff);
+	p[1] = (unsigned char)((value >> 8) & 0xff);
+	p[2] = (unsigned char)((value >> 16) & 0xff);
+	p[3] = (unsigned char)((value >> 24) & 0xff);
+}
+
+unsigned int ReadLittleEndian32(const unsigned char* p)
+{
+	return (unsigned int)p[0] | ((unsigned int)p[1] << 8) | ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+// Compresses one buffer into a complete gzip member, returns the size of the member or 0 if compression failed
+size_t CompressGzipMember(unsigned char* member, size_t maxMemberSize, const unsigned char* input, size_t inputSize)
+{
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+
+	// Negative window bits give a raw deflate stream, the gzip header and trailer are written here
+	if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		return 0;
+	}
+
+	stream.next_in = (Bytef*)input;
+	stream.avail_in = (uInt)inputSize;
+	stream.next_out = member + PARALLEL_GZIP_HEADER_SIZE;
+	stream.avail_out = (uInt)(maxMemberSize - PARALLEL_GZIP_HEADER_SIZE - PARALLEL_GZIP_TRAILER_SIZE);
+
+	int status = deflate(&stream, Z_FINISH);
+	size_t compressedSize = stream.total_out;
+	deflateEnd(&stream);
+
+	if (status != Z_STREAM_END)
+	{
+		return 0;
+	}
+
+	size_t memberSize = PARALLEL_GZIP_HEADER_SIZE + compressedSize + PARALLEL_GZIP_TRAILER_SIZE;
+
+	// Magic number, deflate, FEXTRA flag, no modification time, unix
+	member[0] = 0x1f; member[1] = 0x8b; member[2] = 8; member[3] = 4;
+	member[4] = 0; member[5] = 0; member[6] = 0; member[7] = 0;
+	member[8] = 0; member[9] = 3;
+	// Extra field, 8 bytes, subfield 'B','R' of 4 bytes with the size of the complete member
+	member[10] = 8; member[11] = 0;
+	member[12] = 'B'; member[13] = 'R';
+	member[14] = 4; member[15] = 0;
+	WriteLittleEndian32(&member[16], (unsigned int)memberSize);
+
+	unsigned char* trailer = member + PARALLEL_GZIP_HEADER_SIZE + compressedSize;
+	WriteLittleEndian32(&trailer[0], (unsigned int)crc32(crc32(0L, Z_NULL, 0), input, (uInt)inputSize));
+	WriteLittleEndian32(&trailer[4], (unsigned int)inputSize);
+
+	return memberSize;
+}
+
+// Decompresses one gzip member written by CompressGzipMember, and checks size and crc32
+bool DecompressGzipMember(unsigned char* output, size_t outputSize, const unsigned char* member, size_t memberSize)
+{
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+
+	if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+	{
+		return false;
+	}
+
+	stream.next_in = (Bytef*)(member + PARALLEL_GZIP_HEADER_SIZE);
+	stream.avail_in = (uInt)(memberSize - PARALLEL_GZIP_HEADER_SIZE - PARALLEL_GZIP_TRAILER_SIZE);
+	stream.next_out = output;
+	stream.avail_out = (uInt)outputSize;
+
+	int status = inflate(&stream, Z_FINISH);
+	size_t decompressedSize = stream.total_out;
+	inflateEnd(&stream);
+
+	const unsigned char* trailer = member + memberSize - PARALLEL_GZIP_TRAILER_SIZE;
+	if ( (status != Z_STREAM_END) || (decompressedSize != outputSize) || (ReadLittleEndian32(&trailer[4]) != (unsigned int)outputSize) )
+	{
+		return false;
+	}
+
+	return (ReadLittleEndian32(&trailer[0]) == (unsigned int)crc32(crc32(0L, Z_NULL, 0), output, (uInt)outputSize));
+}
+
+// Reads the header of the member at the current file position, returns false if it was not written by CompressGzipMember
+bool ReadParallelGzipMemberHeader(FILE* file, size_t& memberSize)
+{
+	unsigned char header[PARALLEL_GZIP_HEADER_SIZE];
+	if (fread(header, 1, PARALLEL_GZIP_HEADER_SIZE, file) != PARALLEL_GZIP_HEADER_SIZE)
+	{
+		return false;
+	}
+
+	if ( (header[0] != 0x1f) || (header[1] != 0x8b) || (header[2] != 8) || (header[3] != 4) )
+	{
+		return false;
+	}
+
+	if ( (header[10] != 8) || (header[11] != 0) || (header[12] != 'B') || (header[13] != 'R') || (header[14] != 4) || (header[15] != 0) )
+	{
+		return false;
+	}
+
+	memberSize = ReadLittleEndian32(&header[16]);
+	return (memberSize > (PARALLEL_GZIP_HEADER_SIZE + PARALLEL_GZIP_TRAILER_SIZE));
+}
+
+// Checks if a file was written by WriteParallelGzipNifti, other gzip files are read through znzlib
+bool IsParallelGzipFile(const char* filename)
+{
+	if ( (filename == NULL) || !nifti_is_gzfile(filename) )
+	{
+		return false;
+	}
+
+	FILE* file = fopen(filename, "rb");
+	if (file == NULL)
+	{
+		return false;
+	}
+
+	size_t memberSize;
+	bool parallel = ReadParallelGzipMemberHeader(file, memberSize);
+	fclose(file);
+
+	return parallel;
+}
+
+// Finds the position and size of all members in the file
+bool IndexParallelGzipFile(FILE* file, std::vector<ParallelGzipMember>& members)
+{
+	if (fseek(file, 0, SEEK_END) != 0)
+	{
+		return false;
+	}
+	long fileSize = ftell(file);
+
+	long position = 0;
+	while (position < fileSize)
+	{
+		ParallelGzipMember member;
+		member.offset = position;
+
+		if ( (fseek(file, position, SEEK_SET) != 0) || !ReadParallelGzipMemberHeader(file, member.compressedSize) )
+		{
+			return false;
+		}
+
+		if ( (position + (long)member.compressedSize) > fileSize )
+		{
+			return false;
+		}
+
+		// The uncompressed size is stored last in the trailer
+		unsigned char size[4];
+		if ( (fseek(file, position + (long)member.compressedSize - 4, SEEK_SET) != 0) || (fread(size, 1, 4, file) != 4) )
+		{
+			return false;
+		}
+		member.uncompressedSize = ReadLittleEndian32(size);
+
+		members.push_back(member);
+		position += (long)member.compressedSize;
+	}
+
+	return true;
+}
+
+bool CanWriteParallelGzipNifti(nifti_image* outputNifti)
+{
+	// Extensions and two file formats are left to nifti_image_write
+	return ( (outputNifti->data != NULL) && nifti_is_gzfile(outputNifti->fname) && (outputNifti->nifti_type == NIFTI_FTYPE_NIFTI1_1) && (outputNifti->num_ext == 0) );
+}
+
+// Writes a nifti image as independently compressed gzip members, which are compressed in parallel
+bool WriteParallelGzipNifti(nifti_image* outputNifti)
+{
+	nifti_set_iname_offset(outputNifti);
+	struct nifti_1_header header = nifti_convert_nim2nhdr(outputNifti);
+
+	// Header followed by 4 zero bytes, meaning no extensions
+	unsigned char headerBytes[sizeof(header) + 4];
+	memcpy(headerBytes, &header, sizeof(header));
+	memset(headerBytes + sizeof(header), 0, 4);
+
+	if (outputNifti->iname_offset != (int)sizeof(headerBytes))
+	{
+		printf("Unexpected data offset for %s !\n", outputNifti->fname);
+		return false;
+	}
+
+	FILE* file = fopen(outputNifti->fname, "wb");
+	if (file == NULL)
+	{
+		printf("Could not open %s for writing !\n", outputNifti->fname);
+		return false;
+	}
+
+	size_t dataSize = outputNifti->nvox * outputNifti->nbyper;
+	size_t numberOfBlocks = (dataSize + PARALLEL_GZIP_BLOCK_SIZE - 1) / PARALLEL_GZIP_BLOCK_SIZE;
+	size_t blocksPerBatch = GetNumberOfGzipThreads() * PARALLEL_GZIP_MEMBERS_PER_THREAD;
+	size_t maxMemberSize = PARALLEL_GZIP_HEADER_SIZE + compressBound(PARALLEL_GZIP_BLOCK_SIZE) + PARALLEL_GZIP_TRAILER_SIZE;
+
+	unsigned char* members = (unsigned char*)malloc(blocksPerBatch * maxMemberSize);
+	size_t* memberSizes = (size_t*)malloc(blocksPerBatch * sizeof(size_t));
+	if ( (members == NULL) || (memberSizes == NULL) )
+	{
+		printf("Could not allocate host memory for compressing %s !\n", outputNifti->fname);
+		free(members);
+		free(memberSizes);
+		fclose(file);
+		return false;
+	}
+
+	// First member is the header
+	size_t memberSize = CompressGzipMember(members, maxMemberSize, headerBytes, sizeof(headerBytes));
+	bool success = (memberSize > 0) && (fwrite(members, 1, memberSize, file) == memberSize);
+
+	// Compress one batch of blocks in parallel, then write the members in order
+	const unsigned char* data = (const unsigned char*)outputNifti->data;
+	for (size_t firstBlock = 0; success && (firstBlock < numberOfBlocks); firstBlock += blocksPerBatch)
+	{
+		long blocks = (long)std::min(blocksPerBatch, numberOfBlocks - firstBlock);
+
+		#pragma omp parallel for schedule(dynamic)
+		for (long b = 0; b < blocks; b++)
+		{
+			size_t start = (firstBlock + b) * PARALLEL_GZIP_BLOCK_SIZE;
+			size_t size = std::min((size_t)PARALLEL_GZIP_BLOCK_SIZE, dataSize - start);
+			memberSizes[b] = CompressGzipMember(members + b * maxMemberSize, maxMemberSize, data + start, size);
+		}
+
+		for (long b = 0; b < blocks; b++)
+		{
+			if ( (memberSizes[b] == 0) || (fwrite(members + b * maxMemberSize, 1, memberSizes[b], file) != memberSizes[b]) )
+			{
+				success = false;
+				break;
+			}
+		}
+	}
+
+	free(members);
+	free(memberSizes);
+
+	if (fclose(file) != 0)
+	{
+		success = false;
+	}
+
+	if (!success)
+	{
+		printf("Could not write compressed data to %s !\n", outputNifti->fname);
+	}
+
+	return success;
+}
+
+// Decompresses the data of a file written by WriteParallelGzipNifti in parallel, the handler is called once
+// for each data member (from several threads, for non-overlapping parts of the data)
+bool ReadParallelGzipNiftiData(nifti_image* inputNifti, ParallelGzipBlockHandler handler, void* userData)
+{
+	FILE* file = fopen(inputNifti->iname, "rb");
+	if (file == NULL)
+	{
+		printf("Could not open %s for reading !\n", inputNifti->iname);
+		return false;
+	}
+
+	std::vector<ParallelGzipMember> members;
+	if (!IndexParallelGzipFile(file, members) || (members.size() == 0))
+	{
+		printf("Could not find the compressed blocks in %s !\n", inputNifti->iname);
+		fclose(file);
+		return false;
+	}
+
+	// Check that the first member is the header and that the data members add up to the data size, without splitting voxels
+	size_t bytesPerElement = inputNifti->nbyper;
+	size_t dataSize = inputNifti->nvox * bytesPerElement;
+	size_t totalSize = 0;
+	size_t maxUncompressedSize = 0;
+	for (size_t m = 1; m < members.size(); m++)
+	{
+		totalSize += members[m].uncompressedSize;
+		maxUncompressedSize = std::max(maxUncompressedSize, members[m].uncompressedSize);
+		if ( (members[m].uncompressedSize % bytesPerElement) != 0 )
+		{
+			totalSize = 0;
+			break;
+		}
+	}
+
+	if ( (members[0].uncompressedSize != (size_t)inputNifti->iname_offset) || (totalSize != dataSize) )
+	{
+		printf("The compressed blocks in %s do not match the nifti header !\n", inputNifti->iname);
+		fclose(file);
+		return false;
+	}
+
+	int numberOfThreads = GetNumberOfGzipThreads();
+	size_t membersPerBatch = numberOfThreads * PARALLEL_GZIP_MEMBERS_PER_THREAD;
+
+	// Find the largest batch of compressed members
+	size_t maxBatchSize = 0;
+	for (size_t firstMember = 1; firstMember < members.size(); firstMember += membersPerBatch)
+	{
+		size_t lastMember = std::min(firstMember + membersPerBatch, members.size()) - 1;
+		maxBatchSize = std::max(maxBatchSize, (size_t)(members[lastMember].offset - members[firstMember].offset) + members[lastMember].compressedSize);
+	}
+
+	unsigned char* compressed = (unsigned char*)malloc(maxBatchSize);
+	unsigned char* decompressed = (unsigned char*)malloc(numberOfThreads * maxUncompressedSize);
+	if ( (compressed == NULL) || (decompressed == NULL) )
+	{
+		printf("Could not allocate host memory for decompressing %s !\n", inputNifti->iname);
+		free(compressed);
+		free(decompressed);
+		fclose(file);
+		return false;
+	}
+
+	bool swap = (inputNifti->swapsize > 1) && (inputNifti->byteorder != nifti_short_order());
+	bool success = true;
+	size_t firstElement = 0;
+
+	// Read one batch of compressed members, then decompress them in parallel
+	for (size_t firstMember = 1; success && (firstMember < members.size()); firstMember += membersPerBatch)
+	{
+		size_t lastMember = std::min(firstMember + membersPerBatch, members.size()) - 1;
+		size_t batchSize = (size_t)(members[lastMember].offset - members[firstMember].offset) + members[lastMember].compressedSize;
+
+		if ( (fseek(file, members[firstMember].offset, SEEK_SET) != 0) || (fread(compressed, 1, batchSize, file) != batchSize) )
+		{
+			success = false;
+			break;
+		}
+
+		// Element offset of each member in the batch
+		std::vector<size_t> memberElements(lastMember - firstMember + 1);
+		for (size_t m = firstMember; m <= lastMember; m++)
+		{
+			memberElements[m - firstMember] = firstElement;
+			firstElement += members[m].uncompressedSize / bytesPerElement;
+		}
+
+		int failures = 0;
+		long batchMembers = (long)(lastMember - firstMember + 1);
+
+		#pragma omp parallel for schedule(dynamic) reduction(+:failures)
+		for (long b = 0; b < batchMembers; b++)
+		{
+			const ParallelGzipMember& member = members[firstMember + b];
+			unsigned char* block = decompressed + GetGzipThreadIndex() * maxUncompressedSize;
+
+			if (!DecompressGzipMember(block, member.uncompressedSize, compressed + (member.offset - members[firstMember].offset), member.compressedSize))
+			{
+				failures++;
+				continue;
+			}
+
+			if (swap)
+			{
+				nifti_swap_Nbytes(member.uncompressedSize / inputNifti->swapsize, inputNifti->swapsize, block);
+			}
+
+			if ( (inputNifti->datatype == DT_FLOAT32) || (inputNifti->datatype == DT_COMPLEX64) )
+			{
+				RemoveNonFiniteValues<float>(block, member.uncompressedSize / sizeof(float));
+			}
+			else if ( (inputNifti->datatype == DT_FLOAT64) || (inputNifti->datatype == DT_COMPLEX128) )
+			{
+				RemoveNonFiniteValues<double>(block, member.uncompressedSize / sizeof(double));
+			}
+
+			handler(block, memberElements[b], member.uncompressedSize / bytesPerElement, inputNifti, userData);
+		}
+
+		success = (failures == 0);
+	}
+
+	free(compressed);
+	free(decompressed);
+	fclose(file);
+
+	if (!success)
+	{
+		printf("Could not decompress all the data in %s !\n", inputNifti->iname);
+	}
+
+	return success;
+}
+
+// Copies a decompressed block into the data pointer of the nifti image
+void CopyNiftiBlock(void* block, size_t firstElement, size_t elements, nifti_image* inputNifti, void*)
+{
+	memcpy((char*)inputNifti->data + firstElement * inputNifti->nbyper, block, elements * inputNifti->nbyper);
+}
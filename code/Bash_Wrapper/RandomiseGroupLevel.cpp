@@ -89,6 +89,9 @@ int main(int argc, char **argv)
     bool            DEBUG = false;
     bool            PRINT = true;
 	bool			VERBOS = false;
+	bool			PROFILE = false;
+	const char*		PROFILE_TRACE_FILENAME = NULL;
+	bool			TIMELINE = false;
    	bool			CHANGE_OUTPUT_NAME = false;    
                    
     size_t          NUMBER_OF_GLM_REGRESSORS = 1;
@@ -167,6 +170,9 @@ int main(int argc, char **argv)
 		printf(" -writepermutations         Write all the random permutations (or sign flips) to a text file \n");
 		printf(" -permutationfile           Use a specific permutation file or sign flipping file (e.g. from FSL) \n");
         printf(" -quiet                     Don't print anything to the terminal (default false) \n");
+        printf(" -profile                   Print the time and bytes of each OpenCL kernel and transfer (default false) \n");
+        printf(" -profiletrace              Write all OpenCL kernels and transfers to a Chrome trace file (chrome://tracing) (default none) \n");
+        printf(" -timeline                  Save the time, memory use and data size of each processing stage as JSON (default no) \n");
         printf(" -verbose                   Print extra stuff (default false) \n");
         printf("\n\n");
         
@@ -411,6 +417,27 @@ int main(int argc, char **argv)
             PRINT = false;
             i += 1;
         }
+        else if (strcmp(input,"-profile") == 0)
+        {
+            PROFILE = true;
+            i += 1;
+        }
+        else if (strcmp(input,"-profiletrace") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read name after -profiletrace !\n");
+                return EXIT_FAILURE;
+			}
+
+            PROFILE_TRACE_FILENAME = argv[i+1];
+            i += 2;
+        }
+        else if (strcmp(input,"-timeline") == 0)
+        {
+            TIMELINE = true;
+            i += 1;
+        }
         else if (strcmp(input,"-verbose") == 0)
         {
             VERBOS = true;
@@ -511,7 +538,7 @@ int main(int argc, char **argv)
     
     // Read data
 
-    nifti_image *inputData = nifti_image_read(argv[1],1);
+    nifti_image *inputData = nifti_image_read(argv[1],0);
     
     if (inputData == NULL)
     {
@@ -535,7 +562,7 @@ int main(int argc, char **argv)
             return EXIT_FAILURE;
 		}
 
-	    inputMask = nifti_image_read(MASK_NAME,1);
+	    inputMask = nifti_image_read(MASK_NAME,0);
     
 	    if (inputMask == NULL)
 	    {
@@ -558,6 +585,8 @@ int main(int argc, char **argv)
 		printf("It took %f seconds to read the nifti file(s)\n",(float)(endTime - startTime));
 	}
 
+	double readTime = endTime - startTime;
+
     // Get data dimensions from input data
    	DATA_W = inputData->nx;
     DATA_H = inputData->ny;
@@ -1307,87 +1336,24 @@ int main(int argc, char **argv)
 
 	// Read data
 
-    // Convert data to floats
-    if ( inputData->datatype == DT_SIGNED_SHORT )
-    {
-        short int *p = (short int*)inputData->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * NUMBER_OF_SUBJECTS; i++)
-        {
-            h_First_Level_Results[i] = (float)p[i];
-        }
-    }
-	else if ( inputData->datatype == DT_UINT8 )
-    {
-        unsigned char *p = (unsigned char*)inputData->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * NUMBER_OF_SUBJECTS; i++)
-        {
-            h_First_Level_Results[i] = (float)p[i];
-        }
-    }
-    else if ( inputData->datatype == DT_UINT16 )
-    {
-        unsigned short int *p = (unsigned short int*)inputData->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * NUMBER_OF_SUBJECTS; i++)
-        {
-            h_First_Level_Results[i] = (float)p[i];
-        }
-    }
-    else if ( inputData->datatype == DT_FLOAT )
-    {
-        float *p = (float*)inputData->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * NUMBER_OF_SUBJECTS; i++)
-        {
-            h_First_Level_Results[i] = p[i];
-        }
-    }
-    else
+    // Read data in chunks and convert to floats
+    if (!ReadNiftiDataAsFloats(h_First_Level_Results, inputData))
     {
-        printf("Unknown data type in input data, aborting!\n");
-        FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
-		FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
-        return EXIT_FAILURE;
+    	printf("Could not read the input volumes, aborting!\n");
+    	FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+    	FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+    	return EXIT_FAILURE;
     }
     
 	// Mask is provided by user
 	if (MASK)
 	{
-	    if ( inputMask->datatype == DT_SIGNED_SHORT )
-	    {
-	        short int *p = (short int*)inputMask->data;
-    
-	        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-	        {
-	            h_Mask[i] = (float)p[i];
-	        }
-	    }
-	    else if ( inputMask->datatype == DT_FLOAT )
-	    {
-	        float *p = (float*)inputMask->data;
-    
-	        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-        	{
-	            h_Mask[i] = p[i];
-	        }
-	    }
-	    else if ( inputMask->datatype == DT_UINT8 )
+	    if (!ReadNiftiDataAsFloats(h_Mask, inputMask))
 	    {
-    	    unsigned char *p = (unsigned char*)inputMask->data;
-    
-	        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-	        {
-	            h_Mask[i] = (float)p[i];
-	        }
-	    }
-	    else
-	    {
-	        printf("Unknown data type in mask volume, aborting!\n");
-	        FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
-			FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
-	        return EXIT_FAILURE;
+	    	printf("Could not read the mask volume, aborting!\n");
+	    	FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+	    	FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+	    	return EXIT_FAILURE;
 	    }
 	}
 	// Mask is NOT provided by user, set all mask voxels to 1
@@ -1485,6 +1451,10 @@ int main(int argc, char **argv)
     // Initialization OK
     else
     {        
+        BROCCOLI.SetProfiling(PROFILE || (PROFILE_TRACE_FILENAME != NULL) || TIMELINE);
+        BROCCOLI.SetPipelineTimeline(TIMELINE);
+        BROCCOLI.AddPipelineStage("Read data", readTime, DATA_SIZE + (MASK ? VOLUME_SIZE : 0));
+
         BROCCOLI.SetInputFirstLevelResults(h_First_Level_Results);        
         BROCCOLI.SetInputMNIBrainMask(h_Mask);        
         BROCCOLI.SetMNIWidth(DATA_W);
@@ -1552,6 +1522,8 @@ int main(int argc, char **argv)
 			printf("\nIt took %f seconds to run the permutation test\n",(float)(endTime - startTime));
 		}
 
+        WriteProfilingResults(BROCCOLI, PROFILE, PROFILE_TRACE_FILENAME);
+
         // Print create buffer errors
         int* createBufferErrors = BROCCOLI.GetOpenCLCreateBufferErrors();
         for (int i = 0; i < BROCCOLI.GetNumberOfOpenCLKernels(); i++)
@@ -1686,6 +1658,9 @@ int main(int argc, char **argv)
 	}
 
     startTime = GetWallTime(); 
+
+	// Write the test values and the p-values at the same time
+	StartNiftiWriters();
         
 	if (!ANALYZE_FTEST)
 	{
@@ -1697,6 +1672,8 @@ int main(int argc, char **argv)
 	}
     WriteNifti(outputNifti,h_P_Values,"_perm_pvalues",ADD_FILENAME,DONT_CHECK_EXISTING_FILE);
 
+	bool volumesOK = FinishNiftiWriters();
+
 	endTime = GetWallTime();
 
 	if (VERBOS)
@@ -1704,12 +1681,39 @@ int main(int argc, char **argv)
 		printf("It took %f seconds to write the nifti file(s)\n",(float)(endTime - startTime));
 	}
 
+	if (!volumesOK)
+	{
+		printf("Could not write all the nifti files!\n");
+	}
+
+	// Save the timeline next to the outputs
+	if (TIMELINE)
+	{
+		BROCCOLI.AddPipelineStage("Write results", endTime - startTime, 0);
+
+		const char* extension = "_timeline.json";
+		char* filenameWithExtension;
+
+		CreateFilename(filenameWithExtension, inputData, extension, CHANGE_OUTPUT_NAME, outputFilename);
+
+		if (!BROCCOLI.WritePipelineTimeline(filenameWithExtension))
+		{
+			printf("Could not write %s !\n",filenameWithExtension);
+		}
+		free(filenameWithExtension);
+	}
+
     // Free all memory
     FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
     FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
 
 	free(h_Permutation_Distributions);
 	free(h_Permutation_Matrices);
+
+	if (!volumesOK)
+	{
+		return EXIT_FAILURE;
+	}
         
     return EXIT_SUCCESS;
 }
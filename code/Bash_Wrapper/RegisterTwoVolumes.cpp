@@ -104,11 +104,14 @@ int main(int argc, char **argv)
     const char*     FILENAME_EXTENSION = "_MNI";
     bool            PRINT = true;
 	bool			VERBOS = false;
+	bool			PROFILE = false;
+	const char*		PROFILE_TRACE_FILENAME = NULL;
     bool            WRITE_TRANSFORMATION_MATRIX = false;
     bool            WRITE_DISPLACEMENT_FIELD = false;
 	bool			WRITE_INTERPOLATED = false;
    	bool			CHANGE_OUTPUT_FILENAME = false;    
 	float			SIGMA = 5.0f;
+	const char*		TEMPLATE_CACHE_DIRECTORY = "";
 	bool			MASK = false;
 	bool			MASK_ORIGINAL = false;
 	const char* 	MASK_NAME;
@@ -142,6 +145,7 @@ int main(int argc, char **argv)
 
         printf(" -sigma                     Amount of Gaussian smoothing applied for regularization of the displacement field, defined as sigma of the Gaussian kernel (default 5.0)  \n");        
         printf(" -zcut                      Number of mm to cut from the bottom of the input volume, can be negative, useful if the head in the volume is placed very high or low (default 0) \n");        
+        printf(" -templatecache             Directory where the resized reference volume and its filter responses are saved, to be reused by later registrations to the same reference volume (default none) \n");
         printf(" -precenter                 Center the input volume before the registration starts (default off) \n");        
         printf(" -mask                      Mask to apply after linear and non-linear registration, to for example do a skullstrip (default none) \n");        
         printf(" -maskoriginal              Mask to apply after linear registration, to for example do a skullstrip. Returns the volume skullstripped and unregistered (but interpolated to the reference volume size) (default none) \n");        
@@ -151,6 +155,8 @@ int main(int argc, char **argv)
 		printf(" -saveinterpolated          Saves the input volume rescaled and resized to the size and resolution of the reference volume, before alignment (default false) \n");        
 		printf(" -output                    Set output filename (default input_volume_aligned_linear.nii and input_volume_aligned_nonlinear.nii) \n");
         printf(" -quiet                     Don't print anything to the terminal (default false) \n");
+        printf(" -profile                   Print the time and bytes of each OpenCL kernel and transfer (default false) \n");
+        printf(" -profiletrace              Write all OpenCL kernels and transfers to a Chrome trace file (chrome://tracing) (default none) \n");
         printf(" -verbose                   Print extra stuff (default false) \n");
         printf(" -debug                     Get additional debug information saved as nifti files (default no). Warning: This will use a lot of extra memory! \n");
         printf("\n\n");
@@ -343,6 +349,17 @@ int main(int argc, char **argv)
             }
             i += 2;
         }
+        else if (strcmp(input,"-templatecache") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read name after -templatecache !\n");
+                return EXIT_FAILURE;
+			}
+
+            TEMPLATE_CACHE_DIRECTORY = argv[i+1];
+            i += 2;
+        }
         else if (strcmp(input,"-zcut") == 0)
         {
 			if ( (i+1) >= argc  )
@@ -417,6 +434,22 @@ int main(int argc, char **argv)
             PRINT = false;
             i += 1;
         }
+        else if (strcmp(input,"-profile") == 0)
+        {
+            PROFILE = true;
+            i += 1;
+        }
+        else if (strcmp(input,"-profiletrace") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read name after -profiletrace !\n");
+                return EXIT_FAILURE;
+			}
+
+            PROFILE_TRACE_FILENAME = argv[i+1];
+            i += 2;
+        }
         else if (strcmp(input,"-verbose") == 0)
         {
             VERBOS = true;
@@ -460,7 +493,7 @@ int main(int argc, char **argv)
     // Read first volume (to transform)
 	// -----------------------------------
 
-    nifti_image *inputT1 = nifti_image_read(argv[1],1);
+    nifti_image *inputT1 = nifti_image_read(argv[1],0);
     
     if (inputT1 == NULL)
     {
@@ -510,7 +543,7 @@ int main(int argc, char **argv)
 	// Read second volume (reference)
 	// -----------------------------------
 
-    nifti_image *inputMNI = nifti_image_read(argv[2],1);
+    nifti_image *inputMNI = nifti_image_read(argv[2],0);
     
     if (inputMNI == NULL)
     {
@@ -534,7 +567,7 @@ int main(int argc, char **argv)
             return EXIT_FAILURE;
 		}
 
-	    inputMask = nifti_image_read(MASK_NAME,1);
+	    inputMask = nifti_image_read(MASK_NAME,0);
     
 	    if (inputMask == NULL)
 	    {
@@ -750,112 +783,31 @@ int main(int argc, char **argv)
 
 	startTime = GetWallTime();
 
-    // Convert data to floats
-    if ( inputT1->datatype == DT_SIGNED_SHORT )
+    // Read data in chunks and convert to floats
+    if (!ReadNiftiDataAsFloats(h_T1_Volume, inputT1))
     {
-        short int *p = (short int*)inputT1->data;
-    
-        for (size_t i = 0; i < T1_DATA_W * T1_DATA_H * T1_DATA_D * T1_DATA_T; i++)
-        {
-            h_T1_Volume[i] = (float)p[i];
-        }
-    }
-    else if ( inputT1->datatype == DT_UINT8 )
-    {
-        unsigned char *p = (unsigned char*)inputT1->data;
-    
-        for (size_t i = 0; i < T1_DATA_W * T1_DATA_H * T1_DATA_D * T1_DATA_T; i++)
-        {
-            h_T1_Volume[i] = (float)p[i];
-        }
+    	printf("Could not read the input volume, aborting!\n");
+    	FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+    	FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+    	return EXIT_FAILURE;
     }
-    else if ( inputT1->datatype == DT_FLOAT )
-    {
-        float *p = (float*)inputT1->data;
     
-        for (size_t i = 0; i < T1_DATA_W * T1_DATA_H * T1_DATA_D * T1_DATA_T; i++)
-        {
-            h_T1_Volume[i] = p[i];
-        }
-    }
-    else
+    if (!ReadNiftiDataAsFloats(h_MNI_Volume, inputMNI))
     {
-        printf("Unknown data type in input volume, aborting!\n");
-        FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
-		FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
-        return EXIT_FAILURE;
-    }
-    
-    if ( inputMNI->datatype == DT_SIGNED_SHORT )
-    {
-        short int *p = (short int*)inputMNI->data;
-    
-        for (size_t i = 0; i < MNI_DATA_W * MNI_DATA_H * MNI_DATA_D; i++)
-        {
-            h_MNI_Volume[i] = (float)p[i];
-        }
-    }
-    else if ( inputMNI->datatype == DT_UINT8 )
-    {
-        unsigned char *p = (unsigned char*)inputMNI->data;
-    
-        for (size_t i = 0; i < MNI_DATA_W * MNI_DATA_H * MNI_DATA_D; i++)
-        {
-            h_MNI_Volume[i] = (float)p[i];
-        }
-    }
-    else if ( inputMNI->datatype == DT_FLOAT )
-    {
-        float *p = (float*)inputMNI->data;
-    
-        for (size_t i = 0; i < MNI_DATA_W * MNI_DATA_H * MNI_DATA_D; i++)
-        {
-            h_MNI_Volume[i] = p[i];
-        }
-    }
-    else
-    {
-        printf("Unknown data type %i in reference volume, aborting!\n",inputMNI->datatype);
-        FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
-		FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
-        return EXIT_FAILURE;
+    	printf("Could not read the reference volume, aborting!\n");
+    	FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+    	FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+    	return EXIT_FAILURE;
     }
     
 	if (MASK || MASK_ORIGINAL)
 	{
-	    if ( inputMask->datatype == DT_SIGNED_SHORT )
+	    if (!ReadNiftiDataAsFloats(h_MNI_Brain_Mask, inputMask))
 	    {
-	        short int *p = (short int*)inputMask->data;
-    
-	        for (size_t i = 0; i < MNI_DATA_W * MNI_DATA_H * MNI_DATA_D; i++)
-	        {
-	            h_MNI_Brain_Mask[i] = (float)p[i];
-	        }
-	    }
-	    else if ( inputMask->datatype == DT_FLOAT )
-	    {
-	        float *p = (float*)inputMask->data;
-    
-	        for (size_t i = 0; i < MNI_DATA_W * MNI_DATA_H * MNI_DATA_D; i++)
-        	{
-	            h_MNI_Brain_Mask[i] = p[i];
-	        }
-	    }
-	    else if ( inputMask->datatype == DT_UINT8 )
-	    {
-    	    unsigned char *p = (unsigned char*)inputMask->data;
-    
-	        for (size_t i = 0; i < MNI_DATA_W * MNI_DATA_H * MNI_DATA_D; i++)
-	        {
-	            h_MNI_Brain_Mask[i] = (float)p[i];
-	        }
-	    }
-	    else
-	    {
-	        printf("Unknown data type in mask volume, aborting!\n");
-	        FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
-			FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
-	        return EXIT_FAILURE;
+	    	printf("Could not read the mask volume, aborting!\n");
+	    	FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+	    	FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+	    	return EXIT_FAILURE;
 	    }
 	}
 
@@ -1082,6 +1034,8 @@ int main(int argc, char **argv)
     // Initialization OK
     else
     {
+        BROCCOLI.SetProfiling(PROFILE || (PROFILE_TRACE_FILENAME != NULL));
+
         // Set all necessary pointers and values
         BROCCOLI.SetInputT1Volume(h_T1_Volume);
         BROCCOLI.SetInputMNIBrainVolume(h_MNI_Volume);
@@ -1108,6 +1062,7 @@ int main(int argc, char **argv)
         BROCCOLI.SetNumberOfIterationsForLinearImageRegistration(NUMBER_OF_ITERATIONS_FOR_LINEAR_IMAGE_REGISTRATION);
         BROCCOLI.SetNumberOfIterationsForNonLinearImageRegistration(NUMBER_OF_ITERATIONS_FOR_NONLINEAR_IMAGE_REGISTRATION);
         BROCCOLI.SetImageRegistrationFilterSize(IMAGE_REGISTRATION_FILTER_SIZE);    
+        BROCCOLI.SetTemplateCacheDirectory(TEMPLATE_CACHE_DIRECTORY);
         BROCCOLI.SetLinearImageRegistrationFilters(h_Quadrature_Filter_1_Linear_Registration_Real, h_Quadrature_Filter_1_Linear_Registration_Imag, h_Quadrature_Filter_2_Linear_Registration_Real, h_Quadrature_Filter_2_Linear_Registration_Imag, h_Quadrature_Filter_3_Linear_Registration_Real, h_Quadrature_Filter_3_Linear_Registration_Imag);
         BROCCOLI.SetNonLinearImageRegistrationFilters(h_Quadrature_Filter_1_NonLinear_Registration_Real, h_Quadrature_Filter_1_NonLinear_Registration_Imag, h_Quadrature_Filter_2_NonLinear_Registration_Real, h_Quadrature_Filter_2_NonLinear_Registration_Imag, h_Quadrature_Filter_3_NonLinear_Registration_Real, h_Quadrature_Filter_3_NonLinear_Registration_Imag, h_Quadrature_Filter_4_NonLinear_Registration_Real, h_Quadrature_Filter_4_NonLinear_Registration_Imag, h_Quadrature_Filter_5_NonLinear_Registration_Real, h_Quadrature_Filter_5_NonLinear_Registration_Imag, h_Quadrature_Filter_6_NonLinear_Registration_Real, h_Quadrature_Filter_6_NonLinear_Registration_Imag);    
         BROCCOLI.SetProjectionTensorMatrixFirstFilter(h_Projection_Tensor_1[0],h_Projection_Tensor_1[1],h_Projection_Tensor_1[2],h_Projection_Tensor_1[3],h_Projection_Tensor_1[4],h_Projection_Tensor_1[5]);
@@ -1175,6 +1130,8 @@ int main(int argc, char **argv)
 			printf("\nIt took %f seconds to run the registration\n",(float)(endTime - startTime));
 		}
 
+        WriteProfilingResults(BROCCOLI, PROFILE, PROFILE_TRACE_FILENAME);
+
         // Print create buffer errors
         int* createBufferErrors = BROCCOLI.GetOpenCLCreateBufferErrors();
         for (int i = 0; i < BROCCOLI.GetNumberOfOpenCLKernels(); i++)
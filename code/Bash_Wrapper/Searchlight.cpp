@@ -88,12 +88,20 @@ int main(int argc, char **argv)
     bool            DEBUG = false;
     bool            PRINT = true;
 	bool			VERBOS = false;
+	bool			PROFILE = false;
+	const char*		PROFILE_TRACE_FILENAME = NULL;
    	bool			CHANGE_OUTPUT_NAME = false;    
                    
     float           CLUSTER_DEFINING_THRESHOLD = 2.5f;
 	size_t			NUMBER_OF_PERMUTATIONS = 5000;
 	float			SIGNIFICANCE_LEVEL = 0.05f;
 	int				INFERENCE_MODE = 1;
+	int				CLASSIFIER = 0;
+	int				NUMBER_OF_FOLDS = 0;
+	float			REGULARIZATION = 0.1f;
+	float			RADIUS = 2.0f;
+	bool			CHANGE_RADIUS = false;
+	bool			DO_PERMUTATION_TEST = false;
 	bool			MASK = false;
 	const char*		MASK_NAME;
 	const char*		CLASS_FILE;
@@ -129,16 +137,21 @@ int main(int argc, char **argv)
         printf(" -device                    The OpenCL device to use for the specificed platform (default 0) \n");
         printf(" -classes                   Classes for training and testing of the classifier \n");
         printf(" -mask                      A mask that defines which voxels to analyze (default none) \n");
-        //printf(" -radius                  Radius of search light (default 1 = 7 voxels) \n");
-        //printf(" -classifier              Classifier to use, 0 = neural network, 1 = SVM (default 1) \n");
+        printf(" -classifier                Classifier to use, 0 = neural network, 1 = ridge regression, 2 = shrinkage LDA, 3 = diagonal LDA (default 0) \n");
+        printf(" -radius                    Radius of the searchlight sphere in voxels, for classifier 3 (default 2 = 33 voxels, max 6) \n");
+        printf(" -folds                     Number of folds for cross validation of classifier 1, 2 and 3 (default 0 = leave one out) \n");
+        printf(" -regularization            Regularization (0 - 1) for classifier 1, 2 and 3 (default 0.1) \n");
+        printf(" -permutations              Number of label permutations for classifier 1, gives corrected p-values (default none) \n");
         //printf(" -inferencemode             Inference mode to use, 0 = voxel, 1 = cluster extent, 2 = cluster mass, 3 = TFCE (default 1) \n");
         //printf(" -cdt                       Cluster defining threshold for cluster inference (default 2.5) \n");
         //printf(" -significance              The significance level to calculate the threshold for (default 0.05) \n");
 		//printf(" -output                    Set output filename (default volumes_perm_tvalues.nii and volumes_perm_pvalues.nii) \n");
-		//printf(" -writepermutationvalues    Write all the permutation values to a text file \n");
+		printf(" -writepermutationvalues    Write the maximum accuracy of each permutation to a text file \n");
 		//printf(" -writepermutations         Write all the random permutations (or sign flips) to a text file \n");
 		//printf(" -permutationfile           Use a specific permutation file or sign flipping file (e.g. from FSL) \n");
         printf(" -quiet                     Don't print anything to the terminal (default false) \n");
+        printf(" -profile                   Print the time and bytes of each OpenCL kernel and transfer (default false) \n");
+        printf(" -profiletrace              Write all OpenCL kernels and transfers to a Chrome trace file (chrome://tracing) (default none) \n");
         printf(" -verbose                   Print extra stuff (default false) \n");
         printf("\n\n");
         
@@ -219,6 +232,95 @@ int main(int argc, char **argv)
 			FOUND_CLASSES = true;
             i += 2;
         }
+        else if (strcmp(input,"-classifier") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read value after -classifier !\n");
+                return EXIT_FAILURE;
+			}
+
+            CLASSIFIER = (int)strtol(argv[i+1], &p, 10);
+
+			if (!isspace(*p) && *p != 0)
+		    {
+		        printf("Classifier must be an integer! You provided %s \n",argv[i+1]);
+				return EXIT_FAILURE;
+		    }
+            else if ( (CLASSIFIER != 0) && (CLASSIFIER != 1) && (CLASSIFIER != 2) && (CLASSIFIER != 3) )
+            {
+                printf("Classifier must be 0, 1, 2 or 3 !\n");
+                return EXIT_FAILURE;
+            }
+            i += 2;
+        }
+        else if (strcmp(input,"-radius") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read value after -radius !\n");
+                return EXIT_FAILURE;
+			}
+
+            RADIUS = (float)strtod(argv[i+1], &p);
+
+			if (!isspace(*p) && *p != 0)
+		    {
+		        printf("Radius must be a float! You provided %s \n",argv[i+1]);
+				return EXIT_FAILURE;
+		    }
+			if ( (RADIUS < 1.0f) || (RADIUS > 6.0f) )
+		    {
+		        printf("Radius must be between 1 and 6 voxels ! You provided %f \n",RADIUS);
+				return EXIT_FAILURE;
+		    }
+			CHANGE_RADIUS = true;
+            i += 2;
+        }
+        else if (strcmp(input,"-folds") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read value after -folds !\n");
+                return EXIT_FAILURE;
+			}
+
+            NUMBER_OF_FOLDS = (int)strtol(argv[i+1], &p, 10);
+
+			if (!isspace(*p) && *p != 0)
+		    {
+		        printf("Number of folds must be an integer! You provided %s \n",argv[i+1]);
+				return EXIT_FAILURE;
+		    }
+            else if ( (NUMBER_OF_FOLDS < 0) || (NUMBER_OF_FOLDS == 1) )
+            {
+                printf("Number of folds must be 0 (leave one out) or >= 2 !\n");
+                return EXIT_FAILURE;
+            }
+            i += 2;
+        }
+        else if (strcmp(input,"-regularization") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read value after -regularization !\n");
+                return EXIT_FAILURE;
+			}
+
+            REGULARIZATION = (float)strtod(argv[i+1], &p);
+
+			if (!isspace(*p) && *p != 0)
+		    {
+		        printf("Regularization must be a float! You provided %s \n",argv[i+1]);
+				return EXIT_FAILURE;
+		    }
+			if ( (REGULARIZATION < 0.0f) || (REGULARIZATION > 1.0f) )
+		    {
+		        printf("Regularization must be between 0 and 1 ! You provided %f \n",REGULARIZATION);
+				return EXIT_FAILURE;
+		    }
+            i += 2;
+        }
         else if (strcmp(input,"-permutations") == 0)
         {
 			if ( (i+1) >= argc  )
@@ -239,6 +341,7 @@ int main(int argc, char **argv)
                 printf("Number of permutations must be > 0!\n");
                 return EXIT_FAILURE;
             }
+			DO_PERMUTATION_TEST = true;
             i += 2;
         }
         else if (strcmp(input,"-inferencemode") == 0)
@@ -332,6 +435,22 @@ int main(int argc, char **argv)
             PRINT = false;
             i += 1;
         }
+        else if (strcmp(input,"-profile") == 0)
+        {
+            PROFILE = true;
+            i += 1;
+        }
+        else if (strcmp(input,"-profiletrace") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read name after -profiletrace !\n");
+                return EXIT_FAILURE;
+			}
+
+            PROFILE_TRACE_FILENAME = argv[i+1];
+            i += 2;
+        }
         else if (strcmp(input,"-verbose") == 0)
         {
             VERBOS = true;
@@ -392,6 +511,18 @@ int main(int argc, char **argv)
         }                
     }
 
+	if (CHANGE_RADIUS && (CLASSIFIER != 3))
+	{
+    	printf("The radius can only be changed for classifier 3, aborting! \n");
+        return EXIT_FAILURE;
+	}
+
+	if (DO_PERMUTATION_TEST && (CLASSIFIER != 1))
+	{
+    	printf("Permutations are only supported for classifier 1, aborting! \n");
+        return EXIT_FAILURE;
+	}
+
 	if (!FOUND_CLASSES)
 	{
     	printf("No class file detected, aborting! \n");
@@ -411,7 +542,7 @@ int main(int argc, char **argv)
     
     // Read data
 
-    nifti_image *inputData = nifti_image_read(argv[1],1);
+    nifti_image *inputData = nifti_image_read(argv[1],0);
     
     if (inputData == NULL)
     {
@@ -424,7 +555,7 @@ int main(int argc, char **argv)
 	nifti_image *inputMask;
 	if (MASK)
 	{
-	    inputMask = nifti_image_read(MASK_NAME,1);
+	    inputMask = nifti_image_read(MASK_NAME,0);
     
 	    if (inputMask == NULL)
 	    {
@@ -541,7 +672,11 @@ int main(int argc, char **argv)
 	AllocateMemory(h_Correct_Classes, CLASS_SIZE, allMemoryPointers, numberOfMemoryPointers, allNiftiImages, numberOfNiftiImages, allocatedHostMemory, "CLASSES");
     AllocateMemory(h_d, CLASS_SIZE, allMemoryPointers, numberOfMemoryPointers, allNiftiImages, numberOfNiftiImages, allocatedHostMemory, "D");
                         
-	//AllocateMemory(h_P_Values, STATISTICAL_MAPS_SIZE, allMemoryPointers, numberOfMemoryPointers, allNiftiImages, numberOfNiftiImages, allocatedHostMemory, "PERMUTATION_PVALUES");
+	if (DO_PERMUTATION_TEST)
+	{
+		AllocateMemory(h_P_Values, VOLUME_SIZE, allMemoryPointers, numberOfMemoryPointers, allNiftiImages, numberOfNiftiImages, allocatedHostMemory, "PERMUTATION_PVALUES");
+		AllocateMemory(h_Permutation_Distribution, NUMBER_OF_PERMUTATIONS * sizeof(float), allMemoryPointers, numberOfMemoryPointers, allNiftiImages, numberOfNiftiImages, allocatedHostMemory, "PERMUTATION_DISTRIBUTION");
+	}
 
 	//h_Permutation_Distributions = (float**)malloc(NUMBER_OF_CONTRASTS * sizeof(float*));
 	//h_Permutation_Matrices = (unsigned short int**)malloc(NUMBER_OF_CONTRASTS * sizeof(unsigned short int*));
@@ -575,6 +710,7 @@ int main(int argc, char **argv)
     design.close();
 
 	int uncensoredVolumes = 0;
+	int class1Volumes = 0;
 
     for (size_t v = 0; v < NUMBER_OF_VOLUMES; v++)
     {
@@ -591,8 +727,23 @@ int main(int argc, char **argv)
 		{
 			uncensoredVolumes++;
 		}
+		if (h_Correct_Classes[v] == 1.0f)
+		{
+			class1Volumes++;
+		}
     }
 
+	// Volumes of the same class have the same label, so the number of different labelings is the binomial coefficient
+	if (DO_PERMUTATION_TEST)
+	{
+		double MAX_PERMS = round(exp(lgamma(uncensoredVolumes+1)-lgamma(uncensoredVolumes-class1Volumes+1)-lgamma(class1Volumes+1)));
+		if ((double)NUMBER_OF_PERMUTATIONS > MAX_PERMS)
+		{
+			printf("Warning: Number of possible permutations of the classes is %g, but %g permutations were requested. Lowering number of permutations to number of possible permutations. \n",MAX_PERMS,(double)NUMBER_OF_PERMUTATIONS);
+			NUMBER_OF_PERMUTATIONS = (size_t)MAX_PERMS;
+		}
+	}
+
 	
 	
     NUMBER_OF_STATISTICAL_MAPS = 1;
@@ -604,49 +755,13 @@ int main(int argc, char **argv)
 
 	// Read data
 
-    // Convert data to floats
-    if ( inputData->datatype == DT_SIGNED_SHORT )
+    // Read data in chunks and convert to floats
+    if (!ReadNiftiDataAsFloats(h_Data, inputData))
     {
-        short int *p = (short int*)inputData->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * NUMBER_OF_VOLUMES; i++)
-        {
-            h_Data[i] = (float)p[i];
-        }
-    }
-	else if ( inputData->datatype == DT_UINT8 )
-    {
-        unsigned char *p = (unsigned char*)inputData->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * NUMBER_OF_VOLUMES; i++)
-        {
-            h_Data[i] = (float)p[i];
-        }
-    }
-    else if ( inputData->datatype == DT_UINT16 )
-    {
-        unsigned short int *p = (unsigned short int*)inputData->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * NUMBER_OF_VOLUMES; i++)
-        {
-            h_Data[i] = (float)p[i];
-        }
-    }
-    else if ( inputData->datatype == DT_FLOAT )
-    {
-        float *p = (float*)inputData->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * NUMBER_OF_VOLUMES; i++)
-        {
-            h_Data[i] = p[i];
-        }
-    }
-    else
-    {
-        printf("Unknown data type in input data, aborting!\n");
-        FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
-		FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
-        return EXIT_FAILURE;
+    	printf("Could not read the input data, aborting!\n");
+    	FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+    	FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+    	return EXIT_FAILURE;
     }
     
 	int maskVoxels = 0;
@@ -654,39 +769,12 @@ int main(int argc, char **argv)
 	// Mask is provided by user
 	if (MASK)
 	{
-	    if ( inputMask->datatype == DT_SIGNED_SHORT )
-	    {
-	        short int *p = (short int*)inputMask->data;
-    
-	        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-	        {
-	            h_Mask[i] = (float)p[i];
-	        }
-	    }
-	    else if ( inputMask->datatype == DT_FLOAT )
+	    if (!ReadNiftiDataAsFloats(h_Mask, inputMask))
 	    {
-	        float *p = (float*)inputMask->data;
-    
-	        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-        	{
-	            h_Mask[i] = p[i];
-	        }
-	    }
-	    else if ( inputMask->datatype == DT_UINT8 )
-	    {
-    	    unsigned char *p = (unsigned char*)inputMask->data;
-    
-	        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-	        {
-	            h_Mask[i] = (float)p[i];
-	        }
-	    }
-	    else
-	    {
-	        printf("Unknown data type in mask volume, aborting!\n");
-	        FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
-			FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
-	        return EXIT_FAILURE;
+	    	printf("Could not read the mask volume, aborting!\n");
+	    	FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+	    	FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+	    	return EXIT_FAILURE;
 	    }
 
         for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
@@ -806,11 +894,16 @@ int main(int argc, char **argv)
     // Initialization OK
     else
     {        
+        BROCCOLI.SetProfiling(PROFILE || (PROFILE_TRACE_FILENAME != NULL));
+
         BROCCOLI.SetInputFirstLevelResults(h_Data);
         BROCCOLI.SetInputMNIBrainMask(h_Mask);        
         BROCCOLI.SetMNIWidth(DATA_W);
         BROCCOLI.SetMNIHeight(DATA_H);
         BROCCOLI.SetMNIDepth(DATA_D);                
+        BROCCOLI.SetMNIVoxelSizeX(inputData->dx);
+        BROCCOLI.SetMNIVoxelSizeY(inputData->dy);
+        BROCCOLI.SetMNIVoxelSizeZ(inputData->dz);
         BROCCOLI.SetNumberOfSubjects(NUMBER_OF_VOLUMES);
         
 		BROCCOLI.SetAllocatedHostMemory(allocatedHostMemory);
@@ -822,8 +915,18 @@ int main(int argc, char **argv)
         //BROCCOLI.SetNumberOfPermutations(NUMBER_OF_PERMUTATIONS);
         //BROCCOLI.SetNumberOfGroupPermutations(NUMBER_OF_PERMUTATIONS_PER_CONTRAST);
         BROCCOLI.SetCorrectClasses(h_Correct_Classes, h_d);
+        BROCCOLI.SetSearchlightClassifier(CLASSIFIER);
+        BROCCOLI.SetNumberOfSearchlightFolds(NUMBER_OF_FOLDS);
+        BROCCOLI.SetSearchlightRegularization(REGULARIZATION);
+        BROCCOLI.SetSearchlightRadius(RADIUS);
+        BROCCOLI.SetNumberOfSearchlightPermutations(DO_PERMUTATION_TEST ? (int)NUMBER_OF_PERMUTATIONS : 0);
         
         BROCCOLI.SetOutputStatisticalMapsMNI(h_Classifier_Performance);
+        if (DO_PERMUTATION_TEST)
+        {
+            BROCCOLI.SetOutputPermutationDistribution(h_Permutation_Distribution);
+            BROCCOLI.SetOutputPValuesMNI(h_P_Values);
+        }
         //BROCCOLI.SetOutputPermutationDistributions(h_Permutation_Distributions);
         //BROCCOLI.SetOutputPValuesMNI(h_P_Values);
 
@@ -841,6 +944,8 @@ int main(int argc, char **argv)
 			printf("\nIt took %f seconds to run the searchlight\n",(float)(endTime - startTime));
 		}
 
+        WriteProfilingResults(BROCCOLI, PROFILE, PROFILE_TRACE_FILENAME);
+
         // Print create buffer errors
         int* createBufferErrors = BROCCOLI.GetOpenCLCreateBufferErrors();
         for (int i = 0; i < BROCCOLI.GetNumberOfOpenCLKernels(); i++)
@@ -901,6 +1006,10 @@ int main(int argc, char **argv)
     startTime = GetWallTime(); 
         
     WriteNifti(outputNifti,h_Classifier_Performance,"_classifier_performance",ADD_FILENAME,DONT_CHECK_EXISTING_FILE);
+    if (DO_PERMUTATION_TEST)
+    {
+        WriteNifti(outputNifti,h_P_Values,"_classifier_performance_perm_pvalues",ADD_FILENAME,DONT_CHECK_EXISTING_FILE);
+    }
 
 	endTime = GetWallTime();
 
@@ -909,6 +1018,27 @@ int main(int argc, char **argv)
 		printf("It took %f seconds to write the nifti file(s)\n",(float)(endTime - startTime));
 	}
 
+	// Write the null distribution of the maximum accuracy
+	if (DO_PERMUTATION_TEST && WRITE_PERMUTATION_VALUES)
+	{
+		std::ofstream permutationValues;
+	    permutationValues.open(PERMUTATION_VALUES_FILE);
+
+	    if ( permutationValues.good() )
+	    {
+		    for (size_t p = 0; p < NUMBER_OF_PERMUTATIONS; p++)
+	        {
+	        	permutationValues << std::setprecision(6) << std::fixed << (double)h_Permutation_Distribution[p] << " " << std::endl;
+			}
+		    permutationValues.close();
+	    }
+	    else
+	    {
+			permutationValues.close();
+	        printf("Could not open %s for writing permutation values!\n",PERMUTATION_VALUES_FILE);
+	    }
+	}
+
     // Free all memory
     FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
     FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
@@ -74,6 +74,8 @@ int main(int argc, char ** argv)
     const char*     FILENAME_EXTENSION = "_stc";
     bool            PRINT = true;
 	bool			VERBOS = false;
+	bool			PROFILE = false;
+	const char*		PROFILE_TRACE_FILENAME = NULL;
 	bool			CHANGE_OUTPUT_FILENAME = false;
     
     size_t          DATA_W, DATA_H, DATA_D, DATA_T;
@@ -113,6 +115,8 @@ int main(int argc, char ** argv)
 		printf(" -slicecustomref  Reference slice for the custom slice times (0 - (#slices-1)) (default #slices/2)\n");
         printf(" -output          Set output filename (default input_stc.nii) \n");
         printf(" -quiet           Don't print anything to the terminal (default false) \n");
+        printf(" -profile         Print the time and bytes of each OpenCL kernel and transfer (default false) \n");
+        printf(" -profiletrace    Write all OpenCL kernels and transfers to a Chrome trace file (chrome://tracing) (default none) \n");
         printf(" -verbose         Print extra stuff (default false) \n");
         printf("\n\n");
         
@@ -266,6 +270,22 @@ int main(int argc, char ** argv)
             PRINT = false;
             i += 1;
         }
+        else if (strcmp(input,"-profile") == 0)
+        {
+            PROFILE = true;
+            i += 1;
+        }
+        else if (strcmp(input,"-profiletrace") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read name after -profiletrace !\n");
+                return EXIT_FAILURE;
+			}
+
+            PROFILE_TRACE_FILENAME = argv[i+1];
+            i += 2;
+        }
         else if (strcmp(input,"-verbose") == 0)
         {
             VERBOS = true;
@@ -301,7 +321,7 @@ int main(int argc, char ** argv)
     double startTime = GetWallTime();
 
     // Read data
-    nifti_image *inputData = nifti_image_read(argv[1],1);
+    nifti_image *inputData = nifti_image_read(argv[1],0);
     
     if (inputData == NULL)
     {
@@ -472,7 +492,6 @@ int main(int argc, char ** argv)
 	}
 	
     // Calculate size, in bytes
-    size_t DATA_SIZE = DATA_W * DATA_H * DATA_D * DATA_T * sizeof(float);
     size_t VOLUME_SIZE = DATA_W * DATA_H * DATA_D * sizeof(float);
     
     // Print some info
@@ -493,92 +512,17 @@ int main(int argc, char ** argv)
     
     // ------------------------------------------------
     
-    // Allocate memory on the host
-    
 	startTime = GetWallTime();
 
-	// If the data is in float format, we can just copy the pointer
-	if ( inputData->datatype != DT_FLOAT )
-	{
-		AllocateMemory(h_fMRI_Volumes, DATA_SIZE, allMemoryPointers, numberOfMemoryPointers, allNiftiImages, numberOfNiftiImages, allocatedHostMemory, "INPUT_DATA");
-	}
-	else
-	{
-		allocatedHostMemory += DATA_SIZE;
-	}
-    
-	endTime = GetWallTime();
-    
-	if (VERBOS)
- 	{
-		printf("It took %f seconds to allocate memory\n",(float)(endTime - startTime));
-	}
-
-	startTime = GetWallTime();
-
-    // Convert data to floats
-    if ( inputData->datatype == DT_SIGNED_SHORT )
-    {
-        short int *p = (short int*)inputData->data;
-    
-        for (int i = 0; i < DATA_W * DATA_H * DATA_D * DATA_T; i++)
-        {
-            h_fMRI_Volumes[i] = (float)p[i];
-        }
-    }
-    else if ( inputData->datatype == DT_UINT8 )
-    {
-        unsigned char *p = (unsigned char*)inputData->data;
-    
-        for (int i = 0; i < DATA_W * DATA_H * DATA_D * DATA_T; i++)
-        {
-            h_fMRI_Volumes[i] = (float)p[i];
-        }
-    }
-    else if ( inputData->datatype == DT_UINT16 )
-    {
-        unsigned short int *p = (unsigned short int*)inputData->data;
-    
-        for (int i = 0; i < DATA_W * DATA_H * DATA_D * DATA_T; i++)
-        {
-            h_fMRI_Volumes[i] = (float)p[i];
-        }
-    }
-	// Correct data type, just copy the pointer
-	else if ( inputData->datatype == DT_FLOAT )
-    {
-		h_fMRI_Volumes = (float*)inputData->data;
-
-		// Save the pointer in the pointer list
-		allMemoryPointers[numberOfMemoryPointers] = (void*)h_fMRI_Volumes;
-        numberOfMemoryPointers++;		
-
-        //float *p = (float*)inputData->data;
-    
-        //for (int i = 0; i < DATA_W * DATA_H * DATA_D * DATA_T; i++)
-        //{
-        //    h_fMRI_Volumes[i] = p[i];
-        //}
-    }
-    else
+    // Read the data in chunks and convert to floats, float data is memory mapped
+    h_fMRI_Volumes = ReadNiftiAsFloats(inputData, allMemoryPointers, numberOfMemoryPointers, allocatedHostMemory);
+    if (h_fMRI_Volumes == NULL)
     {
-        printf("Unknown data type in input data, aborting!\n");
-        FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
-        FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
-        return EXIT_FAILURE;
+    	printf("Could not read the fMRI data, aborting!\n");
+    	FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+    	FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+    	return EXIT_FAILURE;
     }
-
-	// Free input fMRI data, it has been converted to floats
-	if ( inputData->datatype != DT_FLOAT )
-	{		
-		free(inputData->data);
-		inputData->data = NULL;
-	}
-	// Pointer has been copied to h_fMRI_Volumes and pointer list, so set the input data pointer to NULL
-	else
-	{		
-		inputData->data = NULL;
-	}
     
 	endTime = GetWallTime();
 
@@ -666,6 +610,8 @@ int main(int argc, char ** argv)
     // Initialization OK
     else
     {
+        BROCCOLI.SetProfiling(PROFILE || (PROFILE_TRACE_FILENAME != NULL));
+
         // Set all necessary pointers and values
         BROCCOLI.SetInputfMRIVolumes(h_fMRI_Volumes);
         
@@ -690,6 +636,8 @@ int main(int argc, char ** argv)
 			printf("\nIt took %f seconds to run the slice timing correction\n",(float)(endTime - startTime));
 		}    
 
+        WriteProfilingResults(BROCCOLI, PROFILE, PROFILE_TRACE_FILENAME);
+
         // Print create buffer errors
         int* createBufferErrors = BROCCOLI.GetOpenCLCreateBufferErrors();
         for (int i = 0; i < BROCCOLI.GetNumberOfOpenCLKernels(); i++)
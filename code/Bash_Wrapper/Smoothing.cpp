@@ -73,6 +73,8 @@ int main(int argc, char ** argv)
     const char*     FILENAME_EXTENSION = "_sm";
     bool            PRINT = true;
 	bool			VERBOS = false;
+	bool			PROFILE = false;
+	const char*		PROFILE_TRACE_FILENAME = NULL;
     
     size_t          DATA_W, DATA_H, DATA_D, DATA_T;
     float           EPI_VOXEL_SIZE_X, EPI_VOXEL_SIZE_Y, EPI_VOXEL_SIZE_Z;
@@ -109,6 +111,8 @@ int main(int argc, char ** argv)
         printf(" -automask        Generate a mask and perform smoothing inside mask (normalized convolution) \n");
         printf(" -output          Set output filename (default input_sm.nii) \n");
         printf(" -quiet           Don't print anything to the terminal (default false) \n");
+        printf(" -profile         Print the time and bytes of each OpenCL kernel and transfer (default false) \n");
+        printf(" -profiletrace    Write all OpenCL kernels and transfers to a Chrome trace file (chrome://tracing) (default none) \n");
         printf(" -verbose         Print extra stuff (default false) \n");
         printf("\n\n");
         
@@ -236,6 +240,22 @@ int main(int argc, char ** argv)
             PRINT = false;
             i += 1;
         }
+        else if (strcmp(input,"-profile") == 0)
+        {
+            PROFILE = true;
+            i += 1;
+        }
+        else if (strcmp(input,"-profiletrace") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read name after -profiletrace !\n");
+                return EXIT_FAILURE;
+			}
+
+            PROFILE_TRACE_FILENAME = argv[i+1];
+            i += 2;
+        }
         else if (strcmp(input,"-verbose") == 0)
         {
             VERBOS = true;
@@ -273,7 +293,7 @@ int main(int argc, char ** argv)
 	// ---------------------
     // Read data
 	// ---------------------
-    nifti_image *inputData = nifti_image_read(argv[1],1);
+    nifti_image *inputData = nifti_image_read(argv[1],0);
     
     if (inputData == NULL)
     {
@@ -302,7 +322,7 @@ int main(int argc, char ** argv)
 		}
 
 
-        inputMask = nifti_image_read(MASK_NAME,1);
+        inputMask = nifti_image_read(MASK_NAME,0);
         if (inputMask == NULL)
         {
             printf("Could not open mask volume!\n");
@@ -347,7 +367,6 @@ int main(int argc, char ** argv)
     EPI_VOXEL_SIZE_Z = inputData->dz;
     	
     // Calculate size, in bytes
-    size_t DATA_SIZE = DATA_W * DATA_H * DATA_D * DATA_T * sizeof(float);
     size_t VOLUME_SIZE = DATA_W * DATA_H * DATA_D * sizeof(float);
     
     // Print some info
@@ -365,15 +384,6 @@ int main(int argc, char ** argv)
     
 	startTime = GetWallTime();
 
-	// If the data is in float format, we can just copy the pointer
-	if ( inputData->datatype != DT_FLOAT )
-	{
-		AllocateMemory(h_fMRI_Volumes, DATA_SIZE, allMemoryPointers, numberOfMemoryPointers, allNiftiImages, numberOfNiftiImages, allocatedHostMemory, "INPUT_DATA");
-	}
-	else
-	{
-		allocatedHostMemory += DATA_SIZE;
-	}
 	AllocateMemory(h_Certainty, VOLUME_SIZE, allMemoryPointers, numberOfMemoryPointers, allNiftiImages, numberOfNiftiImages, allocatedHostMemory, "CERTAINTY");
 
 	endTime = GetWallTime();
@@ -385,116 +395,26 @@ int main(int argc, char ** argv)
 
 	startTime = GetWallTime();
 
-    // Convert data to floats
-    if ( inputData->datatype == DT_SIGNED_SHORT )
-    {
-        short int *p = (short int*)inputData->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * DATA_T; i++)
-        {
-            h_fMRI_Volumes[i] = (float)p[i];
-        }
-    }
-    else if ( inputData->datatype == DT_UINT8 )
-    {
-        unsigned char *p = (unsigned char*)inputData->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * DATA_T; i++)
-        {
-            h_fMRI_Volumes[i] = (float)p[i];
-        }
-    }
-    else if ( inputData->datatype == DT_UINT16 )
-    {
-        unsigned short int *p = (unsigned short int*)inputData->data;
-    
-        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * DATA_T; i++)
-        {
-            h_fMRI_Volumes[i] = (float)p[i];
-        }
-    }
-	// Correct data type, just copy the pointer
-	else if ( inputData->datatype == DT_FLOAT )
-    {
-		h_fMRI_Volumes = (float*)inputData->data;
-
-		// Save the pointer in the pointer list
-		allMemoryPointers[numberOfMemoryPointers] = (void*)h_fMRI_Volumes;
-        numberOfMemoryPointers++;		
-
-        //float *p = (float*)inputData->data;
-    
-        //for (size_t i = 0; i < DATA_W * DATA_H * DATA_D * DATA_T; i++)
-        //{
-        //    h_fMRI_Volumes[i] = p[i];
-        //}
-    }
-    else
-    {
-        printf("Unknown data type in input data, aborting!\n");
-        FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
-        FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
-        return EXIT_FAILURE;
-    }
-
-	// Free input fMRI data, it has been converted to floats
-	if ( inputData->datatype != DT_FLOAT )
-	{		
-		free(inputData->data);
-		inputData->data = NULL;
-	}
-	// Pointer has been copied to h_fMRI_Volumes and pointer list, so set the input data pointer to NULL
-	else
-	{		
-		inputData->data = NULL;
+	// Read the data in chunks and convert to floats, float data is memory mapped
+	h_fMRI_Volumes = ReadNiftiAsFloats(inputData, allMemoryPointers, numberOfMemoryPointers, allocatedHostMemory);
+	if (h_fMRI_Volumes == NULL)
+	{
+		printf("Could not read the input data, aborting!\n");
+		FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+		FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+		return EXIT_FAILURE;
 	}
     
 	// Mask is provided by user
 	if (MASK)
 	{
-	    if ( inputMask->datatype == DT_SIGNED_SHORT )
-	    {
-	        short int *p = (short int*)inputMask->data;
-    
-	        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-	        {
-	            h_Certainty[i] = (float)p[i];
-	        }
-	    }
-	    else if ( inputMask->datatype == DT_UINT16 )
-	    {
-	        unsigned short int *p = (unsigned short int*)inputMask->data;
-    
-	        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-        	{
-	            h_Certainty[i] = (float)p[i];
-	        }
-	    }
-	    else if ( inputMask->datatype == DT_FLOAT )
-	    {
-	        float *p = (float*)inputMask->data;
-    
-	        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-        	{
-	            h_Certainty[i] = p[i];
-	        }
-	    }
-	    else if ( inputMask->datatype == DT_UINT8 )
-	    {
-    	    unsigned char *p = (unsigned char*)inputMask->data;
-    
-	        for (size_t i = 0; i < DATA_W * DATA_H * DATA_D; i++)
-	        {
-	            h_Certainty[i] = (float)p[i];
-	        }
-	    }
-	    else
-	    {
-	        printf("Unknown data type in mask volume, aborting!\n");
-	        FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+		if (!ReadNiftiDataAsFloats(h_Certainty, inputMask))
+		{
+			printf("Could not read the mask volume, aborting!\n");
+			FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
 			FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
-	        return EXIT_FAILURE;
-	    }
+			return EXIT_FAILURE;
+		}
 	}
 	// Mask is NOT provided by user, set all mask voxels to 1
 	else
@@ -591,6 +511,8 @@ int main(int argc, char ** argv)
     // Initialization OK
     else
     {
+        BROCCOLI.SetProfiling(PROFILE || (PROFILE_TRACE_FILENAME != NULL));
+
         // Set all necessary pointers and values
         BROCCOLI.SetInputfMRIVolumes(h_fMRI_Volumes);
 		BROCCOLI.SetAutoMask(AUTO_MASK);
@@ -618,6 +540,8 @@ int main(int argc, char ** argv)
 			printf("\nIt took %f seconds to run the smoothing\n",(float)(endTime - startTime));
 		}    
 
+        WriteProfilingResults(BROCCOLI, PROFILE, PROFILE_TRACE_FILENAME);
+
         // Print create buffer errors
         int* createBufferErrors = BROCCOLI.GetOpenCLCreateBufferErrors();
         for (int i = 0; i < BROCCOLI.GetNumberOfOpenCLKernels(); i++)
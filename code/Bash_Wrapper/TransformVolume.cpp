@@ -89,6 +89,8 @@ int main(int argc, char **argv)
 	const char*		outputFilename;
 
 	bool			VERBOS = false;
+	bool			PROFILE = false;
+	const char*		PROFILE_TRACE_FILENAME = NULL;
 
     // Size parameters
     size_t          INPUT_DATA_H, INPUT_DATA_W, INPUT_DATA_D, INPUT_DATA_T;
@@ -124,6 +126,8 @@ int main(int argc, char **argv)
 		printf(" -interpolation             The interpolation to use, 0 = nearest neighbour, 1 = trilinear (default 1) \n");
 		printf(" -zcut                      Number of mm to cut from the bottom of the input volume, can be negative (default 0). Should be the same as for the call to RegisterTwoVolumes\n"); 
 		printf(" -output                    Set output filename (default volume_to_transform_warped.nii) \n");
+        printf(" -profile                   Print the time and bytes of each OpenCL kernel and transfer (default false) \n");
+        printf(" -profiletrace              Write all OpenCL kernels and transfers to a Chrome trace file (chrome://tracing) (default none) \n");
         printf(" -quiet                     Don't print anything to the terminal (default false) \n");
         printf("\n\n");
         
@@ -333,6 +337,22 @@ int main(int argc, char **argv)
 
             i += 2;
         }
+        else if (strcmp(input,"-profile") == 0)
+        {
+            PROFILE = true;
+            i += 1;
+        }
+        else if (strcmp(input,"-profiletrace") == 0)
+        {
+			if ( (i+1) >= argc  )
+			{
+			    printf("Unable to read name after -profiletrace !\n");
+                return EXIT_FAILURE;
+			}
+
+            PROFILE_TRACE_FILENAME = argv[i+1];
+            i += 2;
+        }
         else if (strcmp(input,"-quiet") == 0)
         {
             PRINT = false;
@@ -378,7 +398,7 @@ int main(int argc, char **argv)
 	}
 
     // Read data
-    nifti_image *inputVolume = nifti_image_read(argv[1],1);    
+    nifti_image *inputVolume = nifti_image_read(argv[1],0);    
     if (inputVolume == NULL)
     {
         printf("Could not open volume to transform!\n");
@@ -387,7 +407,7 @@ int main(int argc, char **argv)
 	allNiftiImages[numberOfNiftiImages] = inputVolume;
 	numberOfNiftiImages++;
 
-    nifti_image *referenceVolume = nifti_image_read(argv[2],1);    
+    nifti_image *referenceVolume = nifti_image_read(argv[2],0);    
     if (referenceVolume == NULL)
     {
         printf("Could not open reference volume!\n");
@@ -399,7 +419,7 @@ int main(int argc, char **argv)
 	nifti_image *inputDisplacementX, *inputDisplacementY, *inputDisplacementZ;
 	if (NONLINEARTRANSFORMATION)
 	{
-    	inputDisplacementX = nifti_image_read(xFieldFilename,1);   
+    	inputDisplacementX = nifti_image_read(xFieldFilename,0);   
 	    if (inputDisplacementX == NULL)
 	    {
 	        printf("Could not open displacement X volume %s !\n",xFieldFilename);
@@ -408,7 +428,7 @@ int main(int argc, char **argv)
 		allNiftiImages[numberOfNiftiImages] = inputDisplacementX;
 		numberOfNiftiImages++;
 
-    	inputDisplacementY = nifti_image_read(yFieldFilename,1);   
+    	inputDisplacementY = nifti_image_read(yFieldFilename,0);   
     	if (inputDisplacementY == NULL)
     	{
     	    printf("Could not open displacement Y volume %s !\n",yFieldFilename);
@@ -417,7 +437,7 @@ int main(int argc, char **argv)
 		allNiftiImages[numberOfNiftiImages] = inputDisplacementY;
 		numberOfNiftiImages++;
 
-    	inputDisplacementZ = nifti_image_read(zFieldFilename,1);   
+    	inputDisplacementZ = nifti_image_read(zFieldFilename,0);   
     	if (inputDisplacementZ == NULL)
     	{
     	    printf("Could not open displacement Z volume %s !\n",zFieldFilename);
@@ -523,120 +543,39 @@ int main(int argc, char **argv)
 		AllocateMemory(h_Displacement_Field_Z, REFERENCE_VOLUME_SIZE, allMemoryPointers, numberOfMemoryPointers, allNiftiImages, numberOfNiftiImages, allocatedHostMemory, "DISPLACEMENT_FIELD_Z");
 	}
 			           
-    // Convert data to floats
-    if ( inputVolume->datatype == DT_SIGNED_SHORT )
-    {
-        short int *p = (short int*)inputVolume->data;
-    
-        for (size_t i = 0; i < INPUT_DATA_W * INPUT_DATA_H * INPUT_DATA_D * INPUT_DATA_T; i++)
-        {
-            h_Input_Volume[i] = (float)p[i];
-        }
-    }
-    else if ( inputVolume->datatype == DT_FLOAT )
-    {
-        float *p = (float*)inputVolume->data;
-    
-        for (size_t i = 0; i < INPUT_DATA_W * INPUT_DATA_H * INPUT_DATA_D * INPUT_DATA_T; i++)
-        {
-            h_Input_Volume[i] = p[i];
-        }
-    }
-    else if ( inputVolume->datatype == DT_UINT8 )
-    {
-        unsigned char *p = (unsigned char*)inputVolume->data;
-    
-        for (size_t i = 0; i < INPUT_DATA_W * INPUT_DATA_H * INPUT_DATA_D * INPUT_DATA_T; i++)
-        {
-            h_Input_Volume[i] = (float)p[i];
-        }
-    }
-    else
+    // Read data in chunks and convert to floats
+    if (!ReadNiftiDataAsFloats(h_Input_Volume, inputVolume))
     {
-        printf("Unknown data type in volume to transform, aborting!\n");
-        FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
-        FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
-        return EXIT_FAILURE;
+    	printf("Could not read the volume to transform, aborting!\n");
+    	FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+    	FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+    	return EXIT_FAILURE;
     }
     
 	if (NONLINEARTRANSFORMATION)
 	{
-	    if ( inputDisplacementX->datatype == DT_SIGNED_SHORT )
+    	if (!ReadNiftiDataAsFloats(h_Displacement_Field_X, inputDisplacementX))
     	{
-    	    short int *p = (short int*)inputDisplacementX->data;
-    
-    	    for (size_t i = 0; i < REFERENCE_DATA_W * REFERENCE_DATA_H * REFERENCE_DATA_D; i++)
-    	    {
-    	        h_Displacement_Field_X[i] = (float)p[i];
-    	    }
-    	}
-    	else if ( inputDisplacementX->datatype == DT_FLOAT )
-    	{
-    	    float *p = (float*)inputDisplacementX->data;
-    	
-    	    for (size_t i = 0; i < REFERENCE_DATA_W * REFERENCE_DATA_H * REFERENCE_DATA_D; i++)
-    	    {
-    	        h_Displacement_Field_X[i] = p[i];
-    	    }
-    	}
-    	else
-    	{
-    	    printf("Unknown data type in displacement x volume, aborting!\n");
-    	    FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
-    	    FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
-    	    return EXIT_FAILURE;
+    		printf("Could not read the displacement x volume, aborting!\n");
+    		FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+    		FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+    		return EXIT_FAILURE;
     	}
 
-    	if ( inputDisplacementY->datatype == DT_SIGNED_SHORT )
+    	if (!ReadNiftiDataAsFloats(h_Displacement_Field_Y, inputDisplacementY))
     	{
-    	    short int *p = (short int*)inputDisplacementY->data;
-    	
-    	    for (size_t i = 0; i < REFERENCE_DATA_W * REFERENCE_DATA_H * REFERENCE_DATA_D; i++)
-    	    {
-		        h_Displacement_Field_Y[i] = (float)p[i];
-    	    }
-    	}
-    	else if ( inputDisplacementY->datatype == DT_FLOAT )
-    	{
-    	    float *p = (float*)inputDisplacementY->data;
-    	
-    	    for (size_t i = 0; i < REFERENCE_DATA_W * REFERENCE_DATA_H * REFERENCE_DATA_D; i++)
-    	    {
-    	        h_Displacement_Field_Y[i] = p[i];			
-    	    }
-    	}
-    	else
-    	{
-    	    printf("Unknown data type in displacement y volume, aborting!\n");
-    	    FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
-    	    FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
-    	    return EXIT_FAILURE;
+    		printf("Could not read the displacement y volume, aborting!\n");
+    		FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+    		FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+    		return EXIT_FAILURE;
     	}
 
-    	if ( inputDisplacementZ->datatype == DT_SIGNED_SHORT )
-    	{
-    	    short int *p = (short int*)inputDisplacementZ->data;
-    	
-    	    for (size_t i = 0; i < REFERENCE_DATA_W * REFERENCE_DATA_H * REFERENCE_DATA_D; i++)
-    	    {
-    	        h_Displacement_Field_Z[i] = (float)p[i];
-    	    }
-    	}
-    	else if ( inputDisplacementZ->datatype == DT_FLOAT )
-    	{
-    	    float *p = (float*)inputDisplacementZ->data;
-    	
-    	    for (size_t i = 0; i < REFERENCE_DATA_W * REFERENCE_DATA_H * REFERENCE_DATA_D; i++)
-    	    {
-    	        h_Displacement_Field_Z[i] = p[i];
-    	    }
-    	}
-    	else
+    	if (!ReadNiftiDataAsFloats(h_Displacement_Field_Z, inputDisplacementZ))
     	{
-    	    printf("Unknown data type in displacement z volume, aborting!\n");
-    	    FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
-    	    FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
-    	    return EXIT_FAILURE;
+    		printf("Could not read the displacement z volume, aborting!\n");
+    		FreeAllMemory(allMemoryPointers,numberOfMemoryPointers);
+    		FreeAllNiftiImages(allNiftiImages,numberOfNiftiImages);
+    		return EXIT_FAILURE;
     	}
 	}
 
@@ -796,6 +735,8 @@ int main(int argc, char **argv)
     // Initialization OK
     else
     {
+        BROCCOLI.SetProfiling(PROFILE || (PROFILE_TRACE_FILENAME != NULL));
+
         // Set all necessary pointers and values
         BROCCOLI.SetInputT1Volume(h_Input_Volume);        
         BROCCOLI.SetT1Width(INPUT_DATA_W);
@@ -842,6 +783,8 @@ int main(int argc, char **argv)
 			BROCCOLI.TransformVolumesNonLinearWrapper();
 		}
 		
+        WriteProfilingResults(BROCCOLI, PROFILE, PROFILE_TRACE_FILENAME);
+
         // Print create buffer errors
         int* createBufferErrors = BROCCOLI.GetOpenCLCreateBufferErrors();
         for (int i = 0; i < BROCCOLI.GetNumberOfOpenCLKernels(); i++)
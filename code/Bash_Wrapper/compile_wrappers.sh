@@ -44,10 +44,10 @@ CLBLAS_LIBRARY_DIRECTORY=${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/clBLASLinux
 
 # Set compilation flags
 if [ "$COMPILATION" -eq "$RELEASE" ] ; then
-    FLAGS="-O3 -DNDEBUG -m64 -fopenmp"
+    FLAGS="-O3 -DNDEBUG -m64 -fopenmp -pthread"
 	BROCCOLI_LIBRARY_DIRECTORY=${BROCCOLI_GIT_DIRECTORY}/compiled/BROCCOLI_LIB/Linux/Release
 elif [ "$COMPILATION" -eq "$DEBUG" ] ; then
-    FLAGS="-O0 -g -m64"
+    FLAGS="-O0 -g -m64 -pthread"
 	BROCCOLI_LIBRARY_DIRECTORY=${BROCCOLI_GIT_DIRECTORY}/compiled/BROCCOLI_LIB/Linux/Debug
 else
     echo "Unknown compilation mode"
@@ -58,6 +58,8 @@ g++ GetOpenCLInfo.cpp -I${OPENCL_HEADER_DIRECTORY1} -I${OPENCL_HEADER_DIRECTORY2
 
 g++ GetBandwidth.cpp -I${OPENCL_HEADER_DIRECTORY1} -I${OPENCL_HEADER_DIRECTORY2} -L${OPENCL_LIBRARY_DIRECTORY} -L${CLBLAS_LIBRARY_DIRECTORY} -I${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/ -L${BROCCOLI_LIBRARY_DIRECTORY} -L${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/lib -I${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/Eigen -lBROCCOLI_LIB -lOpenCL -lclBLAS ${FLAGS} -o GetBandwidth &
 
+g++ KernelBenchmark.cpp -I${OPENCL_HEADER_DIRECTORY1} -I${OPENCL_HEADER_DIRECTORY2} -L${OPENCL_LIBRARY_DIRECTORY} -L${CLBLAS_LIBRARY_DIRECTORY} -I${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/ -L${BROCCOLI_LIBRARY_DIRECTORY} -L${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/lib -I${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/Eigen -lBROCCOLI_LIB -lOpenCL -lclBLAS ${FLAGS} -o KernelBenchmark &
+
 # Support for compressed files
 g++ MotionCorrection.cpp -I${OPENCL_HEADER_DIRECTORY1} -I${OPENCL_HEADER_DIRECTORY2} -L${OPENCL_LIBRARY_DIRECTORY} -L${CLBLAS_LIBRARY_DIRECTORY} -I${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/ -L${BROCCOLI_LIBRARY_DIRECTORY} -L${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/lib -I${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/Eigen -I${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/niftilib -I${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/znzlib -lBROCCOLI_LIB -lOpenCL -lclBLAS -lniftiio -lznz -lz ${FLAGS} -o MotionCorrection &
 
@@ -79,6 +81,10 @@ g++ ICA.cpp -I${OPENCL_HEADER_DIRECTORY1} -I${OPENCL_HEADER_DIRECTORY2} -L${OPEN
 
 g++ Searchlight.cpp -I${OPENCL_HEADER_DIRECTORY1} -I${OPENCL_HEADER_DIRECTORY2} -L${OPENCL_LIBRARY_DIRECTORY} -L${CLBLAS_LIBRARY_DIRECTORY} -I${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/ -L${BROCCOLI_LIBRARY_DIRECTORY} -L${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/lib -I${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/Eigen -I${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/niftilib -I${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/znzlib -lBROCCOLI_LIB -lOpenCL -lclBLAS -lniftiio -lznz -lz ${FLAGS} -o Searchlight &
 
+g++ ConvertMaskedVolumes.cpp -I${OPENCL_HEADER_DIRECTORY1} -I${OPENCL_HEADER_DIRECTORY2} -L${OPENCL_LIBRARY_DIRECTORY} -L${CLBLAS_LIBRARY_DIRECTORY} -I${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/ -L${BROCCOLI_LIBRARY_DIRECTORY} -L${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/lib -I${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/Eigen -I${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/niftilib -I${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/znzlib -lBROCCOLI_LIB -lOpenCL -lclBLAS -lniftiio -lznz -lz ${FLAGS} -o ConvertMaskedVolumes &
+
+g++ CreateSyntheticData.cpp -I${OPENCL_HEADER_DIRECTORY1} -I${OPENCL_HEADER_DIRECTORY2} -L${OPENCL_LIBRARY_DIRECTORY} -L${CLBLAS_LIBRARY_DIRECTORY} -I${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/ -L${BROCCOLI_LIBRARY_DIRECTORY} -L${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/lib -I${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/Eigen -I${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/niftilib -I${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/znzlib -lBROCCOLI_LIB -lOpenCL -lclBLAS -lniftiio -lznz -lz ${FLAGS} -o CreateSyntheticData &
+
 
 
 #g++ CombineAffineTransforms.cpp -I${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/Eigen ${FLAGS} -o CombineAffineTransforms &
@@ -95,6 +101,7 @@ wait
 if [ "$COMPILATION" -eq "$RELEASE" ] ; then
 	mv GetOpenCLInfo ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Release
 	mv GetBandwidth ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Release
+	mv KernelBenchmark ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Release
 	mv MotionCorrection ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Release
 	mv RegisterTwoVolumes ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Release
 	mv TransformVolume ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Release
@@ -105,12 +112,15 @@ if [ "$COMPILATION" -eq "$RELEASE" ] ; then
 	mv GLM ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Release
 	mv ICA ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Release
 	mv Searchlight ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Release
+	mv ConvertMaskedVolumes ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Release
+	mv CreateSyntheticData ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Release
 	#mv MakeROI ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Release
 	#mv ExtractTimeseries ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Release
 	#mv CombineAffineTransforms ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Release
 elif [ "$COMPILATION" -eq "$DEBUG" ] ; then
 	mv GetOpenCLInfo ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Debug
 	mv GetBandwidth ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Debug
+	mv KernelBenchmark ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Debug
 	mv MotionCorrection ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Debug
 	mv RegisterTwoVolumes ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Debug
 	mv TransformVolume ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Debug
@@ -121,6 +131,8 @@ elif [ "$COMPILATION" -eq "$DEBUG" ] ; then
 	mv GLM ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Debug
 	mv ICA ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Debug
 	mv Searchlight ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Debug
+	mv ConvertMaskedVolumes ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Debug
+	mv CreateSyntheticData ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Debug
 	#mv MakeROI ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Debug
 	#mv ExtractTimeseries ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Debug
 	#mv CombineAffineTransforms ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Debug
@@ -16,10 +16,10 @@ OPENCL_HEADER_DIRECTORY=/Applications/Xcode.app/Contents/Developer/Platforms/Mac
 
 # Set compilation flags
 if [ "$COMPILATION" -eq "$RELEASE" ] ; then
-    FLAGS="-O3 -DNDEBUG"
+    FLAGS="-O3 -DNDEBUG -pthread"
 	BROCCOLI_LIBRARY_DIRECTORY=${BROCCOLI_GIT_DIRECTORY}/compiled/BROCCOLI_LIB/Mac/Release
 elif [ "$COMPILATION" -eq "$DEBUG" ] ; then
-    FLAGS="-O0 -g"
+    FLAGS="-O0 -g -pthread"
 	BROCCOLI_LIBRARY_DIRECTORY=${BROCCOLI_GIT_DIRECTORY}/compiled/BROCCOLI_LIB/Mac/Debug
 else
     echo "Unknown compilation mode"
@@ -30,6 +30,8 @@ g++ -framework OpenCL  GetOpenCLInfo.cpp -lBROCCOLI_LIB -I${OPENCL_HEADER_DIRECT
 
 g++ -framework OpenCL  GetBandwidth.cpp -lBROCCOLI_LIB -I${OPENCL_HEADER_DIRECTORY}  -I${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/ -L${BROCCOLI_LIBRARY_DIRECTORY}  -I${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/Eigen ${FLAGS} -o GetBandwidth
 
+g++ -framework OpenCL  KernelBenchmark.cpp -lBROCCOLI_LIB -I${OPENCL_HEADER_DIRECTORY}  -I${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/ -L${BROCCOLI_LIBRARY_DIRECTORY}  -I${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/Eigen ${FLAGS} -o KernelBenchmark
+
 g++ -framework OpenCL MotionCorrection.cpp -lBROCCOLI_LIB -lniftiio -lznz -lz -I${OPENCL_HEADER_DIRECTORY} -I${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/ -L${BROCCOLI_LIBRARY_DIRECTORY} -L${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/lib -I${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/Eigen -I${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/niftilib -I${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/znzlib ${FLAGS} -o MotionCorrection
 
 g++ -framework OpenCL RegisterTwoVolumes.cpp -lBROCCOLI_LIB -lniftiio -lznz -lz -I${OPENCL_HEADER_DIRECTORY} -I${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/ -L${BROCCOLI_LIBRARY_DIRECTORY} -L${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/lib -I${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/Eigen -I${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/niftilib -I${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/znzlib ${FLAGS} -o RegisterTwoVolumes
@@ -50,6 +52,10 @@ g++ -framework OpenCL ICA.cpp -lBROCCOLI_LIB -lniftiio -lznz -lz -I${OPENCL_HEAD
 
 g++ -framework OpenCL Searchlight.cpp -lBROCCOLI_LIB -lniftiio -lznz -lz -I${OPENCL_HEADER_DIRECTORY} -I${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/ -L${BROCCOLI_LIBRARY_DIRECTORY} -L${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/lib -I${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/Eigen -I${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/niftilib -I${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/znzlib ${FLAGS} -o Searchlight
 
+g++ -framework OpenCL ConvertMaskedVolumes.cpp -lBROCCOLI_LIB -lniftiio -lznz -lz -I${OPENCL_HEADER_DIRECTORY} -I${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/ -L${BROCCOLI_LIBRARY_DIRECTORY} -L${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/lib -I${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/Eigen -I${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/niftilib -I${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/znzlib ${FLAGS} -o ConvertMaskedVolumes
+
+g++ -framework OpenCL CreateSyntheticData.cpp -lBROCCOLI_LIB -lniftiio -lznz -lz -I${OPENCL_HEADER_DIRECTORY} -I${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/ -L${BROCCOLI_LIBRARY_DIRECTORY} -L${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/lib -I${BROCCOLI_GIT_DIRECTORY}/code/BROCCOLI_LIB/Eigen -I${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/niftilib -I${BROCCOLI_GIT_DIRECTORY}/code/Bash_Wrapper/nifticlib-2.0.0/znzlib ${FLAGS} -o CreateSyntheticData
+
 
 
 
@@ -58,6 +64,7 @@ g++ -framework OpenCL Searchlight.cpp -lBROCCOLI_LIB -lniftiio -lznz -lz -I${OPE
 if [ "$COMPILATION" -eq "$RELEASE" ] ; then
     mv GetOpenCLInfo ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Mac/Release
     mv GetBandwidth ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Mac/Release
+    mv KernelBenchmark ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Mac/Release
     mv MotionCorrection ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Mac/Release
     mv RegisterTwoVolumes ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Mac/Release
     mv TransformVolume ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Mac/Release
@@ -68,9 +75,12 @@ if [ "$COMPILATION" -eq "$RELEASE" ] ; then
     mv GLM ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Mac/Release
     mv ICA ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Mac/Release
     mv Searchlight ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Mac/Release
+    mv ConvertMaskedVolumes ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Mac/Release
+    mv CreateSyntheticData ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Mac/Release
 elif [ "$COMPILATION" -eq "$DEBUG" ] ; then
     mv GetOpenCLInfo ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Mac/Debug
     mv GetBandwidth ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Mac/Debug
+    mv KernelBenchmark ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Mac/Debug
     mv MotionCorrection ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Mac/Debug
     mv RegisterTwoVolumes ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Mac/Debug
     mv TransformVolume ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Mac/Debug
@@ -81,6 +91,8 @@ elif [ "$COMPILATION" -eq "$DEBUG" ] ; then
     mv GLM ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Mac/Debug
     mv ICA ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Mac/Debug
     mv Searchlight ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Mac/Debug
+    mv ConvertMaskedVolumes ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Mac/Debug
+    mv CreateSyntheticData ${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Mac/Debug
 fi
 
 # For debugging, use lldb
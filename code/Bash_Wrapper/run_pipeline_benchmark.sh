@@ -0,0 +1,197 @@
+#!/bin/bash
+
+# End to end benchmark of FirstLevelAnalysis and RandomiseGroupLevel, on synthetic data of several sizes.
+# CreateSyntheticData makes fMRI data with a known activation, head motion and AR(4) noise, both programs are
+# run with -timeline and the wall time of each processing stage is saved in a tab separated file. With -baseline,
+# the script fails if any stage is slower than in the baseline by more than the threshold.
+#
+# Example, save a baseline on a CPU device and compare a later version to it
+# ./run_pipeline_benchmark.sh -platform 0 -device 0 -output baseline.txt
+# ./run_pipeline_benchmark.sh -platform 0 -device 0 -baseline baseline.txt -threshold 15
+
+BROCCOLI_GIT_DIRECTORY=`cd $(dirname $0) && git rev-parse --show-toplevel`
+
+# Default settings
+BINARY_DIRECTORY=${BROCCOLI_GIT_DIRECTORY}/compiled/Bash/Linux/Release
+WORK_DIRECTORY=/tmp/broccoli_pipeline_benchmark
+PLATFORM=0
+DEVICE=0
+# Width x height x depth x timepoints x voxel size (mm), from a small fMRI dataset to 2 mm MNI resolution with 1200 volumes
+SIZES="64x64x64x200x3 80x80x60x600x2.5 91x109x91x1200x2"
+SUBJECTS=20
+PERMUTATIONS=1000
+REPETITIONS=1
+THRESHOLD=10
+MINIMUM_SECONDS=1
+OUTPUT=pipeline_benchmark.txt
+BASELINE=
+REGENERATE=0
+
+function print_help {
+    echo "Usage:"
+    echo ""
+    echo "run_pipeline_benchmark.sh [options]"
+    echo ""
+    echo "Options:"
+    echo ""
+    echo " -platform           The OpenCL platform to use, should be a CPU platform (default 0)"
+    echo " -device             The OpenCL device to use for the specified platform (default 0)"
+    echo " -sizes              Sizes of the synthetic fMRI data, as a quoted list of WxHxDxTxVOXELSIZE (default \"${SIZES}\")"
+    echo " -subjects           Number of subjects for RandomiseGroupLevel (default ${SUBJECTS})"
+    echo " -permutations       Number of permutations for RandomiseGroupLevel (default ${PERMUTATIONS})"
+    echo " -repetitions        Number of runs of each program, the fastest time of each stage is used (default ${REPETITIONS})"
+    echo " -output             Tab separated file with the time of each stage, can be used as a baseline (default ${OUTPUT})"
+    echo " -baseline           Compare the times to a file written with -output (default none)"
+    echo " -threshold          Allowed slowdown of a stage in percent compared to the baseline (default ${THRESHOLD})"
+    echo " -minimumseconds     Slowdowns smaller than this number of seconds are never regressions (default ${MINIMUM_SECONDS})"
+    echo " -bin                Directory with the compiled bash wrappers (default ${BINARY_DIRECTORY})"
+    echo " -workdir            Directory for the synthetic data and the results (default ${WORK_DIRECTORY})"
+    echo " -regenerate         Create the synthetic data again, even if they exist in the work directory (default no)"
+    echo ""
+}
+
+while [ "$#" -gt 0 ]; do
+    case "$1" in
+        -platform)        PLATFORM=$2; shift 2 ;;
+        -device)          DEVICE=$2; shift 2 ;;
+        -sizes)           SIZES=$2; shift 2 ;;
+        -subjects)        SUBJECTS=$2; shift 2 ;;
+        -permutations)    PERMUTATIONS=$2; shift 2 ;;
+        -repetitions)     REPETITIONS=$2; shift 2 ;;
+        -output)          OUTPUT=$2; shift 2 ;;
+        -baseline)        BASELINE=$2; shift 2 ;;
+        -threshold)       THRESHOLD=$2; shift 2 ;;
+        -minimumseconds)  MINIMUM_SECONDS=$2; shift 2 ;;
+        -bin)             BINARY_DIRECTORY=$2; shift 2 ;;
+        -workdir)         WORK_DIRECTORY=$2; shift 2 ;;
+        -regenerate)      REGENERATE=1; shift 1 ;;
+        -help)            print_help; exit 0 ;;
+        *)                echo "Unrecognized option! $1"; print_help; exit 1 ;;
+    esac
+done
+
+for program in CreateSyntheticData FirstLevelAnalysis RandomiseGroupLevel; do
+    if [ ! -x "${BINARY_DIRECTORY}/${program}" ]; then
+        echo "Could not find ${BINARY_DIRECTORY}/${program} !"
+        exit 1
+    fi
+done
+
+if [ -n "${BASELINE}" ] && [ ! -f "${BASELINE}" ]; then
+    echo "Could not open baseline ${BASELINE} !"
+    exit 1
+fi
+
+# Relative paths are used after changing to the work directory
+OUTPUT=`readlink -f ${OUTPUT}`
+if [ -n "${BASELINE}" ]; then
+    BASELINE=`readlink -f ${BASELINE}`
+fi
+
+mkdir -p ${WORK_DIRECTORY}
+cd ${WORK_DIRECTORY}
+
+RESULTS=`mktemp`
+
+# Runs a program, and adds the wall time of each stage in its timeline to the results
+# Arguments: case, program, timeline file, program arguments
+function run_program {
+
+    case_name=$1
+    program=$2
+    timeline=$3
+    shift 3
+
+    echo "Running ${program} for ${case_name}"
+
+    rm -f ${timeline}
+    ${BINARY_DIRECTORY}/${program} "$@" -platform ${PLATFORM} -device ${DEVICE} -timeline > ${case_name}_${program}.log 2>&1
+    if [ "$?" -ne "0" ] || [ ! -f "${timeline}" ]; then
+        echo "${program} failed for ${case_name}, see ${WORK_DIRECTORY}/${case_name}_${program}.log"
+        rm -f ${RESULTS}
+        exit 1
+    fi
+
+    # One stage per line in the timeline, stages with the same name are added
+    sed -n 's/^,\{0,1\}{"name": "\([^"]*\)", "wall_seconds": \([0-9.]*\),.*/\1\t\2/p' ${timeline} | \
+        awk -F'\t' -v case_name=${case_name} -v program=${program} '{ times[$1] += $2; if (!($1 in order)) { order[$1] = n++; names[n] = $1 } }
+            END { for (i = 1; i <= n; i++) printf "%s\t%s\t%s\t%.6f\n", case_name, program, names[i], times[names[i]] }' >> ${RESULTS}
+    total=`sed -n 's/^"wall_seconds": \([0-9.]*\),/\1/p' ${timeline}`
+    printf "%s\t%s\t%s\t%.6f\n" ${case_name} ${program} "Total" ${total} >> ${RESULTS}
+}
+
+first_case=1
+for size in ${SIZES}; do
+
+    IFS=x read DATA_W DATA_H DATA_D DATA_T VOXEL_SIZE <<< "${size}"
+    case_name=${DATA_W}x${DATA_H}x${DATA_D}x${DATA_T}
+
+    # The group level data are created together with the first size
+    subjects=0
+    if [ "${first_case}" -eq "1" ]; then
+        subjects=${SUBJECTS}
+        group_case=${case_name}
+    fi
+
+    if [ "${REGENERATE}" -eq "1" ] || [ ! -f "${case_name}_fMRI.nii.gz" ] || ( [ "${subjects}" -gt "0" ] && [ ! -f "${case_name}_group.nii.gz" ] ); then
+        echo "Creating synthetic data for ${case_name}"
+        ${BINARY_DIRECTORY}/CreateSyntheticData -output ${case_name} -size ${DATA_W} ${DATA_H} ${DATA_D} ${DATA_T} -voxelsize ${VOXEL_SIZE} -subjects ${subjects}
+        if [ "$?" -ne "0" ]; then
+            echo "Could not create synthetic data for ${case_name} !"
+            rm -f ${RESULTS}
+            exit 1
+        fi
+    fi
+
+    for repetition in $(seq 1 ${REPETITIONS}); do
+        run_program ${case_name} FirstLevelAnalysis ${case_name}_fMRI_timeline.json ${case_name}_fMRI.nii.gz ${case_name}_T1.nii.gz ${case_name}_MNI.nii.gz ${case_name}_regressors.txt ${case_name}_contrasts.txt
+    done
+
+    first_case=0
+done
+
+for repetition in $(seq 1 ${REPETITIONS}); do
+    run_program ${SUBJECTS}subjects RandomiseGroupLevel ${group_case}_group_timeline.json ${group_case}_group.nii.gz -design ${group_case}_design.txt -contrasts ${group_case}_design_contrasts.txt -mask ${group_case}_group_mask.nii.gz -permutations ${PERMUTATIONS}
+done
+
+# The fastest run of each stage
+echo -e "# case\tprogram\tstage\tseconds" > ${OUTPUT}
+awk -F'\t' '{ key = $1 FS $2 FS $3; if (!(key in times)) { keys[n++] = key; times[key] = $4 } else if ($4 < times[key]) { times[key] = $4 } }
+    END { for (i = 0; i < n; i++) printf "%s\t%.6f\n", keys[i], times[keys[i]] }' ${RESULTS} >> ${OUTPUT}
+rm -f ${RESULTS}
+
+echo ""
+echo "Saved the stage times to ${OUTPUT}"
+echo ""
+
+if [ -z "${BASELINE}" ]; then
+    awk -F'\t' '!/^#/ { printf "%-16s %-20s %-40s %10.3f s\n", $1, $2, $3, $4 }' ${OUTPUT}
+    exit 0
+fi
+
+# Compare to the baseline, a stage is a regression if it is slower by more than the threshold and the minimum number of seconds
+awk -F'\t' -v threshold=${THRESHOLD} -v minimum=${MINIMUM_SECONDS} '
+    FNR == NR { if ($0 !~ /^#/) baseline[$1 FS $2 FS $3] = $4; next }
+    /^#/ { next }
+    {
+        key = $1 FS $2 FS $3
+        if (!(key in baseline)) {
+            printf "%-16s %-20s %-40s %10.3f s                          new\n", $1, $2, $3, $4
+            next
+        }
+        change = (baseline[key] > 0) ? 100 * ($4 - baseline[key]) / baseline[key] : 0
+        status = "OK"
+        if ( ($4 > baseline[key] * (1 + threshold / 100)) && (($4 - baseline[key]) > minimum) ) {
+            status = "REGRESSION"
+            regressions++
+        }
+        printf "%-16s %-20s %-40s %10.3f s %10.3f s %+8.1f %%  %s\n", $1, $2, $3, $4, baseline[key], change, status
+    }
+    END {
+        printf "\n"
+        if (regressions > 0) {
+            printf "%d stage(s) are more than %s %% slower than the baseline!\n", regressions, threshold
+            exit 1
+        }
+        printf "No stage is more than %s %% slower than the baseline\n", threshold
+    }' ${BASELINE} ${OUTPUT}
@@ -29,6 +29,8 @@ git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Linux/Debug/SliceTimingCorrection
 git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Linux/Debug/TransformVolume
 git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Linux/Debug/GetOpenCLInfo
 git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Linux/Debug/GetBandwidth
+git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Linux/Debug/KernelBenchmark
+git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Linux/Debug/CreateSyntheticData
 git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Linux/Debug/Smoothing
 git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Linux/Debug/ICA
 git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Linux/Debug/GLM
@@ -63,6 +65,8 @@ git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Linux/Release/SliceTimingCorrectio
 git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Linux/Release/TransformVolume
 git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Linux/Release/GetOpenCLInfo
 git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Linux/Release/GetBandwidth
+git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Linux/Release/KernelBenchmark
+git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Linux/Release/CreateSyntheticData
 git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Linux/Release/Smoothing
 git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Linux/Release/ICA
 git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Linux/Release/GLM
@@ -29,6 +29,8 @@ git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Mac/Debug/SliceTimingCorrection
 git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Mac/Debug/TransformVolume
 git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Mac/Debug/GetOpenCLInfo
 git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Mac/Debug/GetBandwidth
+git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Mac/Debug/KernelBenchmark
+git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Mac/Debug/CreateSyntheticData
 git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Mac/Debug/Smoothing
 git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Mac/Debug/GLM
 git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Mac/Debug/ICA
@@ -63,6 +65,8 @@ git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Mac/Release/SliceTimingCorrection
 git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Mac/Release/TransformVolume
 git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Mac/Release/GetOpenCLInfo
 git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Mac/Release/GetBandwidth
+git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Mac/Release/KernelBenchmark
+git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Mac/Release/CreateSyntheticData
 git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Mac/Release/Smoothing
 git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Mac/Release/GLM
 git add $BROCCOLI_GIT_DIRECTORY/compiled/Bash/Mac/Release/ICA
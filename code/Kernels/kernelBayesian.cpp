@@ -40,6 +40,11 @@ int Calculate4DIndex(int x, int y, int z, int t, int DATA_W, int DATA_H, int DAT
 }
 
 
+// The original sampler needs double precision for its random numbers, devices without double precision only get
+// the integer version of the same generator (Schrage's method) below
+
+#ifdef cl_khr_fp64
+
 #pragma OPENCL EXTENSION cl_khr_fp64: enable
 
 // Generate random uniform number by modulo operation
@@ -81,6 +86,52 @@ double gamrnd(float a, float b, __private int* seed)
 	return 2.0 * b / x;
 }
 
+#else
+
+// Generate random uniform number by modulo operation, without overflow in 32 bit integers
+float unirand(__private int* seed)
+{
+	int const a = 16807;
+	int const m = 2147483647;
+	int const q = 127773; // m / a
+	int const r = 2836;   // m % a
+
+	int temp = a * ((*seed) % q) - r * ((*seed) / q);
+	if (temp <= 0)
+	{
+		temp += m;
+	}
+	*seed = temp;
+
+	return (float)(*seed) / (float)m;
+}
+
+#define pi 3.141592653589793
+
+// Generate random normal number by Box-Muller transform
+float normalrand(__private int* seed)
+{
+	float u = unirand(seed);
+	float v = unirand(seed);
+
+	return sqrt(-2.0f*log(u))*cos(2.0f*pi*v);
+}
+
+// Generate inverse Gamma number
+float gamrnd(float a, float b, __private int* seed)
+{
+	float x = 0.0f;
+	for (int i = 0; i < 2*(int)round(a); i++)
+	{
+		float rand_value = normalrand(seed);
+		x += rand_value * rand_value;
+	}
+
+	return 2.0f * b / x;
+}
+
+#endif
+
 
 /*
 float unirand(__private int* seed)
@@ -575,3 +626,414 @@ __kernel void CalculateStatisticalMapsGLMBayesian(__global float* Statistical_Ma
 }
 
 
+
+// Counter based random numbers (Philox4x32-10, Salmon et al. 2011). Each number only depends on the counter and the key,
+// so every voxel, chain and iteration has its own stream without any state, and the results do not depend on the work group size
+
+#define BAYESIAN_MAX_CHAINS 8
+#define BAYESIAN_CHECK_INTERVAL 250
+#define BAYESIAN_MAX_RHAT 1.05f
+
+uint4 Philox4x32(uint4 counter, uint2 key)
+{
+	for (int round = 0; round < 10; round++)
+	{
+		uint hi0 = mul_hi(0xD2511F53u, counter.x);
+		uint lo0 = 0xD2511F53u * counter.x;
+		uint hi1 = mul_hi(0xCD9E8D57u, counter.z);
+		uint lo1 = 0xCD9E8D57u * counter.z;
+
+		counter = (uint4)(hi1 ^ counter.y ^ key.x, lo1, hi0 ^ counter.w ^ key.y, lo0);
+
+		key.x += 0x9E3779B9u;
+		key.y += 0xBB67AE85u;
+	}
+
+	return counter;
+}
+
+// Four uniform numbers in (0,1), the last component of the counter is increased for every call
+float4 unirand4(__private uint4* counter, uint2 key)
+{
+	uint4 random = Philox4x32(*counter, key);
+	(*counter).w++;
+
+	return ((float4)((float)(random.x >> 8), (float)(random.y >> 8), (float)(random.z >> 8), (float)(random.w >> 8)) + 0.5f) * (1.0f / 16777216.0f);
+}
+
+// Four normal numbers by Box-Muller transform
+float4 normalrand4(__private uint4* counter, uint2 key)
+{
+	float4 u = unirand4(counter, key);
+
+	float r1 = sqrt(-2.0f * log(u.x));
+	float r2 = sqrt(-2.0f * log(u.z));
+
+	return (float4)(r1 * cos(2.0f * (float)pi * u.y), r1 * sin(2.0f * (float)pi * u.y), r2 * cos(2.0f * (float)pi * u.w), r2 * sin(2.0f * (float)pi * u.w));
+}
+
+// Generate inverse Gamma number, b / Gamma(a,1), Gamma by Marsaglia and Tsang's method (a >= 1), one normal number per try instead of 2a
+float invgamrnd(float a, float b, __private uint4* counter, uint2 key)
+{
+	float d = a - 1.0f/3.0f;
+	float c = 1.0f / sqrt(9.0f * d);
+
+	for (int i = 0; i < 100; i++)
+	{
+		float4 u = unirand4(counter, key);
+		float x = sqrt(-2.0f * log(u.x)) * cos(2.0f * (float)pi * u.y);
+		float v = 1.0f + c * x;
+
+		if (v <= 0.0f)
+		{
+			continue;
+		}
+
+		v = v * v * v;
+		if (log(u.z) < (0.5f * x * x + d - d * v + d * log(v)))
+		{
+			return b / (d * v);
+		}
+	}
+
+	return b / d;
+}
+
+// Generates posterior probability maps (PPMs) with the same model as CalculateStatisticalMapsGLMBayesian, in single precision.
+// NUMBER_OF_CHAINS independent chains are run for each voxel, starting from different AR parameters, and the sampling stops
+// when the PPMs change less than TOLERANCE between two checks (every BAYESIAN_CHECK_INTERVAL iterations) and the potential
+// scale reduction factor (R-hat) of the beta weights is below BAYESIAN_MAX_RHAT. NUMBER_OF_ITERATIONS is the maximum number
+// of iterations per chain. The residuals of each iteration are obtained from sums calculated once, instead of from all volumes.
+// MCMC_Diagnostics contains the R-hat (0 for one chain) and the number of iterations per chain.
+
+__kernel void CalculateStatisticalMapsGLMBayesianMultiChain(__global float* Statistical_Maps,
+															__global float* Beta_Volumes,
+															__global float* AR_Estimates,
+															__global float* MCMC_Diagnostics,
+															__global const float* Volumes,
+															__global const float* Mask,
+															__constant float* c_X_GLM,
+															__constant float* c_InvOmega0,
+															__constant float* c_S00,
+															__constant float* c_S01,
+															__constant float* c_S11,
+															__private int DATA_W,
+															__private int DATA_H,
+															__private int DATA_D,
+															__private int NUMBER_OF_VOLUMES,
+															__private int NUMBER_OF_REGRESSORS,
+															__private int NUMBER_OF_ITERATIONS,
+															__private int NUMBER_OF_CHAINS,
+															__private float TOLERANCE,
+															__private uint SEED,
+															__private int slice)
+{
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int z = get_global_id(2);
+
+	if (x >= DATA_W || y >= DATA_H || z >= DATA_D)
+		return;
+
+	if ( Mask[Calculate3DIndex(x,y,slice,DATA_W,DATA_H)] != 1.0f )
+	{
+		for (int i = 0; i < 6; i++)
+		{
+			Statistical_Maps[Calculate4DIndex(x,y,slice,i,DATA_W,DATA_H,DATA_D)] = 0.0f;
+		}
+
+		Beta_Volumes[Calculate4DIndex(x,y,slice,0,DATA_W,DATA_H,DATA_D)] = 0.0f;
+		Beta_Volumes[Calculate4DIndex(x,y,slice,1,DATA_W,DATA_H,DATA_D)] = 0.0f;
+
+		AR_Estimates[Calculate3DIndex(x,y,slice,DATA_W,DATA_H)] = 0.0f;
+
+		MCMC_Diagnostics[Calculate4DIndex(x,y,slice,0,DATA_W,DATA_H,DATA_D)] = 0.0f;
+		MCMC_Diagnostics[Calculate4DIndex(x,y,slice,1,DATA_W,DATA_H,DATA_D)] = 0.0f;
+
+		return;
+	}
+
+	// Prior options
+	float r = 0.5f;                    // Prior mean on rho1
+	float c = 0.3f;                    // Prior standard deviation on first lag.
+	float a0 = 0.01f;                  // First parameter in IG prior for sigma^2
+	float b0 = 0.01f;                  // Second parameter in IG prior for sigma^2
+
+	float InvA0 = c * c;
+
+	int nBurnin = (int)round((float)NUMBER_OF_ITERATIONS*(10.0f/100.0f));
+
+	// Same sums as in CalculateStatisticalMapsGLMBayesian
+	float m00[2], m01[2], m10[2], m11[2];
+	float g00 = 0.0f;
+	float g01 = 0.0f;
+	float g11 = 0.0f;
+
+	for (int k = 0; k < 2; k++)
+	{
+		m00[k] = 0.0f;
+		m01[k] = 0.0f;
+		m10[k] = 0.0f;
+		m11[k] = 0.0f;
+	}
+
+	float y0 = Volumes[Calculate3DIndex(x,y,0,DATA_W,DATA_H)];
+	float y1 = Volumes[Calculate3DIndex(x,y,1,DATA_W,DATA_H)];
+	float old_value = y0;
+
+	m00[0] += c_X_GLM[NUMBER_OF_VOLUMES * 0 + 0] * old_value;
+	m00[1] += c_X_GLM[NUMBER_OF_VOLUMES * 1 + 0] * old_value;
+
+	g00 += old_value * old_value;
+
+	for (int v = 1; v < NUMBER_OF_VOLUMES; v++)
+	{
+		float value = Volumes[Calculate3DIndex(x,y,v,DATA_W,DATA_H)];
+
+		for (int k = 0; k < 2; k++)
+		{
+			m00[k] += c_X_GLM[NUMBER_OF_VOLUMES * k + v] * value;
+			m01[k] += c_X_GLM[NUMBER_OF_VOLUMES * k + v] * old_value;
+			m10[k] += c_X_GLM[NUMBER_OF_VOLUMES * k + (v - 1)] * value;
+			m11[k] += c_X_GLM[NUMBER_OF_VOLUMES * k + (v - 1)] * old_value;
+		}
+
+		g00 += value * value;
+		g01 += value * old_value;
+		g11 += old_value * old_value;
+
+		old_value = value;
+	}
+
+	// Sums for the residuals eps(v) = y(v) - x(v) * beta, as in the original sampler the squares are summed for v >= 1
+	// and the products eps(v) * eps(v-1) for v >= 2
+	float Syy = g00 - y0 * y0;
+	float Lyy = g01 - y1 * y0;
+	float Sxy[2], Lxy[2], Lyx[2], Sxx[2][2], Lxx[2][2];
+
+	for (int j = 0; j < 2; j++)
+	{
+		float x0j = c_X_GLM[NUMBER_OF_VOLUMES * j + 0];
+		float x1j = c_X_GLM[NUMBER_OF_VOLUMES * j + 1];
+
+		Sxy[j] = m00[j] - x0j * y0;
+		Lxy[j] = m01[j] - x1j * y0;
+		Lyx[j] = m10[j] - x0j * y1;
+
+		for (int k = 0; k < 2; k++)
+		{
+			Sxx[j][k] = c_S00[j + k*2] - x0j * c_X_GLM[NUMBER_OF_VOLUMES * k + 0];
+			Lxx[j][k] = c_S01[j + k*2] - x1j * c_X_GLM[NUMBER_OF_VOLUMES * k + 0];
+		}
+	}
+
+	NUMBER_OF_CHAINS = clamp(NUMBER_OF_CHAINS, 1, BAYESIAN_MAX_CHAINS);
+
+	// State and results of each chain
+	float rho[BAYESIAN_MAX_CHAINS];
+	float rhoSum[BAYESIAN_MAX_CHAINS];
+	float betaMean[BAYESIAN_MAX_CHAINS][2];
+	float betaM2[BAYESIAN_MAX_CHAINS][2];
+	int probabilities[BAYESIAN_MAX_CHAINS][6];
+
+	for (int chain = 0; chain < NUMBER_OF_CHAINS; chain++)
+	{
+		// Overdispersed starting points
+		rho[chain] = (NUMBER_OF_CHAINS > 1) ? (-0.5f + (float)chain / (float)(NUMBER_OF_CHAINS - 1)) : 0.0f;
+		rhoSum[chain] = 0.0f;
+		betaMean[chain][0] = 0.0f;
+		betaMean[chain][1] = 0.0f;
+		betaM2[chain][0] = 0.0f;
+		betaM2[chain][1] = 0.0f;
+		for (int i = 0; i < 6; i++)
+		{
+			probabilities[chain][i] = 0;
+		}
+	}
+
+	uint2 key = (uint2)(SEED, 0x2F6B9C31u);
+	uint voxel = (uint)Calculate3DIndex(x,y,slice,DATA_W,DATA_H);
+
+	float oldPPM[6];
+	for (int i = 0; i < 6; i++)
+	{
+		oldPPM[i] = -1.0f;
+	}
+
+	float aT = a0 + (float)NUMBER_OF_VOLUMES/2.0f;
+	float Rhat = 0.0f;
+	int samples = 0;
+	int i = 0;
+
+	// Loop over iterations, all chains are updated in each iteration
+	for (i = 0; i < (nBurnin + NUMBER_OF_ITERATIONS); i++)
+	{
+		for (int chain = 0; chain < NUMBER_OF_CHAINS; chain++)
+		{
+			float rho_ = rho[chain];
+			uint4 counter = (uint4)(voxel, (uint)chain, (uint)i, 0u);
+
+			// Prewhitening of regressors and data
+			float InvOmegaT[2][2];
+			float OmegaT[2][2];
+			float XtildeYtilde[2];
+
+			for (int j = 0; j < 2; j++)
+			{
+				for (int k = 0; k < 2; k++)
+				{
+					InvOmegaT[j][k] = c_InvOmega0[j + k * NUMBER_OF_REGRESSORS] + c_S00[j + k*2] - 2.0f * rho_ * c_S01[j + k*2] + rho_ * rho_ * c_S11[j + k*2];
+				}
+				XtildeYtilde[j] = m00[j] - rho_ * (m01[j] + m10[j]) + rho_ * rho_ * m11[j];
+			}
+			float Ytildesquared = g00 - 2.0f * rho_ * g01 + rho_ * rho_ * g11;
+
+			Invert_2x2(InvOmegaT, OmegaT);
+
+			float betaT[2];
+			betaT[0] = OmegaT[0][0] * XtildeYtilde[0] + OmegaT[0][1] * XtildeYtilde[1];
+			betaT[1] = OmegaT[1][0] * XtildeYtilde[0] + OmegaT[1][1] * XtildeYtilde[1];
+
+			float temp[2];
+			temp[0] = InvOmegaT[0][0] * betaT[0] + InvOmegaT[0][1] * betaT[1];
+			temp[1] = InvOmegaT[1][0] * betaT[0] + InvOmegaT[1][1] * betaT[1];
+			float bT = b0 + 0.5f * (Ytildesquared - betaT[0] * temp[0] - betaT[1] * temp[1]);
+
+			// Block 1 - Step 1a. Update sigma2
+			float sigma2 = invgamrnd(aT, fmax(bT, 1e-10f), &counter, key);
+
+			// Block 1 - Step 1b. Update beta | sigma2
+			float4 normals = normalrand4(&counter, key);
+
+			float cholCov[2][2];
+			Cholesky2(cholCov, sigma2, OmegaT);
+
+			float beta[2];
+			beta[0] = betaT[0] + cholCov[0][0] * normals.x;
+			beta[1] = betaT[1] + cholCov[1][0] * normals.x + cholCov[1][1] * normals.y;
+
+			// Block 2, update rho
+			float zsquared = Syy - 2.0f * (beta[0] * Sxy[0] + beta[1] * Sxy[1]) + beta[0] * beta[0] * Sxx[0][0] + beta[0] * beta[1] * (Sxx[0][1] + Sxx[1][0]) + beta[1] * beta[1] * Sxx[1][1];
+			float zu = Lyy - beta[0] * (Lxy[0] + Lyx[0]) - beta[1] * (Lxy[1] + Lyx[1]) + beta[0] * beta[0] * Lxx[0][0] + beta[0] * beta[1] * (Lxx[0][1] + Lxx[1][0]) + beta[1] * beta[1] * Lxx[1][1];
+
+			float InvAT = InvA0 + fmax(zsquared, 0.0f) / sigma2;
+			float AT = 1.0f / InvAT;
+			float rhoT = AT * zu / sigma2;
+			float rhoProp = rhoT + sqrt(sigma2 * AT) * normals.z;
+
+			if (myabs(rhoProp) < 1.0f)
+			{
+				rho[chain] = rhoProp;
+			}
+
+			if (i >= nBurnin)
+			{
+				int n = samples + 1;
+
+				probabilities[chain][0] += (beta[0] > 0.0f);
+				probabilities[chain][1] += (beta[1] > 0.0f);
+				probabilities[chain][2] += (beta[0] < 0.0f);
+				probabilities[chain][3] += (beta[1] < 0.0f);
+				probabilities[chain][4] += ((beta[0] - beta[1]) > 0.0f);
+				probabilities[chain][5] += ((beta[1] - beta[0]) > 0.0f);
+
+				// Running mean and sum of squared deviations (Welford)
+				for (int k = 0; k < 2; k++)
+				{
+					float delta = beta[k] - betaMean[chain][k];
+					betaMean[chain][k] += delta / (float)n;
+					betaM2[chain][k] += delta * (beta[k] - betaMean[chain][k]);
+				}
+
+				rhoSum[chain] += rho[chain];
+			}
+		}
+
+		if (i >= nBurnin)
+		{
+			samples++;
+		}
+
+		// Check for convergence
+		if ( (samples > 0) && ((samples % BAYESIAN_CHECK_INTERVAL) == 0) )
+		{
+			float change = 0.0f;
+			for (int p = 0; p < 6; p++)
+			{
+				int count = 0;
+				for (int chain = 0; chain < NUMBER_OF_CHAINS; chain++)
+				{
+					count += probabilities[chain][p];
+				}
+				float PPM = (float)count / (float)(samples * NUMBER_OF_CHAINS);
+				change = fmax(change, myabs(PPM - oldPPM[p]));
+				oldPPM[p] = PPM;
+			}
+
+			// Potential scale reduction factor, maximum over the beta weights
+			Rhat = 0.0f;
+			if (NUMBER_OF_CHAINS > 1)
+			{
+				for (int k = 0; k < 2; k++)
+				{
+					float grandMean = 0.0f;
+					float W = 0.0f;
+					for (int chain = 0; chain < NUMBER_OF_CHAINS; chain++)
+					{
+						grandMean += betaMean[chain][k];
+						W += betaM2[chain][k] / (float)(samples - 1);
+					}
+					grandMean /= (float)NUMBER_OF_CHAINS;
+					W /= (float)NUMBER_OF_CHAINS;
+
+					float B = 0.0f;
+					for (int chain = 0; chain < NUMBER_OF_CHAINS; chain++)
+					{
+						B += (betaMean[chain][k] - grandMean) * (betaMean[chain][k] - grandMean);
+					}
+					B /= (float)(NUMBER_OF_CHAINS - 1);
+
+					float V = (float)(samples - 1) / (float)samples * W + B;
+					Rhat = fmax(Rhat, (W > 0.0f) ? sqrt(V / W) : 1.0f);
+				}
+			}
+
+			if ( (change < TOLERANCE) && (Rhat < BAYESIAN_MAX_RHAT) )
+			{
+				i++;
+				break;
+			}
+		}
+	}
+
+	samples = max(samples, 1);
+
+	for (int p = 0; p < 6; p++)
+	{
+		int count = 0;
+		for (int chain = 0; chain < NUMBER_OF_CHAINS; chain++)
+		{
+			count += probabilities[chain][p];
+		}
+		Statistical_Maps[Calculate4DIndex(x,y,slice,p,DATA_W,DATA_H,DATA_D)] = (float)count / (float)(samples * NUMBER_OF_CHAINS);
+	}
+
+	// Posterior means over all chains
+	float beta0 = 0.0f;
+	float beta1 = 0.0f;
+	float rhoMean = 0.0f;
+	for (int chain = 0; chain < NUMBER_OF_CHAINS; chain++)
+	{
+		beta0 += betaMean[chain][0];
+		beta1 += betaMean[chain][1];
+		rhoMean += rhoSum[chain] / (float)samples;
+	}
+
+	Beta_Volumes[Calculate4DIndex(x,y,slice,0,DATA_W,DATA_H,DATA_D)] = beta0 / (float)NUMBER_OF_CHAINS;
+	Beta_Volumes[Calculate4DIndex(x,y,slice,1,DATA_W,DATA_H,DATA_D)] = beta1 / (float)NUMBER_OF_CHAINS;
+
+	AR_Estimates[Calculate3DIndex(x,y,slice,DATA_W,DATA_H)] = rhoMean / (float)NUMBER_OF_CHAINS;
+
+	MCMC_Diagnostics[Calculate4DIndex(x,y,slice,0,DATA_W,DATA_H,DATA_D)] = Rhat;
+	MCMC_Diagnostics[Calculate4DIndex(x,y,slice,1,DATA_W,DATA_H,DATA_D)] = (float)i;
+}
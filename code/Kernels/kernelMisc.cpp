@@ -103,6 +103,36 @@ __kernel void LogitMatrixDouble(__global double* Matrix,
 	Matrix[x] = 1.0 - (2.0 / (1.0 + exp(-Matrix[x] )) );
 }
 
+#define FASTICA_LOGCOSH 0
+#define FASTICA_EXP 1
+
+// Applies the FastICA nonlinearity g in place, and saves the derivative g' for the Newton step
+__kernel void FastICANonlinearity(__global float* Matrix, 
+                                  __global float* Derivative, 
+  			     			      __private int N,
+  			     			      __private int NONLINEARITY)
+{
+	int x = get_global_id(0);	
+
+	if (x >= N)
+		return;
+
+	float value = Matrix[x];
+
+	if (NONLINEARITY == FASTICA_LOGCOSH)
+	{
+		float t = tanh(value);
+		Matrix[x] = t;
+		Derivative[x] = 1.0f - t * t;
+	}
+	else if (NONLINEARITY == FASTICA_EXP)
+	{
+		float e = exp(-0.5f * value * value);
+		Matrix[x] = value * e;
+		Derivative[x] = (1.0f - value * value) * e;
+	}
+}
+
 __kernel void GetSubMatrix(__global float* Small_Matrix, 
                            __global const float* Matrix, 
   			     		   __private int startRow,
@@ -302,6 +332,194 @@ __kernel void CalculateMaxAtomic(volatile __global int* max_value,
 
 
 
+#define REDUCE_SUM 0
+#define REDUCE_MAX 1
+#define REDUCE_MIN 2
+
+#define REDUCTION_LOCAL_SIZE 256
+
+float ReductionStartValue(int OPERATION)
+{
+	if (OPERATION == REDUCE_MAX)
+		return -FLT_MAX;
+	else if (OPERATION == REDUCE_MIN)
+		return FLT_MAX;
+	else
+		return 0.0f;
+}
+
+// Combines a new value with the current one, max and min also keep the index of the value (lowest index for ties)
+void ReductionCombine(float* value, int* index, float newValue, int newIndex, int OPERATION)
+{
+	if (OPERATION == REDUCE_SUM)
+	{
+		*value += newValue;
+	}
+	else if (newIndex != -1)
+	{
+		bool better = (OPERATION == REDUCE_MAX) ? (newValue > *value) : (newValue < *value);
+		if ( better || (*index == -1) || ((newValue == *value) && (newIndex < *index)) )
+		{
+			*value = newValue;
+			*index = newIndex;
+		}
+	}
+}
+
+// First pass of a work-group tree reduction, each work-group reduces a strided part of one volume (selected by the second dimension)
+// and writes one partial value, which are reduced by ReduceVolumesFinal
+__kernel void ReduceVolumes(__global float* Partial_Values,
+	                        __global int* Partial_Indices,
+	                        __global const float* Volumes,
+	                        __global const float* Mask,
+	                        __private int N,
+	                        __private int OPERATION,
+	                        __private int USE_MASK)
+{
+	__local float l_Values[REDUCTION_LOCAL_SIZE];
+	__local int l_Indices[REDUCTION_LOCAL_SIZE];
+
+	int tid = get_local_id(0);
+	int volume = get_global_id(1);
+	int numberOfGroups = get_num_groups(0);
+
+	__global const float* Volume = &Volumes[(size_t)volume * (size_t)N];
+
+	float value = ReductionStartValue(OPERATION);
+	int index = -1;
+
+	for (int i = get_global_id(0); i < N; i += get_global_size(0))
+	{
+		if ( USE_MASK && (Mask[i] != 1.0f) )
+			continue;
+
+		ReductionCombine(&value, &index, Volume[i], i, OPERATION);
+	}
+
+	l_Values[tid] = value;
+	l_Indices[tid] = index;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int s = get_local_size(0)/2; s > 0; s >>= 1)
+	{
+		if (tid < s)
+		{
+			value = l_Values[tid];
+			index = l_Indices[tid];
+			ReductionCombine(&value, &index, l_Values[tid + s], l_Indices[tid + s], OPERATION);
+			l_Values[tid] = value;
+			l_Indices[tid] = index;
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (tid == 0)
+	{
+		Partial_Values[get_group_id(0) + volume * numberOfGroups] = l_Values[0];
+		Partial_Indices[get_group_id(0) + volume * numberOfGroups] = l_Indices[0];
+	}
+}
+
+// Final pass of the tree reduction, one work-group per volume reduces the partial values from ReduceVolumes
+__kernel void ReduceVolumesFinal(__global float* Results,
+	                             __global int* Result_Indices,
+	                             __global const float* Partial_Values,
+	                             __global const int* Partial_Indices,
+	                             __private int NUMBER_OF_PARTIALS,
+	                             __private int OPERATION)
+{
+	__local float l_Values[REDUCTION_LOCAL_SIZE];
+	__local int l_Indices[REDUCTION_LOCAL_SIZE];
+
+	int tid = get_local_id(0);
+	int volume = get_global_id(1);
+
+	float value = ReductionStartValue(OPERATION);
+	int index = -1;
+
+	for (int i = tid; i < NUMBER_OF_PARTIALS; i += get_local_size(0))
+	{
+		ReductionCombine(&value, &index, Partial_Values[i + volume * NUMBER_OF_PARTIALS], Partial_Indices[i + volume * NUMBER_OF_PARTIALS], OPERATION);
+	}
+
+	l_Values[tid] = value;
+	l_Indices[tid] = index;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int s = get_local_size(0)/2; s > 0; s >>= 1)
+	{
+		if (tid < s)
+		{
+			value = l_Values[tid];
+			index = l_Indices[tid];
+			ReductionCombine(&value, &index, l_Values[tid + s], l_Indices[tid + s], OPERATION);
+			l_Values[tid] = value;
+			l_Indices[tid] = index;
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (tid == 0)
+	{
+		Results[volume] = l_Values[0];
+		Result_Indices[volume] = l_Indices[0];
+	}
+}
+
+// First pass of the center of mass calculation, each work-group sums mass, mass * x, mass * y and mass * z for a strided part of the volume,
+// the partial sums are stored as four volumes and summed by ReduceVolumesFinal
+__kernel void CalculateMassMoments(__global float* Partial_Values,
+	                               __global int* Partial_Indices,
+	                               __global const float* Volume,
+	                               __private int DATA_W,
+	                               __private int DATA_H,
+	                               __private int DATA_D)
+{
+	__local float4 l_Moments[REDUCTION_LOCAL_SIZE];
+
+	int tid = get_local_id(0);
+	int numberOfGroups = get_num_groups(0);
+	int N = DATA_W * DATA_H * DATA_D;
+
+	float4 moments = (float4)(0.0f, 0.0f, 0.0f, 0.0f);
+
+	for (int i = get_global_id(0); i < N; i += get_global_size(0))
+	{
+		float mass = Volume[i];
+		int x = i % DATA_W;
+		int y = (i / DATA_W) % DATA_H;
+		int z = i / (DATA_W * DATA_H);
+
+		moments += mass * (float4)(1.0f, (float)x, (float)y, (float)z);
+	}
+
+	l_Moments[tid] = moments;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int s = get_local_size(0)/2; s > 0; s >>= 1)
+	{
+		if (tid < s)
+		{
+			l_Moments[tid] += l_Moments[tid + s];
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (tid == 0)
+	{
+		int group = get_group_id(0);
+		Partial_Values[group + 0 * numberOfGroups] = l_Moments[0].x;
+		Partial_Values[group + 1 * numberOfGroups] = l_Moments[0].y;
+		Partial_Values[group + 2 * numberOfGroups] = l_Moments[0].z;
+		Partial_Values[group + 3 * numberOfGroups] = l_Moments[0].w;
+
+		Partial_Indices[group + 0 * numberOfGroups] = -1;
+		Partial_Indices[group + 1 * numberOfGroups] = -1;
+		Partial_Indices[group + 2 * numberOfGroups] = -1;
+		Partial_Indices[group + 3 * numberOfGroups] = -1;
+	}
+}
+
 __kernel void ThresholdVolume(__global float* Thresholded_Volume, 
 	                          __global const float* Volume, 
 							  __private float threshold, 
@@ -617,37 +835,29 @@ float InterpolateCubic(float p0, float p1, float p2, float p3, float delta)
    return(a0 * delta * delta2 + a1 * delta2 + a2 * delta + a3);
 }
 
-__kernel void SliceTimingCorrection(__global float* Corrected_Volumes, 
-                                    __global const float* Volumes, 									 
-									__private float delta, 									 
-									__private int DATA_W, 
-									__private int DATA_H, 
-									__private int DATA_D, 
-									__private int DATA_T)
+// Cubic interpolation in time of one time series, the time points are separated by stride elements
+void SliceTimingCorrectTimeSeries(__global float* Corrected_Volumes, 
+                                  __global const float* Volumes, 
+								  int offset, 
+								  int stride, 
+								  float delta, 
+								  int DATA_T)
 {
-	int x = get_global_id(0);
-	int y = get_global_id(1);
-
-	int3 tIdx = {get_local_id(0), get_local_id(1), get_local_id(2)};
-
-	if (x >= DATA_W || y >= DATA_H)
-		return;
-
 	float t0, t1, t2, t3;
 
 	// Forward interpolation
 	if (delta > 0.0f)
 	{
-		t0 = Volumes[Calculate3DIndex(x,y,0,DATA_W,DATA_H)];
+		t0 = Volumes[offset];
 		t1 = t0;
-		t2 = Volumes[Calculate3DIndex(x,y,1,DATA_W,DATA_H)];
-		t3 = Volumes[Calculate3DIndex(x,y,2,DATA_W,DATA_H)];
+		t2 = Volumes[offset + stride];
+		t3 = Volumes[offset + 2 * stride];
 
 		// Loop over timepoints
 		for (int t = 0; t < DATA_T - 3; t++)
 		{
 			// Cubic interpolation in time
-			Corrected_Volumes[Calculate3DIndex(x,y,t,DATA_W,DATA_H)] = InterpolateCubic(t0,t1,t2,t3,delta); 
+			Corrected_Volumes[offset + t * stride] = InterpolateCubic(t0,t1,t2,t3,delta); 
 		
 			// Shift old values backwards
 			t0 = t1;
@@ -655,38 +865,38 @@ __kernel void SliceTimingCorrection(__global float* Corrected_Volumes,
 			t2 = t3;
 
 			// Read one new value
-			t3 = Volumes[Calculate3DIndex(x,y,t+3,DATA_W,DATA_H)];
+			t3 = Volumes[offset + (t + 3) * stride];
 		}
 
 		int t = DATA_T - 3;	
-		Corrected_Volumes[Calculate3DIndex(x,y,t,DATA_W,DATA_H)] = InterpolateCubic(t0,t1,t2,t3,delta); 
+		Corrected_Volumes[offset + t * stride] = InterpolateCubic(t0,t1,t2,t3,delta); 
 	
 		t = DATA_T - 2;
 		t0 = t1;
 		t1 = t2;
 		t2 = t3;	
-		Corrected_Volumes[Calculate3DIndex(x,y,t,DATA_W,DATA_H)] = InterpolateCubic(t0,t1,t2,t3,delta); 
+		Corrected_Volumes[offset + t * stride] = InterpolateCubic(t0,t1,t2,t3,delta); 
 
 		t = DATA_T - 1;
 		t0 = t1;
 		t1 = t2;
-		Corrected_Volumes[Calculate3DIndex(x,y,t,DATA_W,DATA_H)] = InterpolateCubic(t0,t1,t2,t3,delta); 
+		Corrected_Volumes[offset + t * stride] = InterpolateCubic(t0,t1,t2,t3,delta); 
 	}
 	// Backward interpolation
 	else
 	{
 		delta = 1.0f - (-delta);
 
-		t0 = Volumes[Calculate3DIndex(x,y,0,DATA_W,DATA_H)];
+		t0 = Volumes[offset];
 		t1 = t0;
 		t2 = t0;
-		t3 = Volumes[Calculate3DIndex(x,y,1,DATA_W,DATA_H)];
+		t3 = Volumes[offset + stride];
 
 		// Loop over timepoints
 		for (int t = 0; t < DATA_T - 2; t++)
 		{
 			// Cubic interpolation in time
-			Corrected_Volumes[Calculate3DIndex(x,y,t,DATA_W,DATA_H)] = InterpolateCubic(t0,t1,t2,t3,delta); 
+			Corrected_Volumes[offset + t * stride] = InterpolateCubic(t0,t1,t2,t3,delta); 
 		
 			// Shift old values backwards
 			t0 = t1;
@@ -694,20 +904,41 @@ __kernel void SliceTimingCorrection(__global float* Corrected_Volumes,
 			t2 = t3;
 
 			// Read one new value
-			t3 = Volumes[Calculate3DIndex(x,y,t+2,DATA_W,DATA_H)];
+			t3 = Volumes[offset + (t + 2) * stride];
 		}
 
 		int t = DATA_T - 2;	
-		Corrected_Volumes[Calculate3DIndex(x,y,t,DATA_W,DATA_H)] = InterpolateCubic(t0,t1,t2,t3,delta); 
+		Corrected_Volumes[offset + t * stride] = InterpolateCubic(t0,t1,t2,t3,delta); 
 	
 		t = DATA_T - 1;
 		t0 = t1;
 		t1 = t2;
 		t2 = t3;	
-		Corrected_Volumes[Calculate3DIndex(x,y,t,DATA_W,DATA_H)] = InterpolateCubic(t0,t1,t2,t3,delta); 
+		Corrected_Volumes[offset + t * stride] = InterpolateCubic(t0,t1,t2,t3,delta); 
 	}
 }
 
+// Corrects several slices (a slab, or the whole volume) in one launch, stored as x, y, z, t. The time shift of each
+// slice is read from c_Slice_Differences, SLICE_OFFSET is the index of the first slice of the slab in the full volume
+__kernel void SliceTimingCorrectionSlices(__global float* Corrected_Volumes, 
+                                          __global const float* Volumes, 									 
+										  __constant float* c_Slice_Differences, 									 
+										  __private int DATA_W, 
+										  __private int DATA_H, 
+										  __private int DATA_D, 
+										  __private int DATA_T,
+										  __private int SLICE_OFFSET)
+{
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int z = get_global_id(2);
+
+	if (x >= DATA_W || y >= DATA_H || z >= DATA_D)
+		return;
+
+	SliceTimingCorrectTimeSeries(Corrected_Volumes, Volumes, Calculate3DIndex(x,y,z,DATA_W,DATA_H), DATA_W * DATA_H * DATA_D, c_Slice_Differences[z + SLICE_OFFSET], DATA_T);
+}
+
 __kernel void CalculateMagnitudes(__global float* Magnitudes,
 	                              __global const float2* Complex,
 								  __private int DATA_W, 
@@ -989,6 +989,9 @@ __kernel void CalculateDisplacementUpdate(__global float* DisplacementX,
 
 
 
+// Image based interpolation, only compiled for devices that support images
+#ifdef __IMAGE_SUPPORT__
+
 __constant sampler_t volume_sampler_nearest = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
 	
 
@@ -1139,6 +1142,8 @@ __kernel void InterpolateVolumeLinearNonLinear(__global float* Volume,
 	Volume[idx4D] = Interpolated_Value.x;
 }
 
+#endif
+
 __kernel void AddLinearAndNonLinearDisplacement(__global float* d_Displacement_Field_X,
 		   	   	   	   	   	   	   	   	   	   	   	    __global float* d_Displacement_Field_Y,
 		   	   	   	   	   	   	   	   	   	   	   	    __global float* d_Displacement_Field_Z,
@@ -1189,6 +1194,9 @@ float bspline(float t)
 
 
 
+// Image based interpolation, only compiled for devices that support images
+#ifdef __IMAGE_SUPPORT__
+
 __kernel void InterpolateVolumeCubicLinear(__global float* Volume,
 	                                           read_only image3d_t Original_Volume, 
 											   __constant float* c_Parameter_Vector, 
@@ -1309,6 +1317,200 @@ __kernel void InterpolateVolumeCubicNonLinear(__global float* Volume,
 	Volume[idx] = result;
 }
 
+#endif
+
+// Composed transformations map a voxel in the new volume (after the displacement field, if any) to the intermediate volume
+// (c_Composed_Transformation[0-11]), and the intermediate volume to the original volume (c_Composed_Transformation[18-29]),
+// as absolute coordinates (p0 p1 p2 are translations, p3 - p11 a matrix). Voxels that are mapped outside the intermediate
+// volume, given by the bounds in c_Composed_Transformation[12-17], are zero. The w component is set to -1 for such voxels.
+float4 CalculateComposedPosition(float xf, 
+                                 float yf, 
+								 float zf, 
+								 __constant float* c_Composed_Transformation)
+{
+	float4 Intermediate_Position, Position;
+
+	Intermediate_Position.x = c_Composed_Transformation[0] + c_Composed_Transformation[3] * xf + c_Composed_Transformation[4]  * yf + c_Composed_Transformation[5]  * zf;
+	Intermediate_Position.y = c_Composed_Transformation[1] + c_Composed_Transformation[6] * xf + c_Composed_Transformation[7]  * yf + c_Composed_Transformation[8]  * zf;
+	Intermediate_Position.z = c_Composed_Transformation[2] + c_Composed_Transformation[9] * xf + c_Composed_Transformation[10] * yf + c_Composed_Transformation[11] * zf;
+
+	Position.x = c_Composed_Transformation[18] + c_Composed_Transformation[21] * Intermediate_Position.x + c_Composed_Transformation[22] * Intermediate_Position.y + c_Composed_Transformation[23] * Intermediate_Position.z + 0.5f;
+	Position.y = c_Composed_Transformation[19] + c_Composed_Transformation[24] * Intermediate_Position.x + c_Composed_Transformation[25] * Intermediate_Position.y + c_Composed_Transformation[26] * Intermediate_Position.z + 0.5f;
+	Position.z = c_Composed_Transformation[20] + c_Composed_Transformation[27] * Intermediate_Position.x + c_Composed_Transformation[28] * Intermediate_Position.y + c_Composed_Transformation[29] * Intermediate_Position.z + 0.5f;
+	Position.w = 0.0f;
+
+	if ( (Intermediate_Position.x < c_Composed_Transformation[12]) || (Intermediate_Position.x > c_Composed_Transformation[13]) || (Intermediate_Position.y < c_Composed_Transformation[14]) || (Intermediate_Position.y > c_Composed_Transformation[15]) || (Intermediate_Position.z < c_Composed_Transformation[16]) || (Intermediate_Position.z > c_Composed_Transformation[17]) )
+	{
+		Position.w = -1.0f;
+	}
+
+	return Position;
+}
+
+// Image based interpolation, only compiled for devices that support images
+#ifdef __IMAGE_SUPPORT__
+
+__kernel void InterpolateVolumeNearestComposed(__global float* Volume,
+	                                           read_only image3d_t Original_Volume, 
+											   __global const float* d_Displacement_Field_X, 
+											   __global const float* d_Displacement_Field_Y, 
+											   __global const float* d_Displacement_Field_Z, 
+											   __constant float* c_Composed_Transformation,
+											   __private int USE_DISPLACEMENT_FIELD,
+											   __private int DATA_W, 
+											   __private int DATA_H, 
+											   __private int DATA_D, 
+											   __private int VOLUME)
+{
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int z = get_global_id(2);
+
+	if ((x >= DATA_W) || (y >= DATA_H) || (z >= DATA_D))
+		return;
+
+	int idx4D = Calculate4DIndex(x,y,z,VOLUME,DATA_W,DATA_H,DATA_D);
+	int idx3D = Calculate3DIndex(x,y,z,DATA_W,DATA_H);
+
+	float xf = (float)x;
+	float yf = (float)y;
+	float zf = (float)z;
+
+	if (USE_DISPLACEMENT_FIELD == 1)
+	{
+		xf += d_Displacement_Field_X[idx3D];
+		yf += d_Displacement_Field_Y[idx3D];
+		zf += d_Displacement_Field_Z[idx3D];
+	}
+
+	float4 Motion_Vector = CalculateComposedPosition(xf, yf, zf, c_Composed_Transformation);
+	if (Motion_Vector.w < 0.0f)
+	{
+		Volume[idx4D] = 0.0f;
+		return;
+	}
+
+	float4 Interpolated_Value = read_imagef(Original_Volume, volume_sampler_nearest, Motion_Vector);
+	Volume[idx4D] = Interpolated_Value.x;
+}
+
+__kernel void InterpolateVolumeLinearComposed(__global float* Volume,
+	                                          read_only image3d_t Original_Volume, 
+											  __global const float* d_Displacement_Field_X, 
+											  __global const float* d_Displacement_Field_Y, 
+											  __global const float* d_Displacement_Field_Z, 
+											  __constant float* c_Composed_Transformation,
+											  __private int USE_DISPLACEMENT_FIELD,
+											  __private int DATA_W, 
+											  __private int DATA_H, 
+											  __private int DATA_D, 
+											  __private int VOLUME)
+{
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int z = get_global_id(2);
+
+	if ((x >= DATA_W) || (y >= DATA_H) || (z >= DATA_D))
+		return;
+
+	int idx4D = Calculate4DIndex(x,y,z,VOLUME,DATA_W,DATA_H,DATA_D);
+	int idx3D = Calculate3DIndex(x,y,z,DATA_W,DATA_H);
+
+	float xf = (float)x;
+	float yf = (float)y;
+	float zf = (float)z;
+
+	if (USE_DISPLACEMENT_FIELD == 1)
+	{
+		xf += d_Displacement_Field_X[idx3D];
+		yf += d_Displacement_Field_Y[idx3D];
+		zf += d_Displacement_Field_Z[idx3D];
+	}
+
+	float4 Motion_Vector = CalculateComposedPosition(xf, yf, zf, c_Composed_Transformation);
+	if (Motion_Vector.w < 0.0f)
+	{
+		Volume[idx4D] = 0.0f;
+		return;
+	}
+
+	float4 Interpolated_Value = read_imagef(Original_Volume, volume_sampler_linear, Motion_Vector);
+	Volume[idx4D] = Interpolated_Value.x;
+}
+
+__kernel void InterpolateVolumeCubicComposed(__global float* Volume,
+	                                         read_only image3d_t Original_Volume, 
+											 __global const float* d_Displacement_Field_X, 
+											 __global const float* d_Displacement_Field_Y, 
+											 __global const float* d_Displacement_Field_Z, 
+											 __constant float* c_Composed_Transformation,
+											 __private int USE_DISPLACEMENT_FIELD,
+											 __private int DATA_W, 
+											 __private int DATA_H, 
+											 __private int DATA_D, 
+											 __private int VOLUME)
+{
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int z = get_global_id(2);
+
+	if ((x >= DATA_W) || (y >= DATA_H) || (z >= DATA_D))
+		return;
+
+	int idx4D = Calculate4DIndex(x,y,z,VOLUME,DATA_W,DATA_H,DATA_D);
+	int idx3D = Calculate3DIndex(x,y,z,DATA_W,DATA_H);
+
+	float xf = (float)x;
+	float yf = (float)y;
+	float zf = (float)z;
+
+	if (USE_DISPLACEMENT_FIELD == 1)
+	{
+		xf += d_Displacement_Field_X[idx3D];
+		yf += d_Displacement_Field_Y[idx3D];
+		zf += d_Displacement_Field_Z[idx3D];
+	}
+
+	float4 Motion_Vector = CalculateComposedPosition(xf, yf, zf, c_Composed_Transformation);
+	if (Motion_Vector.w < 0.0f)
+	{
+		Volume[idx4D] = 0.0f;
+		return;
+	}
+
+	const float3 coord_grid = Motion_Vector.xyz - 0.5f;
+	float3 index = floor(coord_grid);
+	const float3 fraction = coord_grid - index;
+	index = index + 0.5f;  //move from [-0.5, extent-0.5] to [0, extent]
+
+	float result = 0.0f;
+	
+	for (float zz = -1.0f; zz < 2.5f; zz += 1.0f)  //range [-1, 2]
+	{
+		float bsplineZ = bspline(zz-fraction.z);
+		float w = index.z + zz;
+		for (float yy = -1.0f; yy < 2.5f; yy += 1.0f)
+		{
+			float bsplineYZ = bspline(yy-fraction.y) * bsplineZ;
+			float v = index.y + yy;
+			for (float xx = -1.0f; xx < 2.5f; xx += 1.0f)
+			{
+				float bsplineXYZ = bspline(xx-fraction.x) * bsplineYZ;
+				float u = index.x + xx;
+				float4 Sample_Position;
+				Sample_Position.x = u;
+				Sample_Position.y = v;
+				Sample_Position.z = w;
+				Sample_Position.w = 0.0f;
+				float4 temp = read_imagef(Original_Volume, volume_sampler_linear, Sample_Position);
+				result += temp.x * bsplineXYZ;
+			}
+		}
+	}
+	
+	Volume[idx4D] = result;
+}
+
 __kernel void RescaleVolumeNearest(__global float* Volume,
 	                               read_only image3d_t Original_Volume,
 								   __private float VOXEL_DIFFERENCE_X,
@@ -1422,6 +1624,620 @@ __kernel void RescaleVolumeCubic(__global float* Volume,
 }
 
 
+#endif
+
+// Buffer based interpolation, used instead of images on devices where images are emulated (CPUs) or not supported.
+// Positions are given in the same way as for the images (voxel centres at 0.5, 1.5, ...) and voxels outside the volume
+// are clamped to the edge, as with CLK_ADDRESS_CLAMP_TO_EDGE. The kernels have the same arguments as the image kernels,
+// the rescale and composed kernels also take the size of the original volume and which volume to read from the buffer.
+
+float InterpolateBufferNearest(__global const float* Volume, 
+                               float4 Position, 
+							   int DATA_W, 
+							   int DATA_H, 
+							   int DATA_D)
+{
+	int x = clamp((int)floor(Position.x), 0, DATA_W - 1);
+	int y = clamp((int)floor(Position.y), 0, DATA_H - 1);
+	int z = clamp((int)floor(Position.z), 0, DATA_D - 1);
+
+	return Volume[Calculate3DIndex(x,y,z,DATA_W,DATA_H)];
+}
+
+float InterpolateBufferLinear(__global const float* Volume, 
+                              float4 Position, 
+							  int DATA_W, 
+							  int DATA_H, 
+							  int DATA_D)
+{
+	float3 Coordinate = Position.xyz - 0.5f;
+	float3 Base = floor(Coordinate);
+	float3 Fraction = Coordinate - Base;
+
+	// Clamp the eight neighbours without branches, the two neighbours along x are next to each other in memory
+	int x0 = clamp((int)Base.x, 0, DATA_W - 1);
+	int y0 = clamp((int)Base.y, 0, DATA_H - 1);
+	int z0 = clamp((int)Base.z, 0, DATA_D - 1);
+	int x1 = clamp((int)Base.x + 1, 0, DATA_W - 1);
+	int y1 = clamp((int)Base.y + 1, 0, DATA_H - 1);
+	int z1 = clamp((int)Base.z + 1, 0, DATA_D - 1);
+
+	int Row00 = Calculate3DIndex(0,y0,z0,DATA_W,DATA_H);
+	int Row10 = Calculate3DIndex(0,y1,z0,DATA_W,DATA_H);
+	int Row01 = Calculate3DIndex(0,y0,z1,DATA_W,DATA_H);
+	int Row11 = Calculate3DIndex(0,y1,z1,DATA_W,DATA_H);
+
+	float Value00 = mix(Volume[Row00 + x0], Volume[Row00 + x1], Fraction.x);
+	float Value10 = mix(Volume[Row10 + x0], Volume[Row10 + x1], Fraction.x);
+	float Value01 = mix(Volume[Row01 + x0], Volume[Row01 + x1], Fraction.x);
+	float Value11 = mix(Volume[Row11 + x0], Volume[Row11 + x1], Fraction.x);
+
+	return mix(mix(Value00, Value10, Fraction.y), mix(Value01, Value11, Fraction.y), Fraction.z);
+}
+
+float InterpolateBufferCubic(__global const float* Volume, 
+                             float4 Position, 
+							 int DATA_W, 
+							 int DATA_H, 
+							 int DATA_D)
+{
+	float3 Coordinate = Position.xyz - 0.5f;
+	float3 Base = floor(Coordinate);
+	float3 Fraction = Coordinate - Base;
+
+	// Weights and clamped indices of the four neighbours in each direction
+	float Weights_X[4], Weights_Y[4], Weights_Z[4];
+	int Indices_X[4], Rows_Y[4], Slices_Z[4];
+	for (int i = 0; i < 4; i++)
+	{
+		float Offset = (float)(i - 1);
+		Weights_X[i] = bspline(Offset - Fraction.x);
+		Weights_Y[i] = bspline(Offset - Fraction.y);
+		Weights_Z[i] = bspline(Offset - Fraction.z);
+		Indices_X[i] = clamp((int)Base.x + i - 1, 0, DATA_W - 1);
+		Rows_Y[i] = clamp((int)Base.y + i - 1, 0, DATA_H - 1) * DATA_W;
+		Slices_Z[i] = clamp((int)Base.z + i - 1, 0, DATA_D - 1) * DATA_W * DATA_H;
+	}
+
+	float result = 0.0f;
+	for (int k = 0; k < 4; k++)
+	{
+		float Slice_Sum = 0.0f;
+		for (int j = 0; j < 4; j++)
+		{
+			__global const float* Row = &Volume[Slices_Z[k] + Rows_Y[j]];
+			float Row_Sum = Weights_X[0] * Row[Indices_X[0]] + Weights_X[1] * Row[Indices_X[1]] + Weights_X[2] * Row[Indices_X[2]] + Weights_X[3] * Row[Indices_X[3]];
+			Slice_Sum += Weights_Y[j] * Row_Sum;
+		}
+		result += Weights_Z[k] * Slice_Sum;
+	}
+
+	return result;
+}
+
+float4 CalculateLinearPosition(int x, 
+                               int y, 
+							   int z, 
+							   __constant float* c_Parameter_Vector, 
+							   int DATA_W, 
+							   int DATA_H, 
+							   int DATA_D)
+{
+	float4 Motion_Vector;
+	float xf, yf, zf;
+
+	// Change to coordinate system with origo in (sx - 1)/2 (sy - 1)/2 (sz - 1)/2
+	xf = (float)x - ((float)DATA_W - 1.0f) * 0.5f;
+	yf = (float)y - ((float)DATA_H - 1.0f) * 0.5f;
+	zf = (float)z - ((float)DATA_D - 1.0f) * 0.5f;
+
+	Motion_Vector.x = x + c_Parameter_Vector[0] + c_Parameter_Vector[3] * xf + c_Parameter_Vector[4]   * yf + c_Parameter_Vector[5]  * zf + 0.5f;
+	Motion_Vector.y = y + c_Parameter_Vector[1] + c_Parameter_Vector[6] * xf + c_Parameter_Vector[7]   * yf + c_Parameter_Vector[8]  * zf + 0.5f;
+	Motion_Vector.z = z + c_Parameter_Vector[2] + c_Parameter_Vector[9] * xf + c_Parameter_Vector[10]  * yf + c_Parameter_Vector[11] * zf + 0.5f;
+	Motion_Vector.w = 0.0f;
+
+	return Motion_Vector;
+}
+
+float4 CalculateNonLinearPosition(int x, 
+                                  int y, 
+								  int z, 
+								  __global const float* d_Displacement_Field_X, 
+								  __global const float* d_Displacement_Field_Y, 
+								  __global const float* d_Displacement_Field_Z, 
+								  int DATA_W, 
+								  int DATA_H)
+{
+	int idx3D = Calculate3DIndex(x,y,z,DATA_W,DATA_H);
+	float4 Motion_Vector;
+
+	Motion_Vector.x = (float)x + d_Displacement_Field_X[idx3D] + 0.5f;
+	Motion_Vector.y = (float)y + d_Displacement_Field_Y[idx3D] + 0.5f;
+	Motion_Vector.z = (float)z + d_Displacement_Field_Z[idx3D] + 0.5f;
+	Motion_Vector.w = 0.0f;
+
+	return Motion_Vector;
+}
+
+float4 CalculateComposedBufferPosition(int x, 
+                                       int y, 
+									   int z, 
+									   __global const float* d_Displacement_Field_X, 
+									   __global const float* d_Displacement_Field_Y, 
+									   __global const float* d_Displacement_Field_Z, 
+									   __constant float* c_Composed_Transformation, 
+									   int USE_DISPLACEMENT_FIELD, 
+									   int DATA_W, 
+									   int DATA_H)
+{
+	float xf = (float)x;
+	float yf = (float)y;
+	float zf = (float)z;
+
+	if (USE_DISPLACEMENT_FIELD == 1)
+	{
+		int idx3D = Calculate3DIndex(x,y,z,DATA_W,DATA_H);
+		xf += d_Displacement_Field_X[idx3D];
+		yf += d_Displacement_Field_Y[idx3D];
+		zf += d_Displacement_Field_Z[idx3D];
+	}
+
+	return CalculateComposedPosition(xf, yf, zf, c_Composed_Transformation);
+}
+
+__kernel void InterpolateVolumeNearestLinearBuffer(__global float* Volume,
+	                                               __global const float* Original_Volume, 
+												   __constant float* c_Parameter_Vector, 
+												   __private int DATA_W, 
+												   __private int DATA_H, 
+												   __private int DATA_D, 
+												   __private int VOLUME,
+												   __private int ORIGINAL_VOLUME)
+{
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int z = get_global_id(2);
+
+	if (x >= DATA_W || y >= DATA_H || z >= DATA_D)
+		return;
+
+	float4 Motion_Vector = CalculateLinearPosition(x, y, z, c_Parameter_Vector, DATA_W, DATA_H, DATA_D);
+	__global const float* Original = &Original_Volume[ORIGINAL_VOLUME * DATA_W * DATA_H * DATA_D];
+	Volume[Calculate4DIndex(x,y,z,VOLUME,DATA_W,DATA_H,DATA_D)] = InterpolateBufferNearest(Original, Motion_Vector, DATA_W, DATA_H, DATA_D);
+}
+
+__kernel void InterpolateVolumeLinearLinearBuffer(__global float* Volume,
+	                                              __global const float* Original_Volume, 
+												  __constant float* c_Parameter_Vector, 
+												  __private int DATA_W, 
+												  __private int DATA_H, 
+												  __private int DATA_D, 
+												  __private int VOLUME,
+												  __private int ORIGINAL_VOLUME)
+{
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int z = get_global_id(2);
+
+	if (x >= DATA_W || y >= DATA_H || z >= DATA_D)
+		return;
+
+	float4 Motion_Vector = CalculateLinearPosition(x, y, z, c_Parameter_Vector, DATA_W, DATA_H, DATA_D);
+	__global const float* Original = &Original_Volume[ORIGINAL_VOLUME * DATA_W * DATA_H * DATA_D];
+	Volume[Calculate4DIndex(x,y,z,VOLUME,DATA_W,DATA_H,DATA_D)] = InterpolateBufferLinear(Original, Motion_Vector, DATA_W, DATA_H, DATA_D);
+}
+
+__kernel void InterpolateVolumeCubicLinearBuffer(__global float* Volume,
+	                                             __global const float* Original_Volume, 
+												 __constant float* c_Parameter_Vector, 
+												 __private int DATA_W, 
+												 __private int DATA_H, 
+												 __private int DATA_D, 
+												 __private int VOLUME,
+												 __private int ORIGINAL_VOLUME)
+{
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int z = get_global_id(2);
+
+	if (x >= DATA_W || y >= DATA_H || z >= DATA_D)
+		return;
+
+	float4 Motion_Vector = CalculateLinearPosition(x, y, z, c_Parameter_Vector, DATA_W, DATA_H, DATA_D);
+	__global const float* Original = &Original_Volume[ORIGINAL_VOLUME * DATA_W * DATA_H * DATA_D];
+	Volume[Calculate4DIndex(x,y,z,VOLUME,DATA_W,DATA_H,DATA_D)] = InterpolateBufferCubic(Original, Motion_Vector, DATA_W, DATA_H, DATA_D);
+}
+
+__kernel void InterpolateVolumeNearestNonLinearBuffer(__global float* Volume,
+	                                                  __global const float* Original_Volume, 
+													  __global const float* d_Displacement_Field_X, 
+													  __global const float* d_Displacement_Field_Y, 
+													  __global const float* d_Displacement_Field_Z, 
+													  __private int DATA_W, 
+													  __private int DATA_H, 
+													  __private int DATA_D, 
+													  __private int VOLUME)
+{
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int z = get_global_id(2);
+
+	if (x >= DATA_W || y >= DATA_H || z >= DATA_D)
+		return;
+
+	float4 Motion_Vector = CalculateNonLinearPosition(x, y, z, d_Displacement_Field_X, d_Displacement_Field_Y, d_Displacement_Field_Z, DATA_W, DATA_H);
+	Volume[Calculate4DIndex(x,y,z,VOLUME,DATA_W,DATA_H,DATA_D)] = InterpolateBufferNearest(Original_Volume, Motion_Vector, DATA_W, DATA_H, DATA_D);
+}
+
+__kernel void InterpolateVolumeLinearNonLinearBuffer(__global float* Volume,
+	                                                 __global const float* Original_Volume, 
+													 __global const float* d_Displacement_Field_X, 
+													 __global const float* d_Displacement_Field_Y, 
+													 __global const float* d_Displacement_Field_Z, 
+													 __private int DATA_W, 
+													 __private int DATA_H, 
+													 __private int DATA_D, 
+													 __private int VOLUME)
+{
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int z = get_global_id(2);
+
+	if (x >= DATA_W || y >= DATA_H || z >= DATA_D)
+		return;
+
+	float4 Motion_Vector = CalculateNonLinearPosition(x, y, z, d_Displacement_Field_X, d_Displacement_Field_Y, d_Displacement_Field_Z, DATA_W, DATA_H);
+	Volume[Calculate4DIndex(x,y,z,VOLUME,DATA_W,DATA_H,DATA_D)] = InterpolateBufferLinear(Original_Volume, Motion_Vector, DATA_W, DATA_H, DATA_D);
+}
+
+__kernel void InterpolateVolumeCubicNonLinearBuffer(__global float* Volume,
+	                                                __global const float* Original_Volume, 
+													__global const float* d_Displacement_Field_X, 
+													__global const float* d_Displacement_Field_Y, 
+													__global const float* d_Displacement_Field_Z, 
+													__private int DATA_W, 
+													__private int DATA_H, 
+													__private int DATA_D, 
+													__private int VOLUME)
+{
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int z = get_global_id(2);
+
+	if (x >= DATA_W || y >= DATA_H || z >= DATA_D)
+		return;
+
+	float4 Motion_Vector = CalculateNonLinearPosition(x, y, z, d_Displacement_Field_X, d_Displacement_Field_Y, d_Displacement_Field_Z, DATA_W, DATA_H);
+	Volume[Calculate4DIndex(x,y,z,VOLUME,DATA_W,DATA_H,DATA_D)] = InterpolateBufferCubic(Original_Volume, Motion_Vector, DATA_W, DATA_H, DATA_D);
+}
+
+__kernel void InterpolateVolumeNearestComposedBuffer(__global float* Volume,
+	                                                 __global const float* Original_Volume, 
+													 __global const float* d_Displacement_Field_X, 
+													 __global const float* d_Displacement_Field_Y, 
+													 __global const float* d_Displacement_Field_Z, 
+													 __constant float* c_Composed_Transformation,
+													 __private int USE_DISPLACEMENT_FIELD,
+													 __private int DATA_W, 
+													 __private int DATA_H, 
+													 __private int DATA_D, 
+													 __private int VOLUME,
+													 __private int ORIGINAL_DATA_W, 
+													 __private int ORIGINAL_DATA_H, 
+													 __private int ORIGINAL_DATA_D, 
+													 __private int ORIGINAL_VOLUME)
+{
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int z = get_global_id(2);
+
+	if ((x >= DATA_W) || (y >= DATA_H) || (z >= DATA_D))
+		return;
+
+	int idx4D = Calculate4DIndex(x,y,z,VOLUME,DATA_W,DATA_H,DATA_D);
+
+	float4 Motion_Vector = CalculateComposedBufferPosition(x, y, z, d_Displacement_Field_X, d_Displacement_Field_Y, d_Displacement_Field_Z, c_Composed_Transformation, USE_DISPLACEMENT_FIELD, DATA_W, DATA_H);
+	if (Motion_Vector.w < 0.0f)
+	{
+		Volume[idx4D] = 0.0f;
+		return;
+	}
+
+	__global const float* Original = &Original_Volume[ORIGINAL_VOLUME * ORIGINAL_DATA_W * ORIGINAL_DATA_H * ORIGINAL_DATA_D];
+	Volume[idx4D] = InterpolateBufferNearest(Original, Motion_Vector, ORIGINAL_DATA_W, ORIGINAL_DATA_H, ORIGINAL_DATA_D);
+}
+
+__kernel void InterpolateVolumeLinearComposedBuffer(__global float* Volume,
+	                                                __global const float* Original_Volume, 
+													__global const float* d_Displacement_Field_X, 
+													__global const float* d_Displacement_Field_Y, 
+													__global const float* d_Displacement_Field_Z, 
+													__constant float* c_Composed_Transformation,
+													__private int USE_DISPLACEMENT_FIELD,
+													__private int DATA_W, 
+													__private int DATA_H, 
+													__private int DATA_D, 
+													__private int VOLUME,
+													__private int ORIGINAL_DATA_W, 
+													__private int ORIGINAL_DATA_H, 
+													__private int ORIGINAL_DATA_D, 
+													__private int ORIGINAL_VOLUME)
+{
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int z = get_global_id(2);
+
+	if ((x >= DATA_W) || (y >= DATA_H) || (z >= DATA_D))
+		return;
+
+	int idx4D = Calculate4DIndex(x,y,z,VOLUME,DATA_W,DATA_H,DATA_D);
+
+	float4 Motion_Vector = CalculateComposedBufferPosition(x, y, z, d_Displacement_Field_X, d_Displacement_Field_Y, d_Displacement_Field_Z, c_Composed_Transformation, USE_DISPLACEMENT_FIELD, DATA_W, DATA_H);
+	if (Motion_Vector.w < 0.0f)
+	{
+		Volume[idx4D] = 0.0f;
+		return;
+	}
+
+	__global const float* Original = &Original_Volume[ORIGINAL_VOLUME * ORIGINAL_DATA_W * ORIGINAL_DATA_H * ORIGINAL_DATA_D];
+	Volume[idx4D] = InterpolateBufferLinear(Original, Motion_Vector, ORIGINAL_DATA_W, ORIGINAL_DATA_H, ORIGINAL_DATA_D);
+}
+
+__kernel void InterpolateVolumeCubicComposedBuffer(__global float* Volume,
+	                                               __global const float* Original_Volume, 
+												   __global const float* d_Displacement_Field_X, 
+												   __global const float* d_Displacement_Field_Y, 
+												   __global const float* d_Displacement_Field_Z, 
+												   __constant float* c_Composed_Transformation,
+												   __private int USE_DISPLACEMENT_FIELD,
+												   __private int DATA_W, 
+												   __private int DATA_H, 
+												   __private int DATA_D, 
+												   __private int VOLUME,
+												   __private int ORIGINAL_DATA_W, 
+												   __private int ORIGINAL_DATA_H, 
+												   __private int ORIGINAL_DATA_D, 
+												   __private int ORIGINAL_VOLUME)
+{
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int z = get_global_id(2);
+
+	if ((x >= DATA_W) || (y >= DATA_H) || (z >= DATA_D))
+		return;
+
+	int idx4D = Calculate4DIndex(x,y,z,VOLUME,DATA_W,DATA_H,DATA_D);
+
+	float4 Motion_Vector = CalculateComposedBufferPosition(x, y, z, d_Displacement_Field_X, d_Displacement_Field_Y, d_Displacement_Field_Z, c_Composed_Transformation, USE_DISPLACEMENT_FIELD, DATA_W, DATA_H);
+	if (Motion_Vector.w < 0.0f)
+	{
+		Volume[idx4D] = 0.0f;
+		return;
+	}
+
+	__global const float* Original = &Original_Volume[ORIGINAL_VOLUME * ORIGINAL_DATA_W * ORIGINAL_DATA_H * ORIGINAL_DATA_D];
+	Volume[idx4D] = InterpolateBufferCubic(Original, Motion_Vector, ORIGINAL_DATA_W, ORIGINAL_DATA_H, ORIGINAL_DATA_D);
+}
+
+__kernel void RescaleVolumeNearestBuffer(__global float* Volume,
+	                                     __global const float* Original_Volume,
+										 __private float VOXEL_DIFFERENCE_X,
+										 __private float VOXEL_DIFFERENCE_Y,
+										 __private float VOXEL_DIFFERENCE_Z,
+										 __private int DATA_W,
+										 __private int DATA_H,
+										 __private int DATA_D,
+										 __private int ORIGINAL_DATA_W, 
+										 __private int ORIGINAL_DATA_H, 
+										 __private int ORIGINAL_DATA_D, 
+										 __private int ORIGINAL_VOLUME)
+{
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int z = get_global_id(2);
+
+	if (x >= DATA_W || y >= DATA_H || z >= DATA_D)
+		return;
+
+	float4 Motion_Vector;
+	Motion_Vector.x = x * VOXEL_DIFFERENCE_X + 0.5f;
+	Motion_Vector.y = y * VOXEL_DIFFERENCE_Y + 0.5f;
+	Motion_Vector.z = z * VOXEL_DIFFERENCE_Z + 0.5f;
+	Motion_Vector.w = 0.0f;
+
+	__global const float* Original = &Original_Volume[ORIGINAL_VOLUME * ORIGINAL_DATA_W * ORIGINAL_DATA_H * ORIGINAL_DATA_D];
+	Volume[Calculate3DIndex(x,y,z,DATA_W,DATA_H)] = InterpolateBufferNearest(Original, Motion_Vector, ORIGINAL_DATA_W, ORIGINAL_DATA_H, ORIGINAL_DATA_D);
+}
+
+__kernel void RescaleVolumeLinearBuffer(__global float* Volume,
+	                                    __global const float* Original_Volume,
+										__private float VOXEL_DIFFERENCE_X,
+										__private float VOXEL_DIFFERENCE_Y,
+										__private float VOXEL_DIFFERENCE_Z,
+										__private int DATA_W,
+										__private int DATA_H,
+										__private int DATA_D,
+										__private int ORIGINAL_DATA_W, 
+										__private int ORIGINAL_DATA_H, 
+										__private int ORIGINAL_DATA_D, 
+										__private int ORIGINAL_VOLUME)
+{
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int z = get_global_id(2);
+
+	if (x >= DATA_W || y >= DATA_H || z >= DATA_D)
+		return;
+
+	float4 Motion_Vector;
+	Motion_Vector.x = x * VOXEL_DIFFERENCE_X + 0.5f;
+	Motion_Vector.y = y * VOXEL_DIFFERENCE_Y + 0.5f;
+	Motion_Vector.z = z * VOXEL_DIFFERENCE_Z + 0.5f;
+	Motion_Vector.w = 0.0f;
+
+	__global const float* Original = &Original_Volume[ORIGINAL_VOLUME * ORIGINAL_DATA_W * ORIGINAL_DATA_H * ORIGINAL_DATA_D];
+	Volume[Calculate3DIndex(x,y,z,DATA_W,DATA_H)] = InterpolateBufferLinear(Original, Motion_Vector, ORIGINAL_DATA_W, ORIGINAL_DATA_H, ORIGINAL_DATA_D);
+}
+
+__kernel void RescaleVolumeCubicBuffer(__global float* Volume,
+	                                   __global const float* Original_Volume,
+									   __private float VOXEL_DIFFERENCE_X,
+									   __private float VOXEL_DIFFERENCE_Y,
+									   __private float VOXEL_DIFFERENCE_Z,
+									   __private int DATA_W,
+									   __private int DATA_H,
+									   __private int DATA_D,
+									   __private int ORIGINAL_DATA_W, 
+									   __private int ORIGINAL_DATA_H, 
+									   __private int ORIGINAL_DATA_D, 
+									   __private int ORIGINAL_VOLUME)
+{
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int z = get_global_id(2);
+
+	if (x >= DATA_W || y >= DATA_H || z >= DATA_D)
+		return;
+
+	float4 Motion_Vector;
+	Motion_Vector.x = x * VOXEL_DIFFERENCE_X + 0.5f;
+	Motion_Vector.y = y * VOXEL_DIFFERENCE_Y + 0.5f;
+	Motion_Vector.z = z * VOXEL_DIFFERENCE_Z + 0.5f;
+	Motion_Vector.w = 0.0f;
+
+	__global const float* Original = &Original_Volume[ORIGINAL_VOLUME * ORIGINAL_DATA_W * ORIGINAL_DATA_H * ORIGINAL_DATA_D];
+	Volume[Calculate3DIndex(x,y,z,DATA_W,DATA_H)] = InterpolateBufferCubic(Original, Motion_Vector, ORIGINAL_DATA_W, ORIGINAL_DATA_H, ORIGINAL_DATA_D);
+}
+
+
+// Combined slice timing and motion correction
+
+float4 CalculateMotionCorrectedPosition(int x, 
+                                        int y, 
+										int z, 
+										__global const float* Parameters, 
+										int DATA_W, 
+										int DATA_H, 
+										int DATA_D)
+{
+	float4 Motion_Vector;
+	float xf, yf, zf;
+
+	// Change to coordinate system with origo in (sx - 1)/2 (sy - 1)/2 (sz - 1)/2
+	xf = (float)x - ((float)DATA_W - 1.0f) * 0.5f;
+	yf = (float)y - ((float)DATA_H - 1.0f) * 0.5f;
+	zf = (float)z - ((float)DATA_D - 1.0f) * 0.5f;
+
+	Motion_Vector.x = x + Parameters[0] + Parameters[3] * xf + Parameters[4]   * yf + Parameters[5]  * zf + 0.5f;
+	Motion_Vector.y = y + Parameters[1] + Parameters[6] * xf + Parameters[7]   * yf + Parameters[8]  * zf + 0.5f;
+	Motion_Vector.z = z + Parameters[2] + Parameters[9] * xf + Parameters[10]  * yf + Parameters[11] * zf + 0.5f;
+	Motion_Vector.w = 0.0f;
+
+	return Motion_Vector;
+}
+
+float InterpolateCubicInTime(float p0, float p1, float p2, float p3, float delta)
+{
+	float a0,a1,a2,a3,delta2;
+
+	delta2 = delta * delta;
+	a0 = p3 - p2 - p0 + p1;
+	a1 = p0 - p1 - a0;
+	a2 = p2 - p0;
+	a3 = p1;
+
+	return(a0 * delta * delta2 + a1 * delta2 + a2 * delta + a3);
+}
+
+// Motion corrects one voxel of one volume, and finds the time shift of the slice that is sampled
+float MotionCorrectVoxel(float* Slice_Difference, 
+                         __global const float* Volumes, 
+						 __global const float* d_Motion_Parameters, 
+						 __constant float* c_Slice_Differences, 
+						 int x, 
+						 int y, 
+						 int z, 
+						 int t, 
+						 int CUBIC_INTERPOLATION, 
+						 int DATA_W, 
+						 int DATA_H, 
+						 int DATA_D)
+{
+	float4 Motion_Vector = CalculateMotionCorrectedPosition(x, y, z, &d_Motion_Parameters[t * 12], DATA_W, DATA_H, DATA_D);
+
+	*Slice_Difference = c_Slice_Differences[clamp((int)floor(Motion_Vector.z), 0, DATA_D - 1)];
+
+	__global const float* Volume = &Volumes[t * DATA_W * DATA_H * DATA_D];
+	if (CUBIC_INTERPOLATION == 1)
+	{
+		return InterpolateBufferCubic(Volume, Motion_Vector, DATA_W, DATA_H, DATA_D);
+	}
+	else
+	{
+		return InterpolateBufferLinear(Volume, Motion_Vector, DATA_W, DATA_H, DATA_D);
+	}
+}
+
+// Applies the motion correction of each volume (12 parameters per volume, estimated on the data without slice timing
+// correction) and the slice timing correction in one pass. Each volume is interpolated in space once, and the cubic
+// interpolation in time uses the motion corrected values of the closest volumes, clamped at the ends of the time series
+// in the same way as in SliceTimingCorrection. The time shift is the one of the slice that was sampled.
+__kernel void SliceTimingAndMotionCorrection(__global float* Corrected_Volumes,
+                                             __global const float* Volumes,
+											 __global const float* d_Motion_Parameters,
+											 __constant float* c_Slice_Differences,
+											 __private int CUBIC_INTERPOLATION,
+											 __private int DATA_W,
+											 __private int DATA_H,
+											 __private int DATA_D,
+											 __private int DATA_T)
+{
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int z = get_global_id(2);
+
+	if (x >= DATA_W || y >= DATA_H || z >= DATA_D)
+		return;
+
+	// Motion corrected values of the volumes t - 2 to t + 2, and time shifts of the volumes t to t + 2
+	float m0, m1, m2, m3, m4;
+	float d2, d3, d4;
+
+	m2 = MotionCorrectVoxel(&d2, Volumes, d_Motion_Parameters, c_Slice_Differences, x, y, z, 0, CUBIC_INTERPOLATION, DATA_W, DATA_H, DATA_D);
+	m3 = MotionCorrectVoxel(&d3, Volumes, d_Motion_Parameters, c_Slice_Differences, x, y, z, min(1, DATA_T - 1), CUBIC_INTERPOLATION, DATA_W, DATA_H, DATA_D);
+	m4 = MotionCorrectVoxel(&d4, Volumes, d_Motion_Parameters, c_Slice_Differences, x, y, z, min(2, DATA_T - 1), CUBIC_INTERPOLATION, DATA_W, DATA_H, DATA_D);
+	m0 = m2;
+	m1 = m2;
+
+	for (int t = 0; t < DATA_T; t++)
+	{
+		float value;
+
+		// Forward interpolation
+		if (d2 > 0.0f)
+		{
+			value = InterpolateCubicInTime(m1, m2, m3, m4, d2);
+		}
+		// Backward interpolation
+		else
+		{
+			value = InterpolateCubicInTime(m0, m1, m2, m3, 1.0f + d2);
+		}
+
+		Corrected_Volumes[Calculate4DIndex(x,y,z,t,DATA_W,DATA_H,DATA_D)] = value;
+
+		// Shift old values backwards, and motion correct one new volume
+		m0 = m1;
+		m1 = m2;
+		m2 = m3;
+		m3 = m4;
+		d2 = d3;
+		d3 = d4;
+		m4 = MotionCorrectVoxel(&d4, Volumes, d_Motion_Parameters, c_Slice_Differences, x, y, z, min(t + 3, DATA_T - 1), CUBIC_INTERPOLATION, DATA_W, DATA_H, DATA_D);
+	}
+}
+
+
 __kernel void CopyT1VolumeToMNI(__global float* MNI_T1_Volume,
 		                        __global float* Interpolated_T1_Volume,
 		                        __private int MNI_DATA_W,
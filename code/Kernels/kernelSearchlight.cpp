@@ -975,3 +975,955 @@ __kernel void CalculateStatisticalMapSearchlight___(__global float* Classifier_P
     Classifier_Performance[Calculate3DIndex(x,y,z,DATA_W,DATA_H)] = (float)classification_performance / (float)uncensoredVolumes;
 }
 
+
+
+
+// Closed form classifiers for the searchlight. The features are the same 19 voxels as for CalculateStatisticalMapSearchlight,
+// and a constant. Symmetric 20 x 20 matrices are stored as packed lower triangles, to save private memory.
+
+int CalculatePackedIndex(int i, int j)
+{
+    if (j > i)
+    {
+        int temp = i;
+        i = j;
+        j = temp;
+    }
+
+    return i * (i + 1) / 2 + j;
+}
+
+void ReadSearchlightFeatures(float* features,
+                             __global const float* Volumes,
+                             float* means,
+                             int x,
+                             int y,
+                             int z,
+                             int t,
+                             int DATA_W,
+                             int DATA_H,
+                             int DATA_D)
+{
+    features[0] = 1.0f;
+
+    // z - 1
+    features[1] = Volumes[Calculate4DIndex(x-1,y,z-1,t,DATA_W,DATA_H,DATA_D)];
+    features[2] = Volumes[Calculate4DIndex(x,y-1,z-1,t,DATA_W,DATA_H,DATA_D)];
+    features[3] = Volumes[Calculate4DIndex(x,y,z-1,t,DATA_W,DATA_H,DATA_D)];
+    features[4] = Volumes[Calculate4DIndex(x,y+1,z-1,t,DATA_W,DATA_H,DATA_D)];
+    features[5] = Volumes[Calculate4DIndex(x+1,y,z-1,t,DATA_W,DATA_H,DATA_D)];
+
+    // z
+    features[6] = Volumes[Calculate4DIndex(x-1,y-1,z,t,DATA_W,DATA_H,DATA_D)];
+    features[7] = Volumes[Calculate4DIndex(x-1,y,z,t,DATA_W,DATA_H,DATA_D)];
+    features[8] = Volumes[Calculate4DIndex(x-1,y+1,z,t,DATA_W,DATA_H,DATA_D)];
+    features[9] = Volumes[Calculate4DIndex(x,y-1,z,t,DATA_W,DATA_H,DATA_D)];
+    features[10] = Volumes[Calculate4DIndex(x,y,z,t,DATA_W,DATA_H,DATA_D)];
+    features[11] = Volumes[Calculate4DIndex(x,y+1,z,t,DATA_W,DATA_H,DATA_D)];
+    features[12] = Volumes[Calculate4DIndex(x+1,y-1,z,t,DATA_W,DATA_H,DATA_D)];
+    features[13] = Volumes[Calculate4DIndex(x+1,y,z,t,DATA_W,DATA_H,DATA_D)];
+    features[14] = Volumes[Calculate4DIndex(x+1,y+1,z,t,DATA_W,DATA_H,DATA_D)];
+
+    // z + 1
+    features[15] = Volumes[Calculate4DIndex(x-1,y,z+1,t,DATA_W,DATA_H,DATA_D)];
+    features[16] = Volumes[Calculate4DIndex(x,y-1,z+1,t,DATA_W,DATA_H,DATA_D)];
+    features[17] = Volumes[Calculate4DIndex(x,y,z+1,t,DATA_W,DATA_H,DATA_D)];
+    features[18] = Volumes[Calculate4DIndex(x,y+1,z+1,t,DATA_W,DATA_H,DATA_D)];
+    features[19] = Volumes[Calculate4DIndex(x+1,y,z+1,t,DATA_W,DATA_H,DATA_D)];
+
+    // Remove the mean of each voxel, to improve the conditioning of the matrices
+    for (int i = 1; i < 20; i++)
+    {
+        features[i] -= means[i];
+    }
+}
+
+// Cholesky factorization, in place, of the block FIRST ... N - 1 of a packed matrix. Returns 0 if the block is not positive definite
+int CholeskyPacked(float* Matrix, int FIRST, int N)
+{
+    for (int j = FIRST; j < N; j++)
+    {
+        float diagonal = Matrix[CalculatePackedIndex(j,j)];
+        for (int k = FIRST; k < j; k++)
+        {
+            diagonal -= Matrix[CalculatePackedIndex(j,k)] * Matrix[CalculatePackedIndex(j,k)];
+        }
+
+        if (diagonal <= 0.0f)
+        {
+            return 0;
+        }
+
+        diagonal = sqrt(diagonal);
+        Matrix[CalculatePackedIndex(j,j)] = diagonal;
+
+        for (int i = j + 1; i < N; i++)
+        {
+            float value = Matrix[CalculatePackedIndex(i,j)];
+            for (int k = FIRST; k < j; k++)
+            {
+                value -= Matrix[CalculatePackedIndex(i,k)] * Matrix[CalculatePackedIndex(j,k)];
+            }
+            Matrix[CalculatePackedIndex(i,j)] = value / diagonal;
+        }
+    }
+
+    return 1;
+}
+
+// Solves L L' x = b, in place, for the factor from CholeskyPacked
+void CholeskySolvePacked(float* Vector, float* Matrix, int FIRST, int N)
+{
+    // Forward substitution
+    for (int i = FIRST; i < N; i++)
+    {
+        float value = Vector[i];
+        for (int k = FIRST; k < i; k++)
+        {
+            value -= Matrix[CalculatePackedIndex(i,k)] * Vector[k];
+        }
+        Vector[i] = value / Matrix[CalculatePackedIndex(i,i)];
+    }
+
+    // Backward substitution
+    for (int i = N - 1; i >= FIRST; i--)
+    {
+        float value = Vector[i];
+        for (int k = i + 1; k < N; k++)
+        {
+            value -= Matrix[CalculatePackedIndex(k,i)] * Vector[k];
+        }
+        Vector[i] = value / Matrix[CalculatePackedIndex(i,i)];
+    }
+}
+
+void MultiplySymmetricPacked(float* Result, float* Matrix, float* Vector, int N)
+{
+    for (int i = 0; i < N; i++)
+    {
+        float sum = 0.0f;
+        for (int j = 0; j < N; j++)
+        {
+            sum += Matrix[CalculatePackedIndex(i,j)] * Vector[j];
+        }
+        Result[i] = sum;
+    }
+}
+
+// Adds (or subtracts, for a negative scale) scale * a * a' to a packed matrix
+void AddOuterProductPacked(float* Matrix, float* a, float scale, int N)
+{
+    for (int i = 0; i < N; i++)
+    {
+        int row = i * (i + 1) / 2;
+        float value = scale * a[i];
+        for (int j = 0; j <= i; j++)
+        {
+            Matrix[row + j] += value * a[j];
+        }
+    }
+}
+
+// Mean of each voxel over all uncensored volumes, zeros has to contain 20 zeros
+void CalculateSearchlightMeans(float* means,
+                               float* features,
+                               float* zeros,
+                               __global const float* Volumes,
+                               __constant int* c_Volume_Indices,
+                               int x,
+                               int y,
+                               int z,
+                               int DATA_W,
+                               int DATA_H,
+                               int DATA_D,
+                               int NUMBER_OF_UNCENSORED_VOLUMES)
+{
+    for (int i = 0; i < 20; i++)
+    {
+        means[i] = 0.0f;
+    }
+
+    for (int v = 0; v < NUMBER_OF_UNCENSORED_VOLUMES; v++)
+    {
+        ReadSearchlightFeatures(features, Volumes, zeros, x, y, z, c_Volume_Indices[v], DATA_W, DATA_H, DATA_D);
+        for (int i = 1; i < 20; i++)
+        {
+            means[i] += features[i];
+        }
+    }
+
+    for (int i = 1; i < 20; i++)
+    {
+        means[i] /= (float)NUMBER_OF_UNCENSORED_VOLUMES;
+    }
+}
+
+// Regularizes the second moments in Matrix for ridge regression and replaces them with their inverse, Temp has room for
+// a packed matrix and Column for 20 values. Returns 0 if the moments are not positive definite.
+int InvertRidgeMoments(float* Matrix, float* Temp, float* Column, float REGULARIZATION)
+{
+    // Regularization relative to the mean energy of the voxels, the constant is not regularized
+    float energy = 0.0f;
+    for (int i = 1; i < 20; i++)
+    {
+        energy += Matrix[CalculatePackedIndex(i,i)];
+    }
+    energy /= 19.0f;
+
+    for (int i = 1; i < 20; i++)
+    {
+        Matrix[CalculatePackedIndex(i,i)] += REGULARIZATION * energy + 1e-6f;
+    }
+
+    if (!CholeskyPacked(Matrix, 0, 20))
+    {
+        return 0;
+    }
+
+    // Invert one column at a time
+    for (int column = 0; column < 20; column++)
+    {
+        for (int i = 0; i < 20; i++)
+        {
+            Column[i] = 0.0f;
+        }
+        Column[column] = 1.0f;
+
+        CholeskySolvePacked(Column, Matrix, 0, 20);
+
+        for (int i = column; i < 20; i++)
+        {
+            Temp[CalculatePackedIndex(i,column)] = Column[i];
+        }
+    }
+
+    for (int i = 0; i < 210; i++)
+    {
+        Matrix[i] = Temp[i];
+    }
+
+    return 1;
+}
+
+// Searchlight with closed form classifiers and k-fold cross validation, CLASSIFIER 1 is ridge regression and 2 is shrinkage LDA.
+// The moments of all uncensored volumes are calculated once, each fold then removes its own volumes from them (rank-one downdates),
+// instead of training from scratch. Fold f contains the uncensored volumes c_Fold_Starts[f] ... c_Fold_Starts[f + 1] - 1, the host
+// orders the volumes such that each fold has the same proportion of the two classes.
+__kernel void CalculateStatisticalMapSearchlightClosedForm(__global float* Classifier_Performance,
+                                                           __global const float* Volumes,
+                                                           __global const float* Mask,
+                                                           __constant float* c_d,
+                                                           __constant float* c_Correct_Classes,
+                                                           __constant int* c_Volume_Indices,
+                                                           __constant int* c_Fold_Starts,
+                                                           __private int DATA_W,
+                                                           __private int DATA_H,
+                                                           __private int DATA_D,
+                                                           __private int NUMBER_OF_UNCENSORED_VOLUMES,
+                                                           __private int NUMBER_OF_FOLDS,
+                                                           __private int CLASSIFIER,
+                                                           __private float REGULARIZATION)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int z = get_global_id(2);
+
+    if (x >= DATA_W || y >= DATA_H || z >= DATA_D)
+        return;
+
+    if ( Mask[Calculate3DIndex(x,y,z,DATA_W,DATA_H)] != 1.0f )
+    {
+        Classifier_Performance[Calculate3DIndex(x,y,z,DATA_W,DATA_H)] = 0.0f;
+        return;
+    }
+
+    if ( ((x + 1) >= DATA_W) || ((y + 1) >= DATA_H) || ((z + 1) >= DATA_D) || ((x - 1) < 0) || ((y - 1) < 0) || ((z - 1) < 0) || (NUMBER_OF_UNCENSORED_VOLUMES < 2) )
+    {
+        Classifier_Performance[Calculate3DIndex(x,y,z,DATA_W,DATA_H)] = 0.0f;
+        return;
+    }
+
+    float features[20];
+    float means[20];
+    float b[20];
+    float fold_b[20];
+    float weights[20];
+    float Matrix[210];
+    float Fold_Matrix[210];
+
+    for (int i = 0; i < 20; i++)
+    {
+        b[i] = 0.0f;
+    }
+
+    // b is zero, so the original voxel values are read
+    CalculateSearchlightMeans(means, features, b, Volumes, c_Volume_Indices, x, y, z, DATA_W, DATA_H, DATA_D, NUMBER_OF_UNCENSORED_VOLUMES);
+
+    // Second moments, and correlation with the desired output (1 for class 0, -1 for class 1)
+    for (int i = 0; i < 210; i++)
+    {
+        Matrix[i] = 0.0f;
+    }
+
+    for (int v = 0; v < NUMBER_OF_UNCENSORED_VOLUMES; v++)
+    {
+        int t = c_Volume_Indices[v];
+        ReadSearchlightFeatures(features, Volumes, means, x, y, z, t, DATA_W, DATA_H, DATA_D);
+        AddOuterProductPacked(Matrix, features, 1.0f, 20);
+        for (int i = 0; i < 20; i++)
+        {
+            b[i] += c_d[t] * features[i];
+        }
+    }
+
+    int classification_performance = 0;
+
+    // Ridge regression, the inverse of the regularized second moments is shared by all folds
+    if (CLASSIFIER == 1)
+    {
+        if (!InvertRidgeMoments(Matrix, Fold_Matrix, weights, REGULARIZATION))
+        {
+            Classifier_Performance[Calculate3DIndex(x,y,z,DATA_W,DATA_H)] = 0.0f;
+            return;
+        }
+
+        for (int fold = 0; fold < NUMBER_OF_FOLDS; fold++)
+        {
+            int first = c_Fold_Starts[fold];
+            int last = c_Fold_Starts[fold + 1];
+
+            for (int i = 0; i < 210; i++)
+            {
+                Fold_Matrix[i] = Matrix[i];
+            }
+            for (int i = 0; i < 20; i++)
+            {
+                fold_b[i] = b[i];
+            }
+
+            // Remove the validation volumes from the inverse, one Sherman-Morrison downdate per volume
+            for (int v = first; v < last; v++)
+            {
+                int t = c_Volume_Indices[v];
+                ReadSearchlightFeatures(features, Volumes, means, x, y, z, t, DATA_W, DATA_H, DATA_D);
+                MultiplySymmetricPacked(weights, Fold_Matrix, features, 20);
+
+                float h = 0.0f;
+                for (int i = 0; i < 20; i++)
+                {
+                    h += features[i] * weights[i];
+                }
+
+                // A volume that can not be removed from the inverse stays in the training data, for the moments and for b
+                if ((1.0f - h) > 1e-6f)
+                {
+                    AddOuterProductPacked(Fold_Matrix, weights, 1.0f / (1.0f - h), 20);
+                    for (int i = 0; i < 20; i++)
+                    {
+                        fold_b[i] -= c_d[t] * features[i];
+                    }
+                }
+            }
+
+            MultiplySymmetricPacked(weights, Fold_Matrix, fold_b, 20);
+
+            // Classify the validation volumes
+            for (int v = first; v < last; v++)
+            {
+                int t = c_Volume_Indices[v];
+                ReadSearchlightFeatures(features, Volumes, means, x, y, z, t, DATA_W, DATA_H, DATA_D);
+
+                float s = 0.0f;
+                for (int i = 0; i < 20; i++)
+                {
+                    s += weights[i] * features[i];
+                }
+
+                float classification = (s > 0.0f) ? 0.0f : 1.0f;
+                if (classification == c_Correct_Classes[t])
+                {
+                    classification_performance++;
+                }
+            }
+        }
+    }
+    // Shrinkage LDA, the class means and the pooled covariance of each fold are obtained from the downdated moments
+    else
+    {
+        for (int fold = 0; fold < NUMBER_OF_FOLDS; fold++)
+        {
+            int first = c_Fold_Starts[fold];
+            int last = c_Fold_Starts[fold + 1];
+
+            for (int i = 0; i < 210; i++)
+            {
+                Fold_Matrix[i] = Matrix[i];
+            }
+            for (int i = 0; i < 20; i++)
+            {
+                fold_b[i] = b[i];
+            }
+
+            for (int v = first; v < last; v++)
+            {
+                int t = c_Volume_Indices[v];
+                ReadSearchlightFeatures(features, Volumes, means, x, y, z, t, DATA_W, DATA_H, DATA_D);
+                AddOuterProductPacked(Fold_Matrix, features, -1.0f, 20);
+                for (int i = 0; i < 20; i++)
+                {
+                    fold_b[i] -= c_d[t] * features[i];
+                }
+            }
+
+            // Number of training volumes in each class, the sums of the two classes are (moment + b) / 2 and (moment - b) / 2
+            float n = Fold_Matrix[0];
+            float n0 = 0.5f * (n + fold_b[0]);
+            float n1 = 0.5f * (n - fold_b[0]);
+
+            if ( (n0 < 0.5f) || (n1 < 0.5f) || (n < 2.5f) )
+            {
+                continue;
+            }
+
+            // Class means, stored in features (class 0) and weights (class 1)
+            for (int i = 1; i < 20; i++)
+            {
+                float sum = Fold_Matrix[CalculatePackedIndex(i,0)];
+                features[i] = 0.5f * (sum + fold_b[i]) / n0;
+                weights[i] = 0.5f * (sum - fold_b[i]) / n1;
+            }
+
+            // Pooled within class covariance
+            float trace = 0.0f;
+            for (int i = 1; i < 20; i++)
+            {
+                for (int j = 1; j <= i; j++)
+                {
+                    Fold_Matrix[CalculatePackedIndex(i,j)] = (Fold_Matrix[CalculatePackedIndex(i,j)] - n0 * features[i] * features[j] - n1 * weights[i] * weights[j]) / (n - 2.0f);
+                }
+                trace += Fold_Matrix[CalculatePackedIndex(i,i)];
+            }
+
+            // Shrink towards a scaled identity matrix
+            for (int i = 1; i < 20; i++)
+            {
+                for (int j = 1; j <= i; j++)
+                {
+                    Fold_Matrix[CalculatePackedIndex(i,j)] *= (1.0f - REGULARIZATION);
+                }
+                Fold_Matrix[CalculatePackedIndex(i,i)] += REGULARIZATION * trace / 19.0f + 1e-6f;
+            }
+
+            if (!CholeskyPacked(Fold_Matrix, 1, 20))
+            {
+                continue;
+            }
+
+            // Discriminant direction, the threshold is halfway between the class means
+            for (int i = 1; i < 20; i++)
+            {
+                fold_b[i] = features[i] - weights[i];
+            }
+            CholeskySolvePacked(fold_b, Fold_Matrix, 1, 20);
+
+            fold_b[0] = 0.0f;
+            for (int i = 1; i < 20; i++)
+            {
+                fold_b[0] -= fold_b[i] * 0.5f * (features[i] + weights[i]);
+            }
+
+            // Classify the validation volumes
+            for (int v = first; v < last; v++)
+            {
+                int t = c_Volume_Indices[v];
+                ReadSearchlightFeatures(features, Volumes, means, x, y, z, t, DATA_W, DATA_H, DATA_D);
+
+                float s = 0.0f;
+                for (int i = 0; i < 20; i++)
+                {
+                    s += fold_b[i] * features[i];
+                }
+
+                float classification = (s > 0.0f) ? 0.0f : 1.0f;
+                if (classification == c_Correct_Classes[t])
+                {
+                    classification_performance++;
+                }
+            }
+        }
+    }
+
+    Classifier_Performance[Calculate3DIndex(x,y,z,DATA_W,DATA_H)] = (float)classification_performance / (float)NUMBER_OF_UNCENSORED_VOLUMES;
+}
+
+
+
+
+// Label permutations for the ridge regression searchlight. The inverse of the second moments only depends on the voxel values and is
+// calculated once per voxel for all permutations, only the correlation with the desired output (b) and the classification of the
+// validation volumes depend on the labels. The permutations are evaluated in batches of SEARCHLIGHT_PERMUTATIONS_PER_BATCH, the data
+// of each volume is then read once for the whole batch. Permuted_Volume_Indices contains, for each permutation, the volume whose label
+// is given to each uncensored volume. The maximum number of correct classifications in the mask is stored for each permutation.
+
+#define SEARCHLIGHT_PERMUTATIONS_PER_BATCH 8
+
+__kernel void CalculateStatisticalMapsSearchlightRidgePermutation(__global int* Max_Correct_Classifications,
+                                                                  __global const float* Volumes,
+                                                                  __global const float* Mask,
+                                                                  __constant float* c_d,
+                                                                  __constant float* c_Correct_Classes,
+                                                                  __constant int* c_Volume_Indices,
+                                                                  __constant int* c_Fold_Starts,
+                                                                  __global const int* Permuted_Volume_Indices,
+                                                                  __private int DATA_W,
+                                                                  __private int DATA_H,
+                                                                  __private int DATA_D,
+                                                                  __private int NUMBER_OF_UNCENSORED_VOLUMES,
+                                                                  __private int NUMBER_OF_FOLDS,
+                                                                  __private float REGULARIZATION,
+                                                                  __private int NUMBER_OF_PERMUTATIONS)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int z = get_global_id(2);
+
+    if (x >= DATA_W || y >= DATA_H || z >= DATA_D)
+        return;
+
+    // Voxels that are not classified have zero correct classifications, the host sets the maximum to zero
+    if ( (Mask[Calculate3DIndex(x,y,z,DATA_W,DATA_H)] != 1.0f) || ((x + 1) >= DATA_W) || ((y + 1) >= DATA_H) || ((z + 1) >= DATA_D) || ((x - 1) < 0) || ((y - 1) < 0) || ((z - 1) < 0) || (NUMBER_OF_UNCENSORED_VOLUMES < 2) )
+    {
+        return;
+    }
+
+    float features[20];
+    float means[20];
+    float weights[20];
+    float Matrix[210];
+    float Fold_Matrix[210];
+    float b[SEARCHLIGHT_PERMUTATIONS_PER_BATCH * 20];
+    float fold_b[SEARCHLIGHT_PERMUTATIONS_PER_BATCH * 20];
+    int classification_performance[SEARCHLIGHT_PERMUTATIONS_PER_BATCH];
+
+    for (int i = 0; i < (SEARCHLIGHT_PERMUTATIONS_PER_BATCH * 20); i++)
+    {
+        b[i] = 0.0f;
+    }
+
+    // b is zero, so the original voxel values are read
+    CalculateSearchlightMeans(means, features, b, Volumes, c_Volume_Indices, x, y, z, DATA_W, DATA_H, DATA_D, NUMBER_OF_UNCENSORED_VOLUMES);
+
+    // Second moments, the same for all permutations
+    for (int i = 0; i < 210; i++)
+    {
+        Matrix[i] = 0.0f;
+    }
+
+    for (int v = 0; v < NUMBER_OF_UNCENSORED_VOLUMES; v++)
+    {
+        ReadSearchlightFeatures(features, Volumes, means, x, y, z, c_Volume_Indices[v], DATA_W, DATA_H, DATA_D);
+        AddOuterProductPacked(Matrix, features, 1.0f, 20);
+    }
+
+    if (!InvertRidgeMoments(Matrix, Fold_Matrix, weights, REGULARIZATION))
+    {
+        return;
+    }
+
+    for (int first_permutation = 0; first_permutation < NUMBER_OF_PERMUTATIONS; first_permutation += SEARCHLIGHT_PERMUTATIONS_PER_BATCH)
+    {
+        int permutations = min(SEARCHLIGHT_PERMUTATIONS_PER_BATCH, NUMBER_OF_PERMUTATIONS - first_permutation);
+        __global const int* Batch_Volume_Indices = &Permuted_Volume_Indices[first_permutation * NUMBER_OF_UNCENSORED_VOLUMES];
+
+        // Correlation with the permuted desired outputs
+        for (int i = 0; i < (permutations * 20); i++)
+        {
+            b[i] = 0.0f;
+        }
+
+        for (int p = 0; p < permutations; p++)
+        {
+            classification_performance[p] = 0;
+        }
+
+        for (int v = 0; v < NUMBER_OF_UNCENSORED_VOLUMES; v++)
+        {
+            ReadSearchlightFeatures(features, Volumes, means, x, y, z, c_Volume_Indices[v], DATA_W, DATA_H, DATA_D);
+            for (int p = 0; p < permutations; p++)
+            {
+                float d = c_d[Batch_Volume_Indices[v + p * NUMBER_OF_UNCENSORED_VOLUMES]];
+                for (int i = 0; i < 20; i++)
+                {
+                    b[i + p * 20] += d * features[i];
+                }
+            }
+        }
+
+        for (int fold = 0; fold < NUMBER_OF_FOLDS; fold++)
+        {
+            int first = c_Fold_Starts[fold];
+            int last = c_Fold_Starts[fold + 1];
+
+            for (int i = 0; i < 210; i++)
+            {
+                Fold_Matrix[i] = Matrix[i];
+            }
+            for (int i = 0; i < (permutations * 20); i++)
+            {
+                fold_b[i] = b[i];
+            }
+
+            // Remove the validation volumes from the inverse, once for all permutations in the batch
+            for (int v = first; v < last; v++)
+            {
+                ReadSearchlightFeatures(features, Volumes, means, x, y, z, c_Volume_Indices[v], DATA_W, DATA_H, DATA_D);
+                MultiplySymmetricPacked(weights, Fold_Matrix, features, 20);
+
+                float h = 0.0f;
+                for (int i = 0; i < 20; i++)
+                {
+                    h += features[i] * weights[i];
+                }
+
+                // A volume that can not be removed from the inverse stays in the training data, for the moments and for b
+                if ((1.0f - h) > 1e-6f)
+                {
+                    AddOuterProductPacked(Fold_Matrix, weights, 1.0f / (1.0f - h), 20);
+                    for (int p = 0; p < permutations; p++)
+                    {
+                        float d = c_d[Batch_Volume_Indices[v + p * NUMBER_OF_UNCENSORED_VOLUMES]];
+                        for (int i = 0; i < 20; i++)
+                        {
+                            fold_b[i + p * 20] -= d * features[i];
+                        }
+                    }
+                }
+            }
+
+            // Weights of each permutation, stored in fold_b
+            for (int p = 0; p < permutations; p++)
+            {
+                MultiplySymmetricPacked(weights, Fold_Matrix, &fold_b[p * 20], 20);
+                for (int i = 0; i < 20; i++)
+                {
+                    fold_b[i + p * 20] = weights[i];
+                }
+            }
+
+            // Classify the validation volumes
+            for (int v = first; v < last; v++)
+            {
+                ReadSearchlightFeatures(features, Volumes, means, x, y, z, c_Volume_Indices[v], DATA_W, DATA_H, DATA_D);
+
+                for (int p = 0; p < permutations; p++)
+                {
+                    float s = 0.0f;
+                    for (int i = 0; i < 20; i++)
+                    {
+                        s += fold_b[i + p * 20] * features[i];
+                    }
+
+                    float classification = (s > 0.0f) ? 0.0f : 1.0f;
+                    if (classification == c_Correct_Classes[Batch_Volume_Indices[v + p * NUMBER_OF_UNCENSORED_VOLUMES]])
+                    {
+                        classification_performance[p]++;
+                    }
+                }
+            }
+        }
+
+        for (int p = 0; p < permutations; p++)
+        {
+            atomic_max(&Max_Correct_Classifications[first_permutation + p], classification_performance[p]);
+        }
+    }
+}
+
+
+
+
+// Searchlight for spheres of any size, one work group per sphere. The host gives the offsets (x, y, z) of all voxels in the sphere,
+// and the voxels of each sphere that are inside the volume and the mask are first gathered into a compact list in local memory.
+// The values of these voxels for all uncensored volumes are then copied once to a compact feature matrix in global memory (one
+// per work group), which is read with consecutive addresses by the threads for the training and the classification of each fold.
+
+#define SEARCHLIGHT_SPHERE_LOCAL_SIZE 64
+#define SEARCHLIGHT_MAX_SPHERE_VOXELS 1024
+#define SEARCHLIGHT_FEATURES_PER_THREAD 16
+
+// Sum of one value from each thread in the work group, all threads get the sum
+float SumSearchlightWorkGroup(__local float* Partial_Sums,
+                              float value,
+                              int lid)
+{
+    Partial_Sums[lid] = value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int s = SEARCHLIGHT_SPHERE_LOCAL_SIZE / 2; s > 0; s >>= 1)
+    {
+        if (lid < s)
+        {
+            Partial_Sums[lid] += Partial_Sums[lid + s];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    float sum = Partial_Sums[0];
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    return sum;
+}
+
+// Diagonal LDA (pooled variance of each voxel, shrunk towards the mean variance) with k-fold cross validation, folds as for
+// CalculateStatisticalMapSearchlightClosedForm. Each thread handles the voxels lid, lid + SEARCHLIGHT_SPHERE_LOCAL_SIZE, ... of the sphere,
+// and only reads the columns of the feature matrix that it has written itself. Each run handles the voxels FIRST_VOXEL, FIRST_VOXEL + 1, ...
+// in Voxel_Indices, Sphere_Features has room for NUMBER_OF_SPHERE_VOXELS x NUMBER_OF_UNCENSORED_VOLUMES values per work group.
+__kernel void CalculateStatisticalMapSearchlightSphere(__global float* Classifier_Performance,
+                                                       __global float* Sphere_Features,
+                                                       __global const float* Volumes,
+                                                       __global const float* Mask,
+                                                       __global const int* Voxel_Indices,
+                                                       __constant int* c_Sphere_Offsets,
+                                                       __constant float* c_Correct_Classes,
+                                                       __constant int* c_Volume_Indices,
+                                                       __constant int* c_Fold_Starts,
+                                                       __private int DATA_W,
+                                                       __private int DATA_H,
+                                                       __private int DATA_D,
+                                                       __private int NUMBER_OF_SPHERE_VOXELS,
+                                                       __private int NUMBER_OF_UNCENSORED_VOLUMES,
+                                                       __private int NUMBER_OF_FOLDS,
+                                                       __private float REGULARIZATION,
+                                                       __private int FIRST_VOXEL)
+{
+    int lid = get_local_id(0);
+
+    int center = Voxel_Indices[FIRST_VOXEL + get_group_id(0)];
+    int z = center / (DATA_W * DATA_H);
+    int y = (center - z * DATA_W * DATA_H) / DATA_W;
+    int x = center - z * DATA_W * DATA_H - y * DATA_W;
+
+    int VOLUME_SIZE = DATA_W * DATA_H * DATA_D;
+
+    __local int Sphere_Indices[SEARCHLIGHT_MAX_SPHERE_VOXELS];
+    __local int Thread_Counts[SEARCHLIGHT_SPHERE_LOCAL_SIZE];
+    __local float Partial_Sums[SEARCHLIGHT_SPHERE_LOCAL_SIZE];
+
+    // Each thread checks a block of consecutive offsets, such that the order of the compact list is always the same
+    int block = (NUMBER_OF_SPHERE_VOXELS + SEARCHLIGHT_SPHERE_LOCAL_SIZE - 1) / SEARCHLIGHT_SPHERE_LOCAL_SIZE;
+    int firstOffset = min(lid * block, NUMBER_OF_SPHERE_VOXELS);
+    int lastOffset = min(firstOffset + block, NUMBER_OF_SPHERE_VOXELS);
+
+    int count = 0;
+    for (int o = firstOffset; o < lastOffset; o++)
+    {
+        int xx = x + c_Sphere_Offsets[3 * o + 0];
+        int yy = y + c_Sphere_Offsets[3 * o + 1];
+        int zz = z + c_Sphere_Offsets[3 * o + 2];
+
+        if ( (xx >= 0) && (yy >= 0) && (zz >= 0) && (xx < DATA_W) && (yy < DATA_H) && (zz < DATA_D) && (Mask[Calculate3DIndex(xx,yy,zz,DATA_W,DATA_H)] == 1.0f) )
+        {
+            count++;
+        }
+    }
+
+    Thread_Counts[lid] = count;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int position = 0;
+    int features = 0;
+    for (int i = 0; i < SEARCHLIGHT_SPHERE_LOCAL_SIZE; i++)
+    {
+        if (i < lid)
+        {
+            position += Thread_Counts[i];
+        }
+        features += Thread_Counts[i];
+    }
+
+    for (int o = firstOffset; o < lastOffset; o++)
+    {
+        int xx = x + c_Sphere_Offsets[3 * o + 0];
+        int yy = y + c_Sphere_Offsets[3 * o + 1];
+        int zz = z + c_Sphere_Offsets[3 * o + 2];
+
+        if ( (xx >= 0) && (yy >= 0) && (zz >= 0) && (xx < DATA_W) && (yy < DATA_H) && (zz < DATA_D) && (Mask[Calculate3DIndex(xx,yy,zz,DATA_W,DATA_H)] == 1.0f) )
+        {
+            Sphere_Indices[position] = Calculate3DIndex(xx,yy,zz,DATA_W,DATA_H);
+            position++;
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Number of uncensored volumes in each class
+    int N0 = 0;
+    int N1 = 0;
+    for (int v = 0; v < NUMBER_OF_UNCENSORED_VOLUMES; v++)
+    {
+        if (c_Correct_Classes[c_Volume_Indices[v]] == 0.0f)
+        {
+            N0++;
+        }
+        else
+        {
+            N1++;
+        }
+    }
+
+    // Feature matrix of this sphere, the value of sphere voxel j in uncensored volume v is stored at v * features + j
+    __global float* Features = &Sphere_Features[get_group_id(0) * NUMBER_OF_SPHERE_VOXELS * NUMBER_OF_UNCENSORED_VOLUMES];
+
+    // Sums over all uncensored volumes, the values are shifted by the first volume to avoid cancellation in the sum of squares
+    float shift[SEARCHLIGHT_FEATURES_PER_THREAD];
+    float sum0[SEARCHLIGHT_FEATURES_PER_THREAD];
+    float sum1[SEARCHLIGHT_FEATURES_PER_THREAD];
+    float sumSquares[SEARCHLIGHT_FEATURES_PER_THREAD];
+    float weights[SEARCHLIGHT_FEATURES_PER_THREAD];
+    float mid[SEARCHLIGHT_FEATURES_PER_THREAD];
+    float variances[SEARCHLIGHT_FEATURES_PER_THREAD];
+
+    for (int k = 0; k < SEARCHLIGHT_FEATURES_PER_THREAD; k++)
+    {
+        int j = lid + k * SEARCHLIGHT_SPHERE_LOCAL_SIZE;
+
+        shift[k] = 0.0f;
+        sum0[k] = 0.0f;
+        sum1[k] = 0.0f;
+        sumSquares[k] = 0.0f;
+
+        if (j >= features)
+        {
+            continue;
+        }
+
+        int index = Sphere_Indices[j];
+        shift[k] = Volumes[index + c_Volume_Indices[0] * VOLUME_SIZE];
+
+        for (int v = 0; v < NUMBER_OF_UNCENSORED_VOLUMES; v++)
+        {
+            int t = c_Volume_Indices[v];
+            float value = Volumes[index + t * VOLUME_SIZE] - shift[k];
+            Features[v * features + j] = value;
+
+            if (c_Correct_Classes[t] == 0.0f)
+            {
+                sum0[k] += value;
+            }
+            else
+            {
+                sum1[k] += value;
+            }
+            sumSquares[k] += value * value;
+        }
+    }
+
+    int classification_performance = 0;
+
+    for (int fold = 0; fold < NUMBER_OF_FOLDS; fold++)
+    {
+        int first = c_Fold_Starts[fold];
+        int last = c_Fold_Starts[fold + 1];
+
+        int n0 = N0;
+        int n1 = N1;
+        for (int v = first; v < last; v++)
+        {
+            if (c_Correct_Classes[c_Volume_Indices[v]] == 0.0f)
+            {
+                n0--;
+            }
+            else
+            {
+                n1--;
+            }
+        }
+
+        // Same for all threads, so the barriers below are reached by the whole work group
+        if ( (n0 < 1) || (n1 < 1) || ((n0 + n1) < 3) || (features == 0) )
+        {
+            continue;
+        }
+
+        // Remove the validation volumes from the sums
+        float variance = 0.0f;
+        for (int k = 0; k < SEARCHLIGHT_FEATURES_PER_THREAD; k++)
+        {
+            int j = lid + k * SEARCHLIGHT_SPHERE_LOCAL_SIZE;
+
+            weights[k] = 0.0f;
+            mid[k] = 0.0f;
+            variances[k] = 0.0f;
+
+            if (j >= features)
+            {
+                continue;
+            }
+
+            float foldSum0 = sum0[k];
+            float foldSum1 = sum1[k];
+            float foldSumSquares = sumSquares[k];
+
+            for (int v = first; v < last; v++)
+            {
+                float value = Features[v * features + j];
+
+                if (c_Correct_Classes[c_Volume_Indices[v]] == 0.0f)
+                {
+                    foldSum0 -= value;
+                }
+                else
+                {
+                    foldSum1 -= value;
+                }
+                foldSumSquares -= value * value;
+            }
+
+            float mean0 = foldSum0 / (float)n0;
+            float mean1 = foldSum1 / (float)n1;
+
+            weights[k] = mean0 - mean1;
+            mid[k] = 0.5f * (mean0 + mean1);
+            variances[k] = max(foldSumSquares - (float)n0 * mean0 * mean0 - (float)n1 * mean1 * mean1, 0.0f) / (float)(n0 + n1 - 2);
+            variance += variances[k];
+        }
+
+        // Shrink the variances towards the mean variance of the sphere
+        float meanVariance = SumSearchlightWorkGroup(Partial_Sums, variance, lid) / (float)features;
+
+        for (int k = 0; k < SEARCHLIGHT_FEATURES_PER_THREAD; k++)
+        {
+            float shrunkVariance = (1.0f - REGULARIZATION) * variances[k] + REGULARIZATION * meanVariance;
+            weights[k] = (shrunkVariance > 0.0f) ? weights[k] / shrunkVariance : 0.0f;
+        }
+
+        // Classify the validation volumes
+        for (int v = first; v < last; v++)
+        {
+            int t = c_Volume_Indices[v];
+
+            float s = 0.0f;
+            for (int k = 0; k < SEARCHLIGHT_FEATURES_PER_THREAD; k++)
+            {
+                int j = lid + k * SEARCHLIGHT_SPHERE_LOCAL_SIZE;
+                if (j < features)
+                {
+                    s += weights[k] * (Features[v * features + j] - mid[k]);
+                }
+            }
+
+            s = SumSearchlightWorkGroup(Partial_Sums, s, lid);
+
+            float classification = (s > 0.0f) ? 0.0f : 1.0f;
+            if (classification == c_Correct_Classes[t])
+            {
+                classification_performance++;
+            }
+        }
+    }
+
+    if (lid == 0)
+    {
+        Classifier_Performance[center] = (float)classification_performance / (float)NUMBER_OF_UNCENSORED_VOLUMES;
+    }
+}
+